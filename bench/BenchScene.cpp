@@ -0,0 +1,62 @@
+#include "BenchScene.h"
+#include "../samples/mfov/reader/MultiFovReader.h"
+#include "util/PixelSelector.h"
+#include "util/defs.h"
+#include "util/util.h"
+#include <cmath>
+
+namespace fishdso {
+
+BenchScene syntheticScene(const SyntheticSequenceSettings &settings) {
+  SyntheticSequence sequence(settings);
+  BenchScene scene;
+  scene.name = "synthetic";
+  scene.cam = std::unique_ptr<CameraModel>(new CameraModel(*sequence.cam()));
+  scene.baseToRef =
+      SE3(SO3::exp(Vec3(0.02, -0.03, 0.01)), Vec3(0.15, -0.05, 0.1));
+  sequence.render(SE3(), 1, &scene.frames[0], &scene.baseDepths);
+  sequence.render(scene.baseToRef, 1, &scene.frames[1], nullptr);
+  return scene;
+}
+
+BenchScene mfovScene(const std::string &datasetDir, int baseFrameNum,
+                     int frameStep) {
+  MultiFovReader reader(datasetDir);
+  int refFrameNum = baseFrameNum + frameStep;
+
+  BenchScene scene;
+  scene.name = "mfov";
+  scene.cam = std::unique_ptr<CameraModel>(new CameraModel(*reader.cam));
+  scene.frames[0] = reader.getFrameGray(baseFrameNum);
+  scene.frames[1] = reader.getFrameGray(refFrameNum);
+  scene.baseDepths = reader.getDepths(baseFrameNum);
+  // the dataset marks the sky with huge depths
+  for (double &depth : scene.baseDepths)
+    if (depth > 1e10)
+      depth = INF;
+  scene.baseToRef = reader.getWorldToFrameGT(refFrameNum) *
+                    reader.getWorldToFrameGT(baseFrameNum).inverse();
+  return scene;
+}
+
+void selectDepthedPoints(const BenchScene &scene, StdVector<Vec2> &points,
+                         std::vector<double> &depths) {
+  cv::Mat1f gradX, gradY, gradNorm;
+  grad(scene.frames[0], gradX, gradY, gradNorm);
+  PixelSelector pixelSelector;
+  std::vector<cv::Point> selected = pixelSelector.select(
+      scene.frames[0], gradNorm, Settings::KeyFrame::default_pointsNum,
+      nullptr);
+
+  points.clear();
+  depths.clear();
+  for (const cv::Point &p : selected) {
+    double depth = scene.baseDepths(p);
+    if (std::isfinite(depth)) {
+      points.push_back(toVec2(p));
+      depths.push_back(depth);
+    }
+  }
+}
+
+} // namespace fishdso
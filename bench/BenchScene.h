@@ -0,0 +1,53 @@
+#ifndef INCLUDE_BENCHSCENE
+#define INCLUDE_BENCHSCENE
+
+#include "SyntheticSequence.h"
+#include "system/CameraModel.h"
+#include "util/types.h"
+#include <memory>
+#include <opencv2/core.hpp>
+#include <string>
+
+namespace fishdso {
+
+// Two views of a static scene with the ground truth the kernels need to run
+// on realistic input: depths of the base view and the motion between views.
+struct BenchScene {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  std::string name;
+  std::unique_ptr<CameraModel> cam;
+  cv::Mat1b frames[2];
+  // ray lengths, as in the MultiFoV dataset; INF where there is no surface
+  cv::Mat1d baseDepths;
+  SE3 baseToRef;
+};
+
+// Two fisheye views from the center of the room of SyntheticSequence, with
+// its camera. Fully deterministic, so runs on different machines see the
+// same images.
+BenchScene syntheticScene(const SyntheticSequenceSettings &settings = {});
+
+// Frames baseFrameNum and baseFrameNum + frameStep of a MultiFoV sequence.
+BenchScene mfovScene(const std::string &datasetDir, int baseFrameNum,
+                     int frameStep);
+
+// Pixels of the base view with a known depth, chosen with the default
+// PixelSelector.
+void selectDepthedPoints(const BenchScene &scene, StdVector<Vec2> &points,
+                         std::vector<double> &depths);
+
+// Each of these registers the benchmarks of one area on the scene, with the
+// scene name appended to the benchmark names. The scene must outlive the run.
+void registerCameraBenchmarks(const BenchScene &scene);
+void registerImageBenchmarks(const BenchScene &scene);
+void registerTrackingBenchmarks(const BenchScene &scene);
+void registerGeometryBenchmarks(const BenchScene &scene);
+
+// Runs the whole DsoSystem over a SyntheticSequence with each of the motions,
+// starting from the given settings.
+void registerSystemBenchmarks(const SyntheticSequenceSettings &settings);
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,205 @@
+#include "SyntheticSequence.h"
+#include "util/defs.h"
+#include <cmath>
+#include <cstdint>
+#include <glog/logging.h>
+#include <random>
+#include <tbb/parallel_for.h>
+
+namespace fishdso {
+
+namespace {
+
+double latticeValue(int x, int y, int z) {
+  uint32_t h = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^
+               uint32_t(z) * 83492791u;
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  h ^= h >> 15;
+  return (h & 0xffff) / 65535.0;
+}
+
+double smoothStep(double t) { return t * t * (3 - 2 * t); }
+
+double valueNoise(const Vec3 &p) {
+  int x0 = std::floor(p[0]), y0 = std::floor(p[1]), z0 = std::floor(p[2]);
+  double tx = smoothStep(p[0] - x0), ty = smoothStep(p[1] - y0),
+         tz = smoothStep(p[2] - z0);
+  double res = 0;
+  for (int dz = 0; dz < 2; ++dz)
+    for (int dy = 0; dy < 2; ++dy)
+      for (int dx = 0; dx < 2; ++dx)
+        res += latticeValue(x0 + dx, y0 + dy, z0 + dz) *
+               (dx ? tx : 1 - tx) * (dy ? ty : 1 - ty) * (dz ? tz : 1 - tz);
+  return res;
+}
+
+double texture(const Vec3 &p) {
+  return 40 + 170 * (0.6 * valueNoise(4 * p) + 0.4 * valueNoise(12 * p));
+}
+
+const Vec3 roomHalfSize(4, 3, 5);
+
+// centers and half sizes, off the path of the walk
+const std::pair<Vec3, Vec3> boxes[] = {
+    {Vec3(-2.5, -2, 2.5), Vec3(0.6, 1, 0.6)},
+    {Vec3(2.5, -2.2, -1.5), Vec3(0.8, 0.8, 0.8)},
+    {Vec3(1.5, 1.8, 3.5), Vec3(0.7, 0.5, 0.5)}};
+
+// ray length from a point inside the room to the nearest surface
+double sceneDepth(const Vec3 &origin, const Vec3 &direction) {
+  double depth = INF;
+  for (int i = 0; i < 3; ++i)
+    if (direction[i] != 0) {
+      double wall = direction[i] > 0 ? roomHalfSize[i] : -roomHalfSize[i];
+      depth = std::min(depth, (wall - origin[i]) / direction[i]);
+    }
+
+  for (const auto &[center, halfSize] : boxes) {
+    double entry = -INF, exit = INF;
+    for (int i = 0; i < 3; ++i) {
+      double lo = center[i] - halfSize[i], hi = center[i] + halfSize[i];
+      if (direction[i] == 0) {
+        if (origin[i] < lo || origin[i] > hi)
+          exit = -INF;
+        continue;
+      }
+      double t1 = (lo - origin[i]) / direction[i];
+      double t2 = (hi - origin[i]) / direction[i];
+      entry = std::max(entry, std::min(t1, t2));
+      exit = std::min(exit, std::max(t1, t2));
+    }
+    if (entry > 0 && entry <= exit)
+      depth = std::min(depth, entry);
+  }
+  return depth;
+}
+
+// The corner radius in the normalized coordinates of the camera model, at
+// which the rays are at the angle from the axis.
+double cornerRadius(const VecX &unmapPolyCoeffs, double angle) {
+  auto rayAngle = [&](double r) {
+    double z = unmapPolyCoeffs[0];
+    double tail = 0;
+    for (int i = unmapPolyCoeffs.size() - 1; i >= 1; --i)
+      tail = tail * r + unmapPolyCoeffs[i];
+    z += r * r * tail;
+    return std::atan2(r, z);
+  };
+  double lo = 0, hi = 1.9;
+  for (int it = 0; it < 60; ++it) {
+    double mid = (lo + hi) / 2;
+    (rayAngle(mid) < angle ? lo : hi) = mid;
+  }
+  return lo;
+}
+
+} // namespace
+
+SyntheticSequence::SyntheticSequence(const SyntheticSequenceSettings &settings)
+    : settings(settings)
+    , nextFrameNum(0) {
+  CHECK_GT(settings.frameCount, 0);
+  CHECK_GT(settings.fps, 0);
+  // the fisheye from the camera model tests, fitted up to about 240 degrees
+  VecX unmapPolyCoeffs(5, 1);
+  unmapPolyCoeffs << 1.14169, -0.203229, -0.362134, 0.351011, -0.147191;
+  double scale = 302.0 * settings.width / 960.0;
+  if (settings.fov > 0) {
+    CHECK_LE(settings.fov, 240) << "the camera model does not reach further";
+    double cornerDist = std::hypot(settings.width / 2.0, settings.height / 2.0);
+    scale = cornerDist /
+            cornerRadius(unmapPolyCoeffs, settings.fov * M_PI / 360.0);
+  }
+  Vec2 center(settings.width / (2 * scale), settings.height / (2 * scale));
+  camera = std::unique_ptr<CameraModel>(new CameraModel(
+      settings.width, settings.height, scale, center, unmapPolyCoeffs));
+
+  std::mt19937 mt(settings.seed);
+  std::normal_distribution<double> noise(0, settings.jitter);
+  jitters.resize(settings.frameCount);
+  for (SE3 &jitter : jitters)
+    if (settings.motion == SyntheticSequenceSettings::SHAKY_WALK) {
+      Vec3 rotation(noise(mt), noise(mt), noise(mt));
+      Vec3 translation(noise(mt), noise(mt), noise(mt));
+      jitter = SE3(SO3::exp(rotation), translation);
+    }
+}
+
+double SyntheticSequence::timestamp(int frameNum) const {
+  return frameNum / settings.fps;
+}
+
+SE3 SyntheticSequence::worldToFrame(int frameNum) const {
+  CHECK(frameNum >= 0 && frameNum < settings.frameCount);
+  double t = timestamp(frameNum);
+  SE3 frameToWorld;
+  if (settings.motion == SyntheticSequenceSettings::TURN)
+    frameToWorld = SE3(SO3::exp(Vec3(0, settings.angularSpeed * t, 0)),
+                       Vec3::Zero());
+  else {
+    // back and forth along the room, with the peak speed of settings.speed
+    const double walkAmplitude = 3, swayFrequency = 0.5;
+    Vec3 position(0.5 * std::sin(0.7 * t), 0.15 * std::sin(1.1 * t),
+                  walkAmplitude * std::sin(settings.speed * t / walkAmplitude));
+    double yaw = settings.angularSpeed / swayFrequency *
+                 std::sin(swayFrequency * t);
+    double pitch = 0.1 * std::sin(0.9 * t);
+    frameToWorld = SE3(SO3::exp(Vec3(pitch, yaw, 0)), position) *
+                   jitters[frameNum];
+  }
+  return frameToWorld.inverse();
+}
+
+double SyntheticSequence::exposureGain(int frameNum) const {
+  return std::exp(settings.exposureAmplitude *
+                  std::sin(2 * M_PI * timestamp(frameNum) /
+                           settings.exposurePeriod));
+}
+
+cv::Mat1b SyntheticSequence::frame(int frameNum) const {
+  cv::Mat1b result;
+  render(worldToFrame(frameNum), exposureGain(frameNum), &result, nullptr);
+  return result;
+}
+
+cv::Mat1d SyntheticSequence::depths(int frameNum) const {
+  cv::Mat1d result;
+  render(worldToFrame(frameNum), 1, nullptr, &result);
+  return result;
+}
+
+bool SyntheticSequence::next(SourceFrame &frame) {
+  if (nextFrameNum >= settings.frameCount)
+    return false;
+  frame = SourceFrame();
+  frame.gray = this->frame(nextFrameNum);
+  frame.globalFrameNum = nextFrameNum;
+  frame.timestamp = timestamp(nextFrameNum);
+  nextFrameNum++;
+  return true;
+}
+
+void SyntheticSequence::render(const SE3 &worldToCam, double gain,
+                               cv::Mat1b *frame, cv::Mat1d *depths) const {
+  const CameraModel &cam = *camera;
+  SE3 camToWorld = worldToCam.inverse();
+  if (frame)
+    frame->create(cam.getHeight(), cam.getWidth());
+  if (depths)
+    depths->create(cam.getHeight(), cam.getWidth());
+  tbb::parallel_for(0, cam.getHeight(), [&](int y) {
+    for (int x = 0; x < cam.getWidth(); ++x) {
+      Vec3 direction = camToWorld.so3() * cam.unmap(Vec2(x, y)).normalized();
+      double depth = sceneDepth(camToWorld.translation(), direction);
+      if (frame) {
+        Vec3 point = camToWorld.translation() + depth * direction;
+        (*frame)(y, x) = cv::saturate_cast<uchar>(gain * texture(point));
+      }
+      if (depths)
+        (*depths)(y, x) = depth;
+    }
+  });
+}
+
+} // namespace fishdso
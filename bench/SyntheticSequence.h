@@ -0,0 +1,87 @@
+#ifndef INCLUDE_SYNTHETICSEQUENCE
+#define INCLUDE_SYNTHETICSEQUENCE
+
+#include "system/CameraModel.h"
+#include "system/FrameSource.h"
+#include "util/types.h"
+#include <memory>
+#include <opencv2/core.hpp>
+
+namespace fishdso {
+
+struct SyntheticSequenceSettings {
+  enum Motion {
+    // forward and back along the room, swaying and yawing on the way
+    WALK,
+    // the same with a seeded jitter of every frame on top, like a handheld
+    // camera
+    SHAKY_WALK,
+    // around the vertical axis at the center of the room
+    TURN
+  };
+
+  // the fisheye of the camera model tests at half the resolution by default
+  int width = 960;
+  int height = 604;
+  // Angle between the rays of two opposite corners of the image, in degrees.
+  // With zero the scale of the calibration is kept, which gives about 240
+  // degrees at the default resolution. At most 240.
+  double fov = 0;
+
+  int frameCount = 100;
+  double fps = 30;
+  Motion motion = WALK;
+  // of the walk, in meters per second along the room
+  double speed = 0.6;
+  // of the sway and the turn, in radians per second
+  double angularSpeed = 0.4;
+  // of the jitter of SHAKY_WALK, in meters and radians
+  double jitter = 0.01;
+
+  // The exposure oscillates, scaling the image by exp(exposureAmplitude *
+  // sin(2 * pi * t / exposurePeriod)).
+  double exposureAmplitude = 0;
+  double exposurePeriod = 4;
+
+  unsigned seed = 42;
+};
+
+// A camera moving inside a room with a value noise texture on its walls and
+// a few boxes standing in it. Everything is computed from the settings, so
+// the same sequence comes out on every machine at any resolution. The frames
+// are rendered when they are requested, by casting a ray through every
+// pixel, and the ground truth comes with them. As a FrameSource it gives out
+// the frames in order, with their timestamps.
+class SyntheticSequence : public FrameSource {
+public:
+  SyntheticSequence(const SyntheticSequenceSettings &settings = {});
+
+  CameraModel *cam() const { return camera.get(); }
+  int frameCount() const { return settings.frameCount; }
+
+  double timestamp(int frameNum) const;
+  SE3 worldToFrame(int frameNum) const;
+  // the factor that the exposure applies to the texture
+  double exposureGain(int frameNum) const;
+
+  cv::Mat1b frame(int frameNum) const;
+  // ray lengths, as in the MultiFoV dataset
+  cv::Mat1d depths(int frameNum) const;
+  // The scene from any pose, with the texture scaled by gain. Either output
+  // can be null.
+  void render(const SE3 &worldToCam, double gain, cv::Mat1b *frame,
+              cv::Mat1d *depths) const;
+
+  bool next(SourceFrame &frame) override;
+
+private:
+
+  SyntheticSequenceSettings settings;
+  std::unique_ptr<CameraModel> camera;
+  StdVector<SE3> jitters;
+  int nextFrameNum;
+};
+
+} // namespace fishdso
+
+#endif
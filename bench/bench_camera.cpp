@@ -0,0 +1,75 @@
+#include "BenchScene.h"
+#include <benchmark/benchmark.h>
+#include <random>
+
+namespace fishdso {
+
+namespace {
+
+constexpr int pointsPerIteration = 4096;
+
+// integer ones, as the tables only cover those
+StdVector<Vec2> randomPixels(const CameraModel &cam) {
+  std::mt19937 mt(42);
+  std::uniform_int_distribution<int> x(0, cam.getWidth() - 1);
+  std::uniform_int_distribution<int> y(0, cam.getHeight() - 1);
+  StdVector<Vec2> pixels(pointsPerIteration);
+  for (Vec2 &p : pixels)
+    p = Vec2(double(x(mt)), double(y(mt)));
+  return pixels;
+}
+
+void benchUnmap(benchmark::State &state, const CameraModel &cam) {
+  StdVector<Vec2> pixels = randomPixels(cam);
+  for (auto _ : state)
+    for (const Vec2 &p : pixels)
+      benchmark::DoNotOptimize(cam.unmap(p));
+  state.SetItemsProcessed(state.iterations() * pixels.size());
+}
+
+void benchMap(benchmark::State &state, const CameraModel &cam) {
+  StdVector<Vec3> rays;
+  for (const Vec2 &p : randomPixels(cam))
+    rays.push_back(cam.unmap(p) * 3.0);
+  for (auto _ : state)
+    for (const Vec3 &ray : rays)
+      benchmark::DoNotOptimize(cam.map(ray));
+  state.SetItemsProcessed(state.iterations() * rays.size());
+}
+
+void benchDiffMap(benchmark::State &state, const CameraModel &cam) {
+  StdVector<Vec3> rays;
+  for (const Vec2 &p : randomPixels(cam))
+    rays.push_back(cam.unmap(p) * 3.0);
+  for (auto _ : state)
+    for (const Vec3 &ray : rays)
+      benchmark::DoNotOptimize(cam.diffMap(ray));
+  state.SetItemsProcessed(state.iterations() * rays.size());
+}
+
+} // namespace
+
+void registerCameraBenchmarks(const BenchScene &scene) {
+  // a copy of the camera that uses the lookup tables, owned by the registry
+  auto tabled = std::make_shared<CameraModel>(*scene.cam);
+  tabled->buildLookupTables();
+
+  const CameraModel &cam = *scene.cam;
+  benchmark::RegisterBenchmark(
+      ("CameraModel/unmap/" + scene.name).c_str(),
+      [&cam](benchmark::State &state) { benchUnmap(state, cam); });
+  benchmark::RegisterBenchmark(
+      ("CameraModel/unmap/tables/" + scene.name).c_str(),
+      [tabled](benchmark::State &state) { benchUnmap(state, *tabled); });
+  benchmark::RegisterBenchmark(
+      ("CameraModel/map/" + scene.name).c_str(),
+      [&cam](benchmark::State &state) { benchMap(state, cam); });
+  benchmark::RegisterBenchmark(
+      ("CameraModel/map/tables/" + scene.name).c_str(),
+      [tabled](benchmark::State &state) { benchMap(state, *tabled); });
+  benchmark::RegisterBenchmark(
+      ("CameraModel/diffMap/" + scene.name).c_str(),
+      [&cam](benchmark::State &state) { benchDiffMap(state, cam); });
+}
+
+} // namespace fishdso
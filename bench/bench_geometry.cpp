@@ -0,0 +1,76 @@
+#include "BenchScene.h"
+#include "system/StereoGeometryEstimator.h"
+#include "util/Triangulation.h"
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <random>
+
+namespace fishdso {
+
+namespace {
+
+void benchTriangulation(benchmark::State &state, const CameraModel &cam) {
+  std::mt19937 mt(42);
+  std::uniform_real_distribution<double> x(0, cam.getWidth());
+  std::uniform_real_distribution<double> y(0, cam.getHeight());
+  StdVector<Vec2> points(state.range(0));
+  for (Vec2 &p : points)
+    p = Vec2(x(mt), y(mt));
+
+  for (auto _ : state) {
+    Triangulation triangulation(points);
+    benchmark::DoNotOptimize(triangulation.triangleNum());
+  }
+  state.SetItemsProcessed(state.iterations() * points.size());
+}
+
+// Correspondences are the ground truth projections of the base frame pixels
+// onto the second one, with a third of them replaced by outliers.
+void benchCoarseMotion(benchmark::State &state, const BenchScene &scene) {
+  const CameraModel &cam = *scene.cam;
+  std::mt19937 mt(42);
+  std::uniform_int_distribution<int> x(0, cam.getWidth() - 1);
+  std::uniform_int_distribution<int> y(0, cam.getHeight() - 1);
+  std::normal_distribution<double> noise(0, 0.5);
+
+  StdVector<std::pair<Vec2, Vec2>> imgCorresps;
+  while (int(imgCorresps.size()) < state.range(0)) {
+    Vec2 base(double(x(mt)), double(y(mt)));
+    double depth = scene.baseDepths(int(base[1]), int(base[0]));
+    if (!std::isfinite(depth))
+      continue;
+    Vec2 ref;
+    if (imgCorresps.size() % 3 == 2)
+      ref = Vec2(double(x(mt)), double(y(mt)));
+    else
+      ref = cam.map(scene.baseToRef * (depth * cam.unmap(base).normalized())) +
+            Vec2(noise(mt), noise(mt));
+    if (cam.isOnImage(ref, 0))
+      imgCorresps.push_back({base, ref});
+  }
+
+  for (auto _ : state) {
+    StereoGeometryEstimator estimator(scene.cam.get(), imgCorresps);
+    benchmark::DoNotOptimize(estimator.findCoarseMotion());
+  }
+}
+
+} // namespace
+
+void registerGeometryBenchmarks(const BenchScene &scene) {
+  const CameraModel &cam = *scene.cam;
+  benchmark::RegisterBenchmark(
+      ("Triangulation/construct/" + scene.name).c_str(),
+      [&cam](benchmark::State &state) { benchTriangulation(state, cam); })
+      ->ArgName("points")
+      ->RangeMultiplier(4)
+      ->Range(500, 8000);
+  benchmark::RegisterBenchmark(
+      ("StereoGeometryEstimator/findCoarseMotion/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) { benchCoarseMotion(state, scene); })
+      ->ArgName("corresps")
+      ->Arg(300)
+      ->Unit(benchmark::kMillisecond);
+}
+
+} // namespace fishdso
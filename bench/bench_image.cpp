@@ -0,0 +1,156 @@
+#include "BenchScene.h"
+#include "util/DepthedImagePyramid.h"
+#include "util/ImagePyramid.h"
+#include "util/ImageSampler.h"
+#include "util/PixelSelector.h"
+#include "util/settings.h"
+#include "util/util.h"
+#include <benchmark/benchmark.h>
+
+namespace fishdso {
+
+namespace {
+
+constexpr int levelNum = Settings::Pyramid::default_levelNum;
+
+void benchPyramid(benchmark::State &state, const cv::Mat1b &frame) {
+  for (auto _ : state) {
+    ImagePyramid pyramid(frame, levelNum);
+    benchmark::DoNotOptimize(pyramid.images.back().data);
+  }
+  state.SetBytesProcessed(state.iterations() * frame.total());
+}
+
+// the path of recycled frames: the same storage is refilled every time
+void benchPyramidRebuild(benchmark::State &state, const cv::Mat1b &frame) {
+  PyramidGradients gradients;
+  ImagePyramid pyramid(frame, levelNum, gradients);
+  for (auto _ : state) {
+    pyramid.rebuild(levelNum, gradients);
+    benchmark::DoNotOptimize(gradients.arena.data());
+  }
+  state.SetBytesProcessed(state.iterations() * frame.total());
+}
+
+void benchGrad(benchmark::State &state, const cv::Mat1b &frame) {
+  cv::Mat1f gradX, gradY, gradNorm;
+  for (auto _ : state) {
+    grad(frame, gradX, gradY, gradNorm);
+    benchmark::DoNotOptimize(gradNorm.data);
+  }
+  state.SetBytesProcessed(state.iterations() * frame.total());
+}
+
+void benchSelect(benchmark::State &state, const cv::Mat1b &frame) {
+  cv::Mat1f gradX, gradY, gradNorm;
+  grad(frame, gradX, gradY, gradNorm);
+  for (auto _ : state) {
+    // the selector adapts its block size to the previous call, a fresh one
+    // keeps the work the same on every iteration
+    PixelSelector pixelSelector;
+    std::vector<cv::Point> points = pixelSelector.select(
+        frame, gradNorm, Settings::KeyFrame::default_pointsNum, nullptr);
+    benchmark::DoNotOptimize(points.data());
+  }
+}
+
+void benchDepthedPyramid(benchmark::State &state, const BenchScene &scene) {
+  StdVector<Vec2> points;
+  std::vector<double> depths;
+  selectDepthedPoints(scene, points, depths);
+  std::vector<double> weights(depths.size(), 1.0);
+  for (auto _ : state) {
+    DepthedImagePyramid pyramid(scene.frames[0], levelNum, points, depths,
+                                weights);
+    benchmark::DoNotOptimize(pyramid.points.back().depth.data());
+  }
+  state.SetItemsProcessed(state.iterations() * points.size());
+}
+
+// Replaces the depths of the same points, as after bundle adjustment.
+void benchDepthedPyramidUpdate(benchmark::State &state,
+                               const BenchScene &scene) {
+  StdVector<Vec2> points;
+  std::vector<double> depths;
+  selectDepthedPoints(scene, points, depths);
+  std::vector<double> xs, ys, weights(depths.size(), 1.0);
+  for (const Vec2 &p : points) {
+    xs.push_back(p[0]);
+    ys.push_back(p[1]);
+  }
+  DepthedImagePyramid pyramid(scene.frames[0], levelNum, xs, ys, depths,
+                              weights);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(pyramid.updateDepths(xs, ys, depths, weights));
+  state.SetItemsProcessed(state.iterations() * points.size());
+}
+
+// Samples the reference view at the points of the base one warped by the
+// ground truth motion, in the order of the points, the access pattern of
+// tracking on the finest level. Run with
+// --benchmark_perf_counters=CACHE-MISSES to compare the cache misses of the
+// layouts, if the benchmark library is built with libpfm.
+void benchSampleWarped(benchmark::State &state, const BenchScene &scene,
+                       ImageSampler::Layout layout) {
+  StdVector<Vec2> points;
+  std::vector<double> depths;
+  selectDepthedPoints(scene, points, depths);
+  std::vector<double> ys, xs;
+  for (int i = 0; i < points.size(); ++i) {
+    Vec3 onBase = depths[i] * scene.cam->unmap(points[i]).normalized();
+    Vec2 p = scene.cam->map(scene.baseToRef * onBase);
+    // the pattern around each point, as tracking samples it
+    for (int dy = -1; dy <= 1; ++dy)
+      for (int dx = -1; dx <= 1; ++dx) {
+        ys.push_back(p[1] + dy);
+        xs.push_back(p[0] + dx);
+      }
+  }
+
+  ImageSampler sampler(scene.frames[1], layout);
+  std::vector<double> f(ys.size()), dfdy(ys.size()), dfdx(ys.size());
+  for (auto _ : state) {
+    sampler.evaluateBatch(ys.size(), ys.data(), xs.data(), f.data(),
+                          dfdy.data(), dfdx.data());
+    benchmark::DoNotOptimize(f.data());
+  }
+  state.SetItemsProcessed(state.iterations() * ys.size());
+}
+
+} // namespace
+
+void registerImageBenchmarks(const BenchScene &scene) {
+  const cv::Mat1b &frame = scene.frames[0];
+  benchmark::RegisterBenchmark(
+      ("ImagePyramid/construct/" + scene.name).c_str(),
+      [&frame](benchmark::State &state) { benchPyramid(state, frame); });
+  benchmark::RegisterBenchmark(
+      ("ImagePyramid/rebuild/" + scene.name).c_str(),
+      [&frame](benchmark::State &state) { benchPyramidRebuild(state, frame); });
+  benchmark::RegisterBenchmark(
+      ("grad/" + scene.name).c_str(),
+      [&frame](benchmark::State &state) { benchGrad(state, frame); });
+  benchmark::RegisterBenchmark(
+      ("PixelSelector/select/" + scene.name).c_str(),
+      [&frame](benchmark::State &state) { benchSelect(state, frame); });
+  benchmark::RegisterBenchmark(
+      ("DepthedImagePyramid/construct/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) { benchDepthedPyramid(state, scene); });
+  benchmark::RegisterBenchmark(
+      ("DepthedImagePyramid/update/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) {
+        benchDepthedPyramidUpdate(state, scene);
+      });
+  benchmark::RegisterBenchmark(
+      ("ImageSampler/warped/rows/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) {
+        benchSampleWarped(state, scene, ImageSampler::ROW_MAJOR);
+      });
+  benchmark::RegisterBenchmark(
+      ("ImageSampler/warped/tiles/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) {
+        benchSampleWarped(state, scene, ImageSampler::TILED);
+      });
+}
+
+} // namespace fishdso
@@ -0,0 +1,71 @@
+#include "BenchScene.h"
+#include <benchmark/benchmark.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <memory>
+#include <vector>
+
+DEFINE_string(mfov_dir, "",
+              "Path to the MultiFoV dataset. If set, every benchmark also runs "
+              "on a pair of its frames besides the synthetic scene.");
+DEFINE_int32(mfov_base_frame, 1, "Number of the first frame of the pair.");
+DEFINE_int32(mfov_frame_step, 2,
+             "The second frame of the pair is this many frames later.");
+
+DEFINE_int32(synthetic_width, 960, "Width of the synthetic frames.");
+DEFINE_int32(synthetic_height, 604, "Height of the synthetic frames.");
+DEFINE_double(synthetic_fov, 0,
+              "Angle between the opposite corners of the synthetic frames, in "
+              "degrees, at most 240. With 0 the scale of the calibration is "
+              "kept.");
+DEFINE_int32(synthetic_frames, 100,
+             "Length of the synthetic sequences the whole system runs on.");
+DEFINE_double(synthetic_exposure, 0.2,
+              "Amplitude of the exposure changes in the synthetic sequences, "
+              "see SyntheticSequenceSettings.");
+DEFINE_bool(run_system, true,
+            "Also run the whole system over the synthetic sequences.");
+
+using namespace fishdso;
+
+int main(int argc, char **argv) {
+  std::string usage = "Usage: " + std::string(argv[0]) + R"abacaba( [options]
+Runs the micro-benchmarks of the core kernels and the whole system on
+synthetic sequences. All the Google Benchmark flags
+are supported, e.g. to store the results for a later comparison use
+  --benchmark_out=results.json --benchmark_out_format=json)abacaba";
+  gflags::SetUsageMessage(usage);
+
+  benchmark::Initialize(&argc, argv);
+  // the kernels log a lot on the INFO level, which would only add noise
+  gflags::SetCommandLineOptionWithMode("minloglevel", "1",
+                                       gflags::SET_FLAGS_DEFAULT);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  SyntheticSequenceSettings syntheticSettings;
+  syntheticSettings.width = FLAGS_synthetic_width;
+  syntheticSettings.height = FLAGS_synthetic_height;
+  syntheticSettings.fov = FLAGS_synthetic_fov;
+  syntheticSettings.frameCount = FLAGS_synthetic_frames;
+  syntheticSettings.exposureAmplitude = FLAGS_synthetic_exposure;
+
+  std::vector<std::unique_ptr<BenchScene>> scenes;
+  scenes.push_back(std::unique_ptr<BenchScene>(
+      new BenchScene(syntheticScene(syntheticSettings))));
+  if (!FLAGS_mfov_dir.empty())
+    scenes.push_back(std::unique_ptr<BenchScene>(new BenchScene(mfovScene(
+        FLAGS_mfov_dir, FLAGS_mfov_base_frame, FLAGS_mfov_frame_step))));
+
+  for (const auto &scene : scenes) {
+    registerCameraBenchmarks(*scene);
+    registerImageBenchmarks(*scene);
+    registerTrackingBenchmarks(*scene);
+    registerGeometryBenchmarks(*scene);
+  }
+  if (FLAGS_run_system)
+    registerSystemBenchmarks(syntheticSettings);
+
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
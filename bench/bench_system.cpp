@@ -0,0 +1,54 @@
+#include "BenchScene.h"
+#include "system/DsoSystem.h"
+#include <benchmark/benchmark.h>
+#include <string>
+#include <vector>
+
+namespace fishdso {
+
+namespace {
+
+// Feeds the whole sequence to a fresh DsoSystem, including the
+// initialization. The frames are rendered before the timed loop, so only the
+// system itself is measured. Reports the frames per second.
+void benchRunSystem(benchmark::State &state,
+                    const SyntheticSequenceSettings &sequenceSettings) {
+  SyntheticSequence sequence(sequenceSettings);
+  std::vector<SourceFrame> frames;
+  SourceFrame frame;
+  while (sequence.next(frame))
+    frames.push_back(frame);
+
+  for (auto _ : state) {
+    DsoSystem dso(sequence.cam());
+    for (const SourceFrame &frame : frames)
+      dso.addFrame(frame);
+    dso.waitForMapping();
+  }
+  state.counters["fps"] = benchmark::Counter(
+      state.iterations() * frames.size(), benchmark::Counter::kIsRate);
+}
+
+} // namespace
+
+void registerSystemBenchmarks(const SyntheticSequenceSettings &settings) {
+  const std::pair<SyntheticSequenceSettings::Motion, std::string> motions[] = {
+      {SyntheticSequenceSettings::WALK, "walk"},
+      {SyntheticSequenceSettings::SHAKY_WALK, "shakyWalk"},
+      {SyntheticSequenceSettings::TURN, "turn"}};
+  for (const auto &[motion, motionName] : motions) {
+    SyntheticSequenceSettings sequenceSettings = settings;
+    sequenceSettings.motion = motion;
+    benchmark::RegisterBenchmark(
+        ("DsoSystem/" + motionName + "/" + std::to_string(settings.width) +
+         "x" + std::to_string(settings.height))
+            .c_str(),
+        [sequenceSettings](benchmark::State &state) {
+          benchRunSystem(state, sequenceSettings);
+        })
+        ->Unit(benchmark::kMillisecond)
+        ->Iterations(1);
+  }
+}
+
+} // namespace fishdso
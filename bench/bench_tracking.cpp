@@ -0,0 +1,198 @@
+#include "BenchScene.h"
+#include "system/BundleAdjuster.h"
+#include "system/FrameTracker.h"
+#include "system/KeyFrame.h"
+#include "util/settings.h"
+#include "util/util.h"
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <random>
+
+namespace fishdso {
+
+namespace {
+
+constexpr int levelNum = Settings::Pyramid::default_levelNum;
+
+std::shared_ptr<PreKeyFrame> makePreKeyFrame(const BenchScene &scene, int ind,
+                                             KeyFrame *baseKeyFrame) {
+  SourceFrame frame = {scene.frames[ind], {}, ind};
+  return std::shared_ptr<PreKeyFrame>(
+      new PreKeyFrame(baseKeyFrame, scene.cam.get(), frame));
+}
+
+std::unique_ptr<KeyFrame>
+makeKeyFrame(const BenchScene &scene, int ind,
+             const PointTracerSettings &tracingSettings = {}) {
+  PixelSelector pixelSelector;
+  std::unique_ptr<KeyFrame> keyFrame(
+      new KeyFrame(makePreKeyFrame(scene, ind, nullptr), pixelSelector, {},
+                   tracingSettings));
+  keyFrame->thisToWorld = ind == 0 ? SE3() : scene.baseToRef.inverse();
+  return keyFrame;
+}
+
+// Traces all the points selected on the base frame onto the second one. With
+// retrace set, the points have been traced once before, so the search runs
+// over the narrowed depth interval, as it does for most points in practice.
+// coarseLevels is PointTracer::coarseSearchLevels.
+void benchTraceOn(benchmark::State &state, const BenchScene &scene,
+                  bool retrace, int coarseLevels = 0) {
+  PointTracerSettings tracingSettings;
+  tracingSettings.pointTracer.coarseSearchLevels = coarseLevels;
+  std::unique_ptr<KeyFrame> baseFrame =
+      makeKeyFrame(scene, 0, tracingSettings);
+  std::shared_ptr<PreKeyFrame> refFrame =
+      makePreKeyFrame(scene, 1, baseFrame.get());
+  refFrame->baseToThis = scene.baseToRef;
+  TracingContext context(*baseFrame, *refFrame);
+
+  StdVector<ImmaturePoint> pristine;
+  for (const auto &ip : baseFrame->immaturePoints) {
+    pristine.push_back(*ip);
+    if (retrace)
+      pristine.back().traceOn(context, ImmaturePoint::NO_DEBUG);
+  }
+
+  StdVector<ImmaturePoint> points;
+  points.reserve(pristine.size());
+  for (auto _ : state) {
+    state.PauseTiming();
+    points.clear();
+    points.insert(points.end(), pristine.begin(), pristine.end());
+    state.ResumeTiming();
+    for (ImmaturePoint &ip : points)
+      benchmark::DoNotOptimize(ip.traceOn(context, ImmaturePoint::NO_DEBUG));
+  }
+  state.SetItemsProcessed(state.iterations() * pristine.size());
+}
+
+// Tracks the second frame against the depths of the first one from the
+// coarsest pyramid level down to state.range(0), starting from a perturbed
+// ground truth motion as the motion prior would. The inverse compositional
+// solver precomputes its Jacobians in the constructor of the tracker, which
+// is outside of the timed loop, as it is run once per keyframe.
+void benchTrackFrame(benchmark::State &state, const BenchScene &scene,
+                     bool inverseCompositional) {
+  Settings settings;
+  settings.frameTracker.useInverseCompositional = inverseCompositional;
+  StdVector<CameraModel> camPyr = scene.cam->camPyr(levelNum);
+  StdVector<Vec2> points;
+  std::vector<double> depths;
+  selectDepthedPoints(scene, points, depths);
+  std::vector<double> weights(depths.size(), 1.0);
+  std::unique_ptr<DepthedImagePyramid> baseForTrack(new DepthedImagePyramid(
+      scene.frames[0], levelNum, points, depths, weights));
+  FrameTracker frameTracker(camPyr, std::move(baseForTrack), {},
+                            settings.getFrameTrackerSettings());
+  std::shared_ptr<PreKeyFrame> frame = makePreKeyFrame(scene, 1, nullptr);
+
+  double baseline = scene.baseToRef.translation().norm();
+  SE3 coarseBaseToTracked =
+      SE3(SO3::exp(Vec3(0.005, -0.005, 0.002)),
+          Vec3(0.1, -0.05, 0.05) * baseline) *
+      scene.baseToRef;
+
+  int minPyrLevel = state.range(0);
+  double rmse = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(frameTracker.trackFrameQuiet(
+        *frame, coarseBaseToTracked, AffLight(), minPyrLevel, &rmse));
+  state.counters["rmse"] = rmse;
+}
+
+struct AdjustProblem {
+  std::unique_ptr<KeyFrame> keyFrames[2];
+  std::unique_ptr<BundleAdjuster> bundleAdjuster;
+};
+
+// Points of the base frame get the ground truth depths with a 5% noise, the
+// second keyframe only hosts residuals.
+std::unique_ptr<AdjustProblem> makeAdjustProblem(const BenchScene &scene,
+                                                 const Settings &settings) {
+  std::unique_ptr<AdjustProblem> problem(new AdjustProblem);
+  for (int i = 0; i < 2; ++i)
+    problem->keyFrames[i] = makeKeyFrame(scene, i);
+
+  std::mt19937 mt(42);
+  std::uniform_real_distribution<double> noise(0.95, 1.05);
+  KeyFrame &base = *problem->keyFrames[0];
+  auto &immatures = base.immaturePoints;
+  immatures.erase(std::remove_if(immatures.begin(), immatures.end(),
+                                 [&](const auto &ip) {
+                                   return ip->state != ImmaturePoint::ACTIVE ||
+                                          !std::isfinite(scene.baseDepths(
+                                              toCvPoint(ip->p)));
+                                 }),
+                  immatures.end());
+  for (const auto &ip : immatures)
+    ip->depth = scene.baseDepths(toCvPoint(ip->p)) * noise(mt);
+  base.activateAllImmature();
+
+  problem->bundleAdjuster = std::unique_ptr<BundleAdjuster>(new BundleAdjuster(
+      scene.cam.get(), settings.getBundleAdjusterSettings()));
+  for (int i = 0; i < 2; ++i)
+    problem->bundleAdjuster->addKeyFrame(problem->keyFrames[i].get());
+  return problem;
+}
+
+void benchAdjust(benchmark::State &state, const BenchScene &scene) {
+  Settings settings;
+  std::unique_ptr<AdjustProblem> problem;
+  for (auto _ : state) {
+    state.PauseTiming();
+    problem.reset();
+    problem = makeAdjustProblem(scene, settings);
+    state.ResumeTiming();
+    problem->bundleAdjuster->adjust(state.range(0));
+  }
+  state.PauseTiming();
+  problem.reset();
+  state.ResumeTiming();
+}
+
+} // namespace
+
+void registerTrackingBenchmarks(const BenchScene &scene) {
+  benchmark::RegisterBenchmark(
+      ("ImmaturePoint/traceOn/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) { benchTraceOn(state, scene, false); })
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark(
+      ("ImmaturePoint/traceOn/retrace/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) { benchTraceOn(state, scene, true); })
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark(
+      ("ImmaturePoint/traceOn/coarseToFine/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) {
+        benchTraceOn(state, scene, false, state.range(0));
+      })
+      ->ArgName("coarseLevels")
+      ->DenseRange(1, 2)
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark(
+      ("FrameTracker/trackFrame/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) {
+        benchTrackFrame(state, scene, false);
+      })
+      ->ArgName("minLevel")
+      ->DenseRange(0, levelNum - 1)
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark(
+      ("FrameTracker/trackFrame/inverse/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) {
+        benchTrackFrame(state, scene, true);
+      })
+      ->ArgName("minLevel")
+      ->DenseRange(0, levelNum - 1)
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark(
+      ("BundleAdjuster/adjust/" + scene.name).c_str(),
+      [&scene](benchmark::State &state) { benchAdjust(state, scene); })
+      ->ArgName("iterations")
+      ->Arg(5)
+      ->Unit(benchmark::kMillisecond);
+}
+
+} // namespace fishdso
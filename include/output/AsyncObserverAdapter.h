@@ -0,0 +1,131 @@
+#ifndef INCLUDE_ASYNCOBSERVERADAPTER
+#define INCLUDE_ASYNCOBSERVERADAPTER
+
+#include "output/DsoObserver.h"
+#include "output/DsoSnapshotObserver.h"
+#include "output/FrameTrackerObserver.h"
+#include "util/Scheduler.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace fishdso {
+
+// Delivers observer callbacks on a worker thread, so that observers drawing
+// images or writing files do not stall tracking. Callbacks are queued with
+// copies of their arguments, which are immutable snapshots. The queue is
+// bounded, and the drop policy says what to do when it is full: wait for
+// space, drop the oldest callback or drop the new one. Callbacks that must
+// not be lost, like flushed poses, are never dropped, the caller waits for
+// space instead. With a scheduler the callbacks are delivered by its threads
+// with the output priority, still one at a time and in order, instead of by
+// a thread of the adapter's own.
+class AsyncObserverAdapter {
+public:
+  enum DropPolicy { BLOCK, DROP_OLDEST, DROP_NEWEST };
+
+  AsyncObserverAdapter(int queueSize = 16, DropPolicy dropPolicy = BLOCK,
+                       std::shared_ptr<Scheduler> scheduler = nullptr);
+  AsyncObserverAdapter(const AsyncObserverAdapter &other) = delete;
+  // delivers everything still queued
+  virtual ~AsyncObserverAdapter();
+
+  // Waits until all of the queued callbacks are delivered. The wrapped
+  // observer should be inspected only after this.
+  void flush();
+
+  int droppedNum() const;
+
+protected:
+  void enqueue(std::function<void()> callback, bool isDroppable = true);
+  // flushes, then calls right away, for the callbacks that set the observer
+  // up
+  void callNow(const std::function<void()> &callback);
+
+private:
+  struct Task {
+    std::function<void()> callback;
+    bool isDroppable;
+  };
+
+  void workerLoop();
+  // delivers the queued callbacks until the queue is empty
+  void drain();
+
+  int queueSize;
+  DropPolicy dropPolicy;
+  std::shared_ptr<Scheduler> scheduler;
+
+  mutable std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Task> queue;
+  bool isBusy = false;
+  // a drain task is scheduled or running
+  bool isDraining = false;
+  bool doStop = false;
+  int dropped = 0;
+
+  std::thread worker;
+};
+
+// All of the callbacks but created() are delivered asynchronously. The ones
+// about frames and keyframes take their snapshots on the calling thread, see
+// DsoSnapshotObserver, so that the worker never touches the objects of the
+// system, which may be changed or gone by the time it gets to them.
+class AsyncDsoObserver : public DsoObserver, public AsyncObserverAdapter {
+public:
+  AsyncDsoObserver(DsoSnapshotObserver *observer, int queueSize = 16,
+                   DropPolicy dropPolicy = BLOCK,
+                   std::shared_ptr<Scheduler> scheduler = nullptr);
+
+  void created(DsoSystem *newDso, CameraModel *newCam,
+               const Settings &newSettings) override;
+  void
+  initialized(const std::vector<const KeyFrame *> &initializedKFs) override;
+  void newFrame(const PreKeyFrame *frame) override;
+  void newKeyFrame(const KeyFrame *baseFrame) override;
+  void keyFramesMarginalized(
+      const std::vector<const KeyFrame *> &marginalized) override;
+  void posesFlushed(const PoseHistory::Chunk &chunk) override;
+  void frameProcessed(const FrameTimings &timings) override;
+  void loopClosed(const StdMap<int, Sim3> &worldToKeyFrame) override;
+  void pointBudgetChanged(const PointBudget &budget) override;
+  bool needsWindow() const override;
+  void windowMapped(const std::vector<const KeyFrame *> &window,
+                    int baseIndex) override;
+  void globalBundleAdjusted(
+      const std::vector<const KeyFrame *> &keyFrames) override;
+  void destructed(const std::vector<const KeyFrame *> &lastKeyFrames) override;
+
+private:
+  DsoSnapshotObserver *observer;
+};
+
+// All of the tracker callbacks are delivered asynchronously. The pyramids
+// are shallow copies, which keep their images alive, and pyramids are never
+// written to after they are built.
+class AsyncFrameTrackerObserver : public FrameTrackerObserver,
+                                  public AsyncObserverAdapter {
+public:
+  AsyncFrameTrackerObserver(FrameTrackerObserver *observer, int queueSize = 16,
+                            DropPolicy dropPolicy = BLOCK,
+                            std::shared_ptr<Scheduler> scheduler = nullptr);
+
+  void newBaseFrame(const DepthedImagePyramid &pyr) override;
+  void startTracking(const ImagePyramid &frame) override;
+  void
+  levelTracked(int pyrLevel, const SE3 &baseToLast,
+               const AffineLightTransform<double> &affLightBaseToLast,
+               const StdVector<std::pair<Vec2, double>> &pointResiduals,
+               int iterations, double time) override;
+
+private:
+  FrameTrackerObserver *observer;
+};
+
+} // namespace fishdso
+
+#endif
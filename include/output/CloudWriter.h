@@ -1,22 +1,38 @@
 #ifndef INCLUDE_CLOUDWRITER
 #define INCLUDE_CLOUDWRITER
 
-#include "output/DsoObserver.h"
+#include "output/DsoSnapshotObserver.h"
 #include "util/PlyHolder.h"
+#include "util/RecordStream.h"
+#include <memory>
 
 namespace fishdso {
 
-class CloudWriter : public DsoObserver {
+// Writes the points of the marginalized keyframes into a PLY file per
+// keyframe and into the common fileName. If a record stream is given, the
+// points of the keyframes go there instead. It only sees the snapshots of the
+// keyframes, so it can be wrapped into AsyncDsoObserver.
+class CloudWriter : public DsoSnapshotObserver {
 public:
   CloudWriter(CameraModel *cam, const std::string &outputDirectory,
-              const std::string &fileName);
-  void keyFramesMarginalized(const std::vector<const KeyFrame *> &marginalized);
-  void destructed(const std::vector<const KeyFrame *> &lastKeyFrames);
+              const std::string &fileName,
+              PlyHolder::Format format = PlyHolder::ASCII,
+              int pointsPerChunk = 0, RecordStream *records = nullptr);
+  void
+  keyFramesMarginalized(const std::vector<KeyFrameSnapshot> &marginalized);
+  void destructed(const std::vector<KeyFrameSnapshot> &lastKeyFrames);
+  // the whole globally adjusted map goes into "global_" + fileName
+  void globalBundleAdjusted(const std::vector<KeyFrameSnapshot> &keyFrames);
 
 private:
   CameraModel *cam;
   std::string outputDirectory;
-  PlyHolder cloudHolder;
+  std::string globalFileName;
+  PlyHolder::Format format;
+  int pointsPerChunk;
+  RecordStream *records;
+  // only without the records
+  std::unique_ptr<PlyHolder> cloudHolder;
 };
 
 } // namespace fishdso
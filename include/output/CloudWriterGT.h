@@ -5,16 +5,29 @@
 #include "util/PlyHolder.h"
 #include "util/Sim3Aligner.h"
 #include "util/types.h"
+#include <functional>
 
 namespace fishdso {
 
+// Fills the GT points of the given frame, in the frame's coordinates, and
+// their colors. Is called concurrently for different frames.
+typedef std::function<void(int globalFrameNum, std::vector<Vec3> &points,
+                           std::vector<cv::Vec3b> &colors)>
+    GTPointsSource;
+
+// Writes the GT points of the marginalized keyframes and the frames tracked
+// on them. The points are requested from the source only then, frame by
+// frame, and aligned and written as soon as they are sampled, so that at
+// most framesInFlight frames of points are held in memory. The frames are
+// sampled in parallel, but written in order.
 class CloudWriterGT : public DsoObserver {
 public:
   CloudWriterGT(const StdVector<SE3> &worldToFrameGT,
-                const std::vector<std::vector<Vec3>> &pointsInFrameGT,
-                const std::vector<std::vector<cv::Vec3b>> &colors,
+                const GTPointsSource &pointsSource,
                 const std::string &outputDirectory,
-                const std::string &fileName);
+                const std::string &fileName,
+                PlyHolder::Format format = PlyHolder::BINARY,
+                int pointsPerChunk = 0, int framesInFlight = 4);
 
   void initialized(const std::vector<const KeyFrame *> &initializedKFs);
   void keyFramesMarginalized(const std::vector<const KeyFrame *> &marginalized);
@@ -22,9 +35,9 @@ public:
 
 private:
   StdVector<SE3> worldToFrameGT;
-  std::vector<std::vector<Vec3>> pointsInFrameGT;
-  std::vector<std::vector<cv::Vec3b>> colors;
+  GTPointsSource pointsSource;
   PlyHolder cloudHolder;
+  int framesInFlight;
   std::unique_ptr<Sim3Aligner> sim3Aligner;
 };
 
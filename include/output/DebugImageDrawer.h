@@ -1,9 +1,10 @@
 #ifndef INCLUDE_DEBUGIMAGEDRAWER
 #define INCLUDE_DEBUGIMAGEDRAWER
 
-#include "output/DsoObserver.h"
+#include "output/DsoSnapshotObserver.h"
 #include "output/TrackingDebugImageDrawer.h"
 #include "system/DsoSystem.h"
+#include <optional>
 
 DECLARE_double(debug_rel_point_size);
 DECLARE_int32(debug_image_width);
@@ -11,24 +12,47 @@ DECLARE_double(debug_max_stddev);
 
 namespace fishdso {
 
-class DebugImageDrawer : public DsoObserver {
+// Draws the depths, the visibility and the stddevs of the points projected
+// onto the base keyframe, along with the tracking residuals, as a 2x2 image
+// of debug_image_width. Nothing is drawn until draw() is called, and then
+// right at the output resolution. The projections of the optimized points
+// are kept until the window changes, and the image until the next frame. It
+// only sees the snapshots of the window, so it can be wrapped into
+// AsyncDsoObserver, which should then be flushed before draw().
+class DebugImageDrawer : public DsoSnapshotObserver {
 public:
   DebugImageDrawer();
 
   void created(DsoSystem *newDso, CameraModel *newCam,
                const Settings &newSettings);
-  void newFrame(const PreKeyFrame *newFrame);
-  void newKeyFrame(const KeyFrame *newBaseFrame);
-
+  void newFrame(const FrameSnapshot &newFrame);
+  void newKeyFrame(const KeyFrameSnapshot &newBaseFrame);
+  void
+  keyFramesMarginalized(const std::vector<KeyFrameSnapshot> &marginalized);
+  void frameProcessed(const FrameTimings &timings);
+  bool needsWindow() const { return true; }
+  void windowMapped(const std::vector<KeyFrameSnapshot> &newWindow,
+                    int newBaseIndex);
+
+  // The result is shared with the following calls until the next frame, so
+  // it should not be drawn upon.
   cv::Mat3b draw();
 
 private:
-  DsoSystem *dso;
   CameraModel *cam;
   Settings settings;
-  const KeyFrame *baseFrame;
-  const PreKeyFrame *lastFrame;
+  std::vector<KeyFrameSnapshot> window;
+  int baseIndex;
+  std::optional<SE3> baseToLast;
+  // chosen on the first drawn image, so that the colors stay the same
+  std::optional<DepthColBounds> depthBounds;
   std::unique_ptr<TrackingDebugImageDrawer> residualsDrawer;
+
+  bool areOptimizedProjected;
+  StdVector<Vec2> optPt;
+  std::vector<double> optD;
+  std::vector<double> optStddev;
+  cv::Mat3b lastImage;
 };
 
 } // namespace fishdso
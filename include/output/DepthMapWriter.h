@@ -0,0 +1,67 @@
+#ifndef INCLUDE_DEPTHMAPWRITER
+#define INCLUDE_DEPTHMAPWRITER
+
+#include "output/AsyncObserverAdapter.h"
+#include "output/DsoObserver.h"
+
+namespace fishdso {
+
+// Writes the dense depth of every marginalized keyframe, interpolated over
+// the triangulation of its points, and the confidence of the depth as raw
+// floats for the consumers that need metric depth, never rendering colour
+// images. A keyframe goes into outputDirectory/depth<frame number>.bin:
+//   "FISHDSOD", int32 version, int32 precision (0 for float32, 1 for
+//   float16), int32 frame number, int32 width, int32 height, int32 tile
+//   size, frameToWorld as a 3x4 row-major matrix of doubles,
+// followed by the tiles of tileSize x tileSize pixels in row-major order,
+// the ones on the right and bottom borders cut to the image, each holding
+// its depths row by row and then its confidences. The confidence of a
+// point is 1 / (1 + stddev) of its depth estimate, and both are 0 where
+// there is no depth. Only the points are copied on the calling thread,
+// rasterizing and writing are done on the worker of the adapter, each file
+// replaced at once.
+class DepthMapWriter : public DsoObserver, public AsyncObserverAdapter {
+public:
+  enum Precision { FLOAT32, FLOAT16 };
+
+  struct DepthMap {
+    int frameNum;
+    SE3 frameToWorld;
+    cv::Mat1f depth;
+    cv::Mat1f confidence;
+  };
+
+  DepthMapWriter(CameraModel *cam, const std::string &outputDirectory,
+                 Precision precision = FLOAT32, int tileSize = 64,
+                 int queueSize = 4,
+                 std::shared_ptr<Scheduler> scheduler = nullptr);
+  // writes everything still queued
+  ~DepthMapWriter();
+
+  void keyFramesMarginalized(const std::vector<const KeyFrame *> &marginalized);
+  void destructed(const std::vector<const KeyFrame *> &lastKeyFrames);
+
+  // queues a depth map from the points of a keyframe and their depths and
+  // standard deviations
+  void addDepthMap(int frameNum, const SE3 &frameToWorld,
+                   const StdVector<Vec2> &points,
+                   const std::vector<double> &depths,
+                   const std::vector<double> &stddevs);
+
+  std::string fileName(int frameNum) const;
+  static DepthMap read(const std::string &fname);
+
+private:
+  void write(int frameNum, const SE3 &frameToWorld,
+             const StdVector<Vec2> &points, const std::vector<double> &depths,
+             const std::vector<double> &stddevs) const;
+
+  CameraModel *cam;
+  fs::path outputDirectory;
+  Precision precision;
+  int tileSize;
+};
+
+} // namespace fishdso
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "output/FrameTrackerObserver.h"
 #include "output/TrackingDebugImageDrawer.h"
+#include <optional>
 
 DECLARE_double(pyr_rel_point_size);
 DECLARE_int32(pyr_image_width);
@@ -11,12 +12,17 @@ namespace fishdso {
 
 class DepthPyramidDrawer : public FrameTrackerObserver {
 public:
+  DepthPyramidDrawer(const Settings::DepthColors &depthColors = {});
+
   void newBaseFrame(const DepthedImagePyramid &pyr);
 
   bool pyrChanged();
   cv::Mat getLastPyr();
 
 private:
+  Settings::DepthColors depthColors;
+  // chosen on the first base frame, so that the colors stay the same
+  std::optional<DepthColBounds> depthBounds;
   cv::Mat lastPyr;
   bool mPyrChanged = false;
 };
@@ -3,7 +3,9 @@
 
 #include "system/CameraModel.h"
 #include "system/KeyFrame.h"
+#include "system/PointBudgetController.h"
 #include "system/PreKeyFrame.h"
+#include "util/PoseHistory.h"
 #include <opencv2/opencv.hpp>
 
 namespace fishdso {
@@ -18,10 +20,40 @@ public:
                        const Settings &newSettings) {}
   virtual void
   initialized(const std::vector<const KeyFrame *> &initializedKFs) {}
+  // Called after frame is tracked. Frames that do not become keyframes are
+  // destroyed after mapping, so the pointer should not be kept.
   virtual void newFrame(const PreKeyFrame *frame) {}
   virtual void newKeyFrame(const KeyFrame *baseFrame) {}
   virtual void
   keyFramesMarginalized(const std::vector<const KeyFrame *> &marginalized) {}
+  // Poses of these frames will not change anymore. Chunks come in the order
+  // of frame numbers, the last ones right before destructed().
+  virtual void posesFlushed(const PoseHistory::Chunk &chunk) {}
+  // Called once a tracked frame has been mapped, with the time every stage
+  // took on it. Frames used for initialization are not reported.
+  virtual void frameProcessed(const FrameTimings &timings) {}
+  // Called by mapping after the frame during which a loop was closed, with
+  // the corrected poses of all of the keyframes that have left the window,
+  // by their frame numbers. Loops closed at the end come before
+  // globalBundleAdjusted().
+  virtual void loopClosed(const StdMap<int, Sim3> &worldToKeyFrame) {}
+  // Called after frameProcessed when the adaptive point budget, see
+  // Settings::PointBudget, has changed. It applies from the next keyframe.
+  virtual void pointBudgetChanged(const PointBudget &budget) {}
+  // Whether windowMapped should be called, as the observers that draw the
+  // whole window are the only ones that need it.
+  virtual bool needsWindow() const { return false; }
+  // Called after frameProcessed with the keyframes of the window, oldest
+  // first, and the index of the one the frames are tracked against. Only
+  // if needsWindow() is set.
+  virtual void windowMapped(const std::vector<const KeyFrame *> &window,
+                            int baseIndex) {}
+  // Called on destruction with settings.globalBundleAdjuster.enabled, before
+  // destructed(), with all of the keyframes of the session in chronological
+  // order, after the global bundle adjustment. The last ones are those of
+  // the window, which destructed() gets too.
+  virtual void
+  globalBundleAdjusted(const std::vector<const KeyFrame *> &keyFrames) {}
   virtual void destructed(const std::vector<const KeyFrame *> &lastKeyFrames) {}
 };
 
@@ -0,0 +1,81 @@
+#ifndef INCLUDE_DSOSNAPSHOTOBSERVER
+#define INCLUDE_DSOSNAPSHOTOBSERVER
+
+#include "output/DsoObserver.h"
+#include <memory>
+#include <vector>
+
+namespace fishdso {
+
+// A point of a keyframe, as of the moment of the snapshot.
+struct PointSnapshot {
+  Vec2 p;
+  double depth;
+  double stddev;
+  bool isActive;
+};
+
+// What the observers read from a keyframe, copied so that it stays the same
+// while the system goes on. The pre-keyframe is kept only for its images,
+// which are never written to after they are built, the rest of it may change
+// and should not be read.
+struct KeyFrameSnapshot {
+  explicit KeyFrameSnapshot(const KeyFrame &keyFrame);
+
+  int globalFrameNum;
+  SE3 thisToWorld;
+  AffineLightTransform<double> lightWorldToThis;
+  std::shared_ptr<const PreKeyFrame> preKeyFrame;
+  // only the ones with finite depths
+  StdVector<PointSnapshot> optimizedPoints;
+  // only the ones traced at least once
+  StdVector<PointSnapshot> immaturePoints;
+};
+
+struct FrameSnapshot {
+  explicit FrameSnapshot(const PreKeyFrame &frame);
+
+  int globalFrameNum;
+  SE3 baseToThis;
+  AffineLightTransform<double> lightBaseToThis;
+  double trackRmse;
+};
+
+std::vector<KeyFrameSnapshot>
+takeSnapshots(const std::vector<const KeyFrame *> &keyFrames);
+
+// An observer that gets snapshots instead of the frames and keyframes
+// themselves, so that AsyncDsoObserver can deliver all of its callbacks on
+// another thread. Called directly, it gets the snapshots right away. The
+// callbacks are the same as those of DsoObserver.
+class DsoSnapshotObserver : public DsoObserver {
+public:
+  void
+  initialized(const std::vector<const KeyFrame *> &initializedKFs) final;
+  void newFrame(const PreKeyFrame *frame) final;
+  void newKeyFrame(const KeyFrame *baseFrame) final;
+  void keyFramesMarginalized(
+      const std::vector<const KeyFrame *> &marginalized) final;
+  void globalBundleAdjusted(
+      const std::vector<const KeyFrame *> &keyFrames) final;
+  void windowMapped(const std::vector<const KeyFrame *> &window,
+                    int baseIndex) final;
+  void destructed(const std::vector<const KeyFrame *> &lastKeyFrames) final;
+
+  virtual void
+  initialized(const std::vector<KeyFrameSnapshot> &initializedKFs) {}
+  virtual void newFrame(const FrameSnapshot &frame) {}
+  virtual void newKeyFrame(const KeyFrameSnapshot &baseFrame) {}
+  virtual void
+  keyFramesMarginalized(const std::vector<KeyFrameSnapshot> &marginalized) {}
+  virtual void
+  globalBundleAdjusted(const std::vector<KeyFrameSnapshot> &keyFrames) {}
+  virtual void windowMapped(const std::vector<KeyFrameSnapshot> &window,
+                            int baseIndex) {}
+  virtual void destructed(const std::vector<KeyFrameSnapshot> &lastKeyFrames) {
+  }
+};
+
+} // namespace fishdso
+
+#endif
@@ -12,10 +12,12 @@ public:
 
   virtual void newBaseFrame(const DepthedImagePyramid &pyr) {}
   virtual void startTracking(const ImagePyramid &frame) {}
+  // time is the wall time spent on the level in seconds
   virtual void
   levelTracked(int pyrLevel, const SE3 &baseToLast,
                const AffineLightTransform<double> &affLightBaseToLast,
-               const StdVector<std::pair<Vec2, double>> &pointResiduals) {}
+               const StdVector<std::pair<Vec2, double>> &pointResiduals,
+               int iterations, double time) {}
 };
 
 } // namespace fishdso
@@ -7,7 +7,8 @@ namespace fishdso {
 
 class InterpolationDrawer : public InitializerObserver {
 public:
-  InterpolationDrawer(CameraModel *cam);
+  InterpolationDrawer(CameraModel *cam,
+                      const Settings::DepthColors &depthColors = {});
 
   void initialized(const KeyFrame *lastKeyFrame,
                    const SphericalTerrain *lastTerrain,
@@ -19,6 +20,7 @@ public:
 
 private:
   CameraModel *cam;
+  Settings::DepthColors depthColors;
   bool mDidInitialize;
   cv::Mat3b result;
 };
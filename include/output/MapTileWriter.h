@@ -0,0 +1,90 @@
+#ifndef INCLUDE_MAPTILEWRITER
+#define INCLUDE_MAPTILEWRITER
+
+#include "output/DsoObserver.h"
+#include "util/PlyHolder.h"
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
+namespace fishdso {
+
+// Writes the points of the marginalized keyframes as a voxel-downsampled map
+// split into tiles with levels of detail, for the viewers that stream large
+// maps. Points are averaged in position and colour over the voxels of
+// voxelSize, and the space is cut into cubic tiles of tileVoxels voxels along
+// each side. Every tile is written as levelNum PLY files, level l holding
+// the averages over the cubes of 2^l voxels, into
+//   outputDirectory/<level>/<x>_<y>_<z>.ply
+// along with outputDirectory/tiles.txt, a line "voxel_size tile_voxels
+// level_num" followed by a line per tile with its coordinates and the point
+// counts of its levels. The dirty tiles are rewritten every flushEvery
+// marginalized keyframes, each file replaced at once, so that a viewer never
+// sees a partial one. When more than maxVoxels voxels are held, the tiles
+// touched the longest ago are evicted to outputDirectory/state and read
+// back only when a point falls into them again, which bounds the memory.
+class MapTileWriter : public DsoObserver {
+public:
+  MapTileWriter(CameraModel *cam, const std::string &outputDirectory,
+                double voxelSize, int tileVoxels = 64, int levelNum = 4,
+                int maxVoxels = 4'000'000, int flushEvery = 10,
+                PlyHolder::Format format = PlyHolder::BINARY);
+
+  void keyFramesMarginalized(const std::vector<const KeyFrame *> &marginalized);
+  void destructed(const std::vector<const KeyFrame *> &lastKeyFrames);
+
+  void addPoints(const std::vector<Vec3> &points,
+                 const std::vector<cv::Vec3b> &colors);
+  // rewrites the dirty tiles and the index
+  void flush();
+
+  int heldVoxelCount() const { return heldVoxels; }
+
+private:
+  struct TileKey {
+    int x, y, z;
+    bool operator<(const TileKey &other) const {
+      return std::tie(x, y, z) < std::tie(other.x, other.y, other.z);
+    }
+  };
+
+  struct Voxel {
+    Vec3 positionSum = Vec3::Zero();
+    Vec3 colorSum = Vec3::Zero();
+    int count = 0;
+  };
+
+  struct Tile {
+    // by the index of the voxel inside of the tile
+    std::unordered_map<int, Voxel> voxels;
+    bool isDirty = false;
+    bool isEvicted = false;
+    int lastTouched = 0;
+    std::vector<int> levelPointCounts;
+  };
+
+  std::string tileName(const TileKey &key) const;
+  void writeTile(const TileKey &key, const Tile &tile,
+                 std::vector<int> &levelPointCounts) const;
+  void writeIndex() const;
+  void evict(const TileKey &key, Tile &tile);
+  void restore(const TileKey &key, Tile &tile);
+  void evictOldest();
+
+  CameraModel *cam;
+  fs::path outputDirectory;
+  double voxelSize;
+  int tileVoxels;
+  int levelNum;
+  int maxVoxels;
+  int flushEvery;
+  PlyHolder::Format format;
+
+  std::map<TileKey, Tile> tiles;
+  int heldVoxels = 0;
+  int marginalizedCount = 0;
+};
+
+} // namespace fishdso
+
+#endif
@@ -8,11 +8,13 @@ namespace fishdso {
 class DsoObserver;
 class FrameTrackerObserver;
 class InitializerObserver;
+class ProfilingObserver;
 
 struct Observers {
   std::vector<DsoObserver *> dso;
   std::vector<InitializerObserver *> initializer;
   std::vector<FrameTrackerObserver *> frameTracker;
+  std::vector<ProfilingObserver *> profiling;
 };
 
 } // namespace fishdso
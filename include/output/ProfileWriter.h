@@ -0,0 +1,30 @@
+#ifndef INCLUDE_PROFILEWRITER
+#define INCLUDE_PROFILEWRITER
+
+#include "output/ProfilingObserver.h"
+#include <fstream>
+
+namespace fishdso {
+
+// Writes the frame profiles as they come. CSV gets one row per metric
+// value, JSON gets one object per frame on its own line.
+class ProfileWriter : public ProfilingObserver {
+public:
+  enum Format { CSV, JSON };
+
+  ProfileWriter(const std::string &outputDirectory,
+                const std::string &fileName, Format format);
+
+  void frameProfiled(const FrameProfile &profile) override;
+
+private:
+  void writeCsv(const FrameProfile &profile);
+  void writeJson(const FrameProfile &profile);
+
+  std::ofstream ofs;
+  Format format;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef INCLUDE_PROFILINGOBSERVER
+#define INCLUDE_PROFILINGOBSERVER
+
+#include "util/Profiler.h"
+
+namespace fishdso {
+
+class ProfilingObserver {
+public:
+  virtual ~ProfilingObserver() = 0;
+
+  // Called once a tracked frame has been mapped, with what the instrumented
+  // code recorded since the previous frame was reported. With asynchronous
+  // mapping the tracking of the frames that follow may partially get into
+  // the profile as well. Empty unless built with PROFILING.
+  virtual void frameProfiled(const FrameProfile &profile) {}
+};
+
+} // namespace fishdso
+
+#endif
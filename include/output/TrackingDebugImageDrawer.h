@@ -9,6 +9,10 @@ DECLARE_double(debug_max_residual);
 
 namespace fishdso {
 
+// Keeps the residuals of the last tracked frame and draws them only when
+// asked to, so that an unused drawer costs next to nothing. The images are
+// taken from the pyramid of the frame, so they should be drawn before the
+// next frame is added.
 class TrackingDebugImageDrawer : public FrameTrackerObserver {
 public:
   TrackingDebugImageDrawer(const StdVector<CameraModel> &camPyr,
@@ -18,18 +22,24 @@ public:
   void startTracking(const ImagePyramid &frame);
   void levelTracked(int pyrLevel, const SE3 &baseToLast,
                     const AffineLightTransform<double> &affLightBaseToLast,
-                    const StdVector<std::pair<Vec2, double>> &pointResiduals);
+                    const StdVector<std::pair<Vec2, double>> &pointResiduals,
+                    int iterations, double time);
 
   cv::Mat3b drawAllLevels();
-  cv::Mat3b drawFinestLevel();
+  // The finest tracked level, drawn right at the given size, by default the
+  // one of the frame.
+  cv::Mat3b drawFinestLevel(cv::Size size = cv::Size());
 
 private:
+  cv::Mat3b drawLevel(int levelNum, cv::Size size) const;
+
   Settings::FrameTracker frameTrackerSettings;
   Settings::Pyramid pyrSettings;
 
   StdVector<CameraModel> camPyr;
   std::vector<cv::Mat1b> curFramePyr;
-  std::vector<cv::Mat3b> residualsImg;
+  std::vector<StdVector<std::pair<Vec2, double>>> levelResiduals;
+  std::vector<bool> isLevelTracked;
 };
 
 } // namespace fishdso
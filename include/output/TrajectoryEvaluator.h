@@ -0,0 +1,85 @@
+#ifndef INCLUDE_TRAJECTORYEVALUATOR
+#define INCLUDE_TRAJECTORYEVALUATOR
+
+#include "output/DsoSnapshotObserver.h"
+#include <ostream>
+#include <string>
+
+namespace fishdso {
+
+// Evaluates the trajectory against the ground truth as the final poses are
+// flushed, without keeping it. The estimated camera centers are aligned to
+// the ground truth ones with the Umeyama Sim3, computed from running sums of
+// the positions and their products, and the ATE under that alignment comes
+// from the same sums. The RPE is taken over the pairs of frames rpeDelta
+// apart, with the translations scaled by the scale of the alignment. Thus
+// the result is the one of aligning the whole trajectory at once. If a
+// summary file is given, one record per run is appended to it on
+// destruction of the system, as a line of JSON.
+class TrajectoryEvaluator : public DsoSnapshotObserver {
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  struct Summary {
+    int frameCount;
+    int rpePairNum;
+    // of the ground truth per estimated unit
+    double scale;
+    // in the units of the ground truth
+    double ateRmse;
+    double rpeTransRmse;
+    // in degrees
+    double rpeRotRmse;
+  };
+
+  TrajectoryEvaluator(const StdVector<SE3> &worldToFrameGT, int rpeDelta = 1,
+                      const std::string &summaryFileName = "",
+                      const std::string &runName = "");
+
+  void posesFlushed(const PoseHistory::Chunk &chunk) override;
+  void destructed(const std::vector<KeyFrameSnapshot> &lastKeyFrames) override;
+
+  // of the poses flushed so far, zeros before there are three of them
+  Summary summary() const;
+  // from the estimated world to the ground truth one
+  Sim3 alignment() const;
+  void writeSummary(std::ostream &os) const;
+
+private:
+  struct Recorded {
+    int frameNum;
+    SE3 worldToFrame;
+    SE3 worldToFrameGT;
+  };
+
+  // the rotation, the scale and the translation between the centered
+  // positions
+  bool solveAlignment(Mat33 &rotation, double &scale,
+                      Vec3 &translation) const;
+
+  StdVector<SE3> worldToFrameGT;
+  int rpeDelta;
+  std::string summaryFileName;
+  std::string runName;
+
+  // the last rpeDelta frames
+  StdMap<int, Recorded> recent;
+
+  // Sums over the camera centers, taken relative to the first ones to keep
+  // the cancellation in the products low. x are the estimated ones, y the
+  // ground truth ones.
+  int frameCount;
+  Vec3 originX, originY;
+  Vec3 sumX, sumY;
+  Mat33 sumYX;
+  double sumSqX, sumSqY;
+
+  // sums over the relative motions of the RPE pairs
+  int rpePairNum;
+  double sumSqRelX, sumRelDot, sumSqRelY;
+  double sumSqRotErr;
+};
+
+} // namespace fishdso
+
+#endif
@@ -1,31 +1,32 @@
 #ifndef INCLUDE_TRAJECTORYWRITER
 #define INCLUDE_TRAJECTORYWRITER
 
-#include "output/DsoObserver.h"
-#include <set>
+#include "output/DsoSnapshotObserver.h"
+#include "util/RecordStream.h"
+#include <fstream>
 
 namespace fishdso {
 
-class TrajectoryWriter : public DsoObserver {
+// Appends the final poses to the files of world to frame motions with frame
+// numbers and of frame to world matrices. If a record stream is given, the
+// poses go there instead, and the text files are not created.
+class TrajectoryWriter : public DsoSnapshotObserver {
 public:
   TrajectoryWriter(const std::string &outputDirectory,
                    const std::string &fileName,
-                   const std::string &matrixFormFileName);
+                   const std::string &matrixFormFileName,
+                   RecordStream *records = nullptr);
 
-  void newKeyFrame(const KeyFrame *baseFrame);
-  void keyFramesMarginalized(const std::vector<const KeyFrame *> &marginalized);
-  void destructed(const std::vector<const KeyFrame *> &lastKeyFrames);
+  void posesFlushed(const PoseHistory::Chunk &chunk);
 
   const StdVector<SE3> &writtenFrameToWorld() { return mWrittenFrameToWorld; };
 
 private:
-  std::set<int> curKfNums;
-  StdMap<int, SE3> frameToWorldPool;
-
   StdVector<SE3> mWrittenFrameToWorld;
 
-  std::string outputFileName;
-  std::string matrixFormOutputFileName;
+  RecordStream *records;
+  std::ofstream posesOfs;
+  std::ofstream matrixFormOfs;
 };
 
 } // namespace fishdso
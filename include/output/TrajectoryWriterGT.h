@@ -1,21 +1,20 @@
 #ifndef INCLUDE_TRAJECTORYWRITERGT
 #define INCLUDE_TRAJECTORYWRITERGT
 
-#include "output/DsoObserver.h"
+#include "output/DsoSnapshotObserver.h"
 #include "util/Sim3Aligner.h"
 
 namespace fishdso {
 
-class TrajectoryWriterGT : public DsoObserver {
+class TrajectoryWriterGT : public DsoSnapshotObserver {
 public:
   TrajectoryWriterGT(const StdVector<SE3> &worldToFrameUnalignedGT,
                      const std::string &outputDirectory,
                      const std::string &fileName,
                      const std::string &matrixFormFileName);
 
-  void initialized(const std::vector<const KeyFrame *> &marginalized);
-  void keyFramesMarginalized(const std::vector<const KeyFrame *> &marginalized);
-  void destructed(const std::vector<const KeyFrame *> &lastKeyFrames);
+  void initialized(const std::vector<KeyFrameSnapshot> &initializedKFs);
+  void posesFlushed(const PoseHistory::Chunk &chunk);
 
 private:
   StdVector<SE3> worldToFrameGT;
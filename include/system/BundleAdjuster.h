@@ -3,25 +3,68 @@
 
 #include "system/CameraModel.h"
 #include "system/KeyFrame.h"
+#include <ceres/problem.h>
+#include <map>
 #include <memory>
-#include <set>
+#include <optional>
 #include <sophus/se3.hpp>
+#include <vector>
 
 namespace fishdso {
 
+struct DirectResidual;
+class PosePairCache;
+
+// Long-lived Ceres bundle adjuster. The problem persists between adjust()
+// calls: parameter blocks are created once per keyframe and point, and on
+// every adjust() only the residuals that are missing (new keyframes, new
+// points, points that came back into view) are added, while the ones that
+// went out of bounds are removed. Keyframes must be added in chronological
+// order, the first one defines the gauge. Points classified as outliers can
+// be pruned during the solve, see Settings::BundleAdjuster::pruneOutliers.
 class BundleAdjuster {
 public:
   BundleAdjuster(CameraModel *cam, const BundleAdjusterSettings &_settings);
+  ~BundleAdjuster();
 
+  // Does nothing if keyFrame has already been added.
   void addKeyFrame(KeyFrame *keyFrame);
+  // Removes keyFrame with all the residuals it takes part in. Should be called
+  // before keyFrame or any of its optimized points get destroyed.
+  void removeKeyFrame(KeyFrame *keyFrame);
   void adjust(int maxNumIterations);
 
 private:
-  bool isOOB(const SE3 &worldToBase, const SE3 &worldToRef,
-             const OptimizedPoint &baseOP);
+  struct ResidualRef {
+    ceres::ResidualBlockId id;
+    DirectResidual *residual;
+  };
+  // pattern residual blocks of a point by the keyframe they project onto
+  typedef std::map<KeyFrame *, ResidualRef> PointResiduals;
+
+  // the ray is the unit one through the point on the base frame
+  bool isOOB(const SE3 &baseToRef, const Vec3 &rayInBase, double depth) const;
+
+  void updateGauge();
+  void removeResidualsOnto(KeyFrame *refFrame);
+  // returns the number of point-to-keyframe projections that are OOB
+  int updateResiduals(KeyFrame *baseFrame);
+  // The median intencity difference of a point over its residuals, with the
+  // differences of their last evaluation if there was one. Empty if the
+  // point has no residuals.
+  std::optional<double> medianDiff(const PointResiduals &residuals) const;
+
   CameraModel *cam;
-  std::set<KeyFrame *> keyFrames;
-  KeyFrame *firstKeyFrame;
+  // the problem holds a pointer to it, so it goes first
+  std::unique_ptr<PosePairCache> posePairs;
+  std::unique_ptr<ceres::Problem> problem;
+  std::vector<KeyFrame *> keyFrames;
+  std::map<OptimizedPoint *, PointResiduals> residualsFor;
+
+  // the keyframe with the fixed pose and the one whose translation is
+  // restricted to a sphere around it
+  KeyFrame *gaugeFirst;
+  KeyFrame *gaugeSecond;
 
   BundleAdjusterSettings settings;
 };
@@ -1,13 +1,17 @@
 #ifndef INCLUDE_CAMERAMODEL
 #define INCLUDE_CAMERAMODEL
 
+#include "system/PhotometricCalibration.h"
 #include "util/settings.h"
 #include "util/types.h"
 #include "util/util.h"
 #include <Eigen/Dense>
 #include <Eigen/StdVector>
+#include <cmath>
+#include <memory>
 #include <opencv2/core.hpp>
 #include <string>
+#include <vector>
 
 namespace fishdso {
 
@@ -16,8 +20,23 @@ class CameraModel {
 public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
+  // Coefficients are kept in fixed-capacity storage and the polynomials are
+  // evaluated right from it with Horner's scheme, so that templated map and
+  // unmap do not allocate, which they are called with ceres::Jet in every
+  // residual.
+  static constexpr int maxUnmapPolyDeg = 16;
+  static constexpr int maxMapPolyDeg = 24;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, 1, 0, maxUnmapPolyDeg, 1>
+      UnmapPolyCoeffs;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, 1, 0, maxMapPolyDeg + 1, 1>
+      MapPolyCoeffs;
+
+  // calibFileName is the file the coefficients come from, if any. The map
+  // polynomial fit is cached next to it, see
+  // Settings::CameraModel::cacheMapPolyFit.
   CameraModel(int width, int height, double scale, const Vec2 &center,
-              VecX unmapPolyCoeffs, const Settings::CameraModel &settings = {});
+              VecX unmapPolyCoeffs, const Settings::CameraModel &settings = {},
+              const std::string &calibFileName = "");
   CameraModel(int width, int height, const std::string &calibFileName,
               const Settings::CameraModel &settings = {});
   CameraModel(int width, int height, double f, double cx, double cy,
@@ -26,27 +45,18 @@ public:
   template <typename T> Eigen::Matrix<T, 3, 1> unmap(const T *point) const {
     typedef Eigen::Matrix<T, 3, 1> Vec3t;
     typedef Eigen::Matrix<T, 2, 1> Vec2t;
-    typedef Eigen::Matrix<T, Eigen::Dynamic, 1> VecXt;
     Eigen::Map<const Vec2t> pt_(point);
     Vec2t pt = pt_;
 
-    VecXt p = unmapPolyCoeffs.cast<T>();
     Vec2t c = center.cast<T>();
 
     pt /= scale;
     pt -= c;
 
     T rho2 = pt.squaredNorm();
-    T rho1 = sqrt(rho2);
-
-    T z = p[0];
-    T rhoN = rho2;
-    for (int i = 1; i < unmapPolyDeg; i += 2) {
-      z += rhoN * p[i];
-      if (i + 1 < unmapPolyDeg)
-        z += rhoN * rho1 * p[i + 1];
-      rhoN *= rho2;
-    }
+    T z = T(unmapPolyCoeffs[0]);
+    if (unmapPolyDeg > 1)
+      z += rho2 * unmapPolyTail(sqrt(rho2));
 
     Vec3t res(pt[0], pt[1], z);
     return res;
@@ -55,19 +65,12 @@ public:
   template <typename T> Eigen::Matrix<T, 2, 1> map(const T *point) const {
     typedef Eigen::Matrix<T, 3, 1> Vec3t;
     typedef Eigen::Matrix<T, 2, 1> Vec2t;
-    typedef Eigen::Matrix<T, Eigen::Dynamic, 1> VecXt;
 
     Eigen::Map<const Vec3t> pt_(point);
     Vec3t pt = pt_;
-    VecXt p = mapPolyCoeffs.cast<T>();
 
     T angle = atan2(pt.template head<2>().norm(), pt[2]);
-    T r = p[0];
-    T angleN = angle;
-    for (int i = 1; i < p.rows(); ++i) {
-      r += p[i] * angleN;
-      angleN *= angle;
-    }
+    T r = mapPoly(angle);
 
     Vec2t c = center.cast<T>();
     Vec2t res = pt.template head<2>().normalized() * r;
@@ -77,13 +80,36 @@ public:
   }
 
   EIGEN_STRONG_INLINE Vec3 unmap(const Vec2 &point) const {
+    if (unmapTable) {
+      int x = int(point[0]), y = int(point[1]);
+      if (x == point[0] && y == point[1] && x >= 0 && x < width && y >= 0 &&
+          y < height)
+        return (*unmapTable)[y * width + x];
+    }
     return unmap(point.data());
   }
 
   EIGEN_STRONG_INLINE Vec2 map(const Vec3 &ray) const {
-    return map(ray.data());
+    if (!mapTable)
+      return map(ray.data());
+
+    const std::vector<double> &table = *mapTable;
+    double xyNorm = ray.head<2>().norm();
+    double pos = std::atan2(xyNorm, ray[2]) * mapTableInvStep;
+    int ind = int(pos);
+    if (ind >= int(table.size()) - 1)
+      return map(ray.data());
+    double r = table[ind] + (pos - ind) * (table[ind + 1] - table[ind]);
+
+    Vec2 res = center;
+    if (xyNorm > 0)
+      res += ray.head<2>() * (r / xyNorm);
+    res *= scale;
+    return res;
   }
 
+  // Maps every pixel separately, for repeated undistortion use
+  // makeUndistortMaps.
   template <typename T>
   cv::Mat undistort(const cv::Mat &img, const Mat33 &cameraMatrix) const {
     Mat33 Kinv = cameraMatrix.inverse();
@@ -101,56 +127,148 @@ public:
     return result;
   }
 
+  // Maps for cv::remap from a pinhole image with the given camera matrix and
+  // size to ours, so that an image is undistorted with
+  // cv::remap(img, undistorted, mapX, mapY, cv::INTER_LINEAR).
+  // Computed once for all the frames, in parallel over the rows.
+  std::pair<cv::Mat1f, cv::Mat1f> makeUndistortMaps(const Mat33 &cameraMatrix,
+                                                    cv::Size size) const;
+
   std::pair<Vec2, Mat23> diffMap(const Vec3 &ray) const;
 
+  // map() of n rays given as a structure of arrays. Without lookup tables
+  // the map polynomial is evaluated for all rays at once, which vectorizes.
+  void mapBatch(int n, const double *rayX, const double *rayY,
+                const double *rayZ, double *x, double *y) const;
+
   EIGEN_STRONG_INLINE int getWidth() const { return width; }
   EIGEN_STRONG_INLINE int getHeight() const { return height; }
   EIGEN_STRONG_INLINE Vec2 getImgCenter() const { return scale * center; }
+  EIGEN_STRONG_INLINE double getScale() const { return scale; }
+  EIGEN_STRONG_INLINE const MapPolyCoeffs &getMapPolyCoeffs() const {
+    return mapPolyCoeffs;
+  }
   EIGEN_STRONG_INLINE double getMaxAngle() const { return maxAngle; }
 
+  // Also false for the points outside of the valid image circle, see
+  // Settings::CameraModel::validAngle, and for the masked ones.
   bool isOnImage(const Vec2 &p, int border) const;
 
+  // Pixels that are zero in the mask, like the car hood or the rig in the
+  // view, are not used anywhere. The mask has the size of the image and is
+  // pyramided along with the camera, a pixel of a coarser level is usable
+  // only if all of the pixels it covers are. camPyr() passes it on.
+  void setStaticMask(const cv::Mat1b &mask);
+  EIGEN_STRONG_INLINE bool hasStaticMask() const {
+    return !staticMasks.empty();
+  }
+  EIGEN_STRONG_INLINE const cv::Mat1b &getStaticMask(int level = 0) const {
+    return staticMasks[level];
+  }
+
+  // Applied to every frame as it is brought into its pyramid, null if the
+  // camera is not photometrically calibrated.
+  void setPhotometricCalibration(
+      std::shared_ptr<const PhotometricCalibration> calibration) {
+    photometricCalibration = std::move(calibration);
+  }
+  EIGEN_STRONG_INLINE const PhotometricCalibration *
+  getPhotometricCalibration() const {
+    return photometricCalibration.get();
+  }
+
+  // The valid pixels of a row y on the given pyramid level are the ones with
+  // x in [span[0], span[1]). Rows with no valid pixels have an empty span.
+  // Per-pixel loops go over these instead of the whole rectangle.
+  EIGEN_STRONG_INLINE const std::vector<Vec2i> &
+  getValidSpans(int level = 0) const {
+    return validSpans[level];
+  }
+  EIGEN_STRONG_INLINE const std::vector<std::vector<Vec2i>> &
+  getValidSpansPyramid() const {
+    return validSpans;
+  }
+  EIGEN_STRONG_INLINE bool hasInvalidPixels() const {
+    return validRadius < 1;
+  }
+  // both the valid spans and the static mask, if any
+  cv::Mat1b validMask(int level = 0) const;
+
   double getImgRadiusByAngle(double observeAngle) const;
   void getRectByAngle(double observeAngle, int &width, int &height) const;
 
   void setMapPolyCoeffs();
+  void buildLookupTables();
+  void buildUnmapTable();
+
+  // The file with the map polynomial fit for this calibration and these
+  // settings, next to the calibration file.
+  std::string mapPolyCacheFileName(const std::string &calibFileName) const;
 
   StdVector<CameraModel> camPyr(int pyrLevels);
 
 private:
   friend std::istream &operator>>(std::istream &is, CameraModel &cc);
 
+  // the unmap polynomial is p0 + r^2 * (p1 + p2 * r + ... ), this is the
+  // part in brackets
+  template <typename T> EIGEN_STRONG_INLINE T unmapPolyTail(const T &r) const {
+    T res = T(unmapPolyCoeffs[unmapPolyDeg - 1]);
+    for (int i = unmapPolyDeg - 2; i >= 1; --i)
+      res = res * r + unmapPolyCoeffs[i];
+    return res;
+  }
+  template <typename T> EIGEN_STRONG_INLINE T mapPoly(const T &angle) const {
+    const int n = mapPolyCoeffs.rows();
+    T res = T(mapPolyCoeffs[n - 1]);
+    for (int i = n - 2; i >= 0; --i)
+      res = res * angle + mapPolyCoeffs[i];
+    return res;
+  }
+
   EIGEN_STRONG_INLINE double calcUnmapPoly(double r) const {
-    double rN = r * r;
     double res = unmapPolyCoeffs[0];
-    for (int i = 1; i < unmapPolyDeg; ++i) {
-      res += unmapPolyCoeffs[i] * rN;
-      rN *= r;
-    }
+    if (unmapPolyDeg > 1)
+      res += r * r * unmapPolyTail(r);
     return res;
   }
   EIGEN_STRONG_INLINE double calcMapPoly(double funcVal) const {
-    double funcValN = funcVal;
-    double res = mapPolyCoeffs[0];
-    for (int i = 1; i < mapPolyCoeffs.rows(); ++i) {
-      res += mapPolyCoeffs[i] * funcValN;
-      funcValN *= funcVal;
-    }
-    return res;
+    return mapPoly(funcVal);
   }
 
   void normalize();
+  // setMapPolyCoeffs(), or loading them from the cache if it is enabled and
+  // has them
+  void fitMapPoly(const std::string &calibFileName);
+  bool loadMapPolyCoeffs(const std::string &cacheFileName);
+  void saveMapPolyCoeffs(const std::string &cacheFileName) const;
+  // spans of the valid pixels for all levels down to a 1x1 image
+  void buildValidSpans();
 
   int width, height;
   int unmapPolyDeg;
-  VecX unmapPolyCoeffs;
+  UnmapPolyCoeffs unmapPolyCoeffs;
   Vec2 center;
   double scale;
   double maxRadius;
   double minZ;
   double maxAngle;
-
-  VecX mapPolyCoeffs;
+  // in normalized units, 1 if every pixel is valid
+  double validRadius;
+
+  MapPolyCoeffs mapPolyCoeffs;
+
+  std::vector<std::vector<Vec2i>> validSpans;
+  // empty if there is no mask
+  std::vector<cv::Mat1b> staticMasks;
+  std::shared_ptr<const PhotometricCalibration> photometricCalibration;
+
+  // null if settings.useLookupTables is not set. The map table is in normalized
+  // units, so the levels of camPyr share it, while the unmap table is per pixel
+  // and each level builds its own.
+  std::shared_ptr<const std::vector<Vec3>> unmapTable;
+  std::shared_ptr<const std::vector<double>> mapTable;
+  double mapTableInvStep;
 
   Settings::CameraModel settings;
 };
@@ -0,0 +1,69 @@
+#ifndef INCLUDE_CUBEMAPIMAGE
+#define INCLUDE_CUBEMAPIMAGE
+
+#include "system/CameraModel.h"
+#include "util/BicubicTiles.h"
+#include <array>
+#include <memory>
+
+namespace fishdso {
+
+// A fisheye image resampled once onto the six faces of a cube around the
+// camera, for the keyframes that bundle adjustment samples over and over.
+// A ray is projected onto the face of its largest coordinate with a
+// division, instead of mapping it through the camera model with an atan2
+// and a polynomial, and the jacobian of the projection is as simple. The
+// faces have the resolution of the image at its center times scale, with a
+// border for the bicubic interpolation, and the rays that the camera does
+// not see sample the nearest pixels of the image, like BicubicTiles does
+// outside of it. The faces are interpolated with BicubicTiles, so they are
+// also computed on the first sample and can be released.
+class CubeMapImage {
+public:
+  static constexpr int border = 3;
+
+  CubeMapImage(const CameraModel &cam, const cv::Mat1b &image,
+               double scale = 1);
+
+  // The intencity in the direction of the ray, which need not be
+  // normalized, and its derivative wrt the ray.
+  EIGEN_STRONG_INLINE void
+  evaluate(const Vec3 &ray, double *f,
+           Eigen::Matrix<double, 1, 3> *dfdRay = nullptr) const {
+    Vec3 absRay = ray.cwiseAbs();
+    int m = absRay[0] >= absRay[1] ? (absRay[0] >= absRay[2] ? 0 : 2)
+                                   : (absRay[1] >= absRay[2] ? 1 : 2);
+    int i = (m + 1) % 3, j = (m + 2) % 3;
+    int face = 2 * m + (ray[m] < 0);
+    double invQ = 1 / absRay[m];
+    double u = focal * ray[i] * invQ + center;
+    double v = focal * ray[j] * invQ + center;
+    double dfdv, dfdu;
+    faces[face]->evaluate(v, u, f, dfdRay ? &dfdv : nullptr,
+                          dfdRay ? &dfdu : nullptr);
+    if (dfdRay) {
+      // q = |ray[m]|, du/dray[i] = focal / q, du/dray[m] = -focal * ray[i] *
+      // sign(ray[m]) / q^2 and the same for v
+      double sign = ray[m] < 0 ? -1 : 1;
+      (*dfdRay)[i] = dfdu * focal * invQ;
+      (*dfdRay)[j] = dfdv * focal * invQ;
+      (*dfdRay)[m] = -(dfdu * ray[i] + dfdv * ray[j]) * focal * invQ * invQ *
+                     sign;
+    }
+  }
+
+  // frees the computed tiles of the faces
+  void release();
+
+  int faceSize() const { return faceImages[0].cols; }
+
+private:
+  double focal;
+  double center;
+  std::array<cv::Mat1b, 6> faceImages;
+  std::array<std::unique_ptr<BicubicTiles>, 6> faces;
+};
+
+} // namespace fishdso
+
+#endif
@@ -22,19 +22,35 @@ public:
       const InitializerSettings &settings = {});
 
   // returns true if initialization is completed
-  bool addFrame(const cv::Mat &frame, int globalFrameNum);
+  bool addFrame(const SourceFrame &frame);
 
   StdVector<KeyFrame> createKeyFrames();
 
 private:
+  struct Attempt {
+    std::shared_ptr<PreKeyFrame> frame;
+    bool isMatched = false;
+    SE3 firstToSecond;
+    StdVector<Vec2> keyPoints[2];
+    std::vector<double> depths[2];
+    double medianParallax = 0;
+    double score = 0;
+  };
+
+  void matchCandidates();
+  bool isGoodEnough(const Attempt &attempt) const;
+
   CameraModel *cam;
   DsoSystem *dsoSystem;
   PixelSelector *pixelSelector;
-  StereoMatcher stereoMatcher;
+  // one per candidate in a batch, so that they can match at once
+  std::vector<StereoMatcher> stereoMatchers;
   bool hasFirstFrame;
   int framesSkipped;
-  cv::Mat frames[2];
-  int globalFrameNums[2];
+  // built right away, so that the source buffers can be reused
+  std::shared_ptr<PreKeyFrame> frames[2];
+  StdVector<Attempt> candidates;
+  Attempt bestAttempt;
   int pointsNeeded;
   DebugOutputType debugOutputType;
   InitializerSettings settings;
@@ -1,6 +1,7 @@
 #ifndef INCLUDE_DSOINITIALIZER
 #define INCLUDE_DSOINITIALIZER
 
+#include "system/FrameSource.h"
 #include "system/KeyFrame.h"
 #include "system/StereoMatcher.h"
 #include <memory>
@@ -15,7 +16,7 @@ public:
   virtual ~DsoInitializer() {}
 
   // returns true if initialization is completed
-  virtual bool addFrame(const cv::Mat &frame, int globalFrameNum) = 0;
+  virtual bool addFrame(const SourceFrame &frame) = 0;
 
   virtual StdVector<KeyFrame> createKeyFrames() = 0;
 };
@@ -5,29 +5,73 @@
 #include "system/BundleAdjuster.h"
 #include "system/CameraModel.h"
 #include "system/DsoInitializer.h"
+#include "system/FrameSource.h"
+#include "system/FrameTimings.h"
 #include "system/FrameTracker.h"
+#include "system/GlobalBundleAdjuster.h"
+#include "system/ImuPreintegrator.h"
 #include "system/KeyFrame.h"
+#include "system/KeyFrameDatabase.h"
+#include "system/KeyFrameWindow.h"
+#include "system/KeyFramePolicy.h"
+#include "system/LoopCloser.h"
+#include "system/MarginalizationPolicy.h"
+#include "system/PointBudgetController.h"
+#include "system/SerializerMode.h"
+#include "system/WindowedOptimizer.h"
 #include "util/DepthedImagePyramid.h"
 #include "util/DistanceMap.h"
 #include "util/PlyHolder.h"
+#include "util/PoseHistory.h"
 #include "util/settings.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <opencv2/core.hpp>
 #include <optional>
+#include <thread>
 
 namespace fishdso {
 
 class DsoSystem {
 public:
+  // what Settings::LoadShedding has shed so far
+  struct SheddingStats {
+    int skippedFrames;
+    int untracedFrames;
+    int deferredBa;
+  };
+
+  // The system runs on a single camera. A rig can only be tracked with
+  // FrameTracker::trackRig for now, its frame sets are not accepted here and
+  // the bundle adjuster has no rig poses.
   DsoSystem(CameraModel *cam, const Observers &observers = {},
             const Settings &settings = {});
   DsoSystem(const SnapshotLoader &snapshotLoader, const Observers &observers,
             const Settings &_settings);
   ~DsoSystem();
 
+  // The grayscale image goes into the pyramid without conversion, the colour
+  // one is only obtained when some observer draws the frame.
+  std::shared_ptr<PreKeyFrame> addFrame(const SourceFrame &frame);
+  // BGR frame, converted to gray once and kept for visualization
   std::shared_ptr<PreKeyFrame> addFrame(const cv::Mat &frame,
                                         int globalFrameNum);
+  // Builds the pyramid of a frame without tracking it, so that it can be
+  // done ahead of time on another thread, see FramePipeline. Thread-safe.
+  std::shared_ptr<PreKeyFrame> prepareFrame(const SourceFrame &frame) const;
+  // The same as addFrame(frame), but with the pyramid from prepareFrame.
+  std::shared_ptr<PreKeyFrame>
+  addFrame(const SourceFrame &frame, std::shared_ptr<PreKeyFrame> prepared);
+  // Adds consecutive recorded frames, tracking them in batches, see
+  // Settings::SpeculativeTracking. The results are the same as those of
+  // addFrame for each of them. Falls back to addFrame during the
+  // initialization and with an IMU, load shedding or asynchronous mapping.
+  std::vector<std::shared_ptr<PreKeyFrame>>
+  addFrames(const std::vector<SourceFrame> &frames);
   template <typename PointT>
   void projectOntoBaseKf(StdVector<Vec2> *points, std::vector<double> *depths,
                          std::vector<PointT *> *ptrs,
@@ -35,7 +79,33 @@ public:
 
   void addFrameTrackerObserver(FrameTrackerObserver *observer);
 
-  void saveSnapshot(const std::string &snapshotDir) const;
+  // With an IMU the rotation of each tracked frame is predicted by
+  // integrating the gyro since the previous frame, instead of extrapolating
+  // the last motion. The frames then need timestamps. Measurements should
+  // be added in the thread that adds the frames, before the frame that
+  // follows them, and should cover the time up to it.
+  void enableImu(const SE3 &imuToCam, const Vec3 &gyroBias = Vec3::Zero());
+  void addImuMeasurement(const ImuMeasurement &measurement);
+
+  // With embedded frames the snapshot is restored without the dataset.
+  void saveSnapshot(const std::string &snapshotDir,
+                    SerializerFormat format = BINARY,
+                    FrameEmbedding frameEmbedding = NO_FRAMES) const;
+  // Checkpoints the window into snapshotDir after every new keyframe, with
+  // the changes only, see DeltaSnapshotSaver. SnapshotLoader restores the
+  // last synced checkpoint. Should be called before adding frames.
+  void enableCheckpoints(const std::string &snapshotDir,
+                         SerializerFormat format = BINARY, int syncEvery = 1,
+                         FrameEmbedding frameEmbedding = NO_FRAMES);
+
+  // Number of tracked frames the mapping thread has not processed yet. Always
+  // zero unless settings.threading.asyncMapping is set.
+  int mappingLag() const;
+  // Blocks until the mapping thread has processed every queued frame. Call
+  // it before inspecting keyframes from the outside in asynchronous mode.
+  void waitForMapping() const;
+
+  SheddingStats sheddingStats() const;
 
   // output only
   KeyFrame *lastInitialized;
@@ -45,11 +115,9 @@ public:
   SE3 gtToOur;
 
 private:
-  EIGEN_STRONG_INLINE KeyFrame &lastKeyFrame() {
-    return keyFrames.rbegin()->second;
-  }
+  EIGEN_STRONG_INLINE KeyFrame &lastKeyFrame() { return keyFrames.back(); }
   EIGEN_STRONG_INLINE KeyFrame &lboKeyFrame() {
-    return (++keyFrames.rbegin())->second;
+    return keyFrames[keyFrames.size() - 2].second;
   }
   EIGEN_STRONG_INLINE KeyFrame &baseKeyFrame() {
     return settings.trackFromLastKf ? lastKeyFrame() : lboKeyFrame();
@@ -61,39 +129,156 @@ private:
   SE3 predictBaseKfToCur();
   SE3 purePredictBaseKfToCur();
 
-  void adjustWorldToFrameSizes(int newFrameNum);
+  // Hands the chunks of final poses to the observers and frees them. The
+  // time spent in the observers is booked on the clock if it is given.
+  void flushPoses(bool flushAll, StageClock *clock = nullptr);
 
-  bool didTrackFail();
+  // compares the RMSE with the last one computed on the same pyramid level
+  bool didTrackFail(double trackRmse, int trackRmseLevel);
+  // Tracks the frame from the prediction, recovering or relocalizing it if
+  // tracking fails. The RMSE is left in tracker.lastRmse and
+  // tracker.lastRmseLevel.
+  std::pair<SE3, AffineLightTransform<double>> trackWithFallbacks(
+      FrameTracker &tracker, PreKeyFrame *preKeyFrame, const SE3 &predicted,
+      const std::optional<SO3> &rotationPrior, double timeLastByLbo,
+      const SE3 &baseToLbo, const SE3 &baseToLast, const SE3 &baseToWorld);
+  // stores the tracked motion, notifies the observers and maps the frame
+  void finishFrame(const std::shared_ptr<PreKeyFrame> &preKeyFrame,
+                   double trackRmse, int trackRmseLevel,
+                   const SE3 &baseKfToCur,
+                   const AffineLightTransform<double> &lightBaseKfToCur,
+                   const SE3 &predicted, const SE3 &purePredicted,
+                   const SE3 &baseToWorld, FrameTimings &timings,
+                   StageClock &clock);
+  bool canTrackSpeculatively() const;
+  // Adds a batch of the frames from first on and returns the number of
+  // frames added, which is less than the batch size if one of them became a
+  // keyframe.
+  int addSpeculativeBatch(const std::vector<SourceFrame> &frames, int first,
+                          std::vector<std::shared_ptr<PreKeyFrame>> &added);
+  // Tracks lastFrame from a set of perturbed motion predictions concurrently
+  // and returns the one with the lowest RMSE.
   std::pair<SE3, AffineLightTransform<double>>
-  recoverTrack(PreKeyFrame *lastFrame);
+  recoverTrack(const FrameTracker &tracker, PreKeyFrame *lastFrame,
+               double timeLastByLbo, const SE3 &baseToLbo,
+               const SE3 &baseToLast);
+
+  // Tracks lastFrame against the most similar keyframes of the database on
+  // the coarsest level, and returns the motion from the base keyframe that
+  // the best of them suggests, if any.
+  std::optional<SE3> relocalize(PreKeyFrame *lastFrame,
+                                const SE3 &baseToWorld);
+  std::shared_ptr<const KeyFrameDatabase::Entry>
+  addToDatabase(const KeyFrame &keyFrame);
 
   bool doNeedKf(PreKeyFrame *lastFrame);
-  void marginalizeFrames();
+  KeyFrameCues keyFrameCues(const PreKeyFrame &frame,
+                            int framesSinceKeyFrame) const;
+  // part of the active points of the keyframe that project onto the other
+  double visibleRatio(const KeyFrame &keyFrame, const KeyFrame &other) const;
+  void marginalizeFrames(StageClock *clock);
   void activateNewOptimizedPoints();
 
+  // gives a late frame the predicted pose instead of tracking it
+  void skipFrame(int globalFrameNum);
+  // Settings::LoadShedding says that mapping does not keep up
+  bool isMappingBehind(const PreKeyFrame &preKeyFrame) const;
+  void tracePoints(const PreKeyFrame &preKeyFrame);
+  void mapFrame(const std::shared_ptr<PreKeyFrame> &preKeyFrame);
+  void notifyFrameProcessed(const PreKeyFrame &preKeyFrame);
+  // Hands the loops closed since the last call to the observers. Called by
+  // mapping, so that the observers are never called from the thread of the
+  // loop closer.
+  void notifyLoopsClosed();
+  // sets up the optional subsystems the settings enable
+  void initSubsystems();
+  void mappingLoop();
+  void startMapping();
+  // makes baseKeyFrame() the one new frames are tracked against
+  void publishTrackingBase(std::unique_ptr<DepthedImagePyramid> baseForTrack);
+
   CameraModel *cam;
   StdVector<CameraModel> camPyr;
 
   PixelSelector pixelSelector;
 
+  // storage of frames in flight: the queued ones, the one being tracked and
+  // the one being mapped
+  std::shared_ptr<FrameBufferPool> frameBufferPool;
+
   std::unique_ptr<DsoInitializer> dsoInitializer;
   bool isInitialized;
 
-  std::unique_ptr<FrameTracker> frameTracker;
+  // Base frame that new frames are tracked against. With asynchronous mapping
+  // it is replaced by the mapping thread, so it is guarded by trackingMutex
+  // along with the frame poses.
+  std::shared_ptr<FrameTracker> frameTracker;
+  KeyFrame *trackingBaseKf;
+  SE3 trackingBaseToWorld;
+  mutable std::mutex trackingMutex;
 
-  StdMap<int, KeyFrame> keyFrames;
+  // holds settings.maxKeyFrames + 1 of them, the window and the new one
+  KeyFrameWindow keyFrames;
+  // exactly one of these is non-null
+  std::unique_ptr<BundleAdjuster> bundleAdjuster;
+  std::unique_ptr<WindowedOptimizer> windowedOptimizer;
+  // only with settings.keyFrameDatabase.enabled
+  std::unique_ptr<KeyFrameDatabase> keyFrameDatabase;
+  // only with settings.loopClosure.enabled and the database
+  std::unique_ptr<LoopCloser> loopCloser;
+  // corrected poses from the loop closer, waiting for notifyLoopsClosed
+  std::vector<StdMap<int, Sim3>> closedLoops;
+  std::mutex closedLoopsMutex;
+  // only with settings.globalBundleAdjuster.enabled, keeps the marginalized
+  // keyframes and adjusts them on destruction
+  std::unique_ptr<GlobalBundleAdjuster> globalBundleAdjuster;
+  // only with settings.keyFramePolicy.enabled, replaces the fixed
+  // shiftBetweenKeyFrames
+  std::unique_ptr<KeyFramePolicy> keyFramePolicy;
+  // only with settings.marginalization.enabled, replaces marginalizing the
+  // oldest keyframes
+  std::unique_ptr<MarginalizationPolicy> marginalizationPolicy;
+  // only with settings.pointBudget.enabled, its budget is applied to the
+  // settings
+  std::unique_ptr<PointBudgetController> pointBudgetController;
+  // only after enableCheckpoints
+  std::unique_ptr<DeltaSnapshotSaver> checkpointSaver;
 
-  std::vector<int> frameNumbers;
-  StdVector<SE3> worldToFrame;
-  StdVector<SE3> worldToFramePredict;
+  PoseHistory poseHistory;
 
   AffineLightTransform<double> lightKfToLast;
 
-  double lastTrackRmse;
+  std::unique_ptr<ImuPreintegrator> imu;
+  std::optional<double> lastFrameTimestamp;
+
+  // per the pyramid level the RMSE is computed on, see
+  // FrameTracker::lastRmseLevel
+  std::vector<double> lastTrackRmse;
+
+  std::atomic<int> skippedFrameNum{0};
+  std::atomic<int> untracedFrameNum{0};
+  std::atomic<int> deferredBaNum{0};
+  // only touched by mapping
+  int consecutiveDeferredBa = 0;
+  // tracking RMSE of the first frame after the last keyframe, zero until it
+  // is mapped
+  double referenceTrackRmse = 0;
 
   Settings settings;
+  // Shared by all of the keyframes and the trackers, and through the
+  // keyframes by their points. The adaptations of the point budget do not
+  // touch these parts of the settings.
+  std::shared_ptr<const PointTracerSettings> tracingSettings;
+  std::shared_ptr<const FrameTrackerSettings> trackerSettings;
 
   Observers observers;
+
+  std::deque<std::shared_ptr<PreKeyFrame>> mappingQueue;
+  bool isMappingBusy;
+  bool doStopMapping;
+  mutable std::mutex mappingMutex;
+  mutable std::condition_variable mappingCv;
+  std::thread mappingThread;
 };
 
 } // namespace fishdso
@@ -0,0 +1,47 @@
+#ifndef INCLUDE_FRAMEBUFFERPOOL
+#define INCLUDE_FRAMEBUFFERPOOL
+
+#include "util/ImagePyramid.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fishdso {
+
+class PreKeyFrameInternals;
+
+// Per-frame storage of a PreKeyFrame that depends only on the image size:
+// the grayscale pyramid and the interpolation data.
+struct FrameBuffers {
+  FrameBuffers();
+  FrameBuffers(FrameBuffers &&other);
+  FrameBuffers &operator=(FrameBuffers &&other);
+  ~FrameBuffers();
+
+  ImagePyramid framePyr;
+  std::unique_ptr<PreKeyFrameInternals> internals;
+};
+
+// Recycles FrameBuffers of destroyed PreKeyFrames, so that in the steady
+// state new frames reuse the storage of the frames that did not become
+// keyframes instead of allocating. Can be used from several threads.
+class FrameBufferPool {
+public:
+  // At most maxFree released buffers are kept, the rest are freed.
+  FrameBufferPool(int maxFree);
+
+  // Returns empty buffers if there are no free ones.
+  FrameBuffers acquire();
+  void release(FrameBuffers &&buffers);
+
+  int freeCount() const;
+
+private:
+  std::vector<FrameBuffers> freeBuffers;
+  int maxFree;
+  mutable std::mutex mutex;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef INCLUDE_FRAMEPIPELINE
+#define INCLUDE_FRAMEPIPELINE
+
+#include "system/DsoSystem.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace fishdso {
+
+// Feeds recorded frames into DsoSystem in three overlapping stages: the
+// frames are decoded and their pyramids are built by prepareThreads threads,
+// while a single thread adds the prepared ones to the system in the order
+// of submission, tracking and (without asynchronous mapping) mapping them.
+// The throughput then approaches that of the slowest stage instead of that
+// of their sum. At most depth submitted frames are not yet added, so
+// submitFrame blocks when the pipeline is full. The observers of the system
+// are called from the adding thread and, with asynchronous mapping, from
+// the mapping one.
+class FramePipeline {
+public:
+  // What addFrame returned for a frame, null if it was not tracked, i.e. it
+  // went into the initializer or was skipped.
+  struct Result {
+    int globalFrameNum;
+    std::shared_ptr<PreKeyFrame> preKeyFrame;
+  };
+
+  FramePipeline(DsoSystem *dso, int depth = 4, int prepareThreads = 1);
+  // waits for the submitted frames to be added
+  ~FramePipeline();
+
+  void submitFrame(SourceFrame frame);
+  // decode is called on a preparation thread. The frame numbers it gives
+  // should increase in the order of submission.
+  void submitFrame(std::function<SourceFrame()> decode);
+
+  // The result of the next frame in the order of submission, if it has
+  // already been added. The results are kept until they are polled, so they
+  // should be polled regularly on long runs, as they hold the frames.
+  std::optional<Result> poll();
+  // blocks until every frame submitted so far is added
+  void finish();
+
+  int inFlight() const;
+
+private:
+  struct Prepared {
+    SourceFrame frame;
+    std::shared_ptr<PreKeyFrame> preKeyFrame;
+  };
+
+  void prepareLoop();
+  void addLoop();
+
+  DsoSystem *dso;
+  int depth;
+
+  // submitted frames waiting for a preparation thread, with their sequence
+  // numbers
+  std::deque<std::pair<int, std::function<SourceFrame()>>> toPrepare;
+  // prepared frames by their sequence numbers, possibly out of order
+  std::map<int, Prepared> prepared;
+  std::deque<Result> results;
+  int submittedNum = 0;
+  int addedNum = 0;
+  bool doStop = false;
+  mutable std::mutex mutex;
+  std::condition_variable cv;
+
+  std::vector<std::thread> prepareThreads;
+  std::thread addThread;
+};
+
+} // namespace fishdso
+
+#endif
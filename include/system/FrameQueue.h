@@ -0,0 +1,43 @@
+#ifndef INCLUDE_FRAMEQUEUE
+#define INCLUDE_FRAMEQUEUE
+
+#include "system/FrameSource.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace fishdso {
+
+// Hands the frames of a capture thread over to the thread that adds them to
+// DsoSystem, stamping them with the time they arrived. With
+// Settings::LoadShedding the frames that waited here for too long are
+// skipped by DsoSystem, so the queue itself never drops any. push blocks
+// while the queue is full, tryPush drops the frame instead, as the driver of
+// a live camera would.
+class FrameQueue : public FrameSource {
+public:
+  FrameQueue(int capacity = 8);
+
+  void push(SourceFrame frame);
+  // false if the queue is full
+  bool tryPush(SourceFrame frame);
+  // No frames will be pushed anymore, next returns false once the queue is
+  // empty.
+  void close();
+
+  // blocks until there is a frame or the queue is closed
+  bool next(SourceFrame &frame) override;
+
+  int size() const;
+
+private:
+  int capacity;
+  mutable std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<SourceFrame> frames;
+  bool isClosed = false;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef INCLUDE_FRAMEREPLAYER
+#define INCLUDE_FRAMEREPLAYER
+
+#include "system/DsoSystem.h"
+#include "system/FrameQueue.h"
+#include <vector>
+
+namespace fishdso {
+
+// Plays recorded frames back into DsoSystem the way a live camera would
+// deliver them. A release thread pushes each frame into a FrameQueue at its
+// timestamp, or at a fixed rate, and drops it if the queue is full, as a
+// camera driver does, while run adds the frames from the queue to the
+// system. So the system sees the cadence of the camera instead of being fed
+// as fast as it goes, which is what load shedding and asynchronous mapping
+// need to be validated with.
+class FrameReplayer {
+public:
+  struct Stats {
+    int released = 0;
+    // found the queue full
+    int dropped = 0;
+    // skipped by Settings::LoadShedding after waiting in the queue
+    int skipped = 0;
+    // tracked after the release of the next frame
+    int deadlineMisses = 0;
+    // From the release of a frame to the return of addFrame with its pose,
+    // in seconds, for every tracked frame in order. The initialization
+    // frames have no pose of their own and are not included.
+    std::vector<double> latencies;
+    // the number of frames waiting in the queue at each release
+    std::vector<int> queueDepths;
+  };
+
+  // With zero fps the frames are released at their timestamps divided by
+  // speed, the first one right away. Otherwise every 1 / fps seconds.
+  FrameReplayer(std::vector<SourceFrame> frames, double fps = 0,
+                double speed = 1, int queueCapacity = 2);
+
+  // Replays all the frames and waits for the mapping of the last one.
+  Stats run(DsoSystem &dso);
+
+private:
+  void releaseLoop(
+      FrameQueue &queue,
+      const std::vector<std::chrono::steady_clock::time_point> &releaseTimes,
+      Stats &stats) const;
+
+  std::vector<SourceFrame> frames;
+  double fps;
+  double speed;
+  int queueCapacity;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef INCLUDE_FRAMESOURCE
+#define INCLUDE_FRAMESOURCE
+
+#include <chrono>
+#include <functional>
+#include <opencv2/core.hpp>
+
+namespace fishdso {
+
+// Produces the colour image of a frame. It is only ever called by
+// visualization and output code, at most once per frame and possibly long
+// after the frame was added, so it should not rely on transient buffers.
+typedef std::function<cv::Mat3b()> ColorProvider;
+
+// A frame as handed over by a capture pipeline. Tracking needs only the
+// grayscale image. If gray owns its data (a refcounted cv::Mat) it becomes
+// the base of the frame pyramid as is, so the caller must not write into it
+// afterwards. A view of foreign memory (e.g. a driver buffer) is copied once
+// into the pooled pyramid storage before addFrame returns. Without a
+// colorProvider the colour image is made out of gray when requested. The
+// timestamp, in seconds, is only needed to match the frame with IMU
+// measurements. The arrival time is when the frame was captured or queued,
+// see FrameQueue. It is only needed for Settings::LoadShedding, and the
+// default one means that the frame is never late.
+struct SourceFrame {
+  cv::Mat1b gray;
+  ColorProvider colorProvider;
+  int globalFrameNum;
+  double timestamp = 0;
+  std::chrono::steady_clock::time_point arrivalTime = {};
+};
+
+class FrameSource {
+public:
+  virtual ~FrameSource() = default;
+
+  // returns false if there are no frames left
+  virtual bool next(SourceFrame &frame) = 0;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef INCLUDE_FRAMETIMINGS
+#define INCLUDE_FRAMETIMINGS
+
+#include <array>
+#include <chrono>
+
+namespace fishdso {
+
+// Wall time in seconds that the processing of one frame took, by stage.
+struct FrameTimings {
+  enum Stage {
+    TRACKING, // including the pyramid construction
+    TRACING,
+    KEYFRAME_CREATION, // point selection, marginalization, new tracking base
+    BUNDLE_ADJUSTMENT,
+    OBSERVERS, // time spent inside DsoObserver callbacks
+    STAGE_NUM
+  };
+
+  static const char *stageName(Stage stage);
+
+  double total() const;
+
+  int globalFrameNum = -1;
+  bool isKeyFrame = false;
+  std::array<double, STAGE_NUM> seconds = {};
+};
+
+// Books the wall time to the stages of one FrameTimings: whatever passed
+// since the previous switch goes to the stage that was running.
+class StageClock {
+public:
+  // Makes stage the running one for its lifetime and then switches back.
+  // Does nothing with a null clock.
+  class Switch {
+  public:
+    Switch(StageClock *clock, FrameTimings::Stage stage);
+    ~Switch();
+
+  private:
+    StageClock *clock;
+    FrameTimings::Stage previous;
+  };
+
+  StageClock(FrameTimings &timings, FrameTimings::Stage stage);
+  ~StageClock();
+
+  // returns the stage that was running before
+  FrameTimings::Stage switchTo(FrameTimings::Stage stage);
+  // Books the running stage, afterwards the clock does nothing.
+  void stop();
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  FrameTimings &timings;
+  FrameTimings::Stage running;
+  Clock::time_point since;
+  bool isStopped;
+};
+
+} // namespace fishdso
+
+#endif
@@ -5,6 +5,8 @@
 #include "system/CameraModel.h"
 #include "system/KeyFrame.h"
 #include "util/DepthedImagePyramid.h"
+#include "util/ImageSampler.h"
+#include <optional>
 
 namespace fishdso {
 
@@ -12,14 +14,61 @@ class FrameTrackerObserver;
 
 class FrameTracker {
 public:
+  // One of the cameras of a rig, rigidly attached to the body.
+  struct RigCamera {
+    const StdVector<CameraModel> *camPyr;
+    SE3 bodyToCam;
+  };
+
+  FrameTracker(const StdVector<CameraModel> &camPyr,
+               std::unique_ptr<DepthedImagePyramid> _baseFrame,
+               const std::vector<FrameTrackerObserver *> &observers = {},
+               const FrameTrackerSettings &_settings = {});
+  // The same, sharing the settings with the other trackers instead of
+  // copying them.
   FrameTracker(const StdVector<CameraModel> &camPyr,
                std::unique_ptr<DepthedImagePyramid> _baseFrame,
+               const std::vector<FrameTrackerObserver *> &observers,
+               std::shared_ptr<const FrameTrackerSettings> _settings);
+  // A tracker for a rig, with a base frame per camera. The camera pyramids
+  // should outlive the tracker. Observers are given the base frame of the
+  // first camera. DsoSystem does not build one, the base frames and their
+  // depths are up to the caller.
+  FrameTracker(const StdVector<RigCamera> &rig,
+               std::vector<std::unique_ptr<DepthedImagePyramid>> _baseFrames,
                const std::vector<FrameTrackerObserver *> &observers = {},
                const FrameTrackerSettings &_settings = {});
 
+  // The rotation prior, if given, is the rotation of baseToTracked, usually
+  // integrated from an IMU. It is weighted with
+  // settings.frameTracker.rotationPriorWeight.
   std::pair<SE3, AffineLightTransform<double>>
   trackFrame(const PreKeyFrame &frame, const SE3 &coarseBaseToTracked,
-             const AffineLightTransform<double> &coarseAffLight);
+             const AffineLightTransform<double> &coarseAffLight,
+             const std::optional<SO3> &rotationPrior = std::nullopt);
+
+  // Same as trackFrame, but stops at minPyrLevel, notifies no observers and
+  // writes the RMSE on the last tracked level and that level to rmse and
+  // rmseLevel instead of lastRmse and lastRmseLevel. It does not modify the
+  // tracker, so several frames or initial motions can be tracked concurrently.
+  std::pair<SE3, AffineLightTransform<double>>
+  trackFrameQuiet(const PreKeyFrame &frame, const SE3 &coarseBaseToTracked,
+                  const AffineLightTransform<double> &coarseAffLight,
+                  int minPyrLevel, double *rmse,
+                  int *rmseLevel = nullptr) const;
+
+  // Tracks a synchronized frame set of the rig, one frame per camera, in
+  // the order of the rig. A single motion of the body from the base frame
+  // set to the tracked one is optimized with the residuals of all cameras,
+  // and an affine light transform per camera. The cameras are linearized in
+  // parallel. It writes the RMSE over all of the cameras to lastRmse and
+  // reports no per-level results to the observers.
+  std::pair<SE3, std::vector<AffLight>>
+  trackRig(const std::vector<const PreKeyFrame *> &frames,
+           const SE3 &coarseBaseToTracked,
+           const std::vector<AffLight> &coarseAffLights);
+
+  int cameraNum() const { return cameras.size(); }
 
   void addObserver(FrameTrackerObserver *observer);
 
@@ -27,22 +76,97 @@ public:
   std::vector<cv::Mat3b> residualsImg;
 
   double lastRmse;
+  // The pyramid level lastRmse is computed on, 1 if the finest level was
+  // skipped. The RMSEs of different levels are not comparable.
+  int lastRmseLevel;
+
+  // Linearization of the analytic tracking over a set of points, see
+  // linearizeTracking in FrameTracker.cpp.
+  typedef double (*LinearizeFunc)(
+      const CameraModel &cam, const ImageSampler &trackedFrame,
+      ImageSampler::Interpolation interpolation,
+      const StdVector<Vec3> &positions, const std::vector<double> &intensities,
+      const std::vector<double> &weights, const SE3 &baseToTracked,
+      const AffLight &affLight, double outlierDiff, Mat88 *H, Vec8 *b,
+      StdVector<Vec2> *onTracked, std::vector<double> *residuals);
 
 private:
+  // Points of the base frame on one pyramid level with everything tracking
+  // needs precomputed, as a structure of arrays.
+  struct BasePoints {
+    inline int size() const { return depth.size(); }
+    inline Vec3 position(int i) const {
+      return Vec3(rayX[i], rayY[i], rayZ[i]) * double(depth[i]);
+    }
+
+    std::vector<float> x, y;
+    std::vector<float> rayX, rayY, rayZ;
+    std::vector<float> depth;
+    std::vector<float> intensity;
+    std::vector<float> weight;
+    // Only with settings.frameTracker.useInverseCompositional, the gradient
+    // of the base image times the Jacobian of its projection wrt a left
+    // increment of the point, translation first.
+    StdVector<Vec6> steepestDescent;
+  };
+
+  struct TrackedCamera {
+    const StdVector<CameraModel> *camPyr;
+    SE3 bodyToCam;
+    std::unique_ptr<DepthedImagePyramid> baseFrame;
+    std::vector<BasePoints> basePoints;
+  };
+
+  void fillBasePoints(TrackedCamera &camera);
+  // Keeps maxPoints of the points on the level, the most informative ones
+  // in each cell of a grid over the image first. The information of a point
+  // is the squared norm of its steepest descent row.
+  void subsampleBasePoints(BasePoints &level,
+                           const StdVector<Vec6> &steepestDescent,
+                           const CameraModel &cam, int maxPoints) const;
+
+  std::pair<SE3, AffineLightTransform<double>>
+  trackLevels(const PreKeyFrame &frame, const SE3 &coarseBaseToTracked,
+              const AffineLightTransform<double> &coarseAffLight,
+              int minPyrLevel, bool notifyObservers, double *rmse,
+              int *rmseLevel, const SO3 *rotationPrior = nullptr) const;
+
   std::pair<SE3, AffineLightTransform<double>>
-  trackPyrLevel(const CameraModel &cam, const cv::Mat1b &baseImg,
-                const cv::Mat1d &baseDepths, const cv::Mat1b &trackedImg,
+  trackPyrLevel(const CameraModel &cam, const BasePoints &basePoints,
                 const PreKeyFrameInternals &trackedImgInternals,
                 const SE3 &coarseBaseToTracked,
                 const AffineLightTransform<double> &coarseAffLight,
-                int pyrLevel);
+                int pyrLevel, bool notifyObservers, double *rmse,
+                const SO3 *rotationPrior) const;
 
-  const StdVector<CameraModel> &camPyr;
-  std::unique_ptr<DepthedImagePyramid> baseFrame;
+  std::pair<SE3, AffineLightTransform<double>>
+  trackPyrLevelAnalytic(const CameraModel &cam, const BasePoints &basePoints,
+                        const PreKeyFrameInternals &trackedImgInternals,
+                        const SE3 &coarseBaseToTracked,
+                        const AffineLightTransform<double> &coarseAffLight,
+                        int pyrLevel, bool notifyObservers,
+                        double *rmse, const SO3 *rotationPrior) const;
+
+  // writes the sum of squared residuals and their number to sqSum and
+  // residualNum
+  std::pair<SE3, std::vector<AffLight>>
+  trackRigLevel(const std::vector<const PreKeyFrame *> &frames,
+                const SE3 &coarseBaseToTracked,
+                const std::vector<AffLight> &coarseAffLights, int pyrLevel,
+                double *sqSum, int *residualNum) const;
+
+  // the single camera tracker has one with the identity extrinsics
+  StdVector<TrackedCamera> cameras;
   int displayWidth, displayHeight;
 
+  // The linearization specialized for the precision, the affine light
+  // being optimized or fixed and the gradient weighting of the settings.
+  static LinearizeFunc
+  chooseLinearizeKernel(const FrameTrackerSettings &settings);
+
   std::vector<FrameTrackerObserver *> observers;
-  FrameTrackerSettings settings;
+  std::shared_ptr<const FrameTrackerSettings> settings;
+  LinearizeFunc linearizeKernel;
 };
 
 } // namespace fishdso
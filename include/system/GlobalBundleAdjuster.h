@@ -0,0 +1,50 @@
+#ifndef INCLUDE_GLOBALBUNDLEADJUSTER
+#define INCLUDE_GLOBALBUNDLEADJUSTER
+
+#include "system/CameraModel.h"
+#include "system/KeyFrame.h"
+#include "util/settings.h"
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace fishdso {
+
+// Keeps the keyframes that have left the window and bundle adjusts all of
+// them at the end of the session, see Settings::GlobalBundleAdjuster. Every
+// submap is solved by a BundleAdjuster of its own over copies of its
+// keyframes, so the submaps can go in parallel. The first keyframe of a
+// submap is its gauge, and it also belongs to the previous submap, so the
+// results are chained by moving each submap onto the adjusted pose and
+// light of its first keyframe. Every keyframe takes its result from a single
+// submap, the one with the keyframe farther from its ends.
+class GlobalBundleAdjuster {
+public:
+  GlobalBundleAdjuster(CameraModel *cam,
+                       const BundleAdjusterSettings &baSettings,
+                       const Settings::GlobalBundleAdjuster &settings);
+
+  // Takes over a keyframe marginalized from the window. Only what bundle
+  // adjustment needs is kept: the pyramid, the pose, the affine light and
+  // the optimized points with finite depths.
+  void addKeyFrame(KeyFrame &&keyFrame);
+  int keyFrameNum() const;
+
+  // Adjusts the kept keyframes followed by lastKeyFrames, the current
+  // window, in place. Returns all of them in chronological order.
+  std::vector<KeyFrame *> adjust(const std::vector<KeyFrame *> &lastKeyFrames);
+
+  // [begin, end) ranges of keyframe indices covering kfNum keyframes
+  static std::vector<std::pair<int, int>>
+  submapRanges(int kfNum, int submapSize, int overlap);
+
+private:
+  CameraModel *cam;
+  std::vector<std::unique_ptr<KeyFrame>> keyFrames;
+  BundleAdjusterSettings baSettings;
+  Settings::GlobalBundleAdjuster settings;
+};
+
+} // namespace fishdso
+
+#endif
@@ -3,8 +3,11 @@
 
 #include "system/AffineLightTransform.h"
 #include "system/CameraModel.h"
+#include "system/ImmaturePointBlock.h"
 #include "system/PreKeyFrame.h"
 #include "system/SerializerMode.h"
+#include "util/ImageSampler.h"
+#include "util/MemoryAccounting.h"
 #include "util/settings.h"
 #include "util/types.h"
 
@@ -14,7 +17,27 @@ struct KeyFrame;
 
 template <SerializerMode mode> class PointSerializer;
 
-struct ImmaturePoint {
+// What tracing the points of one keyframe on one frame has in common. It is
+// computed once per pair, not for every point.
+struct TracingContext {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  TracingContext(const KeyFrame &baseFrame, const PreKeyFrame &refFrame);
+
+  const KeyFrame &baseFrame;
+  const PreKeyFrame &refFrame;
+  SE3 baseToRef;
+  AffineLightTransform<double> lightBaseToRef;
+  // the ray through the base camera's center, where the epipolar curves of
+  // all of the points start from at zero depth
+  Vec3 epipole;
+};
+
+struct ImmaturePointsMemory {
+  static constexpr const char *name = "memory.immaturePoints";
+};
+
+struct ImmaturePoint : CountedObject<ImmaturePointsMemory, ImmaturePoint> {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
   enum State { ACTIVE, OOB, OUTLIER };
@@ -29,14 +52,22 @@ struct ImmaturePoint {
     INF_ENERGY,
     BIG_ENERGY,
     SMALL_ABS_SECOND_BEST,
-    LOW_QUALITY
+    LOW_QUALITY,
+    CONVERGED
   };
 
+  static constexpr int MPS = Settings::ResidualPattern::maxSize;
+
   // TODO create PointTracer!!!
-  ImmaturePoint(KeyFrame *baseFrame, const Vec2 &p,
-                const PointTracerSettings &_settings = {});
+  // The point shares the tracing settings of its keyframe and keeps its
+  // pattern data in the given slot of the block of the keyframe. Copies of
+  // the point share the slot.
+  ImmaturePoint(KeyFrame *baseFrame, const Vec2 &p, int slot);
+  // appends a slot to the block of the keyframe
   ImmaturePoint(KeyFrame *baseFrame, PointSerializer<LOAD> &pointSerializer);
 
+  TracingStatus traceOn(const TracingContext &context,
+                        TracingDebugType debugType);
   TracingStatus traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
                         TracingDebugType debugType);
 
@@ -47,20 +78,34 @@ struct ImmaturePoint {
 
   bool isReady(); // checks if the point is good enough to be optimized
 
+  // Fuses an inverse depth measurement with the given variance in the
+  // filter. Marks the point as an outlier and returns false once the inlier
+  // ratio drops below pointTracer.minInlierRatio.
+  bool updateDepthFilter(double invDepth, double variance);
+  bool isFilterConverged() const;
+
+  // the pattern data, only the first pattern().size() values are meaningful
+  ImmaturePointBlockBase::PatternRef pattern() const {
+    return block->pattern(slot);
+  }
+
   Vec2 p;
-  std::vector<Vec3> baseDirections;
-  std::vector<double> baseIntencities;
-  StdVector<Vec2> baseGrad;
-  StdVector<Vec2> baseGradNorm;
+  ImmaturePointBlockBase *block;
+  int slot;
   double minDepth, maxDepth;
   double depth;
   double bestQuality;
   double lastEnergy;
   double stddev; // predicted disparity error on last successful tracing
+  // Inverse depth filter, used with pointTracer.useDepthFilter. The variance
+  // is INF before the first update. It is not stored in snapshots, loaded
+  // points start over.
+  double filterMean, filterVar;
+  double filterA, filterB; // Beta distribution over the inlier ratio
   CameraModel *cam;
   State state;
 
-  PointTracerSettings settings;
+  std::shared_ptr<const PointTracerSettings> settings;
 
   // output only
   bool lastTraced;
@@ -72,14 +117,28 @@ struct ImmaturePoint {
   double eBeforeSubpixel, eAfterSubpixel;
 
 private:
-  bool pointsToTrace(const SE3 &baseToRef, Vec3 &dirMinDepth, Vec3 &dirMaxDepth,
+  bool pointsToTrace(Vec3 &dirMinDepth, Vec3 &dirMaxDepth,
                      StdVector<Vec2> &points, std::vector<Vec3> &directions);
-  double estVariance(const Vec2 &searchDirection);
-  Vec2 tracePrecise(
-      const ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>>
-          &refFrame,
-      const Vec2 &from, const Vec2 &to, const std::vector<double> &intencities,
-      const StdVector<Vec2> &pattern, double &bestDispl, double &bestEnergy);
+
+  // pixels the point moves by on the reference frame per unit of inverse
+  // depth around the given one
+  double disparityPerInvDepth(const SE3 &baseToRef, double invDepth) const;
+  // The pattern size is a template parameter for the usual sizes, and 0 for
+  // the rest, which are read from the settings. A fixed size lets the
+  // compiler unroll the loops over the pattern.
+  template <int N> int patternSize() const;
+  template <int N> const ImmaturePointBlock<N> &blockOf() const {
+    return static_cast<const ImmaturePointBlock<N> &>(*block);
+  }
+  template <int N>
+  TracingStatus traceOnPattern(const TracingContext &context,
+                               TracingDebugType debugType);
+  template <int N> double estVariance(const Vec2 &searchDirection);
+  template <int N>
+  Vec2 tracePrecise(const ImageSampler &refFrame, const Vec2 &from,
+                    const Vec2 &to, const double *intencities,
+                    const Vec2 *pattern, double &bestDispl,
+                    double &bestEnergy);
 };
 
 } // namespace fishdso
@@ -0,0 +1,105 @@
+#ifndef INCLUDE_IMMATUREPOINTBLOCK
+#define INCLUDE_IMMATUREPOINTBLOCK
+
+#include "util/settings.h"
+#include "util/types.h"
+#include <array>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace fishdso {
+
+// Calls func with std::integral_constant<int, N> of the given pattern size,
+// for the sizes the tracing is compiled for, and with N = 0 for the rest,
+// which are read from the settings.
+template <typename Func>
+decltype(auto) dispatchPatternSize(int patternSize, Func &&func) {
+  switch (patternSize) {
+  case 8:
+    return func(std::integral_constant<int, 8>());
+  case 9:
+    return func(std::integral_constant<int, 9>());
+  default:
+    return func(std::integral_constant<int, 0>());
+  }
+}
+
+// The part of ImmaturePointBlock that does not depend on the pattern size.
+class ImmaturePointBlockBase {
+public:
+  // pointers to the pattern data of a slot
+  struct PatternRef {
+    Vec3 *directions;
+    float *intencities;
+    Vec2f *grads;
+    Vec2f *gradNorms;
+  };
+
+  // the block for patterns of the given size
+  static std::unique_ptr<ImmaturePointBlockBase> create(int patternSize);
+
+  virtual ~ImmaturePointBlockBase() = default;
+
+  virtual int size() const = 0;
+  // The slots [size(), newSize) are added, the ones after newSize dropped.
+  virtual void resize(int newSize) = 0;
+  // appends a slot and returns its index
+  int add() {
+    resize(size() + 1);
+    return size() - 1;
+  }
+
+  // For the code that does not depend on the pattern size, the tracing reads
+  // the arrays of ImmaturePointBlock directly.
+  virtual PatternRef pattern(int slot) = 0;
+};
+
+// The pattern data of the immature points of a keyframe, a structure of
+// arrays with a slot per point instead of arrays in every point. The points
+// refer to their slots by index, KeyFrame::immaturePoints is kept in the order
+// of the slots and the slots of removed points are not reused until the block
+// is cleared, so tracing the points of a keyframe in order walks each of the
+// arrays once.
+//
+// The arrays have room for N values of the pattern, or for
+// Settings::ResidualPattern::maxSize if N is 0, see dispatchPatternSize.
+// Intencities and gradients are sampled from 8-bit images, so floats hold
+// them well enough. The directions stay double for the triangulation.
+template <int N> class ImmaturePointBlock : public ImmaturePointBlockBase {
+public:
+  static constexpr int capacity =
+      N > 0 ? N : Settings::ResidualPattern::maxSize;
+  template <typename T> using Pattern = std::array<T, capacity>;
+
+  int size() const override { return directions.size(); }
+
+  void resize(int newSize) override {
+    directions.resize(newSize);
+    intencities.resize(newSize);
+    grads.resize(newSize);
+    gradNorms.resize(newSize);
+  }
+
+  PatternRef pattern(int slot) override {
+    return {directions[slot].data(), intencities[slot].data(),
+            grads[slot].data(), gradNorms[slot].data()};
+  }
+
+  std::vector<Pattern<Vec3>> directions;
+  std::vector<Pattern<float>> intencities;
+  std::vector<Pattern<Vec2f>> grads;
+  std::vector<Pattern<Vec2f>> gradNorms;
+};
+
+inline std::unique_ptr<ImmaturePointBlockBase>
+ImmaturePointBlockBase::create(int patternSize) {
+  return dispatchPatternSize(
+      patternSize, [](auto n) -> std::unique_ptr<ImmaturePointBlockBase> {
+        return std::make_unique<ImmaturePointBlock<decltype(n)::value>>();
+      });
+}
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef INCLUDE_IMUPREINTEGRATOR
+#define INCLUDE_IMUPREINTEGRATOR
+
+#include "util/types.h"
+#include <deque>
+#include <optional>
+
+namespace fishdso {
+
+// A sample of an IMU, rigidly attached to the camera. The timestamps are in
+// seconds, on the same clock as the ones of the frames.
+struct ImuMeasurement {
+  double timestamp;
+  // angular velocity in rad/s and specific force in m/s^2, both in the IMU
+  // frame
+  Vec3 gyro;
+  Vec3 accel;
+};
+
+// Motion of the IMU between two moments, integrated from the samples. The
+// gravity is not removed, so the velocity and position deltas are those of
+// the specific force, as in on-manifold preintegration.
+struct ImuDelta {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  double dt = 0;
+  // orientation of the IMU at the end in the IMU frame at the start
+  SO3 deltaRot;
+  Vec3 deltaVel = Vec3::Zero();
+  Vec3 deltaPos = Vec3::Zero();
+};
+
+// Keeps the recent IMU samples and integrates them between frames. Each
+// sample is held until the next one.
+class ImuPreintegrator {
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  ImuPreintegrator(const SE3 &imuToCam = SE3(),
+                   const Vec3 &gyroBias = Vec3::Zero());
+
+  // the timestamps should increase
+  void addMeasurement(const ImuMeasurement &measurement);
+  // Forgets the samples not needed to integrate from time on.
+  void discardBefore(double time);
+
+  // Nothing if the samples do not cover the interval.
+  std::optional<ImuDelta> integrate(double fromTime, double toTime) const;
+  // Rotation of the camera motion over the interval of the delta, as in
+  // worldToTo * worldToFrom^-1.
+  SO3 camRotation(const ImuDelta &delta) const;
+
+  int measurementNum() const { return measurements.size(); }
+
+private:
+  SE3 imuToCam;
+  Vec3 gyroBias;
+  std::deque<ImuMeasurement, Eigen::aligned_allocator<ImuMeasurement>>
+      measurements;
+};
+
+} // namespace fishdso
+
+#endif
@@ -1,10 +1,14 @@
 #ifndef INCLUDE_KEYFRAME
 #define INCLUDE_KEYFRAME
 
+#include "system/CubeMapImage.h"
 #include "system/ImmaturePoint.h"
 #include "system/OptimizedPoint.h"
 #include "system/PreKeyFrame.h"
+#include "system/TrackedFrameRecord.h"
+#include "util/BicubicTiles.h"
 #include "util/DepthedImagePyramid.h"
+#include "util/MemoryAccounting.h"
 #include "util/PixelSelector.h"
 #include "util/settings.h"
 #include <Eigen/StdVector>
@@ -14,6 +18,10 @@
 
 namespace fishdso {
 
+struct TrackedFramesMemory {
+  static constexpr const char *name = "memory.trackedFrames";
+};
+
 struct KeyFrame {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
@@ -30,6 +38,14 @@ struct KeyFrame {
            PixelSelector &pixelSelector,
            const Settings::KeyFrame &_kfSettings = {},
            const PointTracerSettings &tracingSettings = {});
+  // The same, sharing the tracing settings with the other keyframes instead
+  // of copying them.
+  KeyFrame(std::shared_ptr<PreKeyFrame> newPreKeyFrame,
+           const Settings::KeyFrame &_kfSettings,
+           std::shared_ptr<const PointTracerSettings> tracingSettings);
+  KeyFrame(std::shared_ptr<PreKeyFrame> newPreKeyFrame,
+           PixelSelector &pixelSelector, const Settings::KeyFrame &_kfSettings,
+           std::shared_ptr<const PointTracerSettings> tracingSettings);
 
   void activateAllImmature();
   void deactivateAllOptimized();
@@ -48,10 +64,22 @@ struct KeyFrame {
   std::vector<std::unique_ptr<ImmaturePoint>> immaturePoints;
   std::vector<std::unique_ptr<OptimizedPoint>> optimizedPoints;
 
-  std::vector<std::shared_ptr<PreKeyFrame>> trackedFrames;
+  CountedVector<TrackedFrameRecord, TrackedFramesMemory> trackedFrames;
 
   Settings::KeyFrame kfSettings;
-  PointTracerSettings tracingSettings;
+  // shared with the immature points of the keyframe
+  std::shared_ptr<const PointTracerSettings> tracingSettings;
+  // the pattern data of immaturePoints, which are kept in the order of their
+  // slots in it
+  std::unique_ptr<ImmaturePointBlockBase> immaturePointBlock;
+
+  // Sampling of the image by bundle adjustment. The tiles are computed on
+  // the first samples and released once the keyframe is marginalized.
+  std::unique_ptr<BicubicTiles> imageTiles;
+  // The same on the faces of a cube, only with
+  // settings.bundleAdjuster.prewarpKeyFrames. It is created by bundle
+  // adjustment and its tiles are released along with the others.
+  std::unique_ptr<CubeMapImage> cubeMap;
 };
 
 } // namespace fishdso
@@ -0,0 +1,57 @@
+#ifndef INCLUDE_KEYFRAMEDATABASE
+#define INCLUDE_KEYFRAMEDATABASE
+
+#include "util/DepthedImagePyramid.h"
+#include "util/settings.h"
+#include "util/types.h"
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <vector>
+
+namespace fishdso {
+
+// Keyframes that are no longer optimized, kept to relocalize against when
+// tracking fails. Every entry is described by a small thumbnail of its
+// image, normalized to zero mean and unit norm, so that the lookup is a
+// linear scan of dot products. It can be used from several threads.
+class KeyFrameDatabase {
+public:
+  struct Entry {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    int globalFrameNum;
+    SE3 thisToWorld;
+    std::vector<float> thumbnail;
+    // the keyframe image with the depths of its points, to track against
+    DepthedImagePyramid trackingBase;
+  };
+
+  KeyFrameDatabase(const Settings::KeyFrameDatabase &settings = {});
+
+  std::vector<float> thumbnail(const cv::Mat1b &image) const;
+
+  // The oldest entry is dropped when there are maxEntries of them already.
+  std::shared_ptr<const Entry> add(int globalFrameNum, const SE3 &thisToWorld,
+                                   const DepthedImagePyramid &trackingBase);
+  // The candidateNum entries with the most similar thumbnails, the most
+  // similar first, out of the ones with frame numbers up to
+  // maxGlobalFrameNum. The entries stay valid after they are dropped.
+  std::vector<std::shared_ptr<const Entry>>
+  query(const cv::Mat1b &image,
+        int maxGlobalFrameNum = std::numeric_limits<int>::max()) const;
+
+  int size() const;
+
+private:
+  Settings::KeyFrameDatabase settings;
+
+  mutable std::mutex mutex;
+  std::deque<std::shared_ptr<const Entry>> entries;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef INCLUDE_KEYFRAMEPOLICY
+#define INCLUDE_KEYFRAMEPOLICY
+
+#include "util/settings.h"
+
+namespace fishdso {
+
+// What a tracked frame tells about the need of a new keyframe.
+struct KeyFrameCues {
+  // RMS shifts on the image of the points of the base keyframe, in pixels,
+  // with the tracked motion and with its translation only
+  double flow;
+  double translationFlow;
+  // part of the points of the base keyframe that project onto the frame
+  double visibleRatio;
+  // |log| of the affine light multiplier from the base keyframe
+  double lightChange;
+  // tracking RMSE over the one of the first frame after the last keyframe
+  double rmseRatio;
+  int framesSinceKeyFrame;
+};
+
+// Decides on keyframes by Settings::KeyFramePolicy. The flows and the light
+// change add up into a score, each relative to its maximum, and a keyframe
+// is needed when the score gets over one, when too few points stay visible
+// or when tracking gets much worse. Keyframes are at least
+// minFramesBetweenKeyFrames apart and at most maxFramesBetweenKeyFrames.
+class KeyFramePolicy {
+public:
+  KeyFramePolicy(int imageWidth, int imageHeight,
+                 const Settings::KeyFramePolicy &settings);
+
+  double score(const KeyFrameCues &cues) const;
+  bool needKeyFrame(const KeyFrameCues &cues) const;
+
+private:
+  double imageSize;
+  Settings::KeyFramePolicy settings;
+};
+
+} // namespace fishdso
+
+#endif
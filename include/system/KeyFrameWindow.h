@@ -0,0 +1,117 @@
+#ifndef INCLUDE_KEYFRAMEWINDOW
+#define INCLUDE_KEYFRAMEWINDOW
+
+#include "system/KeyFrame.h"
+#include "util/types.h"
+#include <iterator>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace fishdso {
+
+// The keyframes of the optimization window, oldest first, in a fixed
+// number of slots. Keyframes are only added at the back, in the order of
+// their frame numbers, and can be marginalized from anywhere in the window,
+// but a keyframe stays in its slot for all its life and the pointers to it
+// stay valid until it is marginalized. The point vectors of the
+// marginalized keyframe are kept and handed to the next one, so that its
+// points do not reallocate them while they are selected and activated.
+// The slots are iterated as pairs of the frame number and the keyframe,
+// the same way as a map from frame numbers would be.
+class KeyFrameWindow {
+public:
+  using value_type = std::pair<const int, KeyFrame>;
+
+  template <typename Value, typename Slots> class Iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::remove_const_t<Value>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Value *;
+    using reference = Value &;
+
+    Iterator(Slots *slots, const std::vector<int> *order, int index)
+        : slots(slots)
+        , order(order)
+        , index(index) {}
+
+    reference operator*() const { return *(*slots)[(*order)[index]]; }
+    pointer operator->() const { return &**this; }
+    Iterator &operator++() {
+      ++index;
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator old = *this;
+      ++index;
+      return old;
+    }
+    bool operator==(const Iterator &other) const {
+      return index == other.index;
+    }
+    bool operator!=(const Iterator &other) const {
+      return index != other.index;
+    }
+
+  private:
+    Slots *slots;
+    const std::vector<int> *order;
+    int index;
+  };
+
+  using Slots = StdVector<std::optional<value_type>>;
+  using iterator = Iterator<value_type, Slots>;
+  using const_iterator = Iterator<const value_type, const Slots>;
+
+  // The capacity should hold the maximal window and the keyframe that is
+  // added before the oldest one is marginalized.
+  explicit KeyFrameWindow(int capacity);
+  KeyFrameWindow(const KeyFrameWindow &other) = delete;
+
+  EIGEN_STRONG_INLINE int size() const { return order.size(); }
+  EIGEN_STRONG_INLINE bool empty() const { return order.empty(); }
+  EIGEN_STRONG_INLINE int capacity() const { return slots.size(); }
+
+  // i-th oldest
+  EIGEN_STRONG_INLINE value_type &operator[](int i) {
+    return *slots[order[i]];
+  }
+  EIGEN_STRONG_INLINE const value_type &operator[](int i) const {
+    return *slots[order[i]];
+  }
+  EIGEN_STRONG_INLINE KeyFrame &front() { return (*this)[0].second; }
+  EIGEN_STRONG_INLINE KeyFrame &back() { return (*this)[size() - 1].second; }
+  EIGEN_STRONG_INLINE int frontNum() const { return (*this)[0].first; }
+
+  iterator begin() { return iterator(&slots, &order, 0); }
+  iterator end() { return iterator(&slots, &order, size()); }
+  const_iterator begin() const { return const_iterator(&slots, &order, 0); }
+  const_iterator end() const {
+    return const_iterator(&slots, &order, size());
+  }
+
+  // The frame number is that of the keyframe's preKeyFrame and should be
+  // greater than the ones in the window.
+  KeyFrame &pushBack(KeyFrame &&keyFrame);
+  // Destroys the i-th oldest keyframe. It can be moved out of the window
+  // before.
+  void erase(int i);
+  EIGEN_STRONG_INLINE void popFront() { erase(0); }
+
+  // If keyFrame still holds the keyframe of frame number num. After a
+  // keyframe is marginalized its slot can hold a newer one.
+  bool contains(const KeyFrame *keyFrame, int num) const;
+
+private:
+  Slots slots;
+  // the occupied slots, oldest first
+  std::vector<int> order;
+
+  std::vector<std::unique_ptr<ImmaturePoint>> spareImmaturePoints;
+  std::vector<std::unique_ptr<OptimizedPoint>> spareOptimizedPoints;
+};
+
+} // namespace fishdso
+
+#endif
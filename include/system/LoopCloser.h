@@ -0,0 +1,112 @@
+#ifndef INCLUDE_LOOPCLOSER
+#define INCLUDE_LOOPCLOSER
+
+#include "system/CameraModel.h"
+#include "system/KeyFrameDatabase.h"
+#include "util/settings.h"
+#include "util/types.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace fishdso {
+
+// Closes loops over the keyframes that have left the optimization window,
+// on a thread of its own. Every keyframe added is looked up in the keyframe
+// database among the ones at least minFrameGap frames older. A candidate is
+// verified by tracking the images against each other in both directions,
+// which gives the Sim3 between them, the scale being the ratio of the
+// translations in the two depth maps, if the rotations of the two directions
+// agree. The keyframe poses then go through a pose graph optimization of Sim3
+// poses, with the motions between consecutive keyframes and the loops as the
+// edges.
+class LoopCloser {
+public:
+  // Gets worldToKeyFrame of all of the keyframes added so far, by their
+  // global frame numbers. Called on the thread of the loop closer, so
+  // DsoSystem only queues them for its mapping thread.
+  typedef std::function<void(const StdMap<int, Sim3> &)> Callback;
+
+  // A keyframe of the pose graph.
+  struct Node {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    static Node fromPose(int globalFrameNum, const Sim3 &worldToThis);
+    Sim3 pose() const;
+
+    int globalFrameNum;
+    // worldToThis as stored in the optimization
+    Quaternion rot;
+    Vec3 trans;
+    double logScale;
+  };
+
+  // measured worldToJ * worldToI^-1
+  struct Edge {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    int i, j;
+    Sim3 iToJ;
+  };
+
+  LoopCloser(CameraModel *cam, const KeyFrameDatabase *database,
+             Callback onLoopClosed, const Settings &settings = {});
+  LoopCloser(const LoopCloser &other) = delete;
+  // processes everything still queued
+  ~LoopCloser();
+
+  // The entry should be in the database already. Keyframes should come in
+  // the order of frame numbers.
+  void addKeyFrame(std::shared_ptr<const KeyFrameDatabase::Entry> entry);
+  // Blocks until every queued keyframe is processed.
+  void flush();
+
+  int loopNum() const;
+
+  // The Sim3 from the candidate to the entry out of the motions tracked
+  // between them in both directions, each in the scale of the depths it was
+  // tracked against, or nothing if their rotations disagree.
+  static std::optional<Sim3>
+  combineMotions(const SE3 &candidateToThis, const SE3 &thisToCandidate,
+                 const Settings::LoopClosure &settings);
+  // Optimizes the poses of the nodes to agree with the edges, the first node
+  // being fixed.
+  static void optimize(StdVector<Node> &nodes, const StdVector<Edge> &edges,
+                       const Settings::LoopClosure &settings);
+
+private:
+  void workerLoop();
+  void process(const KeyFrameDatabase::Entry &entry);
+  // Sim3 from the candidate to the entry, if it is a loop
+  std::optional<Sim3> verify(const KeyFrameDatabase::Entry &candidate,
+                             const KeyFrameDatabase::Entry &entry) const;
+
+  CameraModel *cam;
+  StdVector<CameraModel> camPyr;
+  const KeyFrameDatabase *database;
+  Callback onLoopClosed;
+  Settings settings;
+
+  StdVector<Node> nodes;
+  std::map<int, int> nodeIndex;
+  StdVector<Edge> edges;
+  // maps the corrected world into the one of the incoming poses
+  Sim3 correctedToLive;
+  int loops = 0;
+
+  mutable std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<const KeyFrameDatabase::Entry>> queue;
+  bool isBusy = false;
+  bool doStop = false;
+  std::thread worker;
+};
+
+} // namespace fishdso
+
+#endif
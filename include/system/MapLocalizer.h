@@ -0,0 +1,67 @@
+#ifndef INCLUDE_MAPLOCALIZER
+#define INCLUDE_MAPLOCALIZER
+
+#include "system/FrameSource.h"
+#include "system/FrameTracker.h"
+#include "system/KeyFrameDatabase.h"
+#include "system/serialization.h"
+#include "util/settings.h"
+#include <memory>
+#include <optional>
+
+namespace fishdso {
+
+// Localizes frames in a prebuilt map, e.g. of a route driven before, instead
+// of building one. The keyframes of a snapshot are the map, and every frame
+// is only tracked against the map keyframe nearest to it: nothing is traced,
+// no keyframes are created and nothing is bundle adjusted. As the camera
+// moves, the base keyframe is switched to the one nearest to the last pose,
+// see Settings::Localization. The first frame and the frames where tracking
+// fails are relocalized against the keyframes with the most similar
+// thumbnails, as in DsoSystem.
+class MapLocalizer {
+public:
+  // Any number of keyframes can be loaded, not only a window.
+  MapLocalizer(const SnapshotLoader &snapshotLoader,
+               const Settings &settings = {});
+
+  // The worldToFrame pose of the frame in the map, or nothing if it could
+  // not be localized.
+  std::optional<SE3> localize(const SourceFrame &frame);
+
+  int keyFrameNum() const;
+  // of the keyframe the frames are tracked against, -1 when lost
+  int baseFrameNum() const;
+
+private:
+  // the distance from a frame to a keyframe, see Settings::Localization
+  double distance(const SE3 &worldToFrame,
+                  const KeyFrameDatabase::Entry &keyFrame) const;
+  int nearestKeyFrame(const SE3 &worldToFrame) const;
+  void setBase(const std::shared_ptr<const KeyFrameDatabase::Entry> &keyFrame);
+  // Tracks the frame against the candidates from the database on the
+  // coarsest level and then against the best one fully, which becomes the
+  // base. Returns worldToFrame.
+  std::optional<SE3> relocalize(const PreKeyFrame &frame);
+
+  CameraModel *cam;
+  StdVector<CameraModel> camPyr;
+  Settings settings;
+  std::shared_ptr<const FrameTrackerSettings> trackerSettings;
+
+  KeyFrameDatabase database;
+  // ordered by frame numbers
+  std::vector<std::shared_ptr<const KeyFrameDatabase::Entry>> keyFrames;
+  double meanNeighbourDistance;
+
+  std::shared_ptr<const KeyFrameDatabase::Entry> base;
+  std::unique_ptr<FrameTracker> tracker;
+  AffineLightTransform<double> lightBaseToLast;
+  double lastRmse;
+  // of the last two localized frames, the last one first
+  StdVector<SE3> lastWorldToFrame;
+};
+
+} // namespace fishdso
+
+#endif
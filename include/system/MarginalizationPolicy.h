@@ -0,0 +1,41 @@
+#ifndef INCLUDE_MARGINALIZATIONPOLICY
+#define INCLUDE_MARGINALIZATIONPOLICY
+
+#include "util/settings.h"
+#include "util/types.h"
+
+namespace fishdso {
+
+// Chooses the keyframes that leave the window by
+// Settings::Marginalization, the way DSO does. First go the keyframes of
+// which too few points are visible on the newest one. Then, while there are
+// more than maxKeyFrames, goes the one that is the most redundant: close to
+// the others but far from the newest one. The score of a keyframe is the
+// square root of its distance to the newest keyframe times the sum of the
+// inverse distances to the other ones, except the newest. The distance
+// combines the translation, relative to its mean over the window, and the
+// rotation angle. The newest keptNewest keyframes always stay.
+class MarginalizationPolicy {
+public:
+  MarginalizationPolicy(const Settings::Marginalization &settings);
+
+  // The poses and the visible parts of the points on the newest keyframe
+  // are those of the keyframes in the window, oldest first. Returns the
+  // indices of the keyframes to marginalize, in increasing order.
+  std::vector<int> choose(const StdVector<SE3> &thisToWorld,
+                          const std::vector<double> &visibleRatios,
+                          int maxKeyFrames) const;
+
+  // Of the i-th keyframe, with the distances between all of them and the
+  // keyframes that are gone.
+  double redundancy(const MatXX &distances, const std::vector<bool> &isGone,
+                    int i) const;
+  MatXX distances(const StdVector<SE3> &thisToWorld) const;
+
+private:
+  Settings::Marginalization settings;
+};
+
+} // namespace fishdso
+
+#endif
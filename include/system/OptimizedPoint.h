@@ -3,6 +3,7 @@
 
 #include "system/ImmaturePoint.h"
 #include "system/serialization.h"
+#include "util/MemoryAccounting.h"
 #include "util/types.h"
 #include <Eigen/Core>
 #include <Eigen/StdVector>
@@ -11,7 +12,11 @@
 
 namespace fishdso {
 
-struct OptimizedPoint {
+struct OptimizedPointsMemory {
+  static constexpr const char *name = "memory.optimizedPoints";
+};
+
+struct OptimizedPoint : CountedObject<OptimizedPointsMemory, OptimizedPoint> {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
   enum State { ACTIVE, OOB, OUTLIER };
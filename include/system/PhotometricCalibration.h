@@ -0,0 +1,51 @@
+#ifndef INCLUDE_PHOTOMETRICCALIBRATION
+#define INCLUDE_PHOTOMETRICCALIBRATION
+
+#include <array>
+#include <memory>
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+namespace fishdso {
+
+// Undoes the nonlinear response and the vignetting of a camera, so that the
+// pixel values are proportional to the irradiance, which is what the affine
+// light model assumes. Both are folded into lookup tables once: the inverse
+// response into 256 values scaled back to [0, 255], and the vignette into a
+// gain for every pixel. A frame is then corrected in the single pass that
+// brings it into the pyramid, see PreKeyFrame. The corrected values stay 8
+// bit, so the brightest pixels near the border can saturate.
+class PhotometricCalibration {
+public:
+  // The inverse response gives the irradiance of each of the 256 pixel
+  // values and should increase, an empty one means the linear response.
+  // The vignette is the attenuation of every pixel, relative to its
+  // maximum, an empty one means no vignetting. The pixels where it is zero
+  // become black.
+  PhotometricCalibration(const std::vector<double> &inverseResponse,
+                         const cv::Mat1f &vignette);
+
+  // The inverse response is a text file with the 256 values and the
+  // vignette an 8 or 16-bit image of the size of the frames, as in the TUM
+  // monoVO dataset. Either name can be empty.
+  static std::shared_ptr<PhotometricCalibration>
+  load(const std::string &inverseResponseFile,
+       const std::string &vignetteFile);
+
+  bool hasVignette() const { return !gain.empty(); }
+
+  // src and dst can be the same image
+  void apply(const cv::Mat1b &src, cv::Mat1b &dst) const;
+
+private:
+  // inverse response, scaled so that 255 maps to 255
+  std::array<float, 256> irradiance;
+  std::array<uchar, 256> responseLut;
+  // 1 / vignette
+  cv::Mat1f gain;
+};
+
+} // namespace fishdso
+
+#endif
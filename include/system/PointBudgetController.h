@@ -0,0 +1,53 @@
+#ifndef INCLUDE_POINTBUDGETCONTROLLER
+#define INCLUDE_POINTBUDGETCONTROLLER
+
+#include "system/FrameTimings.h"
+#include "util/settings.h"
+
+namespace fishdso {
+
+// The sizes of the work DsoSystem does per frame and per keyframe.
+struct PointBudget {
+  // immature points selected on a new keyframe, Settings::KeyFrame::pointsNum
+  int pointsNum;
+  // Settings::maxOptimizedPoints
+  int optimizedPointsNum;
+  // Settings::BundleAdjuster::maxIterations
+  int baIterations;
+
+  bool operator==(const PointBudget &other) const;
+  bool operator!=(const PointBudget &other) const;
+};
+
+// Scales the point budget to hold the target times of Settings::PointBudget,
+// looking at the timings of the processed frames. The per-frame time of
+// tracking and tracing drives the point numbers, and the per-keyframe time
+// of keyframe creation and bundle adjustment drives the BA iterations. Both
+// are smoothed exponentially, nothing changes while they are within the
+// tolerance, and the changes are apart by at least minFramesBetweenChanges.
+class PointBudgetController {
+public:
+  // initial is clamped to the bounds of the settings
+  PointBudgetController(const PointBudget &initial,
+                        const Settings::PointBudget &settings = {});
+
+  // returns true if the budget has changed
+  bool update(const FrameTimings &timings);
+
+  const PointBudget &budget() const { return curBudget; }
+
+private:
+  PointBudget clamped(const PointBudget &budget) const;
+
+  PointBudget curBudget;
+  // smoothed seconds, negative before the first sample
+  double frameTime;
+  double keyFrameTime;
+  int framesSinceChange;
+
+  Settings::PointBudget settings;
+};
+
+} // namespace fishdso
+
+#endif
@@ -3,9 +3,14 @@
 
 #include "system/AffineLightTransform.h"
 #include "system/CameraModel.h"
+#include "system/FrameBufferPool.h"
+#include "system/FrameSource.h"
+#include "system/FrameTimings.h"
 #include "util/ImagePyramid.h"
 #include "util/settings.h"
 #include "util/types.h"
+#include <memory>
+#include <mutex>
 #include <opencv2/core.hpp>
 #include <sophus/se3.hpp>
 
@@ -17,26 +22,68 @@ class PreKeyFrameInternals;
 struct PreKeyFrame {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
+  // With a bufferPool the pyramid storage is taken from it and given back
+  // on destruction.
   PreKeyFrame(KeyFrame *baseKeyFrame, CameraModel *cam,
               const cv::Mat &frameColored, int globalFrameNum,
-              const Settings::Pyramid &_pyrSettings = {});
+              const Settings::Pyramid &_pyrSettings = {},
+              std::shared_ptr<FrameBufferPool> bufferPool = nullptr);
+  // Builds the pyramid right from frame.gray, see SourceFrame for when it is
+  // shared and when copied.
+  PreKeyFrame(KeyFrame *baseKeyFrame, CameraModel *cam,
+              const SourceFrame &frame,
+              const Settings::Pyramid &_pyrSettings = {},
+              std::shared_ptr<FrameBufferPool> bufferPool = nullptr);
+  PreKeyFrame(const PreKeyFrame &other) = delete;
   ~PreKeyFrame();
 
-  cv::Mat frameColored;
-  cv::Mat1d gradX, gradY, gradNorm;
+  // For visualization only. Produced on the first call, thread-safe.
+  const cv::Mat3b &frameColored() const;
+
+  // The central-difference gradients of frame(), zero outside of the valid
+  // spans of the camera, the same as ImagePyramid::rebuild gives. Only the
+  // keyframes need them, and only at their points, so they are computed on
+  // demand instead of being stored for every frame.
+  Vec2f gradient(const cv::Point &p) const;
+  float gradNorm(const cv::Point &p) const;
+  // of every pixel, for the pixel selection
+  cv::Mat1f gradNormImage() const;
+
   ImagePyramid framePyr;
   EIGEN_STRONG_INLINE cv::Mat1b &frame() { return framePyr[0]; }
   EIGEN_STRONG_INLINE const cv::Mat1b &frame() const { return framePyr[0]; }
 
   KeyFrame *baseKeyFrame;
+  // tells the base keyframe from a later one that took its place in the
+  // window, see KeyFrameWindow::contains
+  int baseKeyFrameNum = -1;
   CameraModel *cam;
   SE3 baseToThis;
   AffineLightTransform<double> lightBaseToThis;
+  // of the tracking against the base keyframe
+  double trackRmse = 0;
   int globalFrameNum;
+  // see SourceFrame
+  std::chrono::steady_clock::time_point arrivalTime;
 
   Settings::Pyramid pyrSettings;
+  std::shared_ptr<FrameBufferPool> bufferPool;
 
   std::unique_ptr<PreKeyFrameInternals> internals;
+
+  // output only
+  FrameTimings timings;
+
+private:
+  void acquireBuffers();
+  void buildPyramid();
+
+  // of the pyramid images, booked to "memory.framePyramids"
+  long long pyramidBytes = 0;
+
+  ColorProvider colorProvider;
+  mutable std::once_flag colorOnce;
+  mutable cv::Mat3b colored;
 };
 
 } // namespace fishdso
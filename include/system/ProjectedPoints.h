@@ -0,0 +1,48 @@
+#ifndef INCLUDE_PROJECTEDPOINTS
+#define INCLUDE_PROJECTEDPOINTS
+
+#include "system/CameraModel.h"
+#include "util/PointGrid.h"
+#include "util/types.h"
+#include <memory>
+
+namespace fishdso {
+
+// Points of several frames projected onto one base frame, as a structure of
+// arrays. Each source frame is moved with a single motion and mapped in one
+// batch. The grid buckets the projections on the base image, so that they
+// can be looked up by place afterwards.
+class ProjectedPoints {
+public:
+  ProjectedPoints(const CameraModel *cam);
+
+  inline int size() const { return x.size(); }
+
+  // Unmaps the pixels (srcX, srcY) of the source frame, puts them at the
+  // given depths, moves them with sourceToBase and keeps those that land on
+  // the base image. A null sourceToBase means that the points are on the
+  // base frame already, they are then kept as they are.
+  void add(const SE3 *sourceToBase, const std::vector<double> &srcX,
+           const std::vector<double> &srcY,
+           const std::vector<double> &srcDepth);
+
+  // Buckets the points added so far.
+  void buildGrid(int cellSize);
+  const PointGrid &getGrid() const;
+
+  // positions and depths on the base frame
+  std::vector<double> x, y;
+  std::vector<double> depth;
+  // the number of the add() call a point came from and its index there
+  std::vector<int> source;
+  std::vector<int> sourceIndex;
+
+private:
+  const CameraModel *cam;
+  int sourceNum;
+  std::unique_ptr<PointGrid> grid;
+};
+
+} // namespace fishdso
+
+#endif
@@ -4,6 +4,17 @@
 namespace fishdso {
 
 enum SerializerMode { LOAD, STORE };
-}
 
-#endif
\ No newline at end of file
+// Binary files are written in the native byte order after a short versioned
+// header and are loaded by mapping them into memory. The text format is
+// meant for debugging. Loaders detect the format by the header.
+enum SerializerFormat { BINARY, TEXT };
+
+// Whether snapshots carry the grayscale images of the keyframes, so that
+// they are restored without the dataset. PNG ones are compressed losslessly.
+// The coarser pyramid levels are always rebuilt on restoring.
+enum FrameEmbedding { NO_FRAMES, RAW_FRAMES, PNG_FRAMES };
+
+} // namespace fishdso
+
+#endif
@@ -1,4 +1,5 @@
 #include "system/CameraModel.h"
+#include <atomic>
 
 namespace fishdso {
 
@@ -21,8 +22,28 @@ public:
   void outputInlierCorresps();
 
 private:
-  int findInliersEssential(const Mat33 &E, std::vector<int> &_inliersInds);
+  // Counts the inliers of EsNum essential matrices among the
+  // correspondences inds[0, n), or [0, n) if inds is null, in one pass. The
+  // correspondences are taken in chunks, and each chunk is checked against
+  // all of the matrices still being scored while it is in the cache, with
+  // the rays corrected onto the epipolar planes of a matrix projected by a
+  // single CameraModel::mapBatch per camera. A matrix gets -1 inliers as
+  // soon as it cannot reach the larger of atLeast and sharedAtLeast, if
+  // given, which lets RANSAC drop hopeless hypotheses early. If inliersInds
+  // is not null, it gets the inlier indices of every matrix.
+  void scoreEssentials(const Mat33 *Es, int EsNum, const int *inds, int n,
+                       int atLeast, const std::atomic<int> *sharedAtLeast,
+                       int *inliersNum,
+                       std::vector<int> *inliersInds = nullptr) const;
+  // Returns -1 as soon as it is clear that fewer than atLeast correspondences
+  // are inliers.
+  int findInliersEssential(const Mat33 &E, std::vector<int> &_inliersInds,
+                           int atLeast = 0) const;
   int findInliersMotion(const SE3 &motion, std::vector<int> &_inliersInds);
+  // the decomposition of E with the most of the inliers in front of both
+  // cameras, without touching the shared buffers
+  SE3 bestDecomposition(const Mat33 &E, const std::vector<int> &inliersInds,
+                        int &frontPointsNum) const;
 
   SE3 extractMotion(const Mat33 &E, std::vector<int> &_inliersInds,
                     int &newInliers, bool doLogFrontPoints);
@@ -5,10 +5,10 @@
 #include "system/StereoGeometryEstimator.h"
 #include "util/Terrain.h"
 #include "util/types.h"
+#include <map>
 #include <opencv2/opencv.hpp>
 #include <vector>
 
-DECLARE_bool(draw_inlier_matches);
 
 namespace fishdso {
 
@@ -17,15 +17,43 @@ public:
   StereoMatcher(CameraModel *cam, const Settings::StereoMatcher &settings = {},
                 const Settings::Threading &threadingSettings = {});
 
+  static constexpr int NO_FRAME_ID = -1;
+
   SE3 match(cv::Mat frames[2], StdVector<Vec2> resPoints[2],
-            std::vector<double> resDepths[2]) const;
+            std::vector<double> resDepths[2]);
+  // The features of the frames with ids other than NO_FRAME_ID are kept, so
+  // that matching one of them again does not detect them anew. The grid
+  // matcher searches around the positions that predictedRotation, taking the
+  // first frame to the second one, gives.
+  SE3 match(cv::Mat frames[2], const int frameIds[2],
+            StdVector<Vec2> resPoints[2], std::vector<double> resDepths[2],
+            const SO3 &predictedRotation = SO3());
 
   std::shared_ptr<Terrain> getBaseTerrain();
 
 private:
+  struct FrameFeatures {
+    std::vector<cv::KeyPoint> keyPoints;
+    cv::Mat descriptors;
+  };
+
   void createEstimations(const std::vector<cv::KeyPoint> keyPoints[2],
                          const cv::Mat decriptors[2]);
 
+  void detectFeatures(cv::Mat frames[2], const int frameIds[2],
+                      std::vector<cv::KeyPoint> keyPoints[2],
+                      cv::Mat descriptors[2]);
+
+  // queryIdx refers to the second frame and trainIdx to the first one
+  std::vector<cv::DMatch>
+  matchFeatures(const std::vector<cv::KeyPoint> keyPoints[2],
+                const cv::Mat descriptors[2],
+                const SO3 &predictedRotation) const;
+  std::vector<cv::DMatch>
+  matchOnGrid(const std::vector<cv::KeyPoint> keyPoints[2],
+              const cv::Mat descriptors[2],
+              const SO3 &predictedRotation) const;
+
   void filterOutStillMatches(std::vector<cv::DMatch> &matches,
                              std::vector<cv::DMatch> &stillMatches,
                              const std::vector<cv::KeyPoint> kp[2]) const;
@@ -33,8 +61,10 @@ private:
   CameraModel *cam;
   cv::Mat descriptorsMask;
   cv::Mat altMask;
-  cv::Ptr<cv::ORB> orb;
+  // one per frame, so that both can detect at once
+  cv::Ptr<cv::ORB> orb[2];
   std::unique_ptr<cv::DescriptorMatcher> descriptorMatcher;
+  std::map<int, FrameFeatures> cachedFeatures;
 
   Settings::StereoMatcher settings;
   Settings::Threading threadingSettings;
@@ -0,0 +1,30 @@
+#ifndef INCLUDE_TRACKEDFRAMERECORD
+#define INCLUDE_TRACKEDFRAMERECORD
+
+#include "system/PreKeyFrame.h"
+#include "util/types.h"
+
+namespace fishdso {
+
+// What is left of a tracked frame that did not become a keyframe: its pose
+// and affine light relative to the base keyframe.
+struct TrackedFrameRecord {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  TrackedFrameRecord(const SE3 &baseToThis, const AffLight &lightBaseToThis,
+                     int globalFrameNum)
+      : baseToThis(baseToThis)
+      , lightBaseToThis(lightBaseToThis)
+      , globalFrameNum(globalFrameNum) {}
+  TrackedFrameRecord(const PreKeyFrame &preKeyFrame)
+      : TrackedFrameRecord(preKeyFrame.baseToThis, preKeyFrame.lightBaseToThis,
+                           preKeyFrame.globalFrameNum) {}
+
+  SE3 baseToThis;
+  AffLight lightBaseToThis;
+  int globalFrameNum;
+};
+
+} // namespace fishdso
+
+#endif
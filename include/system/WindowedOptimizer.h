@@ -0,0 +1,96 @@
+#ifndef INCLUDE_WINDOWEDOPTIMIZER
+#define INCLUDE_WINDOWEDOPTIMIZER
+
+#include "system/CameraModel.h"
+#include "system/KeyFrame.h"
+#include "util/settings.h"
+#include "util/types.h"
+#include <vector>
+
+namespace fishdso {
+
+// Sliding-window photometric bundle adjustment with hand-written normal
+// equations. Inverse depths are eliminated with the Schur complement, and
+// keyframes leaving the window are marginalized into a quadratic prior on the
+// remaining ones. Frame parameters are a right SE3 increment of thisToWorld
+// followed by the two affine light parameters.
+class WindowedOptimizer {
+public:
+  static constexpr int frameParams = 8;
+
+  WindowedOptimizer(CameraModel *cam, const BundleAdjusterSettings &_settings);
+
+  // Optimizes poses and affine light of the window keyframes and the depths
+  // of their active points. Without a prior the first keyframe is fixed.
+  void adjust(const std::vector<KeyFrame *> &window, int maxIterations);
+
+  // Folds the residuals hosted by keyFrame into the prior, then removes the
+  // parameters of keyFrame itself. The residuals observed in keyFrame but
+  // hosted by the other keyframes are dropped. Call it before erasing
+  // keyFrame.
+  void marginalize(KeyFrame *keyFrame, const std::vector<KeyFrame *> &window);
+
+  EIGEN_STRONG_INLINE bool hasPrior() const { return !priorFrames.empty(); }
+
+  // Normal equations over the frame parameters and the inverse depths. Every
+  // residual depends on a single point, so the point block is diagonal.
+  struct Linearization {
+    MatXX Hff;
+    VecX bf;
+    std::vector<double> Hpp, bp;
+    MatXX Hpf;
+  };
+
+  // Eliminates all the points of lin and then the frame with the index k,
+  // leaving the system on the other frames in their order.
+  static void marginalizeFrame(const Linearization &lin, int k, MatXX &H,
+                               VecX &b);
+
+private:
+  struct Residual {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    int point;
+    int host, target;
+    Vec3 baseDirection;
+    double baseIntencity;
+    double weight;
+  };
+
+  struct Problem {
+    std::vector<KeyFrame *> frames;
+    std::vector<OptimizedPoint *> points;
+    StdVector<Residual> residuals;
+  };
+
+  Problem buildProblem(const std::vector<KeyFrame *> &window,
+                       const std::vector<KeyFrame *> &hosts);
+
+  // returns the energy, fills lin if it is not null
+  double linearize(const Problem &problem, Linearization *lin);
+  double residualValue(const Problem &problem, const Residual &res,
+                       const SE3 &hostToTarget);
+
+  // prior with frames reindexed to problem.frames, relinearized at the
+  // current state
+  double priorAt(const Problem &problem, MatXX *H, VecX *b);
+
+  static void schurPoints(const Linearization &lin, double lambda, MatXX &H,
+                          VecX &b);
+
+  void classifyOutliers(const Problem &problem);
+
+  CameraModel *cam;
+
+  std::vector<KeyFrame *> priorFrames;
+  StdVector<SE3> priorLinThisToWorld;
+  std::vector<AffLight> priorLinLight;
+  MatXX priorH;
+  VecX priorB;
+
+  BundleAdjusterSettings settings;
+};
+
+} // namespace fishdso
+
+#endif
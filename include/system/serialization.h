@@ -4,9 +4,17 @@
 #include "../../samples/mfov/reader/MultiFovReader.h"
 #include "system/ImmaturePoint.h"
 #include "system/SerializerMode.h"
+#include "system/TrackedFrameRecord.h"
 #include "util/types.h"
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <glog/logging.h>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 namespace fishdso {
 
@@ -25,20 +33,28 @@ using RefT = typename RefTHelper<mode, T>::type;
 
 template <SerializerMode mode> class DataSerializer;
 
+// floats are stored as doubles, so that the format does not depend on the
+// precision kept in memory
+template <typename T>
+using StoredT = std::conditional_t<std::is_same_v<T, float>, double, T>;
+
 template <> class DataSerializer<STORE> {
 public:
-  DataSerializer(const fs::path &fname);
+  DataSerializer(const fs::path &fname, SerializerFormat format = BINARY);
 
   template <typename Scalar, int rows, int cols>
   void process(const Eigen::Matrix<Scalar, rows, cols> &mat) {
     for (int i = 0; i < mat.size(); ++i)
-      stream << mat.data()[i] << ' ';
-    stream << '\n';
+      put(StoredT<Scalar>(mat.data()[i]), ' ');
+    if (format == TEXT)
+      stream << '\n';
   }
-  void process(const double &val) { stream << val << '\n'; }
-  void process(const int &val) { stream << val << '\n'; }
+  void process(const double &val) { put(val, '\n'); }
+  void process(const float &val) { put(double(val), '\n'); }
+  void process(const int &val) { put(val, '\n'); }
   void process(const AffLight &affLight) {
-    stream << affLight.data[0] << ' ' << affLight.data[1] << '\n';
+    put(affLight.data[0], ' ');
+    put(affLight.data[1], '\n');
   }
   void process(const SO3 &rot) { process(rot.unit_quaternion().coeffs()); }
   void process(const SE3 &motion) {
@@ -46,24 +62,54 @@ public:
     process(motion.translation());
   }
   void process(const ImmaturePoint::State &state) { process(int(state)); }
+  // the size followed by the bytes
+  void process(const std::vector<uchar> &bytes) {
+    put(int(bytes.size()), '\n');
+    if (format == BINARY)
+      stream.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    else {
+      for (uchar byte : bytes)
+        stream << int(byte) << ' ';
+      stream << '\n';
+    }
+  }
 
 private:
+  template <typename T> void put(const T &val, char separator) {
+    if (format == BINARY)
+      stream.write(reinterpret_cast<const char *>(&val), sizeof(T));
+    else
+      stream << val << separator;
+  }
+
+  SerializerFormat format;
   std::ofstream stream;
 };
 
 template <> class DataSerializer<LOAD> {
 public:
   DataSerializer(const fs::path &fname);
+  DataSerializer(const DataSerializer &other) = delete;
+  ~DataSerializer();
 
   template <typename Scalar, int rows, int cols>
   void process(Eigen::Matrix<Scalar, rows, cols> &mat) {
-    for (int i = 0; i < mat.size(); ++i)
-      stream >> mat.data()[i];
+    for (int i = 0; i < mat.size(); ++i) {
+      StoredT<Scalar> val;
+      get(val);
+      mat.data()[i] = Scalar(val);
+    }
+  }
+  void process(double &val) { get(val); }
+  void process(float &val) {
+    double doubleVal;
+    get(doubleVal);
+    val = float(doubleVal);
   }
-  void process(double &val) { stream >> val; }
-  void process(int &val) { stream >> val; }
+  void process(int &val) { get(val); }
   void process(AffLight &affLight) {
-    stream >> affLight.data[0] >> affLight.data[1];
+    get(affLight.data[0]);
+    get(affLight.data[1]);
   }
   void process(SO3 &rot) {
     Quaternion quaternion;
@@ -79,14 +125,45 @@ public:
     process(stateInt);
     state = ImmaturePoint::State(stateInt);
   }
+  void process(std::vector<uchar> &bytes) {
+    int size;
+    get(size);
+    bytes.resize(size);
+    if (mapped) {
+      CHECK_LE(cur + size, mappedEnd) << "unexpected end of file";
+      std::memcpy(bytes.data(), cur, size);
+      cur += size;
+    } else
+      for (uchar &byte : bytes) {
+        int val;
+        stream >> val;
+        byte = uchar(val);
+      }
+  }
 
 private:
+  template <typename T> void get(T &val) {
+    if (mapped) {
+      CHECK_LE(cur + sizeof(T), mappedEnd) << "unexpected end of file";
+      std::memcpy(&val, cur, sizeof(T));
+      cur += sizeof(T);
+    } else
+      stream >> val;
+  }
+
   std::ifstream stream;
+  // the whole file if it is binary
+  char *mapped;
+  size_t mappedSize;
+  const char *cur;
+  const char *mappedEnd;
 };
 
 template <SerializerMode mode> class PointSerializer {
 public:
-  PointSerializer(const fs::path &pointsFname, int patternSize);
+  // format is only used for storing, loading detects it
+  PointSerializer(const fs::path &pointsFname, int patternSize,
+                  SerializerFormat format = BINARY);
 
   void process(RefT<mode, ImmaturePoint> p);
   void process(RefT<mode, OptimizedPoint> p);
@@ -96,12 +173,26 @@ private:
   int PS;
 };
 
+template <>
+PointSerializer<STORE>::PointSerializer(const fs::path &pointsFname,
+                                        int patternSize,
+                                        SerializerFormat format);
+template <>
+PointSerializer<LOAD>::PointSerializer(const fs::path &pointsFname,
+                                       int patternSize,
+                                       SerializerFormat format);
+
 class PreKeyFrameLoader {
 public:
+  // With frameFname the image is taken from there, see FrameEmbedding, and
+  // the dataset reader can be null.
   PreKeyFrameLoader(const MultiFovReader *datasetReader, CameraModel *cam,
                     KeyFrame *baseFrame, const fs::path &preKeyFrameFname,
-                    const Settings::Pyramid &pyramidSettings);
+                    const Settings::Pyramid &pyramidSettings,
+                    const fs::path &frameFname = {});
   std::shared_ptr<PreKeyFrame> load() const;
+  // loads only the pose and light, without reading the frame itself
+  TrackedFrameRecord loadRecord() const;
 
 private:
   const MultiFovReader *datasetReader;
@@ -109,14 +200,20 @@ private:
   KeyFrame *baseFrame;
   fs::path preKeyFrameFname;
   Settings::Pyramid pyramidSettings;
+  fs::path frameFname;
 };
 
 class PreKeyFrameSaver {
 public:
   static void store(const fs::path &preKeyFrameFname,
-                    const PreKeyFrame &preKeyFrame);
+                    const TrackedFrameRecord &record,
+                    SerializerFormat format = BINARY);
+  static void storeFrame(const fs::path &frameFname, const cv::Mat1b &frame,
+                         FrameEmbedding embedding,
+                         SerializerFormat format = BINARY);
 };
 
+// Keyframes with embedded frames are loaded without the dataset reader.
 class KeyFrameLoader {
 public:
   KeyFrameLoader(const MultiFovReader *datasetReader,
@@ -125,6 +222,8 @@ public:
                  const PointTracerSettings &tracerSettings);
   void load(const fs::path &keyFrameDir,
             StdMap<int, KeyFrame> &keyFrames) const;
+  // Overwrites what KeyFrameSaver::storeState stores in a loaded keyframe.
+  void loadState(const fs::path &stateFname, KeyFrame &keyFrame) const;
 
 private:
   template <typename PointT>
@@ -138,13 +237,23 @@ private:
   fs::path snapshotDir;
   CameraModel *cam;
   Settings::KeyFrame kfSettings;
-  PointTracerSettings tracerSettings;
+  // shared by all of the loaded keyframes
+  std::shared_ptr<const PointTracerSettings> tracerSettings;
 };
 
 class KeyFrameSaver {
 public:
-  KeyFrameSaver(const fs::path &snapshotDir, int patternSize);
+  // Without storeTrackedFrames only the numbers of the tracked frames are
+  // stored with the keyframe, and their own files are left to the caller.
+  KeyFrameSaver(const fs::path &snapshotDir, int patternSize,
+                SerializerFormat format = BINARY,
+                FrameEmbedding frameEmbedding = NO_FRAMES,
+                bool storeTrackedFrames = true);
   void store(const KeyFrame &keyFrame) const;
+  // Stores what bundle adjustment and tracing change in a keyframe while its
+  // points stay the same: the pose, the light, the depths and states of the
+  // points and the numbers of the tracked frames.
+  void storeState(const fs::path &stateFname, const KeyFrame &keyFrame) const;
 
 private:
   template <typename PointT>
@@ -156,8 +265,16 @@ private:
 
   fs::path snapshotDir;
   int patternSize;
+  SerializerFormat format;
+  FrameEmbedding frameEmbedding;
+  bool storeTrackedFrames;
 };
 
+// Loads a snapshot of SnapshotSaver, or, if there is a manifest in the
+// directory, the last window listed by DeltaSnapshotSaver. The dataset
+// reader is only needed if the frames are not embedded. The latter is
+// replayed from the manifest: every keyframe is loaded from the last delta
+// that has it in full, and then takes the state from a later delta, if any.
 class SnapshotLoader {
 public:
   SnapshotLoader(const MultiFovReader *datasetReader, CameraModel *cam,
@@ -167,8 +284,6 @@ public:
   CameraModel *getCam() const { return cam; }
 
 private:
-  void loadDepthColBounds() const;
-
   const MultiFovReader *datasetReader;
   CameraModel *cam;
   fs::path snapshotDir;
@@ -177,15 +292,72 @@ private:
 
 class SnapshotSaver {
 public:
-  SnapshotSaver(const fs::path &snapshotDir, int patternSize);
+  SnapshotSaver(const fs::path &snapshotDir, int patternSize,
+                SerializerFormat format = BINARY,
+                FrameEmbedding frameEmbedding = NO_FRAMES);
 
   void save(const KeyFrame *keyFrames[], int numKeyFrames) const;
 
 private:
-  void saveDepthColBounds() const;
+  fs::path snapshotDir;
+  int patternSize;
+  SerializerFormat format;
+  FrameEmbedding frameEmbedding;
+};
+
+// Checkpoints a window into snapshotDir on every call to save, writing only
+// what has changed since the previous call. Each call makes a delta
+// directory. A keyframe goes there in full if it is new or its points have
+// changed, and as its state alone (see KeyFrameSaver::storeState) if only
+// that has changed. The tracked frames are stored once, in snapshotDir
+// itself. A delta is listed in the append-only manifest only after its files
+// are synced to the disk, and the syncs are batched by syncEvery deltas, so
+// a crash loses at most the last syncEvery - 1 deltas and never leaves the
+// manifest referring to missing data. Once synced, deltas and tracked frames
+// that the listed window does not need anymore are removed. Checkpointing
+// into a directory of an earlier run goes on with its manifest.
+class DeltaSnapshotSaver {
+public:
+  DeltaSnapshotSaver(const fs::path &snapshotDir, int patternSize,
+                     SerializerFormat format = BINARY, int syncEvery = 1,
+                     FrameEmbedding frameEmbedding = NO_FRAMES);
+  DeltaSnapshotSaver(const DeltaSnapshotSaver &other) = delete;
+  // syncs the pending deltas
+  ~DeltaSnapshotSaver();
+
+  void save(const KeyFrame *keyFrames[], int numKeyFrames);
+  // syncs and lists the deltas saved since the last sync
+  void sync();
+
+private:
+  struct StoredKeyFrame {
+    // of the points and of everything storeState stores
+    uint64_t structureHash;
+    uint64_t stateHash;
+    int fullDelta;
+    // -1 if the state has not changed since the full one
+    int stateDelta;
+    std::vector<int> trackedNums;
+  };
+
+  struct PendingDelta {
+    int num;
+    std::string manifestLine;
+  };
+
+  fs::path deltaDir(int delta) const;
+  void removeUnneeded() const;
 
   fs::path snapshotDir;
   int patternSize;
+  SerializerFormat format;
+  int syncEvery;
+  FrameEmbedding frameEmbedding;
+
+  int nextDelta;
+  std::map<int, StoredKeyFrame> stored;
+  std::vector<PendingDelta> pending;
+  std::vector<fs::path> pendingTracked;
 };
 
 } // namespace fishdso
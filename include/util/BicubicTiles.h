@@ -0,0 +1,86 @@
+#ifndef INCLUDE_BICUBICTILES
+#define INCLUDE_BICUBICTILES
+
+#include "util/types.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <vector>
+
+namespace fishdso {
+
+// Bicubic interpolation of an image with the polynomial of every cell
+// between four pixels precomputed, for the images that are sampled over and
+// over, like the keyframes in bundle adjustment. It interpolates exactly like
+// ceres::BiCubicInterpolator over a ceres::Grid2D (Catmull-Rom splines with
+// clamped indices), but a sample reads the 16 coefficients of one cell, a
+// single cache line, and evaluates the polynomial, instead of computing the
+// spline weights and gathering 16 pixels from four rows. The coefficients
+// take 64 bytes per pixel, so they are computed in square tiles of
+// tileSize cells on the first sample in the tile. Sampling can be done from
+// several threads.
+class BicubicTiles {
+public:
+  static constexpr int tileSize = 16;
+  static constexpr int cellFloats = 16;
+
+  // The image should not be changed while the tiles are alive, it is
+  // shared, not copied.
+  BicubicTiles(const cv::Mat1b &img);
+
+  EIGEN_STRONG_INLINE void evaluate(double y, double x, double *f,
+                                    double *dfdy = nullptr,
+                                    double *dfdx = nullptr) const {
+    // Outside of cells [-1, size - 1] the clamped splines are constant, and
+    // on the border ones they already reach the constant with a zero
+    // derivative, so the coordinates are clamped onto them.
+    double cy = std::clamp(std::floor(y), -1.0, double(image.rows - 1));
+    double cx = std::clamp(std::floor(x), -1.0, double(image.cols - 1));
+    float s = std::clamp(float(y - cy), 0.0f, 1.0f);
+    float t = std::clamp(float(x - cx), 0.0f, 1.0f);
+    const float *a = cell(int(cy) + 1, int(cx) + 1);
+
+    // a[4 * i + j] is the coefficient of s^i t^j
+    float r[4], dr[4];
+    for (int i = 0; i < 4; ++i, a += 4) {
+      r[i] = a[0] + t * (a[1] + t * (a[2] + t * a[3]));
+      dr[i] = a[1] + t * (2 * a[2] + t * 3 * a[3]);
+    }
+    *f = r[0] + s * (r[1] + s * (r[2] + s * r[3]));
+    if (dfdy)
+      *dfdy = r[1] + s * (2 * r[2] + s * 3 * r[3]);
+    if (dfdx)
+      *dfdx = dr[0] + s * (dr[1] + s * (dr[2] + s * dr[3]));
+  }
+
+  // Frees the computed tiles, they are computed again if sampled. Should not
+  // race with evaluate.
+  void release();
+
+  int materializedTiles() const;
+
+  EIGEN_STRONG_INLINE int getWidth() const { return image.cols; }
+  EIGEN_STRONG_INLINE int getHeight() const { return image.rows; }
+
+private:
+  // of cell (cy - 1, cx - 1)
+  EIGEN_STRONG_INLINE const float *cell(int cy, int cx) const {
+    int tile = (cy / tileSize) * tilesX + cx / tileSize;
+    std::call_once(tileOnce[tile], [this, tile]() { materialize(tile); });
+    return tiles[tile].get() +
+           ((cy % tileSize) * tileSize + cx % tileSize) * cellFloats;
+  }
+
+  void materialize(int tile) const;
+
+  cv::Mat1b image;
+  int tilesX, tilesY;
+  mutable std::vector<std::unique_ptr<float[]>> tiles;
+  mutable std::unique_ptr<std::once_flag[]> tileOnce;
+};
+
+} // namespace fishdso
+
+#endif
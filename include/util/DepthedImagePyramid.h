@@ -8,12 +8,73 @@
 namespace fishdso {
 
 struct DepthedImagePyramid : ImagePyramid {
+  // Points with known depth on one pyramid level, as a structure of arrays.
+  // On level l a point stands for a 2^l x 2^l block of the base image, with
+  // the depth being the weighted average of the depths inside the block.
+  struct DepthedPoints {
+    inline int size() const { return depth.size(); }
+
+    std::vector<float> x, y;
+    std::vector<float> depth;
+    std::vector<float> weight;
+  };
+
   DepthedImagePyramid(const cv::Mat1b &baseImage, int levelNum,
                       const StdVector<Vec2> &points,
                       const std::vector<double> &depthsVec,
                       const std::vector<double> &weightsVec);
+  // the same with the point positions as a structure of arrays
+  DepthedImagePyramid(const cv::Mat1b &baseImage, int levelNum,
+                      const std::vector<double> &pointsX,
+                      const std::vector<double> &pointsY,
+                      const std::vector<double> &depthsVec,
+                      const std::vector<double> &weightsVec);
+  // Shares the first levelNum levels of an already built pyramid of the base
+  // image instead of building them again, if it has as many.
+  DepthedImagePyramid(const ImagePyramid &images, int levelNum,
+                      const std::vector<double> &pointsX,
+                      const std::vector<double> &pointsY,
+                      const std::vector<double> &depthsVec,
+                      const std::vector<double> &weightsVec);
+
+  // Replaces the depths and weights of the points the pyramid was built
+  // from, if they still fall into the same pixels of the base image, e.g.
+  // after bundle adjustment only changed their depths. The points on the
+  // coarser levels are then recomputed in place without sorting. Returns
+  // false and leaves the pyramid unchanged otherwise.
+  bool updateDepths(const std::vector<double> &pointsX,
+                    const std::vector<double> &pointsY,
+                    const std::vector<double> &depthsVec,
+                    const std::vector<double> &weightsVec);
+
+  std::vector<DepthedPoints> points;
+
+private:
+  // The blocks with any points on every level, in the order of their
+  // indices. A block is in points only if its weights do not sum to zero.
+  struct Blocks {
+    // the index in points of the level or -1
+    std::vector<int> depthed;
+    // the index of the block containing it on the next level, -1 if it is
+    // cut off by the odd size of the level
+    std::vector<int> parent;
+  };
+
+  void splat(const std::vector<double> &pointsX,
+             const std::vector<double> &pointsY,
+             const std::vector<double> &depthsVec,
+             const std::vector<double> &weightsVec);
+  // weighted depth sums and weight sums of the blocks on all levels
+  void sumBlocks(const std::vector<double> &depthsVec,
+                 const std::vector<double> &weightsVec,
+                 std::vector<std::vector<double>> &depthSums,
+                 std::vector<std::vector<double>> &weightSums) const;
 
-  std::vector<cv::Mat1d> depths;
+  std::vector<Blocks> blocks;
+  // the pixel of every point, -1 if outside of the image
+  std::vector<int> pointPixel;
+  // the block of every point on level 0, -1 if outside of the image
+  std::vector<int> pointBlock;
 };
 
 } // namespace fishdso
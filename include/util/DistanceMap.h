@@ -1,22 +1,37 @@
 #ifndef INCLUDE_DISTANCEMAP
 #define INCLUDE_DISTANCEMAP
 
+#include "util/PointGrid.h"
 #include "util/settings.h"
 #include "util/types.h"
 
 namespace fishdso {
 
+// Exact squared Euclidean distances from every pixel of a w x h image to the
+// nearest of the given points, computed with the separable linear-time
+// transform of Felzenszwalb and Huttenlocher.
 class DistanceMap {
 public:
-  DistanceMap(int givenW, int givenH, const StdVector<Vec2> &points,
+  DistanceMap(int w, int h, const StdVector<Vec2> &points,
               const Settings::DistanceMap &settings = {});
 
-  // returns coefficients chosen
-  std::vector<int> choose(const StdVector<Vec2> &otherPoints, int pointsNeeded);
+  // Greedily picks up to pointsNeeded of otherPoints, each time the one
+  // farthest from both the map's points and the ones picked before. Returns
+  // the indices of the picked points in the order of picking. Points outside
+  // of the image are never picked.
+  std::vector<int> choose(const StdVector<Vec2> &otherPoints,
+                          int pointsNeeded) const;
+  // The same for candidates that are already bucketed, all on the image.
+  // Cells of the grid should not be much larger than settings.cellSize.
+  std::vector<int> choose(const std::vector<double> &x,
+                          const std::vector<double> &y, const PointGrid &grid,
+                          int pointsNeeded) const;
+
+  // INF-like std::numeric_limits<int>::max() when there are no points
+  int sqDistAt(int x, int y) const { return sqDist(y, x); }
 
 private:
-  int pyrDown;
-  MatXXi dist;
+  MatXXi sqDist;
 
   Settings::DistanceMap settings;
 };
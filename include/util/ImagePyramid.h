@@ -2,13 +2,39 @@
 #define INCLUDE_IMAGEPYRAMID
 
 #include "util/settings.h"
+#include "util/types.h"
+#include <Eigen/Core>
 #include <ceres/cubic_interpolation.h>
 #include <opencv2/opencv.hpp>
 
 namespace fishdso {
 
+// Gradients of every level of an ImagePyramid. The matrices are headers into
+// a single aligned arena, each plane padded to a multiple of 8 floats so
+// that all of them keep the alignment of the arena.
+struct PyramidGradients {
+  std::vector<cv::Mat1f> gradX, gradY, gradNorm;
+  std::vector<float, Eigen::aligned_allocator<float>> arena;
+};
+
 struct ImagePyramid {
+  ImagePyramid() = default;
   ImagePyramid(const cv::Mat1b &baseImage, int levelNum);
+  // Also computes the gradients of all levels, in the same pass over each
+  // level that produces the next one.
+  ImagePyramid(const cv::Mat1b &baseImage, int levelNum,
+               PyramidGradients &gradients);
+
+  // Rebuilds the levels above images[0] only, reusing the storage in the
+  // same way as the overload below.
+  void rebuild(int levelNum);
+  // Rebuilds the levels above images[0] and the gradients of all of them.
+  // Storage of a previous build of the same size is reused, except for the
+  // levels still referenced from elsewhere, which are reallocated. If
+  // validSpans are given, for every level, gradients are only computed in
+  // them, as with gradAndPyrDown.
+  void rebuild(int levelNum, PyramidGradients &gradients,
+               const std::vector<std::vector<Vec2i>> *validSpans = nullptr);
 
   inline cv::Mat1b &operator[](int ind) { return images[ind]; }
   inline const cv::Mat1b &operator[](int ind) const { return images[ind]; }
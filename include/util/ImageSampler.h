@@ -0,0 +1,162 @@
+#ifndef INCLUDE_IMAGESAMPLER
+#define INCLUDE_IMAGESAMPLER
+
+#include "util/Placement.h"
+#include "util/types.h"
+#include <algorithm>
+#include <cmath>
+#include <opencv2/core.hpp>
+#include <type_traits>
+
+namespace fishdso {
+
+// Bicubic sampler over a float copy of the image, padded by replicating the
+// border. It interpolates exactly like ceres::BiCubicInterpolator over a
+// ceres::Grid2D (Catmull-Rom splines with clamped indices), but never has to
+// check bounds per tap. evaluateBatch processes points in fixed-size chunks
+// laid out so that the weight computation and the tap accumulation vectorize.
+// The copy is either stored row by row or in tiles of 4x4 pixels, 64 bytes
+// each, which keeps the taps of the curved sampling patterns of the fisheye
+// warps in fewer cache lines. The batches can also be sampled with the
+// cheaper nearest neighbour and bilinear kernels, chosen at compile time, for
+// the consumers that do not need the bicubic precision.
+class ImageSampler {
+public:
+  enum Layout { ROW_MAJOR, TILED };
+  // NEAREST takes the derivatives by central differences around the nearest
+  // pixel, BILINEAR those of the bilinear patch.
+  enum Interpolation { NEAREST, BILINEAR, BICUBIC };
+
+  // Coordinates are clamped to [-pad + 1, size + pad - 3], which is where
+  // the clamped-index interpolation becomes constant anyway.
+  static constexpr int pad = 3;
+  static constexpr int batchSize = 8;
+  static constexpr int tileSide = 4;
+
+  // With hugePages the copy is allocated with HugePageAllocator.
+  ImageSampler(const cv::Mat1b &img, Layout layout = ROW_MAJOR,
+               bool hugePages = false);
+
+  // Resamples img, reusing the buffer if it is large enough.
+  void reset(const cv::Mat1b &img);
+
+  EIGEN_STRONG_INLINE void evaluate(double y, double x, double *f,
+                                    double *dfdy = nullptr,
+                                    double *dfdx = nullptr) const {
+    float fy = std::clamp(float(y), minCoord, maxY);
+    float fx = std::clamp(float(x), minCoord, maxX);
+    float iy = std::floor(fy), ix = std::floor(fx);
+    float wy[4], wx[4], dwy[4], dwx[4];
+    splineWeights(fy - iy, wy, dwy);
+    splineWeights(fx - ix, wx, dwx);
+
+    int rows[4], cols[4];
+    tapOffsets(int(iy), int(ix), rows, cols);
+    float val = 0, valDy = 0, valDx = 0;
+    for (int r = 0; r < 4; ++r) {
+      const float *row = data.data() + rows[r];
+      float rowVal = 0, rowDx = 0;
+      for (int c = 0; c < 4; ++c) {
+        rowVal += wx[c] * row[cols[c]];
+        rowDx += dwx[c] * row[cols[c]];
+      }
+      val += wy[r] * rowVal;
+      valDy += dwy[r] * rowVal;
+      valDx += wy[r] * rowDx;
+    }
+
+    *f = val;
+    if (dfdy)
+      *dfdy = valDy;
+    if (dfdx)
+      *dfdx = valDx;
+  }
+
+  // Samples n points at once. Any of the derivative outputs may be null.
+  // Sampling is done in floats either way, the float overload just saves
+  // the conversions for callers that work in floats.
+  void evaluateBatch(int n, const double *ys, const double *xs, double *f,
+                     double *dfdy = nullptr, double *dfdx = nullptr) const;
+  void evaluateBatch(int n, const float *ys, const float *xs, float *f,
+                     float *dfdy = nullptr, float *dfdx = nullptr) const;
+  // The same with the interpolation given, T being either float or double.
+  template <Interpolation I, typename T>
+  void evaluateBatch(int n, const T *ys, const T *xs, T *f, T *dfdy = nullptr,
+                     T *dfdx = nullptr) const;
+
+  EIGEN_STRONG_INLINE int getWidth() const { return width; }
+  EIGEN_STRONG_INLINE int getHeight() const { return height; }
+  EIGEN_STRONG_INLINE Layout getLayout() const { return layout; }
+
+private:
+  // Catmull-Rom weights and their derivatives for the four taps around t.
+  EIGEN_STRONG_INLINE static void splineWeights(float t, float *w, float *dw) {
+    float t2 = t * t, t3 = t2 * t;
+    w[0] = 0.5f * (-t3 + 2 * t2 - t);
+    w[1] = 0.5f * (3 * t3 - 5 * t2 + 2);
+    w[2] = 0.5f * (-3 * t3 + 4 * t2 + t);
+    w[3] = 0.5f * (t3 - t2);
+    dw[0] = 0.5f * (-3 * t2 + 4 * t - 1);
+    dw[1] = 0.5f * (9 * t2 - 10 * t);
+    dw[2] = 0.5f * (-9 * t2 + 8 * t + 1);
+    dw[3] = 0.5f * (3 * t2 - 2 * t);
+  }
+
+  template <typename T>
+  void evaluateBicubic(int n, const T *ys, const T *xs, T *f, T *dfdy,
+                       T *dfdx) const;
+  template <typename T>
+  void evaluateBilinear(int n, const T *ys, const T *xs, T *f, T *dfdy,
+                        T *dfdx) const;
+  template <typename T>
+  void evaluateNearest(int n, const T *ys, const T *xs, T *f, T *dfdy,
+                       T *dfdx) const;
+
+  // The offset of a tap is the sum of the offsets of its row and its column
+  // in both of the layouts.
+  EIGEN_STRONG_INLINE void tapOffsets(int iy, int ix, int *rows,
+                                      int *cols) const {
+    int py = iy - 1 + pad, px = ix - 1 + pad;
+    for (int k = 0; k < 4; ++k) {
+      if (layout == TILED) {
+        rows[k] = ((py + k) / tileSide) * stride +
+                  ((py + k) % tileSide) * tileSide;
+        cols[k] = ((px + k) / tileSide) * tileSide * tileSide +
+                  (px + k) % tileSide;
+      } else {
+        rows[k] = (py + k) * stride;
+        cols[k] = px + k;
+      }
+    }
+  }
+
+  Layout layout;
+  // of a padded row in ROW_MAJOR, of a row of tiles in TILED
+  int stride;
+  int width, height;
+  float minCoord, maxX, maxY;
+  std::vector<float, HugePageAllocator<float>> data;
+  // the padded image before it is tiled
+  std::vector<float, HugePageAllocator<float>> rowMajor;
+};
+
+// Calls func with std::integral_constant<ImageSampler::Interpolation, I> of
+// the given interpolation, so that the kernels using it are instantiated for
+// each of the interpolations and the choice is made once per call.
+template <typename Func>
+decltype(auto) dispatchInterpolation(ImageSampler::Interpolation interpolation,
+                                     Func &&func) {
+  using I = ImageSampler::Interpolation;
+  switch (interpolation) {
+  case ImageSampler::NEAREST:
+    return func(std::integral_constant<I, ImageSampler::NEAREST>());
+  case ImageSampler::BILINEAR:
+    return func(std::integral_constant<I, ImageSampler::BILINEAR>());
+  default:
+    return func(std::integral_constant<I, ImageSampler::BICUBIC>());
+  }
+}
+
+} // namespace fishdso
+
+#endif
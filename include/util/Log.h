@@ -0,0 +1,157 @@
+#ifndef INCLUDE_LOG
+#define INCLUDE_LOG
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <sstream>
+#include <string>
+
+namespace fishdso {
+
+// The subsystems that have a verbosity of their own.
+enum class LogCategory {
+  SYSTEM,
+  INIT,
+  TRACKING,
+  TRACING,
+  MAPPING,
+  BA,
+  LOOP,
+  CAMERA,
+  SELECTION
+};
+constexpr int logCategoryNum = int(LogCategory::SELECTION) + 1;
+
+struct LogRecord {
+  LogCategory category;
+  int level;
+  const char *file;
+  int line;
+  std::string message;
+};
+
+// The process-wide verbosities and sink of the DSO_LOG messages below.
+//
+// The levels are
+//   0 for the rare events, like the creation of the system, initialization,
+//     loop closures and relocalization,
+//   1 for the summaries of a keyframe or of an adjustment,
+//   2 for the summaries of a frame or of a pyramid level,
+//   3 for the messages about single points and full solver reports.
+// A message is written if its level is not above the verbosity of its
+// category, 0 by default, and is compiled out altogether if its level is above
+// FISHDSO_MAX_LOG_LEVEL (see the LOG_MAX_LEVEL CMake option). Its arguments
+// are evaluated and formatted only if it is written.
+//
+// The formatted messages are handed over to a thread of the sink, which writes
+// them into glog, so that the synchronous file writes of glog stay off the
+// hot path. The queue of the sink is bounded, and when it is full the messages
+// are dropped and counted, not waited for. The queue is drained at the exit,
+// but not on a failed CHECK, so the warnings and errors still go to glog
+// directly.
+class Log {
+public:
+  static constexpr int queueSize = 4096;
+
+  static void setVerbosity(LogCategory category, int level);
+  static int verbosity(LogCategory category) {
+    return verbosities[int(category)].load(std::memory_order_relaxed);
+  }
+  static bool isOn(LogCategory category, int level) {
+    return level <= verbosity(category);
+  }
+  // "category=level,..." with the lowercase names of the categories, "all"
+  // standing for every one of them, e.g. "all=1,tracking=2"
+  static void setVerbosities(const std::string &spec);
+  static const char *categoryName(LogCategory category);
+
+  static void push(LogRecord &&record);
+  // waits until everything pushed so far is written
+  static void flush();
+  // Writes the messages with the given function instead of glog, an empty one
+  // restores glog. The function is called on the thread of the sink.
+  static void setSink(std::function<void(const LogRecord &)> sink);
+  // since the start
+  static long long droppedNum();
+
+private:
+  static std::array<std::atomic<int>, logCategoryNum> verbosities;
+};
+
+// Lets one message through per period and counts the ones it holds back.
+class LogRateLimiter {
+public:
+  explicit LogRateLimiter(double periodSeconds);
+
+  bool allow();
+  // the messages held back since the previous call
+  int takeSuppressed();
+
+private:
+  long long periodNs;
+  std::atomic<long long> nextNs{0};
+  std::atomic<int> suppressed{0};
+};
+
+// Collects a message and pushes it to the sink when destroyed.
+class LogMessage {
+public:
+  LogMessage(LogCategory category, int level, const char *file, int line,
+             LogRateLimiter *limiter = nullptr);
+  ~LogMessage();
+
+  std::ostream &stream() { return message; }
+
+private:
+  LogCategory category;
+  int level;
+  const char *file;
+  int line;
+  LogRateLimiter *limiter;
+  std::ostringstream message;
+};
+
+// turns the stream into void for the conditional operator of DSO_LOG
+struct LogMessageVoidify {
+  void operator&(std::ostream &) {}
+};
+
+} // namespace fishdso
+
+#ifndef FISHDSO_MAX_LOG_LEVEL
+#define FISHDSO_MAX_LOG_LEVEL 2
+#endif
+
+// whether a message would be written, to skip computing what only the message
+// needs
+#define DSO_LOG_IS_ON(category, level)                                         \
+  ((level) <= FISHDSO_MAX_LOG_LEVEL &&                                         \
+   ::fishdso::Log::isOn(::fishdso::LogCategory::category, (level)))
+
+// DSO_LOG(TRACKING, 2) << "tracked frame #" << frameNum;
+#define DSO_LOG(category, level)                                               \
+  !DSO_LOG_IS_ON(category, level)                                              \
+      ? (void)0                                                                \
+      : ::fishdso::LogMessageVoidify() &                                       \
+            ::fishdso::LogMessage(::fishdso::LogCategory::category, (level),   \
+                                  __FILE__, __LINE__)                          \
+                .stream()
+
+// At most one message per the given constant number of seconds from a call
+// site, the next one written telling how many were held back.
+#define DSO_LOG_EVERY_SEC(category, level, seconds)                            \
+  for (::fishdso::LogRateLimiter *fishdsoLogLimiter =                          \
+           DSO_LOG_IS_ON(category, level)                                      \
+               ? &[]() -> ::fishdso::LogRateLimiter & {                        \
+                   static ::fishdso::LogRateLimiter limiter(seconds);          \
+                   return limiter;                                             \
+                 }()                                                           \
+               : nullptr;                                                      \
+       fishdsoLogLimiter && fishdsoLogLimiter->allow();                        \
+       fishdsoLogLimiter = nullptr)                                            \
+  ::fishdso::LogMessage(::fishdso::LogCategory::category, (level), __FILE__,   \
+                        __LINE__, fishdsoLogLimiter)                           \
+      .stream()
+
+#endif
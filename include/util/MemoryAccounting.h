@@ -0,0 +1,88 @@
+#ifndef INCLUDE_MEMORYACCOUNTING
+#define INCLUDE_MEMORYACCOUNTING
+
+#include "util/Profiler.h"
+#include <Eigen/Core>
+#include <cstddef>
+#include <vector>
+
+namespace fishdso {
+
+// Memory is booked to a subsystem through its tag, a type with the name of
+// the metric, like
+//   struct PoseHistoryMemory {
+//     static constexpr const char *name = "memory.poseHistory";
+//   };
+// The bytes and the allocations go to the memory metrics of Profiler, and
+// from there to the ProfilingObserver-s. Nothing is booked without
+// PROFILING.
+template <typename Tag> int memoryId() {
+  static const int id = Profiler::registerMemory(Tag::name);
+  return id;
+}
+
+template <typename Tag> void bookAllocation(long long bytes) {
+#ifdef FISHDSO_PROFILING
+  Profiler::addAllocation(memoryId<Tag>(), bytes);
+#endif
+}
+
+template <typename Tag> void bookDeallocation(long long bytes) {
+#ifdef FISHDSO_PROFILING
+  Profiler::addDeallocation(memoryId<Tag>(), bytes);
+#endif
+}
+
+// Eigen::aligned_allocator that books what it allocates to Tag.
+template <typename T, typename Tag>
+class CountingAllocator : public Eigen::aligned_allocator<T> {
+public:
+  template <typename U> struct rebind {
+    typedef CountingAllocator<U, Tag> other;
+  };
+
+  CountingAllocator() = default;
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U, Tag> &other) {}
+
+  T *allocate(std::size_t num, const void *hint = nullptr) {
+    T *result = Eigen::aligned_allocator<T>::allocate(num, hint);
+    bookAllocation<Tag>(num * sizeof(T));
+    return result;
+  }
+
+  void deallocate(T *p, std::size_t num) {
+    bookDeallocation<Tag>(num * sizeof(T));
+    Eigen::aligned_allocator<T>::deallocate(p, num);
+  }
+};
+
+template <typename T, typename U, typename Tag>
+bool operator==(const CountingAllocator<T, Tag> &,
+                const CountingAllocator<U, Tag> &) {
+  return true;
+}
+
+template <typename T, typename U, typename Tag>
+bool operator!=(const CountingAllocator<T, Tag> &,
+                const CountingAllocator<U, Tag> &) {
+  return false;
+}
+
+// StdVector with its storage booked to Tag
+template <typename T, typename Tag>
+using CountedVector = std::vector<T, CountingAllocator<T, Tag>>;
+
+// Base of the objects that are booked to Tag by their own size. What they
+// own besides is not included.
+template <typename Tag, typename T> class CountedObject {
+protected:
+  CountedObject() { bookAllocation<Tag>(sizeof(T)); }
+  CountedObject(const CountedObject &other) { bookAllocation<Tag>(sizeof(T)); }
+  CountedObject &operator=(const CountedObject &other) = default;
+  ~CountedObject() { bookDeallocation<Tag>(sizeof(T)); }
+};
+
+} // namespace fishdso
+
+#endif
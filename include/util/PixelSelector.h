@@ -9,21 +9,26 @@ namespace fishdso {
 
 class PixelSelector {
 public:
-  PixelSelector(const Settings::PixelSelector &settings = {});
+  PixelSelector(const PixelSelectorSettings &settings = {});
 
-  std::vector<cv::Point> select(const cv::Mat &frame, const cv::Mat1d &gradNorm,
-                                int pointsNeeded, cv::Mat *debugOut);
+  // If validSpans are given, as by CameraModel::getValidSpans, only the
+  // pixels in them are selected, and the blocks out of them are skipped.
+  // Pixels that are zero in the mask, if it is given, are not selected.
+  std::vector<cv::Point> select(const cv::Mat &frame, const cv::Mat1f &gradNorm,
+                                int pointsNeeded, cv::Mat *debugOut,
+                                const std::vector<Vec2i> *validSpans = nullptr,
+                                const cv::Mat1b *mask = nullptr);
 
 private:
-  std::vector<cv::Point> selectInternal(const cv::Mat &frame,
-                                        const cv::Mat1d &gradNorm,
-                                        int pointsNeeded, int blockSize,
-                                        cv::Mat *debugOut);
+  std::vector<cv::Point>
+  selectInternal(const cv::Mat &frame, const cv::Mat1f &gradNorm,
+                 int pointsNeeded, int blockSize, cv::Mat *debugOut,
+                 const std::vector<Vec2i> *validSpans, const cv::Mat1b *mask);
 
   int lastBlockSize;
   int lastPointsFound;
 
-  Settings::PixelSelector settings;
+  PixelSelectorSettings settings;
 };
 
 } // namespace fishdso
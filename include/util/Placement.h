@@ -0,0 +1,79 @@
+#ifndef INCLUDE_PLACEMENT
+#define INCLUDE_PLACEMENT
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace fishdso {
+
+// Placement of the threads and the memory of a DsoSystem on the cores and
+// the memory nodes of a multi-socket machine. Pages are placed on the node
+// of the thread that first touches them, so with all of the threads of an
+// instance pinned to the cores of one node its buffers stay local too.
+// Pinning is only supported on Linux and does nothing elsewhere.
+
+// Parses a list of cores like "0-7,16-23".
+std::vector<int> parseCoreList(const std::string &list);
+
+// Restricts the calling thread to the cores, an empty list leaves it as it
+// is. Returns false if it could not be pinned.
+bool pinThread(const std::vector<int> &cores);
+
+// Pins the calling thread to the cores for its lifetime and then restores
+// the previous affinity.
+class ScopedAffinity {
+public:
+  explicit ScopedAffinity(const std::vector<int> &cores);
+  ScopedAffinity(const ScopedAffinity &other) = delete;
+  ~ScopedAffinity();
+
+private:
+  std::vector<int> previousCores;
+};
+
+// Memory for the large per-frame buffers. If enabled, blocks of at least a
+// huge page are aligned to it and advised to be backed by transparent huge
+// pages before they are touched, which takes the TLB misses off the sampling
+// of the pyramids. Small blocks and disabled allocators are aligned for
+// vectorization, like Eigen::aligned_allocator.
+void *allocateBuffer(size_t bytes, bool hugePages);
+void freeBuffer(void *data, size_t bytes, bool hugePages);
+
+template <typename T> class HugePageAllocator {
+public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  HugePageAllocator(bool enabled = false)
+      : enabled(enabled) {}
+  template <typename U>
+  HugePageAllocator(const HugePageAllocator<U> &other)
+      : enabled(other.enabled) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(allocateBuffer(n * sizeof(T), enabled));
+  }
+  void deallocate(T *data, size_t n) {
+    freeBuffer(data, n * sizeof(T), enabled);
+  }
+
+  bool enabled;
+};
+
+template <typename T, typename U>
+bool operator==(const HugePageAllocator<T> &a, const HugePageAllocator<U> &b) {
+  return a.enabled == b.enabled;
+}
+
+template <typename T, typename U>
+bool operator!=(const HugePageAllocator<T> &a, const HugePageAllocator<U> &b) {
+  return !(a == b);
+}
+
+} // namespace fishdso
+
+#endif
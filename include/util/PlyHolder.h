@@ -2,22 +2,48 @@
 #define INCLUDE_PLYHOLDER
 
 #include "util/types.h"
+#include <fstream>
 #include <opencv2/opencv.hpp>
 #include <string>
 #include <vector>
 
 namespace fishdso {
 
+// Writes a point cloud into a PLY file, which stays open with a large buffer
+// while points are being added. The vertex count in the header is reserved
+// upfront and patched by updatePointCount, and on destruction. If
+// pointsPerChunk is positive, the cloud is split into files of at most that
+// many points, named like "points_0.ply", "points_1.ply" for "points.ply",
+// so that a viewer can load a part of a large cloud.
 class PlyHolder {
 public:
-  PlyHolder(const std::string &fname);
+  enum Format { ASCII, BINARY };
+
+  PlyHolder(const std::string &fname, Format format = ASCII,
+            int pointsPerChunk = 0);
+  PlyHolder(const PlyHolder &other) = delete;
+  ~PlyHolder();
 
   void putPoints(const std::vector<Vec3> &points,
                  const std::vector<cv::Vec3b> &colors);
+  // patches the header and flushes, so that the file is valid after this
   void updatePointCount();
 
 private:
+  static constexpr int bufferSize = 1 << 20;
+
+  std::string chunkName(int chunk) const;
+  void openChunk();
+  void write(const Vec3 *points, const cv::Vec3b *colors, int count);
+
   std::string fname;
+  Format format;
+  int pointsPerChunk;
+
+  std::vector<char> buffer;
+  std::ofstream fs;
+  std::streampos countPos;
+  int chunkNum;
   int pointCount;
 };
 
@@ -0,0 +1,50 @@
+#ifndef INCLUDE_POINTGRID
+#define INCLUDE_POINTGRID
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace fishdso {
+
+// Indices of points on a w x h image, bucketed by the square cells they fall
+// into, for finding the points around a place without going over all of
+// them. Points off the image go to the nearest border cell.
+class PointGrid {
+public:
+  PointGrid(int w, int h, int cellSize, const std::vector<double> &x,
+            const std::vector<double> &y);
+
+  // Calls f(i) for every point i in the cells that intersect the box
+  // [minX, maxX] x [minY, maxY], in the order of cells. Points that are
+  // close to the box but outside of it may be visited too.
+  template <typename Callback>
+  void forEachInBox(double minX, double minY, double maxX, double maxY,
+                    Callback f) const {
+    const int cx1 = cellX(maxX), cy1 = cellY(maxY);
+    for (int cy = cellY(minY); cy <= cy1; ++cy)
+      for (int cx = cellX(minX); cx <= cx1; ++cx) {
+        int cell = cy * cellsW + cx;
+        for (int k = cellStart[cell]; k < cellStart[cell + 1]; ++k)
+          f(cellItems[k]);
+      }
+  }
+
+private:
+  inline int cellX(double x) const {
+    return std::clamp(int(std::floor(x / cellSize)), 0, cellsW - 1);
+  }
+  inline int cellY(double y) const {
+    return std::clamp(int(std::floor(y / cellSize)), 0, cellsH - 1);
+  }
+
+  int cellSize;
+  int cellsW, cellsH;
+  // the points of cell c are cellItems[cellStart[c]..cellStart[c + 1])
+  std::vector<int> cellStart;
+  std::vector<int> cellItems;
+};
+
+} // namespace fishdso
+
+#endif
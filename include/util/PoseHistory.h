@@ -0,0 +1,68 @@
+#ifndef INCLUDE_POSEHISTORY
+#define INCLUDE_POSEHISTORY
+
+#include "util/MemoryAccounting.h"
+#include "util/types.h"
+#include <deque>
+#include <vector>
+
+namespace fishdso {
+
+struct FramePose {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  int frameNum;
+  // of the SourceFrame
+  double timestamp = 0;
+  // false for the frames that only went into the initializer
+  bool isEstimated = false;
+  // the frame was skipped as late, see Settings::LoadShedding, and its pose
+  // is only predicted
+  bool isSkipped = false;
+  SE3 worldToFrame;
+  SE3 worldToFramePredict;
+};
+
+// Append-only store of frame poses keyed by strictly increasing frame
+// numbers. Frames are kept in chunks of a fixed size, so the memory is
+// proportional to the number of frames actually added, and old chunks can be
+// flushed once their poses are final.
+struct PoseHistoryMemory {
+  static constexpr const char *name = "memory.poseHistory";
+};
+
+class PoseHistory {
+public:
+  typedef CountedVector<FramePose, PoseHistoryMemory> Chunk;
+
+  PoseHistory(int chunkSize);
+
+  // frameNum should be greater than any of the frames appended before
+  FramePose &append(int frameNum);
+
+  // The frame should have been appended and not flushed yet.
+  FramePose &operator[](int frameNum);
+  const FramePose &operator[](int frameNum) const;
+
+  // Number of the ind-th last appended frame, ind = 0 gives the last one.
+  int lastFrameNum(int ind = 0) const;
+  // number of frames appended, including the flushed ones
+  EIGEN_STRONG_INLINE int size() const { return totalSize; }
+  EIGEN_STRONG_INLINE bool empty() const { return totalSize == 0; }
+
+  // Removes and returns the full chunks in which every frame is older than
+  // frameNum. The chunk being filled is never flushed.
+  std::vector<Chunk> flushBefore(int frameNum);
+  // Removes and returns all of the chunks.
+  std::vector<Chunk> flushAll();
+
+private:
+  std::deque<Chunk> chunks;
+  int chunkSize;
+  int totalSize;
+  int flushedSize;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef INCLUDE_PROFILER
+#define INCLUDE_PROFILER
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace fishdso {
+
+// Everything the instrumented code recorded since the previous
+// Profiler::collect(), merged over all threads. Metrics that were not hit
+// in this period are still listed, with zero values.
+struct FrameProfile {
+  struct Timer {
+    std::string name;
+    long long calls;
+    double seconds;
+  };
+
+  struct Counter {
+    std::string name;
+    long long value;
+  };
+
+  // Values below min go to the first bucket and values not below max go to
+  // the last one, so buckets.size() is the number of buckets plus two.
+  struct Histogram {
+    std::string name;
+    double min, max;
+    std::vector<long long> buckets;
+  };
+
+  // Memory that a subsystem holds. Unlike the other metrics the live bytes
+  // are not reset, they sum everything since the start.
+  struct Memory {
+    std::string name;
+    long long liveBytes;
+    // since the previous collect()
+    long long allocations;
+  };
+
+  int globalFrameNum = -1;
+  bool isKeyFrame = false;
+  std::vector<Timer> timers;
+  std::vector<Counter> counters;
+  std::vector<Histogram> histograms;
+  std::vector<Memory> memory;
+};
+
+// Process-wide registry of the metrics behind the PROFILE_* macros. Every
+// thread records into its own slots with relaxed atomics, so recording does
+// not contend; collect() sums the slots of all threads and resets them.
+//
+// While a trace is on, the timed scopes and the stages of StageClock are also
+// recorded as events on the timeline of their thread, to see how the threads
+// overlap. Every thread keeps its last events in a ring of its own, which
+// only it writes to, except while the trace is written out.
+class Profiler {
+public:
+  static constexpr int maxSlots = 1024;
+
+  // Registering a name twice returns the same id, so several call sites can
+  // feed one metric. The kinds and histogram ranges must agree.
+  static int registerTimer(const char *name);
+  static int registerCounter(const char *name);
+  static int registerHistogram(const char *name, double min, double max,
+                               int bucketNum);
+  // see util/MemoryAccounting.h
+  static int registerMemory(const char *name);
+
+  static void addTime(int id, std::chrono::steady_clock::duration duration);
+  static void addCount(int id, long long value);
+  static void addToHistogram(int id, double value);
+  // The memory can be freed on another thread than it was allocated.
+  static void addAllocation(int id, long long bytes);
+  static void addDeallocation(int id, long long bytes);
+
+  static FrameProfile collect();
+
+  // The rings of the threads hold eventsPerThread events each, the older
+  // ones are overwritten. Starting the trace again drops what was recorded,
+  // and should not be done while other threads record.
+  static void startTrace(int eventsPerThread);
+  static void stopTrace();
+  static bool isTracing() { return tracing.load(std::memory_order_relaxed); }
+  // The name should outlive the trace, like a literal or a metric name.
+  static void addTraceEvent(const char *name,
+                            std::chrono::steady_clock::time_point start,
+                            std::chrono::steady_clock::time_point end);
+  static const char *metricName(int id);
+  // Chrome trace event JSON of the events recorded so far, which both
+  // chrome://tracing and Perfetto open. The category of an event is the
+  // part of its name before the first dot.
+  static void writeTrace(const std::string &fname);
+
+private:
+  static std::atomic<bool> tracing;
+};
+
+class ProfileScope {
+public:
+  ProfileScope(int timerId)
+      : timerId(timerId)
+      , start(std::chrono::steady_clock::now()) {}
+  ~ProfileScope() {
+    auto end = std::chrono::steady_clock::now();
+    Profiler::addTime(timerId, end - start);
+    if (Profiler::isTracing())
+      Profiler::addTraceEvent(Profiler::metricName(timerId), start, end);
+  }
+
+private:
+  int timerId;
+  std::chrono::steady_clock::time_point start;
+};
+
+} // namespace fishdso
+
+#ifdef FISHDSO_PROFILING
+
+#define FISHDSO_PROFILE_CONCAT_(a, b) a##b
+#define FISHDSO_PROFILE_CONCAT(a, b) FISHDSO_PROFILE_CONCAT_(a, b)
+
+// times the rest of the enclosing scope
+#define PROFILE_SCOPE(name)                                                    \
+  static const int FISHDSO_PROFILE_CONCAT(profileTimerId, __LINE__) =          \
+      ::fishdso::Profiler::registerTimer(name);                                \
+  ::fishdso::ProfileScope FISHDSO_PROFILE_CONCAT(profileScope, __LINE__)(      \
+      FISHDSO_PROFILE_CONCAT(profileTimerId, __LINE__))
+
+#define PROFILE_COUNT(name, value)                                             \
+  do {                                                                         \
+    static const int profileCounterId =                                        \
+        ::fishdso::Profiler::registerCounter(name);                            \
+    ::fishdso::Profiler::addCount(profileCounterId, (value));                  \
+  } while (false)
+
+#define PROFILE_HIST(name, value, min, max, bucketNum)                         \
+  do {                                                                         \
+    static const int profileHistogramId =                                      \
+        ::fishdso::Profiler::registerHistogram(name, min, max, bucketNum);     \
+    ::fishdso::Profiler::addToHistogram(profileHistogramId, (value));          \
+  } while (false)
+
+#else
+
+// arguments are not evaluated when the profiling is compiled out
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNT(name, value)                                             \
+  do {                                                                         \
+  } while (false)
+#define PROFILE_HIST(name, value, min, max, bucketNum)                         \
+  do {                                                                         \
+  } while (false)
+
+#endif
+
+#endif
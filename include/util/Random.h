@@ -0,0 +1,81 @@
+#ifndef INCLUDE_RANDOM
+#define INCLUDE_RANDOM
+
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <utility>
+
+namespace fishdso {
+
+// The stages that draw random numbers, each has streams of its own.
+enum class RandomStage : std::uint32_t {
+  PIXEL_SELECTOR,
+  TRIANGULATION,
+  STEREO_RANSAC,
+  STEREO_SCORING_ORDER,
+  CAMERA_FIT
+};
+
+// A stream of random numbers from the counter-based Philox4x32-10
+// generator. The n-th number of a stream is a function of the seed, the
+// stage, the key (e.g. the frame number), the task index and n only, so
+// tasks that run in parallel draw the same numbers however they are
+// scheduled and however many threads there are, without sharing a
+// generator. It is a UniformRandomBitGenerator, but uniformInt, uniformReal
+// and shuffle below should be preferred to the distributions and
+// std::shuffle of the standard library, which differ between its
+// implementations.
+class RandomStream {
+public:
+  using result_type = std::uint32_t;
+
+  RandomStream(std::uint32_t seed, RandomStage stage, std::uint32_t key,
+               std::uint32_t task);
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() {
+    return std::numeric_limits<result_type>::max();
+  }
+
+  result_type operator()() {
+    if (used == block.size()) {
+      block = philox(counter++);
+      used = 0;
+    }
+    return block[used++];
+  }
+
+  // uniform in [0, n), without the bias of the modulo
+  int uniformInt(int n);
+  // uniform in [0, 1), with 53 random bits
+  double uniformReal();
+
+  template <typename It> void shuffle(It begin, It end) {
+    using std::swap;
+    auto n = std::distance(begin, end);
+    for (auto i = n - 1; i > 0; --i)
+      swap(begin[i], begin[uniformInt(int(i + 1))]);
+  }
+
+  // the Philox4x32-10 block of the counter, exposed for the tests
+  std::array<std::uint32_t, 4> philox(std::uint64_t blockCounter) const;
+
+private:
+  std::array<std::uint32_t, 2> key;
+  std::uint32_t task;
+  RandomStage stage;
+  std::uint64_t counter = 0;
+  std::array<std::uint32_t, 4> block = {};
+  int used = block.size();
+};
+
+// The stream of a task of a stage. With deterministic set the seed is
+// fixed, otherwise it is drawn from std::random_device.
+RandomStream randomStream(bool deterministic, RandomStage stage,
+                          std::uint32_t key = 0, std::uint32_t task = 0);
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef INCLUDE_RECORDSTREAM
+#define INCLUDE_RECORDSTREAM
+
+#include "util/types.h"
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+namespace fishdso {
+
+// Compact binary output of a run, written through one file that stays open
+// with a large buffer, so that writers can share it instead of reopening
+// text files. The file is a short versioned header followed by records in
+// the native byte order, each a type tag (int32) and a payload:
+// POSE: frame number (int32), timestamp (double) and the world to frame
+// motion as the quaternion x, y, z, w and the translation, 7 floats or
+// doubles, see Precision;
+// POINTS: keyframe number (int32), point count (int32) and that many points
+// with x, y, z as floats and blue, green, red as uchars, packed.
+// The records are flushed with the buffer, so a file cut off by a crash
+// holds the whole records written before it. records2text converts it back
+// into the text formats of TrajectoryWriter and CloudWriter.
+class RecordStream {
+public:
+  enum RecordType : int32_t { POSE = 1, POINTS = 2 };
+  enum Precision : int32_t { FLOAT = 0, DOUBLE = 1 };
+
+  RecordStream(const std::string &fname, Precision posePrecision = DOUBLE);
+  RecordStream(const RecordStream &other) = delete;
+  ~RecordStream();
+
+  // Both are thread-safe.
+  void putPose(int frameNum, double timestamp, const SE3 &worldToFrame);
+  void putPoints(int keyFrameNum, const std::vector<Vec3> &points,
+                 const std::vector<cv::Vec3b> &colors);
+  void flush();
+
+private:
+  static constexpr int bufferSize = 1 << 20;
+
+  template <typename T> void put(const T &val) {
+    stream.write(reinterpret_cast<const char *>(&val), sizeof(T));
+  }
+
+  Precision posePrecision;
+  std::vector<char> buffer;
+  std::ofstream stream;
+  std::mutex mutex;
+};
+
+class RecordReader {
+public:
+  struct Record {
+    RecordStream::RecordType type;
+    // POSE
+    int frameNum;
+    double timestamp;
+    SE3 worldToFrame;
+    // POINTS
+    int keyFrameNum;
+    std::vector<Vec3> points;
+    std::vector<cv::Vec3b> colors;
+  };
+
+  explicit RecordReader(const std::string &fname);
+
+  // False at the end of the file, of which a cut off record is a part.
+  bool next(Record &record);
+
+private:
+  template <typename T> bool get(T &val) {
+    return bool(stream.read(reinterpret_cast<char *>(&val), sizeof(T)));
+  }
+
+  std::ifstream stream;
+  RecordStream::Precision posePrecision;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef INCLUDE_SCHEDULER
+#define INCLUDE_SCHEDULER
+
+#include "util/settings.h"
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace fishdso {
+
+// Worker threads to share between all of the parallel work of possibly many
+// DsoSystem instances, so that they do not each start pools of their own
+// and oversubscribe the cores. Work is run with a priority: workers go to
+// tracking first, then to mapping, and only then to the output, like
+// asynchronous observers. Priorities need oneTBB, with older TBB versions
+// the work of all priorities is served equally.
+//
+// Set it in Settings::Threading to use it. It should outlive everything
+// that runs on it.
+class Scheduler {
+public:
+  enum Priority { TRACKING, MAPPING, OUTPUT };
+  static constexpr int priorityNum = 3;
+
+  // If cores are given, the workers are pinned to them, see pinThread.
+  explicit Scheduler(int numThreads, const std::vector<int> &cores = {});
+  Scheduler(const Scheduler &other) = delete;
+  ~Scheduler();
+
+  int numThreads() const;
+
+  // Runs f and waits for it. Parallel algorithms called from f run on the
+  // threads of this scheduler.
+  void execute(Priority priority, const std::function<void()> &f);
+  // Runs f on one of the threads later, without waiting for it.
+  void enqueue(Priority priority, std::function<void()> f);
+
+private:
+  struct Arenas;
+
+  int mNumThreads;
+  std::unique_ptr<Arenas> arenas;
+};
+
+// Runs parallel work on the scheduler of the settings, or on
+// settings.numThreads threads of its own if there is none, pinned to
+// settings.cores.
+class ParallelExecutor {
+public:
+  ParallelExecutor(const Settings::Threading &settings,
+                   Scheduler::Priority priority);
+  ParallelExecutor(const ParallelExecutor &other) = delete;
+  ~ParallelExecutor();
+
+  // Runs f and waits for it, parallel algorithms called from f run on the
+  // threads of the executor.
+  void execute(const std::function<void()> &f);
+
+private:
+  struct OwnArena;
+
+  Scheduler *scheduler;
+  Scheduler::Priority priority;
+  std::unique_ptr<OwnArena> ownArena;
+};
+
+// The number of threads for libraries with pools of their own, like Ceres.
+int threadNum(const Settings::Threading &settings);
+
+} // namespace fishdso
+
+#endif
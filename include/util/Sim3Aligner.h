@@ -14,6 +14,10 @@ public:
 
   SE3 alignWorldToFrameGT(const SE3 &worldToFrameGT) const;
   Vec3 alignScale(const Vec3 &pointInFrameGT) const;
+  // frameToWorld * alignScale(p) for all of the points of a frame in place,
+  // as one matrix product over the block of their coordinates
+  void alignToWorld(const SE3 &frameToWorld,
+                    std::vector<Vec3> &pointsInFrameGT) const;
 
 private:
   double scaleGTToDso;
@@ -13,6 +13,12 @@ public:
                    const Settings::Triangulation &triangulationSettings = {});
 
   bool operator()(Vec3 direction, double &resDepth);
+  // The same along the rays of all pixels of the camera frame at once, 0
+  // where there is no depth. Every sector is filled over its bounding box in
+  // the image, with the pixel rays coming from the camera's lookup table if
+  // it has one, and bands of rows are filled in parallel.
+  cv::Mat1d denseDepths(CameraModel *cam,
+                        const Settings::Threading &threading = {}) const;
 
   void checkAllSectors(Vec3 ray, CameraModel *cam, cv::Mat &img);
 
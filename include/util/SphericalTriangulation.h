@@ -7,18 +7,35 @@
 
 namespace fishdso {
 
+// Triangulation of rays, made as the Delaunay triangulation of their
+// stereographic projections. The sectors are kept in a flat array, and a
+// cube map over the directions lists for every cell the sectors that may
+// overlap it, so that finding the sector of a ray takes a few dot products.
 class SphericalTriangulation {
 public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
   struct TrihedralSector {
     Vec3 *rays[3];
+    // normals of the sides, pointing inside the sector
+    Vec3 sideNormals[3];
+    // of the triangle in the tangent plane it comes from
+    int triangle;
+
+    bool contains(const Vec3 &ray) const {
+      return sideNormals[0].dot(ray) >= 0 && sideNormals[1].dot(ray) >= 0 &&
+             sideNormals[2].dot(ray) >= 0;
+    }
   };
 
   SphericalTriangulation(const std::vector<Vec3> &rays,
                          const Settings::Triangulation &settings = {});
 
+  // If the ray is in several overlapping sectors, all of them but the one
+  // with the smallest angles are removed.
   TrihedralSector *enclosingSector(Vec3 ray);
+  // in no particular order, which changes when a sector is removed
+  const StdVector<TrihedralSector> &sectors() const;
 
   void checkAllSectors(Vec3 ray, CameraModel *cam, cv::Mat &img);
 
@@ -31,9 +48,19 @@ public:
 private:
   bool isInConvexDummy(Vec3 ray);
 
+  void buildCubeMap();
+  static int cubeMapCell(const Vec3 &ray);
+  void removeSector(int sector);
+
   Triangulation tangentTriang;
   std::vector<Vec3> _rays;
-  std::map<const Triangulation::Triangle *, TrihedralSector> _sectors;
+  StdVector<TrihedralSector> _sectors;
+  // the sector of every triangle of tangentTriang, -1 if it has none
+  std::vector<int> sectorOfTriangle;
+  // The triangles of the sectors overlapping each cell of the cube map are
+  // cellTriangles[cellBegin[c], cellBegin[c + 1]).
+  std::vector<int> cellBegin;
+  std::vector<int> cellTriangles;
 };
 
 } // namespace fishdso
@@ -1,20 +1,32 @@
 #include "system/CameraModel.h"
 #include "util/Triangulation.h"
+#include <functional>
 
 namespace fishdso {
 
 class Terrain {
-  using Vertex = Triangulation::Vertex;
-  using Edge = Triangulation::Edge;
-  using Triangle = Triangulation::Triangle;
-
 public:
   Terrain(CameraModel *cam, const StdVector<Vec2> &points,
           const std::vector<double> &depths,
           const Settings::Triangulation &triangulationSettings = {});
+  // an empty terrain over the camera frame, filled with addPoint
+  Terrain(CameraModel *cam,
+          const Settings::Triangulation &triangulationSettings = {});
+
+  void addPoint(const Vec2 &p, double depth);
 
   bool hasInterpolatedDepth(Vec2 p);
   bool operator()(Vec2 p, double &resDepth);
+  // The same for all pixels of a width x height image at once, 0 where there
+  // is no depth. Every triangle is filled scanline by scanline, and bands of
+  // rows are filled in parallel.
+  cv::Mat1d denseDepths(int width, int height,
+                        const Settings::Threading &threading = {}) const;
+  // The same for other values given at the points, in their order, such as
+  // the uncertainties of the depths.
+  cv::Mat1d denseValues(const std::vector<double> &values, int width,
+                        int height,
+                        const Settings::Threading &threading = {}) const;
 
   void draw(cv::Mat &img, cv::Scalar edgeCol);
   void drawDensePlainDepths(cv::Mat &img, double minDepth, double maxDepth);
@@ -23,6 +35,11 @@ public:
   bool debugOut;
 
 private:
+  cv::Mat1d rasterize(int width, int height,
+                      const Settings::Threading &threading,
+                      const std::function<double(int)> &vertexValue) const;
+
+  CameraModel *cam;
   std::vector<double> depths;
   Triangulation triang;
   std::vector<Vec3> refRays;
@@ -1,56 +1,62 @@
-﻿#ifndef INCLUDE_TRIANGULATION
+#ifndef INCLUDE_TRIANGULATION
 #define INCLUDE_TRIANGULATION
 
 #include "system/CameraModel.h"
+#include "util/Random.h"
 #include "util/types.h"
 #include <opencv2/opencv.hpp>
-#include <unordered_set>
 #include <vector>
 
 namespace fishdso {
 
+// Delaunay triangulation, built incrementally inside a large bounding
+// triangle. Triangles are stored as flat arrays of half-edges: triangle t
+// owns the half-edges 3t, 3t + 1 and 3t + 2, and the half-edge 3t + i starts
+// at its corner i. Corners are indices of the added points, the corners of
+// the bounding triangle are negative.
 class Triangulation {
 public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-  struct Vertex;
-  struct Edge;
-  struct Triangle;
+  static constexpr int NO_TRIANGLE = -1;
 
-  typedef std::vector<const Vertex *>::const_iterator VertexIterator;
-
-  struct Vertex {
-    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-    Vec2 pos;
-    std::unordered_set<Edge *> edges;
-    std::unordered_set<Triangle *> triangles;
-    int index;
-  };
-
-  struct Edge {
-    Vertex *vert[2];
-    Triangle *triang[2];
-  };
-
-  struct Triangle {
-    Vertex *vert[3];
-    Edge *edges[3];
-  };
-
-  static const int POINT_NOT_FOUND = -4;
-
-  Triangulation(const StdVector<Vec2> &newPoints,
+  Triangulation(const StdVector<Vec2> &points,
+                const Settings::Triangulation &settings = {});
+  // An empty triangulation to add points to later. They should be no
+  // farther from the box than half of its larger side, so that they fit into
+  // the bounding triangle.
+  Triangulation(const Vec2 &boxMin, const Vec2 &boxMax,
                 const Settings::Triangulation &settings = {});
 
-  VertexIterator begin() const;
-  VertexIterator end() const;
-
-  Vertex *operator[](int index) const;
-  const std::vector<const Edge *> &edges() const;
-  const std::vector<const Triangle *> &triangles() const;
-
-  Triangle *enclosingTriangle(const Vec2 &point);
-  bool isIncidentToBoundary(Triangle *tri) const;
+  // returns the index of the new point
+  int addPoint(const Vec2 &point);
+  // Adds the points in a biased randomized insertion order, sorted along
+  // the Hilbert curve in every round, so that consecutive points are close
+  // to each other and the walks are short. They get consecutive indices.
+  void addPoints(const StdVector<Vec2> &points);
+
+  int pointNum() const;
+  const Vec2 &point(int index) const;
+  // The point that represents the given one in the triangulation. It is an
+  // earlier one if they coincide, and the point itself otherwise.
+  int vertexOf(int index) const;
+
+  // triangles incident to the bounding triangle included
+  int triangleNum() const;
+  // corners go counterclockwise, with cross2 of the sides being positive
+  int corner(int triangle, int i) const;
+  // the triangle across the side opposite to corner i, if any
+  int neighbour(int triangle, int i) const;
+  bool isIncidentToBoundary(int triangle) const;
+
+  // edges between the points, not incident to the bounding triangle
+  std::vector<std::pair<int, int>> edges() const;
+
+  // Walks from the triangle found by the previous call, so that a sequence
+  // of close queries, like one over the pixels in a row, is cheap. Returns
+  // NO_TRIANGLE if the point is outside the bounding triangle.
+  int enclosingTriangle(const Vec2 &point);
+  int enclosingTriangle(const Vec2 &point, int startTriangle) const;
 
   cv::Mat draw(int imgWidth, int imgHeight, cv::Scalar bgCol,
                cv::Scalar edgeCol) const;
@@ -59,55 +65,45 @@ public:
   void drawCurved(CameraModel *cam, cv::Mat &img, cv::Scalar edgeCol) const;
 
 private:
-  EIGEN_STRONG_INLINE static Vertex *findThirdVert(Triangle *tri, Edge *edge);
+  static int next(int halfEdge) {
+    return halfEdge % 3 == 2 ? halfEdge - 2 : halfEdge + 1;
+  }
+  static int prev(int halfEdge) {
+    return halfEdge % 3 == 0 ? halfEdge + 2 : halfEdge - 1;
+  }
 
-  EIGEN_STRONG_INLINE static Edge *findOppositeEdge(Triangle *tri,
-                                                    Vertex *vert);
+  const Vec2 &position(int vertex) const {
+    return vertex >= 0 ? points[vertex] : bound[-1 - vertex];
+  }
 
-  EIGEN_STRONG_INLINE static bool isIncident(Vertex *vert, Edge *edge);
-  EIGEN_STRONG_INLINE static bool isIncident(Vertex *vert, Triangle *tri);
+  void setTriangle(int triangle, int a, int b, int c);
+  void link(int halfEdge, int twinHalfEdge);
 
-  EIGEN_STRONG_INLINE bool isInsideBound(const Vec2 &point) const;
+  bool isLegal(int halfEdge) const;
+  void legalize(std::vector<int> &halfEdges);
 
-  EIGEN_STRONG_INLINE bool doesContain(Triangle *tri, const Vec2 &point) const;
-  EIGEN_STRONG_INLINE bool doesContain(Edge *edge, const Vec2 &point) const;
-
-  EIGEN_STRONG_INLINE bool isFromBoundingTri(Vertex *vert) const;
-  EIGEN_STRONG_INLINE bool isEdgeLegal(Edge *edge) const;
-
-  Vertex *makeBoundingVertex(const Vec2 &newPos);
-  Vertex *makeVertex(const Vec2 &newPos, int newIndex);
-  Edge *makeEdge();
-  Triangle *makeTriangle();
-
-  void performFlip(Edge *edge);
-  void divideTriangle(Triangle *tri, Vertex *vert);
-  void divideEdge(Edge *edge, Vertex *vert);
-
-  Vertex *addPoint(Vertex *newVert);
-
-  void tidy();
-
-  void fillPtrVectors();
+  void insert(int vertex);
+  void splitTriangle(int triangle, int vertex);
+  void splitEdge(int halfEdge, int vertex);
 
   void drawScaled(cv::Mat &img, double scaleX, double scaleY,
                   cv::Point upperLeftPoint, cv::Scalar edgeCol) const;
 
   double maxDim;
   Vec2 upperLeft, bottomRight;
-  std::vector<std::unique_ptr<Vertex>> _vertices;
-  std::vector<std::unique_ptr<Edge>> _edges;
-  std::vector<std::unique_ptr<Triangle>> _triangles;
-  std::vector<int> indicesInv;
+  Vec2 bound[3];
+
+  StdVector<Vec2> points;
+  std::vector<int> pointVertex;
 
-  std::vector<const Vertex *> vertexPtrs;
-  std::vector<const Edge *> edgePtrs;
-  std::vector<const Triangle *> trianglePtrs;
+  // corner at which the half-edge starts and the opposite half-edge of the
+  // neighbouring triangle, -1 on the outer sides of the bounding triangle
+  std::vector<int> halfEdgeStart;
+  std::vector<int> twin;
 
-  //  std::vector<Edge *> _edges;
-  //  std::vector<Triangle *> _triangles;
+  int lastFound;
 
-  std::mt19937 mt;
+  RandomStream randomOrder;
 
   Settings::Triangulation settings;
 };
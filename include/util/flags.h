@@ -5,17 +5,31 @@
 #include <gflags/gflags.h>
 
 DECLARE_int32(num_threads);
+DECLARE_bool(async_mapping);
+DECLARE_string(cores);
+DECLARE_bool(huge_pages);
 
 DECLARE_int32(points_per_frame);
+DECLARE_double(valid_angle);
+DECLARE_bool(cache_camera_fit);
+DECLARE_string(static_mask);
+DECLARE_string(inverse_response);
+DECLARE_string(vignette);
 
 DECLARE_int32(first_frames_skip);
+DECLARE_int32(init_candidates_per_batch);
+DECLARE_int32(init_min_inliers);
 DECLARE_bool(run_max_RANSAC_iterations);
+DECLARE_int32(RANSAC_preemptive_block);
 DECLARE_bool(average_ORB_motion);
+DECLARE_string(ORB_matcher);
+DECLARE_double(ORB_grid_match_radius);
 DECLARE_bool(switch_first_motion_to_GT);
 
 DECLARE_bool(optimize_affine_light);
 
 DECLARE_bool(perform_full_tracing);
+DECLARE_bool(depth_filter_tracing);
 DECLARE_bool(use_alt_H_weighting);
 DECLARE_int32(tracing_GN_iter);
 
@@ -29,15 +43,52 @@ DECLARE_bool(track_from_lask_kf);
 DECLARE_bool(predict_using_screw);
 DECLARE_bool(use_grad_weights_on_tracking);
 DECLARE_double(track_fail_factor);
+DECLARE_bool(analytic_tracking);
+DECLARE_bool(single_precision_tracking);
+DECLARE_bool(cuda_tracking);
+DECLARE_bool(inverse_compositional_tracking);
+DECLARE_int32(tracking_max_points);
+DECLARE_bool(tiled_sampling);
+DECLARE_string(tracking_interpolation);
+DECLARE_string(tracing_search_interpolation);
+DECLARE_int32(tracing_coarse_levels);
+DECLARE_int32(tracing_search_candidates);
+DECLARE_int32(tracking_max_iter);
+DECLARE_bool(skip_finest_tracking);
+DECLARE_bool(recover_track);
+DECLARE_double(rotation_prior_weight);
+DECLARE_bool(relocalize);
+DECLARE_bool(close_loops);
+DECLARE_bool(real_time);
+DECLARE_double(max_frame_age);
+DECLARE_int32(speculative_batch_size);
+DECLARE_double(speculative_max_rotation_diff);
+DECLARE_double(speculative_max_translation_diff);
+DECLARE_bool(global_ba);
+DECLARE_int32(global_ba_submap_size);
+DECLARE_bool(adapt_point_budget);
+DECLARE_double(target_frame_time);
 
 DECLARE_bool(gt_poses);
 
 DECLARE_bool(run_ba);
 DECLARE_bool(fixed_motion_on_first_ba);
+DECLARE_bool(windowed_ba);
+DECLARE_string(ba_linear_solver);
+DECLARE_double(ba_max_time);
+DECLARE_bool(ba_prune_outliers);
+DECLARE_bool(ba_prewarp);
+DECLARE_int32(max_keyframes);
 DECLARE_double(optimized_stddev);
 
 DECLARE_int32(shift_between_keyframes);
+DECLARE_bool(adaptive_keyframes);
+DECLARE_bool(adaptive_marginalization);
 DECLARE_bool(deterministic);
+DECLARE_string(log_verbosity);
+DECLARE_bool(draw_inlier_matches);
+DECLARE_double(red_depths_part);
+DECLARE_double(blue_depths_part);
 
 namespace fishdso {
 
@@ -1,3 +1,6 @@
+#ifndef INCLUDE_GEOMETRY
+#define INCLUDE_GEOMETRY
+
 #include "util/types.h"
 
 namespace fishdso {
@@ -28,4 +31,26 @@ bool isInSector(const Vec3 &ray, Vec3 *s[3]);
 // with angle sectorAngle
 bool intersectOnSphere(double sectorAngle, Vec3 &dir1, Vec3 &dir2);
 
+// Cone around the rays from a camera center to a set of points, with the
+// smallest depth of the points along them. Bounds where the points can be,
+// so that a pair of cameras that do not see each other's points can be
+// skipped before testing the points one by one.
+struct RayCone {
+  // the empty cone, that nothing is seen in
+  RayCone();
+  // Rays are unit, depths are the lower bounds of the depths along them,
+  // possibly 0.
+  RayCone(const StdVector<Vec3> &rays, const std::vector<double> &minDepths);
+
+  // Conservative: false only if none of the points is within fovAngle of
+  // the Oz axis of the camera baseToOther maps into.
+  bool maybeSeenFrom(const SE3 &baseToOther, double fovAngle) const;
+
+  Vec3 axis;
+  double halfAngle; // negative for the empty cone
+  double minDepth;
+};
+
 } // namespace fishdso
+
+#endif
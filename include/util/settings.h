@@ -1,13 +1,17 @@
 #ifndef INCLUDE_SETTINGS
 #define INCLUDE_SETTINGS
 
+#include "util/ImageSampler.h"
 #include "util/defs.h"
 #include "util/types.h"
 #include <cmath>
 #include <gflags/gflags.h>
+#include <memory>
 
 namespace fishdso {
 
+class Scheduler;
+
 struct InitializerSettings;
 
 struct PointTracerSettings;
@@ -16,6 +20,8 @@ struct FrameTrackerSettings;
 
 struct BundleAdjusterSettings;
 
+struct PixelSelectorSettings;
+
 struct Settings {
   struct CameraModel {
     static constexpr int default_mapPolyDegree = 10;
@@ -23,9 +29,38 @@ struct Settings {
 
     static constexpr int default_mapPolyPoints = 2000;
     int mapPolyPoints = default_mapPolyPoints;
+
+    // If set, non-templated map/unmap calls use precomputed tables: a per-pixel
+    // ray table for unmapping integer pixels and a tabulated angle -> radius
+    // function with mapTableSize nodes, linearly interpolated.
+    static constexpr bool default_useLookupTables = false;
+    bool useLookupTables = default_useLookupTables;
+
+    static constexpr int default_mapTableSize = 4096;
+    int mapTableSize = default_mapTableSize;
+
+    // Rays at larger angles to the optical axis are treated as off the
+    // image, so that the dead border around the image circle of a fisheye
+    // lens is skipped everywhere. The default keeps the whole frame.
+    static constexpr double default_validAngle = M_PI;
+    double validAngle = default_validAngle;
+
+    // If set, the fitted map polynomial is stored next to the calibration
+    // file, keyed by a hash of the calibration and of the fitting settings,
+    // and loaded instead of being fitted again on later starts.
+    static constexpr bool default_cacheMapPolyFit = false;
+    bool cacheMapPolyFit = default_cacheMapPolyFit;
+
+    // fixed seed for sampling the points the map polynomial is fitted to
+    static constexpr bool default_deterministic = true;
+    bool deterministic = default_deterministic;
   } cameraModel;
 
   struct PixelSelector {
+    // fixed seed for shuffling the selected points
+    static constexpr bool default_deterministic = true;
+    bool deterministic = default_deterministic;
+
     static constexpr int default_initialAdaptiveBlockSize = 25;
     int initialAdaptiveBlockSize = default_initialAdaptiveBlockSize;
 
@@ -43,11 +78,10 @@ struct Settings {
   } pixelSelector;
 
   struct DistanceMap {
-    static constexpr double default_maxWidth = 480;
-    double maxWidth = default_maxWidth;
-
-    static constexpr double default_maxHeight = 302;
-    double maxHeight = default_maxHeight;
+    // side of the square cells that candidate points are bucketed into, so
+    // that choosing a point only revisits the candidates around it
+    static constexpr int default_cellSize = 16;
+    int cellSize = default_cellSize;
   } distanceMap;
 
   struct StereoMatcher {
@@ -70,6 +104,22 @@ struct Settings {
       static constexpr bool default_runMaxRansacIter = false;
       bool runMaxRansacIter = default_runMaxRansacIter;
 
+      // RANSAC hypotheses are generated and scored in parallel in rounds of
+      // this many, and the number of iterations is adapted after each round.
+      static constexpr int default_hypothesesPerRound = 64;
+      int hypothesesPerRound = default_hypothesesPerRound;
+
+      // If positive, every round is scored as in Nister's preemptive RANSAC:
+      // on blocks of this many correspondences, keeping the better half of
+      // the hypotheses after each block. Only the survivors are scored on
+      // all of the correspondences.
+      static constexpr int default_preemptiveBlockSize = 0;
+      int preemptiveBlockSize = default_preemptiveBlockSize;
+
+      // fixed seed for the RANSAC samples
+      static constexpr bool default_deterministic = true;
+      bool deterministic = default_deterministic;
+
       static constexpr int minimalSolveN = 5;
     } stereoGeometryEstimator;
 
@@ -79,11 +129,43 @@ struct Settings {
     static constexpr int default_keyPointNum = 2000;
     int keyPointNum = default_keyPointNum;
 
+    // How ORB descriptors are matched: by cross-checked brute force over
+    // all of them, by FLANN LSH with the same cross-check, or by brute force
+    // restricted to the keypoints around the positions predicted by the
+    // rotation between the frames.
+    enum MatcherType { BRUTE_FORCE, LSH, GRID };
+    static constexpr MatcherType default_matcherType = BRUTE_FORCE;
+    MatcherType matcherType = default_matcherType;
+
+    static constexpr int default_lshTableNum = 12;
+    int lshTableNum = default_lshTableNum;
+
+    static constexpr int default_lshKeySize = 20;
+    int lshKeySize = default_lshKeySize;
+
+    static constexpr int default_lshMultiProbeLevel = 2;
+    int lshMultiProbeLevel = default_lshMultiProbeLevel;
+
+    // in pixels, should cover the parallax the rotation does not predict
+    static constexpr double default_gridMatchRadius = 150.0;
+    double gridMatchRadius = default_gridMatchRadius;
+
+    static constexpr int default_gridMatchCellSize = 32;
+    int gridMatchCellSize = default_gridMatchCellSize;
+
     static constexpr int default_maxRansacIter = 100000;
     int maxRansacIter = default_maxRansacIter;
+
+    // shows the inlier matches in a window and waits for a key
+    static constexpr bool default_drawInlierMatches = false;
+    bool drawInlierMatches = default_drawInlierMatches;
   } stereoMatcher;
 
   struct Triangulation {
+    // fixed seed for the insertion order
+    static constexpr bool default_deterministic = true;
+    bool deterministic = default_deterministic;
+
     static constexpr double default_epsPointIsOnSegment = 1e-9;
     double epsPointIsOnSegment = default_epsPointIsOnSegment;
 
@@ -95,9 +177,28 @@ struct Settings {
   } triangulation;
 
   struct DelaunayDsoInitializer {
+    // the most frames skipped before the second frame of the pair
     static constexpr int default_firstFramesSkip = 15;
     int firstFramesSkip = default_firstFramesSkip;
 
+    // Every this many frames an earlier second frame is tried. The tries are
+    // matched together in batches of candidatesPerBatch, one per thread, and
+    // the first batch with a pair good enough initializes the system. If
+    // none is, the best pair overall is used after firstFramesSkip frames.
+    static constexpr int default_candidateFramesStep = 3;
+    int candidateFramesStep = default_candidateFramesStep;
+
+    static constexpr int default_candidatesPerBatch = 4;
+    int candidatesPerBatch = default_candidatesPerBatch;
+
+    // what a pair should have to be good enough
+    static constexpr int default_minInliers = 300;
+    int minInliers = default_minInliers;
+
+    // median angle between the rays of inlier matches, rotation compensated
+    static constexpr double default_minParallax = 1.0 * (M_PI / 180);
+    double minParallax = default_minParallax;
+
     static constexpr bool default_usePlainTriangulation = false;
     bool usePlainTriangulation = default_usePlainTriangulation;
   } delaunayDsoInitializer;
@@ -107,6 +208,246 @@ struct Settings {
     int pointsNum = default_pointsNum;
   } keyFrame;
 
+  // Keyframes chosen by what the tracked frame shows instead of every
+  // shiftBetweenKeyFrames frames, see KeyFramePolicy. The flows are relative
+  // to the sum of the image width and height.
+  struct KeyFramePolicy {
+    static constexpr bool default_enabled = false;
+    bool enabled = default_enabled;
+
+    // RMS shift of the points of the base keyframe with the full motion
+    static constexpr double default_maxFlow = 0.08;
+    double maxFlow = default_maxFlow;
+
+    // the same, without the rotation, which is what gives the parallax
+    static constexpr double default_maxTranslationFlow = 0.04;
+    double maxTranslationFlow = default_maxTranslationFlow;
+
+    // of the log of the affine light multiplier
+    static constexpr double default_maxLightChange = 0.5;
+    double maxLightChange = default_maxLightChange;
+
+    // of the points of the base keyframe that project onto the frame
+    static constexpr double default_minVisibleRatio = 0.7;
+    double minVisibleRatio = default_minVisibleRatio;
+
+    // of the tracking RMSE to the one of the first frame after the last
+    // keyframe
+    static constexpr double default_maxRmseRatio = 2.0;
+    double maxRmseRatio = default_maxRmseRatio;
+
+    static constexpr int default_minFramesBetweenKeyFrames = 3;
+    int minFramesBetweenKeyFrames = default_minFramesBetweenKeyFrames;
+
+    // a keyframe is made anyway after this many frames, even when standing
+    static constexpr int default_maxFramesBetweenKeyFrames = 40;
+    int maxFramesBetweenKeyFrames = default_maxFramesBetweenKeyFrames;
+  } keyFramePolicy;
+
+  // Which keyframes leave the window, see MarginalizationPolicy. If not
+  // enabled, the oldest ones leave once there are more than maxKeyFrames.
+  struct Marginalization {
+    static constexpr bool default_enabled = false;
+    bool enabled = default_enabled;
+
+    // keyframes with a smaller part of their points visible on the newest
+    // one are marginalized even if the window is not full
+    static constexpr double default_minVisibleRatio = 0.05;
+    double minVisibleRatio = default_minVisibleRatio;
+
+    // the newest keyframes, which the frames are tracked against, always
+    // stay, at least two
+    static constexpr int default_keptNewest = 2;
+    int keptNewest = default_keptNewest;
+
+    // weight of the rotation angle, in radians, against the translation
+    // relative to its mean over the window in the distances between the
+    // keyframes
+    static constexpr double default_rotationWeight = 0.5;
+    double rotationWeight = default_rotationWeight;
+  } marginalization;
+
+  // Marginalized keyframes kept to relocalize against when tracking fails.
+  struct KeyFrameDatabase {
+    static constexpr bool default_enabled = false;
+    bool enabled = default_enabled;
+
+    // beyond this the oldest ones are dropped, each keeps an image pyramid
+    static constexpr int default_maxEntries = 200;
+    int maxEntries = default_maxEntries;
+
+    static constexpr int default_thumbnailWidth = 32;
+    int thumbnailWidth = default_thumbnailWidth;
+
+    static constexpr int default_thumbnailHeight = 24;
+    int thumbnailHeight = default_thumbnailHeight;
+
+    // number of the most similar keyframes that are tracked against
+    static constexpr int default_candidateNum = 3;
+    int candidateNum = default_candidateNum;
+  } keyFrameDatabase;
+
+  // Tracking against the keyframes of a prebuilt map only, see MapLocalizer.
+  struct Localization {
+    // the base keyframe is switched to the nearest one once it is this many
+    // times closer to the frame than the current one
+    static constexpr double default_switchRatio = 0.7;
+    double switchRatio = default_switchRatio;
+
+    // weight of the rotation angle, in radians, against the translation
+    // relative to the mean distance between the neighbouring keyframes
+    static constexpr double default_rotationWeight = 0.5;
+    double rotationWeight = default_rotationWeight;
+  } localization;
+
+  // Loops are searched for among the keyframes of the database, so it needs
+  // the database enabled.
+  struct LoopClosure {
+    static constexpr bool default_enabled = false;
+    bool enabled = default_enabled;
+
+    // keyframes closer than this many frames are not a loop
+    static constexpr int default_minFrameGap = 300;
+    int minFrameGap = default_minFrameGap;
+
+    // largest tracking RMSE of a loop, in both directions
+    static constexpr double default_maxRmse = 10;
+    double maxRmse = default_maxRmse;
+
+    // shorter translations between the loop keyframes give no scale
+    static constexpr double default_minScaleBaseline = 0.05;
+    double minScaleBaseline = default_minScaleBaseline;
+
+    // Largest angle in radians between the rotation tracked from the
+    // candidate and the inverse of the one tracked back. The scale is only
+    // the ratio of the translations, so a loop is checked with the rotations.
+    static constexpr double default_maxRotationDisagreement = 0.05;
+    double maxRotationDisagreement = default_maxRotationDisagreement;
+
+    static constexpr double default_outlierResidual = 0.5;
+    double outlierResidual = default_outlierResidual;
+
+    // the pose graph optimization is bounded by both
+    static constexpr int default_maxIterations = 20;
+    int maxIterations = default_maxIterations;
+
+    static constexpr double default_maxSeconds = 0.5;
+    double maxSeconds = default_maxSeconds;
+  } loopClosure;
+
+  // Bounds and targets for PointBudgetController, which adjusts the point
+  // numbers and the BA iterations to the measured frame times.
+  struct PointBudget {
+    static constexpr bool default_enabled = false;
+    bool enabled = default_enabled;
+
+    // tracking and tracing per frame, in seconds
+    static constexpr double default_targetFrameTime = 0.03;
+    double targetFrameTime = default_targetFrameTime;
+
+    // keyframe creation and bundle adjustment per keyframe, in seconds
+    static constexpr double default_targetKeyFrameTime = 0.2;
+    double targetKeyFrameTime = default_targetKeyFrameTime;
+
+    // weight of the newest time in the smoothed one
+    static constexpr double default_smoothing = 0.2;
+    double smoothing = default_smoothing;
+
+    // relative deviation from the target that is tolerated
+    static constexpr double default_tolerance = 0.15;
+    double tolerance = default_tolerance;
+
+    // largest relative change of the point numbers at once
+    static constexpr double default_maxStep = 0.2;
+    double maxStep = default_maxStep;
+
+    static constexpr int default_minFramesBetweenChanges = 10;
+    int minFramesBetweenChanges = default_minFramesBetweenChanges;
+
+    static constexpr int default_minPointsNum = 500;
+    int minPointsNum = default_minPointsNum;
+    static constexpr int default_maxPointsNum = 4000;
+    int maxPointsNum = default_maxPointsNum;
+
+    static constexpr int default_minOptimizedPoints = 500;
+    int minOptimizedPoints = default_minOptimizedPoints;
+    static constexpr int default_maxOptimizedPoints = 4000;
+    int maxOptimizedPoints = default_maxOptimizedPoints;
+
+    static constexpr int default_minBaIterations = 2;
+    int minBaIterations = default_minBaIterations;
+    static constexpr int default_maxBaIterations = 20;
+    int maxBaIterations = default_maxBaIterations;
+  } pointBudget;
+
+  // Real-time mode for frames with arrival times, see SourceFrame and
+  // FrameQueue. When the system falls behind, the late frames are skipped
+  // and get predicted poses, the frames that do not become keyframes are
+  // only tracked, and bundle adjustment passes are deferred.
+  struct LoadShedding {
+    static constexpr bool default_enabled = false;
+    bool enabled = default_enabled;
+
+    // older frames are skipped, in seconds
+    static constexpr double default_maxFrameAge = 0.1;
+    double maxFrameAge = default_maxFrameAge;
+
+    // frames older than this when mapping starts on them are not traced,
+    // unless they become keyframes
+    static constexpr double default_maxTracingAge = 0.05;
+    double maxTracingAge = default_maxTracingAge;
+
+    // with asynchronous mapping, neither are they while more frames than this
+    // wait for the mapping thread
+    static constexpr int default_maxMappingLag = 2;
+    int maxMappingLag = default_maxMappingLag;
+
+    // consecutive keyframes without bundle adjustment, at most
+    static constexpr int default_maxDeferredBa = 2;
+    int maxDeferredBa = default_maxDeferredBa;
+  } loadShedding;
+
+  // For offline reprocessing, where the throughput matters instead of the
+  // latency. DsoSystem::addFrames tracks up to batchSize frames at once
+  // against the same base frame, each from the motion extrapolated over the
+  // predictions of the frames before it. The results are then checked in
+  // order against the prediction from the accepted ones, the frames that
+  // disagree are tracked again from it, and all of them are traced in
+  // order. A new keyframe discards the rest of the batch.
+  struct SpeculativeTracking {
+    static constexpr int default_batchSize = 8;
+    int batchSize = default_batchSize;
+
+    // between the rotation tracked from the extrapolated motion and the
+    // predicted one, in radians
+    static constexpr double default_maxRotationDiff = 0.02;
+    double maxRotationDiff = default_maxRotationDiff;
+
+    // between the tracked translation and the predicted one, relative to the
+    // predicted distance from the base frame
+    static constexpr double default_maxTranslationDiff = 0.1;
+    double maxTranslationDiff = default_maxTranslationDiff;
+  } speculativeTracking;
+
+  // For offline map building: the keyframes that leave the window are kept,
+  // and at the end of the session all of them are bundle adjusted together.
+  // The problem is split into overlapping submaps of consecutive keyframes,
+  // solved in parallel and chained together on the overlaps.
+  struct GlobalBundleAdjuster {
+    static constexpr bool default_enabled = false;
+    bool enabled = default_enabled;
+
+    static constexpr int default_submapSize = 30;
+    int submapSize = default_submapSize;
+
+    // keyframes shared by consecutive submaps, at least one
+    static constexpr int default_submapOverlap = 6;
+    int submapOverlap = default_submapOverlap;
+
+    static constexpr int default_maxIterations = 30;
+    int maxIterations = default_maxIterations;
+  } globalBundleAdjuster;
+
   struct PointTracer {
     static constexpr int default_onImageTestCount = 100;
     int onImageTestCount = default_onImageTestCount;
@@ -143,6 +484,46 @@ struct Settings {
 
     static constexpr bool default_useAltHWeighting = true;
     bool useAltHWeighting = default_useAltHWeighting;
+
+    // If set, every successful tracing updates a filter over the inverse
+    // depth of the point, a Gaussian mixed with a uniform outlier
+    // distribution, with a Beta distribution over the inlier ratio. Once the
+    // filter has a mean, only searchWindowSigmas of its stddev around it are
+    // searched. Points are not traced once the filter stddev is below
+    // convergedRel of the mean, and are marked as outliers once the inlier
+    // ratio drops below minInlierRatio.
+    static constexpr bool default_useDepthFilter = false;
+    bool useDepthFilter = default_useDepthFilter;
+
+    static constexpr double default_searchWindowSigmas = 3.0;
+    double searchWindowSigmas = default_searchWindowSigmas;
+
+    static constexpr double default_convergedRel = 0.005;
+    double convergedRel = default_convergedRel;
+
+    static constexpr double default_minInlierRatio = 0.1;
+    double minInlierRatio = default_minInlierRatio;
+
+    // Interpolation of the epipolar search per pyramid level of the
+    // reference frame, bicubic on the levels without an entry. The precise
+    // search after it is always bicubic.
+    std::vector<ImageSampler::Interpolation> levelSearchInterpolation = {};
+
+    inline ImageSampler::Interpolation searchInterpolationAt(int level) const {
+      return level < levelSearchInterpolation.size()
+                 ? levelSearchInterpolation[level]
+                 : ImageSampler::BICUBIC;
+    }
+
+    // If positive, the epipolar search first runs this many pyramid levels
+    // coarser than the pattern size asks for, on every 2^coarseSearchLevels
+    // step at the nearest pixels. Only the steps around its searchCandidates
+    // best local minima are then searched as usual.
+    static constexpr int default_coarseSearchLevels = 0;
+    int coarseSearchLevels = default_coarseSearchLevels;
+
+    static constexpr int default_searchCandidates = 3;
+    int searchCandidates = default_searchCandidates;
   } pointTracer;
 
   struct FrameTracker {
@@ -151,6 +532,105 @@ struct Settings {
 
     static constexpr bool default_useGradWeighting = false;
     bool useGradWeighting = default_useGradWeighting;
+
+    // If set, tracking builds the 8-DoF normal equations directly instead of
+    // creating a Ceres residual block per pixel.
+    static constexpr bool default_useAnalyticJacobian = false;
+    bool useAnalyticJacobian = default_useAnalyticJacobian;
+
+    // If set, the analytic solver evaluates the per-pixel residuals and
+    // Jacobians in floats. The normal equations are still summed up and
+    // solved in doubles.
+    static constexpr bool default_useSinglePrecision = false;
+    bool useSinglePrecision = default_useSinglePrecision;
+
+    // If set, the analytic solver builds the normal equations on the GPU.
+    // Needs the CUDA_TRACKING build option and a device, tracking stays on
+    // the CPU otherwise.
+    static constexpr bool default_useCuda = false;
+    bool useCuda = default_useCuda;
+
+    // If set, the analytic solver is inverse compositional: the Jacobians of
+    // the residuals wrt the pose are taken on the base frame once, when the
+    // tracker is created, and each iteration only warps the points and
+    // samples the tracked frame. Implies the analytic solver, and always runs
+    // on the CPU in doubles.
+    static constexpr bool default_useInverseCompositional = false;
+    bool useInverseCompositional = default_useInverseCompositional;
+
+    // If positive, at most this many points of the base frame are tracked on
+    // each pyramid level. The subset is chosen once per base frame, by the
+    // image gradient along the directions in which the point moves with the
+    // camera, and spread over the image with a grid. levelMaxPoints
+    // overrides it per level with the positive entries.
+    static constexpr int default_maxPointsPerLevel = 0;
+    int maxPointsPerLevel = default_maxPointsPerLevel;
+    std::vector<int> levelMaxPoints = {};
+
+    inline int maxPointsAt(int level) const {
+      return level < levelMaxPoints.size() && levelMaxPoints[level] > 0
+                 ? levelMaxPoints[level]
+                 : maxPointsPerLevel;
+    }
+
+    static constexpr int default_maxIterations = 10;
+    int maxIterations = default_maxIterations;
+
+    static constexpr double default_initialLmLambda = 1e-4;
+    double initialLmLambda = default_initialLmLambda;
+
+    static constexpr double default_minDeltaNorm = 1e-7;
+    double minDeltaNorm = default_minDeltaNorm;
+
+    // Per-level overrides indexed by the pyramid level. Levels without a
+    // positive entry use maxIterations and minDeltaNorm with the analytic
+    // solver and the Ceres defaults otherwise.
+    std::vector<int> levelMaxIterations = {};
+    std::vector<double> levelMinDeltaNorm = {};
+
+    inline int levelMaxIterationsAt(int level) const {
+      return level < levelMaxIterations.size() ? levelMaxIterations[level] : 0;
+    }
+    inline double levelMinDeltaNormAt(int level) const {
+      return level < levelMinDeltaNorm.size() ? levelMinDeltaNorm[level] : 0;
+    }
+
+    // Interpolation of the tracked frame per pyramid level with the analytic
+    // solver on the CPU, bicubic on the levels without an entry. The Ceres
+    // and the CUDA solvers are always bicubic.
+    std::vector<ImageSampler::Interpolation> levelInterpolation = {};
+
+    inline ImageSampler::Interpolation interpolationAt(int level) const {
+      return level < levelInterpolation.size() ? levelInterpolation[level]
+                                               : ImageSampler::BICUBIC;
+    }
+
+    // If set, the finest level is not tracked when the pose update on level 1
+    // (norm of its SE3 log) is below skipFinestLevelDelta.
+    static constexpr bool default_skipFinestLevel = false;
+    bool skipFinestLevel = default_skipFinestLevel;
+
+    static constexpr double default_skipFinestLevelDelta = 1e-4;
+    double skipFinestLevelDelta = default_skipFinestLevelDelta;
+
+    // If set, a failed track is retried from several perturbed initial
+    // motions in parallel. All of them are first tracked on the coarsest
+    // level only, and the recoveryCandidates best ones are tracked fully.
+    static constexpr bool default_recoverTrack = false;
+    bool recoverTrack = default_recoverTrack;
+
+    static constexpr int default_recoveryCandidates = 3;
+    int recoveryCandidates = default_recoveryCandidates;
+
+    // rotation of the perturbed hypotheses around each axis, in radians
+    static constexpr double default_recoveryRotation = 0.05;
+    double recoveryRotation = default_recoveryRotation;
+
+    // Weight of the prior on the rotation predicted from the IMU, per
+    // squared radian, against the sum of the photometric energies of the
+    // points. With zero the IMU rotation only initializes tracking.
+    static constexpr double default_rotationPriorWeight = 0;
+    double rotationPriorWeight = default_rotationPriorWeight;
   } frameTracker;
 
   struct BundleAdjuster {
@@ -165,12 +645,62 @@ struct Settings {
 
     static constexpr bool default_runBA = true;
     bool runBA = default_runBA;
+
+    // If set, DsoSystem keeps a persistent WindowedOptimizer instead of
+    // building a new Ceres problem on every keyframe. Keyframes leaving the
+    // window are marginalized into a prior instead of being dropped.
+    static constexpr bool default_useWindowedOptimizer = false;
+    bool useWindowedOptimizer = default_useWindowedOptimizer;
+
+    static constexpr double default_initialLmLambda = 1e-4;
+    double initialLmLambda = default_initialLmLambda;
+
+    // Linear solver for the reduced camera system of BundleAdjuster, with
+    // the points eliminated. The dense one is the fastest for a few
+    // keyframes, the sparse and the iterative ones (the latter
+    // preconditioned with SCHUR_JACOBI) grow slower with the window.
+    enum LinearSolver { DENSE_SCHUR, SPARSE_SCHUR, ITERATIVE_SCHUR };
+    static constexpr LinearSolver default_linearSolver = DENSE_SCHUR;
+    LinearSolver linearSolver = default_linearSolver;
+
+    // wall time budget of one adjustment in seconds, none if not positive
+    static constexpr double default_maxSolverTime = 0;
+    double maxSolverTime = default_maxSolverTime;
+
+    // relative cost change at which an adjustment stops, as in Ceres
+    static constexpr double default_functionTolerance = 1e-6;
+    double functionTolerance = default_functionTolerance;
+
+    // If set, the points that become outliers are found after every
+    // successful iteration of an adjustment from the residuals Ceres has
+    // already evaluated, and stop taking part in the next steps. After the
+    // adjustment they are removed from the problem for good.
+    static constexpr bool default_pruneOutliers = false;
+    bool pruneOutliers = default_pruneOutliers;
+
+    // If set, the keyframes are sampled through their images resampled onto
+    // cube maps, see CubeMapImage, instead of through the camera model. The
+    // faces have the resolution of the image center times prewarpScale.
+    static constexpr bool default_prewarpKeyFrames = false;
+    bool prewarpKeyFrames = default_prewarpKeyFrames;
+    static constexpr double default_prewarpScale = 1;
+    double prewarpScale = default_prewarpScale;
   } bundleAdjuster;
 
   struct Pyramid {
     static constexpr int max_levelNum = 8;
     static constexpr int default_levelNum = 6;
     int levelNum = default_levelNum;
+
+    // If set, the samplers of the levels store the images in tiles instead
+    // of rows, see ImageSampler.
+    static constexpr bool default_tiledSamplers = false;
+    bool tiledSamplers = default_tiledSamplers;
+
+    // If set, the samplers of the levels large enough are backed by
+    // transparent huge pages, see HugePageAllocator.
+    static constexpr bool default_hugePages = false;
+    bool hugePages = default_hugePages;
   } pyramid;
 
   struct AffineLight {
@@ -198,6 +728,18 @@ struct Settings {
     double max = default_max;
   } depth;
 
+  // How depths are colored on the debug images, see depthColBounds.
+  struct DepthColors {
+    // part of the points drawn red, too close to be distinguished
+    static constexpr double default_redDepthsPart = 0;
+    double redDepthsPart = default_redDepthsPart;
+
+    // part of the points NOT drawn completely blue, i.e. not too far to be
+    // distinguished
+    static constexpr double default_blueDepthsPart = 0.7;
+    double blueDepthsPart = default_blueDepthsPart;
+  } depthColors;
+
   struct GradWeighting {
     static constexpr double default_c = 50.0;
     double c = default_c;
@@ -218,6 +760,10 @@ struct Settings {
     inline const StdVector<Vec2> &pattern() const { return _pattern; }
     int height;
 
+    // the pattern data of the points is stored in fixed-size arrays, see
+    // ImmaturePointBlock, so patterns can't be larger
+    static constexpr int maxSize = 12;
+
   private:
     StdVector<Vec2> _pattern;
     static const StdVector<Vec2> default_pattern;
@@ -231,6 +777,31 @@ struct Settings {
   struct Threading {
     static constexpr int default_numThreads = 4;
     int numThreads = default_numThreads;
+
+    // If set, DsoSystem traces points, creates keyframes and runs bundle
+    // adjustment on a separate mapping thread, while addFrame only tracks
+    // against the last published base frame. DsoObserver callbacks then come
+    // from both threads.
+    static constexpr bool default_asyncMapping = false;
+    bool asyncMapping = default_asyncMapping;
+
+    // Max number of tracked frames waiting for the mapping thread. addFrame
+    // blocks when the queue is full.
+    static constexpr int default_mappingQueueSize = 8;
+    int mappingQueueSize = default_mappingQueueSize;
+
+    // If set, all of the parallel work runs on it instead of numThreads
+    // threads of its own, and it can be shared with other DsoSystem
+    // instances. See util/Scheduler.h.
+    std::shared_ptr<Scheduler> scheduler;
+
+    // If not empty, the threads of the instance run only on these cores: the
+    // workers of its own pool, the mapping thread, the thread calling
+    // addFrame for the duration of the call and the Ceres threads started
+    // from them. With the cores of one memory node the frame buffers and the
+    // keyframes, allocated and first touched by these threads, are placed on
+    // that node too. See util/Placement.h.
+    std::vector<int> cores;
   } threading;
 
   static constexpr int default_maxOptimizedPoints = 2000;
@@ -248,8 +819,10 @@ struct Settings {
   static constexpr bool default_continueChoosingKeyFrames = true;
   bool continueChoosingKeyFrames = default_continueChoosingKeyFrames;
 
-  static constexpr int default_initialMaxFrame = 2500;
-  int initialMaxFrame = default_initialMaxFrame;
+  // Frame poses are stored in chunks of this many frames. Chunks of frames
+  // older than the active keyframes are handed to the observers and freed.
+  static constexpr int default_poseChunkSize = 256;
+  int poseChunkSize = default_poseChunkSize;
 
   static constexpr int default_shiftBetweenKeyFrames = 10;
   int shiftBetweenKeyFrames = default_shiftBetweenKeyFrames;
@@ -258,6 +831,7 @@ struct Settings {
   PointTracerSettings getPointTracerSettings() const;
   FrameTrackerSettings getFrameTrackerSettings() const;
   BundleAdjusterSettings getBundleAdjusterSettings() const;
+  PixelSelectorSettings getPixelSelectorSettings() const;
 };
 
 struct PointTracerSettings {
@@ -265,6 +839,8 @@ struct PointTracerSettings {
   Settings::Intencity intencity = {};
   Settings::ResidualPattern residualPattern = {};
   Settings::Pyramid pyramid = {};
+  Settings::Depth depth = {};
+  Settings::Threading threading = {};
 };
 
 struct InitializerSettings {
@@ -295,6 +871,11 @@ struct BundleAdjusterSettings {
   Settings::Depth depth = {};
 };
 
+struct PixelSelectorSettings {
+  Settings::PixelSelector pixelSelector = {};
+  Settings::Threading threading = {};
+};
+
 } // namespace fishdso
 
 #endif
@@ -20,11 +20,15 @@ typedef Eigen::Matrix<double, 2, 1> Vec2;
 typedef Eigen::Matrix<double, 3, 1> Vec3;
 typedef Eigen::Matrix<double, 4, 1> Vec4;
 typedef Eigen::Matrix<double, 5, 1> Vec5;
+typedef Eigen::Matrix<double, 6, 1> Vec6;
+typedef Eigen::Matrix<double, 8, 1> Vec8;
 typedef Eigen::Matrix<double, 9, 1> Vec9;
 typedef Eigen::Matrix<double, Eigen::Dynamic, 1> VecX;
 
 typedef Eigen::Matrix<int, 2, 1> Vec2i;
 
+typedef Eigen::Matrix<float, 2, 1> Vec2f;
+
 typedef Eigen::Matrix<double, 2, 2> Mat22;
 typedef Eigen::Matrix<double, 2, 3> Mat23;
 typedef Eigen::Matrix<double, 3, 2> Mat32;
@@ -33,6 +37,7 @@ typedef Eigen::Matrix<double, 3, 4> Mat34;
 typedef Eigen::Matrix<double, 4, 3> Mat43;
 typedef Eigen::Matrix<double, 4, 4> Mat44;
 typedef Eigen::Matrix<double, 5, 5> Mat55;
+typedef Eigen::Matrix<double, 8, 8> Mat88;
 typedef Eigen::Matrix<double, Eigen::Dynamic, 5> MatX5;
 typedef Eigen::Matrix<double, Eigen::Dynamic, 9> MatX9;
 typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> MatXX;
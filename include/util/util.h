@@ -4,16 +4,17 @@
 #include "util/settings.h"
 #include "util/types.h"
 #include <fstream>
+#include <functional>
 #include <opencv2/opencv.hpp>
 #include <vector>
 
-DECLARE_double(red_depths_part);
-DECLARE_double(blue_depths_part);
-
 namespace fishdso {
 
-extern cv::Mat dbg;
-extern double minDepthCol, maxDepthCol;
+// the depths drawn as the reddest and the bluest by depthCol
+struct DepthColBounds {
+  double min = 0;
+  double max = 1;
+};
 
 template <typename T>
 EIGEN_STRONG_INLINE std::vector<T> reservedVector(int toReserve) {
@@ -47,7 +48,8 @@ void outputArray(const std::string &fname, const std::vector<T> &array) {
 void printInPly(std::ostream &out, const std::vector<Vec3> &points,
                 const std::vector<cv::Vec3b> &colors);
 
-void setDepthColBounds(const std::vector<double> &depths);
+DepthColBounds depthColBounds(const std::vector<double> &depths,
+                              const Settings::DepthColors &settings = {});
 
 cv::Mat drawLeveled(cv::Mat3b *images, int num, int w, int h, int resutW);
 
@@ -60,8 +62,16 @@ void putCross(cv::Mat &img, const cv::Point &pos, int size,
 void putSquare(cv::Mat &img, const cv::Point &pos, int size,
                const cv::Scalar &col, int thickness);
 
-void grad(const cv::Mat &img, cv::Mat1d &gradX, cv::Mat1d &gradY,
-          cv::Mat1d &gradNorm);
+void grad(const cv::Mat &img, cv::Mat1f &gradX, cv::Mat1f &gradY,
+          cv::Mat1f &gradNorm);
+// Single sweep over img that writes its central-difference gradients with
+// replicated borders (same as grad()) into planes with a row stride of
+// img.cols, and the 2x2 box-filtered image into down. Gradients are skipped
+// if gradX is null, downsampling if down is null. With validSpans, one per
+// row, the gradients are only computed in them and are zero elsewhere.
+void gradAndPyrDown(const cv::Mat1b &img, float *gradX, float *gradY,
+                    float *gradNorm, cv::Mat1b *down,
+                    const Vec2i *validSpans = nullptr);
 double gradNormAt(const cv::Mat1b &img, const cv::Point &p);
 
 cv::Scalar depthCol(double d, double mind, double maxd);
@@ -108,6 +118,15 @@ cv::Mat3b cvtGrayToBgr(const cv::Mat1b &grayImg);
 cv::Mat1d pyrNUpDepth(const cv::Mat1d &integralWeightedDepths,
                       const cv::Mat1d &integralWeights, int levelNum);
 
+// Splits the rows [0, height) into bands and calls f(item, rowFrom, rowTo)
+// for every item whose rows [minRow, maxRow] intersect a band, with the rows
+// clipped to the band. Bands are processed in parallel and the items within
+// a band in order, so f can write to the rows it gets without locking.
+void forEachInRowBands(int height, const std::vector<int> &minRow,
+                       const std::vector<int> &maxRow,
+                       const Settings::Threading &threading,
+                       const std::function<void(int, int, int)> &f);
+
 cv::Mat3b drawDepthedFrame(const cv::Mat1b &frame, const cv::Mat1d &depths,
                            double minDepth, double maxDepth);
 
@@ -116,6 +135,10 @@ std::string fileInDir(const std::string &directoryName,
 
 std::string curTimeBrief();
 
+// nearest-rank percentile, p in [0, 100], of sorted values, 0 if there are
+// none
+double percentile(const std::vector<double> &sorted, double p);
+
 } // namespace fishdso
 
 #endif
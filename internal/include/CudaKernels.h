@@ -0,0 +1,85 @@
+#ifndef INCLUDE_CUDAKERNELS
+#define INCLUDE_CUDAKERNELS
+
+#include <cmath>
+#include <cstddef>
+
+#ifdef __CUDACC__
+#define FISHDSO_HOST_DEVICE __host__ __device__
+#else
+#define FISHDSO_HOST_DEVICE
+#endif
+
+// Plain interface to the CUDA kernels, so that nvcc does not have to see
+// Eigen, Sophus or OpenCV. The wrappers in CudaTracking.h convert.
+namespace fishdso::cuda {
+
+constexpr int maxMapPolyCoeffs = 32;
+// the upper triangle of the 8x8 H, then b, then the energy
+constexpr int linearizationSize = 36 + 8 + 1;
+constexpr int blockSize = 256;
+
+struct CameraParams {
+  // pixel = imgCenter + scale * mapPoly(angle) * xy / |xy|
+  double imgCenterX, imgCenterY;
+  double scale;
+  int coeffNum;
+  double coeffs[maxMapPolyCoeffs];
+};
+
+struct Motion {
+  // row-major
+  double rot[9];
+  double trans[3];
+  double expA, affB;
+  double outlierDiff;
+};
+
+// float image padded by replicating the border, laid out as in ImageSampler
+struct ImageView {
+  const float *data;
+  int width, height, stride, pad;
+};
+
+bool isDeviceAvailable();
+
+void *deviceAlloc(size_t bytes);
+void deviceFree(void *ptr);
+void copyToDevice(void *dst, const void *src, size_t bytes);
+
+inline int partialNum(int pointNum) {
+  return (pointNum + blockSize - 1) / blockSize;
+}
+
+// Adds a residual with its Jacobian wrt the pose and the affine light to
+// vals, laid out as the upper triangle of H, then b, then the energy. It is
+// Huber weighted the same way as linearizeTracking in FrameTracker.cpp.
+// Shared with the host, so that the reduction can be tested without a
+// device.
+FISHDSO_HOST_DEVICE inline void accumulateResidual(double res, double weight,
+                                                   const double *jac,
+                                                   double outlierDiff,
+                                                   double *vals) {
+  double absRes = fabs(res);
+  bool isInlier = absRes <= outlierDiff;
+  double w = weight * (isInlier ? 1.0 : outlierDiff / absRes);
+  int k = 0;
+  for (int r = 0; r < 8; ++r)
+    for (int c = r; c < 8; ++c)
+      vals[k++] += w * jac[r] * jac[c];
+  for (int r = 0; r < 8; ++r)
+    vals[k++] += w * res * jac[r];
+  vals[k] += weight * (isInlier ? res * res
+                                : outlierDiff * (2 * absRes - outlierDiff));
+}
+
+// Writes linearizationSize sums per block of points to hostPartials, through
+// devPartials of the same size on the device.
+void linearize(const CameraParams &cam, const ImageView &img, int pointNum,
+               const double *positions, const float *intensities,
+               const float *weights, const Motion &motion,
+               double *devPartials, double *hostPartials);
+
+} // namespace fishdso::cuda
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef INCLUDE_CUDATRACKING
+#define INCLUDE_CUDATRACKING
+
+#include "CudaKernels.h"
+#include "system/AffineLightTransform.h"
+#include "system/CameraModel.h"
+#include "util/types.h"
+#include <opencv2/core.hpp>
+#include <vector>
+
+namespace fishdso::cuda {
+
+// Compiled with the CUDA_TRACKING option and a device present. Checked once.
+bool isAvailable();
+
+// Adds up the linearizationSize partial sums of every block in block order,
+// so that the result does not depend on the scheduling, and unpacks them
+// into H and b. Returns the energy.
+inline double reducePartials(const std::vector<double> &partials, Mat88 *H,
+                             Vec8 *b) {
+  double sums[linearizationSize] = {};
+  for (int blk = 0; blk < partials.size() / linearizationSize; ++blk)
+    for (int k = 0; k < linearizationSize; ++k)
+      sums[k] += partials[blk * linearizationSize + k];
+
+  int k = 0;
+  for (int r = 0; r < 8; ++r)
+    for (int c = r; c < 8; ++c) {
+      (*H)(r, c) = sums[k];
+      (*H)(c, r) = sums[k];
+      ++k;
+    }
+  for (int r = 0; r < 8; ++r)
+    (*b)[r] = sums[k++];
+  return sums[k];
+}
+
+// A pyramid level on the device, padded as in ImageSampler, so that the
+// device sampling matches the host one.
+class DeviceImage {
+public:
+  DeviceImage() = default;
+  DeviceImage(const DeviceImage &other) = delete;
+  ~DeviceImage();
+
+  // reuses the device buffer if it is large enough
+  void upload(const cv::Mat1b &img);
+
+  EIGEN_STRONG_INLINE const ImageView &view() const { return imgView; }
+
+private:
+  float *data = nullptr;
+  size_t capacity = 0;
+  ImageView imgView;
+};
+
+// The points of one tracked level, uploaded once for all of the iterations.
+class DeviceTrackingPoints {
+public:
+  DeviceTrackingPoints(const StdVector<Vec3> &positions,
+                       const std::vector<double> &intensities,
+                       const std::vector<double> &weights);
+  DeviceTrackingPoints(const DeviceTrackingPoints &other) = delete;
+  ~DeviceTrackingPoints();
+
+  // The same as linearizeTracking in FrameTracker.cpp, with H and b always
+  // computed. The per-block partial sums are added up on the host in block
+  // order, so the result does not depend on the scheduling.
+  double linearize(const CameraModel &cam, const DeviceImage &trackedFrame,
+                   const SE3 &baseToTracked, const AffLight &affLight,
+                   double outlierDiff, Mat88 *H, Vec8 *b);
+
+private:
+  int pointNum;
+  double *positions = nullptr;
+  float *intensities = nullptr;
+  float *weights = nullptr;
+  double *devPartials = nullptr;
+  std::vector<double> hostPartials;
+};
+
+} // namespace fishdso::cuda
+
+#endif
@@ -1,30 +1,67 @@
 #ifndef INCLUDE_PREKEYFRAMEINTERNALS
 #define INCLUDE_PREKEYFRAMEINTERNALS
 
+#ifdef FISHDSO_CUDA
+#include "CudaTracking.h"
+#endif
 #include "util/ImagePyramid.h"
+#include "util/ImageSampler.h"
+#include <atomic>
 #include <ceres/cubic_interpolation.h>
+#include <memory>
+#include <mutex>
 
 namespace fishdso {
 
+// Interpolation data over the levels of a frame's pyramid. A level is
+// materialized on the first access to it, most frames are only sampled on a
+// few of them. Accessors can be called from several threads.
 class PreKeyFrameInternals {
 public:
   using Grid_t = ceres::Grid2D<unsigned char>;
   using Interpolator_t = ceres::BiCubicInterpolator<Grid_t>;
 
+  // The pyramid should outlive the internals or the next reset.
   PreKeyFrameInternals(const ImagePyramid &pyramid,
                        const Settings::Pyramid &_pyrSettings);
 
+  // Points the internals to a new pyramid of the same settings, reusing the
+  // sampler buffers. Should not race with the accessors.
+  void reset(const ImagePyramid &pyramid);
+
   Grid_t &grid(int lvl);
   const Grid_t &grid(int lvl) const;
   Interpolator_t &interpolator(int lvl);
   const Interpolator_t &interpolator(int lvl) const;
+  const ImageSampler &sampler(int lvl) const;
+#ifdef FISHDSO_CUDA
+  // uploaded on the first access, separately from the host data
+  const cuda::DeviceImage &deviceImage(int lvl) const;
+#endif
+
+  bool isMaterialized(int lvl) const;
+
+  EIGEN_STRONG_INLINE int levelNum() const { return pyrSettings.levelNum; }
 
 private:
-  alignas(alignof(Grid_t))
-      uint8_t gridsData[Settings::Pyramid::max_levelNum * sizeof(Grid_t)];
-  alignas(alignof(Interpolator_t)) uint8_t
-      interpolatorsData[Settings::Pyramid::max_levelNum *
-                        sizeof(Interpolator_t)];
+  static constexpr int maxLevels = Settings::Pyramid::max_levelNum;
+
+  void materialize(int lvl) const;
+
+  const ImagePyramid *pyramid;
+
+  alignas(alignof(Grid_t)) mutable uint8_t
+      gridsData[maxLevels * sizeof(Grid_t)];
+  alignas(alignof(Interpolator_t)) mutable uint8_t
+      interpolatorsData[maxLevels * sizeof(Interpolator_t)];
+  mutable std::unique_ptr<ImageSampler> samplers[maxLevels];
+  mutable std::atomic<bool> isReady[maxLevels];
+#ifdef FISHDSO_CUDA
+  mutable std::unique_ptr<cuda::DeviceImage> deviceImages[maxLevels];
+  mutable std::atomic<bool> isDeviceReady[maxLevels];
+#endif
+  mutable std::mutex mutex;
+
   Settings::Pyramid pyrSettings;
 };
 
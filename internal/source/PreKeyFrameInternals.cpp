@@ -1,40 +1,102 @@
 #include "PreKeyFrameInternals.h"
+#include "util/Profiler.h"
 
 namespace fishdso {
 
 PreKeyFrameInternals::PreKeyFrameInternals(
     const ImagePyramid &pyramid, const Settings::Pyramid &_pyrSettings)
     : pyrSettings(_pyrSettings) {
-  for (int lvl = 0; lvl < pyrSettings.levelNum; ++lvl) {
-    Grid_t *newGrid = new (&gridsData[lvl * sizeof(Grid_t)])
-        Grid_t(pyramid[lvl].data, 0, pyramid[lvl].rows, 0, pyramid[lvl].cols);
-    new (&interpolatorsData[lvl * sizeof(Interpolator_t)])
-        Interpolator_t(*newGrid);
+  CHECK_LE(pyrSettings.levelNum, maxLevels);
+  reset(pyramid);
+}
+
+void PreKeyFrameInternals::reset(const ImagePyramid &pyramid) {
+  this->pyramid = &pyramid;
+  for (int lvl = 0; lvl < maxLevels; ++lvl) {
+    isReady[lvl].store(false, std::memory_order_relaxed);
+#ifdef FISHDSO_CUDA
+    isDeviceReady[lvl].store(false, std::memory_order_relaxed);
+#endif
   }
 }
 
-PreKeyFrameInternals::Grid_t &PreKeyFrameInternals::grid(int lvl) {
+void PreKeyFrameInternals::materialize(int lvl) const {
   CHECK(lvl >= 0 && lvl < pyrSettings.levelNum);
+  if (isReady[lvl].load(std::memory_order_acquire))
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (isReady[lvl].load(std::memory_order_relaxed))
+    return;
+
+  const cv::Mat1b &img = (*pyramid)[lvl];
+  Grid_t *newGrid = new (&gridsData[lvl * sizeof(Grid_t)])
+      Grid_t(img.data, 0, img.rows, 0, img.cols);
+  new (&interpolatorsData[lvl * sizeof(Interpolator_t)])
+      Interpolator_t(*newGrid);
+  ImageSampler::Layout layout = pyrSettings.tiledSamplers
+                                    ? ImageSampler::TILED
+                                    : ImageSampler::ROW_MAJOR;
+  if (samplers[lvl] && samplers[lvl]->getLayout() == layout)
+    samplers[lvl]->reset(img);
+  else
+    samplers[lvl].reset(
+        new ImageSampler(img, layout, pyrSettings.hugePages));
+
+  PROFILE_COUNT("frame.levels_materialized", 1);
+  PROFILE_HIST("frame.materialized_level", lvl, 0, maxLevels, maxLevels);
+  isReady[lvl].store(true, std::memory_order_release);
+}
+
+bool PreKeyFrameInternals::isMaterialized(int lvl) const {
+  CHECK(lvl >= 0 && lvl < pyrSettings.levelNum);
+  return isReady[lvl].load(std::memory_order_acquire);
+}
+
+PreKeyFrameInternals::Grid_t &PreKeyFrameInternals::grid(int lvl) {
+  materialize(lvl);
   return *reinterpret_cast<Grid_t *>(&gridsData[lvl * sizeof(Grid_t)]);
 }
 
 const PreKeyFrameInternals::Grid_t &PreKeyFrameInternals::grid(int lvl) const {
-  CHECK(lvl >= 0 && lvl < pyrSettings.levelNum);
+  materialize(lvl);
   return *reinterpret_cast<const Grid_t *>(&gridsData[lvl * sizeof(Grid_t)]);
 }
 
 PreKeyFrameInternals::Interpolator_t &
 PreKeyFrameInternals::interpolator(int lvl) {
-  CHECK(lvl >= 0 && lvl < pyrSettings.levelNum);
+  materialize(lvl);
   return *reinterpret_cast<Interpolator_t *>(
       &interpolatorsData[lvl * sizeof(Interpolator_t)]);
 }
 
 const PreKeyFrameInternals::Interpolator_t &
 PreKeyFrameInternals::interpolator(int lvl) const {
-  CHECK(lvl >= 0 && lvl < pyrSettings.levelNum);
+  materialize(lvl);
   return *reinterpret_cast<const Interpolator_t *>(
       &interpolatorsData[lvl * sizeof(Interpolator_t)]);
 }
 
+const ImageSampler &PreKeyFrameInternals::sampler(int lvl) const {
+  materialize(lvl);
+  return *samplers[lvl];
+}
+
+#ifdef FISHDSO_CUDA
+const cuda::DeviceImage &PreKeyFrameInternals::deviceImage(int lvl) const {
+  CHECK(lvl >= 0 && lvl < pyrSettings.levelNum);
+  if (!isDeviceReady[lvl].load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!isDeviceReady[lvl].load(std::memory_order_relaxed)) {
+      if (!deviceImages[lvl])
+        deviceImages[lvl].reset(new cuda::DeviceImage());
+      deviceImages[lvl]->upload((*pyramid)[lvl]);
+      PROFILE_COUNT("frame.levels_uploaded", 1);
+      isDeviceReady[lvl].store(true, std::memory_order_release);
+    }
+  }
+  return *deviceImages[lvl];
+}
+#endif
+
 } // namespace fishdso
@@ -0,0 +1,186 @@
+#include "CudaKernels.h"
+#include <cuda_runtime.h>
+#include <glog/logging.h>
+
+namespace fishdso::cuda {
+
+namespace {
+
+#define CUDA_CHECK(expr)                                                       \
+  do {                                                                         \
+    cudaError_t err = (expr);                                                  \
+    CHECK_EQ(err, cudaSuccess) << #expr << ": " << cudaGetErrorString(err);    \
+  } while (false)
+
+// Catmull-Rom weights and their derivatives, as in ImageSampler
+__device__ void splineWeights(float t, float *w, float *dw) {
+  float t2 = t * t, t3 = t2 * t;
+  w[0] = 0.5f * (-t3 + 2 * t2 - t);
+  w[1] = 0.5f * (3 * t3 - 5 * t2 + 2);
+  w[2] = 0.5f * (-3 * t3 + 4 * t2 + t);
+  w[3] = 0.5f * (t3 - t2);
+  dw[0] = 0.5f * (-3 * t2 + 4 * t - 1);
+  dw[1] = 0.5f * (9 * t2 - 10 * t);
+  dw[2] = 0.5f * (-9 * t2 + 8 * t + 1);
+  dw[3] = 0.5f * (3 * t2 - 2 * t);
+}
+
+__device__ void sample(const ImageView &img, float y, float x, float *f,
+                       float *dfdy, float *dfdx) {
+  float minCoord = -img.pad + 1;
+  float fy = fminf(fmaxf(y, minCoord), float(img.height + img.pad - 3));
+  float fx = fminf(fmaxf(x, minCoord), float(img.width + img.pad - 3));
+  float iy = floorf(fy), ix = floorf(fx);
+  float wy[4], wx[4], dwy[4], dwx[4];
+  splineWeights(fy - iy, wy, dwy);
+  splineWeights(fx - ix, wx, dwx);
+
+  const float *ptr = img.data + (int(iy) - 1 + img.pad) * img.stride +
+                     (int(ix) - 1 + img.pad);
+  float val = 0, valDy = 0, valDx = 0;
+  for (int r = 0; r < 4; ++r, ptr += img.stride) {
+    float rowVal = 0, rowDx = 0;
+    for (int c = 0; c < 4; ++c) {
+      rowVal += wx[c] * ptr[c];
+      rowDx += dwx[c] * ptr[c];
+    }
+    val += wy[r] * rowVal;
+    valDy += dwy[r] * rowVal;
+    valDx += wy[r] * rowDx;
+  }
+  *f = val;
+  *dfdy = valDy;
+  *dfdx = valDx;
+}
+
+// the projection and its 2x3 Jacobian, false for rays along the axis
+__device__ bool diffMap(const CameraParams &cam, const double *p,
+                        double *pix, double jac[2][3]) {
+  double rho2 = p[0] * p[0] + p[1] * p[1];
+  double rho = sqrt(rho2);
+  if (rho < 1e-12)
+    return false;
+  double angle = atan2(rho, p[2]);
+
+  double r = cam.coeffs[cam.coeffNum - 1], dr = 0;
+  for (int i = cam.coeffNum - 2; i >= 0; --i) {
+    dr = dr * angle + r;
+    r = r * angle + cam.coeffs[i];
+  }
+
+  double denom = rho2 + p[2] * p[2];
+  double dAngle[3] = {p[2] * p[0] / (rho * denom), p[2] * p[1] / (rho * denom),
+                      -rho / denom};
+  double dRho[3] = {p[0] / rho, p[1] / rho, 0};
+  double k = cam.scale * r / rho;
+  double dk[3];
+  for (int i = 0; i < 3; ++i)
+    dk[i] = cam.scale * (dr * dAngle[i] * rho - r * dRho[i]) / rho2;
+
+  pix[0] = cam.imgCenterX + k * p[0];
+  pix[1] = cam.imgCenterY + k * p[1];
+  for (int i = 0; i < 3; ++i) {
+    jac[0][i] = p[0] * dk[i] + (i == 0 ? k : 0);
+    jac[1][i] = p[1] * dk[i] + (i == 1 ? k : 0);
+  }
+  return true;
+}
+
+__global__ void linearizeKernel(CameraParams cam, ImageView img, int pointNum,
+                                const double *positions,
+                                const float *intensities,
+                                const float *weights, Motion motion,
+                                double *partials) {
+  __shared__ double shared[blockSize];
+
+  double vals[linearizationSize];
+  for (int k = 0; k < linearizationSize; ++k)
+    vals[k] = 0;
+
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  double pos[3], pix[2], mapJac[2][3];
+  if (i < pointNum) {
+    const double *base = positions + 3 * i;
+    for (int r = 0; r < 3; ++r)
+      pos[r] = motion.rot[3 * r] * base[0] + motion.rot[3 * r + 1] * base[1] +
+               motion.rot[3 * r + 2] * base[2] + motion.trans[r];
+  }
+
+  if (i < pointNum && diffMap(cam, pos, pix, mapJac)) {
+    float intensity, dIdy, dIdx;
+    sample(img, float(pix[1]), float(pix[0]), &intensity, &dIdy, &dIdx);
+
+    double res = motion.expA * (intensity + motion.affB) - intensities[i];
+
+    // the gradient times mapJac * [I, -p^], with -p^ w = w x p
+    double gradJ[3];
+    for (int c = 0; c < 3; ++c)
+      gradJ[c] =
+          motion.expA * (dIdx * mapJac[0][c] + dIdy * mapJac[1][c]);
+    double jac[8];
+    jac[0] = gradJ[0];
+    jac[1] = gradJ[1];
+    jac[2] = gradJ[2];
+    jac[3] = pos[1] * gradJ[2] - pos[2] * gradJ[1];
+    jac[4] = pos[2] * gradJ[0] - pos[0] * gradJ[2];
+    jac[5] = pos[0] * gradJ[1] - pos[1] * gradJ[0];
+    jac[6] = motion.expA * (intensity + motion.affB);
+    jac[7] = motion.expA;
+
+    accumulateResidual(res, weights[i], jac, motion.outlierDiff, vals);
+  }
+
+  // a tree sum per value, in the same order on every run
+  for (int k = 0; k < linearizationSize; ++k) {
+    shared[threadIdx.x] = vals[k];
+    __syncthreads();
+    for (int s = blockDim.x / 2; s > 0; s /= 2) {
+      if (threadIdx.x < s)
+        shared[threadIdx.x] += shared[threadIdx.x + s];
+      __syncthreads();
+    }
+    if (threadIdx.x == 0)
+      partials[blockIdx.x * linearizationSize + k] = shared[0];
+    __syncthreads();
+  }
+}
+
+} // namespace
+
+bool isDeviceAvailable() {
+  int count = 0;
+  return cudaGetDeviceCount(&count) == cudaSuccess && count > 0;
+}
+
+void *deviceAlloc(size_t bytes) {
+  void *ptr = nullptr;
+  CUDA_CHECK(cudaMalloc(&ptr, bytes));
+  return ptr;
+}
+
+void deviceFree(void *ptr) {
+  if (ptr)
+    CUDA_CHECK(cudaFree(ptr));
+}
+
+void copyToDevice(void *dst, const void *src, size_t bytes) {
+  CUDA_CHECK(cudaMemcpy(dst, src, bytes, cudaMemcpyHostToDevice));
+}
+
+void linearize(const CameraParams &cam, const ImageView &img, int pointNum,
+               const double *positions, const float *intensities,
+               const float *weights, const Motion &motion,
+               double *devPartials, double *hostPartials) {
+  int blocks = partialNum(pointNum);
+  if (blocks == 0)
+    return;
+  linearizeKernel<<<blocks, blockSize>>>(cam, img, pointNum, positions,
+                                         intensities, weights, motion,
+                                         devPartials);
+  CUDA_CHECK(cudaGetLastError());
+  CUDA_CHECK(cudaMemcpy(hostPartials, devPartials,
+                        sizeof(double) * blocks * linearizationSize,
+                        cudaMemcpyDeviceToHost));
+}
+
+} // namespace fishdso::cuda
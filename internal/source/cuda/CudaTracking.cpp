@@ -0,0 +1,102 @@
+#include "CudaTracking.h"
+#include "util/ImageSampler.h"
+#include <glog/logging.h>
+#include <opencv2/imgproc.hpp>
+
+namespace fishdso::cuda {
+
+bool isAvailable() {
+  static const bool isDevicePresent = isDeviceAvailable();
+  return isDevicePresent;
+}
+
+DeviceImage::~DeviceImage() { deviceFree(data); }
+
+void DeviceImage::upload(const cv::Mat1b &img) {
+  constexpr int pad = ImageSampler::pad;
+  cv::Mat1b padded;
+  cv::copyMakeBorder(img, padded, pad, pad, pad, pad, cv::BORDER_REPLICATE);
+  cv::Mat1f paddedFloat;
+  padded.convertTo(paddedFloat, CV_32F);
+
+  size_t bytes = sizeof(float) * paddedFloat.total();
+  if (bytes > capacity) {
+    deviceFree(data);
+    data = static_cast<float *>(deviceAlloc(bytes));
+    capacity = bytes;
+  }
+  copyToDevice(data, paddedFloat.ptr<float>(), bytes);
+  imgView = {data, img.cols, img.rows, paddedFloat.cols, pad};
+}
+
+DeviceTrackingPoints::DeviceTrackingPoints(
+    const StdVector<Vec3> &_positions, const std::vector<double> &_intensities,
+    const std::vector<double> &_weights)
+    : pointNum(_positions.size())
+    , hostPartials(partialNum(pointNum) * linearizationSize) {
+  if (pointNum == 0)
+    return;
+
+  std::vector<double> flatPositions(3 * pointNum);
+  for (int i = 0; i < pointNum; ++i)
+    for (int j = 0; j < 3; ++j)
+      flatPositions[3 * i + j] = _positions[i][j];
+  std::vector<float> floatIntensities(_intensities.begin(),
+                                      _intensities.end());
+  std::vector<float> floatWeights(_weights.begin(), _weights.end());
+
+  positions =
+      static_cast<double *>(deviceAlloc(sizeof(double) * 3 * pointNum));
+  intensities = static_cast<float *>(deviceAlloc(sizeof(float) * pointNum));
+  weights = static_cast<float *>(deviceAlloc(sizeof(float) * pointNum));
+  devPartials = static_cast<double *>(
+      deviceAlloc(sizeof(double) * hostPartials.size()));
+  copyToDevice(positions, flatPositions.data(),
+               sizeof(double) * flatPositions.size());
+  copyToDevice(intensities, floatIntensities.data(),
+               sizeof(float) * pointNum);
+  copyToDevice(weights, floatWeights.data(), sizeof(float) * pointNum);
+}
+
+DeviceTrackingPoints::~DeviceTrackingPoints() {
+  deviceFree(positions);
+  deviceFree(intensities);
+  deviceFree(weights);
+  deviceFree(devPartials);
+}
+
+double DeviceTrackingPoints::linearize(const CameraModel &cam,
+                                       const DeviceImage &trackedFrame,
+                                       const SE3 &baseToTracked,
+                                       const AffLight &affLight,
+                                       double outlierDiff, Mat88 *H, Vec8 *b) {
+  CameraParams camParams;
+  Vec2 imgCenter = cam.getImgCenter();
+  camParams.imgCenterX = imgCenter[0];
+  camParams.imgCenterY = imgCenter[1];
+  camParams.scale = cam.getScale();
+  const CameraModel::MapPolyCoeffs &coeffs = cam.getMapPolyCoeffs();
+  CHECK_LE(coeffs.size(), maxMapPolyCoeffs);
+  camParams.coeffNum = coeffs.size();
+  for (int i = 0; i < coeffs.size(); ++i)
+    camParams.coeffs[i] = coeffs[i];
+
+  Motion motion;
+  Mat33 rot = baseToTracked.rotationMatrix();
+  for (int r = 0; r < 3; ++r) {
+    for (int c = 0; c < 3; ++c)
+      motion.rot[3 * r + c] = rot(r, c);
+    motion.trans[r] = baseToTracked.translation()[r];
+  }
+  motion.expA = std::exp(affLight.data[0]);
+  motion.affB = affLight.data[1];
+  motion.outlierDiff = outlierDiff;
+
+  cuda::linearize(camParams, trackedFrame.view(), pointNum, positions,
+                  intensities, weights, motion, devPartials,
+                  hostPartials.data());
+
+  return reducePartials(hostPartials, H, b);
+}
+
+} // namespace fishdso::cuda
@@ -0,0 +1,62 @@
+#include "NumpyAllocator.h"
+#include <stdexcept>
+
+namespace py = pybind11;
+
+namespace fishdso {
+
+namespace {
+
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag AccessFlags;
+#else
+typedef int AccessFlags;
+#endif
+
+// Only releases the arrays that wrapArray has wrapped, Mats that need new
+// storage get it from the default allocator.
+class NumpyAllocator : public cv::MatAllocator {
+public:
+  cv::UMatData *allocate(int dims, const int *sizes, int type, void *data,
+                         size_t *step, AccessFlags flags,
+                         cv::UMatUsageFlags usageFlags) const override {
+    return cv::Mat::getDefaultAllocator()->allocate(dims, sizes, type, data,
+                                                    step, flags, usageFlags);
+  }
+
+  bool allocate(cv::UMatData *data, AccessFlags accessFlags,
+                cv::UMatUsageFlags usageFlags) const override {
+    return false;
+  }
+
+  void deallocate(cv::UMatData *data) const override {
+    if (!data)
+      return;
+    py::gil_scoped_acquire gil;
+    Py_XDECREF(static_cast<PyObject *>(data->userdata));
+    delete data;
+  }
+};
+
+NumpyAllocator numpyAllocator;
+
+} // namespace
+
+cv::Mat1b wrapArray(const py::array_t<uint8_t> &array) {
+  if (array.ndim() != 2 || array.strides(0) <= 0 || array.strides(1) != 1)
+    throw std::invalid_argument(
+        "expected a 2D uint8 array with contiguous rows");
+
+  uchar *begin = const_cast<uchar *>(array.data());
+  cv::UMatData *data = new cv::UMatData(&numpyAllocator);
+  data->data = data->origdata = begin;
+  data->size = array.shape(0) * array.strides(0);
+  data->userdata = array.inc_ref().ptr();
+
+  cv::Mat1b mat(array.shape(0), array.shape(1), begin, array.strides(0));
+  mat.u = data;
+  mat.addref();
+  return mat;
+}
+
+} // namespace fishdso
@@ -0,0 +1,18 @@
+#ifndef INCLUDE_NUMPYALLOCATOR
+#define INCLUDE_NUMPYALLOCATOR
+
+#include <opencv2/core.hpp>
+#include <pybind11/numpy.h>
+
+namespace fishdso {
+
+// Wraps a 2D uint8 array with contiguous rows into a refcounted cv::Mat
+// without copying it, so that DsoSystem takes it as the finest pyramid level
+// as is, see SourceFrame. The Mat holds a reference to the array, which is
+// dropped under the GIL when the last Mat sharing it is released, possibly
+// by the mapping thread. The array must not be written to afterwards.
+cv::Mat1b wrapArray(const pybind11::array_t<uint8_t> &array);
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,65 @@
+#include "OutputCollector.h"
+#include "system/KeyFrame.h"
+#include "util/util.h"
+#include <cmath>
+
+namespace fishdso {
+
+OutputCollector::OutputCollector(CameraModel *cam)
+    : cam(cam) {}
+
+void OutputCollector::posesFlushed(const PoseHistory::Chunk &chunk) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const FramePose &pose : chunk)
+    if (pose.isEstimated)
+      poses.push_back(pose);
+}
+
+void OutputCollector::frameProcessed(const FrameTimings &frameTimings) {
+  std::lock_guard<std::mutex> lock(mutex);
+  timings.push_back(frameTimings);
+}
+
+void OutputCollector::keyFramesMarginalized(
+    const std::vector<const KeyFrame *> &marginalized) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const KeyFrame *kf : marginalized) {
+    const cv::Mat1b &frame = kf->preKeyFrame->frame();
+    int kfNum = kf->preKeyFrame->globalFrameNum;
+    auto add = [&](const Vec2 &p, double depth) {
+      if (!std::isfinite(depth))
+        return;
+      points.positions.push_back(kf->thisToWorld *
+                                 (depth * cam->unmap(p).normalized()));
+      points.intencities.push_back(frame(toCvPoint(p)));
+      points.keyFrameNums.push_back(kfNum);
+    };
+    for (const auto &op : kf->optimizedPoints)
+      add(op->p, op->depth());
+    for (const auto &ip : kf->immaturePoints)
+      if (ip->numTraced > 0)
+        add(ip->p, ip->depth);
+  }
+}
+
+void OutputCollector::destructed(
+    const std::vector<const KeyFrame *> &lastKeyFrames) {
+  keyFramesMarginalized(lastKeyFrames);
+}
+
+PoseHistory::Chunk OutputCollector::takePoses() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return std::move(poses);
+}
+
+OutputCollector::Points OutputCollector::takePoints() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return std::move(points);
+}
+
+std::vector<FrameTimings> OutputCollector::takeTimings() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return std::move(timings);
+}
+
+} // namespace fishdso
@@ -0,0 +1,48 @@
+#ifndef INCLUDE_OUTPUTCOLLECTOR
+#define INCLUDE_OUTPUTCOLLECTOR
+
+#include "output/DsoObserver.h"
+#include "system/CameraModel.h"
+#include "system/FrameTimings.h"
+#include <mutex>
+#include <vector>
+
+namespace fishdso {
+
+// Gathers the output that the Python module hands out in bulk: the final
+// poses, the points of the keyframes that have left the window and the
+// timings of every frame. With asynchronous mapping the callbacks come from
+// both threads, each take returns what has come since the previous one.
+class OutputCollector : public DsoObserver {
+public:
+  struct Points {
+    std::vector<Vec3> positions;
+    // of the base keyframe at the point
+    std::vector<uchar> intencities;
+    std::vector<int> keyFrameNums;
+  };
+
+  explicit OutputCollector(CameraModel *cam);
+
+  void posesFlushed(const PoseHistory::Chunk &chunk) override;
+  void frameProcessed(const FrameTimings &timings) override;
+  void keyFramesMarginalized(
+      const std::vector<const KeyFrame *> &marginalized) override;
+  void destructed(const std::vector<const KeyFrame *> &lastKeyFrames) override;
+
+  PoseHistory::Chunk takePoses();
+  Points takePoints();
+  std::vector<FrameTimings> takeTimings();
+
+private:
+  CameraModel *cam;
+
+  std::mutex mutex;
+  PoseHistory::Chunk poses;
+  Points points;
+  std::vector<FrameTimings> timings;
+};
+
+} // namespace fishdso
+
+#endif
@@ -0,0 +1,257 @@
+#include "NumpyAllocator.h"
+#include "OutputCollector.h"
+#include "system/DsoSystem.h"
+#include "util/flags.h"
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <memory>
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <stdexcept>
+
+namespace py = pybind11;
+using namespace py::literals;
+using namespace fishdso;
+
+namespace {
+
+// Owns a DsoSystem along with the collector of its output. The GIL is
+// released while the frames are processed, and while the system is
+// destroyed, since the mapping thread may drop the last references to the
+// frame arrays. Once closed, the remaining output can still be taken.
+class PyDsoSystem {
+public:
+  PyDsoSystem(CameraModel *cam, const Settings &settings)
+      : collector(cam) {
+    Observers observers;
+    observers.dso.push_back(&collector);
+    dso.reset(new DsoSystem(cam, observers, settings));
+  }
+
+  ~PyDsoSystem() { close(); }
+
+  void addFrame(const py::array_t<uint8_t> &gray, int globalFrameNum,
+                double timestamp) {
+    DsoSystem &system = checkOpen();
+    SourceFrame frame = {wrapArray(gray), {}, globalFrameNum, timestamp};
+    py::gil_scoped_release release;
+    system.addFrame(frame);
+  }
+
+  void waitForMapping() {
+    DsoSystem &system = checkOpen();
+    py::gil_scoped_release release;
+    system.waitForMapping();
+  }
+
+  // flushes the poses and the points of the last keyframes
+  void close() {
+    py::gil_scoped_release release;
+    dso.reset();
+  }
+
+  void saveSnapshot(const std::string &snapshotDir, bool embedFrames) {
+    DsoSystem &system = checkOpen();
+    py::gil_scoped_release release;
+    system.saveSnapshot(snapshotDir, BINARY,
+                        embedFrames ? PNG_FRAMES : NO_FRAMES);
+  }
+
+  py::dict takePoses() {
+    PoseHistory::Chunk poses = collector.takePoses();
+    py::ssize_t n = poses.size();
+    py::array_t<int> frameNums(n);
+    py::array_t<double> worldToFrame(std::vector<py::ssize_t>{n, 4, 4});
+    py::array_t<bool> isSkipped(n);
+    auto nums = frameNums.mutable_unchecked<1>();
+    auto mats = worldToFrame.mutable_unchecked<3>();
+    auto skipped = isSkipped.mutable_unchecked<1>();
+    for (py::ssize_t i = 0; i < n; ++i) {
+      nums(i) = poses[i].frameNum;
+      skipped(i) = poses[i].isSkipped;
+      Mat44 mat = poses[i].worldToFrame.matrix();
+      for (int r = 0; r < 4; ++r)
+        for (int c = 0; c < 4; ++c)
+          mats(i, r, c) = mat(r, c);
+    }
+    return py::dict("frame_nums"_a = frameNums,
+                    "world_to_frame"_a = worldToFrame,
+                    "is_skipped"_a = isSkipped);
+  }
+
+  py::dict takePoints() {
+    OutputCollector::Points points = collector.takePoints();
+    py::ssize_t n = points.positions.size();
+    py::array_t<double> positions(std::vector<py::ssize_t>{n, 3});
+    auto pos = positions.mutable_unchecked<2>();
+    for (py::ssize_t i = 0; i < n; ++i)
+      for (int c = 0; c < 3; ++c)
+        pos(i, c) = points.positions[i][c];
+    return py::dict(
+        "positions"_a = positions,
+        "intencities"_a = py::array_t<uint8_t>(n, points.intencities.data()),
+        "keyframe_nums"_a = py::array_t<int>(n, points.keyFrameNums.data()));
+  }
+
+  py::dict takeTimings() {
+    std::vector<FrameTimings> timings = collector.takeTimings();
+    py::ssize_t n = timings.size();
+    py::array_t<int> frameNums(n);
+    py::array_t<bool> isKeyFrame(n);
+    py::array_t<double> seconds(
+        std::vector<py::ssize_t>{n, FrameTimings::STAGE_NUM});
+    auto nums = frameNums.mutable_unchecked<1>();
+    auto keyFrames = isKeyFrame.mutable_unchecked<1>();
+    auto secs = seconds.mutable_unchecked<2>();
+    for (py::ssize_t i = 0; i < n; ++i) {
+      nums(i) = timings[i].globalFrameNum;
+      keyFrames(i) = timings[i].isKeyFrame;
+      for (int s = 0; s < FrameTimings::STAGE_NUM; ++s)
+        secs(i, s) = timings[i].seconds[s];
+    }
+    return py::dict("frame_nums"_a = frameNums, "is_keyframe"_a = isKeyFrame,
+                    "seconds"_a = seconds);
+  }
+
+private:
+  DsoSystem &checkOpen() {
+    if (!dso)
+      throw std::runtime_error("the system is closed");
+    return *dso;
+  }
+
+  OutputCollector collector;
+  std::unique_ptr<DsoSystem> dso;
+};
+
+// Settings as getFlaggedSettings makes them with the flags overridden by
+// the given ones, which are put back afterwards.
+Settings settingsFromFlags(const std::map<std::string, py::object> &flags) {
+  std::vector<std::pair<std::string, std::string>> saved;
+  auto restore = [&saved]() {
+    for (const auto &[flag, value] : saved)
+      gflags::SetCommandLineOption(flag.c_str(), value.c_str());
+  };
+  for (const auto &[flag, value] : flags) {
+    std::string oldValue;
+    if (!gflags::GetCommandLineOption(flag.c_str(), &oldValue)) {
+      restore();
+      throw std::invalid_argument("unknown flag " + flag);
+    }
+    std::string newValue = py::isinstance<py::bool_>(value)
+                               ? (value.cast<bool>() ? "true" : "false")
+                               : py::str(value).cast<std::string>();
+    saved.push_back({flag, oldValue});
+    if (gflags::SetCommandLineOption(flag.c_str(), newValue.c_str()).empty()) {
+      restore();
+      throw std::invalid_argument("bad value " + newValue + " of flag " +
+                                  flag);
+    }
+  }
+  Settings settings = getFlaggedSettings();
+  restore();
+  return settings;
+}
+
+} // namespace
+
+PYBIND11_MODULE(fishdso, m) {
+  m.doc() = "Direct sparse odometry for fisheye cameras";
+  google::InitGoogleLogging("fishdso");
+
+  py::class_<Settings::CameraModel>(m, "CameraModelSettings")
+      .def(py::init<>())
+      .def_readwrite("map_poly_degree", &Settings::CameraModel::mapPolyDegree)
+      .def_readwrite("use_lookup_tables",
+                     &Settings::CameraModel::useLookupTables)
+      .def_readwrite("valid_angle", &Settings::CameraModel::validAngle)
+      .def_readwrite("cache_map_poly_fit",
+                     &Settings::CameraModel::cacheMapPolyFit);
+
+  py::class_<Settings::Threading>(m, "ThreadingSettings")
+      .def(py::init<>())
+      .def_readwrite("num_threads", &Settings::Threading::numThreads)
+      .def_readwrite("async_mapping", &Settings::Threading::asyncMapping)
+      .def_readwrite("mapping_queue_size",
+                     &Settings::Threading::mappingQueueSize);
+
+  py::class_<Settings::KeyFrame>(m, "KeyFrameSettings")
+      .def(py::init<>())
+      .def_readwrite("points_num", &Settings::KeyFrame::pointsNum);
+
+  py::class_<Settings::BundleAdjuster>(m, "BundleAdjusterSettings")
+      .def(py::init<>())
+      .def_readwrite("max_iterations", &Settings::BundleAdjuster::maxIterations)
+      .def_readwrite("run_ba", &Settings::BundleAdjuster::runBA)
+      .def_readwrite("use_windowed_optimizer",
+                     &Settings::BundleAdjuster::useWindowedOptimizer)
+      .def_readwrite("max_solver_time",
+                     &Settings::BundleAdjuster::maxSolverTime);
+
+  py::class_<Settings::Pyramid>(m, "PyramidSettings")
+      .def(py::init<>())
+      .def_readwrite("level_num", &Settings::Pyramid::levelNum);
+
+  py::class_<Settings>(m, "Settings")
+      .def(py::init<>())
+      .def_static("from_flags", &settingsFromFlags, "flags"_a,
+                  "Settings of the command line flags of the samples, e.g. "
+                  "{'max_keyframes': 9, 'async_mapping': True}; the ones not "
+                  "given keep their defaults.")
+      .def_readwrite("camera_model", &Settings::cameraModel)
+      .def_readwrite("threading", &Settings::threading)
+      .def_readwrite("key_frame", &Settings::keyFrame)
+      .def_readwrite("bundle_adjuster", &Settings::bundleAdjuster)
+      .def_readwrite("pyramid", &Settings::pyramid)
+      .def_readwrite("max_optimized_points", &Settings::maxOptimizedPoints)
+      .def_readwrite("max_keyframes", &Settings::maxKeyFrames)
+      .def_readwrite("track_from_last_kf", &Settings::trackFromLastKf)
+      .def_readwrite("pose_chunk_size", &Settings::poseChunkSize)
+      .def_readwrite("shift_between_keyframes",
+                     &Settings::shiftBetweenKeyFrames);
+
+  py::class_<CameraModel>(m, "CameraModel")
+      .def(py::init<int, int, const std::string &,
+                    const Settings::CameraModel &>(),
+           "width"_a, "height"_a, "calib_file"_a,
+           "settings"_a = Settings::CameraModel())
+      .def(py::init<int, int, double, double, double,
+                    const Settings::CameraModel &>(),
+           "width"_a, "height"_a, "f"_a, "cx"_a, "cy"_a,
+           "settings"_a = Settings::CameraModel())
+      .def_property_readonly("width", &CameraModel::getWidth)
+      .def_property_readonly("height", &CameraModel::getHeight)
+      .def(
+          "set_static_mask",
+          [](CameraModel &cam, const py::array_t<uint8_t> &mask) {
+            cam.setStaticMask(wrapArray(mask).clone());
+          },
+          "mask"_a);
+
+  std::vector<std::string> stages;
+  for (int s = 0; s < FrameTimings::STAGE_NUM; ++s)
+    stages.push_back(FrameTimings::stageName(FrameTimings::Stage(s)));
+  m.attr("STAGES") = stages;
+
+  py::class_<PyDsoSystem>(m, "DsoSystem")
+      .def(py::init<CameraModel *, const Settings &>(), "cam"_a,
+           "settings"_a = Settings(), py::keep_alive<1, 2>())
+      .def("add_frame", &PyDsoSystem::addFrame, "gray"_a, "frame_num"_a,
+           "timestamp"_a = 0.0,
+           "Tracks a grayscale uint8 frame. The array is not copied, so it "
+           "should not be written to afterwards.")
+      .def("wait_for_mapping", &PyDsoSystem::waitForMapping)
+      .def("save_snapshot", &PyDsoSystem::saveSnapshot, "snapshot_dir"_a,
+           "embed_frames"_a = true)
+      .def("close", &PyDsoSystem::close,
+           "Finishes the run, flushing the remaining poses and points.")
+      .def("take_poses", &PyDsoSystem::takePoses,
+           "Final poses flushed since the last call, as arrays.")
+      .def("take_points", &PyDsoSystem::takePoints,
+           "Points of the keyframes that left the window since the last "
+           "call, in the world frame.")
+      .def("take_timings", &PyDsoSystem::takeTimings,
+           "Seconds per stage, see STAGES, of the frames processed since the "
+           "last call.");
+}
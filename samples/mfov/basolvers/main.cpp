@@ -0,0 +1,174 @@
+#include "../reader/MultiFovReader.h"
+#include "../reader/PrefetchingReader.h"
+#include "system/DsoSystem.h"
+#include "system/FrameTimings.h"
+#include "util/flags.h"
+#include "util/util.h"
+#include <algorithm>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+DEFINE_int32(start, 1, "Number of the starting frame.");
+DEFINE_int32(count, 300, "Number of frames to replay for each configuration.");
+DEFINE_string(window_sizes, "7,10,15,20",
+              "Comma-separated numbers of keyframes in the window to try.");
+DEFINE_string(solvers, "dense,sparse,iterative",
+              "Comma-separated BA linear solvers to try, see "
+              "ba_linear_solver.");
+DEFINE_int32(reader_threads, 4, "Number of threads decoding the frames.");
+DEFINE_string(json, "",
+              "If set, the results are written to this file as JSON.");
+
+using namespace fishdso;
+
+class BaTimingsCollector : public DsoObserver {
+public:
+  void frameProcessed(const FrameTimings &timings) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (timings.isKeyFrame)
+      baSeconds.push_back(timings.seconds[FrameTimings::BUNDLE_ADJUSTMENT]);
+  }
+
+  std::vector<double> take() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::move(baSeconds);
+  }
+
+private:
+  std::mutex mutex;
+  std::vector<double> baSeconds;
+};
+
+struct ConfigResult {
+  int windowSize;
+  std::string solver;
+  // sorted
+  std::vector<double> baSeconds;
+
+  double mean() const {
+    double sum = 0;
+    for (double s : baSeconds)
+      sum += s;
+    return baSeconds.empty() ? 0 : sum / baSeconds.size();
+  }
+};
+
+std::vector<std::string> split(const std::string &list) {
+  std::vector<std::string> result;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    if (!item.empty())
+      result.push_back(item);
+  return result;
+}
+
+Settings::BundleAdjuster::LinearSolver solverByName(const std::string &name) {
+  if (name == "sparse")
+    return Settings::BundleAdjuster::SPARSE_SCHUR;
+  if (name == "iterative")
+    return Settings::BundleAdjuster::ITERATIVE_SCHUR;
+  CHECK_EQ(name, "dense") << "unknown BA linear solver";
+  return Settings::BundleAdjuster::DENSE_SCHUR;
+}
+
+ConfigResult runConfig(const MultiFovReader &reader,
+                       const std::vector<cv::Mat1b> &frames,
+                       Settings settings, int windowSize,
+                       const std::string &solver) {
+  settings.maxKeyFrames = windowSize;
+  settings.bundleAdjuster.linearSolver = solverByName(solver);
+  settings.bundleAdjuster.useWindowedOptimizer = false;
+
+  BaTimingsCollector collector;
+  Observers observers;
+  observers.dso.push_back(&collector);
+  {
+    DsoSystem dso(reader.cam.get(), observers, settings);
+    for (int i = 0; i < frames.size(); ++i)
+      dso.addFrame(SourceFrame{frames[i], {}, FLAGS_start + i});
+    dso.waitForMapping();
+  }
+
+  ConfigResult result{windowSize, solver, collector.take()};
+  // the window is still filling up on the first keyframes
+  int filling = std::min(int(result.baSeconds.size()), windowSize);
+  result.baSeconds.erase(result.baSeconds.begin(),
+                         result.baSeconds.begin() + filling);
+  std::sort(result.baSeconds.begin(), result.baSeconds.end());
+  return result;
+}
+
+void writeJson(std::ostream &out, const std::vector<ConfigResult> &results) {
+  out << std::setprecision(6) << "{\n  \"start\": " << FLAGS_start
+      << ",\n  \"count\": " << FLAGS_count << ",\n  \"configs\": [\n";
+  for (int i = 0; i < results.size(); ++i) {
+    const ConfigResult &r = results[i];
+    out << "    {\"window\": " << r.windowSize << ", \"solver\": \""
+        << r.solver << "\", \"keyframes\": " << r.baSeconds.size()
+        << ", \"ba_ms_mean\": " << 1e3 * r.mean()
+        << ", \"ba_ms_p50\": " << 1e3 * percentile(r.baSeconds, 50)
+        << ", \"ba_ms_p95\": " << 1e3 * percentile(r.baSeconds, 95) << "}"
+        << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::string usage = "Usage: " + std::string(argv[0]) + R"abacaba( data_dir
+Where data_dir names a directory with MultiFoV fishseye dataset.
+Replays frames [start, start + count) through DsoSystem once for every
+window size and BA linear solver, and reports the time of bundle adjustment
+per keyframe once the window is full. The rest of the settings come from
+the usual flags.)abacaba";
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  gflags::SetUsageMessage(usage);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc != 2) {
+    std::cerr << "Wrong number of arguments!\n" << usage << std::endl;
+    return 1;
+  }
+
+  Settings settings = getFlaggedSettings();
+  MultiFovReader reader(argv[1], "", settings.cameraModel);
+
+  std::cout << "decoding frames.." << std::endl;
+  std::vector<cv::Mat1b> frames;
+  frames.reserve(FLAGS_count);
+  PrefetchingReader prefetcher(reader, FLAGS_start, FLAGS_count,
+                               2 * FLAGS_reader_threads, FLAGS_reader_threads,
+                               false, true);
+  while (prefetcher.hasNext())
+    frames.push_back(prefetcher.next().frame);
+
+  std::vector<ConfigResult> results;
+  std::cout << std::setw(8) << "window" << std::setw(12) << "solver"
+            << std::setw(12) << "keyframes" << std::setw(12) << "mean ms"
+            << std::setw(12) << "p50 ms" << std::setw(12) << "p95 ms"
+            << std::endl;
+  for (const std::string &windowSize : split(FLAGS_window_sizes))
+    for (const std::string &solver : split(FLAGS_solvers)) {
+      results.push_back(
+          runConfig(reader, frames, settings, std::stoi(windowSize), solver));
+      const ConfigResult &r = results.back();
+      std::cout << std::setw(8) << r.windowSize << std::setw(12) << r.solver
+                << std::setw(12) << r.baSeconds.size() << std::setw(12)
+                << 1e3 * r.mean() << std::setw(12)
+                << 1e3 * percentile(r.baSeconds, 50) << std::setw(12)
+                << 1e3 * percentile(r.baSeconds, 95) << std::endl;
+    }
+
+  if (!FLAGS_json.empty()) {
+    std::ofstream jsonOfs(FLAGS_json);
+    writeJson(jsonOfs, results);
+  }
+
+  return 0;
+}
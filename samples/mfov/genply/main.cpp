@@ -1,17 +1,26 @@
 #include "../reader/MultiFovReader.h"
+#include "../reader/PrefetchingReader.h"
+#include "output/AsyncObserverAdapter.h"
 #include "output/CloudWriter.h"
 #include "output/CloudWriterGT.h"
 #include "output/DebugImageDrawer.h"
+#include "output/DepthMapWriter.h"
 #include "output/DepthPyramidDrawer.h"
 #include "output/InterpolationDrawer.h"
+#include "output/MapTileWriter.h"
+#include "output/ProfileWriter.h"
 #include "output/TrackingDebugImageDrawer.h"
+#include "output/TrajectoryEvaluator.h"
 #include "output/TrajectoryWriter.h"
 #include "output/TrajectoryWriterGT.h"
 #include "system/DsoSystem.h"
 #include "util/defs.h"
+#include "util/Profiler.h"
 #include "util/flags.h"
 #include <gflags/gflags.h>
+#include <glog/logging.h>
 #include <iostream>
+#include <tbb/parallel_for.h>
 
 DEFINE_int32(start, 1, "Number of the starting frame.");
 DEFINE_int32(count, 100, "Number of frames to process.");
@@ -50,43 +59,126 @@ DEFINE_bool(draw_depth_pyramid, false,
 DEFINE_bool(show_interpolation, false,
             "Show interpolated depths after initialization?");
 
+DEFINE_bool(async_output, false,
+            "Deliver the callbacks of the trajectory and cloud writers and of "
+            "the drawers on worker threads, so that they do not stall "
+            "tracking?");
+DEFINE_int32(async_output_queue, 16,
+             "Number of callbacks an asynchronous observer queues at most.");
+
+DEFINE_bool(binary_ply, false,
+            "Write the point clouds as binary PLY instead of the ASCII one?");
+DEFINE_int32(ply_chunk_points, 0,
+             "If positive, the point clouds are split into files of at most "
+             "this many points.");
+DEFINE_bool(record_stream, false,
+            "Write the poses and the keyframe points into one binary "
+            "records.bin instead of the text trajectories and PLY files. "
+            "records2text converts it back.");
+DEFINE_bool(float_poses, false,
+            "Store the poses of the record stream as floats, not doubles.");
+DEFINE_double(map_voxel_size, 0,
+              "If positive, the map is also written downsampled to voxels of "
+              "this size, in tiles with levels of detail, into the map "
+              "subdirectory of the output directory.");
+DEFINE_int32(map_tile_voxels, 64, "Side of a map tile in voxels.");
+DEFINE_int32(map_levels, 4,
+             "Number of levels of detail of the map, each coarser one "
+             "averaging twice as large voxels.");
+DEFINE_int32(map_max_voxels, 4'000'000,
+             "Number of voxels of the map held in memory at most, the tiles "
+             "beyond that are evicted to the disk.");
+DEFINE_int32(map_flush_every, 10,
+             "Number of marginalized keyframes between rewrites of the "
+             "changed map tiles.");
+DEFINE_string(depth_maps, "",
+              "If float32 or float16, the interpolated depth and its "
+              "confidence of every marginalized keyframe are written as raw "
+              "floats into the depth subdirectory of the output directory.");
+
 DEFINE_bool(write_files, true,
             "Do we need to write output files into output_directory?");
 DEFINE_string(output_directory, "output/default",
               "CO: \"it's dso's output directory!\"");
 DEFINE_string(dir_prefix, "", "The prefix added to distinguish the output");
+DEFINE_int32(read_ahead, 8,
+             "Number of frames decoded in the background ahead of tracking.");
+DEFINE_int32(reader_threads, 2, "Number of frame decoding threads.");
+DEFINE_string(depth_cache_dir, "",
+              "If not empty, GT depth maps are converted into a binary cache "
+              "in this directory once and read from it afterwards.");
+DEFINE_bool(text_snapshot, false,
+            "Write the final snapshot in the human-readable text format "
+            "instead of the binary one.");
+DEFINE_string(embed_frames, "none",
+              "Embed the keyframe images into the snapshots, so that they are "
+              "restored without the dataset: none, raw or png.");
+DEFINE_bool(checkpoint, false,
+            "Checkpoint the window into the checkpoint subdirectory of the "
+            "output directory after every keyframe, writing only what has "
+            "changed. It can be restored like the final snapshot.");
+DEFINE_int32(checkpoint_sync_every, 1,
+             "Number of checkpoints that are synced to the disk at once. A "
+             "crash loses at most this many checkpoints but one.");
+DEFINE_string(profile_format, "",
+              "If set to csv or json, the timers and counters recorded on the "
+              "hot path are written per frame into profile.csv or "
+              "profile.json in the output directory.");
+DEFINE_bool(trace_timeline, false,
+            "If set, the timed scopes of all threads are written into "
+            "trace.json in the output directory as Chrome trace events, to "
+            "be opened in chrome://tracing or Perfetto.");
+DEFINE_int32(trace_events_per_thread, 1 << 18,
+             "Number of the latest timeline events kept per thread.");
+DEFINE_string(eval_summary, "",
+              "If set, the ATE and RPE of the trajectory against the ground "
+              "truth are computed on the fly, and a summary of the run is "
+              "appended to this file as a line of JSON.");
+DEFINE_int32(rpe_delta, 1, "Distance in frames between the RPE pairs.");
 DEFINE_bool(
     use_time_for_output, true,
     "If set to true, output directory is created according to the current "
     "time, instead of using the output_directory flag. The precise format for "
     "the name is output/YYYYMMDD_HHMMSS");
 
-void readPointsInFrameGT(const MultiFovReader &reader,
-                         std::vector<std::vector<Vec3>> &pointsInFrameGT,
-                         std::vector<std::vector<cv::Vec3b>> &colors,
-                         int maxPoints) {
-  std::cout << "filling GT points..." << std::endl;
-  int w = reader.cam->getWidth(), h = reader.cam->getHeight();
-  int step =
-      std::ceil(std::sqrt(double(FLAGS_count) * w * h / FLAGS_gt_points));
-  const double maxd = 1e10;
-  for (int it = FLAGS_start; it < FLAGS_start + FLAGS_count; ++it) {
-    pointsInFrameGT[it].reserve((h / step) * (w / step));
-    cv::Mat1d depths = reader.getDepths(it);
-    cv::Mat3b frame = reader.getFrame(it);
+// Samples GT points on a regular grid of pixels, chosen so that all of the
+// frames together give about maxPoints of them. The rays through the grid are
+// unmapped once, and sampling a frame only reads its depths and colors.
+class GTPointSampler {
+public:
+  GTPointSampler(const MultiFovReader &reader, int maxPoints)
+      : reader(reader) {
+    int w = reader.cam->getWidth(), h = reader.cam->getHeight();
+    int step = std::max(
+        1, int(std::ceil(std::sqrt(double(FLAGS_count) * w * h / maxPoints))));
     for (int y = 0; y < h; y += step)
       for (int x = 0; x < w; x += step) {
-        Vec3 p = reader.cam->unmap(Vec2(x, y));
-        p.normalize();
-        double d = depths(y, x);
-        if (d > maxd)
-          continue;
-        p *= d;
-        pointsInFrameGT[it].push_back(p);
-        colors[it].push_back(frame(y, x));
+        pixels.emplace_back(x, y);
+        rays.push_back(reader.cam->unmap(Vec2(x, y)).normalized());
       }
   }
-}
+
+  void operator()(int globalFrameNum, std::vector<Vec3> &points,
+                  std::vector<cv::Vec3b> &colors) const {
+    const double maxd = 1e10;
+    cv::Mat1d depths = reader.getDepths(globalFrameNum);
+    cv::Mat3b frame = reader.getFrame(globalFrameNum);
+    points.reserve(rays.size());
+    colors.reserve(rays.size());
+    for (int i = 0; i < rays.size(); ++i) {
+      double d = depths(pixels[i]);
+      if (d > maxd)
+        continue;
+      points.push_back(d * rays[i]);
+      colors.push_back(frame(pixels[i]));
+    }
+  }
+
+private:
+  const MultiFovReader &reader;
+  std::vector<cv::Point> pixels;
+  StdVector<Vec3> rays;
+};
 
 int main(int argc, char **argv) {
   std::string usage = "Usage: " + std::string(argv[0]) + R"abacaba( data_dir
@@ -124,24 +216,43 @@ It should contain "info" and "data" subdirectories.)abacaba";
   for (const std::string &a : argsVec)
     argsOfs << a << "\n";
 
-  MultiFovReader reader(argv[1]);
+  MultiFovReader reader(argv[1], FLAGS_depth_cache_dir,
+                        getFlaggedSettings().cameraModel);
+  if (!FLAGS_static_mask.empty()) {
+    cv::Mat1b staticMask = cv::imread(FLAGS_static_mask, cv::IMREAD_GRAYSCALE);
+    CHECK(!staticMask.empty()) << "could not read " << FLAGS_static_mask;
+    reader.cam->setStaticMask(staticMask);
+  }
+  if (!FLAGS_inverse_response.empty() || !FLAGS_vignette.empty())
+    reader.cam->setPhotometricCalibration(
+        PhotometricCalibration::load(FLAGS_inverse_response, FLAGS_vignette));
+
+  PlyHolder::Format plyFormat =
+      FLAGS_binary_ply ? PlyHolder::BINARY : PlyHolder::ASCII;
+  GTPointSampler gtPointSampler(reader, FLAGS_gt_points);
 
   if (FLAGS_gen_gt_only) {
-    std::vector<std::vector<Vec3>> pointsInFrameGT(reader.getFrameCount());
-    std::vector<std::vector<cv::Vec3b>> colors(reader.getFrameCount());
-    readPointsInFrameGT(reader, pointsInFrameGT, colors, FLAGS_gt_points);
-    std::vector<Vec3> allPoints;
-    std::vector<cv::Vec3b> allColors;
-    allPoints.reserve(FLAGS_gt_points);
-    allColors.reserve(FLAGS_gt_points);
-    for (int i = 0; i < pointsInFrameGT.size(); ++i)
-      for (int j = 0; j < pointsInFrameGT[i].size(); ++j) {
-        const Vec3 &p = pointsInFrameGT[i][j];
-        allPoints.push_back(reader.getWorldToFrameGT(i).inverse() * p);
-        allColors.push_back(colors[i][j]);
-      }
-    std::ofstream pointsGTOfs("pointsGT.ply");
-    printInPly(pointsGTOfs, allPoints, allColors);
+    std::cout << "filling GT points..." << std::endl;
+    PlyHolder gtCloud("pointsGT.ply", plyFormat, FLAGS_ply_chunk_points);
+    // Frames are sampled in parallel batches and written in order, so only
+    // one batch of them is in memory at a time.
+    const int batchSize = 16;
+    for (int batchStart = FLAGS_start; batchStart < FLAGS_start + FLAGS_count;
+         batchStart += batchSize) {
+      int curBatch =
+          std::min(batchSize, FLAGS_start + FLAGS_count - batchStart);
+      std::vector<std::vector<Vec3>> points(curBatch);
+      std::vector<std::vector<cv::Vec3b>> colors(curBatch);
+      tbb::parallel_for(0, curBatch, [&](int i) {
+        int frameNum = batchStart + i;
+        gtPointSampler(frameNum, points[i], colors[i]);
+        SE3 frameToWorld = reader.getWorldToFrameGT(frameNum).inverse();
+        for (Vec3 &p : points[i])
+          p = frameToWorld * p;
+      });
+      for (int i = 0; i < curBatch; ++i)
+        gtCloud.putPoints(points[i], colors[i]);
+    }
     return 0;
   }
 
@@ -152,46 +263,151 @@ It should contain "info" and "data" subdirectories.)abacaba";
   TrackingDebugImageDrawer trackingDebugImageDrawer(
       reader.cam->camPyr(settings.pyramid.levelNum), settings.frameTracker,
       settings.pyramid);
+  std::unique_ptr<RecordStream> records;
+  if (FLAGS_record_stream)
+    records.reset(new RecordStream(
+        fileInDir(outDir, "records.bin"),
+        FLAGS_float_poses ? RecordStream::FLOAT : RecordStream::DOUBLE));
   TrajectoryWriter trajectoryWriter(outDir, "tracked_pos.txt",
-                                    "tracked_frame_to_world.txt");
+                                    "tracked_frame_to_world.txt",
+                                    records.get());
   TrajectoryWriterGT trajectoryWriterGT(reader.getAllWorldToFrameGT(), outDir,
                                         "ground_truth_pos.txt",
                                         "matrix_form_GT_pose.txt");
-  CloudWriter cloudWriter(reader.cam.get(), outDir, "points.ply");
+  CloudWriter cloudWriter(reader.cam.get(), outDir, "points.ply", plyFormat,
+                          FLAGS_ply_chunk_points, records.get());
+  std::unique_ptr<MapTileWriter> mapTileWriter;
+  if (FLAGS_map_voxel_size > 0)
+    mapTileWriter.reset(new MapTileWriter(
+        reader.cam.get(), fileInDir(outDir, "map"), FLAGS_map_voxel_size,
+        FLAGS_map_tile_voxels, FLAGS_map_levels, FLAGS_map_max_voxels,
+        FLAGS_map_flush_every, plyFormat));
+  std::unique_ptr<DepthMapWriter> depthMapWriter;
+  if (FLAGS_depth_maps == "float32" || FLAGS_depth_maps == "float16")
+    depthMapWriter.reset(new DepthMapWriter(
+        reader.cam.get(), fileInDir(outDir, "depth"),
+        FLAGS_depth_maps == "float16" ? DepthMapWriter::FLOAT16
+                                      : DepthMapWriter::FLOAT32));
+  else if (!FLAGS_depth_maps.empty())
+    LOG(WARNING) << "unknown depth map format " << FLAGS_depth_maps;
+  std::unique_ptr<TrajectoryEvaluator> trajectoryEvaluator;
+  if (!FLAGS_eval_summary.empty())
+    trajectoryEvaluator.reset(new TrajectoryEvaluator(
+        reader.getAllWorldToFrameGT(), FLAGS_rpe_delta, FLAGS_eval_summary,
+        std::string(argv[1]) + ":" + std::to_string(FLAGS_start) + "+" +
+            std::to_string(FLAGS_count)));
 
   std::unique_ptr<CloudWriterGT> cloudWriterGTPtr;
-  if (FLAGS_gen_gt) {
-    std::vector<std::vector<Vec3>> pointsInFrameGT(reader.getFrameCount());
-    std::vector<std::vector<cv::Vec3b>> colors(reader.getFrameCount());
-    readPointsInFrameGT(reader, pointsInFrameGT, colors, FLAGS_gt_points);
-    cloudWriterGTPtr.reset(new CloudWriterGT(reader.getAllWorldToFrameGT(),
-                                             pointsInFrameGT, colors, outDir,
-                                             "pointsGT.ply"));
-  }
+  if (FLAGS_gen_gt)
+    cloudWriterGTPtr.reset(new CloudWriterGT(
+        reader.getAllWorldToFrameGT(), gtPointSampler, outDir, "pointsGT.ply",
+        plyFormat, FLAGS_ply_chunk_points));
+
+  InterpolationDrawer interpolationDrawer(reader.cam.get(),
+                                          settings.depthColors);
 
-  InterpolationDrawer interpolationDrawer(reader.cam.get());
+  DepthPyramidDrawer depthPyramidDrawer(settings.depthColors);
 
-  DepthPyramidDrawer depthPyramidDrawer;
+  std::unique_ptr<ProfileWriter> profileWriter;
+  if (FLAGS_profile_format == "csv")
+    profileWriter.reset(
+        new ProfileWriter(outDir, "profile.csv", ProfileWriter::CSV));
+  else if (FLAGS_profile_format == "json")
+    profileWriter.reset(
+        new ProfileWriter(outDir, "profile.json", ProfileWriter::JSON));
+  else if (!FLAGS_profile_format.empty())
+    LOG(WARNING) << "unknown profile format " << FLAGS_profile_format;
+
+  // Trajectories must be written in full, while a drawer only needs the
+  // latest state, so the drawers drop old callbacks instead of waiting.
+  std::vector<std::unique_ptr<AsyncDsoObserver>> asyncDsoObservers;
+  std::vector<std::unique_ptr<AsyncFrameTrackerObserver>> asyncTrackerObservers;
+  auto dsoObserver = [&](DsoSnapshotObserver *obs,
+                         AsyncObserverAdapter::DropPolicy dropPolicy =
+                             AsyncObserverAdapter::BLOCK) -> DsoObserver * {
+    if (!FLAGS_async_output)
+      return obs;
+    asyncDsoObservers.emplace_back(
+        new AsyncDsoObserver(obs, FLAGS_async_output_queue, dropPolicy));
+    return asyncDsoObservers.back().get();
+  };
+  auto trackerObserver =
+      [&](FrameTrackerObserver *obs) -> FrameTrackerObserver * {
+    if (!FLAGS_async_output)
+      return obs;
+    asyncTrackerObservers.emplace_back(new AsyncFrameTrackerObserver(
+        obs, FLAGS_async_output_queue, AsyncObserverAdapter::DROP_OLDEST));
+    return asyncTrackerObservers.back().get();
+  };
+  auto flushTrackerObservers = [&]() {
+    for (const auto &obs : asyncTrackerObservers)
+      obs->flush();
+  };
 
   Observers observers;
-  if (FLAGS_write_files || FLAGS_show_debug_image)
-    observers.dso.push_back(&debugImageDrawer);
-  observers.dso.push_back(&trajectoryWriter);
-  observers.dso.push_back(&trajectoryWriterGT);
-  observers.dso.push_back(&cloudWriter);
+  AsyncObserverAdapter *asyncDebugImageDrawer = nullptr;
+  if (FLAGS_write_files || FLAGS_show_debug_image) {
+    observers.dso.push_back(
+        dsoObserver(&debugImageDrawer, AsyncObserverAdapter::DROP_OLDEST));
+    if (FLAGS_async_output)
+      asyncDebugImageDrawer = asyncDsoObservers.back().get();
+  }
+  observers.dso.push_back(dsoObserver(&trajectoryWriter));
+  observers.dso.push_back(dsoObserver(&trajectoryWriterGT));
+  observers.dso.push_back(dsoObserver(&cloudWriter));
+  if (mapTileWriter)
+    observers.dso.push_back(mapTileWriter.get());
+  if (depthMapWriter)
+    observers.dso.push_back(depthMapWriter.get());
+  if (trajectoryEvaluator)
+    observers.dso.push_back(dsoObserver(trajectoryEvaluator.get()));
   if (FLAGS_write_files && FLAGS_draw_depth_pyramid)
-    observers.frameTracker.push_back(&depthPyramidDrawer);
+    observers.frameTracker.push_back(trackerObserver(&depthPyramidDrawer));
   if (cloudWriterGTPtr)
     observers.dso.push_back(cloudWriterGTPtr.get());
   if (FLAGS_write_files || FLAGS_show_track_res)
-    observers.frameTracker.push_back(&trackingDebugImageDrawer);
+    observers.frameTracker.push_back(
+        trackerObserver(&trackingDebugImageDrawer));
   observers.initializer.push_back(&interpolationDrawer);
+  if (profileWriter)
+    observers.profiling.push_back(profileWriter.get());
 
   std::cout << "running DSO.." << std::endl;
+  FrameEmbedding frameEmbedding = NO_FRAMES;
+  if (FLAGS_embed_frames == "raw")
+    frameEmbedding = RAW_FRAMES;
+  else if (FLAGS_embed_frames == "png")
+    frameEmbedding = PNG_FRAMES;
+  else
+    CHECK_EQ(FLAGS_embed_frames, "none") << "unknown frame embedding";
+
+  if (FLAGS_trace_timeline)
+    Profiler::startTrace(FLAGS_trace_events_per_thread);
+
   DsoSystem dso(reader.cam.get(), observers, settings);
-  for (int it = FLAGS_start; it < FLAGS_start + FLAGS_count; ++it) {
+  if (FLAGS_checkpoint)
+    dso.enableCheckpoints(outDir / "checkpoint",
+                          FLAGS_text_snapshot ? TEXT : BINARY,
+                          FLAGS_checkpoint_sync_every, frameEmbedding);
+  PrefetchingReader prefetcher(reader, FLAGS_start, FLAGS_count,
+                               FLAGS_read_ahead, FLAGS_reader_threads, false,
+                               true);
+  FrameSource &frameSource = prefetcher;
+  SourceFrame next;
+  while (frameSource.next(next)) {
+    int it = next.globalFrameNum;
     std::cout << "add frame #" << it << std::endl;
-    dso.addFrame(reader.getFrame(it), it);
+    dso.addFrame(next);
+
+    // The debug drawer gets the window from the mapping thread, or from its
+    // worker when it is asynchronous.
+    if (asyncDebugImageDrawer)
+      asyncDebugImageDrawer->flush();
+    else if (settings.threading.asyncMapping &&
+             (FLAGS_write_files || FLAGS_show_debug_image))
+      dso.waitForMapping();
+    if (FLAGS_write_files || FLAGS_show_track_res)
+      flushTrackerObservers();
 
     if (interpolationDrawer.didInitialize()) {
       cv::Mat3b interpolation = interpolationDrawer.draw();
@@ -224,7 +440,13 @@ It should contain "info" and "data" subdirectories.)abacaba";
       cv::waitKey(1);
   }
 
-  dso.saveSnapshot(outDir / "snapshot");
+  dso.saveSnapshot(outDir / "snapshot", FLAGS_text_snapshot ? TEXT : BINARY,
+                   frameEmbedding);
+
+  if (FLAGS_trace_timeline) {
+    Profiler::stopTrace();
+    Profiler::writeTrace(fileInDir(outDir, "trace.json"));
+  }
 
   return 0;
 }
@@ -0,0 +1,95 @@
+#include "../reader/MultiFovReader.h"
+#include "../reader/PrefetchingReader.h"
+#include "system/MapLocalizer.h"
+#include "util/flags.h"
+#include "util/util.h"
+#include <chrono>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <iostream>
+
+DEFINE_int32(start, 1, "Number of the starting frame.");
+DEFINE_int32(count, 300, "Number of frames to localize.");
+DEFINE_int32(reader_threads, 4, "Number of threads decoding the frames.");
+DEFINE_string(output_directory, "output/localize",
+              "Where the localized trajectory is written to.");
+
+using namespace fishdso;
+
+typedef std::chrono::steady_clock Clock;
+
+int main(int argc, char **argv) {
+  std::string usage = "Usage: " + std::string(argv[0]) + R"abacaba( data_dir snapshot_dir
+Where data_dir names a directory with MultiFoV fishseye dataset and
+snapshot_dir a map saved by DsoSystem::saveSnapshot, e.g. the snapshot
+directory written by genply. Localizes frames [start, start + count) in the
+map without extending it and reports the frames per second and the frames
+that could not be localized. The poses are written into
+localized_frame_to_world.txt in the output directory, as 3x4 matrices, and
+into localized_pos.txt with their frame numbers. Frames are decoded into
+memory beforehand, so the disk does not take part in the measurements.)abacaba";
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  gflags::SetUsageMessage(usage);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc != 3) {
+    std::cerr << "Wrong number of arguments!\n" << usage << std::endl;
+    return 1;
+  }
+
+  Settings settings = getFlaggedSettings();
+  MultiFovReader reader(argv[1], "", settings.cameraModel);
+  if (!FLAGS_static_mask.empty()) {
+    cv::Mat1b staticMask = cv::imread(FLAGS_static_mask, cv::IMREAD_GRAYSCALE);
+    CHECK(!staticMask.empty()) << "could not read " << FLAGS_static_mask;
+    reader.cam->setStaticMask(staticMask);
+  }
+  if (!FLAGS_inverse_response.empty() || !FLAGS_vignette.empty())
+    reader.cam->setPhotometricCalibration(
+        PhotometricCalibration::load(FLAGS_inverse_response, FLAGS_vignette));
+
+  SnapshotLoader snapshotLoader(&reader, reader.cam.get(), argv[2], settings);
+  MapLocalizer localizer(snapshotLoader, settings);
+  std::cout << "loaded a map of " << localizer.keyFrameNum() << " keyframes"
+            << std::endl;
+
+  std::cout << "decoding frames.." << std::endl;
+  std::vector<SourceFrame> frames;
+  frames.reserve(FLAGS_count);
+  PrefetchingReader prefetcher(reader, FLAGS_start, FLAGS_count,
+                               2 * FLAGS_reader_threads, FLAGS_reader_threads,
+                               false, true);
+  while (prefetcher.hasNext()) {
+    PrefetchingReader::Frame frame = prefetcher.next();
+    frames.push_back({frame.frame, {}, frame.globalFrameNum});
+  }
+
+  fs::create_directories(FLAGS_output_directory);
+  std::ofstream posesOfs(
+      fileInDir(FLAGS_output_directory, "localized_pos.txt"));
+  std::ofstream matrixFormOfs(
+      fileInDir(FLAGS_output_directory, "localized_frame_to_world.txt"));
+
+  int lost = 0;
+  double seconds = 0;
+  for (const SourceFrame &frame : frames) {
+    Clock::time_point start = Clock::now();
+    std::optional<SE3> worldToFrame = localizer.localize(frame);
+    seconds += std::chrono::duration<double>(Clock::now() - start).count();
+    if (!worldToFrame) {
+      lost++;
+      continue;
+    }
+    putInMatrixForm(matrixFormOfs, worldToFrame->inverse());
+    matrixFormOfs << '\n';
+    posesOfs << frame.globalFrameNum << ' ';
+    putMotion(posesOfs, *worldToFrame);
+    posesOfs << '\n';
+  }
+
+  std::cout << frames.size() << " frames, " << lost << " not localized, "
+            << frames.size() / seconds << " fps" << std::endl;
+  return 0;
+}
@@ -1,10 +1,24 @@
 #include "MultiFovReader.h"
 #include "util/types.h"
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
-MultiFovReader::MultiFovReader(const std::string &newMultiFovDir)
-    : datasetDir(newMultiFovDir) {
+MultiFovReader::MultiFovReader(const std::string &newMultiFovDir,
+                               const std::string &depthCacheDir,
+                               const Settings::CameraModel &camSettings)
+    : datasetDir(newMultiFovDir)
+    , depthCacheDir(depthCacheDir) {
   if (datasetDir.back() == '/')
     datasetDir = datasetDir.substr(0, datasetDir.size() - 1);
+  if (!depthCacheDir.empty())
+    std::filesystem::create_directories(depthCacheDir);
 
   // Our CameraModel is partially compatible with the provided one (affine
   // transformation used in omni_cam is just scaling in our case, but no problem
@@ -26,8 +40,9 @@ MultiFovReader::MultiFovReader(const std::string &newMultiFovDir)
   if (camIfsLine.size() < 3)
     throw std::runtime_error("inappropriate intrinsics format");
   if (camIfsLine.substr(0, 3) == "K =") {
-    cam = std::unique_ptr<CameraModel>(new CameraModel(
-        defaultWidth, defaultHeight, pinholeF, pinholeCx, pinholeCy));
+    cam = std::unique_ptr<CameraModel>(
+        new CameraModel(defaultWidth, defaultHeight, pinholeF, pinholeCx,
+                        pinholeCy, camSettings));
   } else {
     std::stringstream strIfs(camIfsLine);
     int width, height;
@@ -42,7 +57,8 @@ MultiFovReader::MultiFovReader(const std::string &newMultiFovDir)
     ourCoeffs *= -1;
     strIfs >> center[0] >> center[1];
     cam = std::unique_ptr<CameraModel>(
-        new CameraModel(width, height, 1.0, center, ourCoeffs));
+        new CameraModel(width, height, 1.0, center, ourCoeffs, camSettings,
+                        camFName));
   }
 
   char posesFName[256];
@@ -63,10 +79,18 @@ MultiFovReader::MultiFovReader(const std::string &newMultiFovDir)
 }
 
 cv::Mat MultiFovReader::getFrame(int globalFrameNum) const {
+  return readFrame(globalFrameNum, cv::IMREAD_COLOR);
+}
+
+cv::Mat1b MultiFovReader::getFrameGray(int globalFrameNum) const {
+  return readFrame(globalFrameNum, cv::IMREAD_GRAYSCALE);
+}
+
+cv::Mat MultiFovReader::readFrame(int globalFrameNum, int imreadFlags) const {
   char frameFName[256];
   sprintf(frameFName, "%s/data/img/img%04i_0.png", datasetDir.c_str(),
           globalFrameNum);
-  cv::Mat result = cv::imread(frameFName);
+  cv::Mat result = cv::imread(frameFName, imreadFlags);
   if (result.data == NULL)
     throw std::runtime_error("couldn't read frame from \"" +
                              std::string(frameFName) + "\"");
@@ -77,14 +101,62 @@ cv::Mat1d MultiFovReader::getDepths(int globalFrameNum) const {
   char depthsFName[256];
   sprintf(depthsFName, "%s/data/depth/img%04i_0.depth", datasetDir.c_str(),
           globalFrameNum);
+  if (depthCacheDir.empty())
+    return readTextDepths(depthsFName);
+
+  char cacheFName[256];
+  sprintf(cacheFName, "%s/img%04i_0.depthbin", depthCacheDir.c_str(),
+          globalFrameNum);
+  cv::Mat1d depths(cam->getHeight(), cam->getWidth());
+  size_t size = depths.total() * sizeof(double);
+  int fd = open(cacheFName, O_RDONLY);
+  if (fd >= 0) {
+    struct stat fileStat;
+    bool sizeOk = fstat(fd, &fileStat) == 0 && size_t(fileStat.st_size) == size;
+    void *mapped =
+        sizeOk ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (mapped && mapped != MAP_FAILED) {
+      std::memcpy(depths.data, mapped, size);
+      munmap(mapped, size);
+      return depths;
+    }
+  }
+
+  depths = readTextDepths(depthsFName);
+  // written under a temporary name so that concurrent readers never see a
+  // partial file
+  std::string tmpFName = std::string(cacheFName) + ".tmp" +
+                         std::to_string(std::hash<std::thread::id>()(
+                             std::this_thread::get_id()));
+  {
+    std::ofstream cacheOfs(tmpFName, std::ios_base::binary);
+    cacheOfs.write(reinterpret_cast<const char *>(depths.data), size);
+  }
+  std::filesystem::rename(tmpFName, cacheFName);
+  return depths;
+}
+
+cv::Mat1d MultiFovReader::readTextDepths(const std::string &depthsFName) const {
   std::ifstream depthsIfs(depthsFName);
   if (!depthsIfs.is_open())
-    throw std::runtime_error("could not open depths file \"" +
-                             std::string(depthsFName) + "\"");
+    throw std::runtime_error("could not open depths file \"" + depthsFName +
+                             "\"");
+  std::string contents((std::istreambuf_iterator<char>(depthsIfs)),
+                       std::istreambuf_iterator<char>());
+
+  // strtod over the whole buffer is much faster than stream extraction
   cv::Mat1d depths(cam->getHeight(), cam->getWidth());
+  const char *ptr = contents.c_str();
   for (int y = 0; y < depths.rows; ++y)
-    for (int x = 0; x < depths.cols; ++x)
-      depthsIfs >> depths(y, x);
+    for (int x = 0; x < depths.cols; ++x) {
+      char *end;
+      depths(y, x) = std::strtod(ptr, &end);
+      if (end == ptr)
+        throw std::runtime_error("not enough depths in \"" + depthsFName +
+                                 "\"");
+      ptr = end;
+    }
 
   return depths;
 }
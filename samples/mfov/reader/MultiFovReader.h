@@ -10,9 +10,16 @@ using namespace fishdso;
 
 class MultiFovReader {
 public:
-  MultiFovReader(const std::string &newDatasetDir);
+  // If depthCacheDir is not empty, depth maps are converted into raw binary
+  // files there on the first read and mapped from them afterwards.
+  MultiFovReader(const std::string &newDatasetDir,
+                 const std::string &depthCacheDir = "",
+                 const Settings::CameraModel &camSettings = {});
 
+  // Both are safe to call concurrently.
   cv::Mat getFrame(int globalFrameNum) const;
+  // decoded into grayscale right away, without a BGR image in between
+  cv::Mat1b getFrameGray(int globalFrameNum) const;
   cv::Mat1d getDepths(int globalFrameNum) const;
   SE3 getWorldToFrameGT(int globalFrameNum) const;
   const StdVector<SE3> &getAllWorldToFrameGT() const;
@@ -25,7 +32,11 @@ private:
   static constexpr double pinholeCx = 320, pinholeCy = 240;
   static constexpr double pinholeF = 329.115520046;
 
+  cv::Mat readFrame(int globalFrameNum, int imreadFlags) const;
+  cv::Mat1d readTextDepths(const std::string &depthsFName) const;
+
   std::string datasetDir;
+  std::string depthCacheDir;
   StdVector<SE3> worldToFrameGT;
 };
 
@@ -0,0 +1,108 @@
+#include "PrefetchingReader.h"
+#include "util/util.h"
+#include <algorithm>
+#include <stdexcept>
+
+PrefetchingReader::PrefetchingReader(const MultiFovReader &reader,
+                                     int firstFrame, int frameCount,
+                                     int readAhead, int numThreads,
+                                     bool withDepths, bool grayscale)
+    : reader(reader)
+    , endFrame(firstFrame + frameCount)
+    , readAhead(std::max(readAhead, 1))
+    , withDepths(withDepths)
+    , grayscale(grayscale)
+    , nextToDecode(firstFrame)
+    , nextToTake(firstFrame)
+    , doStop(false) {
+  numThreads = std::max(numThreads, 1);
+  threads.reserve(numThreads);
+  for (int i = 0; i < numThreads; ++i)
+    threads.emplace_back(&PrefetchingReader::decodeLoop, this);
+}
+
+PrefetchingReader::~PrefetchingReader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    doStop = true;
+  }
+  slotFree.notify_all();
+  for (std::thread &thread : threads)
+    thread.join();
+}
+
+bool PrefetchingReader::hasNext() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return nextToTake < endFrame;
+}
+
+PrefetchingReader::Frame PrefetchingReader::next() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (nextToTake >= endFrame)
+    throw std::out_of_range("no frames left in the prefetching reader");
+  frameReady.wait(lock, [this]() { return decoded.count(nextToTake) > 0; });
+  auto it = decoded.find(nextToTake);
+  Slot slot = std::move(it->second);
+  decoded.erase(it);
+  ++nextToTake;
+  lock.unlock();
+  // a slot for one more frame is free now
+  slotFree.notify_all();
+
+  if (slot.error)
+    std::rethrow_exception(slot.error);
+  return std::move(slot.frame);
+}
+
+bool PrefetchingReader::next(SourceFrame &frame) {
+  if (!hasNext())
+    return false;
+  Frame decodedFrame = next();
+  frame.globalFrameNum = decodedFrame.globalFrameNum;
+  if (grayscale) {
+    frame.gray = decodedFrame.frame;
+    const MultiFovReader &frameReader = reader;
+    int globalFrameNum = decodedFrame.globalFrameNum;
+    frame.colorProvider = [&frameReader, globalFrameNum]() {
+      return cv::Mat3b(frameReader.getFrame(globalFrameNum));
+    };
+  } else {
+    cv::Mat colored = decodedFrame.frame;
+    frame.gray = cvtBgrToGray(colored);
+    frame.colorProvider = [colored]() { return cv::Mat3b(colored); };
+  }
+  return true;
+}
+
+void PrefetchingReader::decodeLoop() {
+  while (true) {
+    int frameNum;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      slotFree.wait(lock, [this]() {
+        return doStop || nextToDecode >= endFrame ||
+               nextToDecode < nextToTake + readAhead;
+      });
+      if (doStop || nextToDecode >= endFrame)
+        return;
+      frameNum = nextToDecode++;
+    }
+
+    Slot slot;
+    slot.frame.globalFrameNum = frameNum;
+    try {
+      slot.frame.frame = grayscale ? cv::Mat(reader.getFrameGray(frameNum))
+                                   : reader.getFrame(frameNum);
+      if (withDepths)
+        slot.frame.depths = reader.getDepths(frameNum);
+    } catch (...) {
+      slot.error = std::current_exception();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      decoded[frameNum] = std::move(slot);
+    }
+    frameReady.notify_all();
+  }
+}
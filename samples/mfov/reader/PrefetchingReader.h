@@ -0,0 +1,64 @@
+#ifndef INCLUDE_PREFETCHINGREADER
+#define INCLUDE_PREFETCHINGREADER
+
+#include "MultiFovReader.h"
+#include "system/FrameSource.h"
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Reads frames [firstFrame, firstFrame + frameCount) of a MultiFovReader in
+// the background. Up to readAhead frames past the one last taken are decoded
+// by numThreads threads in parallel, so that next() usually does not wait for
+// the disk or the PNG decoder. With grayscale set frames are decoded right
+// into gray, and as a FrameSource the reader then decodes the colour image
+// again only if it is asked for, so the reader must outlive the frames.
+class PrefetchingReader : public FrameSource {
+public:
+  struct Frame {
+    int globalFrameNum;
+    cv::Mat frame;    // single-channel if grayscale is set
+    cv::Mat1d depths; // empty unless withDepths is set
+  };
+
+  PrefetchingReader(const MultiFovReader &reader, int firstFrame,
+                    int frameCount, int readAhead = 8, int numThreads = 2,
+                    bool withDepths = false, bool grayscale = false);
+  ~PrefetchingReader();
+
+  bool hasNext() const;
+  // Blocks until the next frame in order is decoded. Rethrows the exception
+  // the decoding of that frame ended with, if any.
+  Frame next();
+  bool next(SourceFrame &frame) override;
+
+private:
+  struct Slot {
+    Frame frame;
+    std::exception_ptr error;
+  };
+
+  void decodeLoop();
+
+  const MultiFovReader &reader;
+  int endFrame;
+  int readAhead;
+  bool withDepths;
+  bool grayscale;
+
+  // the next frame to be decoded and the next one to be given out
+  int nextToDecode;
+  int nextToTake;
+  std::map<int, Slot> decoded;
+  bool doStop;
+  mutable std::mutex mutex;
+  // the consumer waits on frameReady, the decoding threads on slotFree
+  std::condition_variable frameReady;
+  std::condition_variable slotFree;
+  std::vector<std::thread> threads;
+};
+
+#endif
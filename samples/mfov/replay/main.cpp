@@ -0,0 +1,129 @@
+#include "../reader/MultiFovReader.h"
+#include "../reader/PrefetchingReader.h"
+#include "system/DsoSystem.h"
+#include "system/FrameReplayer.h"
+#include "util/flags.h"
+#include "util/util.h"
+#include <algorithm>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+
+DEFINE_int32(start, 1, "Number of the starting frame.");
+DEFINE_int32(count, 300, "Number of frames to replay.");
+DEFINE_double(fps, 30,
+              "Rate at which the frames are released. The dataset has no "
+              "timestamps, so they are spaced evenly.");
+DEFINE_int32(queue_capacity, 2,
+             "Frames that can wait to be added, like the buffers of a camera "
+             "driver. A frame released into the full queue is dropped.");
+DEFINE_int32(reader_threads, 4, "Number of threads decoding the frames.");
+DEFINE_string(json, "",
+              "If set, the results are written to this file as JSON.");
+
+using namespace fishdso;
+
+int main(int argc, char **argv) {
+  std::string usage = "Usage: " + std::string(argv[0]) + R"abacaba( data_dir
+Where data_dir names a directory with MultiFoV fishseye dataset.
+Replays frames [start, start + count) through DsoSystem as a live camera
+would deliver them, at fps frames per second, and reports the latency from
+the release of a frame to its pose, the depth of the queue, the frames
+dropped by the queue and skipped by the load shedding (see --real_time) and
+the frames tracked after the next one was released. Frames are decoded into
+memory beforehand, so the disk does not take part in the measurements.)abacaba";
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  gflags::SetUsageMessage(usage);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc != 2) {
+    std::cerr << "Wrong number of arguments!\n" << usage << std::endl;
+    return 1;
+  }
+  if (FLAGS_fps <= 0) {
+    std::cerr << "fps should be positive" << std::endl;
+    return 1;
+  }
+
+  Settings settings = getFlaggedSettings();
+  MultiFovReader reader(argv[1], "", settings.cameraModel);
+  if (!FLAGS_static_mask.empty()) {
+    cv::Mat1b staticMask = cv::imread(FLAGS_static_mask, cv::IMREAD_GRAYSCALE);
+    CHECK(!staticMask.empty()) << "could not read " << FLAGS_static_mask;
+    reader.cam->setStaticMask(staticMask);
+  }
+  if (!FLAGS_inverse_response.empty() || !FLAGS_vignette.empty())
+    reader.cam->setPhotometricCalibration(
+        PhotometricCalibration::load(FLAGS_inverse_response, FLAGS_vignette));
+
+  std::cout << "decoding frames.." << std::endl;
+  std::vector<SourceFrame> frames;
+  frames.reserve(FLAGS_count);
+  PrefetchingReader prefetcher(reader, FLAGS_start, FLAGS_count,
+                               2 * FLAGS_reader_threads, FLAGS_reader_threads,
+                               false, true);
+  while (prefetcher.hasNext()) {
+    PrefetchingReader::Frame frame = prefetcher.next();
+    frames.push_back({frame.frame, {}, frame.globalFrameNum});
+  }
+
+  FrameReplayer replayer(std::move(frames), FLAGS_fps, 1,
+                         FLAGS_queue_capacity);
+  FrameReplayer::Stats stats;
+  {
+    DsoSystem dso(reader.cam.get(), {}, settings);
+    stats = replayer.run(dso);
+  }
+
+  std::vector<double> latencies = stats.latencies;
+  std::sort(latencies.begin(), latencies.end());
+  double meanDepth =
+      stats.queueDepths.empty()
+          ? 0
+          : std::accumulate(stats.queueDepths.begin(),
+                            stats.queueDepths.end(), 0.0) /
+                stats.queueDepths.size();
+  int maxDepth = stats.queueDepths.empty()
+                     ? 0
+                     : *std::max_element(stats.queueDepths.begin(),
+                                         stats.queueDepths.end());
+
+  std::cout << stats.released << " frames released at " << FLAGS_fps
+            << " fps: " << stats.dropped << " dropped, " << stats.skipped
+            << " skipped, " << latencies.size() << " tracked, "
+            << stats.deadlineMisses << " after the deadline\n"
+            << "latency ms: p50 " << 1e3 * percentile(latencies, 50)
+            << ", p95 " << 1e3 * percentile(latencies, 95) << ", p99 "
+            << 1e3 * percentile(latencies, 99) << ", max "
+            << 1e3 * percentile(latencies, 100) << "\n"
+            << "queue depth: mean " << meanDepth << ", max " << maxDepth
+            << std::endl;
+
+  if (!FLAGS_json.empty()) {
+    std::ofstream out(FLAGS_json);
+    out << std::setprecision(6);
+    out << "{\n  \"fps\": " << FLAGS_fps << ",\n";
+    out << "  \"queue_capacity\": " << FLAGS_queue_capacity << ",\n";
+    out << "  \"async_mapping\": "
+        << (settings.threading.asyncMapping ? "true" : "false") << ",\n";
+    out << "  \"load_shedding\": "
+        << (settings.loadShedding.enabled ? "true" : "false") << ",\n";
+    out << "  \"released\": " << stats.released << ",\n";
+    out << "  \"dropped\": " << stats.dropped << ",\n";
+    out << "  \"skipped\": " << stats.skipped << ",\n";
+    out << "  \"tracked\": " << latencies.size() << ",\n";
+    out << "  \"deadline_misses\": " << stats.deadlineMisses << ",\n";
+    out << "  \"latency_ms\": {\"p50\": " << 1e3 * percentile(latencies, 50)
+        << ", \"p95\": " << 1e3 * percentile(latencies, 95)
+        << ", \"p99\": " << 1e3 * percentile(latencies, 99)
+        << ", \"max\": " << 1e3 * percentile(latencies, 100) << "},\n";
+    out << "  \"queue_depth\": {\"mean\": " << meanDepth
+        << ", \"max\": " << maxDepth << "}\n}" << std::endl;
+  }
+
+  return 0;
+}
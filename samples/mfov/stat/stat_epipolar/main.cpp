@@ -6,11 +6,14 @@
 #include "util/flags.h"
 #include "util/geometry.h"
 #include "util/settings.h"
-#include <atomic>
 #include <ceres/solver.h>
+#include <cstdint>
+#include <fstream>
 #include <gflags/gflags.h>
+#include <glog/logging.h>
 #include <iostream>
-#include <tbb/blocked_range.h>
+#include <random>
+#include <sstream>
 #include <tbb/parallel_for.h>
 
 using namespace fishdso;
@@ -20,23 +23,6 @@ const int totalFrames = 2500;
 DEFINE_bool(show_epipolar, false,
             "Do we need to show epipolar curves searched?");
 
-KeyFrame kfFromEpipolar(CameraModel *cam, const cv::Mat &baseFrame,
-                        const cv::Mat &frameToTraceOn, const SE3 &firstToSecond,
-                        PixelSelector &pixelSelector,
-                        const Settings &settings) {
-  KeyFrame result(cam, baseFrame, 0, pixelSelector, settings.keyFrame,
-                  settings.getPointTracerSettings());
-  PreKeyFrame toTraceOn(&result, cam, frameToTraceOn, 1, settings.pyramid);
-  toTraceOn.baseToThis = firstToSecond;
-
-  auto deb = FLAGS_show_epipolar ? ImmaturePoint::DRAW_EPIPOLE
-                                 : ImmaturePoint::NO_DEBUG;
-  for (const auto &ip : result.immaturePoints)
-    ip->traceOn(result, toTraceOn, deb);
-
-  return result;
-}
-
 DEFINE_int32(start_frame, 2, "First baseframe used.");
 DEFINE_int32(end_frame, 2450, "Last baseframe used.");
 DEFINE_int32(disparity_shift, 3,
@@ -54,6 +40,17 @@ DEFINE_bool(show_all, false,
             "traced points on it)?");
 
 DEFINE_bool(run_parallel, true, "Collect all in parallel?");
+DEFINE_int32(shard_size, 50,
+             "Number of base frames whose errors go into one shard file.");
+DEFINE_string(shard_dir, "disp_err_shards",
+              "Directory for the shard files, with a subdirectory for every "
+              "config. Shards that are already there are not recomputed, so "
+              "an interrupted run resumes where it stopped.");
+DEFINE_string(sweep, "",
+              "File with a config per line, a name followed by flag=value "
+              "overrides of the tracer settings. Every shard of frames is "
+              "loaded once and traced with all of the configs. The pyramid "
+              "settings come from the command line.");
 
 const int lastFrameNumGlobal = 2500;
 
@@ -76,129 +73,276 @@ struct EpiErr {
   }
 };
 
-class CollectDisparities {
-private:
-  int *startFrames;
-  const MultiFovReader *reader;
-  std::vector<EpiErr> *errors;
-  Settings settings;
-
-public:
-  CollectDisparities(const MultiFovReader *reader, int *startFrames,
-                     std::vector<EpiErr> *errors, const Settings &settings)
-      : startFrames(startFrames)
-      , reader(reader)
-      , errors(errors)
-      , settings(settings) {}
-
-  void operator()(const tbb::blocked_range<int> &range) const {
-    PixelSelector pixelSelector;
-    std::mt19937 mt;
-
-    for (int ind = range.begin(); ind < range.end(); ++ind) {
-      int firstFrameNum = startFrames[ind];
-      int secondFrameNum = firstFrameNum + FLAGS_disparity_shift;
-      SE3 firstToSecondGT = reader->getWorldToFrameGT(secondFrameNum) *
-                            reader->getWorldToFrameGT(firstFrameNum).inverse();
-      SE3 firstToSecond;
-      if (FLAGS_precise_placement)
-        firstToSecond = firstToSecondGT;
-      else {
-        double dispDev = FLAGS_disparity_trans_error *
-                         firstToSecondGT.translation().norm() / std::sqrt(3);
-        double rotDev = M_PI / 180.0 * FLAGS_disparity_rot_error *
-                        firstToSecondGT.translation().norm() / std::sqrt(3);
-
-        std::normal_distribution<double> rotd(0, rotDev);
-        std::normal_distribution<double> transd(0, dispDev);
-
-        SO3 rot = SO3::exp(Vec3(rotd(mt), rotd(mt), rotd(mt))) *
-                  firstToSecondGT.so3();
-        Vec3 trans = firstToSecondGT.translation();
-        for (int i = 0; i < 3; ++i)
-          trans[i] += transd(mt);
-        firstToSecond = SE3(rot, trans);
-      }
-
-      KeyFrame keyFrame =
-          kfFromEpipolar(reader->cam.get(), reader->getFrame(firstFrameNum),
-                         reader->getFrame(secondFrameNum), firstToSecond,
-                         pixelSelector, settings);
-
-      if (FLAGS_show_all) {
-        std::vector<double> depths;
-        for (const auto &ip : keyFrame.immaturePoints)
-          if (ip->state == ImmaturePoint::ACTIVE && ip->maxDepth != INF)
-            depths.push_back(ip->depth);
-        setDepthColBounds(depths);
-        cv::imshow("traced points",
-                   keyFrame.drawDepthedFrame(minDepthCol, maxDepthCol));
-        cv::waitKey();
-      }
-
-      cv::Mat1d dGT = reader->getDepths(firstFrameNum);
-      for (const auto &ip : keyFrame.immaturePoints) {
-        if (ip->state != ImmaturePoint::ACTIVE || ip->maxDepth == INF)
-          continue;
-        double depthGT = dGT(toCvPoint(ip->p));
-        Vec2 reprojGT = reader->cam->map(
-            firstToSecondGT *
-            (depthGT * reader->cam->unmap(ip->p).normalized()));
-        Vec2 reproj = reader->cam->map(
-            firstToSecond *
-            (ip->depth * reader->cam->unmap(ip->p).normalized()));
-        Vec2 reprojBef = reader->cam->map(
-            firstToSecond *
-            (ip->depthBeforeSubpixel * reader->cam->unmap(ip->p).normalized()));
-
-        Vec2 reprojInfD = reader->cam->map(
-            firstToSecond.so3() * reader->cam->unmap(ip->p).normalized());
-        EpiErr e;
-        e.disparity = (reproj - reprojInfD).norm();
-        e.expectedErr = std::sqrt(ip->lastFullVar);
-        e.realErrBef = (reprojGT - reprojBef).norm();
-        e.realErr = (reprojGT - reproj).norm();
-        e.depthGT = depthGT;
-        e.depth = ip->depth;
-        e.depthBeforeSubpixel = ip->depthBeforeSubpixel;
-        e.eBeforeSubpixel = ip->eBeforeSubpixel;
-        e.eAfterSubpixel = ip->eAfterSubpixel;
-        errors[ind].push_back(e);
-      }
-    }
+// A base frame with the one traced on, loaded once per shard and kept
+// for all of the sweep configurations.
+struct FramePair {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  int firstFrameNum;
+  std::shared_ptr<PreKeyFrame> base;
+  std::unique_ptr<PreKeyFrame> toTraceOn;
+  cv::Mat1d depthsGT;
+  SE3 firstToSecondGT;
+  SE3 firstToSecond;
+};
+
+// The noise on the relative pose is seeded by the frame number, so that the
+// results do not depend on the sharding or on the order of the frames.
+std::unique_ptr<FramePair> loadPair(const MultiFovReader &reader,
+                                    int firstFrameNum,
+                                    const Settings &settings) {
+  std::unique_ptr<FramePair> pair(new FramePair);
+  int secondFrameNum = firstFrameNum + FLAGS_disparity_shift;
+  CameraModel *cam = reader.cam.get();
+  pair->firstFrameNum = firstFrameNum;
+  pair->base.reset(new PreKeyFrame(nullptr, cam, reader.getFrame(firstFrameNum),
+                                   firstFrameNum, settings.pyramid));
+  pair->toTraceOn.reset(new PreKeyFrame(nullptr, cam,
+                                        reader.getFrame(secondFrameNum),
+                                        secondFrameNum, settings.pyramid));
+  pair->depthsGT = reader.getDepths(firstFrameNum);
+  pair->firstToSecondGT = reader.getWorldToFrameGT(secondFrameNum) *
+                          reader.getWorldToFrameGT(firstFrameNum).inverse();
+
+  const SE3 &firstToSecondGT = pair->firstToSecondGT;
+  if (FLAGS_precise_placement) {
+    pair->firstToSecond = firstToSecondGT;
+    return pair;
+  }
+  std::mt19937 mt(firstFrameNum);
+  double dispDev = FLAGS_disparity_trans_error *
+                   firstToSecondGT.translation().norm() / std::sqrt(3);
+  double rotDev = M_PI / 180.0 * FLAGS_disparity_rot_error *
+                  firstToSecondGT.translation().norm() / std::sqrt(3);
+
+  std::normal_distribution<double> rotd(0, rotDev);
+  std::normal_distribution<double> transd(0, dispDev);
+
+  SO3 rot =
+      SO3::exp(Vec3(rotd(mt), rotd(mt), rotd(mt))) * firstToSecondGT.so3();
+  Vec3 trans = firstToSecondGT.translation();
+  for (int i = 0; i < 3; ++i)
+    trans[i] += transd(mt);
+  pair->firstToSecond = SE3(rot, trans);
+  return pair;
+}
+
+std::vector<EpiErr> collectDisparities(CameraModel *cam, FramePair &pair,
+                                       const Settings &settings) {
+  PixelSelector pixelSelector;
+  KeyFrame keyFrame(pair.base, pixelSelector, settings.keyFrame,
+                    settings.getPointTracerSettings());
+  pair.toTraceOn->baseKeyFrame = &keyFrame;
+  pair.toTraceOn->baseToThis = pair.firstToSecond;
+
+  auto deb = FLAGS_show_epipolar ? ImmaturePoint::DRAW_EPIPOLE
+                                 : ImmaturePoint::NO_DEBUG;
+  for (const auto &ip : keyFrame.immaturePoints)
+    ip->traceOn(keyFrame, *pair.toTraceOn, deb);
+
+  if (FLAGS_show_all) {
+    std::vector<double> depths;
+    for (const auto &ip : keyFrame.immaturePoints)
+      if (ip->state == ImmaturePoint::ACTIVE && ip->maxDepth != INF)
+        depths.push_back(ip->depth);
+    DepthColBounds bounds = depthColBounds(depths, settings.depthColors);
+    cv::imshow("traced points",
+               keyFrame.drawDepthedFrame(bounds.min, bounds.max));
+    cv::waitKey();
+  }
+
+  const SE3 &firstToSecond = pair.firstToSecond;
+  std::vector<EpiErr> errors;
+  for (const auto &ip : keyFrame.immaturePoints) {
+    if (ip->state != ImmaturePoint::ACTIVE || ip->maxDepth == INF)
+      continue;
+    Vec3 ray = cam->unmap(ip->p).normalized();
+    double depthGT = pair.depthsGT(toCvPoint(ip->p));
+    Vec2 reprojGT = cam->map(pair.firstToSecondGT * (depthGT * ray));
+    Vec2 reproj = cam->map(firstToSecond * (ip->depth * ray));
+    Vec2 reprojBef =
+        cam->map(firstToSecond * (ip->depthBeforeSubpixel * ray));
+    Vec2 reprojInfD = cam->map(firstToSecond.so3() * ray);
+
+    EpiErr e;
+    e.disparity = (reproj - reprojInfD).norm();
+    e.expectedErr = std::sqrt(ip->lastFullVar);
+    e.realErrBef = (reprojGT - reprojBef).norm();
+    e.realErr = (reprojGT - reproj).norm();
+    e.depthGT = depthGT;
+    e.depth = ip->depth;
+    e.depthBeforeSubpixel = ip->depthBeforeSubpixel;
+    e.eBeforeSubpixel = ip->eBeforeSubpixel;
+    e.eAfterSubpixel = ip->eAfterSubpixel;
+    errors.push_back(e);
   }
+  pair.toTraceOn->baseKeyFrame = nullptr;
+  return errors;
+}
+
+// A named set of flag overrides, one per line of the sweep file:
+//   name flag1=value1 flag2=value2 ...
+struct SweepConfig {
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> flags;
 };
 
-void collectEpipolarStat(const MultiFovReader &reader) {
-  Settings settings = getFlaggedSettings();
+std::vector<SweepConfig> readSweep(const std::string &fileName) {
+  std::vector<SweepConfig> configs;
+  std::ifstream ifs(fileName);
+  CHECK(ifs) << "could not open the sweep file " << fileName;
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::stringstream lineStream(line);
+    SweepConfig config;
+    if (!(lineStream >> config.name) || config.name[0] == '#')
+      continue;
+    std::string flag;
+    while (lineStream >> flag) {
+      auto eq = flag.find('=');
+      CHECK(eq != std::string::npos) << "expected flag=value, got " << flag;
+      config.flags.push_back({flag.substr(0, eq), flag.substr(eq + 1)});
+    }
+    configs.push_back(config);
+  }
+  return configs;
+}
 
+// The flags of the config are set only to build its settings, and then put
+// back, so that the configs do not leak into each other.
+Settings settingsFor(const SweepConfig &config) {
+  std::vector<std::pair<std::string, std::string>> saved;
+  for (const auto &[flag, value] : config.flags) {
+    std::string oldValue;
+    CHECK(gflags::GetCommandLineOption(flag.c_str(), &oldValue))
+        << "unknown flag " << flag << " in config " << config.name;
+    saved.push_back({flag, oldValue});
+    gflags::SetCommandLineOption(flag.c_str(), value.c_str());
+  }
+  Settings settings = getFlaggedSettings();
+  for (const auto &[flag, value] : saved)
+    gflags::SetCommandLineOption(flag.c_str(), value.c_str());
   if (FLAGS_run_parallel)
     settings.threading.numThreads = 1;
+  return settings;
+}
+
+fs::path shardPath(const fs::path &configDir, int first, int last) {
+  return configDir / ("shard_" + std::to_string(first) + "_" +
+                      std::to_string(last) + ".bin");
+}
+
+// A record count followed by the raw records. Written into a temporary file
+// that is renamed when complete, so that a shard file is either whole or
+// absent after a crash.
+void writeShard(const fs::path &path, const std::vector<EpiErr> &errors) {
+  fs::path tmpPath = path;
+  tmpPath += ".tmp";
+  {
+    std::ofstream ofs(tmpPath, std::ios::binary);
+    int64_t count = errors.size();
+    ofs.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    ofs.write(reinterpret_cast<const char *>(errors.data()),
+              count * sizeof(EpiErr));
+    CHECK(ofs) << "could not write " << tmpPath;
+  }
+  fs::rename(tmpPath, path);
+}
+
+void readShard(const fs::path &path, std::vector<EpiErr> &errors) {
+  std::ifstream ifs(path, std::ios::binary);
+  int64_t count = 0;
+  ifs.read(reinterpret_cast<char *>(&count), sizeof(count));
+  size_t oldSize = errors.size();
+  errors.resize(oldSize + count);
+  ifs.read(reinterpret_cast<char *>(errors.data() + oldSize),
+           count * sizeof(EpiErr));
+  CHECK(ifs) << "could not read " << path;
+}
+
+void collectEpipolarStat(const MultiFovReader &reader) {
+  CHECK_GT(FLAGS_shard_size, 0);
+  std::vector<SweepConfig> configs;
+  if (FLAGS_sweep.empty())
+    configs.push_back({"default", {}});
+  else
+    configs = readSweep(FLAGS_sweep);
+  CHECK(!configs.empty()) << "no configs in " << FLAGS_sweep;
+
+  std::vector<Settings> configSettings;
+  std::vector<fs::path> configDirs;
+  for (const SweepConfig &config : configs) {
+    configSettings.push_back(settingsFor(config));
+    configDirs.push_back(fs::path(FLAGS_shard_dir) / config.name);
+    fs::create_directories(configDirs.back());
+  }
+  // the pyramids are shared by the configs
+  const Settings &loadSettings = configSettings[0];
 
-  std::cout << "Start collecting dispaity errors..." << std::endl;
   const int lastFrame =
       std::min(FLAGS_end_frame, totalFrames - FLAGS_disparity_shift);
-  const int testCount = lastFrame - FLAGS_start_frame + 1;
-  int startFrames[testCount];
-  std::vector<EpiErr> errors[testCount];
-  for (int i = 0; i < testCount; ++i)
-    startFrames[i] = FLAGS_start_frame + i;
-
-  if (FLAGS_run_parallel) {
-    tbb::parallel_for(
-        tbb::blocked_range<int>(0, testCount),
-        CollectDisparities(&reader, startFrames, errors, settings));
-  } else {
-    CollectDisparities(&reader, startFrames, errors,
-                       settings)(tbb::blocked_range<int>(0, testCount));
-  }
+  std::cout << "Start collecting disparity errors..." << std::endl;
+  for (int shardFirst = FLAGS_start_frame; shardFirst <= lastFrame;
+       shardFirst += FLAGS_shard_size) {
+    int shardLast = std::min(shardFirst + FLAGS_shard_size - 1, lastFrame);
+    std::vector<int> todo;
+    for (int c = 0; c < configs.size(); ++c)
+      if (!fs::exists(shardPath(configDirs[c], shardFirst, shardLast)))
+        todo.push_back(c);
+    if (todo.empty()) {
+      std::cout << "shard " << shardFirst << ".." << shardLast
+                << " is done already" << std::endl;
+      continue;
+    }
 
-  std::vector<EpiErr> allErr;
-  for (int it = 0; it < testCount; ++it)
-    for (const auto &e : errors[it])
-      allErr.push_back(e);
+    const int pairNum = shardLast - shardFirst + 1;
+    std::vector<std::unique_ptr<FramePair>> pairs(pairNum);
+    auto load = [&](int i) {
+      pairs[i] = loadPair(reader, shardFirst + i, loadSettings);
+    };
+    if (FLAGS_run_parallel)
+      tbb::parallel_for(0, pairNum, load);
+    else
+      for (int i = 0; i < pairNum; ++i)
+        load(i);
+
+    for (int c : todo) {
+      std::vector<std::vector<EpiErr>> errors(pairNum);
+      auto collect = [&](int i) {
+        errors[i] =
+            collectDisparities(reader.cam.get(), *pairs[i], configSettings[c]);
+      };
+      if (FLAGS_run_parallel)
+        tbb::parallel_for(0, pairNum, collect);
+      else
+        for (int i = 0; i < pairNum; ++i)
+          collect(i);
+
+      std::vector<EpiErr> shardErrors;
+      for (const auto &frameErrors : errors)
+        shardErrors.insert(shardErrors.end(), frameErrors.begin(),
+                           frameErrors.end());
+      writeShard(shardPath(configDirs[c], shardFirst, shardLast),
+                 shardErrors);
+      std::cout << "shard " << shardFirst << ".." << shardLast << " of "
+                << configs[c].name << ": " << shardErrors.size()
+                << " points" << std::endl;
+    }
+  }
 
-  outputArray(FLAGS_disparity_output, allErr);
+  // the merged text output is what the analysis scripts read
+  for (int c = 0; c < configs.size(); ++c) {
+    std::vector<EpiErr> allErr;
+    for (int shardFirst = FLAGS_start_frame; shardFirst <= lastFrame;
+         shardFirst += FLAGS_shard_size) {
+      int shardLast = std::min(shardFirst + FLAGS_shard_size - 1, lastFrame);
+      readShard(shardPath(configDirs[c], shardFirst, shardLast), allErr);
+    }
+    fs::path outName = FLAGS_sweep.empty()
+                           ? fs::path(FLAGS_disparity_output)
+                           : configDirs[c] / FLAGS_disparity_output;
+    outputArray(outName.string(), allErr);
+  }
 
   std::cout << "All done." << std::endl;
 }
@@ -0,0 +1,263 @@
+#include "../reader/MultiFovReader.h"
+#include "../reader/PrefetchingReader.h"
+#include "output/TrajectoryEvaluator.h"
+#include "system/DsoSystem.h"
+#include "system/FrameTimings.h"
+#include "util/Scheduler.h"
+#include "util/flags.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+DEFINE_int32(start, 1, "Number of the starting frame.");
+DEFINE_int32(count, 300, "Number of frames to run every config on.");
+DEFINE_int32(reader_threads, 4, "Number of threads decoding the frames.");
+DEFINE_string(sweep, "",
+              "File with a config per line, a name followed by flag=value "
+              "overrides of the settings given on the command line. Lines "
+              "starting with # are skipped.");
+DEFINE_int32(parallel_runs, 2, "Number of configs that run at once.");
+DEFINE_int32(rpe_delta, 1, "Distance in frames between the RPE pairs.");
+DEFINE_string(csv, "", "If set, the table is also written to this file.");
+
+using namespace fishdso;
+
+typedef std::chrono::steady_clock Clock;
+
+// A named set of flag overrides, see FLAGS_sweep.
+struct SweepConfig {
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> flags;
+};
+
+std::vector<SweepConfig> readSweep(const std::string &fileName) {
+  std::vector<SweepConfig> configs;
+  std::ifstream ifs(fileName);
+  CHECK(ifs) << "could not open the sweep file " << fileName;
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::stringstream lineStream(line);
+    SweepConfig config;
+    if (!(lineStream >> config.name) || config.name[0] == '#')
+      continue;
+    std::string flag;
+    while (lineStream >> flag) {
+      auto eq = flag.find('=');
+      CHECK(eq != std::string::npos) << "expected flag=value, got " << flag;
+      config.flags.push_back({flag.substr(0, eq), flag.substr(eq + 1)});
+    }
+    configs.push_back(config);
+  }
+  return configs;
+}
+
+// The flags of the config are set only to build its settings, and then put
+// back, so that the configs do not leak into each other.
+Settings settingsFor(const SweepConfig &config) {
+  std::vector<std::pair<std::string, std::string>> saved;
+  for (const auto &[flag, value] : config.flags) {
+    std::string oldValue;
+    CHECK(gflags::GetCommandLineOption(flag.c_str(), &oldValue))
+        << "unknown flag " << flag << " in config " << config.name;
+    saved.push_back({flag, oldValue});
+    gflags::SetCommandLineOption(flag.c_str(), value.c_str());
+  }
+  Settings settings = getFlaggedSettings();
+  for (const auto &[flag, value] : saved)
+    gflags::SetCommandLineOption(flag.c_str(), value.c_str());
+  return settings;
+}
+
+class TimingsCollector : public DsoObserver {
+public:
+  void frameProcessed(const FrameTimings &timings) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int s = 0; s < FrameTimings::STAGE_NUM; ++s)
+      stageSeconds[s] += timings.seconds[s];
+    if (timings.isKeyFrame)
+      ++keyFrames;
+  }
+
+  std::mutex mutex;
+  std::array<double, FrameTimings::STAGE_NUM> stageSeconds = {};
+  int keyFrames = 0;
+};
+
+struct SweepResult {
+  std::string name;
+  int frames = 0;
+  int keyFrames = 0;
+  double wallSeconds = 0;
+  std::array<double, FrameTimings::STAGE_NUM> stageSeconds = {};
+  TrajectoryEvaluator::Summary accuracy = {};
+};
+
+// The frames are shared by all of the runs. DsoSystem never writes into the
+// grayscale image of a SourceFrame and takes it as the finest level of its
+// pyramid, so only the coarser levels are built per run.
+SweepResult runConfig(const MultiFovReader &reader,
+                      const std::vector<cv::Mat1b> &frames,
+                      const SweepConfig &config, const Settings &settings) {
+  TimingsCollector collector;
+  TrajectoryEvaluator evaluator(reader.getAllWorldToFrameGT(),
+                                FLAGS_rpe_delta);
+  Observers observers;
+  observers.dso.push_back(&collector);
+  observers.dso.push_back(&evaluator);
+
+  SweepResult result;
+  result.name = config.name;
+  Clock::time_point start = Clock::now();
+  {
+    DsoSystem dso(reader.cam.get(), observers, settings);
+    for (int i = 0; i < frames.size(); ++i) {
+      SourceFrame frame = {frames[i], {}, FLAGS_start + i};
+      dso.addFrame(frame);
+    }
+    dso.waitForMapping();
+  }
+  result.wallSeconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  result.frames = frames.size();
+  result.keyFrames = collector.keyFrames;
+  result.stageSeconds = collector.stageSeconds;
+  result.accuracy = evaluator.summary();
+  return result;
+}
+
+void printTable(std::ostream &out, const std::vector<SweepResult> &results,
+                char separator) {
+  const bool isCsv = separator == ',';
+  auto cell = [&](int width) {
+    if (!isCsv)
+      out << std::setw(width);
+  };
+  auto sep = [&]() { out << (isCsv ? "," : " "); };
+
+  cell(16);
+  out << "config";
+  for (const char *column : {"frames", "keyframes", "wall_s", "fps",
+                             "ate_rmse", "rpe_trans", "rpe_rot_deg"}) {
+    sep();
+    cell(11);
+    out << column;
+  }
+  for (int s = 0; s < FrameTimings::STAGE_NUM; ++s) {
+    sep();
+    cell(11);
+    out << std::string(FrameTimings::stageName(FrameTimings::Stage(s))) +
+               "_ms";
+  }
+  out << '\n';
+
+  out << std::setprecision(4);
+  for (const SweepResult &r : results) {
+    cell(16);
+    out << r.name;
+    for (double value :
+         {double(r.frames), double(r.keyFrames), r.wallSeconds,
+          r.frames / r.wallSeconds, r.accuracy.ateRmse,
+          r.accuracy.rpeTransRmse, r.accuracy.rpeRotRmse}) {
+      sep();
+      cell(11);
+      out << value;
+    }
+    for (int s = 0; s < FrameTimings::STAGE_NUM; ++s) {
+      sep();
+      cell(11);
+      out << 1e3 * r.stageSeconds[s] / std::max(r.frames, 1);
+    }
+    out << '\n';
+  }
+  out << std::flush;
+}
+
+int main(int argc, char **argv) {
+  std::string usage = "Usage: " + std::string(argv[0]) + R"abacaba( data_dir
+Where data_dir names a directory with MultiFoV fishseye dataset.
+Runs DsoSystem with every config of the sweep file on frames
+[start, start + count) and prints a table of the accuracy against the ground
+truth and of the time per frame of every config. The frames are decoded once
+and shared by all of the runs, parallel_runs of which go at once on a common
+scheduler. The configs that set cores run on threads of their own instead,
+pinned to those cores.)abacaba";
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  gflags::SetUsageMessage(usage);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc != 2 || FLAGS_sweep.empty()) {
+    std::cerr << "Wrong number of arguments or no sweep file!\n"
+              << usage << std::endl;
+    return 1;
+  }
+
+  std::vector<SweepConfig> configs = readSweep(FLAGS_sweep);
+  CHECK(!configs.empty()) << "no configs in " << FLAGS_sweep;
+  std::vector<Settings> configSettings;
+  for (const SweepConfig &config : configs)
+    configSettings.push_back(settingsFor(config));
+
+  // the runs share the cores instead of each starting a pool of its own,
+  // except for those placed on cores of their own
+  std::shared_ptr<Scheduler> scheduler(
+      new Scheduler(std::thread::hardware_concurrency()));
+  for (Settings &settings : configSettings)
+    if (settings.threading.cores.empty())
+      settings.threading.scheduler = scheduler;
+
+  Settings settings = getFlaggedSettings();
+  MultiFovReader reader(argv[1], "", settings.cameraModel);
+  if (!FLAGS_static_mask.empty()) {
+    cv::Mat1b staticMask = cv::imread(FLAGS_static_mask, cv::IMREAD_GRAYSCALE);
+    CHECK(!staticMask.empty()) << "could not read " << FLAGS_static_mask;
+    reader.cam->setStaticMask(staticMask);
+  }
+  if (!FLAGS_inverse_response.empty() || !FLAGS_vignette.empty())
+    reader.cam->setPhotometricCalibration(
+        PhotometricCalibration::load(FLAGS_inverse_response, FLAGS_vignette));
+
+  std::cout << "decoding frames.." << std::endl;
+  std::vector<cv::Mat1b> frames;
+  frames.reserve(FLAGS_count);
+  PrefetchingReader prefetcher(reader, FLAGS_start, FLAGS_count,
+                               2 * FLAGS_reader_threads, FLAGS_reader_threads,
+                               false, true);
+  while (prefetcher.hasNext())
+    frames.push_back(prefetcher.next().frame);
+
+  std::vector<SweepResult> results(configs.size());
+  std::atomic<int> nextConfig(0);
+  std::mutex printMutex;
+  auto worker = [&]() {
+    for (int c = nextConfig++; c < configs.size(); c = nextConfig++) {
+      results[c] = runConfig(reader, frames, configs[c], configSettings[c]);
+      std::lock_guard<std::mutex> lock(printMutex);
+      std::cout << "done " << configs[c].name << ": ATE "
+                << results[c].accuracy.ateRmse << ", "
+                << results[c].frames / results[c].wallSeconds << " fps"
+                << std::endl;
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int w = 0; w < std::max(1, FLAGS_parallel_runs); ++w)
+    workers.emplace_back(worker);
+  for (std::thread &w : workers)
+    w.join();
+
+  printTable(std::cout, results, ' ');
+  if (!FLAGS_csv.empty()) {
+    std::ofstream csvOfs(FLAGS_csv);
+    printTable(csvOfs, results, ',');
+  }
+
+  return 0;
+}
@@ -0,0 +1,293 @@
+#include "../reader/MultiFovReader.h"
+#include "../reader/PrefetchingReader.h"
+#include "output/CloudWriter.h"
+#include "output/TrajectoryWriter.h"
+#include "system/DsoSystem.h"
+#include "system/FramePipeline.h"
+#include "system/FrameTimings.h"
+#include "util/flags.h"
+#include "util/util.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+
+DEFINE_int32(start, 1, "Number of the starting frame.");
+DEFINE_int32(count, 100, "Number of frames to replay in each run.");
+DEFINE_int32(warmup, 10,
+             "Number of frames after the start that are processed but not "
+             "measured in each run.");
+DEFINE_int32(repeat, 3, "Number of runs, each with a fresh DsoSystem.");
+DEFINE_int32(reader_threads, 4, "Number of threads decoding the frames.");
+DEFINE_int32(pipeline_depth, 0,
+             "If positive, the frames are fed through a FramePipeline with "
+             "this many frames in flight, which builds their pyramids while "
+             "the previous ones are tracked. Latencies are not measured "
+             "then.");
+DEFINE_int32(prepare_threads, 1,
+             "Number of threads building the pyramids in the pipeline.");
+DEFINE_bool(speculative, false,
+            "Add the frames in batches of speculative_batch_size with "
+            "DsoSystem::addFrames, which tracks each batch at once. Latencies "
+            "are not measured then.");
+DEFINE_bool(with_observers, false,
+            "Attach trajectory and point cloud writers, so that their cost "
+            "shows up as the observers stage.");
+DEFINE_string(output_directory, "output/throughput",
+              "Where the writers attached by with_observers write to.");
+DEFINE_string(json, "",
+              "If set, the results are written to this file as JSON.");
+
+using namespace fishdso;
+
+typedef std::chrono::steady_clock Clock;
+
+class TimingsCollector : public DsoObserver {
+public:
+  void frameProcessed(const FrameTimings &timings) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    collected.push_back(timings);
+  }
+
+  std::vector<FrameTimings> take() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::move(collected);
+  }
+
+private:
+  std::mutex mutex;
+  std::vector<FrameTimings> collected;
+};
+
+struct RunResult {
+  int frames = 0;
+  int keyFrames = 0;
+  double wallSeconds = 0;
+  // latency of addFrame, i.e. of the tracking and, without asynchronous
+  // mapping, the mapping of the frame. Empty with pipeline_depth or
+  // speculative.
+  std::vector<double> latencies;
+  std::array<double, FrameTimings::STAGE_NUM> stageSeconds = {};
+
+  double fps() const { return frames / wallSeconds; }
+};
+
+RunResult runOnce(const MultiFovReader &reader,
+                  const std::vector<cv::Mat1b> &frames,
+                  const Settings &settings) {
+  TimingsCollector collector;
+  Observers observers;
+  observers.dso.push_back(&collector);
+  std::unique_ptr<TrajectoryWriter> trajectoryWriter;
+  std::unique_ptr<CloudWriter> cloudWriter;
+  if (FLAGS_with_observers) {
+    fs::create_directories(FLAGS_output_directory);
+    trajectoryWriter.reset(new TrajectoryWriter(
+        FLAGS_output_directory, "tracked_pos.txt",
+        "tracked_frame_to_world.txt"));
+    cloudWriter.reset(new CloudWriter(reader.cam.get(),
+                                      FLAGS_output_directory, "points.ply"));
+    observers.dso.push_back(trajectoryWriter.get());
+    observers.dso.push_back(cloudWriter.get());
+  }
+
+  RunResult result;
+  int firstMeasured = FLAGS_start + FLAGS_warmup;
+  Clock::time_point measureStart = Clock::now();
+  {
+    DsoSystem dso(reader.cam.get(), observers, settings);
+    std::unique_ptr<FramePipeline> pipeline;
+    if (FLAGS_pipeline_depth > 0)
+      pipeline.reset(new FramePipeline(&dso, FLAGS_pipeline_depth,
+                                       FLAGS_prepare_threads));
+    std::vector<SourceFrame> batch;
+    auto addBatch = [&]() {
+      if (!batch.empty())
+        dso.addFrames(batch);
+      batch.clear();
+    };
+    for (int i = 0; i < frames.size(); ++i) {
+      int frameNum = FLAGS_start + i;
+      if (frameNum == firstMeasured) {
+        addBatch();
+        if (pipeline)
+          pipeline->finish();
+        dso.waitForMapping();
+        measureStart = Clock::now();
+      }
+      if (frameNum >= firstMeasured)
+        ++result.frames;
+
+      SourceFrame frame = {frames[i], {}, frameNum};
+      if (FLAGS_speculative) {
+        batch.push_back(frame);
+        if (int(batch.size()) == settings.speculativeTracking.batchSize)
+          addBatch();
+        continue;
+      }
+      if (pipeline) {
+        pipeline->submitFrame(frame);
+        while (pipeline->poll())
+          ;
+        continue;
+      }
+      Clock::time_point frameStart = Clock::now();
+      dso.addFrame(frame);
+      double latency =
+          std::chrono::duration<double>(Clock::now() - frameStart).count();
+      if (frameNum >= firstMeasured)
+        result.latencies.push_back(latency);
+    }
+    addBatch();
+    if (pipeline)
+      pipeline->finish();
+    dso.waitForMapping();
+    result.wallSeconds =
+        std::chrono::duration<double>(Clock::now() - measureStart).count();
+  }
+
+  std::sort(result.latencies.begin(), result.latencies.end());
+  for (const FrameTimings &timings : collector.take()) {
+    if (timings.globalFrameNum < firstMeasured)
+      continue;
+    if (timings.isKeyFrame)
+      ++result.keyFrames;
+    for (int s = 0; s < FrameTimings::STAGE_NUM; ++s)
+      result.stageSeconds[s] += timings.seconds[s];
+  }
+  return result;
+}
+
+void printRun(std::ostream &out, int runInd, const RunResult &run) {
+  out << "run " << runInd << ": " << run.frames << " frames ("
+      << run.keyFrames << " keyframes) in " << run.wallSeconds << " s, "
+      << run.fps() << " fps\n  latency ms: p50 "
+      << 1e3 * percentile(run.latencies, 50) << ", p95 "
+      << 1e3 * percentile(run.latencies, 95) << ", p99 "
+      << 1e3 * percentile(run.latencies, 99) << "\n  ms per frame:";
+  for (int s = 0; s < FrameTimings::STAGE_NUM; ++s)
+    out << " " << FrameTimings::stageName(FrameTimings::Stage(s)) << " "
+        << 1e3 * run.stageSeconds[s] / std::max(run.frames, 1);
+  out << std::endl;
+}
+
+void writeLatencies(std::ostream &out, const std::vector<double> &sorted) {
+  out << "{\"p50\": " << 1e3 * percentile(sorted, 50)
+      << ", \"p95\": " << 1e3 * percentile(sorted, 95)
+      << ", \"p99\": " << 1e3 * percentile(sorted, 99)
+      << ", \"max\": " << 1e3 * (sorted.empty() ? 0 : sorted.back()) << "}";
+}
+
+void writeJson(std::ostream &out, const std::string &datasetDir,
+               const Settings &settings, const std::vector<RunResult> &runs) {
+  out << std::setprecision(6);
+  std::string escapedDir;
+  for (char c : datasetDir) {
+    if (c == '"' || c == '\\')
+      escapedDir += '\\';
+    escapedDir += c;
+  }
+  out << "{\n  \"dataset\": \"" << escapedDir << "\",\n";
+  out << "  \"start\": " << FLAGS_start << ",\n";
+  out << "  \"count\": " << FLAGS_count << ",\n";
+  out << "  \"warmup\": " << FLAGS_warmup << ",\n";
+  out << "  \"async_mapping\": "
+      << (settings.threading.asyncMapping ? "true" : "false") << ",\n";
+  out << "  \"num_threads\": " << settings.threading.numThreads << ",\n";
+  out << "  \"pipeline_depth\": " << FLAGS_pipeline_depth << ",\n";
+  out << "  \"speculative\": " << (FLAGS_speculative ? "true" : "false")
+      << ",\n";
+  out << "  \"runs\": [\n";
+  for (int r = 0; r < runs.size(); ++r) {
+    const RunResult &run = runs[r];
+    out << "    {\"frames\": " << run.frames
+        << ", \"keyframes\": " << run.keyFrames
+        << ", \"wall_s\": " << run.wallSeconds << ", \"fps\": " << run.fps()
+        << ",\n     \"latency_ms\": ";
+    writeLatencies(out, run.latencies);
+    out << ",\n     \"stage_ms_per_frame\": {";
+    for (int s = 0; s < FrameTimings::STAGE_NUM; ++s)
+      out << (s > 0 ? ", " : "") << "\""
+          << FrameTimings::stageName(FrameTimings::Stage(s))
+          << "\": " << 1e3 * run.stageSeconds[s] / std::max(run.frames, 1);
+    out << "}}" << (r + 1 < runs.size() ? "," : "") << "\n";
+  }
+  out << "  ],\n";
+
+  std::vector<double> allLatencies;
+  std::vector<double> fps;
+  for (const RunResult &run : runs) {
+    allLatencies.insert(allLatencies.end(), run.latencies.begin(),
+                        run.latencies.end());
+    fps.push_back(run.fps());
+  }
+  std::sort(allLatencies.begin(), allLatencies.end());
+  std::sort(fps.begin(), fps.end());
+  out << "  \"summary\": {\"fps_median\": " << percentile(fps, 50)
+      << ", \"fps_min\": " << fps.front() << ", \"fps_max\": " << fps.back()
+      << ",\n              \"latency_ms\": ";
+  writeLatencies(out, allLatencies);
+  out << "}\n}" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::string usage = "Usage: " + std::string(argv[0]) + R"abacaba( data_dir
+Where data_dir names a directory with MultiFoV fishseye dataset.
+Replays frames [start, start + count) through DsoSystem repeat times and
+reports the throughput, the per-frame latency percentiles and the time spent
+in each stage. Frames are decoded into memory beforehand, so the disk does
+not take part in the measurements.)abacaba";
+
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  gflags::SetUsageMessage(usage);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc != 2) {
+    std::cerr << "Wrong number of arguments!\n" << usage << std::endl;
+    return 1;
+  }
+  if (FLAGS_warmup >= FLAGS_count || FLAGS_repeat < 1) {
+    std::cerr << "Nothing to measure: warmup should be less than count and "
+                 "repeat should be positive"
+              << std::endl;
+    return 1;
+  }
+
+  Settings settings = getFlaggedSettings();
+  MultiFovReader reader(argv[1], "", settings.cameraModel);
+  if (!FLAGS_static_mask.empty()) {
+    cv::Mat1b staticMask = cv::imread(FLAGS_static_mask, cv::IMREAD_GRAYSCALE);
+    CHECK(!staticMask.empty()) << "could not read " << FLAGS_static_mask;
+    reader.cam->setStaticMask(staticMask);
+  }
+  if (!FLAGS_inverse_response.empty() || !FLAGS_vignette.empty())
+    reader.cam->setPhotometricCalibration(
+        PhotometricCalibration::load(FLAGS_inverse_response, FLAGS_vignette));
+
+  std::cout << "decoding frames.." << std::endl;
+  std::vector<cv::Mat1b> frames;
+  frames.reserve(FLAGS_count);
+  PrefetchingReader prefetcher(reader, FLAGS_start, FLAGS_count,
+                               2 * FLAGS_reader_threads, FLAGS_reader_threads,
+                               false, true);
+  while (prefetcher.hasNext())
+    frames.push_back(prefetcher.next().frame);
+
+  std::vector<RunResult> runs;
+  for (int r = 0; r < FLAGS_repeat; ++r) {
+    runs.push_back(runOnce(reader, frames, settings));
+    printRun(std::cout, r, runs.back());
+  }
+
+  if (!FLAGS_json.empty()) {
+    std::ofstream jsonOfs(FLAGS_json);
+    writeJson(jsonOfs, argv[1], settings, runs);
+  }
+
+  return 0;
+}
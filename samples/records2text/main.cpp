@@ -0,0 +1,64 @@
+#include "util/PlyHolder.h"
+#include "util/RecordStream.h"
+#include "util/util.h"
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <iostream>
+
+DEFINE_bool(binary_ply, false,
+            "Write the point clouds as binary PLY instead of the ASCII one?");
+DEFINE_bool(kf_clouds, true,
+            "Write the points of every keyframe into kf<num>.ply as well?");
+
+using namespace fishdso;
+
+int main(int argc, char **argv) {
+  std::string usage = "Usage: " + std::string(argv[0]) + R"abacaba( records out_dir
+Where records names a file written by RecordStream, e.g. records.bin of
+genply --record_stream. Writes tracked_pos.txt, tracked_frame_to_world.txt,
+points.ply and the keyframe clouds into out_dir, the same way TrajectoryWriter
+and CloudWriter would have.)abacaba";
+
+  gflags::SetUsageMessage(usage);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (argc != 3) {
+    std::cerr << "Wrong number of arguments!\n" << usage << std::endl;
+    return 1;
+  }
+
+  std::string outDir(argv[2]);
+  RecordReader reader(argv[1]);
+  std::ofstream posesOfs(fileInDir(outDir, "tracked_pos.txt"));
+  std::ofstream matrixFormOfs(fileInDir(outDir, "tracked_frame_to_world.txt"));
+  PlyHolder cloudHolder(fileInDir(outDir, "points.ply"),
+                        FLAGS_binary_ply ? PlyHolder::BINARY
+                                         : PlyHolder::ASCII);
+
+  int poseCount = 0, keyFrameCount = 0;
+  RecordReader::Record record;
+  while (reader.next(record)) {
+    if (record.type == RecordStream::POSE) {
+      putInMatrixForm(matrixFormOfs, record.worldToFrame.inverse());
+      matrixFormOfs << '\n';
+      posesOfs << record.frameNum << ' ';
+      putMotion(posesOfs, record.worldToFrame);
+      posesOfs << '\n';
+      ++poseCount;
+    } else {
+      if (FLAGS_kf_clouds) {
+        std::ofstream kfOut(fileInDir(
+            outDir, "kf" + std::to_string(record.keyFrameNum) + ".ply"));
+        printInPly(kfOut, record.points, record.colors);
+      }
+      cloudHolder.putPoints(record.points, record.colors);
+      ++keyFrameCount;
+    }
+  }
+  cloudHolder.updatePointCount();
+
+  std::cout << "converted " << poseCount << " poses and " << keyFrameCount
+            << " keyframe clouds" << std::endl;
+  return 0;
+}
@@ -0,0 +1,245 @@
+#include "output/AsyncObserverAdapter.h"
+#include <algorithm>
+#include <glog/logging.h>
+
+namespace fishdso {
+
+AsyncObserverAdapter::AsyncObserverAdapter(
+    int queueSize, DropPolicy dropPolicy, std::shared_ptr<Scheduler> scheduler)
+    : queueSize(queueSize)
+    , dropPolicy(dropPolicy)
+    , scheduler(scheduler) {
+  CHECK_GT(queueSize, 0);
+  if (!scheduler)
+    worker = std::thread(&AsyncObserverAdapter::workerLoop, this);
+}
+
+AsyncObserverAdapter::~AsyncObserverAdapter() {
+  if (scheduler) {
+    flush();
+    if (dropped > 0)
+      LOG(WARNING) << dropped << " observer callbacks were dropped";
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    doStop = true;
+  }
+  cv.notify_all();
+  worker.join();
+  if (dropped > 0)
+    LOG(WARNING) << dropped << " observer callbacks were dropped";
+}
+
+void AsyncObserverAdapter::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [this]() { return queue.empty() && !isBusy && !isDraining; });
+}
+
+int AsyncObserverAdapter::droppedNum() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return dropped;
+}
+
+void AsyncObserverAdapter::enqueue(std::function<void()> callback,
+                                   bool isDroppable) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (int(queue.size()) >= queueSize && isDroppable) {
+      if (dropPolicy == DROP_NEWEST) {
+        ++dropped;
+        return;
+      }
+      if (dropPolicy == DROP_OLDEST) {
+        auto oldest = std::find_if(queue.begin(), queue.end(),
+                                   [](const Task &t) { return t.isDroppable; });
+        if (oldest != queue.end()) {
+          queue.erase(oldest);
+          ++dropped;
+        }
+      }
+    }
+    cv.wait(lock, [this]() { return int(queue.size()) < queueSize; });
+    queue.push_back({std::move(callback), isDroppable});
+    if (scheduler && !isDraining) {
+      isDraining = true;
+      scheduler->enqueue(Scheduler::OUTPUT, [this]() { drain(); });
+    }
+  }
+  cv.notify_all();
+}
+
+void AsyncObserverAdapter::callNow(const std::function<void()> &callback) {
+  flush();
+  callback();
+}
+
+void AsyncObserverAdapter::workerLoop() {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this]() { return doStop || !queue.empty(); });
+      // the queue is drained before stopping
+      if (queue.empty())
+        return;
+      task = std::move(queue.front());
+      queue.pop_front();
+      isBusy = true;
+    }
+    cv.notify_all();
+
+    task.callback();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      isBusy = false;
+    }
+    cv.notify_all();
+  }
+}
+
+void AsyncObserverAdapter::drain() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!queue.empty()) {
+    Task task = std::move(queue.front());
+    queue.pop_front();
+    isBusy = true;
+    lock.unlock();
+    cv.notify_all();
+
+    task.callback();
+
+    lock.lock();
+    isBusy = false;
+  }
+  isDraining = false;
+  // notified under the lock, as the adapter may be destroyed right after
+  // flush sees that we are done
+  cv.notify_all();
+}
+
+AsyncDsoObserver::AsyncDsoObserver(DsoSnapshotObserver *observer,
+                                   int queueSize, DropPolicy dropPolicy,
+                                   std::shared_ptr<Scheduler> scheduler)
+    : AsyncObserverAdapter(queueSize, dropPolicy, scheduler)
+    , observer(observer) {}
+
+void AsyncDsoObserver::created(DsoSystem *newDso, CameraModel *newCam,
+                               const Settings &newSettings) {
+  callNow([&]() { observer->created(newDso, newCam, newSettings); });
+}
+
+void AsyncDsoObserver::initialized(
+    const std::vector<const KeyFrame *> &initializedKFs) {
+  enqueue(
+      [observer = observer, snapshots = takeSnapshots(initializedKFs)]() {
+        observer->initialized(snapshots);
+      },
+      false);
+}
+
+void AsyncDsoObserver::newFrame(const PreKeyFrame *frame) {
+  enqueue([observer = observer, snapshot = FrameSnapshot(*frame)]() {
+    observer->newFrame(snapshot);
+  });
+}
+
+void AsyncDsoObserver::newKeyFrame(const KeyFrame *baseFrame) {
+  enqueue(
+      [observer = observer, snapshot = KeyFrameSnapshot(*baseFrame)]() {
+        observer->newKeyFrame(snapshot);
+      },
+      false);
+}
+
+void AsyncDsoObserver::keyFramesMarginalized(
+    const std::vector<const KeyFrame *> &marginalized) {
+  enqueue(
+      [observer = observer, snapshots = takeSnapshots(marginalized)]() {
+        observer->keyFramesMarginalized(snapshots);
+      },
+      false);
+}
+
+void AsyncDsoObserver::posesFlushed(const PoseHistory::Chunk &chunk) {
+  enqueue([observer = observer, chunk]() { observer->posesFlushed(chunk); },
+          false);
+}
+
+void AsyncDsoObserver::frameProcessed(const FrameTimings &timings) {
+  enqueue(
+      [observer = observer, timings]() { observer->frameProcessed(timings); });
+}
+
+void AsyncDsoObserver::loopClosed(const StdMap<int, Sim3> &worldToKeyFrame) {
+  enqueue(
+      [observer = observer, worldToKeyFrame]() {
+        observer->loopClosed(worldToKeyFrame);
+      },
+      false);
+}
+
+void AsyncDsoObserver::pointBudgetChanged(const PointBudget &budget) {
+  enqueue(
+      [observer = observer, budget]() { observer->pointBudgetChanged(budget); },
+      false);
+}
+
+bool AsyncDsoObserver::needsWindow() const { return observer->needsWindow(); }
+
+void AsyncDsoObserver::windowMapped(const std::vector<const KeyFrame *> &window,
+                                    int baseIndex) {
+  // only the latest window is drawn, so an old one can be dropped
+  enqueue([observer = observer, snapshots = takeSnapshots(window),
+           baseIndex]() { observer->windowMapped(snapshots, baseIndex); });
+}
+
+void AsyncDsoObserver::globalBundleAdjusted(
+    const std::vector<const KeyFrame *> &keyFrames) {
+  enqueue(
+      [observer = observer, snapshots = takeSnapshots(keyFrames)]() {
+        observer->globalBundleAdjusted(snapshots);
+      },
+      false);
+}
+
+void AsyncDsoObserver::destructed(
+    const std::vector<const KeyFrame *> &lastKeyFrames) {
+  enqueue(
+      [observer = observer, snapshots = takeSnapshots(lastKeyFrames)]() {
+        observer->destructed(snapshots);
+      },
+      false);
+  // the system is gone after this, and the observer may be inspected
+  flush();
+}
+
+AsyncFrameTrackerObserver::AsyncFrameTrackerObserver(
+    FrameTrackerObserver *observer, int queueSize, DropPolicy dropPolicy,
+    std::shared_ptr<Scheduler> scheduler)
+    : AsyncObserverAdapter(queueSize, dropPolicy, scheduler)
+    , observer(observer) {}
+
+void AsyncFrameTrackerObserver::newBaseFrame(const DepthedImagePyramid &pyr) {
+  enqueue([observer = observer, pyr]() { observer->newBaseFrame(pyr); });
+}
+
+void AsyncFrameTrackerObserver::startTracking(const ImagePyramid &frame) {
+  enqueue([observer = observer, frame]() { observer->startTracking(frame); });
+}
+
+void AsyncFrameTrackerObserver::levelTracked(
+    int pyrLevel, const SE3 &baseToLast,
+    const AffineLightTransform<double> &affLightBaseToLast,
+    const StdVector<std::pair<Vec2, double>> &pointResiduals, int iterations,
+    double time) {
+  enqueue([observer = observer, pyrLevel, baseToLast, affLightBaseToLast,
+           pointResiduals, iterations, time]() {
+    observer->levelTracked(pyrLevel, baseToLast, affLightBaseToLast,
+                           pointResiduals, iterations, time);
+  });
+}
+
+} // namespace fishdso
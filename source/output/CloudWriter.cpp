@@ -3,44 +3,75 @@
 namespace fishdso {
 
 CloudWriter::CloudWriter(CameraModel *cam, const std::string &outputDirectory,
-                         const std::string &fileName)
+                         const std::string &fileName,
+                         PlyHolder::Format format, int pointsPerChunk,
+                         RecordStream *records)
     : cam(cam)
-    , cloudHolder(fileInDir(outputDirectory, fileName)) {}
+    , outputDirectory(outputDirectory)
+    , globalFileName(fileInDir(outputDirectory, "global_" + fileName))
+    , format(format)
+    , pointsPerChunk(pointsPerChunk)
+    , records(records) {
+  if (!records)
+    cloudHolder.reset(new PlyHolder(fileInDir(outputDirectory, fileName),
+                                    format, pointsPerChunk));
+}
 
 void CloudWriter::keyFramesMarginalized(
-    const std::vector<const KeyFrame *> &marginalized) {
-  for (const KeyFrame *kf : marginalized) {
+    const std::vector<KeyFrameSnapshot> &marginalized) {
+  for (const KeyFrameSnapshot &kf : marginalized) {
     std::vector<Vec3> points;
     std::vector<cv::Vec3b> colors;
+    const cv::Mat3b &frameColored = kf.preKeyFrame->frameColored();
 
-    for (const auto &op : kf->optimizedPoints) {
-      points.push_back(kf->thisToWorld *
-                       (op->depth() * cam->unmap(op->p).normalized()));
-      colors.push_back(
-          kf->preKeyFrame->frameColored.at<cv::Vec3b>(toCvPoint(op->p)));
+    for (const PointSnapshot &op : kf.optimizedPoints) {
+      points.push_back(kf.thisToWorld *
+                       (op.depth * cam->unmap(op.p).normalized()));
+      colors.push_back(frameColored(toCvPoint(op.p)));
     }
-    for (const auto &ip : kf->immaturePoints) {
-      if (ip->numTraced > 0) {
-        points.push_back(kf->thisToWorld *
-                         (ip->depth * cam->unmap(ip->p).normalized()));
-        colors.push_back(
-            kf->preKeyFrame->frameColored.at<cv::Vec3b>(toCvPoint(ip->p)));
-      }
+    for (const PointSnapshot &ip : kf.immaturePoints) {
+      points.push_back(kf.thisToWorld *
+                       (ip.depth * cam->unmap(ip.p).normalized()));
+      colors.push_back(frameColored(toCvPoint(ip.p)));
     }
 
-    int kfnum = kf->preKeyFrame->globalFrameNum;
+    int kfnum = kf.globalFrameNum;
+    if (records) {
+      records->putPoints(kfnum, points, colors);
+      continue;
+    }
     std::ofstream kfOut(outputDirectory + "/kf" + std::to_string(kfnum) +
                         ".ply");
     printInPly(kfOut, points, colors);
     kfOut.close();
-    cloudHolder.putPoints(points, colors);
+    cloudHolder->putPoints(points, colors);
   }
 
-  cloudHolder.updatePointCount();
+  if (records)
+    records->flush();
+  else
+    cloudHolder->updatePointCount();
+}
+
+void CloudWriter::globalBundleAdjusted(
+    const std::vector<KeyFrameSnapshot> &keyFrames) {
+  PlyHolder globalHolder(globalFileName, format, pointsPerChunk);
+  for (const KeyFrameSnapshot &kf : keyFrames) {
+    std::vector<Vec3> points;
+    std::vector<cv::Vec3b> colors;
+    const cv::Mat3b &frameColored = kf.preKeyFrame->frameColored();
+    // the snapshots have only the points with finite depths
+    for (const PointSnapshot &op : kf.optimizedPoints) {
+      points.push_back(kf.thisToWorld *
+                       (op.depth * cam->unmap(op.p).normalized()));
+      colors.push_back(frameColored(toCvPoint(op.p)));
+    }
+    globalHolder.putPoints(points, colors);
+  }
 }
 
 void CloudWriter::destructed(
-    const std::vector<const KeyFrame *> &lastKeyFrames) {
+    const std::vector<KeyFrameSnapshot> &lastKeyFrames) {
   keyFramesMarginalized(lastKeyFrames);
 }
 
@@ -1,16 +1,21 @@
 #include "output/CloudWriterGT.h"
+#include <memory>
+#include <tbb/parallel_pipeline.h>
 
 namespace fishdso {
 
 CloudWriterGT::CloudWriterGT(
     const StdVector<SE3> &worldToFrameGT,
-    const std::vector<std::vector<Vec3>> &pointsInFrameGT,
-    const std::vector<std::vector<cv::Vec3b>> &colors,
-    const std::string &outputDirectory, const std::string &fileName)
+    const GTPointsSource &pointsSource,
+    const std::string &outputDirectory, const std::string &fileName,
+    PlyHolder::Format format, int pointsPerChunk, int framesInFlight)
     : worldToFrameGT(worldToFrameGT)
-    , pointsInFrameGT(pointsInFrameGT)
-    , colors(colors)
-    , cloudHolder(fileInDir(outputDirectory, fileName)) {}
+    , pointsSource(pointsSource)
+    , cloudHolder(fileInDir(outputDirectory, fileName), format,
+                  pointsPerChunk)
+    , framesInFlight(framesInFlight) {
+  CHECK_GT(framesInFlight, 0);
+}
 
 void CloudWriterGT::initialized(
     const std::vector<const KeyFrame *> &initializedKFs) {
@@ -35,20 +40,44 @@ void CloudWriterGT::keyFramesMarginalized(
   CHECK(sim3Aligner);
 
   for (const KeyFrame *kf : marginalized) {
-    std::vector<Vec3> points;
-    points.reserve(pointsInFrameGT[kf->preKeyFrame->globalFrameNum].size());
-    for (const Vec3 &p : pointsInFrameGT[kf->preKeyFrame->globalFrameNum])
-      points.push_back(kf->thisToWorld * sim3Aligner->alignScale(p));
-    cloudHolder.putPoints(points, colors[kf->preKeyFrame->globalFrameNum]);
+    std::vector<int> frameNums;
+    StdVector<SE3> frameToWorld;
+    frameNums.push_back(kf->preKeyFrame->globalFrameNum);
+    frameToWorld.push_back(kf->thisToWorld);
+    for (const TrackedFrameRecord &tracked : kf->trackedFrames) {
+      frameNums.push_back(tracked.globalFrameNum);
+      frameToWorld.push_back(kf->thisToWorld * tracked.baseToThis.inverse());
+    }
 
-    for (const auto &preKeyFrame : kf->trackedFrames) {
+    // Frames are sampled and aligned in parallel, but written in order, so
+    // that the output does not depend on scheduling.
+    struct FramePoints {
       std::vector<Vec3> points;
-      points.reserve(pointsInFrameGT[preKeyFrame->globalFrameNum].size());
-      SE3 frameToWorld = kf->thisToWorld * preKeyFrame->baseToThis.inverse();
-      for (const Vec3 &p : pointsInFrameGT[preKeyFrame->globalFrameNum])
-        points.push_back(frameToWorld * sim3Aligner->alignScale(p));
-      cloudHolder.putPoints(points, colors[preKeyFrame->globalFrameNum]);
-    }
+      std::vector<cv::Vec3b> colors;
+    };
+    int next = 0;
+    auto nextFrame = [&](tbb::flow_control &fc) {
+      if (next == int(frameNums.size()))
+        fc.stop();
+      return next++;
+    };
+    auto sample = [&](int i) {
+      auto frame = std::make_shared<FramePoints>();
+      pointsSource(frameNums[i], frame->points, frame->colors);
+      sim3Aligner->alignToWorld(frameToWorld[i], frame->points);
+      return frame;
+    };
+    auto write = [&](const std::shared_ptr<FramePoints> &frame) {
+      cloudHolder.putPoints(frame->points, frame->colors);
+    };
+    tbb::parallel_pipeline(
+        framesInFlight,
+        tbb::make_filter<void, int>(tbb::filter_mode::serial_in_order,
+                                    nextFrame) &
+            tbb::make_filter<int, std::shared_ptr<FramePoints>>(
+                tbb::filter_mode::parallel, sample) &
+            tbb::make_filter<std::shared_ptr<FramePoints>, void>(
+                tbb::filter_mode::serial_in_order, write));
   }
   cloudHolder.updatePointCount();
 }
@@ -1,98 +1,178 @@
 #include "output/DebugImageDrawer.h"
+#include "system/ProjectedPoints.h"
 
 DEFINE_double(debug_rel_point_size, 0.004,
               "Relative to w+h point size on debug video.");
 DEFINE_int32(debug_image_width, 1200,
-             "Width of the image with tracking residuals.");
+             "Width of the debug image, which is drawn right at this size.");
 DEFINE_double(debug_max_stddev, 6.0,
               "Max predicted stddev when displaying debug image with stddevs.");
 
 namespace fishdso {
 
+namespace {
+
+// Projects the points of the window onto the base keyframe, those of the base
+// keyframe itself only if they are active, the same as
+// DsoSystem::projectOntoBaseKf does.
+void projectOntoBase(const CameraModel *cam,
+                     const std::vector<KeyFrameSnapshot> &window,
+                     int baseIndex,
+                     StdVector<PointSnapshot> KeyFrameSnapshot::*pointsOf,
+                     StdVector<Vec2> &points, std::vector<double> &depths,
+                     std::vector<double> &stddevs) {
+  ProjectedPoints projected(cam);
+  std::vector<std::vector<const PointSnapshot *>> included(window.size());
+  SE3 worldToBase = window[baseIndex].thisToWorld.inverse();
+  for (int k = 0; k < window.size(); ++k) {
+    std::vector<double> x, y, d;
+    for (const PointSnapshot &p : window[k].*pointsOf)
+      if (k != baseIndex || p.isActive) {
+        included[k].push_back(&p);
+        x.push_back(p.p[0]);
+        y.push_back(p.p[1]);
+        d.push_back(p.depth);
+      }
+    if (k == baseIndex)
+      projected.add(nullptr, x, y, d);
+    else {
+      SE3 curToBase = worldToBase * window[k].thisToWorld;
+      projected.add(&curToBase, x, y, d);
+    }
+  }
+
+  points.resize(projected.size());
+  stddevs.resize(projected.size());
+  for (int i = 0; i < projected.size(); ++i) {
+    points[i] = Vec2(projected.x[i], projected.y[i]);
+    stddevs[i] =
+        included[projected.source[i]][projected.sourceIndex[i]]->stddev;
+  }
+  depths = projected.depth;
+}
+
+} // namespace
+
 DebugImageDrawer::DebugImageDrawer()
-    : baseFrame(nullptr)
-    , lastFrame(nullptr) {}
+    : baseIndex(-1)
+    , areOptimizedProjected(false) {}
 
 void DebugImageDrawer::created(DsoSystem *newDso, CameraModel *newCam,
                                const Settings &newSettings) {
-  dso = newDso;
   cam = newCam;
   settings = newSettings;
   residualsDrawer = std::unique_ptr<TrackingDebugImageDrawer>(
       new TrackingDebugImageDrawer(cam->camPyr(settings.pyramid.levelNum),
                                    settings.frameTracker, settings.pyramid));
-  dso->addFrameTrackerObserver(residualsDrawer.get());
+  newDso->addFrameTrackerObserver(residualsDrawer.get());
+}
+
+void DebugImageDrawer::newFrame(const FrameSnapshot &newFrame) {
+  baseToLast = newFrame.baseToThis;
+  lastImage.release();
+}
+
+void DebugImageDrawer::newKeyFrame(const KeyFrameSnapshot &newBaseFrame) {
+  areOptimizedProjected = false;
+  lastImage.release();
 }
 
-void DebugImageDrawer::newFrame(const PreKeyFrame *newFrame) {
-  lastFrame = newFrame;
+void DebugImageDrawer::keyFramesMarginalized(
+    const std::vector<KeyFrameSnapshot> &marginalized) {
+  areOptimizedProjected = false;
 }
 
-void DebugImageDrawer::newKeyFrame(const KeyFrame *newBaseFrame) {
-  baseFrame = newBaseFrame;
+void DebugImageDrawer::frameProcessed(const FrameTimings &timings) {
+  // a deferred adjustment moves the points without a new keyframe
+  if (timings.seconds[FrameTimings::BUNDLE_ADJUSTMENT] > 0)
+    areOptimizedProjected = false;
+  lastImage.release();
+}
+
+void DebugImageDrawer::windowMapped(
+    const std::vector<KeyFrameSnapshot> &newWindow, int newBaseIndex) {
+  window = newWindow;
+  baseIndex = newBaseIndex;
+  lastImage.release();
 }
 
 cv::Mat3b DebugImageDrawer::draw() {
+  if (!lastImage.empty())
+    return lastImage;
+
   int w = cam->getWidth(), h = cam->getHeight();
-  int s = FLAGS_debug_rel_point_size * (w + h) / 2;
+  int cellW = std::max(1, FLAGS_debug_image_width / 2);
+  double scale = double(cellW) / w;
+  int cellH = std::max(1, int(h * scale));
+  int s = std::max(1, int(FLAGS_debug_rel_point_size * (cellW + cellH) / 2));
+  auto toCell = [scale](const Vec2 &p) { return toCvPoint(p, scale, scale); };
 
-  if (!baseFrame || !lastFrame)
-    return cv::Mat3b::zeros(h, w);
+  if (baseIndex < 0 || !baseToLast)
+    return cv::Mat3b::zeros(2 * cellH, 2 * cellW);
 
-  cv::Mat3b base = cvtBgrToGray3(baseFrame->preKeyFrame->frameColored);
+  cv::Mat1b smallGray;
+  cv::resize(window[baseIndex].preKeyFrame->frame(), smallGray,
+             cv::Size(cellW, cellH), 0, 0, cv::INTER_AREA);
+  cv::Mat3b base = cvtGrayToBgr(smallGray);
+  // traced every frame, unlike the optimized points
   StdVector<Vec2> immPt;
-  std::vector<double> immD;
-  std::vector<ImmaturePoint *> immRef;
-  dso->projectOntoBaseKf<ImmaturePoint>(&immPt, &immD, &immRef, nullptr);
-  StdVector<Vec2> optPt;
-  std::vector<double> optD;
-  std::vector<OptimizedPoint *> optRef;
-  dso->projectOntoBaseKf<OptimizedPoint>(&optPt, &optD, &optRef, nullptr);
+  std::vector<double> immD, immStddev;
+  projectOntoBase(cam, window, baseIndex, &KeyFrameSnapshot::immaturePoints,
+                  immPt, immD, immStddev);
+  if (!areOptimizedProjected) {
+    projectOntoBase(cam, window, baseIndex,
+                    &KeyFrameSnapshot::optimizedPoints, optPt, optD,
+                    optStddev);
+    areOptimizedProjected = true;
+  }
+
+  if (!depthBounds) {
+    std::vector<double> allD = immD;
+    allD.insert(allD.end(), optD.begin(), optD.end());
+    if (!allD.empty())
+      depthBounds = depthColBounds(allD, settings.depthColors);
+  }
+  const DepthColBounds bounds = depthBounds.value_or(DepthColBounds());
 
   cv::Mat3b depths = base.clone();
+  // the snapshots have only the immature points traced at least once
   for (int i = 0; i < immPt.size(); ++i)
-    if (immRef[i]->numTraced > 0)
-      putSquare(depths, toCvPoint(immPt[i]), s,
-                depthCol(immD[i], minDepthCol, maxDepthCol), cv::FILLED);
+    putSquare(depths, toCell(immPt[i]), s,
+              depthCol(immD[i], bounds.min, bounds.max), cv::FILLED);
   for (int i = 0; i < optPt.size(); ++i)
-    putSquare(depths, toCvPoint(optPt[i]), s,
-              depthCol(optD[i], minDepthCol, maxDepthCol), cv::FILLED);
+    putSquare(depths, toCell(optPt[i]), s,
+              depthCol(optD[i], bounds.min, bounds.max), cv::FILLED);
 
   cv::Mat3b usefulImg = base.clone();
-  SE3 baseToLast = lastFrame->baseToThis;
   for (int i = 0; i < optPt.size(); ++i) {
     Vec3 p = optD[i] * cam->unmap(optPt[i]).normalized();
-    Vec2 reproj = cam->map(baseToLast * p);
+    Vec2 reproj = cam->map(*baseToLast * p);
     cv::Scalar col = cam->isOnImage(reproj, settings.residualPattern.height)
                          ? CV_GREEN
                          : CV_RED;
-    putSquare(usefulImg, toCvPoint(optPt[i]), s, col, cv::FILLED);
+    putSquare(usefulImg, toCell(optPt[i]), s, col, cv::FILLED);
   }
 
   cv::Mat3b stddevs = base.clone();
   double minStddev = std::sqrt(settings.pointTracer.positionVariance /
                                settings.residualPattern.pattern().size());
-  for (int i = 0; i < immPt.size(); ++i) {
-    double dev = immRef[i]->stddev;
-    if (immRef[i]->numTraced > 0)
-      putSquare(stddevs, toCvPoint(immPt[i]), s,
-                depthCol(dev, minStddev, FLAGS_debug_max_stddev), cv::FILLED);
-  }
-  for (int i = 0; i < optPt.size(); ++i) {
-    double dev = optRef[i]->stddev;
-    putSquare(stddevs, toCvPoint(optPt[i]), s,
-              depthCol(dev, minStddev, FLAGS_debug_max_stddev), cv::FILLED);
-  }
+  for (int i = 0; i < immPt.size(); ++i)
+    putSquare(stddevs, toCell(immPt[i]), s,
+              depthCol(immStddev[i], minStddev, FLAGS_debug_max_stddev),
+              cv::FILLED);
+  for (int i = 0; i < optPt.size(); ++i)
+    putSquare(stddevs, toCell(optPt[i]), s,
+              depthCol(optStddev[i], minStddev, FLAGS_debug_max_stddev),
+              cv::FILLED);
 
-  cv::Mat3b residuals = residualsDrawer->drawFinestLevel();
+  cv::Mat3b residuals =
+      residualsDrawer->drawFinestLevel(cv::Size(cellW, cellH));
 
-  cv::Mat3b row1, row2, resultBig, result;
+  cv::Mat3b row1, row2;
   cv::hconcat(depths, usefulImg, row1);
   cv::hconcat(stddevs, residuals, row2);
-  cv::vconcat(row1, row2, resultBig);
-  int newh = double(resultBig.rows) / resultBig.cols * FLAGS_debug_image_width;
-  cv::resize(resultBig, result, cv::Size(FLAGS_debug_image_width, newh));
-  return result;
+  cv::vconcat(row1, row2, lastImage);
+  return lastImage;
 }
 
 } // namespace fishdso
@@ -0,0 +1,207 @@
+#include "output/DepthMapWriter.h"
+#include "util/Terrain.h"
+#include <algorithm>
+#include <fstream>
+#include <glog/logging.h>
+
+namespace fishdso {
+
+namespace {
+
+constexpr char depthMapMagic[8] = {'F', 'I', 'S', 'H', 'D', 'S', 'O', 'D'};
+constexpr int32_t depthMapVersion = 1;
+
+template <typename T> void putRaw(std::ostream &out, const T &val) {
+  out.write(reinterpret_cast<const char *>(&val), sizeof(T));
+}
+
+template <typename T> bool getRaw(std::istream &in, T &val) {
+  return bool(in.read(reinterpret_cast<char *>(&val), sizeof(T)));
+}
+
+// Appends the values of the tile to the buffer in the given precision.
+void putTile(std::vector<char> &buffer, const cv::Mat1f &values,
+             const cv::Rect &tile, DepthMapWriter::Precision precision) {
+  for (int y = tile.y; y < tile.y + tile.height; ++y) {
+    const float *row = values[y] + tile.x;
+    if (precision == DepthMapWriter::FLOAT32) {
+      const char *bytes = reinterpret_cast<const char *>(row);
+      buffer.insert(buffer.end(), bytes, bytes + tile.width * sizeof(float));
+      continue;
+    }
+    for (int x = 0; x < tile.width; ++x) {
+      uint16_t bits = Eigen::half(row[x]).x;
+      const char *bytes = reinterpret_cast<const char *>(&bits);
+      buffer.insert(buffer.end(), bytes, bytes + sizeof(bits));
+    }
+  }
+}
+
+bool getTile(std::istream &in, cv::Mat1f &values, const cv::Rect &tile,
+             DepthMapWriter::Precision precision) {
+  for (int y = tile.y; y < tile.y + tile.height; ++y) {
+    float *row = values[y] + tile.x;
+    if (precision == DepthMapWriter::FLOAT32) {
+      if (!in.read(reinterpret_cast<char *>(row), tile.width * sizeof(float)))
+        return false;
+      continue;
+    }
+    for (int x = 0; x < tile.width; ++x) {
+      uint16_t bits;
+      if (!getRaw(in, bits))
+        return false;
+      row[x] =
+          float(Eigen::half(Eigen::half_impl::raw_uint16_to_half(bits)));
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+DepthMapWriter::DepthMapWriter(CameraModel *cam,
+                               const std::string &outputDirectory,
+                               Precision precision, int tileSize,
+                               int queueSize,
+                               std::shared_ptr<Scheduler> scheduler)
+    : AsyncObserverAdapter(queueSize, BLOCK, scheduler)
+    , cam(cam)
+    , outputDirectory(outputDirectory)
+    , precision(precision)
+    , tileSize(tileSize) {
+  CHECK_GT(tileSize, 0);
+  fs::create_directories(this->outputDirectory);
+}
+
+DepthMapWriter::~DepthMapWriter() {
+  // the queued writes use the members
+  flush();
+}
+
+void DepthMapWriter::keyFramesMarginalized(
+    const std::vector<const KeyFrame *> &marginalized) {
+  for (const KeyFrame *kf : marginalized) {
+    StdVector<Vec2> points;
+    std::vector<double> depths, stddevs;
+    for (const auto &op : kf->optimizedPoints) {
+      if (op->state != OptimizedPoint::ACTIVE ||
+          !std::isfinite(op->logInvDepth))
+        continue;
+      points.push_back(op->p);
+      depths.push_back(op->depth());
+      stddevs.push_back(op->stddev);
+    }
+    addDepthMap(kf->preKeyFrame->globalFrameNum, kf->thisToWorld, points,
+                depths, stddevs);
+  }
+}
+
+void DepthMapWriter::destructed(
+    const std::vector<const KeyFrame *> &lastKeyFrames) {
+  keyFramesMarginalized(lastKeyFrames);
+  flush();
+}
+
+void DepthMapWriter::addDepthMap(int frameNum, const SE3 &frameToWorld,
+                                 const StdVector<Vec2> &points,
+                                 const std::vector<double> &depths,
+                                 const std::vector<double> &stddevs) {
+  CHECK_EQ(points.size(), depths.size());
+  CHECK_EQ(points.size(), stddevs.size());
+  enqueue(
+      [this, frameNum, frameToWorld, points, depths, stddevs]() {
+        write(frameNum, frameToWorld, points, depths, stddevs);
+      },
+      false);
+}
+
+std::string DepthMapWriter::fileName(int frameNum) const {
+  return (outputDirectory / ("depth" + std::to_string(frameNum) + ".bin"))
+      .string();
+}
+
+void DepthMapWriter::write(int frameNum, const SE3 &frameToWorld,
+                           const StdVector<Vec2> &points,
+                           const std::vector<double> &depths,
+                           const std::vector<double> &stddevs) const {
+  const int width = cam->getWidth(), height = cam->getHeight();
+  cv::Mat1f depth(height, width, 0.0f), confidence(height, width, 0.0f);
+  // a triangle is needed to interpolate anything
+  if (points.size() >= 3) {
+    Terrain terrain(cam, points, depths);
+    terrain.denseDepths(width, height).convertTo(depth, CV_32F);
+    std::vector<double> pointConfidences(stddevs.size());
+    for (int i = 0; i < stddevs.size(); ++i)
+      pointConfidences[i] = 1 / (1 + stddevs[i]);
+    terrain.denseValues(pointConfidences, width, height)
+        .convertTo(confidence, CV_32F);
+  }
+
+  std::vector<char> buffer;
+  for (int ty = 0; ty < height; ty += tileSize)
+    for (int tx = 0; tx < width; tx += tileSize) {
+      cv::Rect tile(tx, ty, std::min(tileSize, width - tx),
+                    std::min(tileSize, height - ty));
+      putTile(buffer, depth, tile, precision);
+      putTile(buffer, confidence, tile, precision);
+    }
+
+  fs::path fname = fileName(frameNum);
+  fs::path tmpFname = fname;
+  tmpFname += ".tmp";
+  {
+    std::ofstream ofs(tmpFname, std::ios_base::out | std::ios_base::binary);
+    CHECK(ofs.good()) << "could not create " << tmpFname;
+    ofs.write(depthMapMagic, sizeof(depthMapMagic));
+    putRaw(ofs, depthMapVersion);
+    putRaw(ofs, int32_t(precision));
+    putRaw(ofs, int32_t(frameNum));
+    putRaw(ofs, int32_t(width));
+    putRaw(ofs, int32_t(height));
+    putRaw(ofs, int32_t(tileSize));
+    Eigen::Matrix<double, 3, 4, Eigen::RowMajor> pose =
+        frameToWorld.matrix3x4();
+    ofs.write(reinterpret_cast<const char *>(pose.data()),
+              pose.size() * sizeof(double));
+    ofs.write(buffer.data(), buffer.size());
+  }
+  fs::rename(tmpFname, fname);
+}
+
+DepthMapWriter::DepthMap DepthMapWriter::read(const std::string &fname) {
+  std::ifstream ifs(fname, std::ios_base::in | std::ios_base::binary);
+  CHECK(ifs.good()) << "could not open " << fname;
+  char magic[sizeof(depthMapMagic)];
+  int32_t version, precision, frameNum, width, height, tileSize;
+  CHECK(ifs.read(magic, sizeof(magic)) &&
+        std::equal(magic, magic + sizeof(magic), depthMapMagic))
+      << fname << " is not a depth map";
+  CHECK(getRaw(ifs, version) && version == depthMapVersion)
+      << "unsupported depth map version in " << fname;
+  CHECK(getRaw(ifs, precision) && getRaw(ifs, frameNum) &&
+        getRaw(ifs, width) && getRaw(ifs, height) && getRaw(ifs, tileSize))
+      << "truncated header in " << fname;
+  CHECK(precision == FLOAT32 || precision == FLOAT16);
+  CHECK_GT(tileSize, 0);
+  Eigen::Matrix<double, 3, 4, Eigen::RowMajor> pose;
+  CHECK(ifs.read(reinterpret_cast<char *>(pose.data()),
+                 pose.size() * sizeof(double)))
+      << "truncated header in " << fname;
+
+  DepthMap result;
+  result.frameNum = frameNum;
+  result.frameToWorld = SE3(pose.leftCols<3>(), pose.col(3));
+  result.depth.create(height, width);
+  result.confidence.create(height, width);
+  for (int ty = 0; ty < height; ty += tileSize)
+    for (int tx = 0; tx < width; tx += tileSize) {
+      cv::Rect tile(tx, ty, std::min(tileSize, width - tx),
+                    std::min(tileSize, height - ty));
+      CHECK(getTile(ifs, result.depth, tile, Precision(precision)) &&
+            getTile(ifs, result.confidence, tile, Precision(precision)))
+          << "truncated depth map " << fname;
+    }
+  return result;
+}
+
+} // namespace fishdso
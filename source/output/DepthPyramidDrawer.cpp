@@ -7,25 +7,33 @@ DEFINE_int32(pyr_image_width, 1200, "Width of the debug image pyramid.");
 
 namespace fishdso {
 
-cv::Mat draw(const DepthedImagePyramid &pyr) {
+cv::Mat draw(const DepthedImagePyramid &pyr, const DepthColBounds &bounds) {
   std::vector<cv::Mat3b> images(pyr.images.size());
   for (int i = 0; i < pyr.images.size(); ++i) {
     int s = FLAGS_pyr_rel_point_size * (pyr[i].cols + pyr[i].rows) / 2;
     images[i] = cvtGrayToBgr(pyr[i]);
-    for (int y = 0; y < pyr.depths[i].rows; ++y)
-      for (int x = 0; x < pyr.depths[i].cols; ++x)
-        if (pyr.depths[i](y, x) > 0)
-          putSquare(images[i], cv::Point(x, y), s,
-                    depthCol(pyr.depths[i](y, x), minDepthCol, maxDepthCol),
-                    cv::FILLED);
+    const DepthedImagePyramid::DepthedPoints &level = pyr.points[i];
+    for (int j = 0; j < level.size(); ++j)
+      putSquare(images[i], cv::Point(level.x[j], level.y[j]), s,
+                depthCol(level.depth[j], bounds.min, bounds.max),
+                cv::FILLED);
   }
-  return drawLeveled(images.data(), pyr.depths.size(), pyr[0].cols, pyr[0].rows,
+  return drawLeveled(images.data(), pyr.points.size(), pyr[0].cols, pyr[0].rows,
                      FLAGS_pyr_image_width);
 }
 
+DepthPyramidDrawer::DepthPyramidDrawer(
+    const Settings::DepthColors &depthColors)
+    : depthColors(depthColors) {}
+
 void DepthPyramidDrawer::newBaseFrame(const DepthedImagePyramid &pyr) {
+  if (!depthBounds && pyr.points[0].size() > 0) {
+    const std::vector<float> &depth = pyr.points[0].depth;
+    std::vector<double> depthD(depth.begin(), depth.end());
+    depthBounds = depthColBounds(depthD, depthColors);
+  }
   mPyrChanged = true;
-  lastPyr = draw(pyr);
+  lastPyr = draw(pyr, depthBounds.value_or(DepthColBounds()));
 }
 
 bool DepthPyramidDrawer::pyrChanged() { return mPyrChanged; }
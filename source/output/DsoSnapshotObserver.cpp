@@ -0,0 +1,70 @@
+#include "output/DsoSnapshotObserver.h"
+#include <cmath>
+
+namespace fishdso {
+
+KeyFrameSnapshot::KeyFrameSnapshot(const KeyFrame &keyFrame)
+    : globalFrameNum(keyFrame.preKeyFrame->globalFrameNum)
+    , thisToWorld(keyFrame.thisToWorld)
+    , lightWorldToThis(keyFrame.lightWorldToThis)
+    , preKeyFrame(keyFrame.preKeyFrame) {
+  optimizedPoints.reserve(keyFrame.optimizedPoints.size());
+  for (const auto &op : keyFrame.optimizedPoints)
+    if (std::isfinite(op->logInvDepth))
+      optimizedPoints.push_back({op->p, op->depth(), op->stddev,
+                                 op->state == OptimizedPoint::ACTIVE});
+  for (const auto &ip : keyFrame.immaturePoints)
+    if (ip->numTraced > 0)
+      immaturePoints.push_back(
+          {ip->p, ip->depth, ip->stddev, ip->state == ImmaturePoint::ACTIVE});
+}
+
+FrameSnapshot::FrameSnapshot(const PreKeyFrame &frame)
+    : globalFrameNum(frame.globalFrameNum)
+    , baseToThis(frame.baseToThis)
+    , lightBaseToThis(frame.lightBaseToThis)
+    , trackRmse(frame.trackRmse) {}
+
+std::vector<KeyFrameSnapshot>
+takeSnapshots(const std::vector<const KeyFrame *> &keyFrames) {
+  std::vector<KeyFrameSnapshot> snapshots;
+  snapshots.reserve(keyFrames.size());
+  for (const KeyFrame *kf : keyFrames)
+    snapshots.emplace_back(*kf);
+  return snapshots;
+}
+
+void DsoSnapshotObserver::initialized(
+    const std::vector<const KeyFrame *> &initializedKFs) {
+  initialized(takeSnapshots(initializedKFs));
+}
+
+void DsoSnapshotObserver::newFrame(const PreKeyFrame *frame) {
+  newFrame(FrameSnapshot(*frame));
+}
+
+void DsoSnapshotObserver::newKeyFrame(const KeyFrame *baseFrame) {
+  newKeyFrame(KeyFrameSnapshot(*baseFrame));
+}
+
+void DsoSnapshotObserver::keyFramesMarginalized(
+    const std::vector<const KeyFrame *> &marginalized) {
+  keyFramesMarginalized(takeSnapshots(marginalized));
+}
+
+void DsoSnapshotObserver::globalBundleAdjusted(
+    const std::vector<const KeyFrame *> &keyFrames) {
+  globalBundleAdjusted(takeSnapshots(keyFrames));
+}
+
+void DsoSnapshotObserver::windowMapped(
+    const std::vector<const KeyFrame *> &window, int baseIndex) {
+  windowMapped(takeSnapshots(window), baseIndex);
+}
+
+void DsoSnapshotObserver::destructed(
+    const std::vector<const KeyFrame *> &lastKeyFrames) {
+  destructed(takeSnapshots(lastKeyFrames));
+}
+
+} // namespace fishdso
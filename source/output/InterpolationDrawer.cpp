@@ -3,8 +3,10 @@
 
 namespace fishdso {
 
-InterpolationDrawer::InterpolationDrawer(CameraModel *cam)
+InterpolationDrawer::InterpolationDrawer(
+    CameraModel *cam, const Settings::DepthColors &depthColors)
     : cam(cam)
+    , depthColors(depthColors)
     , mDidInitialize(false) {}
 
 void InterpolationDrawer::initialized(
@@ -15,11 +17,10 @@ void InterpolationDrawer::initialized(
   ipDepths.reserve(lastKeyFrame->immaturePoints.size());
   for (const auto &ip : lastKeyFrame->immaturePoints)
     ipDepths.push_back(ip->depth);
-  setDepthColBounds(ipDepths);
+  DepthColBounds bounds = depthColBounds(ipDepths, depthColors);
 
-  result = lastKeyFrame->preKeyFrame->frameColored.clone();
-  insertDepths(result, keyPoints, keyPointDepths, minDepthCol, maxDepthCol,
-               true);
+  result = lastKeyFrame->preKeyFrame->frameColored().clone();
+  insertDepths(result, keyPoints, keyPointDepths, bounds.min, bounds.max, true);
 
   // cv::circle(img, cv::Point(1268, 173), 7, CV_BLACK, 2);
 
@@ -33,8 +34,8 @@ void InterpolationDrawer::initialized(
     d.push_back(ip->depth);
   }
 
-  lastTerrain->draw(result, cam, CV_GREEN, minDepthCol, maxDepthCol);
-  insertDepths(result, pnts, d, minDepthCol, maxDepthCol, false);
+  lastTerrain->draw(result, cam, CV_GREEN, bounds.min, bounds.max);
+  insertDepths(result, pnts, d, bounds.min, bounds.max, false);
 
   mDidInitialize = true;
 }
@@ -0,0 +1,255 @@
+#include "output/MapTileWriter.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <glog/logging.h>
+#include <limits>
+
+namespace fishdso {
+
+namespace {
+
+int floorDiv(int a, int b) {
+  return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+template <typename T> void putRaw(std::ostream &out, const T &val) {
+  out.write(reinterpret_cast<const char *>(&val), sizeof(T));
+}
+
+template <typename T> bool getRaw(std::istream &in, T &val) {
+  return bool(in.read(reinterpret_cast<char *>(&val), sizeof(T)));
+}
+
+} // namespace
+
+MapTileWriter::MapTileWriter(CameraModel *cam,
+                             const std::string &outputDirectory,
+                             double voxelSize, int tileVoxels, int levelNum,
+                             int maxVoxels, int flushEvery,
+                             PlyHolder::Format format)
+    : cam(cam)
+    , outputDirectory(outputDirectory)
+    , voxelSize(voxelSize)
+    , tileVoxels(tileVoxels)
+    , levelNum(levelNum)
+    , maxVoxels(maxVoxels)
+    , flushEvery(flushEvery)
+    , format(format) {
+  CHECK_GT(voxelSize, 0);
+  CHECK_GE(levelNum, 1);
+  CHECK_EQ(tileVoxels % (1 << (levelNum - 1)), 0)
+      << "the coarsest level should split the tiles evenly";
+  CHECK_LE(double(tileVoxels) * tileVoxels * tileVoxels,
+           double(std::numeric_limits<int>::max()));
+  for (int l = 0; l < levelNum; ++l)
+    fs::create_directories(this->outputDirectory / std::to_string(l));
+  fs::create_directories(this->outputDirectory / "state");
+}
+
+void MapTileWriter::keyFramesMarginalized(
+    const std::vector<const KeyFrame *> &marginalized) {
+  for (const KeyFrame *kf : marginalized) {
+    std::vector<Vec3> points;
+    std::vector<cv::Vec3b> colors;
+    const cv::Mat3b &frameColored = kf->preKeyFrame->frameColored();
+
+    for (const auto &op : kf->optimizedPoints) {
+      points.push_back(kf->thisToWorld *
+                       (op->depth() * cam->unmap(op->p).normalized()));
+      colors.push_back(frameColored(toCvPoint(op->p)));
+    }
+    for (const auto &ip : kf->immaturePoints) {
+      if (ip->numTraced > 0) {
+        points.push_back(kf->thisToWorld *
+                         (ip->depth * cam->unmap(ip->p).normalized()));
+        colors.push_back(frameColored(toCvPoint(ip->p)));
+      }
+    }
+    addPoints(points, colors);
+
+    if (++marginalizedCount % flushEvery == 0)
+      flush();
+  }
+}
+
+void MapTileWriter::destructed(
+    const std::vector<const KeyFrame *> &lastKeyFrames) {
+  keyFramesMarginalized(lastKeyFrames);
+  flush();
+}
+
+void MapTileWriter::addPoints(const std::vector<Vec3> &points,
+                              const std::vector<cv::Vec3b> &colors) {
+  CHECK_EQ(points.size(), colors.size());
+  for (int i = 0; i < points.size(); ++i) {
+    Vec3 scaled = points[i] / voxelSize;
+    if (!scaled.allFinite() ||
+        scaled.cwiseAbs().maxCoeff() >= std::numeric_limits<int>::max())
+      continue;
+    int v[3];
+    TileKey key;
+    int *keyCoords[3] = {&key.x, &key.y, &key.z};
+    for (int k = 0; k < 3; ++k) {
+      int voxel = int(std::floor(scaled[k]));
+      *keyCoords[k] = floorDiv(voxel, tileVoxels);
+      v[k] = voxel - *keyCoords[k] * tileVoxels;
+    }
+
+    Tile &tile = tiles[key];
+    if (tile.isEvicted)
+      restore(key, tile);
+    Voxel &voxel = tile.voxels[(v[0] * tileVoxels + v[1]) * tileVoxels + v[2]];
+    if (voxel.count == 0)
+      ++heldVoxels;
+    voxel.positionSum += points[i];
+    voxel.colorSum += Vec3(colors[i][0], colors[i][1], colors[i][2]);
+    ++voxel.count;
+    tile.isDirty = true;
+    tile.lastTouched = marginalizedCount;
+  }
+
+  if (heldVoxels > maxVoxels)
+    evictOldest();
+}
+
+void MapTileWriter::flush() {
+  for (auto &[key, tile] : tiles) {
+    if (tile.isDirty && !tile.isEvicted) {
+      writeTile(key, tile, tile.levelPointCounts);
+      tile.isDirty = false;
+    }
+  }
+  writeIndex();
+}
+
+std::string MapTileWriter::tileName(const TileKey &key) const {
+  return std::to_string(key.x) + "_" + std::to_string(key.y) + "_" +
+         std::to_string(key.z);
+}
+
+void MapTileWriter::writeTile(const TileKey &key, const Tile &tile,
+                              std::vector<int> &levelPointCounts) const {
+  levelPointCounts.resize(levelNum);
+  const int sq = tileVoxels * tileVoxels;
+  for (int l = 0; l < levelNum; ++l) {
+    std::unordered_map<int, Voxel> level;
+    if (l == 0)
+      level = tile.voxels;
+    else {
+      for (const auto &[index, voxel] : tile.voxels) {
+        int x = (index / sq) >> l, y = (index / tileVoxels % tileVoxels) >> l,
+            z = (index % tileVoxels) >> l;
+        Voxel &coarse = level[(x * tileVoxels + y) * tileVoxels + z];
+        coarse.positionSum += voxel.positionSum;
+        coarse.colorSum += voxel.colorSum;
+        coarse.count += voxel.count;
+      }
+    }
+
+    std::vector<Vec3> points;
+    std::vector<cv::Vec3b> colors;
+    points.reserve(level.size());
+    colors.reserve(level.size());
+    for (const auto &[index, voxel] : level) {
+      points.push_back(voxel.positionSum / voxel.count);
+      Vec3 color = voxel.colorSum / voxel.count;
+      colors.push_back(cv::Vec3b(std::round(color[0]), std::round(color[1]),
+                                 std::round(color[2])));
+    }
+
+    fs::path fname =
+        outputDirectory / std::to_string(l) / (tileName(key) + ".ply");
+    fs::path tmpFname = fname;
+    tmpFname += ".tmp";
+    {
+      PlyHolder holder(tmpFname.string(), format);
+      holder.putPoints(points, colors);
+    }
+    fs::rename(tmpFname, fname);
+    levelPointCounts[l] = points.size();
+  }
+}
+
+void MapTileWriter::writeIndex() const {
+  fs::path fname = outputDirectory / "tiles.txt";
+  fs::path tmpFname = outputDirectory / "tiles.txt.tmp";
+  {
+    std::ofstream ofs(tmpFname);
+    ofs.precision(15);
+    ofs << voxelSize << ' ' << tileVoxels << ' ' << levelNum << '\n';
+    for (const auto &[key, tile] : tiles) {
+      if (tile.levelPointCounts.empty())
+        continue;
+      ofs << key.x << ' ' << key.y << ' ' << key.z;
+      for (int count : tile.levelPointCounts)
+        ofs << ' ' << count;
+      ofs << '\n';
+    }
+  }
+  fs::rename(tmpFname, fname);
+}
+
+void MapTileWriter::evict(const TileKey &key, Tile &tile) {
+  if (tile.isDirty) {
+    writeTile(key, tile, tile.levelPointCounts);
+    tile.isDirty = false;
+  }
+
+  std::ofstream ofs(outputDirectory / "state" / (tileName(key) + ".vox"),
+                    std::ios_base::binary);
+  putRaw(ofs, int32_t(tile.voxels.size()));
+  for (const auto &[index, voxel] : tile.voxels) {
+    putRaw(ofs, int32_t(index));
+    putRaw(ofs, voxel.positionSum);
+    putRaw(ofs, voxel.colorSum);
+    putRaw(ofs, int32_t(voxel.count));
+  }
+  CHECK(ofs.good()) << "could not evict tile " << tileName(key);
+
+  heldVoxels -= tile.voxels.size();
+  tile.voxels = {};
+  tile.isEvicted = true;
+}
+
+void MapTileWriter::restore(const TileKey &key, Tile &tile) {
+  fs::path fname = outputDirectory / "state" / (tileName(key) + ".vox");
+  {
+    std::ifstream ifs(fname, std::ios_base::binary);
+    int32_t size;
+    CHECK(getRaw(ifs, size)) << "could not restore tile " << tileName(key);
+    tile.voxels.reserve(size);
+    for (int i = 0; i < size; ++i) {
+      int32_t index, count;
+      Voxel voxel;
+      CHECK(getRaw(ifs, index) && getRaw(ifs, voxel.positionSum) &&
+            getRaw(ifs, voxel.colorSum) && getRaw(ifs, count))
+          << "truncated state of tile " << tileName(key);
+      voxel.count = count;
+      tile.voxels[index] = voxel;
+    }
+  }
+  fs::remove(fname);
+  heldVoxels += tile.voxels.size();
+  tile.isEvicted = false;
+}
+
+void MapTileWriter::evictOldest() {
+  std::vector<std::pair<int, TileKey>> held;
+  for (const auto &[key, tile] : tiles)
+    if (!tile.isEvicted && !tile.voxels.empty())
+      held.push_back({tile.lastTouched, key});
+  std::sort(held.begin(), held.end(), [](const auto &a, const auto &b) {
+    return a.first != b.first ? a.first < b.first : a.second < b.second;
+  });
+
+  // leaving some room, so that every keyframe does not evict
+  const int target = maxVoxels - maxVoxels / 4;
+  for (const auto &[lastTouched, key] : held) {
+    if (heldVoxels <= target)
+      break;
+    evict(key, tiles[key]);
+  }
+}
+
+} // namespace fishdso
@@ -0,0 +1,73 @@
+#include "output/ProfileWriter.h"
+#include "util/util.h"
+#include <iomanip>
+
+namespace fishdso {
+
+ProfileWriter::ProfileWriter(const std::string &outputDirectory,
+                             const std::string &fileName, Format format)
+    : ofs(fileInDir(outputDirectory, fileName))
+    , format(format) {
+  ofs << std::setprecision(9);
+  // bucket is set for histograms only, seconds for timers only, bytes (the
+  // live ones) for memory only
+  if (format == CSV)
+    ofs << "frame,keyframe,kind,name,bucket,count,seconds,bytes\n";
+}
+
+void ProfileWriter::frameProfiled(const FrameProfile &profile) {
+  if (format == CSV)
+    writeCsv(profile);
+  else
+    writeJson(profile);
+  ofs.flush();
+}
+
+void ProfileWriter::writeCsv(const FrameProfile &profile) {
+  std::string prefix = std::to_string(profile.globalFrameNum) + ',' +
+                       (profile.isKeyFrame ? '1' : '0') + ',';
+  for (const auto &timer : profile.timers)
+    ofs << prefix << "timer," << timer.name << ",," << timer.calls << ','
+        << timer.seconds << ",\n";
+  for (const auto &counter : profile.counters)
+    ofs << prefix << "counter," << counter.name << ",," << counter.value
+        << ",,\n";
+  for (const auto &hist : profile.histograms)
+    for (int b = 0; b < hist.buckets.size(); ++b)
+      ofs << prefix << "histogram," << hist.name << ',' << b << ','
+          << hist.buckets[b] << ",,\n";
+  for (const auto &memory : profile.memory)
+    ofs << prefix << "memory," << memory.name << ",," << memory.allocations
+        << ",," << memory.liveBytes << '\n';
+}
+
+void ProfileWriter::writeJson(const FrameProfile &profile) {
+  ofs << "{\"frame\": " << profile.globalFrameNum
+      << ", \"keyframe\": " << (profile.isKeyFrame ? "true" : "false")
+      << ", \"timers\": {";
+  for (int i = 0; i < profile.timers.size(); ++i)
+    ofs << (i > 0 ? ", " : "") << '"' << profile.timers[i].name
+        << "\": {\"calls\": " << profile.timers[i].calls
+        << ", \"seconds\": " << profile.timers[i].seconds << '}';
+  ofs << "}, \"counters\": {";
+  for (int i = 0; i < profile.counters.size(); ++i)
+    ofs << (i > 0 ? ", " : "") << '"' << profile.counters[i].name
+        << "\": " << profile.counters[i].value;
+  ofs << "}, \"histograms\": {";
+  for (int i = 0; i < profile.histograms.size(); ++i) {
+    const auto &hist = profile.histograms[i];
+    ofs << (i > 0 ? ", " : "") << '"' << hist.name << "\": {\"min\": "
+        << hist.min << ", \"max\": " << hist.max << ", \"buckets\": [";
+    for (int b = 0; b < hist.buckets.size(); ++b)
+      ofs << (b > 0 ? ", " : "") << hist.buckets[b];
+    ofs << "]}";
+  }
+  ofs << "}, \"memory\": {";
+  for (int i = 0; i < profile.memory.size(); ++i)
+    ofs << (i > 0 ? ", " : "") << '"' << profile.memory[i].name
+        << "\": {\"liveBytes\": " << profile.memory[i].liveBytes
+        << ", \"allocations\": " << profile.memory[i].allocations << '}';
+  ofs << "}}\n";
+}
+
+} // namespace fishdso
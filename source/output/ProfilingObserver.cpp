@@ -0,0 +1,7 @@
+#include "output/ProfilingObserver.h"
+
+namespace fishdso {
+
+ProfilingObserver::~ProfilingObserver() {}
+
+} // namespace fishdso
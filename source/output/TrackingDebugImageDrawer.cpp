@@ -16,39 +16,68 @@ TrackingDebugImageDrawer::TrackingDebugImageDrawer(
     : frameTrackerSettings(frameTrackerSettings)
     , pyrSettings(pyrSettings)
     , camPyr(camPyr)
-    , residualsImg(
-          pyrSettings.levelNum,
-          cv::Mat3b::zeros(camPyr[0].getHeight(), camPyr[0].getWidth())) {}
+    , levelResiduals(pyrSettings.levelNum)
+    , isLevelTracked(pyrSettings.levelNum, false) {}
 
 void TrackingDebugImageDrawer::startTracking(const ImagePyramid &frame) {
   curFramePyr = frame.images;
-  residualsImg.resize(0);
-  residualsImg.resize(pyrSettings.levelNum);
+  for (auto &residuals : levelResiduals)
+    residuals.clear();
+  isLevelTracked.assign(pyrSettings.levelNum, false);
 }
 
 void TrackingDebugImageDrawer::levelTracked(
     int levelNum, const SE3 &baseToLast,
     const AffineLightTransform<double> &affLightBaseToLast,
-    const StdVector<std::pair<Vec2, double>> &pointResiduals) {
-  int w = camPyr[levelNum].getWidth(), h = camPyr[levelNum].getHeight();
-  int s = FLAGS_tracking_rel_point_size * (w + h) / 2;
-  cv::cvtColor(curFramePyr[levelNum], residualsImg[levelNum],
-               cv::COLOR_GRAY2BGR);
-
-  for (const auto &[point, res] : pointResiduals)
-    if (camPyr[levelNum].isOnImage(point, s))
-      putSquare(residualsImg[levelNum], toCvPoint(point), s,
-                depthCol(std::abs(res), 0, FLAGS_debug_max_residual), cv::FILLED);
+    const StdVector<std::pair<Vec2, double>> &pointResiduals, int iterations,
+    double time) {
+  levelResiduals[levelNum] = pointResiduals;
+  isLevelTracked[levelNum] = true;
+}
+
+cv::Mat3b TrackingDebugImageDrawer::drawLevel(int levelNum,
+                                              cv::Size size) const {
+  const CameraModel &cam = camPyr[levelNum];
+  if (curFramePyr.empty())
+    return cv::Mat3b::zeros(size);
+
+  cv::Mat1b gray;
+  if (size == curFramePyr[levelNum].size())
+    gray = curFramePyr[levelNum];
+  else
+    cv::resize(curFramePyr[levelNum], gray, size, 0, 0, cv::INTER_AREA);
+  cv::Mat3b result = cvtGrayToBgr(gray);
+
+  double scaleX = double(size.width) / cam.getWidth(),
+         scaleY = double(size.height) / cam.getHeight();
+  int s = FLAGS_tracking_rel_point_size * (cam.getWidth() + cam.getHeight()) /
+          2;
+  int drawnS = std::max(1, int(s * scaleX));
+  for (const auto &[point, res] : levelResiduals[levelNum])
+    if (cam.isOnImage(point, s))
+      putSquare(result, toCvPoint(point, scaleX, scaleY), drawnS,
+                depthCol(std::abs(res), 0, FLAGS_debug_max_residual),
+                cv::FILLED);
+  return result;
 }
 
 cv::Mat3b TrackingDebugImageDrawer::drawAllLevels() {
-  return drawLeveled(residualsImg.data(), residualsImg.size(),
-                     camPyr[0].getWidth(), camPyr[0].getHeight(),
-                     FLAGS_tracking_res_image_width);
+  std::vector<cv::Mat3b> images(pyrSettings.levelNum);
+  for (int l = 0; l < images.size(); ++l)
+    images[l] = drawLevel(
+        l, cv::Size(camPyr[l].getWidth(), camPyr[l].getHeight()));
+  return drawLeveled(images.data(), images.size(), camPyr[0].getWidth(),
+                     camPyr[0].getHeight(), FLAGS_tracking_res_image_width);
 }
 
-cv::Mat3b TrackingDebugImageDrawer::drawFinestLevel() {
-  return residualsImg[0];
+cv::Mat3b TrackingDebugImageDrawer::drawFinestLevel(cv::Size size) {
+  if (size.empty())
+    size = cv::Size(camPyr[0].getWidth(), camPyr[0].getHeight());
+  // the finest level might have been skipped by the tracker
+  for (int l = 0; l < isLevelTracked.size(); ++l)
+    if (isLevelTracked[l])
+      return drawLevel(l, size);
+  return cv::Mat3b::zeros(size);
 }
 
 } // namespace fishdso
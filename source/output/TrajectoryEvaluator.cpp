@@ -0,0 +1,151 @@
+#include "output/TrajectoryEvaluator.h"
+#include <cmath>
+#include <fstream>
+#include <glog/logging.h>
+
+namespace fishdso {
+
+TrajectoryEvaluator::TrajectoryEvaluator(const StdVector<SE3> &worldToFrameGT,
+                                         int rpeDelta,
+                                         const std::string &summaryFileName,
+                                         const std::string &runName)
+    : worldToFrameGT(worldToFrameGT)
+    , rpeDelta(rpeDelta)
+    , summaryFileName(summaryFileName)
+    , runName(runName)
+    , frameCount(0)
+    , originX(Vec3::Zero())
+    , originY(Vec3::Zero())
+    , sumX(Vec3::Zero())
+    , sumY(Vec3::Zero())
+    , sumYX(Mat33::Zero())
+    , sumSqX(0)
+    , sumSqY(0)
+    , rpePairNum(0)
+    , sumSqRelX(0)
+    , sumRelDot(0)
+    , sumSqRelY(0)
+    , sumSqRotErr(0) {
+  CHECK_GT(rpeDelta, 0);
+}
+
+void TrajectoryEvaluator::posesFlushed(const PoseHistory::Chunk &chunk) {
+  for (const FramePose &pose : chunk) {
+    if (!pose.isEstimated)
+      continue;
+    if (pose.frameNum < 0 || pose.frameNum >= worldToFrameGT.size()) {
+      LOG_FIRST_N(WARNING, 1)
+          << "no ground truth for frame #" << pose.frameNum;
+      continue;
+    }
+    const SE3 &poseGT = worldToFrameGT[pose.frameNum];
+
+    Vec3 x = pose.worldToFrame.inverse().translation();
+    Vec3 y = poseGT.inverse().translation();
+    if (frameCount == 0) {
+      originX = x;
+      originY = y;
+    }
+    x -= originX;
+    y -= originY;
+    sumX += x;
+    sumY += y;
+    sumYX += y * x.transpose();
+    sumSqX += x.squaredNorm();
+    sumSqY += y.squaredNorm();
+    frameCount++;
+
+    auto pairIt = recent.find(pose.frameNum - rpeDelta);
+    if (pairIt != recent.end()) {
+      const Recorded &first = pairIt->second;
+      SE3 relX = pose.worldToFrame * first.worldToFrame.inverse();
+      SE3 relY = poseGT * first.worldToFrameGT.inverse();
+      const Vec3 &tx = relX.translation();
+      const Vec3 &ty = relY.translation();
+      sumSqRelX += tx.squaredNorm();
+      sumRelDot += tx.dot(ty);
+      sumSqRelY += ty.squaredNorm();
+      double rotErr = (relY.so3().inverse() * relX.so3()).log().norm();
+      sumSqRotErr += rotErr * rotErr;
+      rpePairNum++;
+    }
+    recent.erase(recent.begin(),
+                 recent.upper_bound(pose.frameNum - rpeDelta));
+    recent[pose.frameNum] = {pose.frameNum, pose.worldToFrame, poseGT};
+  }
+}
+
+void TrajectoryEvaluator::destructed(
+    const std::vector<KeyFrameSnapshot> &lastKeyFrames) {
+  if (summaryFileName.empty())
+    return;
+  std::ofstream ofs(summaryFileName, std::ios_base::app);
+  writeSummary(ofs);
+}
+
+bool TrajectoryEvaluator::solveAlignment(Mat33 &rotation, double &scale,
+                                         Vec3 &translation) const {
+  if (frameCount < 3)
+    return false;
+  const double n = frameCount;
+  Vec3 meanX = sumX / n, meanY = sumY / n;
+  Mat33 cov = sumYX / n - meanY * meanX.transpose();
+  double varX = sumSqX / n - meanX.squaredNorm();
+  if (varX <= 0)
+    return false;
+
+  Eigen::JacobiSVD<Mat33> svd(cov, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  Vec3 s(1, 1, 1);
+  if (svd.matrixU().determinant() * svd.matrixV().determinant() < 0)
+    s[2] = -1;
+  rotation = svd.matrixU() * s.asDiagonal() * svd.matrixV().transpose();
+  scale = svd.singularValues().dot(s) / varX;
+  translation = meanY - scale * rotation * meanX;
+  return true;
+}
+
+TrajectoryEvaluator::Summary TrajectoryEvaluator::summary() const {
+  Summary result = {frameCount, rpePairNum, 0, 0, 0, 0};
+  Mat33 R;
+  double s;
+  Vec3 t;
+  if (!solveAlignment(R, s, t))
+    return result;
+  result.scale = s;
+
+  // sum of |y - s R x - t|^2 over the frames, expanded
+  double sqErr = sumSqY + s * s * sumSqX + frameCount * t.squaredNorm() -
+                 2 * s * (R * sumYX.transpose()).trace() - 2 * t.dot(sumY) +
+                 2 * s * t.dot(R * sumX);
+  result.ateRmse = std::sqrt(std::max(0.0, sqErr) / frameCount);
+
+  if (rpePairNum > 0) {
+    double sqTransErr = s * s * sumSqRelX - 2 * s * sumRelDot + sumSqRelY;
+    result.rpeTransRmse = std::sqrt(std::max(0.0, sqTransErr) / rpePairNum);
+    result.rpeRotRmse = std::sqrt(sumSqRotErr / rpePairNum) * 180 / M_PI;
+  }
+  return result;
+}
+
+Sim3 TrajectoryEvaluator::alignment() const {
+  Mat33 R;
+  double s;
+  Vec3 t;
+  if (!solveAlignment(R, s, t))
+    return Sim3();
+  // the sums are over the positions relative to the origins
+  return Sim3(Sophus::RxSO3d(s, SO3(R)), t + originY - s * R * originX);
+}
+
+void TrajectoryEvaluator::writeSummary(std::ostream &os) const {
+  Summary result = summary();
+  os << "{\"run\": \"" << runName << "\", \"frames\": " << result.frameCount
+     << ", \"rpe_delta\": " << rpeDelta
+     << ", \"rpe_pairs\": " << result.rpePairNum
+     << ", \"scale\": " << result.scale
+     << ", \"ate_rmse\": " << result.ateRmse
+     << ", \"rpe_trans_rmse\": " << result.rpeTransRmse
+     << ", \"rpe_rot_rmse_deg\": " << result.rpeRotRmse << "}\n";
+}
+
+} // namespace fishdso
@@ -4,49 +4,36 @@ namespace fishdso {
 
 TrajectoryWriter::TrajectoryWriter(const std::string &outputDirectory,
                                    const std::string &fileName,
-                                   const std::string &matrixFormFileName)
-    : outputFileName(fileInDir(outputDirectory, fileName))
-    , matrixFormOutputFileName(fileInDir(outputDirectory, matrixFormFileName)) {
-}
-
-void TrajectoryWriter::newKeyFrame(const KeyFrame *keyFrame) {
-  curKfNums.insert(keyFrame->preKeyFrame->globalFrameNum);
-}
-
-void TrajectoryWriter::keyFramesMarginalized(
-    const std::vector<const KeyFrame *> &marginalized) {
-  for (const KeyFrame *kf : marginalized)
-    curKfNums.erase(kf->preKeyFrame->globalFrameNum);
-
-  for (const KeyFrame *kf : marginalized) {
-    SE3 baseToWorld = kf->thisToWorld;
-    frameToWorldPool.insert({kf->preKeyFrame->globalFrameNum, baseToWorld});
-    for (const auto &preKeyFrame : kf->trackedFrames)
-      frameToWorldPool.insert(
-          {preKeyFrame->globalFrameNum,
-           baseToWorld * preKeyFrame->baseToThis.inverse()});
+                                   const std::string &matrixFormFileName,
+                                   RecordStream *records)
+    : records(records) {
+  if (!records) {
+    posesOfs.open(fileInDir(outputDirectory, fileName), std::ios_base::app);
+    matrixFormOfs.open(fileInDir(outputDirectory, matrixFormFileName),
+                       std::ios_base::app);
   }
+}
 
-  std::ofstream posesOfs(outputFileName, std::ios_base::app);
-  std::ofstream matrixFormOfs(matrixFormOutputFileName, std::ios_base::app);
-  int minKfNum = curKfNums.empty() ? INF : (*curKfNums.begin());
-  auto it = frameToWorldPool.begin();
-  while (it != frameToWorldPool.end() && it->first < minKfNum) {
-    mWrittenFrameToWorld.push_back(it->second);
-    putInMatrixForm(matrixFormOfs, it->second);
+void TrajectoryWriter::posesFlushed(const PoseHistory::Chunk &chunk) {
+  for (const FramePose &pose : chunk) {
+    if (!pose.isEstimated)
+      continue;
+    SE3 frameToWorld = pose.worldToFrame.inverse();
+    mWrittenFrameToWorld.push_back(frameToWorld);
+    if (records) {
+      records->putPose(pose.frameNum, pose.timestamp, pose.worldToFrame);
+      continue;
+    }
+    putInMatrixForm(matrixFormOfs, frameToWorld);
     matrixFormOfs << '\n';
 
-    posesOfs << it->first << ' ';
-    putMotion(posesOfs, it->second.inverse());
+    posesOfs << pose.frameNum << ' ';
+    putMotion(posesOfs, pose.worldToFrame);
     posesOfs << '\n';
-
-    it = frameToWorldPool.erase(it);
   }
-}
-
-void TrajectoryWriter::destructed(
-    const std::vector<const KeyFrame *> &lastKeyFrames) {
-  keyFramesMarginalized(lastKeyFrames);
+  // the chunks come rarely, and the files should be readable during the run
+  posesOfs.flush();
+  matrixFormOfs.flush();
 }
 
 } // namespace fishdso
@@ -13,13 +13,13 @@ TrajectoryWriterGT::TrajectoryWriterGT(
 }
 
 void TrajectoryWriterGT::initialized(
-    const std::vector<const KeyFrame *> &initializedKFs) {
+    const std::vector<KeyFrameSnapshot> &initializedKFs) {
   CHECK(initializedKFs.size() > 1);
 
-  SE3 worldToFirst = initializedKFs[0]->thisToWorld.inverse();
-  SE3 worldToLast = initializedKFs.back()->thisToWorld.inverse();
-  int firstNum = initializedKFs[0]->preKeyFrame->globalFrameNum;
-  int lastNum = initializedKFs.back()->preKeyFrame->globalFrameNum;
+  SE3 worldToFirst = initializedKFs[0].thisToWorld.inverse();
+  SE3 worldToLast = initializedKFs.back().thisToWorld.inverse();
+  int firstNum = initializedKFs[0].globalFrameNum;
+  int lastNum = initializedKFs.back().globalFrameNum;
   SE3 worldToFirstGT = worldToFrameGT[firstNum];
   SE3 worldToLastGT = worldToFrameGT[lastNum];
 
@@ -30,36 +30,21 @@ void TrajectoryWriterGT::initialized(
     pose = sim3Aligner->alignWorldToFrameGT(pose);
 }
 
-void TrajectoryWriterGT::keyFramesMarginalized(
-    const std::vector<const KeyFrame *> &marginalized) {
+void TrajectoryWriterGT::posesFlushed(const PoseHistory::Chunk &chunk) {
   std::ofstream posesOfs(outputFileName, std::ios_base::app);
   std::ofstream matrixFormOfs(matrixFormOutputFileName, std::ios_base::app);
 
-  for (const KeyFrame *kf : marginalized) {
-    putInMatrixForm(
-        matrixFormOfs,
-        worldToFrameUnalignedGT[kf->preKeyFrame->globalFrameNum].inverse());
+  for (const FramePose &pose : chunk) {
+    if (!pose.isEstimated)
+      continue;
+    putInMatrixForm(matrixFormOfs,
+                    worldToFrameUnalignedGT[pose.frameNum].inverse());
     matrixFormOfs << '\n';
 
-    posesOfs << kf->preKeyFrame->globalFrameNum << ' ';
-    putMotion(posesOfs, worldToFrameGT[kf->preKeyFrame->globalFrameNum]);
+    posesOfs << pose.frameNum << ' ';
+    putMotion(posesOfs, worldToFrameGT[pose.frameNum]);
     posesOfs << '\n';
-    for (const auto &preKeyFrame : kf->trackedFrames) {
-      putInMatrixForm(
-          matrixFormOfs,
-          worldToFrameUnalignedGT[preKeyFrame->globalFrameNum].inverse());
-      matrixFormOfs << '\n';
-
-      posesOfs << preKeyFrame->globalFrameNum << ' ';
-      putMotion(posesOfs, worldToFrameGT[preKeyFrame->globalFrameNum]);
-      posesOfs << '\n';
-    }
   }
 }
 
-void TrajectoryWriterGT::destructed(
-    const std::vector<const KeyFrame *> &lastKeyFrames) {
-  keyFramesMarginalized(lastKeyFrames);
-}
-
 } // namespace fishdso
@@ -1,305 +1,819 @@
 #include "system/BundleAdjuster.h"
-#include "PreKeyFrameInternals.h"
 #include "system/AffineLightTransform.h"
 #include "system/SphericalPlus.h"
+#include "util/MemoryAccounting.h"
+#include "util/Log.h"
+#include "util/Profiler.h"
+#include "util/Scheduler.h"
 #include "util/defs.h"
 #include "util/geometry.h"
 #include "util/util.h"
+#include <algorithm>
 #include <ceres/ceres.h>
-#include <ceres/cubic_interpolation.h>
+#include <ceres/evaluation_callback.h>
 #include <ceres/local_parameterization.h>
+#include <functional>
+#include <tbb/parallel_for.h>
+#include <tuple>
 
 namespace fishdso {
 
+// Pose of the reference keyframe relative to the base one, shared by all of
+// the residuals of the pair. The jacobian is that of the rotation matrix
+// entries, row-major, and the translation wrt the base translation, base
+// rotation, reference translation and reference rotation blocks.
+struct PosePair {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  static constexpr int poseParams = 3 + 4 + 3 + 4;
+  typedef Eigen::Matrix<double, 12, poseParams, Eigen::RowMajor> Jacobian;
+
+  PosePair(KeyFrame *base, KeyFrame *ref)
+      : base(base)
+      , ref(ref) {
+    update(false);
+  }
+
+  template <typename T>
+  static void compose(const T *baseTransP, const T *baseRotP,
+                      const T *refTransP, const T *refRotP,
+                      Eigen::Matrix<T, 3, 3> &rot,
+                      Eigen::Matrix<T, 3, 1> &trans) {
+    typedef Eigen::Matrix<T, 3, 1> Vec3t;
+    typedef Eigen::Quaternion<T> Quatt;
+    Eigen::Map<const Vec3t> baseTrans(baseTransP), refTrans(refTransP);
+    Eigen::Map<const Quatt> baseRot(baseRotP), refRot(refRotP);
+    Quatt worldToRef = refRot.conjugate();
+    rot = (worldToRef * baseRot).toRotationMatrix();
+    trans = worldToRef * Vec3t(baseTrans - refTrans);
+  }
+
+  void update(bool withJacobian) {
+    const double *params[4] = {base->thisToWorld.translation().data(),
+                               base->thisToWorld.so3().data(),
+                               ref->thisToWorld.translation().data(),
+                               ref->thisToWorld.so3().data()};
+    const int sizes[4] = {3, 4, 3, 4};
+    if (!withJacobian) {
+      compose(params[0], params[1], params[2], params[3], rot, trans);
+      return;
+    }
+
+    typedef ceres::Jet<double, poseParams> Jett;
+    Jett jets[poseParams];
+    const Jett *jetParams[4];
+    for (int b = 0, j = 0; b < 4; ++b) {
+      jetParams[b] = jets + j;
+      for (int i = 0; i < sizes[b]; ++i, ++j)
+        jets[j] = Jett(params[b][i], j);
+    }
+    Eigen::Matrix<Jett, 3, 3> rotJet;
+    Eigen::Matrix<Jett, 3, 1> transJet;
+    compose(jetParams[0], jetParams[1], jetParams[2], jetParams[3], rotJet,
+            transJet);
+    for (int r = 0; r < 3; ++r) {
+      for (int k = 0; k < 3; ++k) {
+        rot(r, k) = rotJet(r, k).a;
+        jacobian.row(3 * r + k) = rotJet(r, k).v.transpose();
+      }
+      trans[r] = transJet[r].a;
+      jacobian.row(9 + r) = transJet[r].v.transpose();
+    }
+  }
+
+  KeyFrame *base;
+  KeyFrame *ref;
+  Mat33 rot;
+  Vec3 trans;
+  Jacobian jacobian;
+};
+
+// Recomputes the relative poses of all keyframe pairs before Ceres evaluates
+// the residuals, which then only compose them with the points.
+class PosePairCache : public ceres::EvaluationCallback {
+public:
+  PosePair *get(KeyFrame *base, KeyFrame *ref) {
+    auto &pair = pairs[{base, ref}];
+    if (!pair)
+      pair.reset(new PosePair(base, ref));
+    return pair.get();
+  }
+
+  void remove(KeyFrame *keyFrame) {
+    for (auto it = pairs.begin(); it != pairs.end();)
+      if (it->first.first == keyFrame || it->first.second == keyFrame)
+        it = pairs.erase(it);
+      else
+        ++it;
+  }
+
+  void PrepareForEvaluation(bool evaluateJacobians,
+                            bool newEvaluationPoint) override {
+    if (newEvaluationPoint)
+      areJacobiansValid = false;
+    if (!newEvaluationPoint && (!evaluateJacobians || areJacobiansValid))
+      return;
+    for (auto &[kfs, pair] : pairs)
+      pair->update(evaluateJacobians);
+    areJacobiansValid = evaluateJacobians;
+  }
+
+private:
+  std::map<std::pair<KeyFrame *, KeyFrame *>, std::unique_ptr<PosePair>> pairs;
+  bool areJacobiansValid = false;
+};
+
 BundleAdjuster::BundleAdjuster(CameraModel *cam,
                                const BundleAdjusterSettings &_settings)
     : cam(cam)
-    , firstKeyFrame(nullptr)
-    , settings(_settings) {}
+    , posePairs(new PosePairCache())
+    , gaugeFirst(nullptr)
+    , gaugeSecond(nullptr)
+    , settings(_settings) {
+  ceres::Problem::Options options;
+  options.enable_fast_removal = true;
+#if CERES_VERSION_MAJOR >= 2
+  options.evaluation_callback = posePairs.get();
+#endif
+  problem.reset(new ceres::Problem(options));
+}
 
-bool BundleAdjuster::isOOB(const SE3 &baseToWorld, const SE3 &refToWorld,
-                           const OptimizedPoint &baseOP) {
-  Vec3 inBase = cam->unmap(baseOP.p).normalized() * baseOP.depth();
-  Vec2 reproj = cam->map(refToWorld.inverse() * baseToWorld * inBase);
+BundleAdjuster::~BundleAdjuster() = default;
+
+bool BundleAdjuster::isOOB(const SE3 &baseToRef, const Vec3 &rayInBase,
+                           double depth) const {
+  Vec2 reproj = cam->map(baseToRef * (depth * rayInBase));
   return !cam->isOnImage(reproj, settings.residualPattern.height);
 }
 
 void BundleAdjuster::addKeyFrame(KeyFrame *keyFrame) {
-  if (firstKeyFrame == nullptr)
-    firstKeyFrame = keyFrame;
-  keyFrames.insert(keyFrame);
+  if (std::find(keyFrames.begin(), keyFrames.end(), keyFrame) !=
+      keyFrames.end())
+    return;
+  keyFrames.push_back(keyFrame);
+
+  problem->AddParameterBlock(keyFrame->thisToWorld.translation().data(), 3);
+  problem->AddParameterBlock(keyFrame->thisToWorld.so3().data(), 4,
+                             new ceres::EigenQuaternionParameterization());
+  auto affLight = keyFrame->lightWorldToThis.data;
+  problem->AddParameterBlock(affLight, 2);
+  problem->SetParameterLowerBound(affLight, 0,
+                                  settings.affineLight.minAffineLightA);
+  problem->SetParameterUpperBound(affLight, 0,
+                                  settings.affineLight.maxAffineLightA);
+  problem->SetParameterLowerBound(affLight, 1,
+                                  settings.affineLight.minAffineLightB);
+  problem->SetParameterUpperBound(affLight, 1,
+                                  settings.affineLight.maxAffineLightB);
+
+  if (!settings.affineLight.optimizeAffineLight)
+    problem->SetParameterBlockConstant(affLight);
+}
+
+void BundleAdjuster::removeResidualsOnto(KeyFrame *refFrame) {
+  for (auto &[op, residuals] : residualsFor) {
+    auto it = residuals.find(refFrame);
+    if (it == residuals.end())
+      continue;
+    problem->RemoveResidualBlock(it->second.id);
+    residuals.erase(it);
+  }
+}
+
+void BundleAdjuster::removeKeyFrame(KeyFrame *keyFrame) {
+  auto kfIt = std::find(keyFrames.begin(), keyFrames.end(), keyFrame);
+  if (kfIt == keyFrames.end())
+    return;
+  keyFrames.erase(kfIt);
+
+  // removing a parameter block removes all residuals depending on it
+  for (const auto &op : keyFrame->optimizedPoints) {
+    if (problem->HasParameterBlock(&op->logInvDepth))
+      problem->RemoveParameterBlock(&op->logInvDepth);
+    residualsFor.erase(op.get());
+  }
+  for (auto &[op, residuals] : residualsFor)
+    residuals.erase(keyFrame);
+  problem->RemoveParameterBlock(keyFrame->thisToWorld.translation().data());
+  problem->RemoveParameterBlock(keyFrame->thisToWorld.so3().data());
+  problem->RemoveParameterBlock(keyFrame->lightWorldToThis.data);
+  posePairs->remove(keyFrame);
+
+  if (gaugeFirst == keyFrame)
+    gaugeFirst = nullptr;
+  if (gaugeSecond == keyFrame)
+    gaugeSecond = nullptr;
 }
 
-struct DirectResidual {
+void BundleAdjuster::updateGauge() {
+  KeyFrame *first = keyFrames[0];
+  KeyFrame *second = keyFrames[1];
+
+  if (first != gaugeFirst) {
+    problem->SetParameterBlockConstant(first->thisToWorld.translation().data());
+    problem->SetParameterBlockConstant(first->thisToWorld.so3().data());
+    problem->SetParameterBlockConstant(first->lightWorldToThis.data);
+    gaugeFirst = first;
+  }
+
+  if (second != gaugeSecond) {
+    // A parameterization cannot be replaced on a block that is already in the
+    // problem, so the translation block of the new second keyframe is
+    // recreated. This drops its residuals, they are added back below.
+    double *trans = second->thisToWorld.translation().data();
+    for (const auto &op : second->optimizedPoints)
+      residualsFor.erase(op.get());
+    removeResidualsOnto(second);
+    problem->RemoveParameterBlock(trans);
+
+    SE3 firstToWorld = first->thisToWorld;
+    SE3 secondToWorld = second->thisToWorld;
+    double radius =
+        (secondToWorld.translation() - firstToWorld.translation()).norm();
+    Vec3 center = firstToWorld.translation();
+    problem->AddParameterBlock(
+        trans, 3,
+        new ceres::AutoDiffLocalParameterization<SphericalPlus, 3, 2>(
+            new SphericalPlus(center, radius, secondToWorld.translation())));
+    gaugeSecond = second;
+  }
+
+  bool isMotionFixed = settings.bundleAdjuster.fixedMotionOnFirstAdjustent &&
+                       keyFrames.size() == 2;
+  if (isMotionFixed) {
+    problem->SetParameterBlockConstant(
+        second->thisToWorld.translation().data());
+    problem->SetParameterBlockConstant(second->thisToWorld.so3().data());
+    problem->SetParameterBlockConstant(second->lightWorldToThis.data);
+  } else {
+    problem->SetParameterBlockVariable(
+        second->thisToWorld.translation().data());
+    if (!settings.bundleAdjuster.fixedRotationOnSecondKF)
+      problem->SetParameterBlockVariable(second->thisToWorld.so3().data());
+    if (settings.affineLight.optimizeAffineLight)
+      problem->SetParameterBlockVariable(second->lightWorldToThis.data);
+  }
+  if (settings.bundleAdjuster.fixedRotationOnSecondKF)
+    problem->SetParameterBlockConstant(second->thisToWorld.so3().data());
+}
+
+struct BaResidualsMemory {
+  static constexpr const char *name = "memory.baResiduals";
+};
+
+// All residuals of a point's pattern projected onto one keyframe, with
+// analytic jacobians. The relative pose and its jacobian wrt the keyframe
+// poses come from the pair shared by all of the points, so evaluating a
+// residual takes one projection per pattern pixel and no allocations.
+// Per-pixel gradient weights and Huber norms cannot be expressed with a loss
+// function on a multidimensional block, so each component is robustified in
+// place: its square equals the weighted Huber cost of the corresponding pixel.
+// The residuals are booked by their own size, the Ceres problem owns them.
+// Ceres only evaluates the jacobians at the points it accepts, so the
+// differences of the last such evaluation are kept for the outlier
+// classification, which then needs no evaluations of its own.
+struct DirectResidual
+    : public ceres::CostFunction,
+      CountedObject<BaResidualsMemory, DirectResidual> {
+  // The pattern of a point on its base frame, shared by the residuals of the
+  // point on all of the reference frames.
+  struct BasePattern {
+    StdVector<Vec3> directions;
+    std::vector<double> intencities;
+    std::vector<double> sqrtWeights;
+
+    BasePattern(const BicubicTiles &baseFrame,
+                const PreKeyFrame &basePreKeyFrame, const CameraModel &cam,
+                const OptimizedPoint &optimizedPoint,
+                const StdVector<Vec2> &pattern, double gradWeightingC)
+        : directions(pattern.size())
+        , intencities(pattern.size())
+        , sqrtWeights(pattern.size()) {
+      const double c = gradWeightingC;
+      for (int i = 0; i < pattern.size(); ++i) {
+        const Vec2 &pos = optimizedPoint.p + pattern[i];
+        directions[i] = cam.unmap(pos).normalized();
+        baseFrame.evaluate(pos[1], pos[0], &intencities[i]);
+        double weight =
+            c / std::hypot(c, basePreKeyFrame.gradNorm(toCvPoint(pos)));
+        sqrtWeights[i] = std::sqrt(weight);
+      }
+    }
+  };
+
+  // derivatives of an intencity difference wrt the log inverse depth, the
+  // relative pose entries as in PosePair and the affine light parameters
+  struct DiffGradient {
+    double logInvDepth;
+    Eigen::Matrix<double, 1, 12> pose;
+    double baseAff[2];
+    double refAff[2];
+  };
+
+  // The reference frame is sampled through refCube if it is given.
   DirectResidual(
-      ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>> *baseFrame,
-      ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>> *refFrame,
-      const CameraModel *cam, OptimizedPoint *optimizedPoint, const Vec2 &pos,
-      KeyFrame *baseKf, KeyFrame *refKf)
+      const BasePattern &basePattern, const BicubicTiles *refFrame,
+      const CubeMapImage *refCube, const CameraModel *cam,
+      OptimizedPoint *optimizedPoint, double huberThreshold,
+      const PosePair *posePair, KeyFrame *baseKf, KeyFrame *refKf)
       : cam(cam)
-      , baseDirection(cam->unmap(pos).normalized())
+      , baseDirections(basePattern.directions)
+      , baseIntencities(basePattern.intencities)
+      , sqrtWeights(basePattern.sqrtWeights)
+      , huberThreshold(huberThreshold)
       , refFrame(refFrame)
+      , refCube(refCube)
+      , posePair(posePair)
       , optimizedPoint(optimizedPoint)
       , baseKf(baseKf)
-      , refKf(refKf) {
-    baseFrame->Evaluate(pos[1], pos[0], &baseIntencity);
+      , refKf(refKf)
+      , lastDiffs(basePattern.directions.size())
+      , lastResiduals(basePattern.directions.size()) {
+    set_num_residuals(baseDirections.size());
+    *mutable_parameter_block_sizes() = {1, 3, 4, 3, 4, 2, 2};
   }
 
-  template <typename T>
-  bool operator()(const T *const logInvDepthP, const T *const baseTransP,
-                  const T *const baseRotP, const T *const refTransP,
-                  const T *const refRotP, const T *const baseAffP,
-                  const T *const refAffP, T *res) const {
-    typedef Eigen::Matrix<T, 2, 1> Vec2t;
-    typedef Eigen::Matrix<T, 3, 1> Vec3t;
-    typedef Eigen::Matrix<T, 3, 3> Mat33t;
-    typedef Eigen::Quaternion<T> Quatt;
-    typedef Sophus::SE3<T> SE3t;
+  EIGEN_STRONG_INLINE int size() const { return baseDirections.size(); }
+
+  // From now on the residual keeps the values of its last evaluation and
+  // has zero jacobians, so it still adds the same cost to every step Ceres
+  // compares, but takes no part in them. Should not be called during an
+  // evaluation.
+  void freeze() { isFrozen = true; }
 
-    Eigen::Map<const Vec3t> baseTransM(baseTransP);
-    Vec3t baseTrans(baseTransM);
-    Eigen::Map<const Quatt> baseRotM(baseRotP);
-    Quatt baseRot(baseRotM);
-    SE3t baseToWorld(baseRot, baseTrans);
+  // The values of the last evaluation belong to the previous solve, whose
+  // state the keyframes of the window may have moved from since.
+  void resetLastEvaluation() {
+    std::fill(lastDiffs.begin(), lastDiffs.end(), 0.0);
+    std::fill(lastResiduals.begin(), lastResiduals.end(), 0.0);
+    hasLastDiffs = false;
+  }
 
-    Eigen::Map<const Vec3t> refTransM(refTransP);
-    Vec3t refTrans(refTransM);
-    Eigen::Map<const Quatt> refRotM(refRotP);
-    Quatt refRot(refRotM);
-    SE3t refToWorld(refRot, refTrans);
+  // raw intencity difference for the i-th pattern pixel
+  double intencityDiff(int i, double depth, const Mat33 &baseToRefRot,
+                       const Vec3 &baseToRefTrans, const double *baseAff,
+                       const double *refAff, DiffGradient *grad) const {
+    Vec3 rotated = baseToRefRot * baseDirections[i];
+    Vec3 refPos = depth * rotated + baseToRefTrans;
+    double tracked;
+    Eigen::Matrix<double, 1, 3> dPos;
+    if (refCube)
+      refCube->evaluate(refPos, &tracked, grad ? &dPos : nullptr);
+    else {
+      Vec2 refPosMapped;
+      Mat23 mapJacobian;
+      if (grad)
+        std::tie(refPosMapped, mapJacobian) = cam->diffMap(refPos);
+      else
+        refPosMapped = cam->map(refPos.data());
+      double trackedDy, trackedDx;
+      refFrame->evaluate(refPosMapped[1], refPosMapped[0], &tracked,
+                         &trackedDy, &trackedDx);
+      if (grad)
+        dPos = Eigen::Matrix<double, 1, 2>(trackedDx, trackedDy) * mapJacobian;
+    }
 
-    const T *baseAffLightP = baseAffP;
-    AffineLightTransform<T> baseAffLight(baseAffLightP[0], baseAffLightP[1]);
+    // as AffineLightTransform::normalizeMultiplier makes it, the reference
+    // transform only shifts and the base one is relative to it
+    const double baseMult = std::exp(baseAff[0] - refAff[0]);
+    const double baseTransformed = baseMult * (baseIntencities[i] + baseAff[1]);
+    if (grad) {
+      grad->logInvDepth = -depth * dPos.dot(rotated);
+      for (int r = 0; r < 3; ++r)
+        for (int k = 0; k < 3; ++k)
+          grad->pose[3 * r + k] = dPos[r] * depth * baseDirections[i][k];
+      grad->pose.tail<3>() = dPos;
+      grad->baseAff[0] = -baseTransformed;
+      grad->baseAff[1] = -baseMult;
+      grad->refAff[0] = baseTransformed;
+      grad->refAff[1] = 1;
+    }
+    return tracked + refAff[1] - baseTransformed;
+  }
 
-    const T *refAffLightP = refAffP;
-    AffineLightTransform<T> refAffLight(refAffLightP[0], refAffLightP[1]);
+  // raw intencity differences for all pattern pixels
+  void intencityDiffs(double logInvDepth, const SE3 &baseToRef,
+                      const double *baseAff, const double *refAff,
+                      double *diffs) const {
+    const double depth = std::exp(-logInvDepth);
+    const Mat33 rot = baseToRef.rotationMatrix();
+    for (int i = 0; i < size(); ++i)
+      diffs[i] = intencityDiff(i, depth, rot, baseToRef.translation(), baseAff,
+                               refAff, nullptr);
+  }
 
-    AffineLightTransform<T>::normalizeMultiplier(refAffLight, baseAffLight);
+  bool Evaluate(double const *const *parameters, double *residuals,
+                double **jacobians) const override {
+    if (isFrozen) {
+      std::copy(lastResiduals.begin(), lastResiduals.end(), residuals);
+      if (jacobians)
+        for (int b = 0; b < parameter_block_sizes().size(); ++b)
+          if (jacobians[b])
+            std::fill(jacobians[b],
+                      jacobians[b] + size() * parameter_block_sizes()[b], 0.0);
+      return true;
+    }
 
-    T depth = ceres::exp(-(*logInvDepthP));
-    Vec3t refPos = (refToWorld.inverse() * baseToWorld) *
-                   (baseDirection.cast<T>() * depth);
-    Vec2t refPosMapped = cam->map(refPos.data()).template cast<T>();
-    T trackedIntensity;
-    refFrame->Evaluate(refPosMapped[1], refPosMapped[0], &trackedIntensity);
-    *res = refAffLight(trackedIntensity) - baseAffLight(T(baseIntencity));
+    const double depth = std::exp(-parameters[0][0]);
+    const double k = huberThreshold;
+    DiffGradient grad;
+    for (int i = 0; i < size(); ++i) {
+      double diff =
+          intencityDiff(i, depth, posePair->rot, posePair->trans, parameters[5],
+                        parameters[6], jacobians ? &grad : nullptr);
+      if (jacobians)
+        lastDiffs[i] = diff;
+
+      double absDiff = std::abs(diff);
+      double robustDerivative = 1;
+      if (absDiff > k) {
+        double robust = std::sqrt(2.0 * k * absDiff - k * k);
+        diff = diff < 0 ? -robust : robust;
+        robustDerivative = k / robust;
+      }
+      residuals[i] = sqrtWeights[i] * diff;
+
+      if (!jacobians)
+        continue;
+      lastResiduals[i] = residuals[i];
+      const double s = sqrtWeights[i] * robustDerivative;
+      if (jacobians[0])
+        jacobians[0][i] = s * grad.logInvDepth;
+      Eigen::Matrix<double, 1, PosePair::poseParams> dPose =
+          s * grad.pose * posePair->jacobian;
+      const int poseOffsets[4] = {0, 3, 7, 10}, poseSizes[4] = {3, 4, 3, 4};
+      for (int b = 0; b < 4; ++b)
+        if (jacobians[1 + b])
+          for (int j = 0; j < poseSizes[b]; ++j)
+            jacobians[1 + b][poseSizes[b] * i + j] = dPose[poseOffsets[b] + j];
+      for (int j = 0; j < 2; ++j) {
+        if (jacobians[5])
+          jacobians[5][2 * i + j] = s * grad.baseAff[j];
+        if (jacobians[6])
+          jacobians[6][2 * i + j] = s * grad.refAff[j];
+      }
+    }
+    if (jacobians)
+      hasLastDiffs = true;
 
     return true;
   }
 
   const CameraModel *cam;
-  Vec3 baseDirection;
-  double baseIntencity;
-  ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>> *refFrame;
+  StdVector<Vec3> baseDirections;
+  std::vector<double> baseIntencities;
+  std::vector<double> sqrtWeights;
+  double huberThreshold;
+  const BicubicTiles *refFrame;
+  const CubeMapImage *refCube;
+  const PosePair *posePair;
   OptimizedPoint *optimizedPoint;
   KeyFrame *baseKf;
   KeyFrame *refKf;
+
+  // the raw differences and the residuals of the last evaluation with
+  // jacobians
+  mutable std::vector<double> lastDiffs;
+  mutable std::vector<double> lastResiduals;
+  mutable bool hasLastDiffs = false;
+  bool isFrozen = false;
 };
 
-void BundleAdjuster::adjust(int maxNumIterations) {
-  int pointsTotal = 0, pointsOOB = 0, pointsOutliers = 0;
+// Calls a function after every iteration of a solve.
+class IterationFunction : public ceres::IterationCallback {
+public:
+  IterationFunction(
+      std::function<void(const ceres::IterationSummary &)> function)
+      : function(function) {}
+
+  ceres::CallbackReturnType
+  operator()(const ceres::IterationSummary &summary) override {
+    function(summary);
+    return ceres::SOLVER_CONTINUE;
+  }
+
+private:
+  std::function<void(const ceres::IterationSummary &)> function;
+};
 
-  KeyFrame *secondKeyFrame = nullptr;
-  for (auto kf : keyFrames)
-    if (kf != firstKeyFrame) {
-      secondKeyFrame = kf;
-      break;
+int BundleAdjuster::updateResiduals(KeyFrame *baseFrame) {
+  // The rays of the points are unmapped once for all of the keyframe pairs,
+  // and the pairs whose cameras cannot see any of the points are skipped as
+  // a whole.
+  const auto &points = baseFrame->optimizedPoints;
+  StdVector<Vec3> rays(points.size());
+  StdVector<Vec3> finiteRays;
+  std::vector<double> finiteDepths;
+  for (int i = 0; i < points.size(); ++i) {
+    rays[i] = cam->unmap(points[i]->p).normalized();
+    if (std::isfinite(points[i]->logInvDepth)) {
+      finiteRays.push_back(rays[i]);
+      finiteDepths.push_back(points[i]->depth());
     }
+  }
+  RayCone cone(finiteRays, finiteDepths);
 
-  std::shared_ptr<ceres::ParameterBlockOrdering> ordering(
-      new ceres::ParameterBlockOrdering());
+  StdVector<SE3> baseToRef(keyFrames.size());
+  std::vector<bool> maybeSeen(keyFrames.size(), false);
+  for (int k = 0; k < keyFrames.size(); ++k) {
+    if (keyFrames[k] == baseFrame)
+      continue;
+    baseToRef[k] = keyFrames[k]->thisToWorld.inverse() * baseFrame->thisToWorld;
+    maybeSeen[k] = cone.maybeSeenFrom(baseToRef[k], cam->getMaxAngle());
+    if (!maybeSeen[k])
+      PROFILE_COUNT("ba.culledPairs", 1);
+  }
 
-  ceres::Problem problem;
+  // Everything that does not touch the problem is done in parallel, into
+  // arrays indexed by the point and the keyframe: the OOB tests and the new
+  // residuals, with the base pattern computed once per point. Only the
+  // registration with the problem is left serial.
+  const int kfNum = keyFrames.size();
+  const StdVector<Vec2> &pattern = settings.residualPattern.pattern();
+  const BicubicTiles *baseTiles = baseFrame->imageTiles.get();
+  std::vector<const BicubicTiles *> refTiles(kfNum, nullptr);
+  std::vector<const CubeMapImage *> refCubes(kfNum, nullptr);
+  std::vector<PosePair *> pairs(kfNum, nullptr);
+  for (int k = 0; k < kfNum; ++k)
+    if (keyFrames[k] != baseFrame && maybeSeen[k]) {
+      refTiles[k] = keyFrames[k]->imageTiles.get();
+      if (settings.bundleAdjuster.prewarpKeyFrames) {
+        if (!keyFrames[k]->cubeMap) {
+          PROFILE_SCOPE("ba.prewarp");
+          keyFrames[k]->cubeMap.reset(
+              new CubeMapImage(*cam, keyFrames[k]->preKeyFrame->frame(),
+                               settings.bundleAdjuster.prewarpScale));
+        }
+        refCubes[k] = keyFrames[k]->cubeMap.get();
+      }
+      pairs[k] = posePairs->get(baseFrame, keyFrames[k]);
+    }
+  std::vector<PointResiduals *> pointResiduals(points.size(), nullptr);
+  // the pruned outliers do not come back
+  const bool skipOutliers = settings.bundleAdjuster.pruneOutliers;
+  for (int pi = 0; pi < points.size(); ++pi)
+    if (std::isfinite(points[pi]->logInvDepth) &&
+        !(skipOutliers && points[pi]->state == OptimizedPoint::OUTLIER))
+      pointResiduals[pi] = &residualsFor[points[pi].get()];
+
+  std::vector<char> isVisible(points.size() * kfNum, false);
+  std::vector<DirectResidual *> newResiduals(points.size() * kfNum, nullptr);
+  ParallelExecutor(settings.threading, Scheduler::MAPPING).execute([&]() {
+    PROFILE_SCOPE("ba.residualSetup");
+    tbb::parallel_for(0, int(points.size()), [&](int pi) {
+      if (!pointResiduals[pi])
+        return;
+      OptimizedPoint *op = points[pi].get();
+      const PointResiduals &residuals = *pointResiduals[pi];
+      const double depth = op->depth();
+      std::unique_ptr<DirectResidual::BasePattern> basePattern;
+      for (int k = 0; k < kfNum; ++k) {
+        KeyFrame *refFrame = keyFrames[k];
+        if (refFrame == baseFrame || !maybeSeen[k] ||
+            isOOB(baseToRef[k], rays[pi], depth))
+          continue;
+        isVisible[pi * kfNum + k] = true;
+        if (residuals.count(refFrame))
+          continue;
+        if (!basePattern)
+          basePattern.reset(new DirectResidual::BasePattern(
+              *baseTiles, *baseFrame->preKeyFrame, *cam, *op, pattern,
+              settings.gradWeighting.c));
+        newResiduals[pi * kfNum + k] = new DirectResidual(
+            *basePattern, refTiles[k], refCubes[k], cam, op,
+            settings.intencity.outlierDiff, pairs[k], baseFrame, refFrame);
+      }
+    });
+  });
 
-  for (KeyFrame *keyFrame : keyFrames) {
-    problem.AddParameterBlock(keyFrame->thisToWorld.translation().data(), 3);
-    problem.AddParameterBlock(keyFrame->thisToWorld.so3().data(), 4,
-                              new ceres::EigenQuaternionParameterization());
-    auto affLight = keyFrame->lightWorldToThis.data;
-    problem.AddParameterBlock(affLight, 2);
-    problem.SetParameterLowerBound(affLight, 0,
-                                   settings.affineLight.minAffineLightA);
-    problem.SetParameterUpperBound(affLight, 0,
-                                   settings.affineLight.maxAffineLightA);
-    problem.SetParameterLowerBound(affLight, 1,
-                                   settings.affineLight.minAffineLightB);
-    problem.SetParameterUpperBound(affLight, 1,
-                                   settings.affineLight.maxAffineLightB);
-
-    if (!settings.affineLight.optimizeAffineLight)
-      problem.SetParameterBlockConstant(affLight);
+  int pointsOOB = 0;
+  for (int pi = 0; pi < points.size(); ++pi) {
+    if (!pointResiduals[pi])
+      continue;
+    const auto &op = points[pi];
+
+    if (!problem->HasParameterBlock(&op->logInvDepth)) {
+      problem->AddParameterBlock(&op->logInvDepth, 1);
+      problem->SetParameterLowerBound(&op->logInvDepth, 0,
+                                      -std::log(settings.depth.max));
+      problem->SetParameterUpperBound(&op->logInvDepth, 0,
+                                      -std::log(settings.depth.min));
+    }
 
-    ordering->AddElementToGroup(keyFrame->thisToWorld.translation().data(), 1);
-    ordering->AddElementToGroup(keyFrame->thisToWorld.so3().data(), 1);
-    ordering->AddElementToGroup(affLight, 1);
-  }
+    PointResiduals &residuals = *pointResiduals[pi];
+    for (int k = 0; k < kfNum; ++k) {
+      KeyFrame *refFrame = keyFrames[k];
+      if (refFrame == baseFrame)
+        continue;
+      if (!isVisible[pi * kfNum + k]) {
+        pointsOOB++;
+        auto resIt = residuals.find(refFrame);
+        if (resIt != residuals.end()) {
+          problem->RemoveResidualBlock(resIt->second.id);
+          residuals.erase(resIt);
+        }
+        continue;
+      }
 
-  problem.SetParameterBlockConstant(
-      firstKeyFrame->thisToWorld.translation().data());
-  problem.SetParameterBlockConstant(firstKeyFrame->thisToWorld.so3().data());
-  problem.SetParameterBlockConstant(firstKeyFrame->lightWorldToThis.data);
-
-  SE3 firstToWorld = firstKeyFrame->thisToWorld;
-  SE3 secondToWorld = secondKeyFrame->thisToWorld;
-  double radius =
-      (secondToWorld.translation() - firstToWorld.translation()).norm();
-  Vec3 center = firstToWorld.translation();
-  problem.SetParameterization(
-      secondKeyFrame->thisToWorld.translation().data(),
-      new ceres::AutoDiffLocalParameterization<SphericalPlus, 3, 2>(
-          new SphericalPlus(center, radius, secondToWorld.translation())));
+      DirectResidual *newResidual = newResiduals[pi * kfNum + k];
+      if (!newResidual)
+        continue;
+      ceres::ResidualBlockId id = problem->AddResidualBlock(
+          newResidual, nullptr, &op->logInvDepth,
+          baseFrame->thisToWorld.translation().data(),
+          baseFrame->thisToWorld.so3().data(),
+          refFrame->thisToWorld.translation().data(),
+          refFrame->thisToWorld.so3().data(), baseFrame->lightWorldToThis.data,
+          refFrame->lightWorldToThis.data);
+      residuals[refFrame] = {id, newResidual};
+    }
+  }
+  return pointsOOB;
+}
 
-  if (settings.bundleAdjuster.fixedRotationOnSecondKF)
-    problem.SetParameterBlockConstant(secondKeyFrame->thisToWorld.so3().data());
-
-  if (settings.bundleAdjuster.fixedMotionOnFirstAdjustent &&
-      keyFrames.size() == 2) {
-    problem.SetParameterBlockConstant(
-        secondKeyFrame->thisToWorld.translation().data());
-    problem.SetParameterBlockConstant(secondKeyFrame->thisToWorld.so3().data());
-    problem.SetParameterBlockConstant(secondKeyFrame->lightWorldToThis.data);
+std::optional<double>
+BundleAdjuster::medianDiff(const PointResiduals &residuals) const {
+  std::vector<double> values = reservedVector<double>(
+      residuals.size() * settings.residualPattern.pattern().size());
+  for (const auto &[refFrame, resRef] : residuals) {
+    const DirectResidual *res = resRef.residual;
+    if (res->hasLastDiffs) {
+      values.insert(values.end(), res->lastDiffs.begin(),
+                    res->lastDiffs.end());
+      continue;
+    }
+    std::vector<double> diffs(res->size());
+    KeyFrame *base = res->baseKf;
+    KeyFrame *ref = res->refKf;
+    res->intencityDiffs(res->optimizedPoint->logInvDepth,
+                        ref->thisToWorld.inverse() * base->thisToWorld,
+                        base->lightWorldToThis.data,
+                        ref->lightWorldToThis.data, diffs.data());
+    values.insert(values.end(), diffs.begin(), diffs.end());
   }
 
-  LOG(INFO) << "points on the first = " << firstKeyFrame->optimizedPoints.size()
-            << std::endl;
-  LOG(INFO) << "points on the second = "
-            << secondKeyFrame->optimizedPoints.size() << std::endl;
+  if (values.empty())
+    return std::nullopt;
+  std::nth_element(values.begin(), values.begin() + values.size() / 2,
+                   values.end());
+  return values[values.size() / 2];
+}
+
+void BundleAdjuster::adjust(int maxNumIterations) {
+  PROFILE_SCOPE("ba.adjust");
+  CHECK_GE(keyFrames.size(), 2);
+  int pointsTotal = 0, pointsOOB = 0, pointsOutliers = 0;
 
-  std::map<OptimizedPoint *, std::vector<DirectResidual *>> residualsFor;
+  updateGauge();
+  KeyFrame *secondKeyFrame = keyFrames[1];
 
-  StdVector<Vec2> oobPos;
-  StdVector<Vec2> oobKf1;
+  DSO_LOG(BA, 2) << "points on the first = "
+                 << keyFrames[0]->optimizedPoints.size()
+                 << ", on the second = "
+                 << secondKeyFrame->optimizedPoints.size();
 
   int numNonfiniteDepths = 0;
-  for (KeyFrame *baseFrame : keyFrames)
-    for (const auto &op : baseFrame->optimizedPoints) {
-      if (!std::isfinite(op->logInvDepth)) {
+  for (KeyFrame *baseFrame : keyFrames) {
+    for (const auto &op : baseFrame->optimizedPoints)
+      if (!std::isfinite(op->logInvDepth))
         numNonfiniteDepths++;
-        continue;
-      }
-
-      problem.AddParameterBlock(&op->logInvDepth, 1);
-      problem.SetParameterLowerBound(&op->logInvDepth, 0,
-                                     -std::log(settings.depth.max));
-      problem.SetParameterUpperBound(&op->logInvDepth, 0,
-                                     -std::log(settings.depth.min));
-
-      ordering->AddElementToGroup(&op->logInvDepth, 0);
-
-      for (KeyFrame *refFrame : keyFrames) {
-        if (refFrame == baseFrame)
-          continue;
-        pointsTotal++;
-        if (isOOB(baseFrame->thisToWorld, refFrame->thisToWorld, *op)) {
-          pointsOOB++;
-          if (baseFrame == secondKeyFrame)
-            oobPos.push_back(op->p);
-          else
-            oobKf1.push_back(op->p);
-          continue;
-        }
+      else
+        pointsTotal += keyFrames.size() - 1;
+    pointsOOB += updateResiduals(baseFrame);
+  }
 
-        for (int i = 0; i < settings.residualPattern.pattern().size(); ++i) {
-          const Vec2 &pos = op->p + settings.residualPattern.pattern()[i];
-          DirectResidual *newResidual = new DirectResidual(
-              &baseFrame->preKeyFrame->internals->interpolator(0),
-              &refFrame->preKeyFrame->internals->interpolator(0), cam, op.get(),
-              pos, baseFrame, refFrame);
-
-          double gradNorm = baseFrame->preKeyFrame->gradNorm(toCvPoint(pos));
-          const double c = settings.gradWeighting.c;
-          double weight = c / std::hypot(c, gradNorm);
-          ceres::LossFunction *lossFunc = new ceres::ScaledLoss(
-              new ceres::HuberLoss(settings.intencity.outlierDiff), weight,
-              ceres::Ownership::TAKE_OWNERSHIP);
-
-          residualsFor[op.get()].push_back(newResidual);
-          problem.AddResidualBlock(
-              new ceres::AutoDiffCostFunction<DirectResidual, 1, 1, 3, 4, 3, 4,
-                                              2, 2>(newResidual),
-              lossFunc, &op->logInvDepth,
-              baseFrame->thisToWorld.translation().data(),
-              baseFrame->thisToWorld.so3().data(),
-              refFrame->thisToWorld.translation().data(),
-              refFrame->thisToWorld.so3().data(),
-              baseFrame->lightWorldToThis.data,
-              refFrame->lightWorldToThis.data);
-        }
-      }
-    }
-  
   if (numNonfiniteDepths != 0)
     LOG(WARNING) << "found " << numNonfiniteDepths << "nonfinite depths";
 
+  // the ordering is consumed by the solver, so it is rebuilt for every solve
+  std::shared_ptr<ceres::ParameterBlockOrdering> ordering(
+      new ceres::ParameterBlockOrdering());
+  for (KeyFrame *keyFrame : keyFrames) {
+    ordering->AddElementToGroup(keyFrame->thisToWorld.translation().data(), 1);
+    ordering->AddElementToGroup(keyFrame->thisToWorld.so3().data(), 1);
+    ordering->AddElementToGroup(keyFrame->lightWorldToThis.data, 1);
+    for (const auto &op : keyFrame->optimizedPoints)
+      if (problem->HasParameterBlock(&op->logInvDepth))
+        ordering->AddElementToGroup(&op->logInvDepth, 0);
+  }
+
   ceres::Solver::Options options;
-  options.linear_solver_type = ceres::DENSE_SCHUR;
+  switch (settings.bundleAdjuster.linearSolver) {
+  case Settings::BundleAdjuster::DENSE_SCHUR:
+    options.linear_solver_type = ceres::DENSE_SCHUR;
+    break;
+  case Settings::BundleAdjuster::SPARSE_SCHUR:
+    options.linear_solver_type = ceres::SPARSE_SCHUR;
+    break;
+  case Settings::BundleAdjuster::ITERATIVE_SCHUR:
+    options.linear_solver_type = ceres::ITERATIVE_SCHUR;
+    options.preconditioner_type = ceres::SCHUR_JACOBI;
+    break;
+  }
   options.linear_solver_ordering = ordering;
   // options.minimizer_progress_to_stdout = true;
   options.max_num_iterations = maxNumIterations;
-  options.num_threads = settings.threading.numThreads;
+  if (settings.bundleAdjuster.maxSolverTime > 0)
+    options.max_solver_time_in_seconds = settings.bundleAdjuster.maxSolverTime;
+  options.function_tolerance = settings.bundleAdjuster.functionTolerance;
+  options.num_threads = threadNum(settings.threading);
+#if CERES_VERSION_MAJOR < 2
+  options.evaluation_callback = posePairs.get();
+#endif
+
+  for (auto &[op, residuals] : residualsFor)
+    for (auto &[refFrame, resRef] : residuals)
+      resRef.residual->resetLastEvaluation();
+
+  // Only the points of the second keyframe are classified. After every
+  // successful iteration the differences of the new state are already
+  // there, and the residuals of the outliers among them are frozen.
+  std::vector<std::pair<OptimizedPoint *, const PointResiduals *>> candidates;
+  for (const auto &op : secondKeyFrame->optimizedPoints) {
+    auto it = residualsFor.find(op.get());
+    if (op->state == OptimizedPoint::ACTIVE && it != residualsFor.end())
+      candidates.push_back({op.get(), &it->second});
+  }
+  std::vector<OptimizedPoint *> pruned;
+  IterationFunction pruneOutliers([&](const ceres::IterationSummary &iter) {
+    if (iter.iteration == 0 || !iter.step_is_successful)
+      return;
+    PROFILE_SCOPE("ba.pruneOutliers");
+    for (auto &[op, residuals] : candidates) {
+      if (!op)
+        continue;
+      bool isEvaluated = std::all_of(
+          residuals->begin(), residuals->end(),
+          [](const auto &res) { return res.second.residual->hasLastDiffs; });
+      std::optional<double> median = medianDiff(*residuals);
+      if (!isEvaluated || !median || *median <= settings.intencity.outlierDiff)
+        continue;
+      for (const auto &[refFrame, resRef] : *residuals)
+        resRef.residual->freeze();
+      op->state = OptimizedPoint::OUTLIER;
+      pruned.push_back(op);
+      op = nullptr;
+    }
+  });
+  if (settings.bundleAdjuster.pruneOutliers)
+    options.callbacks.push_back(&pruneOutliers);
+
   ceres::Solver::Summary summary;
-  ceres::Solve(options, &problem, &summary);
+  {
+    PROFILE_SCOPE("ba.solve");
+    ceres::Solve(options, problem.get(), &summary);
+  }
+  PROFILE_COUNT("ba.residuals", summary.num_residual_blocks);
+  PROFILE_COUNT("ba.iterations",
+                summary.num_successful_steps + summary.num_unsuccessful_steps);
 
-  if (secondKeyFrame->optimizedPoints.size() > 0) {
+  if (DSO_LOG_IS_ON(BA, 2) && secondKeyFrame->optimizedPoints.size() > 0) {
     auto p = std::minmax_element(secondKeyFrame->optimizedPoints.begin(),
                                  secondKeyFrame->optimizedPoints.end(),
                                  [](const auto &op1, const auto &op2) {
                                    return op1->depth() < op2->depth();
                                  });
-    LOG(INFO) << "minmax d = " << (*p.first)->depth() << ' '
-              << (*p.second)->depth() << std::endl;
+    DSO_LOG(BA, 2) << "minmax d = " << (*p.first)->depth() << ' '
+                   << (*p.second)->depth();
   }
 
-  std::vector<double> depthsVec;
-  depthsVec.reserve(secondKeyFrame->optimizedPoints.size());
-  for (const auto &op : secondKeyFrame->optimizedPoints)
-    depthsVec.push_back(op->depth());
-  // setDepthColBounds(depthsVec);
-
-  cv::Mat kfDepths = secondKeyFrame->drawDepthedFrame(minDepthCol, maxDepthCol);
-
-  StdVector<Vec2> outliers;
-  StdVector<Vec2> badDepth;
+  // the pruned points and those of the previous adjustments are settled
+  const bool isPruning = settings.bundleAdjuster.pruneOutliers;
+  std::vector<OptimizedPoint *> outliers;
   for (const auto &op : secondKeyFrame->optimizedPoints) {
-    if (op->state == OptimizedPoint::OOB)
+    if (op->state == OptimizedPoint::OOB ||
+        (isPruning && op->state == OptimizedPoint::OUTLIER))
       continue;
 
-    std::vector<double> values =
-        reservedVector<double>(residualsFor[op.get()].size());
-    for (DirectResidual *res : residualsFor[op.get()]) {
-      double value;
-      double &logInvDepth = op->logInvDepth;
-      KeyFrame *base = res->baseKf;
-      KeyFrame *ref = res->refKf;
-      if (res->operator()(&logInvDepth, base->thisToWorld.translation().data(),
-                          base->thisToWorld.so3().data(),
-                          ref->thisToWorld.translation().data(),
-                          ref->thisToWorld.so3().data(),
-                          base->lightWorldToThis.data,
-                          ref->lightWorldToThis.data, &value))
-        values.push_back(value);
-    }
-
-    if (values.empty()) {
+    // the differences are those of the final state, Ceres ends on the last
+    // point it evaluated the jacobians at
+    std::optional<double> median = medianDiff(residualsFor[op.get()]);
+    if (!median) {
       op->state = OptimizedPoint::OOB;
       continue;
     }
-
-    std::nth_element(values.begin(), values.begin() + values.size() / 2,
-                     values.end());
-    double median = values[values.size() / 2];
-    if (median > settings.intencity.outlierDiff) {
+    if (*median > settings.intencity.outlierDiff) {
       op->state = OptimizedPoint::OUTLIER;
-      outliers.push_back(op->p);
+      outliers.push_back(op.get());
     }
   }
+  outliers.insert(outliers.end(), pruned.begin(), pruned.end());
+  // removing the depth removes the residuals depending on it
+  if (isPruning)
+    for (OptimizedPoint *op : outliers) {
+      problem->RemoveParameterBlock(&op->logInvDepth);
+      residualsFor.erase(op);
+    }
   pointsOutliers = outliers.size();
-
-  LOG(INFO) << "BA results:";
-  LOG(INFO) << "total points = " << pointsTotal;
-  LOG(INFO) << "OOB points = " << pointsOOB;
-  LOG(INFO) << "outlier points = " << pointsOutliers;
-
-  LOG(INFO) << summary.FullReport() << std::endl;
+  PROFILE_COUNT("ba.prunedPoints", pruned.size());
+  PROFILE_COUNT("ba.points", pointsTotal);
+  PROFILE_COUNT("ba.pointsOOB", pointsOOB);
+  PROFILE_COUNT("ba.outliers", pointsOutliers);
+
+  DSO_LOG(BA, 1) << "BA results: total points = " << pointsTotal
+                 << ", OOB points = " << pointsOOB
+                 << ", outlier points = " << pointsOutliers << ", "
+                 << summary.BriefReport();
+  DSO_LOG(BA, 3) << summary.FullReport();
 }
 } // namespace fishdso
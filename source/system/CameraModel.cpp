@@ -1,21 +1,52 @@
 #include "system/CameraModel.h"
+#include "util/Log.h"
+#include "util/Random.h"
 #include "util/defs.h"
-#include "util/flags.h"
 #include "util/settings.h"
 #include "util/types.h"
 #include <algorithm>
 #include <ceres/ceres.h>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include <random>
+#include <sstream>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 #include <vector>
 
 namespace fishdso {
 
+namespace {
+
+const std::string mapPolyCacheTag = "fishdso-mappoly-v1";
+
+// 64-bit FNV-1a, stable across runs and platforms, unlike std::hash
+class Fnv1a {
+public:
+  template <typename T> void add(const T &value) {
+    const auto *bytes = reinterpret_cast<const unsigned char *>(&value);
+    for (int i = 0; i < int(sizeof(T)); ++i) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ull;
+    }
+  }
+
+  uint64_t get() const { return hash; }
+
+private:
+  uint64_t hash = 14695981039346656037ull;
+};
+
+} // namespace
+
 CameraModel::CameraModel(int width, int height, double scale,
                          const Vec2 &center, VecX unmapPolyCoeffs,
-                         const Settings::CameraModel &settings)
+                         const Settings::CameraModel &settings,
+                         const std::string &calibFileName)
     : width(width)
     , height(height)
     , unmapPolyDeg(unmapPolyCoeffs.rows())
@@ -23,8 +54,12 @@ CameraModel::CameraModel(int width, int height, double scale,
     , center(center)
     , scale(scale)
     , settings(settings) {
+  CHECK_LE(unmapPolyDeg, maxUnmapPolyDeg);
   normalize();
-  setMapPolyCoeffs();
+  fitMapPoly(calibFileName);
+  buildValidSpans();
+  if (settings.useLookupTables)
+    buildLookupTables();
 }
 
 CameraModel::CameraModel(int width, int height,
@@ -39,7 +74,10 @@ CameraModel::CameraModel(int width, int height,
   }
   ifs >> *this;
   normalize();
-  setMapPolyCoeffs();
+  fitMapPoly(calibFileName);
+  buildValidSpans();
+  if (settings.useLookupTables)
+    buildLookupTables();
 }
 
 CameraModel::CameraModel(int width, int height, double f, double cx, double cy,
@@ -54,10 +92,13 @@ CameraModel::CameraModel(int width, int height, double f, double cx, double cy,
   unmapPolyCoeffs[0] = f;
   normalize();
   setMapPolyCoeffs();
+  buildValidSpans();
+  if (settings.useLookupTables)
+    buildLookupTables();
 
-  LOG(INFO) << "\n\n CAMERA MODEL:\n";
-  LOG(INFO) << "unmap coeffs  = " << unmapPolyCoeffs.transpose() << "\n";
-  LOG(INFO) << "\nmap poly coeffs = " << mapPolyCoeffs.transpose() << "\n\n";
+  DSO_LOG(CAMERA, 0) << "camera model: unmap coeffs = "
+                     << unmapPolyCoeffs.transpose()
+                     << ", map poly coeffs = " << mapPolyCoeffs.transpose();
 }
 
 void CameraModel::normalize() {
@@ -83,6 +124,32 @@ void CameraModel::normalize() {
   maxAngle = std::atan2(maxRadius, minZUnnorm);
 }
 
+std::pair<cv::Mat1f, cv::Mat1f>
+CameraModel::makeUndistortMaps(const Mat33 &cameraMatrix,
+                               cv::Size size) const {
+  const Mat33 Kinv = cameraMatrix.inverse();
+  cv::Mat1f mapX(size), mapY(size);
+  tbb::parallel_for(
+      tbb::blocked_range<int>(0, size.height),
+      [&](const tbb::blocked_range<int> &range) {
+        const int w = size.width;
+        std::vector<double> rayX(w), rayY(w), rayZ(w), x(w), y(w);
+        for (int row = range.begin(); row < range.end(); ++row) {
+          for (int col = 0; col < w; ++col) {
+            Vec3 ray = Kinv * Vec3(col, row, 1);
+            rayX[col] = ray[0];
+            rayY[col] = ray[1];
+            rayZ[col] = ray[2];
+          }
+          mapBatch(w, rayX.data(), rayY.data(), rayZ.data(), x.data(),
+                   y.data());
+          std::copy(x.begin(), x.end(), mapX[row]);
+          std::copy(y.begin(), y.end(), mapY[row]);
+        }
+      });
+  return {mapX, mapY};
+}
+
 std::pair<Vec2, Mat23> CameraModel::diffMap(const Vec3 &ray) const {
   ceres::Jet<double, 3> rayJet[3];
   for (int i = 0; i < 3; ++i) {
@@ -96,10 +163,119 @@ std::pair<Vec2, Mat23> CameraModel::diffMap(const Vec3 &ray) const {
   return {Vec2(pointJet[0].a, pointJet[1].a), mapJacobian};
 }
 
+void CameraModel::mapBatch(int n, const double *rayX, const double *rayY,
+                           const double *rayZ, double *x, double *y) const {
+  // in chunks on the stack, so that small batches allocate nothing
+  constexpr int chunkSize = 64;
+  double xyNorm[chunkSize], angle[chunkSize], r[chunkSize];
+  for (int from = 0; from < n; from += chunkSize) {
+    const int cnt = std::min(chunkSize, n - from);
+    const double *cx = rayX + from, *cy = rayY + from, *cz = rayZ + from;
+    for (int i = 0; i < cnt; ++i) {
+      xyNorm[i] = std::sqrt(cx[i] * cx[i] + cy[i] * cy[i]);
+      angle[i] = std::atan2(xyNorm[i], cz[i]);
+    }
+
+    if (!mapTable) {
+      // the same Horner scheme as in map(), step by step for all the rays
+      const int deg = int(mapPolyCoeffs.rows()) - 1;
+      std::fill(r, r + cnt, mapPolyCoeffs[deg]);
+      for (int k = deg - 1; k >= 0; --k) {
+        const double coeff = mapPolyCoeffs[k];
+        for (int i = 0; i < cnt; ++i)
+          r[i] = r[i] * angle[i] + coeff;
+      }
+    } else {
+      const std::vector<double> &table = *mapTable;
+      for (int i = 0; i < cnt; ++i) {
+        double pos = angle[i] * mapTableInvStep;
+        int ind = int(pos);
+        r[i] = ind < int(table.size()) - 1
+                   ? table[ind] + (pos - ind) * (table[ind + 1] - table[ind])
+                   : calcMapPoly(angle[i]);
+      }
+    }
+
+    for (int i = 0; i < cnt; ++i) {
+      double k = xyNorm[i] > 0 ? r[i] / xyNorm[i] : 0;
+      x[from + i] = scale * (center[0] + k * cx[i]);
+      y[from + i] = scale * (center[1] + k * cy[i]);
+    }
+  }
+}
+
 bool CameraModel::isOnImage(const Vec2 &p, int border) const {
-  return Eigen::AlignedBox2d(Vec2(border, border),
-                             Vec2(width - border, height - border))
-      .contains(p);
+  if (!Eigen::AlignedBox2d(Vec2(border, border),
+                           Vec2(width - border, height - border))
+           .contains(p))
+    return false;
+  if (hasStaticMask()) {
+    int x = std::min(int(p[0]), width - 1), y = std::min(int(p[1]), height - 1);
+    if (!staticMasks[0](y, x))
+      return false;
+  }
+  if (!hasInvalidPixels())
+    return true;
+  double radius = validRadius - border / scale;
+  return radius > 0 && (p / scale - center).squaredNorm() <= radius * radius;
+}
+
+void CameraModel::setStaticMask(const cv::Mat1b &mask) {
+  CHECK_EQ(mask.cols, width);
+  CHECK_EQ(mask.rows, height);
+  staticMasks.clear();
+  staticMasks.push_back(mask.clone());
+  for (int lvl = 1; (width >> lvl) > 0 && (height >> lvl) > 0; ++lvl) {
+    const cv::Mat1b &fine = staticMasks.back();
+    cv::Mat1b coarse(height >> lvl, width >> lvl);
+    for (int y = 0; y < coarse.rows; ++y)
+      for (int x = 0; x < coarse.cols; ++x)
+        coarse(y, x) = fine(2 * y, 2 * x) && fine(2 * y, 2 * x + 1) &&
+                               fine(2 * y + 1, 2 * x) &&
+                               fine(2 * y + 1, 2 * x + 1)
+                           ? 255
+                           : 0;
+    staticMasks.push_back(coarse);
+  }
+}
+
+void CameraModel::buildValidSpans() {
+  validRadius = settings.validAngle < maxAngle
+                    ? std::max(0.0, calcMapPoly(settings.validAngle))
+                    : 1;
+
+  validSpans.clear();
+  for (int lvl = 0; (width >> lvl) > 0 && (height >> lvl) > 0; ++lvl) {
+    const int w = width >> lvl, h = height >> lvl;
+    const double lvlScale = scale / (1 << lvl);
+    std::vector<Vec2i> &spans = validSpans.emplace_back(h, Vec2i(0, w));
+    if (!hasInvalidPixels())
+      continue;
+    for (int y = 0; y < h; ++y) {
+      double dy = y / lvlScale - center[1];
+      double halfSq = validRadius * validRadius - dy * dy;
+      if (halfSq < 0) {
+        spans[y] = Vec2i(0, 0);
+        continue;
+      }
+      double half = std::sqrt(halfSq);
+      int begin = int(std::ceil((center[0] - half) * lvlScale));
+      int end = int(std::floor((center[0] + half) * lvlScale)) + 1;
+      begin = std::clamp(begin, 0, w);
+      end = std::clamp(end, begin, w);
+      spans[y] = Vec2i(begin, end);
+    }
+  }
+}
+
+cv::Mat1b CameraModel::validMask(int level) const {
+  const std::vector<Vec2i> &spans = validSpans[level];
+  cv::Mat1b mask = cv::Mat1b::zeros(spans.size(), width >> level);
+  for (int y = 0; y < spans.size(); ++y)
+    std::fill(mask[y] + spans[y][0], mask[y] + spans[y][1], 255);
+  if (hasStaticMask())
+    cv::min(mask, staticMasks[level], mask);
+  return mask;
 }
 
 double CameraModel::getImgRadiusByAngle(double observeAngle) const {
@@ -120,6 +296,8 @@ std::istream &operator>>(std::istream &is, CameraModel &cc) {
     throw std::runtime_error("Invalid camera type");
 
   is >> cc.scale >> cc.center[0] >> cc.center[1] >> cc.unmapPolyDeg;
+  if (cc.unmapPolyDeg < 1 || cc.unmapPolyDeg > CameraModel::maxUnmapPolyDeg)
+    throw std::runtime_error("Invalid camera polynomial degree");
   cc.unmapPolyCoeffs.resize(cc.unmapPolyDeg, 1);
 
   for (int i = 0; i < cc.unmapPolyDeg; ++i)
@@ -136,13 +314,15 @@ void CameraModel::setMapPolyCoeffs() {
   // in the image and \theta stands for angle to z-axis of the unprojected ray
   int nPnts = settings.mapPolyPoints;
   int deg = settings.mapPolyDegree;
+  CHECK_GE(deg, 0);
+  CHECK_LE(deg, maxMapPolyDeg);
   StdVector<Vec2> funcGraph;
   funcGraph.reserve(nPnts);
-  std::mt19937 gen(FLAGS_deterministic ? 42 : std::random_device()());
-  std::uniform_real_distribution<> distr(0, maxRadius);
+  RandomStream stream =
+      randomStream(settings.deterministic, RandomStage::CAMERA_FIT);
 
   for (int it = 0; it < nPnts; ++it) {
-    double r = distr(gen);
+    double r = maxRadius * stream.uniformReal();
     // double r = maxRadius;
     double z = calcUnmapPoly(r);
     double angle = std::atan2(r, z);
@@ -173,12 +353,123 @@ void CameraModel::setMapPolyCoeffs() {
   mapPolyCoeffs = A.fullPivHouseholderQr().solve(b);
 }
 
+std::string
+CameraModel::mapPolyCacheFileName(const std::string &calibFileName) const {
+  // the normalized unmap polynomial already depends on the image size
+  Fnv1a hash;
+  hash.add(unmapPolyDeg);
+  for (int i = 0; i < unmapPolyDeg; ++i)
+    hash.add(unmapPolyCoeffs[i]);
+  hash.add(maxRadius);
+  hash.add(settings.mapPolyDegree);
+  hash.add(settings.mapPolyPoints);
+
+  std::stringstream name;
+  name << calibFileName << "." << std::hex << std::setw(16)
+       << std::setfill('0') << hash.get() << ".mappoly";
+  return name.str();
+}
+
+void CameraModel::fitMapPoly(const std::string &calibFileName) {
+  if (!settings.cacheMapPolyFit || calibFileName.empty()) {
+    setMapPolyCoeffs();
+    return;
+  }
+
+  std::string cacheFileName = mapPolyCacheFileName(calibFileName);
+  if (loadMapPolyCoeffs(cacheFileName))
+    return;
+  setMapPolyCoeffs();
+  saveMapPolyCoeffs(cacheFileName);
+}
+
+bool CameraModel::loadMapPolyCoeffs(const std::string &cacheFileName) {
+  std::ifstream ifs(cacheFileName);
+  if (!ifs.is_open())
+    return false;
+
+  std::string tag;
+  int deg;
+  ifs >> tag >> deg;
+  if (!ifs || tag != mapPolyCacheTag || deg != settings.mapPolyDegree) {
+    LOG(WARNING) << "ignoring the invalid map polynomial cache "
+                 << cacheFileName;
+    return false;
+  }
+  MapPolyCoeffs coeffs(deg + 1, 1);
+  for (int i = 0; i <= deg; ++i)
+    ifs >> coeffs[i];
+  if (!ifs) {
+    LOG(WARNING) << "ignoring the truncated map polynomial cache "
+                 << cacheFileName;
+    return false;
+  }
+
+  mapPolyCoeffs = coeffs;
+  return true;
+}
+
+void CameraModel::saveMapPolyCoeffs(const std::string &cacheFileName) const {
+  // Written to a temporary file, which is then renamed, so that concurrent
+  // starts never read a partially written cache.
+  std::string tmpFileName = cacheFileName + ".tmp" +
+                            std::to_string(std::random_device()());
+  {
+    std::ofstream ofs(tmpFileName);
+    ofs << mapPolyCacheTag << " " << mapPolyCoeffs.rows() - 1 << "\n"
+        << std::setprecision(17);
+    for (int i = 0; i < mapPolyCoeffs.rows(); ++i)
+      ofs << mapPolyCoeffs[i] << "\n";
+    if (!ofs) {
+      LOG(WARNING) << "could not write the map polynomial cache "
+                   << cacheFileName;
+      std::remove(tmpFileName.c_str());
+      return;
+    }
+  }
+  if (std::rename(tmpFileName.c_str(), cacheFileName.c_str()) != 0) {
+    LOG(WARNING) << "could not write the map polynomial cache "
+                 << cacheFileName;
+    std::remove(tmpFileName.c_str());
+  }
+}
+
+void CameraModel::buildLookupTables() {
+  int tableSize = std::max(settings.mapTableSize, 2);
+  double step = maxAngle / (tableSize - 1);
+  mapTableInvStep = 1 / step;
+  auto table = std::make_shared<std::vector<double>>(tableSize);
+  for (int i = 0; i < tableSize; ++i)
+    (*table)[i] = calcMapPoly(i * step);
+  mapTable = std::move(table);
+
+  buildUnmapTable();
+}
+
+void CameraModel::buildUnmapTable() {
+  auto table = std::make_shared<std::vector<Vec3>>();
+  table->reserve(width * height);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x) {
+      double pnt[2] = {double(x), double(y)};
+      table->push_back(unmap(pnt));
+    }
+  unmapTable = std::move(table);
+}
+
 StdVector<CameraModel> CameraModel::camPyr(int pyrLevels) {
   StdVector<CameraModel> result(pyrLevels, *this);
   for (int i = 0; i < pyrLevels; ++i) {
     result[i].scale /= (1 << i);
     result[i].width /= (1 << i);
     result[i].height /= (1 << i);
+    result[i].buildValidSpans();
+    if (hasStaticMask())
+      result[i].staticMasks.erase(result[i].staticMasks.begin(),
+                                  result[i].staticMasks.begin() + i);
+    // the copies share the map table, and the level 0 one the unmap table too
+    if (i > 0 && unmapTable)
+      result[i].buildUnmapTable();
   }
 
   return result;
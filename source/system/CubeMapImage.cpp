@@ -0,0 +1,52 @@
+#include "system/CubeMapImage.h"
+#include <cmath>
+#include <glog/logging.h>
+#include <opencv2/imgproc.hpp>
+
+namespace fishdso {
+
+CubeMapImage::CubeMapImage(const CameraModel &cam, const cv::Mat1b &image,
+                           double scale) {
+  CHECK_GT(scale, 0);
+  // pixels per radian at the center of the image
+  constexpr double angle = 1e-2;
+  double centerResolution =
+      (cam.map(Vec3(std::sin(angle), 0, std::cos(angle))) -
+       cam.map(Vec3(0, 0, 1)))
+          .norm() /
+      angle;
+  int halfSize = std::max(int(std::ceil(scale * centerResolution)), 1);
+  focal = halfSize;
+  center = halfSize + border;
+  const int size = 2 * halfSize + 2 * border + 1;
+
+  cv::Mat1f mapX(size, size), mapY(size, size);
+  for (int m = 0; m < 3; ++m)
+    for (int sign = 0; sign < 2; ++sign) {
+      const int face = 2 * m + sign;
+      const int i = (m + 1) % 3, j = (m + 2) % 3;
+      for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x) {
+          Vec3 ray;
+          ray[m] = sign ? -1 : 1;
+          ray[i] = (x - center) / focal;
+          ray[j] = (y - center) / focal;
+          Vec2 p = cam.map(ray);
+          // far behind the camera the model may not map at all
+          if (!p.allFinite())
+            p = Vec2(-1, -1);
+          mapX(y, x) = p[0];
+          mapY(y, x) = p[1];
+        }
+      cv::remap(image, faceImages[face], mapX, mapY, cv::INTER_LINEAR,
+                cv::BORDER_REPLICATE);
+      faces[face].reset(new BicubicTiles(faceImages[face]));
+    }
+}
+
+void CubeMapImage::release() {
+  for (auto &face : faces)
+    face->release();
+}
+
+} // namespace fishdso
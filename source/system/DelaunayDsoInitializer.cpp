@@ -1,10 +1,14 @@
 #include "system/DelaunayDsoInitializer.h"
+#include "util/Log.h"
+#include "util/Scheduler.h"
 #include "util/SphericalTerrain.h"
 #include "util/defs.h"
 #include "util/util.h"
 #include <algorithm>
 #include <glog/logging.h>
 #include <opencv2/opencv.hpp>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
 namespace fishdso {
 
@@ -16,37 +20,126 @@ DelaunayDsoInitializer::DelaunayDsoInitializer(
     : cam(cam)
     , dsoSystem(dsoSystem)
     , pixelSelector(pixelSelector)
-    , stereoMatcher(cam, _settings.stereoMatcher, _settings.threading)
     , hasFirstFrame(false)
     , framesSkipped(0)
     , pointsNeeded(pointsNeeded)
     , debugOutputType(debugOutputType)
     , settings(_settings)
-    , observers(observers) {}
+    , observers(observers) {
+  const int batchSize = std::max(settings.initializer.candidatesPerBatch, 1);
+  stereoMatchers.reserve(batchSize);
+  for (int i = 0; i < batchSize; ++i)
+    stereoMatchers.emplace_back(cam, settings.stereoMatcher,
+                                settings.threading);
+}
 
-bool DelaunayDsoInitializer::addFrame(const cv::Mat &frame,
-                                      int globalFrameNum) {
+bool DelaunayDsoInitializer::addFrame(const SourceFrame &frame) {
   if (!hasFirstFrame) {
-    frames[0] = frame;
-    globalFrameNums[0] = globalFrameNum;
+    frames[0] = std::shared_ptr<PreKeyFrame>(
+        new PreKeyFrame(nullptr, cam, frame));
     hasFirstFrame = true;
     return false;
-  } else {
-    if (framesSkipped < settings.initializer.firstFramesSkip) {
-      ++framesSkipped;
-      return false;
-    }
+  }
+
+  const Settings::DelaunayDsoInitializer &initSettings = settings.initializer;
+  const bool isLast = framesSkipped >= initSettings.firstFramesSkip;
+  const int step = std::max(initSettings.candidateFramesStep, 1);
+  ++framesSkipped;
+  if (!isLast && framesSkipped % step != 0)
+    return false;
+
+  Attempt attempt;
+  attempt.frame =
+      std::shared_ptr<PreKeyFrame>(new PreKeyFrame(nullptr, cam, frame));
+  candidates.push_back(std::move(attempt));
+  if (!isLast && int(candidates.size()) < int(stereoMatchers.size()))
+    return false;
+
+  matchCandidates();
+  if (!isLast && !isGoodEnough(bestAttempt))
+    return false;
 
-    frames[1] = frame;
-    globalFrameNums[1] = globalFrameNum;
-    return true;
+  if (!bestAttempt.isMatched)
+    throw std::runtime_error(
+        "DelaunayDsoInitializer error: no frame pair could be matched");
+  DSO_LOG(INIT, 0) << "initializing from frames #" << frames[0]->globalFrameNum
+                   << " and #" << bestAttempt.frame->globalFrameNum
+                   << ", inliers = " << bestAttempt.keyPoints[0].size()
+                   << ", median parallax = "
+                   << bestAttempt.medianParallax * (180 / M_PI) << " deg";
+  frames[1] = bestAttempt.frame;
+  return true;
+}
+
+void DelaunayDsoInitializer::matchCandidates() {
+  ParallelExecutor(settings.threading, Scheduler::TRACKING).execute([&]() {
+    tbb::parallel_for(
+        tbb::blocked_range<int>(0, candidates.size()),
+        [&](const tbb::blocked_range<int> &range) {
+          for (int c = range.begin(); c < range.end(); ++c) {
+            Attempt &attempt = candidates[c];
+            cv::Mat grayFrames[2] = {frames[0]->frame(),
+                                     attempt.frame->frame()};
+            const int frameIds[2] = {frames[0]->globalFrameNum,
+                                     attempt.frame->globalFrameNum};
+            try {
+              attempt.firstToSecond = stereoMatchers[c].match(
+                  grayFrames, frameIds, attempt.keyPoints, attempt.depths);
+            } catch (const std::runtime_error &error) {
+              DSO_LOG(INIT, 1) << "frame #" << frameIds[1] << " not matched: "
+                               << error.what();
+              continue;
+            }
+            attempt.isMatched = true;
+
+            const SO3 secondToFirst = attempt.firstToSecond.so3().inverse();
+            const int inliers = attempt.keyPoints[0].size();
+            std::vector<double> parallaxes(inliers);
+            for (int i = 0; i < inliers; ++i) {
+              Vec3 ray0 = cam->unmap(attempt.keyPoints[0][i]).normalized();
+              Vec3 ray1 = secondToFirst *
+                          cam->unmap(attempt.keyPoints[1][i]).normalized();
+              parallaxes[i] = std::acos(std::clamp(ray0.dot(ray1), -1.0, 1.0));
+            }
+            if (inliers > 0) {
+              std::nth_element(parallaxes.begin(),
+                               parallaxes.begin() + inliers / 2,
+                               parallaxes.end());
+              attempt.medianParallax = parallaxes[inliers / 2];
+            }
+            attempt.score = inliers * attempt.medianParallax;
+          }
+        });
+  });
+
+  // the earlier frame wins a tie, as it initializes sooner
+  for (Attempt &attempt : candidates) {
+    if (!attempt.isMatched)
+      continue;
+    DSO_LOG(INIT, 1) << "initialization candidate #"
+                     << attempt.frame->globalFrameNum << ": inliers = "
+                     << attempt.keyPoints[0].size() << ", median parallax = "
+                     << attempt.medianParallax * (180 / M_PI) << " deg";
+    bool isBetter = !bestAttempt.isMatched ||
+                    (isGoodEnough(attempt) && !isGoodEnough(bestAttempt)) ||
+                    (isGoodEnough(attempt) == isGoodEnough(bestAttempt) &&
+                     attempt.score > bestAttempt.score);
+    if (isBetter)
+      bestAttempt = std::move(attempt);
   }
+  candidates.clear();
+}
+
+bool DelaunayDsoInitializer::isGoodEnough(const Attempt &attempt) const {
+  return attempt.isMatched &&
+         int(attempt.keyPoints[0].size()) >= settings.initializer.minInliers &&
+         attempt.medianParallax >= settings.initializer.minParallax;
 }
 
 StdVector<KeyFrame> DelaunayDsoInitializer::createKeyFrames() {
-  StdVector<Vec2> keyPoints[2];
-  std::vector<double> depths[2];
-  SE3 firstToSecond = stereoMatcher.match(frames, keyPoints, depths);
+  StdVector<Vec2> *keyPoints = bestAttempt.keyPoints;
+  std::vector<double> *depths = bestAttempt.depths;
+  SE3 firstToSecond = bestAttempt.firstToSecond;
 
   StdVector<std::pair<Vec2, double>> lastKeyPointDepths;
   lastKeyPointDepths.reserve(keyPoints[1].size());
@@ -57,10 +150,11 @@ StdVector<KeyFrame> DelaunayDsoInitializer::createKeyFrames() {
     dsoSystem->lastKeyPointDepths = std::move(lastKeyPointDepths);
 
   StdVector<KeyFrame> keyFrames;
+  auto tracingSettings =
+      std::make_shared<const PointTracerSettings>(settings.tracingSettings);
   for (int i = 0; i < 2; ++i) {
-    keyFrames.push_back(KeyFrame(cam, frames[i], globalFrameNums[i],
-                                 *pixelSelector, settings.keyFrame,
-                                 settings.tracingSettings));
+    keyFrames.push_back(KeyFrame(frames[i], *pixelSelector, settings.keyFrame,
+                                 tracingSettings));
     for (const auto &ip : keyFrames.back().immaturePoints)
       ip->stddev = 1;
   }
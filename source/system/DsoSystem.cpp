@@ -1,14 +1,25 @@
 #include "system/DsoSystem.h"
 #include "output/DsoObserver.h"
 #include "output/FrameTrackerObserver.h"
+#include "output/ProfilingObserver.h"
 #include "system/AffineLightTransform.h"
 #include "system/DelaunayDsoInitializer.h"
+#include "system/ProjectedPoints.h"
 #include "system/StereoMatcher.h"
 #include "system/serialization.h"
+#include "util/Log.h"
+#include "util/Placement.h"
+#include "util/Profiler.h"
+#include "util/Scheduler.h"
 #include "util/defs.h"
 #include "util/geometry.h"
 #include "util/settings.h"
+#include "util/util.h"
+#include <algorithm>
 #include <glog/logging.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
 
 namespace fishdso {
 
@@ -18,23 +29,34 @@ DsoSystem::DsoSystem(CameraModel *cam, const Observers &observers,
     , scaleGTToOur(1.0)
     , cam(cam)
     , camPyr(cam->camPyr(_settings.pyramid.levelNum))
-    , pixelSelector(_settings.pixelSelector)
+    , pixelSelector(_settings.getPixelSelectorSettings())
+    , frameBufferPool(std::shared_ptr<FrameBufferPool>(
+          new FrameBufferPool(_settings.threading.mappingQueueSize + 2)))
     , dsoInitializer(std::unique_ptr<DsoInitializer>(new DelaunayDsoInitializer(
           this, cam, &pixelSelector, _settings.maxOptimizedPoints,
           DelaunayDsoInitializer::SPARSE_DEPTHS, observers.initializer,
           _settings.getInitializerSettings())))
     , isInitialized(false)
-    , worldToFrame(_settings.initialMaxFrame)
-    , worldToFramePredict(_settings.initialMaxFrame)
-    , lastTrackRmse(INF)
+    , trackingBaseKf(nullptr)
+    , keyFrames(_settings.maxKeyFrames + 1)
+    , poseHistory(_settings.poseChunkSize)
+    , lastTrackRmse(_settings.pyramid.levelNum, INF)
     , settings(_settings)
-    , observers(observers) {
-  LOG(INFO) << "create DsoSystem" << std::endl;
-
-  frameNumbers.reserve(settings.initialMaxFrame);
+    , tracingSettings(std::make_shared<const PointTracerSettings>(
+          _settings.getPointTracerSettings()))
+    , trackerSettings(std::make_shared<const FrameTrackerSettings>(
+          _settings.getFrameTrackerSettings()))
+    , observers(observers)
+    , isMappingBusy(false)
+    , doStopMapping(false) {
+  DSO_LOG(SYSTEM, 0) << "create DsoSystem";
 
   for (DsoObserver *obs : observers.dso)
     obs->created(this, cam, settings);
+
+  initSubsystems();
+
+  startMapping();
 }
 
 DsoSystem::DsoSystem(const SnapshotLoader &snapshotLoader,
@@ -43,45 +65,58 @@ DsoSystem::DsoSystem(const SnapshotLoader &snapshotLoader,
     , scaleGTToOur(1.0)
     , cam(snapshotLoader.getCam())
     , camPyr(cam->camPyr(_settings.pyramid.levelNum))
-    , pixelSelector(_settings.pixelSelector)
+    , pixelSelector(_settings.getPixelSelectorSettings())
+    , frameBufferPool(std::shared_ptr<FrameBufferPool>(
+          new FrameBufferPool(_settings.threading.mappingQueueSize + 2)))
     , isInitialized(true)
-    , worldToFrame(_settings.initialMaxFrame)
-    , worldToFramePredict(_settings.initialMaxFrame)
-    , lastTrackRmse(INF)
+    , trackingBaseKf(nullptr)
+    , keyFrames(_settings.maxKeyFrames + 1)
+    , poseHistory(_settings.poseChunkSize)
+    , lastTrackRmse(_settings.pyramid.levelNum, INF)
     , settings(_settings)
-    , observers(observers) {
-  LOG(INFO) << "create DsoSystem" << std::endl;
-
-  frameNumbers.reserve(settings.initialMaxFrame);
+    , tracingSettings(std::make_shared<const PointTracerSettings>(
+          _settings.getPointTracerSettings()))
+    , trackerSettings(std::make_shared<const FrameTrackerSettings>(
+          _settings.getFrameTrackerSettings()))
+    , observers(observers)
+    , isMappingBusy(false)
+    , doStopMapping(false) {
+  DSO_LOG(SYSTEM, 0) << "create DsoSystem";
 
   for (DsoObserver *obs : observers.dso)
     obs->created(this, cam, settings);
 
-  snapshotLoader.load(keyFrames);
-  CHECK_GE(keyFrames.size(), 2);
+  initSubsystems();
 
+  StdMap<int, KeyFrame> loadedKeyFrames;
+  snapshotLoader.load(loadedKeyFrames);
+  CHECK_GE(loadedKeyFrames.size(), 2);
+  CHECK_LE(loadedKeyFrames.size(), settings.maxKeyFrames)
+      << "the snapshot does not fit into the keyframe window";
+  for (auto &[keyFrameNum, keyFrame] : loadedKeyFrames)
+    keyFrames.pushBack(std::move(keyFrame));
+
+  // tracked frames of a keyframe can come after the next keyframes, so the
+  // poses are sorted before being appended
+  StdMap<int, SE3> loadedWorldToFrame;
   for (auto &[keyFrameNum, keyFrame] : keyFrames) {
-    frameNumbers.push_back(keyFrameNum);
-    adjustWorldToFrameSizes(keyFrameNum);
-    worldToFramePredict[keyFrameNum] = worldToFrame[keyFrameNum] =
-        keyFrame.thisToWorld.inverse();
-    for (DsoObserver *obs : observers.dso) {
+    loadedWorldToFrame[keyFrameNum] = keyFrame.thisToWorld.inverse();
+    for (DsoObserver *obs : observers.dso)
       obs->newKeyFrame(&keyFrame);
-      for (const auto &preKeyFrame : keyFrame.trackedFrames) {
-        obs->newFrame(preKeyFrame.get());
-        int preKeyFrameNum = preKeyFrame->globalFrameNum;
-        frameNumbers.push_back(preKeyFrameNum);
-        adjustWorldToFrameSizes(preKeyFrameNum);
-        worldToFramePredict[preKeyFrameNum] = worldToFrame[preKeyFrameNum] =
-            preKeyFrame->baseToThis * keyFrame.thisToWorld.inverse();
-      }
-    }
+    for (const TrackedFrameRecord &tracked : keyFrame.trackedFrames)
+      loadedWorldToFrame[tracked.globalFrameNum] =
+          tracked.baseToThis * keyFrame.thisToWorld.inverse();
+  }
+  for (const auto &[frameNum, worldToFrame] : loadedWorldToFrame) {
+    FramePose &pose = poseHistory.append(frameNum);
+    pose.isEstimated = true;
+    pose.worldToFrame = pose.worldToFramePredict = worldToFrame;
   }
 
   if (lastKeyFrame().trackedFrames.empty())
-    lightKfToLast = lboKeyFrame().trackedFrames.back()->lightBaseToThis;
+    lightKfToLast = lboKeyFrame().trackedFrames.back().lightBaseToThis;
   else
-    lightKfToLast = lastKeyFrame().trackedFrames.back()->lightBaseToThis;
+    lightKfToLast = lastKeyFrame().trackedFrames.back().lightBaseToThis;
 
   StdVector<Vec2> points;
   std::vector<double> depths;
@@ -104,12 +139,71 @@ DsoSystem::DsoSystem(const SnapshotLoader &snapshotLoader,
       baseKeyFrame().preKeyFrame->frame(), settings.pyramid.levelNum, points,
       depths, weights));
 
-  frameTracker = std::unique_ptr<FrameTracker>(
-      new FrameTracker(camPyr, std::move(baseForTrack), observers.frameTracker,
-                       settings.getFrameTrackerSettings()));
+  publishTrackingBase(std::move(baseForTrack));
+
+  startMapping();
+}
+
+void DsoSystem::initSubsystems() {
+  if (settings.bundleAdjuster.useWindowedOptimizer)
+    windowedOptimizer.reset(
+        new WindowedOptimizer(cam, settings.getBundleAdjusterSettings()));
+  else
+    bundleAdjuster.reset(
+        new BundleAdjuster(cam, settings.getBundleAdjusterSettings()));
+  if (settings.keyFrameDatabase.enabled)
+    keyFrameDatabase.reset(new KeyFrameDatabase(settings.keyFrameDatabase));
+  if (keyFrameDatabase && settings.loopClosure.enabled)
+    loopCloser.reset(new LoopCloser(
+        cam, keyFrameDatabase.get(),
+        [this](const StdMap<int, Sim3> &worldToKeyFrame) {
+          std::lock_guard<std::mutex> lock(closedLoopsMutex);
+          closedLoops.push_back(worldToKeyFrame);
+        },
+        settings));
+  if (settings.keyFramePolicy.enabled)
+    keyFramePolicy.reset(new KeyFramePolicy(
+        cam->getWidth(), cam->getHeight(), settings.keyFramePolicy));
+  if (settings.marginalization.enabled)
+    marginalizationPolicy.reset(
+        new MarginalizationPolicy(settings.marginalization));
+  if (settings.globalBundleAdjuster.enabled)
+    globalBundleAdjuster.reset(
+        new GlobalBundleAdjuster(cam, settings.getBundleAdjusterSettings(),
+                                 settings.globalBundleAdjuster));
+  if (settings.pointBudget.enabled)
+    pointBudgetController.reset(new PointBudgetController(
+        {settings.keyFrame.pointsNum, settings.maxOptimizedPoints,
+         settings.bundleAdjuster.maxIterations},
+        settings.pointBudget));
 }
 
 DsoSystem::~DsoSystem() {
+  if (mappingThread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mappingMutex);
+      doStopMapping = true;
+    }
+    mappingCv.notify_all();
+    mappingThread.join();
+  }
+  // the loop closer may still close loops with the queued keyframes
+  loopCloser.reset();
+  notifyLoopsClosed();
+
+  if (globalBundleAdjuster && !keyFrames.empty()) {
+    std::vector<KeyFrame *> window;
+    for (auto &[num, kf] : keyFrames)
+      window.push_back(&kf);
+    std::vector<KeyFrame *> adjusted = globalBundleAdjuster->adjust(window);
+    std::vector<const KeyFrame *> adjustedConst(adjusted.begin(),
+                                                adjusted.end());
+    for (DsoObserver *obs : observers.dso)
+      obs->globalBundleAdjusted(adjustedConst);
+  }
+
+  flushPoses(true);
+
   std::vector<const KeyFrame *> lastKeyFrames;
   lastKeyFrames.reserve(keyFrames.size());
   for (const auto &kfp : keyFrames)
@@ -146,13 +240,47 @@ EIGEN_STRONG_INLINE double depth<std::unique_ptr<OptimizedPoint>>(
   return p->depth();
 }
 
-// returns reprojection + depth
-std::pair<Vec2, double> reproject(CameraModel *cam, const SE3 origToReprojected,
-                                  const Vec2 &p, double depth) {
-  Vec3 reprojectedDir =
-      origToReprojected * (depth * cam->unmap(p).normalized());
-  Vec2 reprojectedPos = cam->map(reprojectedDir);
-  return {reprojectedPos, reprojectedDir.norm()};
+// Projects the points of every keyframe that isIncluded accepts onto the
+// base keyframe, one batch per keyframe. For every projection positions, if
+// given, gets the keyframe of the point and its index there.
+template <typename PointT, typename Predicate>
+ProjectedPoints
+projectPoints(const CameraModel *cam, KeyFrameWindow &keyFrames,
+              const KeyFrame *baseKf, Predicate isIncluded,
+              std::vector<std::pair<KeyFrame *, int>> *positions) {
+  ProjectedPoints projected(cam);
+  std::vector<std::pair<KeyFrame *, std::vector<int>>> included;
+  included.reserve(keyFrames.size());
+  SE3 worldToBase = baseKf->thisToWorld.inverse();
+  for (auto &[num, kf] : keyFrames) {
+    const auto &curPoints = getPoints<PointT>(kf);
+    std::vector<int> indices;
+    std::vector<double> x, y, depths;
+    for (int i = 0; i < curPoints.size(); ++i)
+      if (isIncluded(kf, *curPoints[i])) {
+        indices.push_back(i);
+        x.push_back(curPoints[i]->p[0]);
+        y.push_back(curPoints[i]->p[1]);
+        depths.push_back(depth(curPoints[i]));
+      }
+
+    if (&kf == baseKf)
+      projected.add(nullptr, x, y, depths);
+    else {
+      SE3 curToBase = worldToBase * kf.thisToWorld;
+      projected.add(&curToBase, x, y, depths);
+    }
+    included.push_back({&kf, std::move(indices)});
+  }
+
+  if (positions) {
+    positions->resize(projected.size());
+    for (int i = 0; i < projected.size(); ++i) {
+      const auto &[kf, indices] = included[projected.source[i]];
+      (*positions)[i] = {kf, indices[projected.sourceIndex[i]]};
+    }
+  }
+  return projected;
 }
 
 template <typename PointT>
@@ -160,47 +288,32 @@ void DsoSystem::projectOntoBaseKf(StdVector<Vec2> *points,
                                   std::vector<double> *depths,
                                   std::vector<PointT *> *ptrs,
                                   std::vector<KeyFrame *> *kfs) {
-  if (points)
-    points->resize(0);
-  if (depths)
-    depths->resize(0);
-  if (ptrs)
-    ptrs->resize(0);
-  if (kfs)
-    kfs->resize(0);
-
   KeyFrame *baseKf = &baseKeyFrame();
-  for (auto &[num, kf] : keyFrames) {
-    auto &curPoints = getPoints<PointT>(kf);
-    if (&kf == baseKf) {
-      for (auto &p : curPoints)
-        if (p->state == PointT::ACTIVE) {
-          if (points)
-            points->push_back(p->p);
-          if (depths)
-            depths->push_back(depth(p));
-          if (ptrs)
-            ptrs->push_back(p.get());
-          if (kfs)
-            kfs->push_back(baseKf);
-        }
-    } else {
-      SE3 curToBase = baseKf->thisToWorld.inverse() * kf.thisToWorld;
-      for (auto &p : curPoints) {
-        Vec3 baseDir = curToBase * (depth(p) * cam->unmap(p->p).normalized());
-        Vec2 basePos = cam->map(baseDir);
-        if (!cam->isOnImage(basePos, 0))
-          continue;
-        if (points)
-          points->push_back(basePos);
-        if (depths)
-          depths->push_back(baseDir.norm());
-        if (ptrs)
-          ptrs->push_back(p.get());
-        if (kfs)
-          kfs->push_back(&kf);
-      }
-    }
+  std::vector<std::pair<KeyFrame *, int>> positions;
+  ProjectedPoints projected = projectPoints<PointT>(
+      cam, keyFrames, baseKf,
+      [baseKf](const KeyFrame &kf, const PointT &p) {
+        return &kf != baseKf || p.state == PointT::ACTIVE;
+      },
+      &positions);
+
+  if (points) {
+    points->resize(projected.size());
+    for (int i = 0; i < projected.size(); ++i)
+      (*points)[i] = Vec2(projected.x[i], projected.y[i]);
+  }
+  if (depths)
+    *depths = projected.depth;
+  if (ptrs) {
+    ptrs->resize(projected.size());
+    for (int i = 0; i < projected.size(); ++i)
+      (*ptrs)[i] = getPoints<PointT>(*positions[i].first)[positions[i].second]
+                       .get();
+  }
+  if (kfs) {
+    kfs->resize(projected.size());
+    for (int i = 0; i < projected.size(); ++i)
+      (*kfs)[i] = positions[i].first;
   }
 }
 
@@ -229,12 +342,12 @@ SE3 predictSimpleInternal(double timeLastByLbo, const SE3 &baseToLbo,
 }
 
 double DsoSystem::getTimeLastByLbo() {
-  CHECK(frameNumbers.size() >= 3);
+  CHECK(poseHistory.size() >= 3);
 
-  int prevFramesSkipped = frameNumbers[frameNumbers.size() - 3] -
-                          frameNumbers[frameNumbers.size() - 2];
-  int lastFramesSkipped = frameNumbers[frameNumbers.size() - 2] -
-                          frameNumbers[frameNumbers.size() - 1];
+  int prevFramesSkipped =
+      poseHistory.lastFrameNum(2) - poseHistory.lastFrameNum(1);
+  int lastFramesSkipped =
+      poseHistory.lastFrameNum(1) - poseHistory.lastFrameNum(0);
   return double(lastFramesSkipped) / prevFramesSkipped;
 }
 
@@ -248,19 +361,21 @@ SE3 DsoSystem::predictInternal(double timeLastByLbo, const SE3 &baseToLbo,
 SE3 DsoSystem::predictBaseKfToCur() {
   double timeLastByLbo = getTimeLastByLbo();
 
-  SE3 baseToLbo = worldToFrame[frameNumbers[frameNumbers.size() - 3]] *
-                  baseKeyFrame().thisToWorld;
-  SE3 baseToLast = worldToFrame[frameNumbers[frameNumbers.size() - 2]] *
-                   baseKeyFrame().thisToWorld;
+  SE3 baseToLbo = poseHistory[poseHistory.lastFrameNum(2)].worldToFrame *
+                  trackingBaseToWorld;
+  SE3 baseToLast = poseHistory[poseHistory.lastFrameNum(1)].worldToFrame *
+                   trackingBaseToWorld;
 
   return predictInternal(timeLastByLbo, baseToLbo, baseToLast);
 }
 
 SE3 DsoSystem::purePredictBaseKfToCur() {
-  SE3 baseToLbo = worldToFramePredict[frameNumbers[frameNumbers.size() - 3]] *
-                  baseKeyFrame().thisToWorld;
-  SE3 baseToLast = worldToFramePredict[frameNumbers[frameNumbers.size() - 2]] *
-                   baseKeyFrame().thisToWorld;
+  SE3 baseToLbo =
+      poseHistory[poseHistory.lastFrameNum(2)].worldToFramePredict *
+      trackingBaseToWorld;
+  SE3 baseToLast =
+      poseHistory[poseHistory.lastFrameNum(1)].worldToFramePredict *
+      trackingBaseToWorld;
 
   return predictInternal(getTimeLastByLbo(), baseToLbo, baseToLast);
 }
@@ -268,79 +383,193 @@ SE3 DsoSystem::purePredictBaseKfToCur() {
 bool DsoSystem::doNeedKf(PreKeyFrame *lastFrame) {
   int shift =
       lastFrame->globalFrameNum - lastKeyFrame().preKeyFrame->globalFrameNum;
-  return shift > 0 && shift % settings.shiftBetweenKeyFrames == 0;
+  if (!keyFramePolicy)
+    return shift > 0 && shift % settings.shiftBetweenKeyFrames == 0;
+  if (shift <= 0)
+    return false;
+
+  if (referenceTrackRmse <= 0)
+    referenceTrackRmse = lastFrame->trackRmse;
+  KeyFrameCues cues = keyFrameCues(*lastFrame, shift);
+  bool needKf = keyFramePolicy->needKeyFrame(cues);
+  if (needKf) {
+    DSO_LOG(MAPPING, 1) << "keyframe on frame #" << lastFrame->globalFrameNum
+                        << ": score = " << keyFramePolicy->score(cues)
+                        << ", visible = " << cues.visibleRatio
+                        << ", rmse ratio = " << cues.rmseRatio;
+    PROFILE_COUNT("dso.keyFrameGap", shift);
+    referenceTrackRmse = 0;
+  }
+  return needKf;
+}
+
+KeyFrameCues DsoSystem::keyFrameCues(const PreKeyFrame &frame,
+                                     int framesSinceKeyFrame) const {
+  const SE3 &baseToThis = frame.baseToThis;
+  auto isVisible = [this](const Vec3 &point) {
+    double cosAngle = std::clamp(point.normalized()[2], -1.0, 1.0);
+    return std::acos(cosAngle) <= cam->getMaxAngle();
+  };
+
+  int total = 0, visible = 0;
+  double sqFlow = 0, sqTranslationFlow = 0;
+  for (const auto &op : frame.baseKeyFrame->optimizedPoints) {
+    if (op->state != OptimizedPoint::ACTIVE)
+      continue;
+    total++;
+    Vec3 pointInBase = op->depth() * cam->unmap(op->p).normalized();
+    Vec3 pointInThis = baseToThis * pointInBase;
+    if (!isVisible(pointInThis))
+      continue;
+    Vec2 projected = cam->map(pointInThis);
+    if (!cam->isOnImage(projected, 0))
+      continue;
+    visible++;
+    sqFlow += (projected - op->p).squaredNorm();
+    Vec3 translated = pointInBase + baseToThis.translation();
+    if (isVisible(translated))
+      sqTranslationFlow += (cam->map(translated) - op->p).squaredNorm();
+  }
+
+  KeyFrameCues cues;
+  cues.flow = visible > 0 ? std::sqrt(sqFlow / visible) : 0;
+  cues.translationFlow =
+      visible > 0 ? std::sqrt(sqTranslationFlow / visible) : 0;
+  cues.visibleRatio = total > 0 ? double(visible) / total : 0;
+  cues.lightChange = std::abs(frame.lightBaseToThis.data[0]);
+  cues.rmseRatio =
+      referenceTrackRmse > 0 ? frame.trackRmse / referenceTrackRmse : 1;
+  cues.framesSinceKeyFrame = framesSinceKeyFrame;
+  return cues;
 }
 
 void DsoSystem::addFrameTrackerObserver(FrameTrackerObserver *observer) {
+  std::lock_guard<std::mutex> lock(trackingMutex);
   observers.frameTracker.push_back(observer);
   if (frameTracker)
     frameTracker->addObserver(observer);
 }
 
-void DsoSystem::marginalizeFrames() {
-  if (keyFrames.size() > settings.maxKeyFrames) {
-    int count = static_cast<int>(keyFrames.size()) - settings.maxKeyFrames;
-    std::vector<const KeyFrame *> marginalized;
-    marginalized.reserve(count);
-    auto kfIt = keyFrames.begin();
-    for (int i = 0; i < count; ++i, ++kfIt)
-      marginalized.push_back(&kfIt->second);
-    for (DsoObserver *obs : observers.dso)
-      obs->keyFramesMarginalized(marginalized);
+void DsoSystem::enableImu(const SE3 &imuToCam, const Vec3 &gyroBias) {
+  imu.reset(new ImuPreintegrator(imuToCam, gyroBias));
+}
 
-    for (int i = 0; i < count; ++i)
-      keyFrames.erase(keyFrames.begin());
-  }
+void DsoSystem::addImuMeasurement(const ImuMeasurement &measurement) {
+  CHECK(imu) << "enableImu should be called before adding measurements";
+  imu->addMeasurement(measurement);
 }
 
-void DsoSystem::activateNewOptimizedPoints() {
-  StdVector<Vec2> optPoints;
-  for (const auto &[num, kf] : keyFrames) {
-    SE3 refToBase = baseKeyFrame().thisToWorld.inverse() * kf.thisToWorld;
-    for (const auto &op : kf.optimizedPoints)
-      if (op->state == OptimizedPoint::ACTIVE) {
-        auto [p, depth] = (&kf == &baseKeyFrame()
-                               ? std::pair(op->p, op->depth())
-                               : reproject(cam, refToBase, op->p, op->depth()));
-        optPoints.push_back(p);
-      }
+double DsoSystem::visibleRatio(const KeyFrame &keyFrame,
+                               const KeyFrame &other) const {
+  SE3 thisToOther = other.thisToWorld.inverse() * keyFrame.thisToWorld;
+  int total = 0, visible = 0;
+  for (const auto &op : keyFrame.optimizedPoints) {
+    if (op->state != OptimizedPoint::ACTIVE)
+      continue;
+    total++;
+    Vec3 pointInOther =
+        thisToOther * (op->depth() * cam->unmap(op->p).normalized());
+    double cosAngle = std::clamp(pointInOther.normalized()[2], -1.0, 1.0);
+    if (std::acos(cosAngle) <= cam->getMaxAngle() &&
+        cam->isOnImage(cam->map(pointInOther), 0))
+      visible++;
   }
+  return total > 0 ? double(visible) / total : 0;
+}
 
-  DistanceMap distMap(cam->getWidth(), cam->getHeight(), optPoints);
-
-  StdVector<Vec2> projectedImmatures;
-  std::vector<std::pair<KeyFrame *, int>> immaturePositions;
+void DsoSystem::marginalizeFrames(StageClock *clock) {
+  std::vector<int> chosen;
+  if (marginalizationPolicy) {
+    StdVector<SE3> thisToWorld;
+    std::vector<double> visibleRatios;
+    for (const auto &[num, kf] : keyFrames) {
+      thisToWorld.push_back(kf.thisToWorld);
+      visibleRatios.push_back(visibleRatio(kf, keyFrames.back()));
+    }
+    chosen = marginalizationPolicy->choose(thisToWorld, visibleRatios,
+                                           settings.maxKeyFrames);
+  } else
+    for (int i = 0; i < int(keyFrames.size()) - settings.maxKeyFrames; ++i)
+      chosen.push_back(i);
+
+  if (!chosen.empty()) {
+    PROFILE_SCOPE("dso.marginalize");
+    std::vector<const KeyFrame *> marginalized;
+    marginalized.reserve(chosen.size());
+    for (int i : chosen)
+      marginalized.push_back(&keyFrames[i].second);
+    {
+      StageClock::Switch toObservers(clock, FrameTimings::OBSERVERS);
+      for (DsoObserver *obs : observers.dso)
+        obs->keyFramesMarginalized(marginalized);
+    }
 
-  for (auto &[num, kf] : keyFrames) {
-    SE3 refToBase = baseKeyFrame().thisToWorld.inverse() * kf.thisToWorld;
-    for (int ind = 0; ind < kf.immaturePoints.size(); ++ind) {
-      const auto &ip = kf.immaturePoints[ind];
-      if (ip->isReady()) {
-        auto [p, depth] = (&kf == &baseKeyFrame()
-                               ? std::pair(ip->p, ip->depth)
-                               : reproject(cam, refToBase, ip->p, ip->depth));
-        projectedImmatures.push_back(p);
-        immaturePositions.push_back({&kf, ind});
+    // oldest first, each one shifting the indices of the next ones
+    for (int k = 0; k < chosen.size(); ++k) {
+      const int i = chosen[k] - k;
+      KeyFrame &keyFrame = keyFrames[i].second;
+      if (windowedOptimizer) {
+        std::vector<KeyFrame *> window;
+        for (auto &[num, kf] : keyFrames)
+          window.push_back(&kf);
+        windowedOptimizer->marginalize(&keyFrame, window);
       }
+      if (bundleAdjuster)
+        bundleAdjuster->removeKeyFrame(&keyFrame);
+      keyFrame.imageTiles->release();
+      if (keyFrame.cubeMap)
+        keyFrame.cubeMap->release();
+      if (keyFrameDatabase) {
+        auto entry = addToDatabase(keyFrame);
+        if (loopCloser)
+          loopCloser->addKeyFrame(entry);
+      }
+      if (globalBundleAdjuster)
+        globalBundleAdjuster->addKeyFrame(std::move(keyFrame));
+      keyFrames.erase(i);
     }
+
+    flushPoses(false, clock);
   }
+}
 
-  LOG(INFO) << "\n\nPOINT SELECTION\n"
-            << "Ready to be optimized = " << projectedImmatures.size()
-            << std::endl;
+void DsoSystem::activateNewOptimizedPoints() {
+  PROFILE_SCOPE("dso.activate");
+  ProjectedPoints optProjected = projectPoints<OptimizedPoint>(
+      cam, keyFrames, &baseKeyFrame(),
+      [](const KeyFrame &, const OptimizedPoint &op) {
+        return op.state == OptimizedPoint::ACTIVE;
+      },
+      nullptr);
+  StdVector<Vec2> optPoints(optProjected.size());
+  for (int i = 0; i < optProjected.size(); ++i)
+    optPoints[i] = Vec2(optProjected.x[i], optProjected.y[i]);
+
+  DistanceMap distMap(cam->getWidth(), cam->getHeight(), optPoints,
+                      settings.distanceMap);
+
+  std::vector<std::pair<KeyFrame *, int>> immaturePositions;
+  ProjectedPoints projectedImmatures = projectPoints<ImmaturePoint>(
+      cam, keyFrames, &baseKeyFrame(),
+      [](const KeyFrame &, ImmaturePoint &ip) { return ip.isReady(); },
+      &immaturePositions);
+  projectedImmatures.buildGrid(settings.distanceMap.cellSize);
 
   int curOptPoints = std::accumulate(
       keyFrames.begin(), keyFrames.end(), 0, [](int acc, const auto &kfp) {
         return acc + kfp.second.optimizedPoints.size();
       });
   int pointsNeeded = settings.maxOptimizedPoints - curOptPoints;
-  LOG(INFO) << "Current # of OptimizedPoint-s = " << curOptPoints
-            << ", needed = " << pointsNeeded << '\n';
 
   std::vector<int> activatedIndices =
-      distMap.choose(projectedImmatures, pointsNeeded);
-  LOG(INFO) << "New OptimizedPoint-s = " << activatedIndices.size()
-            << std::endl;
+      distMap.choose(projectedImmatures.x, projectedImmatures.y,
+                     projectedImmatures.getGrid(), pointsNeeded);
+  DSO_LOG(MAPPING, 1) << "point selection: ready to be optimized = "
+                      << projectedImmatures.size()
+                      << ", current optimized = " << curOptPoints
+                      << ", needed = " << pointsNeeded
+                      << ", activated = " << activatedIndices.size();
+  PROFILE_COUNT("dso.activated", activatedIndices.size());
   std::sort(activatedIndices.begin(), activatedIndices.end(),
             [&immaturePositions](int i1, int i2) {
               return immaturePositions[i1].second >
@@ -352,55 +581,289 @@ void DsoSystem::activateNewOptimizedPoints() {
     auto &ip = kf->immaturePoints[immaturePositions[i].second];
     kf->optimizedPoints.push_back(
         std::unique_ptr<OptimizedPoint>(new OptimizedPoint(*ip)));
-
-    std::swap(ip, kf->immaturePoints.back());
-    kf->immaturePoints.pop_back();
+    ip.reset();
+  }
+  // removed in order, so that the rest stay in the order of their slots
+  for (auto &[num, kf] : keyFrames) {
+    auto &ips = kf.immaturePoints;
+    ips.erase(std::remove(ips.begin(), ips.end(), nullptr), ips.end());
   }
 }
 
-bool DsoSystem::didTrackFail() {
-  return frameTracker->lastRmse >
-         lastTrackRmse * settings.frameTracker.trackFailFactor;
+bool DsoSystem::didTrackFail(double trackRmse, int trackRmseLevel) {
+  return trackRmse > lastTrackRmse[trackRmseLevel] *
+                         settings.frameTracker.trackFailFactor;
 }
 
 std::pair<SE3, AffineLightTransform<double>>
-DsoSystem::recoverTrack(PreKeyFrame *lastFrame) {
-  // TODO
-  typedef std::pair<SE3, AffineLightTransform<double>> retT;
-  return retT();
+DsoSystem::recoverTrack(const FrameTracker &tracker, PreKeyFrame *lastFrame,
+                        double timeLastByLbo, const SE3 &baseToLbo,
+                        const SE3 &baseToLast) {
+  StdVector<SE3> hypotheses;
+  hypotheses.push_back(predictInternal(timeLastByLbo, baseToLbo, baseToLast));
+  hypotheses.push_back(baseToLast);
+  hypotheses.push_back(
+      predictInternal(0.5 * timeLastByLbo, baseToLbo, baseToLast));
+  hypotheses.push_back(
+      predictInternal(2 * timeLastByLbo, baseToLbo, baseToLast));
+  for (int axis = 0; axis < 3; ++axis)
+    for (double sign : {-1.0, 1.0}) {
+      Vec3 rot = Vec3::Zero();
+      rot[axis] = sign * settings.frameTracker.recoveryRotation;
+      hypotheses.push_back(SE3(SO3::exp(rot), Vec3::Zero()) * hypotheses[0]);
+    }
+
+  struct Attempt {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    SE3 baseToLast;
+    AffineLightTransform<double> affLight;
+    double rmse = INF;
+  };
+  StdVector<Attempt> attempts(hypotheses.size());
+
+  int coarsestLevel = settings.pyramid.levelNum - 1;
+  ParallelExecutor executor(settings.threading, Scheduler::TRACKING);
+  executor.execute([&]() {
+    tbb::parallel_for(0, int(hypotheses.size()), [&](int i) {
+      std::tie(attempts[i].baseToLast, attempts[i].affLight) =
+          tracker.trackFrameQuiet(*lastFrame, hypotheses[i], lightKfToLast,
+                                  coarsestLevel, &attempts[i].rmse);
+    });
+  });
+
+  std::sort(attempts.begin(), attempts.end(),
+            [](const Attempt &a, const Attempt &b) { return a.rmse < b.rmse; });
+  attempts.resize(std::min(int(attempts.size()),
+                           settings.frameTracker.recoveryCandidates));
+
+  executor.execute([&]() {
+    tbb::parallel_for(0, int(attempts.size()), [&](int i) {
+      std::tie(attempts[i].baseToLast, attempts[i].affLight) =
+          tracker.trackFrameQuiet(*lastFrame, attempts[i].baseToLast,
+                                  attempts[i].affLight, 0, &attempts[i].rmse);
+    });
+  });
+
+  auto best = std::min_element(
+      attempts.begin(), attempts.end(),
+      [](const Attempt &a, const Attempt &b) { return a.rmse < b.rmse; });
+  DSO_LOG(TRACKING, 0) << "track recovered out of " << hypotheses.size()
+                       << " hypotheses, rmse = " << best->rmse;
+  return {best->baseToLast, best->affLight};
+}
+
+std::optional<SE3> DsoSystem::relocalize(PreKeyFrame *lastFrame,
+                                         const SE3 &baseToWorld) {
+  PROFILE_SCOPE("dso.relocalize");
+  std::vector<std::shared_ptr<const KeyFrameDatabase::Entry>> candidates =
+      keyFrameDatabase->query(lastFrame->frame());
+  if (candidates.empty())
+    return std::nullopt;
+
+  struct Attempt {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    SE3 recalledToLast;
+    double rmse = INF;
+  };
+  StdVector<Attempt> attempts(candidates.size());
+
+  int coarsestLevel = settings.pyramid.levelNum - 1;
+  ParallelExecutor(settings.threading, Scheduler::TRACKING).execute([&]() {
+    tbb::parallel_for(0, int(candidates.size()), [&](int i) {
+      std::unique_ptr<DepthedImagePyramid> recalled(
+          new DepthedImagePyramid(candidates[i]->trackingBase));
+      FrameTracker tracker(camPyr, std::move(recalled), {}, trackerSettings);
+      std::tie(attempts[i].recalledToLast, std::ignore) =
+          tracker.trackFrameQuiet(*lastFrame, SE3(), AffLight(), coarsestLevel,
+                                  &attempts[i].rmse);
+    });
+  });
+
+  int best = std::min_element(attempts.begin(), attempts.end(),
+                              [](const Attempt &a, const Attempt &b) {
+                                return a.rmse < b.rmse;
+                              }) -
+             attempts.begin();
+  if (attempts[best].rmse == INF)
+    return std::nullopt;
+
+  DSO_LOG(TRACKING, 0) << "relocalized against keyframe #"
+                       << candidates[best]->globalFrameNum
+                       << ", coarse rmse = " << attempts[best].rmse;
+  SE3 worldToLast = attempts[best].recalledToLast *
+                    candidates[best]->thisToWorld.inverse();
+  return worldToLast * baseToWorld;
+}
+
+std::shared_ptr<const KeyFrameDatabase::Entry>
+DsoSystem::addToDatabase(const KeyFrame &keyFrame) {
+  std::vector<double> xs, ys, depths, weights;
+  for (const auto &op : keyFrame.optimizedPoints)
+    if (op->state == OptimizedPoint::ACTIVE) {
+      xs.push_back(op->p[0]);
+      ys.push_back(op->p[1]);
+      depths.push_back(op->depth());
+      weights.push_back(1.0 / op->stddev);
+    }
+
+  // the frame buffers go back to the pool with the keyframe
+  DepthedImagePyramid trackingBase(keyFrame.preKeyFrame->frame().clone(),
+                                   settings.pyramid.levelNum, xs, ys, depths,
+                                   weights);
+  return keyFrameDatabase->add(keyFrame.preKeyFrame->globalFrameNum,
+                               keyFrame.thisToWorld, trackingBase);
 }
 
-void DsoSystem::adjustWorldToFrameSizes(int newFrameNum) {
-  CHECK(newFrameNum > 0);
-  if (newFrameNum >= worldToFrame.size()) {
-    worldToFrame.resize(newFrameNum + 1);
-    worldToFramePredict.resize(newFrameNum + 1);
+void DsoSystem::flushPoses(bool flushAll, StageClock *clock) {
+  std::vector<PoseHistory::Chunk> flushed;
+  {
+    std::lock_guard<std::mutex> lock(trackingMutex);
+    if (flushAll)
+      flushed = poseHistory.flushAll();
+    else if (poseHistory.size() >= 3) {
+      // the prediction needs the last three frames
+      int minFrameNum = std::min(keyFrames.frontNum(),
+                                 poseHistory.lastFrameNum(2));
+      flushed = poseHistory.flushBefore(minFrameNum);
+    }
   }
+  StageClock::Switch toObservers(clock, FrameTimings::OBSERVERS);
+  for (const PoseHistory::Chunk &chunk : flushed)
+    for (DsoObserver *obs : observers.dso)
+      obs->posesFlushed(chunk);
+}
+
+struct TracingStats {
+  static constexpr int maxTraced = 8;
+
+  TracingStats(int levelNum)
+      : totalTraced(0)
+      , totalGood(0)
+      , numTraced(maxTraced, 0)
+      , numOnLevel(levelNum, 0) {}
+
+  void add(ImmaturePoint &ip, ImmaturePoint::TracingStatus status) {
+    if (status == ImmaturePoint::OK)
+      totalTraced++;
+    if (ip.isReady())
+      totalGood++;
+
+    if (ip.numTraced < maxTraced)
+      numTraced[ip.numTraced]++;
+    if (ip.tracedPyrLevel >= 0)
+      numOnLevel[ip.tracedPyrLevel]++;
+  }
+
+  void join(const TracingStats &other) {
+    totalTraced += other.totalTraced;
+    totalGood += other.totalGood;
+    for (int i = 0; i < maxTraced; ++i)
+      numTraced[i] += other.numTraced[i];
+    for (int i = 0; i < numOnLevel.size(); ++i)
+      numOnLevel[i] += other.numOnLevel[i];
+  }
+
+  int totalTraced, totalGood;
+  std::vector<int> numTraced;
+  std::vector<int> numOnLevel;
+};
+
+// 0 for the frames without an arrival time
+double frameAge(std::chrono::steady_clock::time_point arrivalTime) {
+  if (arrivalTime == std::chrono::steady_clock::time_point())
+    return 0;
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       arrivalTime)
+      .count();
+}
+
+void DsoSystem::skipFrame(int globalFrameNum) {
+  DSO_LOG_EVERY_SEC(SYSTEM, 1, 1.0)
+      << "frame #" << globalFrameNum << " is late, skipping it";
+  PROFILE_COUNT("shedding.skipped", 1);
+  skippedFrameNum++;
+
+  std::lock_guard<std::mutex> lock(trackingMutex);
+  FramePose &pose = poseHistory[globalFrameNum];
+  pose.isEstimated = true;
+  pose.isSkipped = true;
+  pose.worldToFrame = predictBaseKfToCur() * trackingBaseToWorld.inverse();
+  pose.worldToFramePredict =
+      purePredictBaseKfToCur() * trackingBaseToWorld.inverse();
+}
+
+bool DsoSystem::isMappingBehind(const PreKeyFrame &preKeyFrame) const {
+  if (!settings.loadShedding.enabled)
+    return false;
+  if (frameAge(preKeyFrame.arrivalTime) > settings.loadShedding.maxTracingAge)
+    return true;
+  // the frame being mapped is counted too
+  return settings.threading.asyncMapping &&
+         mappingLag() > settings.loadShedding.maxMappingLag;
+}
+
+DsoSystem::SheddingStats DsoSystem::sheddingStats() const {
+  return {skippedFrameNum.load(), untracedFrameNum.load(),
+          deferredBaNum.load()};
 }
 
 std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
                                                  int globalFrameNum) {
-  LOG(INFO) << "add frame #" << globalFrameNum << std::endl;
+  SourceFrame sourceFrame;
+  sourceFrame.gray = cvtBgrToGray(frame);
+  sourceFrame.colorProvider = [frame]() { return cv::Mat3b(frame); };
+  sourceFrame.globalFrameNum = globalFrameNum;
+  return addFrame(sourceFrame);
+}
+
+std::shared_ptr<PreKeyFrame>
+DsoSystem::prepareFrame(const SourceFrame &frame) const {
+  // the pyramid is first touched on the cores of the instance
+  ScopedAffinity affinity(settings.threading.cores);
+  return std::shared_ptr<PreKeyFrame>(
+      new PreKeyFrame(nullptr, cam, frame, settings.pyramid, frameBufferPool));
+}
+
+std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const SourceFrame &frame) {
+  return addFrame(frame, nullptr);
+}
 
-  adjustWorldToFrameSizes(globalFrameNum);
-  CHECK(frameNumbers.empty() || globalFrameNum > frameNumbers.back());
-  frameNumbers.push_back(globalFrameNum);
+std::shared_ptr<PreKeyFrame>
+DsoSystem::addFrame(const SourceFrame &frame,
+                    std::shared_ptr<PreKeyFrame> prepared) {
+  ScopedAffinity affinity(settings.threading.cores);
+  int globalFrameNum = frame.globalFrameNum;
+  DSO_LOG(SYSTEM, 2) << "add frame #" << globalFrameNum;
+
+  std::optional<double> prevFrameTimestamp = lastFrameTimestamp;
+  if (imu) {
+    lastFrameTimestamp = frame.timestamp;
+    if (prevFrameTimestamp)
+      imu->discardBefore(*prevFrameTimestamp);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(trackingMutex);
+    CHECK(poseHistory.empty() || globalFrameNum > poseHistory.lastFrameNum());
+    poseHistory.append(globalFrameNum).timestamp = frame.timestamp;
+  }
 
   if (!isInitialized) {
-    LOG(INFO) << "put into initializer" << std::endl;
-    isInitialized = dsoInitializer->addFrame(frame, globalFrameNum);
+    DSO_LOG(INIT, 2) << "put into initializer";
+    isInitialized = dsoInitializer->addFrame(frame);
 
     if (isInitialized) {
-      LOG(INFO) << "initialization successful" << std::endl;
+      DSO_LOG(INIT, 0) << "initialization successful";
       StdVector<KeyFrame> kf = dsoInitializer->createKeyFrames();
-      for (const auto &f : kf)
-        worldToFramePredict[f.preKeyFrame->globalFrameNum] =
-            worldToFrame[f.preKeyFrame->globalFrameNum] =
-                f.thisToWorld.inverse();
-      for (KeyFrame &keyFrame : kf) {
-        int num = keyFrame.preKeyFrame->globalFrameNum;
-        keyFrames.insert(std::pair<int, KeyFrame>(num, std::move(keyFrame)));
+      for (const auto &f : kf) {
+        FramePose &pose = poseHistory[f.preKeyFrame->globalFrameNum];
+        pose.isEstimated = true;
+        pose.worldToFramePredict = pose.worldToFrame = f.thisToWorld.inverse();
       }
+      for (KeyFrame &keyFrame : kf)
+        keyFrames.pushBack(std::move(keyFrame));
 
       std::vector<const KeyFrame *> initializedKFs;
       initializedKFs.reserve(keyFrames.size());
@@ -428,127 +891,512 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
           baseKeyFrame().preKeyFrame->frame(), settings.pyramid.levelNum,
           points, depths, weights));
 
-      frameTracker = std::unique_ptr<FrameTracker>(new FrameTracker(
-          camPyr, std::move(initialTrack), observers.frameTracker,
-          settings.getFrameTrackerSettings()));
+      publishTrackingBase(std::move(initialTrack));
 
-      lastInitialized = &keyFrames.rbegin()->second;
+      lastInitialized = &keyFrames.back();
 
       for (DsoObserver *obs : observers.dso)
         obs->newKeyFrame(&baseKeyFrame());
 
+      // the initialization is not attributed to any of the frames
+      Profiler::collect();
+
       return lastInitialized->preKeyFrame;
     }
 
     return nullptr;
   }
 
-  std::shared_ptr<PreKeyFrame> preKeyFrame(
-      new PreKeyFrame(&baseKeyFrame(), cam, frame, globalFrameNum));
+  if (settings.loadShedding.enabled &&
+      frameAge(frame.arrivalTime) > settings.loadShedding.maxFrameAge) {
+    skipFrame(globalFrameNum);
+    return nullptr;
+  }
+
+  FrameTimings timings;
+  timings.globalFrameNum = globalFrameNum;
+  StageClock clock(timings, FrameTimings::TRACKING);
+
+  std::shared_ptr<FrameTracker> curFrameTracker;
+  KeyFrame *baseKf;
+  int baseKfNum;
+  SE3 baseToWorld;
+  SE3 purePredicted, predicted;
+  double timeLastByLbo;
+  SE3 baseToLbo, baseToLast;
+  {
+    std::lock_guard<std::mutex> lock(trackingMutex);
+    curFrameTracker = frameTracker;
+    baseKf = trackingBaseKf;
+    baseKfNum = trackingBaseKf->preKeyFrame->globalFrameNum;
+    baseToWorld = trackingBaseToWorld;
+    purePredicted = purePredictBaseKfToCur();
+    predicted = predictBaseKfToCur();
+    timeLastByLbo = getTimeLastByLbo();
+    baseToLbo = poseHistory[poseHistory.lastFrameNum(2)].worldToFrame *
+                trackingBaseToWorld;
+    baseToLast = poseHistory[poseHistory.lastFrameNum(1)].worldToFrame *
+                 trackingBaseToWorld;
+  }
 
-  for (DsoObserver *obs : observers.dso)
-    obs->newFrame(preKeyFrame.get());
+  // the IMU rotation replaces the extrapolated one, the translation is
+  // still extrapolated
+  std::optional<SO3> rotationPrior;
+  if (imu && prevFrameTimestamp) {
+    std::optional<ImuDelta> imuDelta =
+        imu->integrate(*prevFrameTimestamp, frame.timestamp);
+    if (imuDelta) {
+      SE3 lastToCur = predicted * baseToLast.inverse();
+      lastToCur.so3() = imu->camRotation(*imuDelta);
+      predicted = lastToCur * baseToLast;
+      rotationPrior = predicted.so3();
+    } else
+      LOG(WARNING) << "IMU measurements do not cover frame #"
+                   << globalFrameNum;
+  }
+
+  std::shared_ptr<PreKeyFrame> preKeyFrame =
+      prepared ? std::move(prepared) : prepareFrame(frame);
+  CHECK_EQ(preKeyFrame->globalFrameNum, globalFrameNum);
+  preKeyFrame->baseKeyFrame = baseKf;
+  preKeyFrame->baseKeyFrameNum = baseKfNum;
+
+  auto [baseKfToCur, lightBaseKfToCur] = trackWithFallbacks(
+      *curFrameTracker, preKeyFrame.get(), predicted, rotationPrior,
+      timeLastByLbo, baseToLbo, baseToLast, baseToWorld);
+  finishFrame(preKeyFrame, curFrameTracker->lastRmse,
+              curFrameTracker->lastRmseLevel, baseKfToCur, lightBaseKfToCur,
+              predicted, purePredicted, baseToWorld, timings, clock);
+  return preKeyFrame;
+}
 
+std::pair<SE3, AffineLightTransform<double>> DsoSystem::trackWithFallbacks(
+    FrameTracker &tracker, PreKeyFrame *preKeyFrame, const SE3 &predicted,
+    const std::optional<SO3> &rotationPrior, double timeLastByLbo,
+    const SE3 &baseToLbo, const SE3 &baseToLast, const SE3 &baseToWorld) {
+  int globalFrameNum = preKeyFrame->globalFrameNum;
   SE3 baseKfToCur;
   AffineLightTransform<double> lightBaseKfToCur;
 
-  SE3 purePredicted = purePredictBaseKfToCur();
-  SE3 predicted = predictBaseKfToCur();
-
   std::tie(baseKfToCur, lightBaseKfToCur) =
-      frameTracker->trackFrame(*preKeyFrame, predicted, lightKfToLast);
+      tracker.trackFrame(*preKeyFrame, predicted, lightKfToLast, rotationPrior);
+
+  if (settings.frameTracker.recoverTrack &&
+      didTrackFail(tracker.lastRmse, tracker.lastRmseLevel)) {
+    LOG(WARNING) << "tracking failed on frame #" << globalFrameNum
+                 << ", rmse = " << tracker.lastRmse
+                 << ", trying to recover" << std::endl;
+    std::tie(baseKfToCur, lightBaseKfToCur) = recoverTrack(
+        tracker, preKeyFrame, timeLastByLbo, baseToLbo, baseToLast);
+    // converges at once, but lets the observers and lastRmse see the result
+    std::tie(baseKfToCur, lightBaseKfToCur) =
+        tracker.trackFrame(*preKeyFrame, baseKfToCur, lightBaseKfToCur);
+  }
+  if (keyFrameDatabase &&
+      didTrackFail(tracker.lastRmse, tracker.lastRmseLevel)) {
+    LOG(WARNING) << "tracking failed on frame #" << globalFrameNum
+                 << ", rmse = " << tracker.lastRmse
+                 << ", trying to relocalize" << std::endl;
+    std::optional<SE3> relocalized = relocalize(preKeyFrame, baseToWorld);
+    if (relocalized) {
+      double rmse = INF;
+      int rmseLevel = 0;
+      auto [relocBaseKfToCur, relocLight] = tracker.trackFrameQuiet(
+          *preKeyFrame, *relocalized, lightKfToLast, 0, &rmse, &rmseLevel);
+      bool isBetter = rmseLevel == tracker.lastRmseLevel
+                          ? rmse < tracker.lastRmse
+                          : !didTrackFail(rmse, rmseLevel);
+      if (isBetter)
+        std::tie(baseKfToCur, lightBaseKfToCur) =
+            tracker.trackFrame(*preKeyFrame, relocBaseKfToCur, relocLight);
+    }
+  }
+  return {baseKfToCur, lightBaseKfToCur};
+}
+
+void DsoSystem::finishFrame(
+    const std::shared_ptr<PreKeyFrame> &preKeyFrame, double trackRmse,
+    int trackRmseLevel, const SE3 &baseKfToCur,
+    const AffineLightTransform<double> &lightBaseKfToCur, const SE3 &predicted,
+    const SE3 &purePredicted, const SE3 &baseToWorld, FrameTimings &timings,
+    StageClock &clock) {
+  int globalFrameNum = preKeyFrame->globalFrameNum;
+  lastTrackRmse[trackRmseLevel] = trackRmse;
+  preKeyFrame->trackRmse = trackRmse;
 
   preKeyFrame->lightBaseToThis = lightBaseKfToCur;
 
-  LOG(INFO) << "aff light (base to cur): (fnum=" << preKeyFrame->globalFrameNum
-            << ")\n"
-            << preKeyFrame->lightBaseToThis << std::endl;
+  DSO_LOG(TRACKING, 2) << "aff light (base to cur): (fnum="
+                       << preKeyFrame->globalFrameNum << ")\n"
+                       << preKeyFrame->lightBaseToThis;
 
-  worldToFrame[globalFrameNum] =
-      baseKfToCur * baseKeyFrame().thisToWorld.inverse();
-  worldToFramePredict[globalFrameNum] =
-      purePredicted * baseKeyFrame().thisToWorld.inverse();
+  {
+    std::lock_guard<std::mutex> lock(trackingMutex);
+    FramePose &pose = poseHistory[globalFrameNum];
+    pose.isEstimated = true;
+    pose.worldToFrame = baseKfToCur * baseToWorld.inverse();
+    pose.worldToFramePredict = purePredicted * baseToWorld.inverse();
+  }
 
   preKeyFrame->baseToThis = baseKfToCur;
 
   lightKfToLast = lightBaseKfToCur;
 
-  SE3 diff = baseKfToCur * predicted.inverse();
-  LOG(INFO) << "diff to predicted (trans and rot): "
-            << diff.translation().norm() << " " << diff.so3().log().norm()
-            << '\n';
-
-  int totalTraced = 0, totalGood = 0;
-  constexpr int maxTraced = 8;
-  std::vector<int> numTraced(maxTraced, 0);
-  std::vector<int> numOnLevel(settings.pyramid.levelNum, 0);
-  for (const auto &[num, kf] : keyFrames)
-    for (auto &ip : kf.immaturePoints) {
-      auto status = ip->traceOn(kf, *preKeyFrame, ImmaturePoint::NO_DEBUG);
-
-      if (status == ImmaturePoint::OK)
-        totalTraced++;
-      if (ip->isReady())
-        totalGood++;
-
-      if (ip->numTraced < maxTraced)
-        numTraced[ip->numTraced]++;
-      if (ip->tracedPyrLevel >= 0)
-        numOnLevel[ip->tracedPyrLevel]++;
+  {
+    StageClock::Switch toObservers(&clock, FrameTimings::OBSERVERS);
+    for (DsoObserver *obs : observers.dso)
+      obs->newFrame(preKeyFrame.get());
+  }
+  clock.stop();
+  preKeyFrame->timings = timings;
+
+  if (DSO_LOG_IS_ON(TRACKING, 2)) {
+    SE3 diff = baseKfToCur * predicted.inverse();
+    DSO_LOG(TRACKING, 2) << "diff to predicted (trans and rot): "
+                         << diff.translation().norm() << " "
+                         << diff.so3().log().norm();
+  }
+
+  if (settings.threading.asyncMapping) {
+    std::unique_lock<std::mutex> lock(mappingMutex);
+    mappingCv.wait(lock, [this]() {
+      return int(mappingQueue.size()) < settings.threading.mappingQueueSize;
+    });
+    mappingQueue.push_back(preKeyFrame);
+    lock.unlock();
+    mappingCv.notify_all();
+  } else
+    mapFrame(preKeyFrame);
+}
+
+std::vector<std::shared_ptr<PreKeyFrame>>
+DsoSystem::addFrames(const std::vector<SourceFrame> &frames) {
+  ScopedAffinity affinity(settings.threading.cores);
+  std::vector<std::shared_ptr<PreKeyFrame>> added;
+  added.reserve(frames.size());
+  int next = 0;
+  while (next < int(frames.size())) {
+    if (canTrackSpeculatively())
+      next += addSpeculativeBatch(frames, next, added);
+    else
+      added.push_back(addFrame(frames[next++]));
+  }
+  return added;
+}
+
+bool DsoSystem::canTrackSpeculatively() const {
+  return isInitialized && !imu && !settings.loadShedding.enabled &&
+         !settings.threading.asyncMapping &&
+         settings.speculativeTracking.batchSize > 1;
+}
+
+int DsoSystem::addSpeculativeBatch(
+    const std::vector<SourceFrame> &frames, int first,
+    std::vector<std::shared_ptr<PreKeyFrame>> &added) {
+  PROFILE_SCOPE("dso.speculativeBatch");
+  const auto &specSettings = settings.speculativeTracking;
+  int count = std::min(specSettings.batchSize, int(frames.size()) - first);
+
+  std::shared_ptr<FrameTracker> tracker;
+  KeyFrame *baseKf;
+  int baseKfNum;
+  SE3 baseToWorld;
+  int lboNum, lastNum;
+  SE3 baseToLbo, baseToLast;
+  {
+    std::lock_guard<std::mutex> lock(trackingMutex);
+    tracker = frameTracker;
+    baseKf = trackingBaseKf;
+    baseKfNum = trackingBaseKf->preKeyFrame->globalFrameNum;
+    baseToWorld = trackingBaseToWorld;
+    lboNum = poseHistory.lastFrameNum(1);
+    lastNum = poseHistory.lastFrameNum(0);
+    baseToLbo = poseHistory[lboNum].worldToFrame * baseToWorld;
+    baseToLast = poseHistory[lastNum].worldToFrame * baseToWorld;
+  }
+
+  // each frame is predicted from the predictions of the previous ones
+  StdVector<SE3> chained(count);
+  for (int k = 0; k < count; ++k) {
+    int num = frames[first + k].globalFrameNum;
+    CHECK_GT(num, lastNum);
+    chained[k] = predictInternal(double(num - lastNum) / (lastNum - lboNum),
+                                 baseToLbo, baseToLast);
+    lboNum = lastNum;
+    lastNum = num;
+    baseToLbo = baseToLast;
+    baseToLast = chained[k];
+  }
+
+  std::vector<std::shared_ptr<PreKeyFrame>> preKeyFrames(count);
+  StdVector<std::pair<SE3, AffineLightTransform<double>>> tracked(count);
+  std::vector<double> rmses(count, INF);
+  std::vector<int> rmseLevels(count, 0);
+  std::vector<double> trackSeconds(count);
+  ParallelExecutor executor(settings.threading, Scheduler::TRACKING);
+  executor.execute([&]() {
+    tbb::parallel_for(0, count, [&](int k) {
+      auto start = std::chrono::steady_clock::now();
+      preKeyFrames[k] = prepareFrame(frames[first + k]);
+      preKeyFrames[k]->baseKeyFrame = baseKf;
+      preKeyFrames[k]->baseKeyFrameNum = baseKfNum;
+      tracked[k] =
+          tracker->trackFrameQuiet(*preKeyFrames[k], chained[k], lightKfToLast,
+                                   0, &rmses[k], &rmseLevels[k]);
+      trackSeconds[k] = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    });
+  });
+
+  for (int k = 0; k < count; ++k) {
+    const SourceFrame &frame = frames[first + k];
+    std::shared_ptr<PreKeyFrame> &preKeyFrame = preKeyFrames[k];
+    DSO_LOG(SYSTEM, 2) << "add frame #" << frame.globalFrameNum
+                       << " (speculative)";
+
+    FrameTimings timings;
+    timings.globalFrameNum = frame.globalFrameNum;
+    timings.seconds[FrameTimings::TRACKING] = trackSeconds[k];
+    StageClock clock(timings, FrameTimings::TRACKING);
+
+    SE3 purePredicted, predicted;
+    double timeLastByLbo;
+    {
+      std::lock_guard<std::mutex> lock(trackingMutex);
+      poseHistory.append(frame.globalFrameNum).timestamp = frame.timestamp;
+      purePredicted = purePredictBaseKfToCur();
+      predicted = predictBaseKfToCur();
+      timeLastByLbo = getTimeLastByLbo();
+      baseToLbo = poseHistory[poseHistory.lastFrameNum(2)].worldToFrame *
+                  baseToWorld;
+      baseToLast = poseHistory[poseHistory.lastFrameNum(1)].worldToFrame *
+                   baseToWorld;
+    }
+
+    const SE3 &speculative = tracked[k].first;
+    double rotationDiff =
+        (speculative.so3() * predicted.so3().inverse()).log().norm();
+    double translationDiff =
+        (speculative.translation() - predicted.translation()).norm();
+    bool isAccepted =
+        !didTrackFail(rmses[k], rmseLevels[k]) &&
+        rotationDiff <= specSettings.maxRotationDiff &&
+        translationDiff <= specSettings.maxTranslationDiff *
+                               predicted.translation().norm();
+
+    double rmse = rmses[k];
+    int rmseLevel = rmseLevels[k];
+    if (isAccepted) {
+      // converges at once, but lets the observers see the result
+      if (!observers.frameTracker.empty()) {
+        tracked[k] = tracker->trackFrame(*preKeyFrame, tracked[k].first,
+                                         tracked[k].second);
+        rmse = tracker->lastRmse;
+        rmseLevel = tracker->lastRmseLevel;
+      }
+    } else {
+      DSO_LOG(TRACKING, 1) << "speculative track of frame #"
+                           << frame.globalFrameNum
+                           << " rejected, tracking again";
+      tracked[k] = trackWithFallbacks(*tracker, preKeyFrame.get(), predicted,
+                                      std::nullopt, timeLastByLbo, baseToLbo,
+                                      baseToLast, baseToWorld);
+      rmse = tracker->lastRmse;
+      rmseLevel = tracker->lastRmseLevel;
+    }
+
+    finishFrame(preKeyFrame, rmse, rmseLevel, tracked[k].first,
+                tracked[k].second, predicted, purePredicted, baseToWorld,
+                timings, clock);
+    added.push_back(std::move(preKeyFrame));
+
+    std::lock_guard<std::mutex> lock(trackingMutex);
+    if (frameTracker != tracker)
+      return k + 1;
+  }
+  return count;
+}
+
+void DsoSystem::tracePoints(const PreKeyFrame &preKeyFrame) {
+  // Keyframes whose points the new frame cannot see are not traced at all.
+  // The ray cone is bounded by depths the points can have, so it is only
+  // conclusive for the points traced before.
+  const SE3 worldToFrame = preKeyFrame.baseToThis *
+                           preKeyFrame.baseKeyFrame->thisToWorld.inverse();
+  StdVector<TracingContext> contexts;
+  contexts.reserve(keyFrames.size());
+  std::vector<std::pair<const TracingContext *, ImmaturePoint *>> toTrace;
+  for (const auto &[num, kf] : keyFrames) {
+    StdVector<Vec3> rays;
+    std::vector<double> minDepths;
+    for (const auto &ip : kf.immaturePoints)
+      if (ip->state != ImmaturePoint::OOB) {
+        rays.push_back(ip->pattern().directions[0]);
+        minDepths.push_back(ip->minDepth);
+      }
+    RayCone cone(rays, minDepths);
+    if (!cone.maybeSeenFrom(worldToFrame * kf.thisToWorld,
+                            cam->getMaxAngle())) {
+      PROFILE_COUNT("dso.culledKeyFrames", 1);
+      continue;
     }
+    contexts.emplace_back(kf, preKeyFrame);
+    // in the order of their slots, see ImmaturePointBlock
+    for (auto &ip : kf.immaturePoints)
+      toTrace.push_back({&contexts.back(), ip.get()});
+  }
+  PROFILE_COUNT("dso.traced", toTrace.size());
+
+  // every point is traced independently and the statistics are plain integer
+  // sums, so the result does not depend on the way the range is split
+  TracingStats tracingStats(settings.pyramid.levelNum);
+  ParallelExecutor(settings.threading, Scheduler::MAPPING).execute([&]() {
+    PROFILE_SCOPE("dso.tracing");
+    tracingStats = tbb::parallel_reduce(
+        tbb::blocked_range<int>(0, toTrace.size()),
+        TracingStats(settings.pyramid.levelNum),
+        [&](const tbb::blocked_range<int> &range, TracingStats stats) {
+          for (int i = range.begin(); i < range.end(); ++i) {
+            ImmaturePoint *ip = toTrace[i].second;
+            auto status =
+                ip->traceOn(*toTrace[i].first, ImmaturePoint::NO_DEBUG);
+            // one bucket per status
+            PROFILE_HIST("tracing.status", status, 0,
+                         ImmaturePoint::CONVERGED + 1,
+                         ImmaturePoint::CONVERGED + 1);
+            stats.add(*ip, status);
+          }
+          return stats;
+        },
+        [](TracingStats stats, const TracingStats &other) {
+          stats.join(other);
+          return stats;
+        });
+  });
+
+  PROFILE_COUNT("tracing.succeeded", tracingStats.totalTraced);
+  PROFILE_COUNT("tracing.ready", tracingStats.totalGood);
+  if (DSO_LOG_IS_ON(TRACING, 1)) {
+    std::stringstream byNumber, byLevel;
+    outputArrayUndivided(byNumber, tracingStats.numTraced.data(),
+                         TracingStats::maxTraced);
+    outputArrayUndivided(byLevel, tracingStats.numOnLevel.data(),
+                         settings.pyramid.levelNum);
+    DSO_LOG(TRACING, 1) << "successfully traced = " << tracingStats.totalTraced
+                        << ", ready to be optimized = "
+                        << tracingStats.totalGood
+                        << ", traced by number: " << byNumber.str()
+                        << ", last traced on pyramid levels: "
+                        << byLevel.str();
+  }
+}
+
+void DsoSystem::mapFrame(const std::shared_ptr<PreKeyFrame> &preKeyFrame) {
+  // with a lagging mapping thread the frame's base could have been
+  // marginalized already
+  if (!keyFrames.contains(preKeyFrame->baseKeyFrame,
+                          preKeyFrame->baseKeyFrameNum)) {
+    LOG(WARNING) << "base keyframe of frame #" << preKeyFrame->globalFrameNum
+                 << " was marginalized, skipping it" << std::endl;
+    notifyFrameProcessed(*preKeyFrame);
+    return;
+  }
 
-  LOG(INFO) << "POINT TRACING:";
-  LOG(INFO) << "Successfully traced = " << totalTraced << "\n";
-  LOG(INFO) << "Ready to be optimized = " << totalGood << "\n";
-  LOG(INFO) << "Traced by number: ";
-  outputArrayUndivided(LOG(INFO), numTraced.data(), maxTraced);
-  LOG(INFO) << "Last traced on pyramid levels: ";
-  outputArrayUndivided(LOG(INFO), numOnLevel.data(), settings.pyramid.levelNum);
+  StageClock clock(preKeyFrame->timings, FrameTimings::TRACING);
+
+  bool needNewKf = doNeedKf(preKeyFrame.get());
+  if (!needNewKf && isMappingBehind(*preKeyFrame)) {
+    DSO_LOG_EVERY_SEC(MAPPING, 1, 1.0)
+        << "mapping is behind, frame #" << preKeyFrame->globalFrameNum
+        << " is not traced";
+    PROFILE_COUNT("shedding.untraced", 1);
+    untracedFrameNum++;
+  } else
+    tracePoints(*preKeyFrame);
 
   // for (DsoObserver *obs : observers.dso)
   // obs->pointsTraced ... ;
 
-  bool needNewKf = doNeedKf(preKeyFrame.get());
   if (!needNewKf)
-    baseKeyFrame().trackedFrames.push_back(preKeyFrame);
+    preKeyFrame->baseKeyFrame->trackedFrames.emplace_back(*preKeyFrame);
 
   if (settings.continueChoosingKeyFrames && needNewKf) {
-    int kfNum = preKeyFrame->globalFrameNum;
-    keyFrames.insert(std::pair<int, KeyFrame>(
-        kfNum, KeyFrame(preKeyFrame, pixelSelector, settings.keyFrame,
-                        settings.getPointTracerSettings())));
+    clock.switchTo(FrameTimings::KEYFRAME_CREATION);
+    preKeyFrame->timings.isKeyFrame = true;
+    {
+      PROFILE_SCOPE("dso.newKeyFrame");
+      keyFrames.pushBack(KeyFrame(preKeyFrame, pixelSelector,
+                                  settings.keyFrame, tracingSettings));
+    }
 
-    marginalizeFrames();
+    marginalizeFrames(&clock);
     activateNewOptimizedPoints();
 
-    for (DsoObserver *obs : observers.dso)
-      obs->newKeyFrame(&baseKeyFrame());
-
-    if (settings.bundleAdjuster.runBA) {
-      BundleAdjuster bundleAdjuster(cam, settings.getBundleAdjusterSettings());
+    {
+      StageClock::Switch toObservers(&clock, FrameTimings::OBSERVERS);
+      for (DsoObserver *obs : observers.dso)
+        obs->newKeyFrame(&baseKeyFrame());
+    }
 
-      for (auto &[num, kf] : keyFrames)
-        bundleAdjuster.addKeyFrame(&kf);
-      bundleAdjuster.adjust(settings.bundleAdjuster.maxIterations);
+    // the next pass adjusts the whole window anyway, so it makes up for the
+    // deferred ones
+    bool deferBa =
+        settings.bundleAdjuster.runBA &&
+        consecutiveDeferredBa < settings.loadShedding.maxDeferredBa &&
+        isMappingBehind(*preKeyFrame);
+    if (deferBa) {
+      DSO_LOG_EVERY_SEC(MAPPING, 1, 1.0)
+          << "mapping is behind, bundle adjustment is deferred";
+      PROFILE_COUNT("shedding.deferredBa", 1);
+      consecutiveDeferredBa++;
+      deferredBaNum++;
+    } else
+      consecutiveDeferredBa = 0;
+
+    if (settings.bundleAdjuster.runBA && !deferBa) {
+      StageClock::Switch toBA(&clock, FrameTimings::BUNDLE_ADJUSTMENT);
+      PROFILE_SCOPE("dso.ba");
+      if (windowedOptimizer) {
+        std::vector<KeyFrame *> window;
+        for (auto &[num, kf] : keyFrames)
+          window.push_back(&kf);
+        windowedOptimizer->adjust(window,
+                                  settings.bundleAdjuster.maxIterations);
+      } else {
+        for (auto &[num, kf] : keyFrames)
+          bundleAdjuster->addKeyFrame(&kf);
+        bundleAdjuster->adjust(settings.bundleAdjuster.maxIterations);
+      }
 
+      std::lock_guard<std::mutex> lock(trackingMutex);
       for (const auto &[num, kf] : keyFrames) {
         SE3 worldToKf = kf.thisToWorld.inverse();
-        worldToFrame[kf.preKeyFrame->globalFrameNum] = worldToKf;
-        for (const auto &pkf : kf.trackedFrames)
-          worldToFrame[pkf->globalFrameNum] = pkf->baseToThis * worldToKf;
+        poseHistory[kf.preKeyFrame->globalFrameNum].worldToFrame = worldToKf;
+        for (const TrackedFrameRecord &tracked : kf.trackedFrames)
+          poseHistory[tracked.globalFrameNum].worldToFrame =
+              tracked.baseToThis * worldToKf;
       }
     }
 
-    StdVector<Vec2> points;
-    std::vector<double> depths;
-    std::vector<OptimizedPoint *> refs;
-    projectOntoBaseKf<OptimizedPoint>(&points, &depths, &refs, nullptr);
-    std::vector<double> weights(points.size());
-    for (int i = 0; i < points.size(); ++i)
-      weights[i] = 1.0 / refs[i]->stddev;
+    // bundle adjustment has moved the keyframes, so the projections made
+    // for the activation are outdated
+    KeyFrame *baseKf = &baseKeyFrame();
+    std::vector<std::pair<KeyFrame *, int>> positions;
+    ProjectedPoints projected = projectPoints<OptimizedPoint>(
+        cam, keyFrames, baseKf,
+        [baseKf](const KeyFrame &kf, const OptimizedPoint &op) {
+          return &kf != baseKf || op.state == OptimizedPoint::ACTIVE;
+        },
+        &positions);
+    std::vector<double> weights(projected.size());
+    for (int i = 0; i < projected.size(); ++i) {
+      const auto &[kf, ind] = positions[i];
+      weights[i] = 1.0 / kf->optimizedPoints[ind]->stddev;
+    }
     std::unique_ptr<DepthedImagePyramid> baseForTrack(new DepthedImagePyramid(
-        baseKeyFrame().preKeyFrame->frame(), settings.pyramid.levelNum, points,
-        depths, weights));
+        baseKf->preKeyFrame->framePyr, settings.pyramid.levelNum, projected.x,
+        projected.y, projected.depth, weights));
 
     // for (int i = 0; i < points.size(); ++i) {
     // for (int pl = 0; pl < settings.pyramid.levelNum; ++pl) {
@@ -561,17 +1409,140 @@ std::shared_ptr<PreKeyFrame> DsoSystem::addFrame(const cv::Mat &frame,
     // }
     // }
 
-    frameTracker = std::unique_ptr<FrameTracker>(new FrameTracker(
-        camPyr, std::move(baseForTrack), observers.frameTracker,
-        settings.getFrameTrackerSettings()));
+    publishTrackingBase(std::move(baseForTrack));
+
+    if (checkpointSaver) {
+      PROFILE_SCOPE("dso.checkpoint");
+      std::vector<const KeyFrame *> window;
+      window.reserve(keyFrames.size());
+      for (const auto &[num, kf] : keyFrames)
+        window.push_back(&kf);
+      checkpointSaver->save(window.data(), window.size());
+    }
   }
 
-  return preKeyFrame;
+  clock.stop();
+  notifyFrameProcessed(*preKeyFrame);
 }
 
-void DsoSystem::saveSnapshot(const std::string &snapshotDir) const {
+void DsoSystem::notifyFrameProcessed(const PreKeyFrame &preKeyFrame) {
+  for (DsoObserver *obs : observers.dso)
+    obs->frameProcessed(preKeyFrame.timings);
+  notifyLoopsClosed();
+
+  std::vector<const KeyFrame *> window;
+  int baseIndex = -1;
+  for (DsoObserver *obs : observers.dso) {
+    if (!obs->needsWindow())
+      continue;
+    if (window.empty()) {
+      const KeyFrame *baseKf = &baseKeyFrame();
+      for (const auto &[num, kf] : keyFrames) {
+        if (&kf == baseKf)
+          baseIndex = window.size();
+        window.push_back(&kf);
+      }
+    }
+    obs->windowMapped(window, baseIndex);
+  }
+
+  if (pointBudgetController &&
+      pointBudgetController->update(preKeyFrame.timings)) {
+    const PointBudget &budget = pointBudgetController->budget();
+    settings.keyFrame.pointsNum = budget.pointsNum;
+    settings.maxOptimizedPoints = budget.optimizedPointsNum;
+    settings.bundleAdjuster.maxIterations = budget.baIterations;
+    for (DsoObserver *obs : observers.dso)
+      obs->pointBudgetChanged(budget);
+  }
+
+  if (!observers.profiling.empty()) {
+    FrameProfile profile = Profiler::collect();
+    profile.globalFrameNum = preKeyFrame.globalFrameNum;
+    profile.isKeyFrame = preKeyFrame.timings.isKeyFrame;
+    for (ProfilingObserver *obs : observers.profiling)
+      obs->frameProfiled(profile);
+  }
+}
+
+void DsoSystem::notifyLoopsClosed() {
+  std::vector<StdMap<int, Sim3>> loops;
+  {
+    std::lock_guard<std::mutex> lock(closedLoopsMutex);
+    loops.swap(closedLoops);
+  }
+  for (const StdMap<int, Sim3> &worldToKeyFrame : loops)
+    for (DsoObserver *obs : observers.dso)
+      obs->loopClosed(worldToKeyFrame);
+}
+
+void DsoSystem::publishTrackingBase(
+    std::unique_ptr<DepthedImagePyramid> baseForTrack) {
+  std::vector<FrameTrackerObserver *> trackerObservers;
+  {
+    std::lock_guard<std::mutex> lock(trackingMutex);
+    trackerObservers = observers.frameTracker;
+  }
+  std::shared_ptr<FrameTracker> newFrameTracker(
+      new FrameTracker(camPyr, std::move(baseForTrack), trackerObservers,
+                       trackerSettings));
+
+  std::lock_guard<std::mutex> lock(trackingMutex);
+  frameTracker = std::move(newFrameTracker);
+  trackingBaseKf = &baseKeyFrame();
+  trackingBaseToWorld = baseKeyFrame().thisToWorld;
+}
+
+void DsoSystem::startMapping() {
+  if (settings.threading.asyncMapping)
+    mappingThread = std::thread(&DsoSystem::mappingLoop, this);
+}
+
+void DsoSystem::mappingLoop() {
+  pinThread(settings.threading.cores);
+  while (true) {
+    std::shared_ptr<PreKeyFrame> preKeyFrame;
+    {
+      std::unique_lock<std::mutex> lock(mappingMutex);
+      mappingCv.wait(
+          lock, [this]() { return doStopMapping || !mappingQueue.empty(); });
+      // the queue is drained before stopping
+      if (mappingQueue.empty())
+        return;
+      preKeyFrame = std::move(mappingQueue.front());
+      mappingQueue.pop_front();
+      isMappingBusy = true;
+    }
+    mappingCv.notify_all();
+
+    mapFrame(preKeyFrame);
+
+    {
+      std::lock_guard<std::mutex> lock(mappingMutex);
+      isMappingBusy = false;
+    }
+    mappingCv.notify_all();
+  }
+}
+
+int DsoSystem::mappingLag() const {
+  std::lock_guard<std::mutex> lock(mappingMutex);
+  return mappingQueue.size() + (isMappingBusy ? 1 : 0);
+}
+
+void DsoSystem::waitForMapping() const {
+  std::unique_lock<std::mutex> lock(mappingMutex);
+  mappingCv.wait(lock,
+                 [this]() { return mappingQueue.empty() && !isMappingBusy; });
+}
+
+void DsoSystem::saveSnapshot(const std::string &snapshotDir,
+                             SerializerFormat format,
+                             FrameEmbedding frameEmbedding) const {
+  waitForMapping();
   SnapshotSaver snapshotSaver(snapshotDir,
-                              settings.residualPattern.pattern().size());
+                              settings.residualPattern.pattern().size(),
+                              format, frameEmbedding);
   std::vector<const KeyFrame *> keyFramePtrs;
   keyFramePtrs.reserve(keyFrames.size());
   for (const auto &[frameNum, keyFrame] : keyFrames)
@@ -579,4 +1550,12 @@ void DsoSystem::saveSnapshot(const std::string &snapshotDir) const {
   snapshotSaver.save(keyFramePtrs.data(), keyFramePtrs.size());
 }
 
+void DsoSystem::enableCheckpoints(const std::string &snapshotDir,
+                                  SerializerFormat format, int syncEvery,
+                                  FrameEmbedding frameEmbedding) {
+  checkpointSaver.reset(new DeltaSnapshotSaver(
+      snapshotDir, settings.residualPattern.pattern().size(), format,
+      syncEvery, frameEmbedding));
+}
+
 } // namespace fishdso
@@ -0,0 +1,39 @@
+#include "system/FrameBufferPool.h"
+#include "PreKeyFrameInternals.h"
+
+namespace fishdso {
+
+FrameBuffers::FrameBuffers() = default;
+
+FrameBuffers::FrameBuffers(FrameBuffers &&other) = default;
+
+FrameBuffers &FrameBuffers::operator=(FrameBuffers &&other) = default;
+
+FrameBuffers::~FrameBuffers() = default;
+
+FrameBufferPool::FrameBufferPool(int maxFree)
+    : maxFree(maxFree) {
+  freeBuffers.reserve(maxFree);
+}
+
+FrameBuffers FrameBufferPool::acquire() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (freeBuffers.empty())
+    return FrameBuffers();
+  FrameBuffers buffers = std::move(freeBuffers.back());
+  freeBuffers.pop_back();
+  return buffers;
+}
+
+void FrameBufferPool::release(FrameBuffers &&buffers) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (freeBuffers.size() < maxFree)
+    freeBuffers.push_back(std::move(buffers));
+}
+
+int FrameBufferPool::freeCount() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return freeBuffers.size();
+}
+
+} // namespace fishdso
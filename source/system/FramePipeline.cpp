@@ -0,0 +1,113 @@
+#include "system/FramePipeline.h"
+#include <glog/logging.h>
+
+namespace fishdso {
+
+FramePipeline::FramePipeline(DsoSystem *dso, int depth, int prepareThreads)
+    : dso(dso)
+    , depth(depth) {
+  CHECK_GT(depth, 0);
+  CHECK_GT(prepareThreads, 0);
+  for (int i = 0; i < prepareThreads; ++i)
+    this->prepareThreads.emplace_back(&FramePipeline::prepareLoop, this);
+  addThread = std::thread(&FramePipeline::addLoop, this);
+}
+
+FramePipeline::~FramePipeline() {
+  finish();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    doStop = true;
+  }
+  cv.notify_all();
+  for (std::thread &thread : prepareThreads)
+    thread.join();
+  addThread.join();
+}
+
+void FramePipeline::submitFrame(SourceFrame frame) {
+  submitFrame([frame = std::move(frame)]() { return frame; });
+}
+
+void FramePipeline::submitFrame(std::function<SourceFrame()> decode) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this]() { return submittedNum - addedNum < depth; });
+    toPrepare.emplace_back(submittedNum++, std::move(decode));
+  }
+  cv.notify_all();
+}
+
+std::optional<FramePipeline::Result> FramePipeline::poll() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (results.empty())
+    return std::nullopt;
+  Result result = std::move(results.front());
+  results.pop_front();
+  return result;
+}
+
+void FramePipeline::finish() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [this]() { return addedNum == submittedNum; });
+}
+
+int FramePipeline::inFlight() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return submittedNum - addedNum;
+}
+
+void FramePipeline::prepareLoop() {
+  while (true) {
+    std::pair<int, std::function<SourceFrame()>> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this]() { return doStop || !toPrepare.empty(); });
+      if (toPrepare.empty())
+        return;
+      job = std::move(toPrepare.front());
+      toPrepare.pop_front();
+    }
+
+    Prepared frame;
+    frame.frame = job.second();
+    frame.preKeyFrame = dso->prepareFrame(frame.frame);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      prepared.emplace(job.first, std::move(frame));
+    }
+    cv.notify_all();
+  }
+}
+
+void FramePipeline::addLoop() {
+  while (true) {
+    Prepared frame;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this]() {
+        return doStop || (!prepared.empty() &&
+                          prepared.begin()->first == addedNum);
+      });
+      if (prepared.empty() || prepared.begin()->first != addedNum)
+        return;
+      frame = std::move(prepared.begin()->second);
+      prepared.erase(prepared.begin());
+    }
+
+    Result result;
+    result.globalFrameNum = frame.frame.globalFrameNum;
+    result.preKeyFrame =
+        dso->addFrame(frame.frame, std::move(frame.preKeyFrame));
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      results.push_back(std::move(result));
+      ++addedNum;
+    }
+    cv.notify_all();
+  }
+}
+
+} // namespace fishdso
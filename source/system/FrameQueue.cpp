@@ -0,0 +1,61 @@
+#include "system/FrameQueue.h"
+#include <glog/logging.h>
+
+namespace fishdso {
+
+FrameQueue::FrameQueue(int capacity)
+    : capacity(capacity) {
+  CHECK_GT(capacity, 0);
+}
+
+void FrameQueue::push(SourceFrame frame) {
+  frame.arrivalTime = std::chrono::steady_clock::now();
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    CHECK(!isClosed);
+    cv.wait(lock, [this]() { return int(frames.size()) < capacity; });
+    frames.push_back(std::move(frame));
+  }
+  cv.notify_all();
+}
+
+bool FrameQueue::tryPush(SourceFrame frame) {
+  frame.arrivalTime = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    CHECK(!isClosed);
+    if (int(frames.size()) >= capacity)
+      return false;
+    frames.push_back(std::move(frame));
+  }
+  cv.notify_all();
+  return true;
+}
+
+void FrameQueue::close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    isClosed = true;
+  }
+  cv.notify_all();
+}
+
+bool FrameQueue::next(SourceFrame &frame) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this]() { return isClosed || !frames.empty(); });
+    if (frames.empty())
+      return false;
+    frame = std::move(frames.front());
+    frames.pop_front();
+  }
+  cv.notify_all();
+  return true;
+}
+
+int FrameQueue::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return frames.size();
+}
+
+} // namespace fishdso
@@ -0,0 +1,88 @@
+#include "system/FrameReplayer.h"
+#include <functional>
+#include <glog/logging.h>
+#include <map>
+#include <thread>
+
+namespace fishdso {
+
+typedef std::chrono::steady_clock Clock;
+
+FrameReplayer::FrameReplayer(std::vector<SourceFrame> frames, double fps,
+                             double speed, int queueCapacity)
+    : frames(std::move(frames))
+    , fps(fps)
+    , speed(speed)
+    , queueCapacity(queueCapacity) {
+  CHECK_GE(fps, 0);
+  CHECK_GT(speed, 0);
+  if (fps == 0)
+    for (int i = 1; i < this->frames.size(); ++i)
+      CHECK_GE(this->frames[i].timestamp, this->frames[i - 1].timestamp)
+          << "the frames should be in the order of their timestamps";
+}
+
+FrameReplayer::Stats FrameReplayer::run(DsoSystem &dso) {
+  Stats stats;
+  if (frames.empty())
+    return stats;
+
+  Clock::time_point start = Clock::now();
+  std::vector<Clock::time_point> releaseTimes(frames.size());
+  for (int i = 0; i < frames.size(); ++i) {
+    double offset = fps > 0 ? i / fps
+                            : (frames[i].timestamp - frames[0].timestamp) /
+                                  speed;
+    releaseTimes[i] = start + std::chrono::duration_cast<Clock::duration>(
+                                  std::chrono::duration<double>(offset));
+  }
+  // a frame is due when the next one comes, the last one a frame period
+  // after its release
+  std::map<int, Clock::time_point> deadlines;
+  for (int i = 0; i < frames.size(); ++i) {
+    Clock::time_point deadline = Clock::time_point::max();
+    if (i + 1 < frames.size())
+      deadline = releaseTimes[i + 1];
+    else if (i > 0)
+      deadline = releaseTimes[i] + (releaseTimes[i] - releaseTimes[i - 1]);
+    deadlines[frames[i].globalFrameNum] = deadline;
+  }
+
+  DsoSystem::SheddingStats sheddingBefore = dso.sheddingStats();
+  FrameQueue queue(queueCapacity);
+  std::thread releaseThread(&FrameReplayer::releaseLoop, this,
+                            std::ref(queue), std::cref(releaseTimes),
+                            std::ref(stats));
+
+  SourceFrame frame;
+  while (queue.next(frame)) {
+    bool tracked = bool(dso.addFrame(frame));
+    Clock::time_point poseTime = Clock::now();
+    if (!tracked)
+      continue;
+    stats.latencies.push_back(
+        std::chrono::duration<double>(poseTime - frame.arrivalTime).count());
+    if (poseTime > deadlines[frame.globalFrameNum])
+      stats.deadlineMisses++;
+  }
+  releaseThread.join();
+  dso.waitForMapping();
+  stats.skipped =
+      dso.sheddingStats().skippedFrames - sheddingBefore.skippedFrames;
+  return stats;
+}
+
+void FrameReplayer::releaseLoop(
+    FrameQueue &queue, const std::vector<Clock::time_point> &releaseTimes,
+    Stats &stats) const {
+  for (int i = 0; i < frames.size(); ++i) {
+    std::this_thread::sleep_until(releaseTimes[i]);
+    stats.queueDepths.push_back(queue.size());
+    stats.released++;
+    if (!queue.tryPush(frames[i]))
+      stats.dropped++;
+  }
+  queue.close();
+}
+
+} // namespace fishdso
@@ -0,0 +1,63 @@
+#include "system/FrameTimings.h"
+#include "util/Profiler.h"
+#include <numeric>
+
+namespace fishdso {
+
+const char *FrameTimings::stageName(Stage stage) {
+  static const char *names[STAGE_NUM] = {"tracking", "tracing", "keyframe",
+                                         "ba", "observers"};
+  return names[stage];
+}
+
+// the names of the stages on the timeline of Profiler
+static const char *traceName(FrameTimings::Stage stage) {
+  static const char *names[FrameTimings::STAGE_NUM] = {
+      "frame.tracking", "frame.tracing", "frame.keyframe", "frame.ba",
+      "frame.observers"};
+  return names[stage];
+}
+
+double FrameTimings::total() const {
+  return std::accumulate(seconds.begin(), seconds.end(), 0.0);
+}
+
+StageClock::Switch::Switch(StageClock *clock, FrameTimings::Stage stage)
+    : clock(clock) {
+  if (clock)
+    previous = clock->switchTo(stage);
+}
+
+StageClock::Switch::~Switch() {
+  if (clock)
+    clock->switchTo(previous);
+}
+
+StageClock::StageClock(FrameTimings &timings, FrameTimings::Stage stage)
+    : timings(timings)
+    , running(stage)
+    , since(Clock::now())
+    , isStopped(false) {}
+
+StageClock::~StageClock() { stop(); }
+
+FrameTimings::Stage StageClock::switchTo(FrameTimings::Stage stage) {
+  if (isStopped)
+    return running;
+  Clock::time_point now = Clock::now();
+  timings.seconds[running] +=
+      std::chrono::duration<double>(now - since).count();
+  if (Profiler::isTracing() && now > since)
+    Profiler::addTraceEvent(traceName(running), since, now);
+  since = now;
+  FrameTimings::Stage previous = running;
+  running = stage;
+  return previous;
+}
+
+void StageClock::stop() {
+  switchTo(running);
+  isStopped = true;
+}
+
+} // namespace fishdso
@@ -1,31 +1,60 @@
 #include "system/FrameTracker.h"
 #include "PreKeyFrameInternals.h"
+#ifdef FISHDSO_CUDA
+#include "CudaTracking.h"
+#endif
 #include "output/FrameTrackerObserver.h"
+#include "util/Log.h"
+#include "util/Profiler.h"
+#include "util/Scheduler.h"
 #include "util/defs.h"
 #include "util/util.h"
+#include <algorithm>
 #include <ceres/cubic_interpolation.h>
 #include <ceres/problem.h>
 #include <chrono>
 #include <cmath>
+#include <numeric>
+#include <tbb/parallel_for.h>
 
 namespace fishdso {
 
+// With the affine light parameters optimized it takes the rotation, the
+// translation and the light blocks, otherwise only the first two and the
+// light is fixed to the one given.
 struct PointTrackingResidual {
   PointTrackingResidual(
       Vec3 pos, double baseIntensity, const CameraModel *cam,
       const ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>>
-          *trackedFrame)
+          *trackedFrame,
+      const AffLight &fixedAffLight = AffLight())
       : pos(pos)
       , baseIntensity(baseIntensity)
       , cam(cam)
-      , trackedFrame(trackedFrame) {}
+      , trackedFrame(trackedFrame)
+      , fixedAffLight(fixedAffLight) {}
 
   template <typename T>
   bool operator()(const T *const rotP, const T *const transP,
                   const T *const affLightP, T *res) const {
+    res[0] = residual(rotP, transP,
+                      AffineLightTransform<T>(affLightP[0], affLightP[1]));
+    return true;
+  }
+
+  template <typename T>
+  bool operator()(const T *const rotP, const T *const transP, T *res) const {
+    res[0] = residual(rotP, transP,
+                      AffineLightTransform<T>(T(fixedAffLight.data[0]),
+                                              T(fixedAffLight.data[1])));
+    return true;
+  }
+
+  template <typename T>
+  T residual(const T *const rotP, const T *const transP,
+             const AffineLightTransform<T> &affLight) const {
     typedef Eigen::Matrix<T, 2, 1> Vec2t;
     typedef Eigen::Matrix<T, 3, 1> Vec3t;
-    typedef Eigen::Matrix<T, 3, 3> Mat33t;
     typedef Eigen::Quaternion<T> Quatt;
     typedef Sophus::SE3<T> SE3t;
 
@@ -34,16 +63,13 @@ struct PointTrackingResidual {
     Eigen::Map<const Quatt> rotM(rotP);
     Quatt rot(rotM);
     SE3t motion(rot, trans);
-    AffineLightTransform<T> affLight(affLightP[0], affLightP[1]);
 
     Vec3t newPos = motion * pos.cast<T>();
     Vec2t newPosProj = cam->map(newPos.data());
 
     T trackedIntensity;
     trackedFrame->Evaluate(newPosProj[1], newPosProj[0], &trackedIntensity);
-    res[0] = affLight(trackedIntensity) - baseIntensity;
-
-    return true;
+    return affLight(trackedIntensity) - baseIntensity;
   }
 
   Vec3 pos;
@@ -51,22 +77,194 @@ struct PointTrackingResidual {
   const CameraModel *cam;
   const ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>>
       *trackedFrame;
+  AffLight fixedAffLight;
+};
+
+// The rotation vector of rot * prior^-1, approximated by twice the vector
+// part of the quaternion, which is close enough for the small differences
+// the prior is meant for.
+struct RotationPriorResidual {
+  RotationPriorResidual(const SO3 &prior, double weight)
+      : priorInv(prior.inverse().unit_quaternion())
+      , sqrtWeight(std::sqrt(weight)) {}
+
+  template <typename T> bool operator()(const T *const rotP, T *res) const {
+    typedef Eigen::Quaternion<T> Quatt;
+
+    Eigen::Map<const Quatt> rot(rotP);
+    Quatt diff = rot * priorInv.cast<T>();
+    // q and -q are the same rotation
+    T scale = T(2 * sqrtWeight) * (diff.w() < T(0) ? T(-1) : T(1));
+    res[0] = scale * diff.x();
+    res[1] = scale * diff.y();
+    res[2] = scale * diff.z();
+
+    return true;
+  }
+
+  Quaternion priorInv;
+  double sqrtWeight;
 };
 
 FrameTracker::FrameTracker(const StdVector<CameraModel> &camPyr,
                            std::unique_ptr<DepthedImagePyramid> _baseFrame,
                            const std::vector<FrameTrackerObserver *> &observers,
                            const FrameTrackerSettings &_settings)
-    : residualsImg(_settings.pyramid.levelNum)
+    : FrameTracker(camPyr, std::move(_baseFrame), observers,
+                   std::make_shared<const FrameTrackerSettings>(_settings)) {}
+
+FrameTracker::FrameTracker(
+    const StdVector<CameraModel> &camPyr,
+    std::unique_ptr<DepthedImagePyramid> _baseFrame,
+    const std::vector<FrameTrackerObserver *> &observers,
+    std::shared_ptr<const FrameTrackerSettings> _settings)
+    : residualsImg(_settings->pyramid.levelNum)
     , lastRmse(INF)
-    , camPyr(camPyr)
-    , baseFrame(std::move(_baseFrame))
+    , lastRmseLevel(0)
     , displayWidth(camPyr[1].getWidth())
     , displayHeight(camPyr[1].getHeight())
     , observers(observers)
-    , settings(_settings) {
+    , settings(std::move(_settings))
+    , linearizeKernel(chooseLinearizeKernel(*settings)) {
+  cameras.push_back({&camPyr, SE3(), std::move(_baseFrame), {}});
+  fillBasePoints(cameras[0]);
+
   for (FrameTrackerObserver *obs : observers)
-    obs->newBaseFrame(*baseFrame);
+    obs->newBaseFrame(*cameras[0].baseFrame);
+}
+
+FrameTracker::FrameTracker(
+    const StdVector<RigCamera> &rig,
+    std::vector<std::unique_ptr<DepthedImagePyramid>> _baseFrames,
+    const std::vector<FrameTrackerObserver *> &observers,
+    const FrameTrackerSettings &_settings)
+    : residualsImg(_settings.pyramid.levelNum)
+    , lastRmse(INF)
+    , lastRmseLevel(0)
+    , displayWidth((*rig.at(0).camPyr)[1].getWidth())
+    , displayHeight((*rig.at(0).camPyr)[1].getHeight())
+    , observers(observers)
+    , settings(std::make_shared<const FrameTrackerSettings>(_settings))
+    , linearizeKernel(chooseLinearizeKernel(*settings)) {
+  CHECK_EQ(rig.size(), _baseFrames.size());
+  cameras.reserve(rig.size());
+  for (int ci = 0; ci < rig.size(); ++ci) {
+    cameras.push_back(
+        {rig[ci].camPyr, rig[ci].bodyToCam, std::move(_baseFrames[ci]), {}});
+    fillBasePoints(cameras.back());
+  }
+
+  for (FrameTrackerObserver *obs : observers)
+    obs->newBaseFrame(*cameras[0].baseFrame);
+}
+
+void FrameTracker::fillBasePoints(TrackedCamera &camera) {
+  const double c = settings->gradWeighting.c;
+  camera.basePoints.resize(settings->pyramid.levelNum);
+  for (int pl = 0; pl < settings->pyramid.levelNum; ++pl) {
+    const DepthedImagePyramid::DepthedPoints &depthed =
+        camera.baseFrame->points[pl];
+    const cv::Mat1b &baseImg = camera.baseFrame->images[pl];
+    const CameraModel &cam = (*camera.camPyr)[pl];
+    BasePoints &level = camera.basePoints[pl];
+    const int maxPoints = settings->frameTracker.maxPointsAt(pl);
+    StdVector<Vec6> steepestDescent;
+    for (int i = 0; i < depthed.size(); ++i) {
+      Vec2 p(depthed.x[i], depthed.y[i]);
+      cv::Point cvp = toCvPoint(p);
+      // points on the vehicle move with the camera and tell nothing of motion
+      if (cam.hasStaticMask() && !cam.getStaticMask()(cvp))
+        continue;
+      Vec3 ray = cam.unmap(p).normalized();
+      level.x.push_back(depthed.x[i]);
+      level.y.push_back(depthed.y[i]);
+      level.depth.push_back(depthed.depth[i]);
+      level.rayX.push_back(ray[0]);
+      level.rayY.push_back(ray[1]);
+      level.rayZ.push_back(ray[2]);
+      level.intensity.push_back(baseImg(cvp));
+      level.weight.push_back(
+          settings->frameTracker.useGradWeighting
+              ? c / std::hypot(c, gradNormAt(baseImg, cvp))
+              : 1.0);
+      if (settings->frameTracker.useInverseCompositional || maxPoints > 0) {
+        // central differences with replicated borders, as in gradAndPyrDown
+        int left = std::max(cvp.x - 1, 0),
+            right = std::min(cvp.x + 1, baseImg.cols - 1);
+        int up = std::max(cvp.y - 1, 0),
+            down = std::min(cvp.y + 1, baseImg.rows - 1);
+        Eigen::Matrix<double, 1, 2> grad(
+            (baseImg(cvp.y, right) - baseImg(cvp.y, left)) / 2.0,
+            (baseImg(down, cvp.x) - baseImg(up, cvp.x)) / 2.0);
+        Vec3 pos = level.position(level.size() - 1);
+        Eigen::Matrix<double, 3, 6> dPosdXi;
+        dPosdXi << Mat33::Identity(), -SO3::hat(pos);
+        steepestDescent.push_back(
+            (grad * cam.diffMap(pos).second * dPosdXi).transpose());
+      }
+    }
+
+    if (maxPoints > 0 && level.size() > maxPoints)
+      subsampleBasePoints(level, steepestDescent, cam, maxPoints);
+    else if (settings->frameTracker.useInverseCompositional)
+      level.steepestDescent = std::move(steepestDescent);
+  }
+}
+
+void FrameTracker::subsampleBasePoints(BasePoints &level,
+                                       const StdVector<Vec6> &steepestDescent,
+                                       const CameraModel &cam,
+                                       int maxPoints) const {
+  // about four points per cell are kept
+  const double cellSize =
+      std::sqrt(4.0 * cam.getWidth() * cam.getHeight() / maxPoints);
+  const int cellsX = std::ceil(cam.getWidth() / cellSize);
+
+  std::vector<double> information(level.size());
+  std::vector<int> cells(level.size());
+  for (int i = 0; i < level.size(); ++i) {
+    information[i] = double(level.weight[i]) * level.weight[i] *
+                     steepestDescent[i].squaredNorm();
+    cells[i] =
+        int(level.y[i] / cellSize) * cellsX + int(level.x[i] / cellSize);
+  }
+
+  // Ranks of the points in their cells by the information. Taking the
+  // points by rank first keeps every cell that has points, and then the
+  // most informative ones of the cells with the most.
+  std::vector<int> order(level.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    return cells[a] != cells[b] ? cells[a] < cells[b]
+                                : information[a] > information[b];
+  });
+  std::vector<int> rank(level.size());
+  for (int j = 0; j < order.size(); ++j) {
+    bool isSameCell = j > 0 && cells[order[j]] == cells[order[j - 1]];
+    rank[order[j]] = isSameCell ? rank[order[j - 1]] + 1 : 0;
+  }
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    return rank[a] != rank[b] ? rank[a] < rank[b]
+                              : information[a] > information[b];
+  });
+  order.resize(maxPoints);
+  // keeps the points in the order of the depthed pyramid
+  std::sort(order.begin(), order.end());
+
+  BasePoints selected;
+  for (int i : order) {
+    selected.x.push_back(level.x[i]);
+    selected.y.push_back(level.y[i]);
+    selected.rayX.push_back(level.rayX[i]);
+    selected.rayY.push_back(level.rayY[i]);
+    selected.rayZ.push_back(level.rayZ[i]);
+    selected.depth.push_back(level.depth[i]);
+    selected.intensity.push_back(level.intensity[i]);
+    selected.weight.push_back(level.weight[i]);
+    if (settings->frameTracker.useInverseCompositional)
+      selected.steepestDescent.push_back(steepestDescent[i]);
+  }
+  level = std::move(selected);
 }
 
 void FrameTracker::addObserver(FrameTrackerObserver *observer) {
@@ -76,18 +274,59 @@ void FrameTracker::addObserver(FrameTrackerObserver *observer) {
 std::pair<SE3, AffineLightTransform<double>>
 FrameTracker::trackFrame(const PreKeyFrame &frame,
                          const SE3 &coarseBaseToTracked,
-                         const AffineLightTransform<double> &coarseAffLight) {
+                         const AffineLightTransform<double> &coarseAffLight,
+                         const std::optional<SO3> &rotationPrior) {
+  PROFILE_SCOPE("tracking.frame");
   for (FrameTrackerObserver *obs : observers)
     obs->startTracking(frame.framePyr);
 
+  return trackLevels(frame, coarseBaseToTracked, coarseAffLight, 0, true,
+                     &lastRmse, &lastRmseLevel,
+                     rotationPrior ? &*rotationPrior : nullptr);
+}
+
+std::pair<SE3, AffineLightTransform<double>> FrameTracker::trackFrameQuiet(
+    const PreKeyFrame &frame, const SE3 &coarseBaseToTracked,
+    const AffineLightTransform<double> &coarseAffLight, int minPyrLevel,
+    double *rmse, int *rmseLevel) const {
+  PROFILE_SCOPE("tracking.frameQuiet");
+  return trackLevels(frame, coarseBaseToTracked, coarseAffLight, minPyrLevel,
+                     false, rmse, rmseLevel);
+}
+
+std::pair<SE3, AffineLightTransform<double>> FrameTracker::trackLevels(
+    const PreKeyFrame &frame, const SE3 &coarseBaseToTracked,
+    const AffineLightTransform<double> &coarseAffLight, int minPyrLevel,
+    bool notifyObservers, double *rmse, int *rmseLevel,
+    const SO3 *rotationPrior) const {
+  const TrackedCamera &camera = cameras[0];
   SE3 baseToTracked = coarseBaseToTracked;
   AffineLightTransform<double> affLight = coarseAffLight;
 
-  for (int i = settings.pyramid.levelNum - 1; i >= 0; --i) {
-    LOG(INFO) << "track level #" << i << std::endl;
-    std::tie(baseToTracked, affLight) = trackPyrLevel(
-        camPyr[i], baseFrame->images[i], baseFrame->depths[i],
-        frame.framePyr.images[i], *frame.internals, baseToTracked, affLight, i);
+  double lastLevelDelta = INF;
+  for (int i = settings->pyramid.levelNum - 1; i >= minPyrLevel; --i) {
+    if (i == 0 && settings->frameTracker.skipFinestLevel &&
+        lastLevelDelta < settings->frameTracker.skipFinestLevelDelta) {
+      PROFILE_COUNT("tracking.skippedFinestLevels", 1);
+      DSO_LOG(TRACKING, 2) << "skip level #0, update on level #1 = "
+                           << lastLevelDelta;
+      break;
+    }
+
+    DSO_LOG(TRACKING, 3) << "track level #" << i;
+    SE3 levelStart = baseToTracked;
+    if (settings->frameTracker.useAnalyticJacobian ||
+        settings->frameTracker.useInverseCompositional)
+      std::tie(baseToTracked, affLight) = trackPyrLevelAnalytic(
+          (*camera.camPyr)[i], camera.basePoints[i], *frame.internals,
+          baseToTracked, affLight, i, notifyObservers, rmse, rotationPrior);
+    else
+      std::tie(baseToTracked, affLight) = trackPyrLevel(
+          (*camera.camPyr)[i], camera.basePoints[i], *frame.internals,
+          baseToTracked, affLight, i, notifyObservers, rmse, rotationPrior);
+    lastLevelDelta = (baseToTracked * levelStart.inverse()).log().norm();
+    if (rmseLevel)
+      *rmseLevel = i;
   }
 
   // cv::waitKey();
@@ -103,114 +342,880 @@ bool isPointTrackable(const CameraModel &cam, const Vec3 &basePos,
 }
 
 std::pair<SE3, AffineLightTransform<double>> FrameTracker::trackPyrLevel(
-    const CameraModel &cam, const cv::Mat1b &baseImg,
-    const cv::Mat1d &baseDepths, const cv::Mat1b &trackedImg,
+    const CameraModel &cam, const BasePoints &basePoints,
     const PreKeyFrameInternals &internals, const SE3 &coarseBaseToTracked,
-    const AffineLightTransform<double> &coarseAffLight, int pyrLevel) {
+    const AffineLightTransform<double> &coarseAffLight, int pyrLevel,
+    bool notifyObservers, double *rmse, const SO3 *rotationPrior) const {
+  PROFILE_SCOPE("tracking.level");
+  auto startTime = std::chrono::high_resolution_clock::now();
+
   SE3 baseToTracked = coarseBaseToTracked;
   AffineLightTransform<double> affLight = coarseAffLight;
 
-  cv::Size displSz = cv::Size(displayHeight, displayWidth);
-  cv::Mat1b resMask(baseImg.size(), CV_WHITE_BYTE);
-
   const ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>>
       &trackedFrame = internals.interpolator(pyrLevel);
 
-  ceres::Problem problem;
+  // The losses are shared by the residuals, or scaled per point with
+  // gradient weighting, and are owned here rather than by the problem.
+  ceres::HuberLoss huberLoss(settings->intencity.outlierDiff);
+  std::vector<std::unique_ptr<ceres::ScaledLoss>> scaledLosses;
+  ceres::Problem::Options problemOptions;
+  problemOptions.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+  ceres::Problem problem(problemOptions);
 
   problem.AddParameterBlock(baseToTracked.so3().data(), 4,
                             new ceres::EigenQuaternionParameterization());
   problem.AddParameterBlock(baseToTracked.translation().data(), 3);
 
-  problem.AddParameterBlock(affLight.data, 2);
-  problem.SetParameterLowerBound(affLight.data, 0,
-                                 settings.affineLight.minAffineLightA);
-  problem.SetParameterUpperBound(affLight.data, 0,
-                                 settings.affineLight.maxAffineLightA);
-  problem.SetParameterLowerBound(affLight.data, 1,
-                                 settings.affineLight.minAffineLightB);
-  problem.SetParameterUpperBound(affLight.data, 1,
-                                 settings.affineLight.maxAffineLightB);
+  // with the light fixed its block is left out of the problem altogether
+  const bool optimizeAffLight = settings->affineLight.optimizeAffineLight;
+  if (optimizeAffLight) {
+    problem.AddParameterBlock(affLight.data, 2);
+    problem.SetParameterLowerBound(affLight.data, 0,
+                                   settings->affineLight.minAffineLightA);
+    problem.SetParameterUpperBound(affLight.data, 0,
+                                   settings->affineLight.maxAffineLightA);
+    problem.SetParameterLowerBound(affLight.data, 1,
+                                   settings->affineLight.minAffineLightB);
+    problem.SetParameterUpperBound(affLight.data, 1,
+                                   settings->affineLight.maxAffineLightB);
+  }
 
-  if (!settings.affineLight.optimizeAffineLight)
-    problem.SetParameterBlockConstant(affLight.data);
+  const bool useGradWeighting = settings->frameTracker.useGradWeighting;
+  std::vector<const PointTrackingResidual *> residuals;
+  residuals.reserve(basePoints.size());
+  if (useGradWeighting)
+    scaledLosses.reserve(basePoints.size());
 
-  std::vector<double> pixUsed;
+  for (int i = 0; i < basePoints.size(); ++i) {
+    Vec3 pos = basePoints.position(i);
+    if (!isPointTrackable(cam, pos, coarseBaseToTracked))
+      continue;
 
-  double pnt[2] = {0.0, 0.0};
+    ceres::LossFunction *lossFunc = &huberLoss;
+    if (useGradWeighting) {
+      scaledLosses.emplace_back(new ceres::ScaledLoss(
+          &huberLoss, basePoints.weight[i], ceres::DO_NOT_TAKE_OWNERSHIP));
+      lossFunc = scaledLosses.back().get();
+    }
 
-  std::vector<const PointTrackingResidual *> residuals;
-  StdVector<Vec2> gotOutside;
-
-  int pntTotal = 0;
-
-  for (int y = 0; y < baseImg.rows; ++y)
-    for (int x = 0; x < baseImg.cols; ++x)
-      if (baseDepths(y, x) > 0) {
-        if (!resMask(y, x))
-          continue;
-        ++pntTotal;
-        pnt[0] = x;
-        pnt[1] = y;
-
-        Vec3 pos = cam.unmap(pnt).normalized() * baseDepths(y, x);
-        if (!isPointTrackable(cam, pos, coarseBaseToTracked)) {
-          gotOutside.push_back(Vec2(x, y));
-          continue;
-        }
+    auto newResidual =
+        new PointTrackingResidual(pos, double(basePoints.intensity[i]), &cam,
+                                  &trackedFrame, coarseAffLight);
+    residuals.push_back(newResidual);
+    if (optimizeAffLight)
+      problem.AddResidualBlock(
+          new ceres::AutoDiffCostFunction<PointTrackingResidual, 1, 4, 3, 2>(
+              newResidual),
+          lossFunc, baseToTracked.so3().data(),
+          baseToTracked.translation().data(), affLight.data);
+    else
+      problem.AddResidualBlock(
+          new ceres::AutoDiffCostFunction<PointTrackingResidual, 1, 4, 3>(
+              newResidual),
+          lossFunc, baseToTracked.so3().data(),
+          baseToTracked.translation().data());
+  }
 
-        pixUsed.push_back(baseImg(y, x));
-
-        ceres::LossFunction *lossFunc = nullptr;
-        if (settings.frameTracker.useGradWeighting) {
-          double gradNorm = gradNormAt(baseImg, cv::Point(x, y));
-          double c = settings.gradWeighting.c;
-          double weight = c / std::hypot(c, gradNorm);
-          lossFunc = new ceres::ScaledLoss(
-              new ceres::HuberLoss(settings.intencity.outlierDiff), weight,
-              ceres::Ownership::TAKE_OWNERSHIP);
-        } else
-          lossFunc = new ceres::HuberLoss(settings.intencity.outlierDiff);
-
-        auto newResidual = new PointTrackingResidual(
-            pos, static_cast<double>(baseImg(y, x)), &cam, &trackedFrame);
-        residuals.push_back(newResidual);
-        ceres::CostFunction *newCostFunc =
-            new ceres::AutoDiffCostFunction<PointTrackingResidual, 1, 4, 3, 2>(
-                newResidual);
-        problem.AddResidualBlock(
-            newCostFunc, lossFunc, baseToTracked.so3().data(),
-            baseToTracked.translation().data(), affLight.data);
-      }
+  const double priorWeight = settings->frameTracker.rotationPriorWeight;
+  if (rotationPrior && priorWeight > 0)
+    problem.AddResidualBlock(
+        new ceres::AutoDiffCostFunction<RotationPriorResidual, 3, 4>(
+            new RotationPriorResidual(*rotationPrior, priorWeight)),
+        nullptr, baseToTracked.so3().data());
 
   ceres::Solver::Options options;
   options.linear_solver_type = ceres::DENSE_QR;
-  options.num_threads = settings.threading.numThreads;
+  options.num_threads = threadNum(settings->threading);
   // options.minimizer_progress_to_stdout = true;
-  // options.max_num_iterations = 10;
+  int maxIterations = settings->frameTracker.levelMaxIterationsAt(pyrLevel);
+  if (maxIterations > 0)
+    options.max_num_iterations = maxIterations;
+  double minDeltaNorm = settings->frameTracker.levelMinDeltaNormAt(pyrLevel);
+  if (minDeltaNorm > 0)
+    options.parameter_tolerance = minDeltaNorm;
   ceres::Solver::Summary summary;
 
   ceres::Solve(options, &problem, &summary);
-  LOG(INFO) << "time (mcs) = " << summary.total_time_in_seconds * 1000
-            << std::endl;
+  PROFILE_COUNT("tracking.residuals", residuals.size());
+  PROFILE_COUNT("tracking.iterations",
+                summary.num_successful_steps + summary.num_unsuccessful_steps);
+
+  DSO_LOG(TRACKING, 2) << summary.BriefReport();
 
-  LOG(INFO) << summary.BriefReport() << std::endl;
+  const bool needResiduals = notifyObservers && !observers.empty();
+  if (!rmse && !needResiduals)
+    return {baseToTracked, affLight};
+
+  // The final residuals are evaluated on plain doubles, with the points
+  // projected in one batch, instead of through the AutoDiff functors.
+  const int n = residuals.size();
+  std::vector<double> rayX(n), rayY(n), rayZ(n), xs(n), ys(n);
+  for (int i = 0; i < n; ++i) {
+    Vec3 newPos = baseToTracked * residuals[i]->pos;
+    rayX[i] = newPos[0];
+    rayY[i] = newPos[1];
+    rayZ[i] = newPos[2];
+  }
+  cam.mapBatch(n, rayX.data(), rayY.data(), rayZ.data(), xs.data(), ys.data());
 
   StdVector<std::pair<Vec2, double>> pointResiduals;
-  pointResiduals.reserve(residuals.size());
+  if (needResiduals)
+    pointResiduals.reserve(n);
+
+  double sqSum = 0;
+  for (int i = 0; i < n; ++i) {
+    double trackedIntensity;
+    trackedFrame.Evaluate(ys[i], xs[i], &trackedIntensity);
+    double res = affLight(trackedIntensity) - residuals[i]->baseIntensity;
+    if (needResiduals)
+      pointResiduals.push_back(std::pair(Vec2(xs[i], ys[i]), res));
+    sqSum += res * res;
+  }
+  if (rmse && n > 0)
+    *rmse = std::sqrt(sqSum / n);
+
+  if (!needResiduals)
+    return {baseToTracked, affLight};
+
+  int iterations =
+      summary.num_successful_steps + summary.num_unsuccessful_steps;
+  double time = std::chrono::duration<double>(
+                    std::chrono::high_resolution_clock::now() - startTime)
+                    .count();
+  for (FrameTrackerObserver *obs : observers)
+    obs->levelTracked(pyrLevel, baseToTracked, affLight, pointResiduals,
+                      iterations, time);
+
+  return {baseToTracked, affLight};
+}
+
+// Points per chunk of the parallel linearization. The chunks do not depend
+// on the number of threads, so neither does the sum.
+constexpr int linearizationChunkSize = 64 * ImageSampler::batchSize;
+
+struct NormalEquations {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  Mat88 H = Mat88::Zero();
+  Vec8 b = Vec8::Zero();
+  double energy = 0;
+
+  NormalEquations &operator+=(const NormalEquations &other) {
+    H += other.H;
+    b += other.b;
+    energy += other.energy;
+    return *this;
+  }
+};
+
+// Linearizes the points [begin, end), see linearizeTracking.
+template <typename Scalar, ImageSampler::Interpolation I,
+          bool OptimizeAffLight, bool Weighted>
+void linearizeTrackingChunk(int begin, int end, const CameraModel &cam,
+                            const ImageSampler &trackedFrame,
+                            const StdVector<Vec3> &positions,
+                            const std::vector<double> &intensities,
+                            const std::vector<double> &weights,
+                            const SE3 &baseToTracked, const AffLight &affLight,
+                            double outlierDiff, bool needNormalEquations,
+                            NormalEquations &sum, StdVector<Vec2> *onTracked,
+                            std::vector<double> *residuals) {
+  // with the light fixed only the pose part of H and b is filled
+  constexpr int P = OptimizeAffLight ? 8 : 6;
+  typedef Eigen::Matrix<Scalar, P, P> MatPPt;
+  typedef Eigen::Matrix<Scalar, P, 1> VecPt;
+  constexpr int B = ImageSampler::batchSize;
+
+  const Scalar expA = std::exp(affLight.data[0]);
+  const Scalar affB = affLight.data[1];
+  const Scalar outlier = outlierDiff;
+
+  Vec3 newPos[B];
+  Mat23 mapJacobian[B];
+  Scalar xs[B], ys[B], trackedIntensity[B], dIdy[B], dIdx[B];
+  MatPPt batchH;
+  VecPt batchB;
+  for (int start = begin; start < end; start += B) {
+    int cnt = std::min(B, end - start);
+    for (int l = 0; l < cnt; ++l) {
+      newPos[l] = baseToTracked * positions[start + l];
+      std::pair<Vec2, Mat23> mapped = cam.diffMap(newPos[l]);
+      xs[l] = mapped.first[0];
+      ys[l] = mapped.first[1];
+      mapJacobian[l] = mapped.second;
+      if (onTracked)
+        (*onTracked)[start + l] = mapped.first;
+    }
+    trackedFrame.evaluateBatch<I>(cnt, ys, xs, trackedIntensity, dIdy, dIdx);
+
+    Scalar batchEnergy = 0;
+    if (needNormalEquations) {
+      batchH.setZero();
+      batchB.setZero();
+    }
+    for (int l = 0; l < cnt; ++l) {
+      int i = start + l;
+      Scalar res =
+          expA * (trackedIntensity[l] + affB) - Scalar(intensities[i]);
+      if (residuals)
+        (*residuals)[i] = res;
+      Scalar absRes = std::abs(res);
+      bool isInlier = absRes <= outlier;
+      Scalar weight = Weighted ? Scalar(weights[i]) : Scalar(1);
+      batchEnergy += weight * (isInlier ? res * res
+                                        : outlier * (2 * absRes - outlier));
+
+      if (needNormalEquations) {
+        Eigen::Matrix<Scalar, 3, 6> dPosdXi;
+        dPosdXi << Eigen::Matrix<Scalar, 3, 3>::Identity(),
+            -SO3::hat(newPos[l]).template cast<Scalar>();
+        Eigen::Matrix<Scalar, 1, P> jacobian;
+        jacobian.template head<6>() =
+            expA * Eigen::Matrix<Scalar, 1, 2>(dIdx[l], dIdy[l]) *
+            mapJacobian[l].template cast<Scalar>() * dPosdXi;
+        if constexpr (OptimizeAffLight) {
+          jacobian[6] = expA * (trackedIntensity[l] + affB);
+          jacobian[7] = expA;
+        }
+
+        Scalar w = weight * (isInlier ? Scalar(1) : outlier / absRes);
+        batchH.noalias() += w * jacobian.transpose() * jacobian;
+        batchB.noalias() += w * res * jacobian.transpose();
+      }
+    }
+
+    sum.energy += batchEnergy;
+    if (needNormalEquations) {
+      sum.H.template topLeftCorner<P, P>() +=
+          batchH.template cast<double>();
+      sum.b.template head<P>() += batchB.template cast<double>();
+    }
+  }
+}
+
+// Energy and normal equations of the same robustified photometric cost that
+// PointTrackingResidual defines, with the parameters being a left SE3
+// increment (translation first, as in Sophus) followed by the affine light
+// parameters. H and b are left untouched if null. If onTracked and
+// residuals are not null, they get the projections of the points and their
+// residuals before the loss, for the caller not to redo them after the last
+// iteration. The projection is done in
+// doubles, while the per-pixel residuals and Jacobians are in Scalar. With
+// floats those are accumulated per batch, and the batch sums are added to
+// H, b and the energy in doubles.
+// Chunks of the points are linearized in parallel, on the executor the
+// caller runs on, and their sums are combined pairwise in a fixed tree, so
+// that the result is the same for any number of threads. trackedFrame is
+// sampled with the given interpolation. Without OptimizeAffLight the rows
+// and columns of the affine light parameters in H and b are left zero, and
+// without Weighted all of the weights are taken to be one and not read.
+template <typename Scalar, bool OptimizeAffLight, bool Weighted>
+double linearizeTracking(const CameraModel &cam,
+                         const ImageSampler &trackedFrame,
+                         ImageSampler::Interpolation interpolation,
+                         const StdVector<Vec3> &positions,
+                         const std::vector<double> &intensities,
+                         const std::vector<double> &weights,
+                         const SE3 &baseToTracked, const AffLight &affLight,
+                         double outlierDiff, Mat88 *H, Vec8 *b,
+                         StdVector<Vec2> *onTracked,
+                         std::vector<double> *residuals) {
+  if (onTracked) {
+    onTracked->resize(positions.size());
+    residuals->resize(positions.size());
+  }
+
+  const int pointNum = positions.size();
+  const int chunkNum =
+      (pointNum + linearizationChunkSize - 1) / linearizationChunkSize;
+  StdVector<NormalEquations> sums(std::max(chunkNum, 1));
+  dispatchInterpolation(interpolation, [&](auto I) {
+    tbb::parallel_for(0, chunkNum, [&](int chunk) {
+      int begin = chunk * linearizationChunkSize;
+      int end = std::min(pointNum, begin + linearizationChunkSize);
+      linearizeTrackingChunk<Scalar, decltype(I)::value, OptimizeAffLight,
+                             Weighted>(
+          begin, end, cam, trackedFrame, positions, intensities, weights,
+          baseToTracked, affLight, outlierDiff, H != nullptr, sums[chunk],
+          onTracked, residuals);
+    });
+  });
+  PROFILE_COUNT("tracking.linearization_chunks", chunkNum);
+
+  for (int step = 1; step < chunkNum; step *= 2)
+    for (int i = 0; i + step < chunkNum; i += 2 * step)
+      sums[i] += sums[i + step];
+
+  if (H) {
+    *H = sums[0].H;
+    *b = sums[0].b;
+  }
+  return sums[0].energy;
+}
+
+template <typename Scalar>
+FrameTracker::LinearizeFunc linearizeTrackingFor(bool optimizeAffLight,
+                                                 bool weighted) {
+  if (optimizeAffLight)
+    return weighted ? &linearizeTracking<Scalar, true, true>
+                    : &linearizeTracking<Scalar, true, false>;
+  return weighted ? &linearizeTracking<Scalar, false, true>
+                  : &linearizeTracking<Scalar, false, false>;
+}
+
+FrameTracker::LinearizeFunc
+FrameTracker::chooseLinearizeKernel(const FrameTrackerSettings &settings) {
+  const bool optimizeAffLight = settings.affineLight.optimizeAffineLight;
+  const bool weighted = settings.frameTracker.useGradWeighting;
+  return settings.frameTracker.useSinglePrecision
+             ? linearizeTrackingFor<float>(optimizeAffLight, weighted)
+             : linearizeTrackingFor<double>(optimizeAffLight, weighted);
+}
+
+// Linearizes the points [begin, end), see linearizeInverseCompositional.
+template <ImageSampler::Interpolation I>
+void linearizeInverseChunk(int begin, int end, const CameraModel &cam,
+                           const ImageSampler &trackedFrame,
+                           const StdVector<Vec3> &positions,
+                           const std::vector<double> &intensities,
+                           const std::vector<double> &weights,
+                           const StdVector<Vec6> &steepestDescent,
+                           const SE3 &baseToTracked, const AffLight &affLight,
+                           double outlierDiff, bool needNormalEquations,
+                           NormalEquations &sum, StdVector<Vec2> *onTracked,
+                           std::vector<double> *residuals) {
+  constexpr int B = ImageSampler::batchSize;
+  const double expA = std::exp(affLight.data[0]);
+  const double affB = affLight.data[1];
 
-  for (auto res : residuals) {
-    double eval = -1;
-    (*res)(baseToTracked.unit_quaternion().coeffs().data(),
-           baseToTracked.translation().data(), affLight.data, &eval);
-    Vec2 onTracked = cam.map(baseToTracked * res->pos);
-    pointResiduals.push_back(std::pair(onTracked, eval));
+  double rayX[B], rayY[B], rayZ[B], xs[B], ys[B], trackedIntensity[B];
+  for (int start = begin; start < end; start += B) {
+    int cnt = std::min(B, end - start);
+    for (int l = 0; l < cnt; ++l) {
+      Vec3 newPos = baseToTracked * positions[start + l];
+      rayX[l] = newPos[0];
+      rayY[l] = newPos[1];
+      rayZ[l] = newPos[2];
+    }
+    // neither the projection nor the sampling need derivatives
+    cam.mapBatch(cnt, rayX, rayY, rayZ, xs, ys);
+    trackedFrame.evaluateBatch<I>(cnt, ys, xs, trackedIntensity);
+
+    for (int l = 0; l < cnt; ++l) {
+      int i = start + l;
+      if (onTracked)
+        (*onTracked)[i] = Vec2(xs[l], ys[l]);
+      double res = expA * (trackedIntensity[l] + affB) - intensities[i];
+      if (residuals)
+        (*residuals)[i] = res;
+      double absRes = std::abs(res);
+      bool isInlier = absRes <= outlierDiff;
+      sum.energy += weights[i] * (isInlier ? res * res
+                                           : outlierDiff *
+                                                 (2 * absRes - outlierDiff));
+
+      if (needNormalEquations) {
+        Vec8 jacobian;
+        jacobian.head<6>() = -steepestDescent[i];
+        jacobian[6] = expA * (trackedIntensity[l] + affB);
+        jacobian[7] = expA;
+        double w = weights[i] * (isInlier ? 1 : outlierDiff / absRes);
+        sum.H.noalias() += w * jacobian * jacobian.transpose();
+        sum.b.noalias() += w * res * jacobian;
+      }
+    }
+  }
+}
+
+// The same cost as linearizeTracking, but with the pose increment applied
+// to the base points instead of the tracked ones, as in inverse
+// compositional image alignment: the residual of a point is
+// a (I_t(pi(T p)) + b) - I_b(pi(exp(xi) p)), and the new pose is
+// T exp(xi)^-1. The Jacobian of the residual wrt xi at zero is minus the
+// steepest descent row of the point, which does not depend on T. The affine
+// light parameters stay on the tracked side, as they are cheap to
+// differentiate there.
+double linearizeInverseCompositional(
+    const CameraModel &cam, const ImageSampler &trackedFrame,
+    ImageSampler::Interpolation interpolation,
+    const StdVector<Vec3> &positions, const std::vector<double> &intensities,
+    const std::vector<double> &weights,
+    const StdVector<Vec6> &steepestDescent, const SE3 &baseToTracked,
+    const AffLight &affLight, double outlierDiff, Mat88 *H, Vec8 *b,
+    StdVector<Vec2> *onTracked, std::vector<double> *residuals) {
+  if (onTracked) {
+    onTracked->resize(positions.size());
+    residuals->resize(positions.size());
   }
 
+  const int pointNum = positions.size();
+  const int chunkNum =
+      (pointNum + linearizationChunkSize - 1) / linearizationChunkSize;
+  StdVector<NormalEquations> sums(std::max(chunkNum, 1));
+  dispatchInterpolation(interpolation, [&](auto I) {
+    tbb::parallel_for(0, chunkNum, [&](int chunk) {
+      int begin = chunk * linearizationChunkSize;
+      int end = std::min(pointNum, begin + linearizationChunkSize);
+      linearizeInverseChunk<decltype(I)::value>(
+          begin, end, cam, trackedFrame, positions, intensities, weights,
+          steepestDescent, baseToTracked, affLight, outlierDiff, H != nullptr,
+          sums[chunk], onTracked, residuals);
+    });
+  });
+  PROFILE_COUNT("tracking.linearization_chunks", chunkNum);
+
+  for (int step = 1; step < chunkNum; step *= 2)
+    for (int i = 0; i + step < chunkNum; i += 2 * step)
+      sums[i] += sums[i + step];
+
+  if (H) {
+    *H = sums[0].H;
+    *b = sums[0].b;
+  }
+  return sums[0].energy;
+}
+
+std::pair<SE3, AffineLightTransform<double>>
+FrameTracker::trackPyrLevelAnalytic(
+    const CameraModel &cam, const BasePoints &basePoints,
+    const PreKeyFrameInternals &internals,
+    const SE3 &coarseBaseToTracked,
+    const AffineLightTransform<double> &coarseAffLight, int pyrLevel,
+    bool notifyObservers, double *rmse, const SO3 *rotationPrior) const {
+  PROFILE_SCOPE("tracking.level");
+  auto startTime = std::chrono::high_resolution_clock::now();
+
+  SE3 baseToTracked = coarseBaseToTracked;
+  AffineLightTransform<double> affLight = coarseAffLight;
+
+  const ImageSampler &trackedFrame = internals.sampler(pyrLevel);
+  const ImageSampler::Interpolation interpolation =
+      settings->frameTracker.interpolationAt(pyrLevel);
+
+  const bool isInverse = settings->frameTracker.useInverseCompositional;
+  StdVector<Vec3> positions;
+  std::vector<double> intensities;
+  std::vector<double> weights;
+  StdVector<Vec6> steepestDescent;
+  positions.reserve(basePoints.size());
+  intensities.reserve(basePoints.size());
+  weights.reserve(basePoints.size());
+  if (isInverse)
+    steepestDescent.reserve(basePoints.size());
+
+  for (int i = 0; i < basePoints.size(); ++i) {
+    Vec3 pos = basePoints.position(i);
+    if (!isPointTrackable(cam, pos, coarseBaseToTracked))
+      continue;
+
+    positions.push_back(pos);
+    intensities.push_back(basePoints.intensity[i]);
+    weights.push_back(basePoints.weight[i]);
+    if (isInverse)
+      steepestDescent.push_back(basePoints.steepestDescent[i]);
+  }
+
+  const double outlierDiff = settings->intencity.outlierDiff;
+  const bool optimizeAffLight = settings->affineLight.optimizeAffineLight;
+
+  ParallelExecutor executor(settings->threading, Scheduler::TRACKING);
+
+  // On the device only the normal equations are built, the projections and
+  // residuals for the observers are redone on the host after the last
+  // iteration.
+  bool onDevice = false;
+  if (settings->frameTracker.useCuda && !isInverse) {
+#ifdef FISHDSO_CUDA
+    onDevice = cuda::isAvailable();
+    if (!onDevice)
+      LOG_FIRST_N(WARNING, 1) << "no CUDA device, tracking on the CPU";
+#else
+    LOG_FIRST_N(WARNING, 1)
+        << "built without CUDA_TRACKING, tracking on the CPU";
+#endif
+  }
+#ifdef FISHDSO_CUDA
+  std::unique_ptr<cuda::DeviceTrackingPoints> devicePoints;
+  if (onDevice)
+    devicePoints.reset(
+        new cuda::DeviceTrackingPoints(positions, intensities, weights));
+#endif
+  auto linearize = [&](const SE3 &pose, const AffLight &light, Mat88 *H,
+                       Vec8 *b, StdVector<Vec2> *onTracked,
+                       std::vector<double> *residuals) {
+#ifdef FISHDSO_CUDA
+    if (onDevice && H)
+      return devicePoints->linearize(cam, internals.deviceImage(pyrLevel), pose,
+                                     light, outlierDiff, H, b);
+#endif
+    double energy = 0;
+    executor.execute([&]() {
+      if (isInverse)
+        energy = linearizeInverseCompositional(
+            cam, trackedFrame, interpolation, positions, intensities, weights,
+            steepestDescent, pose, light, outlierDiff, H, b, onTracked,
+            residuals);
+      else
+        energy = linearizeKernel(cam, trackedFrame, interpolation, positions,
+                                 intensities, weights, pose, light,
+                                 outlierDiff, H, b, onTracked, residuals);
+    });
+    return energy;
+  };
+
+  // The prior is W |log(R * prior^-1)|^2. For a left increment of the
+  // rotation the Jacobian of the log is close to identity near the prior.
+  // The inverse compositional increment omega turns R into R exp(-omega),
+  // which is the left increment -R omega. Returns its energy and adds it to
+  // the normal equations.
+  const double priorWeight =
+      rotationPrior ? settings->frameTracker.rotationPriorWeight : 0;
+  auto addPrior = [&](const SE3 &baseToTracked, Mat88 &H, Vec8 &b) {
+    if (priorWeight <= 0)
+      return 0.0;
+    Vec3 priorRes = (baseToTracked.so3() * rotationPrior->inverse()).log();
+    H.block<3, 3>(3, 3).diagonal().array() += priorWeight;
+    if (isInverse)
+      b.segment<3>(3) -=
+          priorWeight * (baseToTracked.so3().matrix().transpose() * priorRes);
+    else
+      b.segment<3>(3) += priorWeight * priorRes;
+    return priorWeight * priorRes.squaredNorm();
+  };
+
+  const bool needResiduals = notifyObservers && !observers.empty();
+  const bool keepResiduals = rmse || needResiduals;
+  const bool keepIterationResiduals = keepResiduals && !onDevice;
+
+  // the projections and residuals at the accepted pose, kept from the
+  // linearization there
+  StdVector<Vec2> onTracked, newOnTracked;
+  std::vector<double> residuals, newResiduals;
+  StdVector<Vec2> *newOnTrackedPtr =
+      keepIterationResiduals ? &newOnTracked : nullptr;
+  std::vector<double> *newResidualsPtr =
+      keepIterationResiduals ? &newResiduals : nullptr;
+
+  Mat88 H, newH;
+  Vec8 b, newB;
+  double energy =
+      linearize(baseToTracked, affLight, &H, &b,
+                keepIterationResiduals ? &onTracked : nullptr,
+                keepIterationResiduals ? &residuals : nullptr);
+  energy += addPrior(baseToTracked, H, b);
+  double initialEnergy = energy;
+  double lambda = settings->frameTracker.initialLmLambda;
+
+  int maxIterations = settings->frameTracker.levelMaxIterationsAt(pyrLevel);
+  if (maxIterations <= 0)
+    maxIterations = settings->frameTracker.maxIterations;
+  double minDeltaNorm = settings->frameTracker.levelMinDeltaNormAt(pyrLevel);
+  if (minDeltaNorm <= 0)
+    minDeltaNorm = settings->frameTracker.minDeltaNorm;
+
+  int it = 0;
+  for (; it < maxIterations; ++it) {
+    Mat88 damped = H;
+    damped.diagonal() *= 1 + lambda;
+    Vec8 rhs = -b;
+    if (!optimizeAffLight) {
+      damped.bottomRows<2>().setZero();
+      damped.rightCols<2>().setZero();
+      damped.bottomRightCorner<2, 2>().setIdentity();
+      rhs.tail<2>().setZero();
+    }
+    Vec8 delta = damped.ldlt().solve(rhs);
+
+    SE3 newBaseToTracked =
+        isInverse ? baseToTracked * SE3::exp(delta.head<6>()).inverse()
+                  : SE3::exp(delta.head<6>()) * baseToTracked;
+    AffineLightTransform<double> newAffLight(
+        std::clamp(affLight.data[0] + delta[6],
+                   settings->affineLight.minAffineLightA,
+                   settings->affineLight.maxAffineLightA),
+        std::clamp(affLight.data[1] + delta[7],
+                   settings->affineLight.minAffineLightB,
+                   settings->affineLight.maxAffineLightB));
+
+    double newEnergy = linearize(newBaseToTracked, newAffLight, &newH, &newB,
+                                 newOnTrackedPtr, newResidualsPtr);
+    newEnergy += addPrior(newBaseToTracked, newH, newB);
+    if (newEnergy < energy) {
+      baseToTracked = newBaseToTracked;
+      affLight = newAffLight;
+      energy = newEnergy;
+      H = newH;
+      b = newB;
+      onTracked.swap(newOnTracked);
+      residuals.swap(newResiduals);
+      lambda *= 0.5;
+    } else
+      lambda *= 4;
+
+    if (delta.norm() < minDeltaNorm)
+      break;
+  }
+
+  auto endTime = std::chrono::high_resolution_clock::now();
+  PROFILE_COUNT("tracking.residuals", positions.size());
+  PROFILE_COUNT("tracking.iterations", it);
+  DSO_LOG(TRACKING, 2) << "analytic tracking: " << positions.size()
+                       << " points, " << it << " iterations, energy "
+                       << initialEnergy << " -> " << energy;
+
+  if (!keepResiduals)
+    return {baseToTracked, affLight};
+  if (!keepIterationResiduals)
+    linearize(baseToTracked, affLight, nullptr, nullptr, &onTracked,
+              &residuals);
+
+  double sqSum = 0;
+  for (double res : residuals)
+    sqSum += res * res;
+  if (rmse && !positions.empty())
+    *rmse = std::sqrt(sqSum / positions.size());
+
+  if (!needResiduals)
+    return {baseToTracked, affLight};
+
+  StdVector<std::pair<Vec2, double>> pointResiduals;
+  pointResiduals.reserve(positions.size());
+  for (int i = 0; i < positions.size(); ++i)
+    pointResiduals.push_back(std::pair(onTracked[i], residuals[i]));
+
+  double time = std::chrono::duration<double>(endTime - startTime).count();
   for (FrameTrackerObserver *obs : observers)
-    obs->levelTracked(pyrLevel, baseToTracked, affLight, pointResiduals);
+    obs->levelTracked(pyrLevel, baseToTracked, affLight, pointResiduals, it,
+                      time);
 
   return {baseToTracked, affLight};
 }
 
+std::pair<SE3, std::vector<AffLight>>
+FrameTracker::trackRig(const std::vector<const PreKeyFrame *> &frames,
+                       const SE3 &coarseBaseToTracked,
+                       const std::vector<AffLight> &coarseAffLights) {
+  PROFILE_SCOPE("tracking.rig");
+  CHECK_EQ(frames.size(), cameras.size());
+  CHECK_EQ(coarseAffLights.size(), cameras.size());
+
+  SE3 baseToTracked = coarseBaseToTracked;
+  std::vector<AffLight> affLights = coarseAffLights;
+
+  double lastLevelDelta = INF;
+  double sqSum = 0;
+  int residualNum = 0;
+  for (int i = settings->pyramid.levelNum - 1; i >= 0; --i) {
+    if (i == 0 && settings->frameTracker.skipFinestLevel &&
+        lastLevelDelta < settings->frameTracker.skipFinestLevelDelta) {
+      PROFILE_COUNT("tracking.skippedFinestLevels", 1);
+      DSO_LOG(TRACKING, 2) << "skip level #0, update on level #1 = "
+                           << lastLevelDelta;
+      break;
+    }
+
+    DSO_LOG(TRACKING, 3) << "track rig level #" << i;
+    SE3 levelStart = baseToTracked;
+    std::tie(baseToTracked, affLights) = trackRigLevel(
+        frames, baseToTracked, affLights, i, &sqSum, &residualNum);
+    lastLevelDelta = (baseToTracked * levelStart.inverse()).log().norm();
+    lastRmseLevel = i;
+  }
+
+  lastRmse = residualNum > 0 ? std::sqrt(sqSum / residualNum) : INF;
+  return {baseToTracked, affLights};
+}
+
+// The motion of a camera is bodyToCam * baseToTracked * bodyToCam^-1, so a
+// left increment xi of the body motion is one of Adj(bodyToCam) * xi of the
+// camera motion. Each camera is linearized as in single camera tracking, and
+// its pose part is then brought to the body with the adjoint. The parameters
+// are the body increment followed by the affine light parameters of the
+// cameras.
+std::pair<SE3, std::vector<AffLight>> FrameTracker::trackRigLevel(
+    const std::vector<const PreKeyFrame *> &frames,
+    const SE3 &coarseBaseToTracked,
+    const std::vector<AffLight> &coarseAffLights, int pyrLevel,
+    double *sqSum, int *residualNum) const {
+  PROFILE_SCOPE("tracking.rigLevel");
+  const int camNum = cameras.size();
+  const int dim = 6 + 2 * camNum;
+
+  struct CameraProblem {
+    const CameraModel *cam;
+    const ImageSampler *trackedFrame;
+    SE3::Adjoint adj;
+    StdVector<Vec3> positions;
+    std::vector<double> intensities;
+    std::vector<double> weights;
+
+    Mat88 H;
+    Vec8 b;
+    double energy;
+  };
+
+  StdVector<CameraProblem> problems(camNum);
+  int pointNum = 0;
+  for (int ci = 0; ci < camNum; ++ci) {
+    const TrackedCamera &camera = cameras[ci];
+    CameraProblem &problem = problems[ci];
+    problem.cam = &(*camera.camPyr)[pyrLevel];
+    problem.trackedFrame = &frames[ci]->internals->sampler(pyrLevel);
+    problem.adj = camera.bodyToCam.Adj();
+
+    SE3 coarseCamMotion = camera.bodyToCam * coarseBaseToTracked *
+                          camera.bodyToCam.inverse();
+    const BasePoints &basePoints = camera.basePoints[pyrLevel];
+    for (int i = 0; i < basePoints.size(); ++i) {
+      Vec3 pos = basePoints.position(i);
+      if (!isPointTrackable(*problem.cam, pos, coarseCamMotion))
+        continue;
+
+      problem.positions.push_back(pos);
+      problem.intensities.push_back(basePoints.intensity[i]);
+      problem.weights.push_back(basePoints.weight[i]);
+    }
+    pointNum += problem.positions.size();
+  }
+
+  const double outlierDiff = settings->intencity.outlierDiff;
+  const bool optimizeAffLight = settings->affineLight.optimizeAffineLight;
+  const ImageSampler::Interpolation interpolation =
+      settings->frameTracker.interpolationAt(pyrLevel);
+
+  const LinearizeFunc linearize = linearizeKernel;
+
+  ParallelExecutor executor(settings->threading, Scheduler::TRACKING);
+
+  // The cameras are linearized in parallel, and their normal equations are
+  // summed in the order of the rig, so that the result does not depend on
+  // the scheduling.
+  auto linearizeRig = [&](const SE3 &baseToTracked,
+                          const std::vector<AffLight> &affLights, MatXX &H,
+                          VecX &b) {
+    executor.execute([&]() {
+      tbb::parallel_for(0, camNum, [&](int ci) {
+        CameraProblem &problem = problems[ci];
+        const SE3 &bodyToCam = cameras[ci].bodyToCam;
+        SE3 camMotion = bodyToCam * baseToTracked * bodyToCam.inverse();
+        problem.energy = linearize(
+            *problem.cam, *problem.trackedFrame, interpolation,
+            problem.positions, problem.intensities, problem.weights,
+            camMotion, affLights[ci], outlierDiff, &problem.H, &problem.b,
+            nullptr, nullptr);
+      });
+    });
+
+    H.setZero(dim, dim);
+    b.setZero(dim);
+    double energy = 0;
+    for (int ci = 0; ci < camNum; ++ci) {
+      const CameraProblem &problem = problems[ci];
+      const SE3::Adjoint &adj = problem.adj;
+      const int ai = 6 + 2 * ci;
+      H.topLeftCorner<6, 6>() +=
+          adj.transpose() * problem.H.topLeftCorner<6, 6>() * adj;
+      H.block<6, 2>(0, ai) +=
+          adj.transpose() * problem.H.topRightCorner<6, 2>();
+      H.block<2, 6>(ai, 0) += problem.H.bottomLeftCorner<2, 6>() * adj;
+      H.block<2, 2>(ai, ai) += problem.H.bottomRightCorner<2, 2>();
+      b.head<6>() += adj.transpose() * problem.b.head<6>();
+      b.segment<2>(ai) += problem.b.tail<2>();
+      energy += problem.energy;
+    }
+    return energy;
+  };
+
+  SE3 baseToTracked = coarseBaseToTracked;
+  std::vector<AffLight> affLights = coarseAffLights;
+
+  MatXX H, newH;
+  VecX b, newB;
+  double energy = linearizeRig(baseToTracked, affLights, H, b);
+  double initialEnergy = energy;
+  double lambda = settings->frameTracker.initialLmLambda;
+
+  int maxIterations = settings->frameTracker.levelMaxIterationsAt(pyrLevel);
+  if (maxIterations <= 0)
+    maxIterations = settings->frameTracker.maxIterations;
+  double minDeltaNorm = settings->frameTracker.levelMinDeltaNormAt(pyrLevel);
+  if (minDeltaNorm <= 0)
+    minDeltaNorm = settings->frameTracker.minDeltaNorm;
+
+  int it = 0;
+  for (; it < maxIterations; ++it) {
+    MatXX damped = H;
+    damped.diagonal() *= 1 + lambda;
+    VecX rhs = -b;
+    if (!optimizeAffLight) {
+      const int affDim = dim - 6;
+      damped.bottomRows(affDim).setZero();
+      damped.rightCols(affDim).setZero();
+      damped.bottomRightCorner(affDim, affDim).setIdentity();
+      rhs.tail(affDim).setZero();
+    }
+    VecX delta = damped.ldlt().solve(rhs);
+
+    SE3 newBaseToTracked = SE3::exp(delta.head<6>()) * baseToTracked;
+    std::vector<AffLight> newAffLights;
+    newAffLights.reserve(camNum);
+    for (int ci = 0; ci < camNum; ++ci) {
+      const int ai = 6 + 2 * ci;
+      newAffLights.emplace_back(
+          std::clamp(affLights[ci].data[0] + delta[ai],
+                     settings->affineLight.minAffineLightA,
+                     settings->affineLight.maxAffineLightA),
+          std::clamp(affLights[ci].data[1] + delta[ai + 1],
+                     settings->affineLight.minAffineLightB,
+                     settings->affineLight.maxAffineLightB));
+    }
+
+    double newEnergy = linearizeRig(newBaseToTracked, newAffLights, newH, newB);
+    if (newEnergy < energy) {
+      baseToTracked = newBaseToTracked;
+      affLights = newAffLights;
+      energy = newEnergy;
+      H.swap(newH);
+      b.swap(newB);
+      lambda *= 0.5;
+    } else
+      lambda *= 4;
+
+    if (delta.norm() < minDeltaNorm)
+      break;
+  }
+
+  PROFILE_COUNT("tracking.residuals", pointNum);
+  PROFILE_COUNT("tracking.iterations", it);
+  DSO_LOG(TRACKING, 2) << "rig tracking: " << camNum << " cameras, "
+                       << pointNum << " points, " << it
+                       << " iterations, energy " << initialEnergy << " -> "
+                       << energy;
+
+  // the residuals before the loss at the accepted motion
+  std::vector<double> camSqSum(camNum, 0);
+  executor.execute([&]() {
+    tbb::parallel_for(0, camNum, [&](int ci) {
+      const CameraProblem &problem = problems[ci];
+      const SE3 &bodyToCam = cameras[ci].bodyToCam;
+      SE3 camMotion = bodyToCam * baseToTracked * bodyToCam.inverse();
+      StdVector<Vec2> onTracked;
+      std::vector<double> residuals;
+      linearize(*problem.cam, *problem.trackedFrame, interpolation,
+                problem.positions, problem.intensities, problem.weights,
+                camMotion, affLights[ci], outlierDiff, nullptr, nullptr,
+                &onTracked, &residuals);
+      for (double res : residuals)
+        camSqSum[ci] += res * res;
+    });
+  });
+  *sqSum = 0;
+  for (double s : camSqSum)
+    *sqSum += s;
+  *residualNum = pointNum;
+
+  return {baseToTracked, affLights};
+}
+
 } // namespace fishdso
@@ -0,0 +1,151 @@
+#include "system/GlobalBundleAdjuster.h"
+#include "system/BundleAdjuster.h"
+#include "util/Log.h"
+#include "util/Profiler.h"
+#include "util/Scheduler.h"
+#include <algorithm>
+#include <cmath>
+#include <glog/logging.h>
+#include <tbb/parallel_for.h>
+
+namespace fishdso {
+
+namespace {
+
+// shares the pyramid of the keyframe, the points are copied in their order
+std::unique_ptr<KeyFrame> copyForSubmap(const KeyFrame &keyFrame) {
+  std::unique_ptr<KeyFrame> copy(
+      new KeyFrame(keyFrame.preKeyFrame, keyFrame.kfSettings));
+  copy->thisToWorld = keyFrame.thisToWorld;
+  copy->lightWorldToThis = keyFrame.lightWorldToThis;
+  copy->optimizedPoints.reserve(keyFrame.optimizedPoints.size());
+  for (const auto &op : keyFrame.optimizedPoints)
+    copy->optimizedPoints.emplace_back(new OptimizedPoint(*op));
+  return copy;
+}
+
+} // namespace
+
+GlobalBundleAdjuster::GlobalBundleAdjuster(
+    CameraModel *cam, const BundleAdjusterSettings &baSettings,
+    const Settings::GlobalBundleAdjuster &settings)
+    : cam(cam)
+    , baSettings(baSettings)
+    , settings(settings) {
+  CHECK_GE(settings.submapOverlap, 1);
+  CHECK_GT(settings.submapSize, settings.submapOverlap);
+  // the last submap can have just two keyframes, their motion is not fixed
+  this->baSettings.bundleAdjuster.fixedMotionOnFirstAdjustent = false;
+}
+
+void GlobalBundleAdjuster::addKeyFrame(KeyFrame &&keyFrame) {
+  std::unique_ptr<KeyFrame> kept(new KeyFrame(std::move(keyFrame)));
+  kept->immaturePoints.clear();
+  kept->immaturePoints.shrink_to_fit();
+  kept->immaturePointBlock.reset();
+  kept->trackedFrames.clear();
+  kept->trackedFrames.shrink_to_fit();
+  // the submaps are adjusted on copies, which warp their own
+  kept->cubeMap.reset();
+  auto &points = kept->optimizedPoints;
+  points.erase(std::remove_if(points.begin(), points.end(),
+                              [](const auto &op) {
+                                return !std::isfinite(op->logInvDepth);
+                              }),
+               points.end());
+  points.shrink_to_fit();
+  // the keyframe it was tracked against is gone or will be soon
+  kept->preKeyFrame->baseKeyFrame = nullptr;
+  // keyframes can leave the window out of order, see MarginalizationPolicy
+  int num = kept->preKeyFrame->globalFrameNum;
+  auto it = std::upper_bound(keyFrames.begin(), keyFrames.end(), num,
+                             [](int num, const std::unique_ptr<KeyFrame> &kf) {
+                               return num < kf->preKeyFrame->globalFrameNum;
+                             });
+  keyFrames.insert(it, std::move(kept));
+}
+
+int GlobalBundleAdjuster::keyFrameNum() const { return keyFrames.size(); }
+
+std::vector<std::pair<int, int>>
+GlobalBundleAdjuster::submapRanges(int kfNum, int submapSize, int overlap) {
+  std::vector<std::pair<int, int>> ranges;
+  if (kfNum < 2)
+    return ranges;
+  // the last range has more than overlap keyframes, so at least two
+  const int stride = submapSize - overlap;
+  for (int begin = 0;; begin += stride) {
+    int end = std::min(begin + submapSize, kfNum);
+    ranges.push_back({begin, end});
+    if (end == kfNum)
+      break;
+  }
+  return ranges;
+}
+
+std::vector<KeyFrame *>
+GlobalBundleAdjuster::adjust(const std::vector<KeyFrame *> &lastKeyFrames) {
+  PROFILE_SCOPE("globalBa.adjust");
+  std::vector<KeyFrame *> all;
+  all.reserve(keyFrames.size() + lastKeyFrames.size());
+  for (const auto &kf : keyFrames)
+    all.push_back(kf.get());
+  all.insert(all.end(), lastKeyFrames.begin(), lastKeyFrames.end());
+  // the copies are made from the pyramids, whose base keyframes may be gone
+  for (KeyFrame *kf : all)
+    kf->preKeyFrame->baseKeyFrame = nullptr;
+
+  const int overlap = settings.submapOverlap;
+  std::vector<std::pair<int, int>> ranges =
+      submapRanges(all.size(), settings.submapSize, overlap);
+  DSO_LOG(BA, 1) << "global BA over " << all.size() << " keyframes in "
+                 << ranges.size() << " submaps";
+  PROFILE_COUNT("globalBa.submaps", ranges.size());
+
+  std::vector<std::vector<std::unique_ptr<KeyFrame>>> submaps(ranges.size());
+  for (int s = 0; s < ranges.size(); ++s)
+    for (int i = ranges[s].first; i < ranges[s].second; ++i)
+      submaps[s].push_back(copyForSubmap(*all[i]));
+
+  ParallelExecutor(baSettings.threading, Scheduler::MAPPING).execute([&]() {
+    tbb::parallel_for(0, int(submaps.size()), [&](int s) {
+      BundleAdjuster bundleAdjuster(cam, baSettings);
+      for (const auto &kf : submaps[s])
+        bundleAdjuster.addKeyFrame(kf.get());
+      bundleAdjuster.adjust(settings.maxIterations);
+    });
+  });
+
+  // The first keyframe of a submap stays where it was, and it is owned by
+  // the previous submap, which has already been merged by then.
+  const int ownedFrom = (overlap + 1) / 2;
+  for (int s = 0; s < ranges.size(); ++s) {
+    auto [begin, end] = ranges[s];
+    const KeyFrame &subFirst = *submaps[s][0];
+    SE3 subToMerged;
+    AffineLightTransform<double> lightMergedToSub;
+    if (s > 0) {
+      subToMerged = all[begin]->thisToWorld * subFirst.thisToWorld.inverse();
+      lightMergedToSub =
+          subFirst.lightWorldToThis.inverse() * all[begin]->lightWorldToThis;
+    }
+
+    int ownBegin = s == 0 ? begin : begin + ownedFrom;
+    int ownEnd = s + 1 < ranges.size() ? ranges[s + 1].first + ownedFrom : end;
+    for (int i = ownBegin; i < ownEnd; ++i) {
+      const KeyFrame &sub = *submaps[s][i - begin];
+      KeyFrame &keyFrame = *all[i];
+      keyFrame.thisToWorld = subToMerged * sub.thisToWorld;
+      keyFrame.lightWorldToThis = sub.lightWorldToThis * lightMergedToSub;
+      for (int p = 0; p < keyFrame.optimizedPoints.size(); ++p) {
+        keyFrame.optimizedPoints[p]->logInvDepth =
+            sub.optimizedPoints[p]->logInvDepth;
+        keyFrame.optimizedPoints[p]->state = sub.optimizedPoints[p]->state;
+      }
+    }
+  }
+
+  return all;
+}
+
+} // namespace fishdso
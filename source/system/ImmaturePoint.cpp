@@ -2,63 +2,129 @@
 #include "PreKeyFrameInternals.h"
 #include "system/KeyFrame.h"
 #include "system/serialization.h"
+#include "util/Profiler.h"
 #include "util/defs.h"
 #include "util/geometry.h"
 #include "util/util.h"
+#include <algorithm>
 #include <ceres/internal/autodiff.h>
 #include <ceres/jet.h>
 
 namespace fishdso {
 
-#define PL (settings.pyramid.levelNum)
-#define PS (settings.residualPattern.pattern().size())
-#define PH (settings.residualPattern.height)
-#define TH (settings.intencity.outlierDiff)
+#define PL (settings->pyramid.levelNum)
+#define PS (int(settings->residualPattern.pattern().size()))
+#define PH (settings->residualPattern.height)
+#define TH (settings->intencity.outlierDiff)
 
-ImmaturePoint::ImmaturePoint(KeyFrame *baseFrame, const Vec2 &p,
-                             const PointTracerSettings &_settings)
+namespace {
+
+// Scratch buffers for tracing, one set per thread. They keep their capacity
+// between points and frames, so after the first few points they stop
+// allocating, and threads tracing in parallel do not contend in the
+// allocator.
+struct TracingWorkspace {
+  StdVector<Vec2> points;
+  std::vector<Vec3> directions;
+  StdVector<std::pair<Vec2, double>> energiesFound;
+  // of the coarse search, with the indices of their steps
+  std::vector<std::pair<float, int>> coarseEnergies;
+  std::vector<char> isSearched;
+};
+
+TracingWorkspace &tracingWorkspace() {
+  thread_local TracingWorkspace workspace;
+  return workspace;
+}
+
+// counts the buffers of the workspace that had to grow while tracing a point
+class WorkspaceGrowthCounter {
+public:
+  WorkspaceGrowthCounter(const TracingWorkspace &workspace)
+      : workspace(workspace)
+      , initialCapacities(capacities()) {}
+
+  ~WorkspaceGrowthCounter() {
+    std::array<size_t, 5> newCapacities = capacities();
+    int grown = 0;
+    for (int i = 0; i < 5; ++i)
+      if (newCapacities[i] != initialCapacities[i])
+        grown++;
+    PROFILE_COUNT("tracing.workspaceAllocations", grown);
+  }
+
+private:
+  std::array<size_t, 5> capacities() const {
+    return {workspace.points.capacity(), workspace.directions.capacity(),
+            workspace.energiesFound.capacity(),
+            workspace.coarseEnergies.capacity(),
+            workspace.isSearched.capacity()};
+  }
+
+  const TracingWorkspace &workspace;
+  std::array<size_t, 5> initialCapacities;
+};
+
+} // namespace
+
+TracingContext::TracingContext(const KeyFrame &baseFrame,
+                               const PreKeyFrame &refFrame)
+    : baseFrame(baseFrame)
+    , refFrame(refFrame)
+    , baseToRef(refFrame.baseToThis *
+                refFrame.baseKeyFrame->thisToWorld.inverse() *
+                baseFrame.thisToWorld)
+    , lightBaseToRef(refFrame.lightBaseToThis *
+                     refFrame.baseKeyFrame->lightWorldToThis *
+                     baseFrame.lightWorldToThis.inverse())
+    , epipole(baseToRef.translation().normalized()) {}
+
+ImmaturePoint::ImmaturePoint(KeyFrame *baseFrame, const Vec2 &p, int slot)
     : p(p)
-    , baseDirections(_settings.residualPattern.pattern().size())
-    , baseIntencities(_settings.residualPattern.pattern().size())
-    , baseGrad(_settings.residualPattern.pattern().size())
-    , baseGradNorm(_settings.residualPattern.pattern().size())
+    , block(baseFrame->immaturePointBlock.get())
+    , slot(slot)
     , minDepth(0)
     , maxDepth(INF)
     , bestQuality(-1)
     , lastEnergy(INF)
     , stddev(INF)
+    , filterMean(0)
+    , filterVar(INF)
+    , filterA(10)
+    , filterB(10)
     , cam(baseFrame->preKeyFrame->cam)
     , state(ACTIVE)
-    , settings(_settings)
+    , settings(baseFrame->tracingSettings)
     , lastTraced(false)
     , numTraced(0)
     , tracedPyrLevel(0) {
+  CHECK_LE(PS, MPS) << "residual pattern is too large";
   if (!cam->isOnImage(p, PH)) {
     state = OOB;
     return;
   }
 
+  ImmaturePointBlockBase::PatternRef base = pattern();
   for (int i = 0; i < PS; ++i) {
-    Vec2 curP = p + settings.residualPattern.pattern()[i];
+    Vec2 curP = p + settings->residualPattern.pattern()[i];
     cv::Point curPCV = toCvPoint(curP);
-    baseDirections[i] = cam->unmap(curP).normalized();
-    baseIntencities[i] = baseFrame->preKeyFrame->frame()(curPCV);
-
-    baseGrad[i] = Vec2(baseFrame->preKeyFrame->gradX(curPCV),
-                       baseFrame->preKeyFrame->gradY(curPCV));
-    baseGradNorm[i] = baseGrad[i].normalized();
+    base.directions[i] = cam->unmap(curP).normalized();
+    base.intencities[i] = baseFrame->preKeyFrame->frame()(curPCV);
+    base.grads[i] = baseFrame->preKeyFrame->gradient(curPCV);
+    base.gradNorms[i] = base.grads[i].normalized();
   }
 }
 
 ImmaturePoint::ImmaturePoint(KeyFrame *baseFrame,
                              PointSerializer<LOAD> &pointSerializer)
-    : baseDirections(
-          baseFrame->tracingSettings.residualPattern.pattern().size())
-    , baseIntencities(
-          baseFrame->tracingSettings.residualPattern.pattern().size())
-    , baseGrad(baseFrame->tracingSettings.residualPattern.pattern().size())
-    , baseGradNorm(baseFrame->tracingSettings.residualPattern.pattern().size())
+    : block(baseFrame->immaturePointBlock.get())
+    , slot(block->add())
+    , filterMean(0)
+    , filterVar(INF)
+    , filterA(10)
+    , filterB(10)
     , settings(baseFrame->tracingSettings) {
+  CHECK_LE(PS, MPS) << "residual pattern is too large";
   cam = baseFrame->preKeyFrame->cam;
   pointSerializer.process(*this);
 
@@ -75,71 +141,73 @@ ImmaturePoint::ImmaturePoint(KeyFrame *baseFrame,
 }
 
 bool ImmaturePoint::isReady() {
-  return state == ACTIVE && stddev < settings.pointTracer.optimizedStddev;
+  return state == ACTIVE && stddev < settings->pointTracer.optimizedStddev;
 }
 
-bool ImmaturePoint::pointsToTrace(const SE3 &baseToRef, Vec3 &dirMinDepth,
-                                  Vec3 &dirMaxDepth, StdVector<Vec2> &points,
+bool ImmaturePoint::pointsToTrace(Vec3 &dirMinDepth, Vec3 &dirMaxDepth,
+                                  StdVector<Vec2> &points,
                                   std::vector<Vec3> &directions) {
   points.resize(0);
   directions.resize(0);
 
   if (M_PI - angle(dirMinDepth, dirMaxDepth) < 1e-3) {
-    LOG(INFO) << "ret by angle" << std::endl;
+    PROFILE_COUNT("tracing.degenerateSegments", 1);
     return false;
   }
 
-  if (settings.pointTracer.performFullTracing) {
+  if (settings->pointTracer.performFullTracing) {
     // While searching along epipolar curve, we will continously map rays on a
     // diametrical segment of a sphere. Since our camera model remains valid
     // only when angle between the mapped ray and Oz is smaller then certain
     // maxAngle, we want to intersect the segment of search with the
     // "well-mapped" part of the sphere, i.e. z > z0.
     if (!intersectOnSphere(cam->getMaxAngle(), dirMinDepth, dirMaxDepth)) {
-      LOG(INFO) << "ret by no itersection" << std::endl;
+      PROFILE_COUNT("tracing.segmentsOffImage", 1);
       return false;
     }
   }
 
   int maxSearchCount =
-      settings.pointTracer.maxSearchRel * (cam->getWidth() + cam->getHeight());
+      settings->pointTracer.maxSearchRel * (cam->getWidth() + cam->getHeight());
   double alpha0 = 0;
-  double step = 1.0 / (settings.pointTracer.onImageTestCount - 1);
+  double step = 1.0 / (settings->pointTracer.onImageTestCount - 1);
   while (alpha0 <= 1) {
     Vec3 curDir = (1 - alpha0) * dirMaxDepth + alpha0 * dirMinDepth;
     Vec2 curP = cam->map(curDir);
     if (!cam->isOnImage(curP, PH)) {
-      if (!settings.pointTracer.performFullTracing)
+      if (!settings->pointTracer.performFullTracing)
         break;
       alpha0 += step;
       continue;
     }
 
-    double alpha;
-    for (int i = 0; i < 2; ++i) {
-      alpha = alpha0;
-      Vec2 point;
-      int pointCnt = 0;
-      do {
-        Vec3 curDir = (1 - alpha) * dirMaxDepth + alpha * dirMinDepth;
-        Mat23 mapJacobian;
-        std::tie(point, mapJacobian) = cam->diffMap(curDir);
-
-        points.push_back(point);
-        directions.push_back(curDir);
-
-        double deltaAlpha =
-            1. / (mapJacobian * (dirMaxDepth - dirMinDepth)).norm();
-        alpha += deltaAlpha;
-
-        pointCnt++;
-        if (!settings.pointTracer.performFullTracing &&
-            pointCnt >= maxSearchCount)
-          break;
-      } while (alpha >= 0 && alpha <= 1 && cam->isOnImage(point, PH));
-    }
+    // The curve is walked in steps of about a pixel. The first step comes
+    // from the jacobian of the camera, and every next one is rescaled by the
+    // distance the previous one made on the image, so a sample only costs a
+    // map(), which uses the lookup tables if there are any.
+    double alpha = alpha0;
+    double deltaAlpha =
+        1. / (cam->diffMap(curDir).second * (dirMaxDepth - dirMinDepth)).norm();
+    Vec2 point = curP;
+    int pointCnt = 0;
+    do {
+      points.push_back(point);
+      directions.push_back(curDir);
+      pointCnt++;
+      if (!settings->pointTracer.performFullTracing &&
+          pointCnt >= maxSearchCount)
+        break;
+
+      alpha += deltaAlpha;
+      curDir = (1 - alpha) * dirMaxDepth + alpha * dirMinDepth;
+      Vec2 nextPoint = cam->map(curDir);
+      double dist = (nextPoint - point).norm();
+      if (dist > 0)
+        deltaAlpha *= std::clamp(1 / dist, 0.5, 2.0);
+      point = nextPoint;
+    } while (alpha >= 0 && alpha <= 1 && cam->isOnImage(point, PH));
 
-    if (!settings.pointTracer.performFullTracing)
+    if (!settings->pointTracer.performFullTracing)
       break;
 
     alpha0 = alpha + step;
@@ -148,32 +216,96 @@ bool ImmaturePoint::pointsToTrace(const SE3 &baseToRef, Vec3 &dirMinDepth,
   return points.size() > 1;
 }
 
-Vec2 ImmaturePoint::tracePrecise(
-    const ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char, 1>> &refFrame,
-    const Vec2 &from, const Vec2 &to, const std::vector<double> &intencities,
-    const StdVector<Vec2> &pattern, double &bestDispl, double &bestEnergy) {
+double ImmaturePoint::disparityPerInvDepth(const SE3 &baseToRef,
+                                           double invDepth) const {
+  // The point is on the ray R d + invDepth * t, up to scale, so t is the
+  // derivative of the ray by the inverse depth.
+  Vec3 ray = baseToRef.so3() * pattern().directions[0] +
+             invDepth * baseToRef.translation();
+  return (cam->diffMap(ray).second * baseToRef.translation()).norm();
+}
+
+// The update of Vogiatzis and Hernandez, as in SVO.
+bool ImmaturePoint::updateDepthFilter(double invDepth, double variance) {
+  if (filterVar == INF) {
+    filterMean = invDepth;
+    filterVar = variance;
+    return true;
+  }
+
+  const double range = 1 / settings->depth.min;
+  double normScale = std::sqrt(filterVar + variance);
+  double z = (invDepth - filterMean) / normScale;
+  double gauss = std::exp(-0.5 * z * z) / (normScale * std::sqrt(2 * M_PI));
+  double c1 = filterA / (filterA + filterB) * gauss;
+  double c2 = filterB / (filterA + filterB) / range;
+  double norm = c1 + c2;
+  c1 /= norm;
+  c2 /= norm;
+
+  double abSum = filterA + filterB;
+  double f =
+      c1 * (filterA + 1) / (abSum + 1) + c2 * filterA / (abSum + 1);
+  double e = c1 * (filterA + 1) * (filterA + 2) / ((abSum + 1) * (abSum + 2)) +
+             c2 * filterA * (filterA + 1) / ((abSum + 1) * (abSum + 2));
+
+  double s2 = 1 / (1 / filterVar + 1 / variance);
+  double m = s2 * (filterMean / filterVar + invDepth / variance);
+  double newMean = c1 * m + c2 * filterMean;
+  filterVar = c1 * (s2 + m * m) + c2 * (filterVar + filterMean * filterMean) -
+              newMean * newMean;
+  filterMean = newMean;
+  filterA = (e - f) / (f - e / f);
+  filterB = filterA * (1 - f) / f;
+
+  if (filterA / (filterA + filterB) < settings->pointTracer.minInlierRatio) {
+    state = OUTLIER;
+    return false;
+  }
+  return true;
+}
+
+bool ImmaturePoint::isFilterConverged() const {
+  return filterVar != INF &&
+         std::sqrt(filterVar) < settings->pointTracer.convergedRel * filterMean;
+}
+
+template <int N> int ImmaturePoint::patternSize() const {
+  if constexpr (N > 0)
+    return N;
+  else
+    return PS;
+}
+
+template <int N>
+Vec2 ImmaturePoint::tracePrecise(const ImageSampler &refFrame,
+                                 const Vec2 &from, const Vec2 &to,
+                                 const double *intencities,
+                                 const Vec2 *pattern, double &bestDispl,
+                                 double &bestEnergy) {
+  const int ps = patternSize<N>();
   Vec2 dir = to - from;
   dir.normalize();
   Vec2 bestPoint = (from + to) * 0.5;
   bestEnergy = INF;
   bestDispl = 0;
   double step = 0;
-  for (int it = 0; it < settings.pointTracer.gnIter + 1; ++it) {
+  for (int it = 0; it < settings->pointTracer.gnIter + 1; ++it) {
     double newEnergy = 0;
     double H = 0, b = 0;
     Vec2 curPoint = bestPoint + step * dir;
-    for (int i = 0; i < PS; ++i) {
+    for (int i = 0; i < ps; ++i) {
       double intencity;
       Vec2 p = curPoint + pattern[i];
       Vec2 grad;
-      refFrame.Evaluate(p[1], p[0], &intencity, &grad[1], &grad[0]);
+      refFrame.evaluate(p[1], p[0], &intencity, &grad[1], &grad[0]);
       double r = intencity - intencities[i];
       double ar = std::abs(r);
       double wb = ar > TH ? TH / ar : 1;
       newEnergy += wb * (2 - wb) * ar * ar;
       double dr = grad.dot(dir);
       b += wb * r * dr;
-      if (settings.pointTracer.useAltHWeighting) {
+      if (settings->pointTracer.useAltHWeighting) {
         double wh = wb / (2 - wb);
         H += wh * dr * dr;
       } else
@@ -196,14 +328,17 @@ Vec2 ImmaturePoint::tracePrecise(
   return bestPoint;
 }
 
+template <int N>
 double ImmaturePoint::estVariance(const Vec2 &searchDirection) {
+  const int ps = patternSize<N>();
+  const auto &gradNorms = blockOf<N>().gradNorms[slot];
   double sum1 = 0;
-  for (const Vec2 &gN : baseGradNorm) {
-    double s = gN.dot(searchDirection);
+  for (int i = 0; i < ps; ++i) {
+    double s = gradNorms[i].cast<double>().dot(searchDirection);
     sum1 += s * s;
   }
 
-  lastGeomVar = PS * settings.pointTracer.positionVariance / sum1;
+  lastGeomVar = ps * settings->pointTracer.positionVariance / sum1;
   lastFullVar = lastGeomVar;
   return lastFullVar;
 }
@@ -211,42 +346,95 @@ double ImmaturePoint::estVariance(const Vec2 &searchDirection) {
 ImmaturePoint::TracingStatus
 ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
                        TracingDebugType debugType) {
+  return traceOn(TracingContext(baseFrame, refFrame), debugType);
+}
+
+ImmaturePoint::TracingStatus
+ImmaturePoint::traceOn(const TracingContext &context,
+                       TracingDebugType debugType) {
+  PROFILE_SCOPE("tracing.point");
   if (state == OOB)
     return WAS_OOB;
 
-  AffineLightTransform<double> lightBaseToRef =
-      refFrame.lightBaseToThis * refFrame.baseKeyFrame->lightWorldToThis *
-      baseFrame.lightWorldToThis.inverse();
-  SE3 baseToRef = refFrame.baseToThis *
-                  refFrame.baseKeyFrame->thisToWorld.inverse() *
-                  baseFrame.thisToWorld;
+  return dispatchPatternSize(PS, [&](auto n) {
+    return traceOnPattern<decltype(n)::value>(context, debugType);
+  });
+}
+
+template <int N>
+ImmaturePoint::TracingStatus
+ImmaturePoint::traceOnPattern(const TracingContext &context,
+                              TracingDebugType debugType) {
+  const KeyFrame &baseFrame = context.baseFrame;
+  const PreKeyFrame &refFrame = context.refFrame;
+  const SE3 &baseToRef = context.baseToRef;
+  const int ps = patternSize<N>();
+  const bool useFilter = settings->pointTracer.useDepthFilter;
+  const ImmaturePointBlock<N> &pointBlock = blockOf<N>();
+  const auto &baseDirections = pointBlock.directions[slot];
+  const auto &baseIntencities = pointBlock.intencities[slot];
+
+  if (useFilter) {
+    if (state == OUTLIER)
+      return LOW_QUALITY;
+    if (isFilterConverged())
+      return CONVERGED;
+  }
+
+  AffineLightTransform<double> lightBaseToRef = context.lightBaseToRef;
 
-  Vec3 dirMin = (baseToRef * (minDepth * baseDirections[0])).normalized();
+  Vec3 dirMin = minDepth == 0
+                    ? context.epipole
+                    : (baseToRef * (minDepth * baseDirections[0])).normalized();
   Vec3 dirMax = maxDepth == INF
                     ? baseToRef.so3() * baseDirections[0]
                     : (baseToRef * (maxDepth * baseDirections[0])).normalized();
-  Mat23 jacobian = cam->diffMap(dirMax).second;
+  auto [startPoint, jacobian] = cam->diffMap(dirMax);
+  // unless the whole curve is searched, the search starts from the far end,
+  // so the point is dropped right away if that is off the image
+  if (!settings->pointTracer.performFullTracing &&
+      !cam->isOnImage(startPoint, PH))
+    return EPIPOLAR_OOB;
   Vec2 searchDirection = jacobian * (dirMin - dirMax);
   searchDirection.normalize();
 
-  double variance = estVariance(searchDirection);
+  double variance = estVariance<N>(searchDirection);
   double curDev = std::sqrt(variance);
 
-  if (!settings.pointTracer.performFullTracing && numTraced > 0)
-    if (curDev * settings.pointTracer.imprFactor > stddev)
+  if (useFilter) {
+    // also rejects the frames the point is unobservable from, with no
+    // disparity along the epipolar curve
+    if (filterVar != INF) {
+      double predictedDev =
+          curDev / disparityPerInvDepth(baseToRef, filterMean);
+      if (!(predictedDev * settings->pointTracer.imprFactor <=
+            std::sqrt(filterVar)))
+        return BIG_PREDICTED_ERROR;
+    }
+  } else if (!settings->pointTracer.performFullTracing && numTraced > 0)
+    if (curDev * settings->pointTracer.imprFactor > stddev)
       return BIG_PREDICTED_ERROR;
 
-  StdVector<Vec2> points;
-  std::vector<Vec3> directions;
-  if (!pointsToTrace(baseToRef, dirMin, dirMax, points, directions)) {
+  TracingWorkspace &workspace = tracingWorkspace();
+  WorkspaceGrowthCounter growthCounter(workspace);
+  StdVector<Vec2> &points = workspace.points;
+  std::vector<Vec3> &directions = workspace.directions;
+  if (!pointsToTrace(dirMin, dirMax, points, directions)) {
     return EPIPOLAR_OOB;
   }
+  PROFILE_HIST("tracing.epipolarSteps", directions.size(), 0, 200, 20);
+
+  // fixed-size scratch arrays, as this runs for every point on every frame
+  double intencities[MPS];
+  float intencitiesF[MPS];
+  for (int i = 0; i < ps; ++i) {
+    intencities[i] = lightBaseToRef(double(baseIntencities[i]));
+    intencitiesF[i] = intencities[i];
+  }
+  const float outlierDiffF = TH;
 
-  std::vector<double> intencities(PS);
-  for (int i = 0; i < PS; ++i)
-    intencities[i] = lightBaseToRef(baseIntencities[i]);
-
-  StdVector<std::pair<Vec2, double>> energiesFound;
+  StdVector<std::pair<Vec2, double>> &energiesFound = workspace.energiesFound;
+  energiesFound.clear();
   double bestEnergy = INF;
   Vec2 bestPoint;
   double bestDepth;
@@ -255,30 +443,34 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
   int bestPyrLevel = -1;
   int lastPyrLevel = -1;
 
-  for (int dirInd = 0; dirInd < directions.size(); ++dirInd) {
+  // The energy of the step dirInd of the search, on the pyramid level chosen
+  // by the size of the reprojected pattern and coarsened by levelOffset.
+  // The coarse search samples the nearest pixels.
+  auto stepEnergy = [&](int dirInd, int levelOffset, double &curDepth,
+                        int &pyrLevel) {
     Vec3 curDir = directions[dirInd];
     Vec2 point = points[dirInd];
     curDir.normalize();
-    StdVector<Vec2> reproj(PS);
+    Vec2 reproj[MPS];
     reproj[0] = point;
-    double curDepth = INF;
+    curDepth = INF;
     if (maxDepth == INF && dirInd == 0) {
-      for (int i = 1; i < PS; ++i)
+      for (int i = 1; i < ps; ++i)
         reproj[i] = cam->map(baseToRef.so3() * baseDirections[i]);
     } else {
       Vec2 curDepths = triangulate(baseToRef, baseDirections[0], curDir);
       curDepth = curDepths[0];
-      for (int i = 1; i < PS; ++i)
+      for (int i = 1; i < ps; ++i)
         reproj[i] = cam->map(baseToRef * (curDepths[0] * baseDirections[i]));
     }
 
     double maxReprojDist = -1;
-    for (int i = 1; i < PS; ++i) {
+    for (int i = 1; i < ps; ++i) {
       double dist = (reproj[i] - point).norm();
       if (maxReprojDist < dist)
         maxReprojDist = dist;
     }
-    int pyrLevel = std::round(std::log2(maxReprojDist / PH));
+    pyrLevel = std::round(std::log2(maxReprojDist / PH));
     if (pyrLevel < 0)
       pyrLevel = 0;
     if (pyrLevel >= PL)
@@ -289,27 +481,106 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
 
     lastPyrLevel = pyrLevel;
 
-    for (Vec2 &r : reproj)
-      r /= double(1 << pyrLevel);
-
-    double energy = 0;
-    for (int i = 0; i < PS; ++i) {
-      double refIntencity;
-      refFrame.internals->interpolator(pyrLevel).Evaluate(
-          reproj[i][1], reproj[i][0], &refIntencity);
-      double residual = std::abs(intencities[i] - refIntencity);
-      energy += residual > TH ? TH * (2 * residual - TH) : residual * residual;
+    const int sampledLevel = std::min(pyrLevel + levelOffset, PL - 1);
+    const double pyrScale = 1.0 / (1 << sampledLevel);
+    // the search energy is a per-pixel kernel run for every step along the
+    // epipolar line, so it is done in floats
+    float reprojX[MPS], reprojY[MPS], refIntencities[MPS];
+    for (int i = 0; i < ps; ++i) {
+      reprojX[i] = reproj[i][0] * pyrScale;
+      reprojY[i] = reproj[i][1] * pyrScale;
     }
+    const ImageSampler &refSampler =
+        refFrame.internals->sampler(sampledLevel);
+    ImageSampler::Interpolation interpolation =
+        levelOffset > 0 ? ImageSampler::NEAREST
+                        : settings->pointTracer.searchInterpolationAt(pyrLevel);
+    dispatchInterpolation(interpolation, [&](auto I) {
+      refSampler.evaluateBatch<decltype(I)::value>(ps, reprojY, reprojX,
+                                                   refIntencities);
+    });
+
+    float energy = 0;
+    for (int i = 0; i < ps; ++i) {
+      float residual = std::abs(intencitiesF[i] - refIntencities[i]);
+      energy += residual > outlierDiffF
+                    ? outlierDiffF * (2 * residual - outlierDiffF)
+                    : residual * residual;
+    }
+    return energy;
+  };
 
-    energiesFound.push_back({point, energy});
+  auto searchStep = [&](int dirInd) {
+    double curDepth;
+    int pyrLevel;
+    float energy = stepEnergy(dirInd, 0, curDepth, pyrLevel);
+    energiesFound.push_back({points[dirInd], energy});
 
     if (energy < bestEnergy) {
       bestEnergy = energy;
-      bestPoint = point;
+      bestPoint = points[dirInd];
       bestDepth = curDepth;
       bestInd = dirInd;
       bestPyrLevel = pyrLevel;
     }
+  };
+
+  const int coarseLevels = settings->pointTracer.coarseSearchLevels;
+  const int coarseStride = 1 << std::max(coarseLevels, 0);
+  const int stepNum = directions.size();
+  if (coarseLevels <= 0 || stepNum <= 2 * coarseStride) {
+    for (int dirInd = 0; dirInd < stepNum; ++dirInd)
+      searchStep(dirInd);
+  } else {
+    // First every coarseStride-th step is searched coarseLevels levels
+    // coarser, where the steps are about as far apart as the pixels. Only
+    // the steps around the best local minima of it are then searched as
+    // usual.
+    std::vector<std::pair<float, int>> &coarseEnergies =
+        workspace.coarseEnergies;
+    coarseEnergies.clear();
+    for (int dirInd = 0; dirInd < stepNum; dirInd += coarseStride) {
+      double curDepth;
+      int pyrLevel;
+      coarseEnergies.push_back(
+          {stepEnergy(dirInd, coarseLevels, curDepth, pyrLevel), dirInd});
+    }
+
+    // moved to the front, the ones before them are not needed anymore
+    int minimaNum = 0;
+    float prevEnergy = INF;
+    for (int i = 0; i < coarseEnergies.size(); ++i) {
+      std::pair<float, int> cur = coarseEnergies[i];
+      if (cur.first <= prevEnergy && (i + 1 == coarseEnergies.size() ||
+                                      cur.first < coarseEnergies[i + 1].first))
+        coarseEnergies[minimaNum++] = cur;
+      prevEnergy = cur.first;
+    }
+    const int candidateNum =
+        std::min(minimaNum, settings->pointTracer.searchCandidates);
+    std::partial_sort(coarseEnergies.begin(),
+                      coarseEnergies.begin() + candidateNum,
+                      coarseEnergies.begin() + minimaNum);
+
+    // The steps are about a pixel apart, so a single candidate is refined
+    // beyond minSecondBestDistance too, to still have a second best like
+    // the full search does.
+    const int refineRadius =
+        std::max(coarseStride - 1,
+                 int(std::ceil(settings->pointTracer.minSecondBestDistance)) +
+                     1);
+    std::vector<char> &isSearched = workspace.isSearched;
+    isSearched.assign(stepNum, false);
+    for (int c = 0; c < candidateNum; ++c) {
+      int center = coarseEnergies[c].second;
+      for (int dirInd = std::max(0, center - refineRadius);
+           dirInd <= std::min(stepNum - 1, center + refineRadius); ++dirInd)
+        if (!isSearched[dirInd]) {
+          isSearched[dirInd] = true;
+          searchStep(dirInd);
+        }
+    }
+    PROFILE_HIST("tracing.refinedSteps", energiesFound.size(), 0, 200, 20);
   }
 
   lastEnergy = bestEnergy;
@@ -326,7 +597,7 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
   double secondBestEnergy = INF;
   for (const auto &p : energiesFound) {
     if ((p.first - bestPoint).norm() <
-        settings.pointTracer.minSecondBestDistance)
+        settings->pointTracer.minSecondBestDistance)
       continue;
     if (p.second < secondBestEnergy)
       secondBestEnergy = p.second;
@@ -336,19 +607,19 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
     return INF_ENERGY;
 
   double secondBestEnergyThres =
-      settings.pointTracer.secondBestEnergyThresFactor * PS * TH * TH;
+      settings->pointTracer.secondBestEnergyThresFactor * ps * TH * TH;
   if (secondBestEnergy <= secondBestEnergyThres)
     return SMALL_ABS_SECOND_BEST;
 
   double outlierEnergy =
-      settings.pointTracer.outlierEnergyFactor * PS * TH * TH;
+      settings->pointTracer.outlierEnergyFactor * ps * TH * TH;
 
   if (lastEnergy > outlierEnergy)
     return BIG_ENERGY;
 
   double newQuality = secondBestEnergy / bestEnergy;
 
-  if (newQuality < settings.pointTracer.outlierQuality)
+  if (newQuality < settings->pointTracer.outlierQuality)
     return LOW_QUALITY;
 
   if (newQuality > bestQuality)
@@ -362,20 +633,20 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
 
   // subpixel refinement
   double bestDispl = 0;
-  if (settings.pointTracer.gnIter > 0) {
+  if (settings->pointTracer.gnIter > 0) {
     int fromInd = std::max(0, bestInd - 1);
     int toInd = std::min(int(points.size()) - 1, bestInd + 1);
     Vec2 from = points[fromInd];
     Vec2 to = points[toInd];
-    StdVector<Vec2> pattern(PS);
+    Vec2 pattern[MPS];
     double scale = 1.0 / (1 << bestPyrLevel);
     pattern[0] = Vec2::Zero();
-    for (int i = 1; i < PS; ++i) {
+    for (int i = 1; i < ps; ++i) {
       Vec2 reproj = cam->map(baseToRef * (bestDepth * baseDirections[i]));
       pattern[i] = scale * (reproj - points[bestInd]);
     }
     bestPoint =
-        tracePrecise(refFrame.internals->interpolator(bestPyrLevel), from, to,
+        tracePrecise<N>(refFrame.internals->sampler(bestPyrLevel), from, to,
                      intencities, pattern, bestDispl, bestEnergy);
     depth = triangulate(baseToRef, baseDirections[0],
                         cam->unmap(bestPoint / scale))[0];
@@ -384,30 +655,47 @@ ImmaturePoint::traceOn(const KeyFrame &baseFrame, const PreKeyFrame &refFrame,
 
   eAfterSubpixel = bestEnergy;
 
-  double displ = 2 * curDev;
-  // depth bounds
-  Vec2 minDepthPos = approxOnCurve(points, bestInd + displ);
-  minDepth =
-      triangulate(baseToRef, baseDirections[0], cam->unmap(minDepthPos))[0];
-
-  double maxDepthDispl = bestInd - displ;
-  if (maxDepthDispl <= 0)
-    maxDepth = INF;
-  else {
-    Vec2 maxDepthPos = approxOnCurve(points, maxDepthDispl);
-    maxDepth =
-        triangulate(baseToRef, baseDirections[0], cam->unmap(maxDepthPos))[0];
+  if (useFilter) {
+    double invDepth = 1 / depth;
+    double measDev = curDev / disparityPerInvDepth(baseToRef, invDepth);
+    if (!(invDepth > 0) || !std::isfinite(measDev))
+      return INF_DEPTH;
+    if (!updateDepthFilter(invDepth, measDev * measDev))
+      return LOW_QUALITY;
+
+    // the next search is limited to the window around the estimate
+    double filterDev = std::sqrt(filterVar);
+    double window = settings->pointTracer.searchWindowSigmas * filterDev;
+    depth = 1 / filterMean;
+    minDepth = 1 / (filterMean + window);
+    maxDepth = filterMean > window ? 1 / (filterMean - window) : INF;
+    stddev = curDev * filterDev / measDev;
+  } else {
+    double displ = 2 * curDev;
+    // depth bounds
+    Vec2 minDepthPos = approxOnCurve(points, bestInd + displ);
+    minDepth =
+        triangulate(baseToRef, baseDirections[0], cam->unmap(minDepthPos))[0];
+
+    double maxDepthDispl = bestInd - displ;
+    if (maxDepthDispl <= 0)
+      maxDepth = INF;
+    else {
+      Vec2 maxDepthPos = approxOnCurve(points, maxDepthDispl);
+      maxDepth = triangulate(baseToRef, baseDirections[0],
+                             cam->unmap(maxDepthPos))[0];
+    }
+    stddev = curDev;
   }
 
   lastTraced = true;
-  stddev = curDev;
   tracedPyrLevel = bestPyrLevel;
 
   if (state == ACTIVE && debugType == DRAW_EPIPOLE) {
     cv::Mat base;
     cv::Mat curved;
-    base = baseFrame.preKeyFrame->frameColored.clone();
-    curved = refFrame.frameColored.clone();
+    base = baseFrame.preKeyFrame->frameColored().clone();
+    curved = refFrame.frameColored().clone();
 
     cv::circle(base, toCvPoint(p), 4, CV_GREEN, 1);
     drawTracing(curved, energiesFound, 5);
@@ -0,0 +1,53 @@
+#include "system/ImuPreintegrator.h"
+#include <algorithm>
+#include <glog/logging.h>
+
+namespace fishdso {
+
+ImuPreintegrator::ImuPreintegrator(const SE3 &imuToCam, const Vec3 &gyroBias)
+    : imuToCam(imuToCam)
+    , gyroBias(gyroBias) {}
+
+void ImuPreintegrator::addMeasurement(const ImuMeasurement &measurement) {
+  CHECK(measurements.empty() ||
+        measurement.timestamp > measurements.back().timestamp);
+  measurements.push_back(measurement);
+}
+
+void ImuPreintegrator::discardBefore(double time) {
+  // the last sample before time is held up to it, so it stays
+  while (measurements.size() >= 2 && measurements[1].timestamp <= time)
+    measurements.pop_front();
+}
+
+std::optional<ImuDelta> ImuPreintegrator::integrate(double fromTime,
+                                                    double toTime) const {
+  CHECK_LE(fromTime, toTime);
+  if (measurements.empty() || measurements.front().timestamp > fromTime ||
+      measurements.back().timestamp < toTime)
+    return std::nullopt;
+
+  ImuDelta delta;
+  for (int i = 0; i + 1 < measurements.size(); ++i) {
+    double from = std::max(fromTime, measurements[i].timestamp);
+    double to = std::min(toTime, measurements[i + 1].timestamp);
+    if (to <= from)
+      continue;
+
+    double dt = to - from;
+    Vec3 accel = delta.deltaRot * measurements[i].accel;
+    delta.deltaPos += delta.deltaVel * dt + 0.5 * accel * dt * dt;
+    delta.deltaVel += accel * dt;
+    delta.deltaRot *= SO3::exp((measurements[i].gyro - gyroBias) * dt);
+  }
+  delta.dt = toTime - fromTime;
+
+  return delta;
+}
+
+SO3 ImuPreintegrator::camRotation(const ImuDelta &delta) const {
+  const SO3 &imuToCamRot = imuToCam.so3();
+  return imuToCamRot * delta.deltaRot.inverse() * imuToCamRot.inverse();
+}
+
+} // namespace fishdso
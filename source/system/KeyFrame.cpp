@@ -1,11 +1,29 @@
 #include "system/KeyFrame.h"
+#include "util/Profiler.h"
+#include "util/Scheduler.h"
 #include "util/defs.h"
 #include "util/settings.h"
 #include "util/util.h"
+#include <glog/logging.h>
 #include <opencv2/opencv.hpp>
+#include <tbb/parallel_for.h>
 
 namespace fishdso {
 
+namespace {
+
+const std::vector<Vec2i> *validSpansOf(const PreKeyFrame &preKeyFrame) {
+  const CameraModel *cam = preKeyFrame.cam;
+  return cam->hasInvalidPixels() ? &cam->getValidSpans() : nullptr;
+}
+
+const cv::Mat1b *staticMaskOf(const PreKeyFrame &preKeyFrame) {
+  const CameraModel *cam = preKeyFrame.cam;
+  return cam->hasStaticMask() ? &cam->getStaticMask() : nullptr;
+}
+
+} // namespace
+
 KeyFrame::KeyFrame(CameraModel *cam, const cv::Mat &frameColored,
                    int globalFrameNum, PixelSelector &pixelSelector,
                    const Settings::KeyFrame &_kfSettings,
@@ -17,15 +35,33 @@ KeyFrame::KeyFrame(CameraModel *cam, const cv::Mat &frameColored,
     , optimizedPoints(reservedVector<std::unique_ptr<OptimizedPoint>>(
           _kfSettings.pointsNum))
     , kfSettings(_kfSettings)
-    , tracingSettings(tracingSettings) {
+    , tracingSettings(std::make_shared<PointTracerSettings>(tracingSettings))
+    , immaturePointBlock(ImmaturePointBlockBase::create(
+          this->tracingSettings->residualPattern.pattern().size()))
+    , imageTiles(new BicubicTiles(preKeyFrame->frame())) {
   std::vector<cv::Point> points = pixelSelector.select(
-      frameColored, preKeyFrame->gradNorm, kfSettings.pointsNum, nullptr);
+      preKeyFrame->frame(), preKeyFrame->gradNormImage(),
+      kfSettings.pointsNum, nullptr, validSpansOf(*preKeyFrame),
+      staticMaskOf(*preKeyFrame));
   addImmatures(points);
 }
 
 KeyFrame::KeyFrame(std::shared_ptr<PreKeyFrame> newPreKeyFrame,
                    const Settings::KeyFrame &_kfSettings,
                    const PointTracerSettings &tracingSettings)
+    : KeyFrame(newPreKeyFrame, _kfSettings,
+               std::make_shared<const PointTracerSettings>(tracingSettings)) {}
+
+KeyFrame::KeyFrame(std::shared_ptr<PreKeyFrame> newPreKeyFrame,
+                   PixelSelector &pixelSelector,
+                   const Settings::KeyFrame &_kfSettings,
+                   const PointTracerSettings &tracingSettings)
+    : KeyFrame(newPreKeyFrame, pixelSelector, _kfSettings,
+               std::make_shared<const PointTracerSettings>(tracingSettings)) {}
+
+KeyFrame::KeyFrame(std::shared_ptr<PreKeyFrame> newPreKeyFrame,
+                   const Settings::KeyFrame &_kfSettings,
+                   std::shared_ptr<const PointTracerSettings> tracingSettings)
     : preKeyFrame(newPreKeyFrame)
     , lightWorldToThis(preKeyFrame->baseKeyFrame
                            ? preKeyFrame->lightBaseToThis *
@@ -40,31 +76,53 @@ KeyFrame::KeyFrame(std::shared_ptr<PreKeyFrame> newPreKeyFrame,
     , optimizedPoints(reservedVector<std::unique_ptr<OptimizedPoint>>(
           _kfSettings.pointsNum))
     , kfSettings(_kfSettings)
-    , tracingSettings(tracingSettings) {}
+    , tracingSettings(std::move(tracingSettings))
+    , imageTiles(new BicubicTiles(preKeyFrame->frame())) {
+  CHECK(this->tracingSettings);
+  immaturePointBlock = ImmaturePointBlockBase::create(
+      this->tracingSettings->residualPattern.pattern().size());
+}
 
 KeyFrame::KeyFrame(std::shared_ptr<PreKeyFrame> newPreKeyFrame,
                    PixelSelector &pixelSelector,
                    const Settings::KeyFrame &_kfSettings,
-                   const PointTracerSettings &tracingSettings)
-    : KeyFrame(newPreKeyFrame, _kfSettings, tracingSettings) {
+                   std::shared_ptr<const PointTracerSettings> tracingSettings)
+    : KeyFrame(newPreKeyFrame, _kfSettings, std::move(tracingSettings)) {
   std::vector<cv::Point> points =
-      pixelSelector.select(newPreKeyFrame->frameColored, preKeyFrame->gradNorm,
-                           kfSettings.pointsNum, nullptr);
+      pixelSelector.select(newPreKeyFrame->frame(),
+                           preKeyFrame->gradNormImage(),
+                           kfSettings.pointsNum, nullptr,
+                           validSpansOf(*preKeyFrame),
+                           staticMaskOf(*preKeyFrame));
   addImmatures(points);
 }
 
 void KeyFrame::addImmatures(const std::vector<cv::Point> &points) {
-  immaturePoints.reserve(immaturePoints.size() + points.size());
-  for (const cv::Point &p : points)
-    immaturePoints.push_back(std::unique_ptr<ImmaturePoint>(
-        new ImmaturePoint(this, toVec2(p), tracingSettings)));
+  PROFILE_SCOPE("keyFrame.addImmatures");
+  // Each point samples the frame and unmaps the rays of its pattern, which
+  // for the whole keyframe is on the way of the bundle adjustment.
+  const int oldSize = immaturePoints.size();
+  const int firstSlot = immaturePointBlock->size();
+  immaturePoints.resize(oldSize + points.size());
+  immaturePointBlock->resize(firstSlot + points.size());
+  ParallelExecutor(tracingSettings->threading, Scheduler::MAPPING)
+      .execute([&]() {
+        tbb::parallel_for(0, int(points.size()), [&](int i) {
+          immaturePoints[oldSize + i].reset(
+              new ImmaturePoint(this, toVec2(points[i]), firstSlot + i));
+        });
+      });
 }
 
 void KeyFrame::selectPointsDenser(PixelSelector &pixelSelector,
                                   int pointsNeeded) {
-  std::vector<cv::Point> points = pixelSelector.select(
-      preKeyFrame->frameColored, preKeyFrame->gradNorm, pointsNeeded, nullptr);
+  std::vector<cv::Point> points =
+      pixelSelector.select(preKeyFrame->frame(),
+                           preKeyFrame->gradNormImage(), pointsNeeded,
+                           nullptr, validSpansOf(*preKeyFrame),
+                           staticMaskOf(*preKeyFrame));
   immaturePoints.clear();
+  immaturePointBlock->resize(0);
   optimizedPoints.clear();
   addImmatures(points);
 }
@@ -74,20 +132,29 @@ void KeyFrame::activateAllImmature() {
     optimizedPoints.push_back(
         std::unique_ptr<OptimizedPoint>(new OptimizedPoint(*ip)));
   immaturePoints.clear();
+  immaturePointBlock->resize(0);
 }
 
 void KeyFrame::deactivateAllOptimized() {
-  for (const auto &op : optimizedPoints) {
-    std::unique_ptr<ImmaturePoint> ip(
-        new ImmaturePoint(this, op->p, tracingSettings));
-    ip->depth = op->depth();
-    immaturePoints.push_back(std::move(ip));
-  }
+  const int oldSize = immaturePoints.size();
+  const int firstSlot = immaturePointBlock->size();
+  immaturePoints.resize(oldSize + optimizedPoints.size());
+  immaturePointBlock->resize(firstSlot + optimizedPoints.size());
+  ParallelExecutor(tracingSettings->threading, Scheduler::MAPPING)
+      .execute([&]() {
+        tbb::parallel_for(0, int(optimizedPoints.size()), [&](int i) {
+          const OptimizedPoint &op = *optimizedPoints[i];
+          std::unique_ptr<ImmaturePoint> ip(
+              new ImmaturePoint(this, op.p, firstSlot + i));
+          ip->depth = op.depth();
+          immaturePoints[oldSize + i] = std::move(ip);
+        });
+      });
   optimizedPoints.clear();
 }
 
 cv::Mat3b KeyFrame::drawDepthedFrame(double minDepth, double maxDepth) const {
-  cv::Mat res = preKeyFrame->frameColored.clone();
+  cv::Mat res = preKeyFrame->frameColored().clone();
 
   for (const auto &ip : immaturePoints)
     if (ip->state == ImmaturePoint::ACTIVE && ip->maxDepth != INF)
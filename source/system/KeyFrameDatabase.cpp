@@ -0,0 +1,78 @@
+#include "system/KeyFrameDatabase.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <opencv2/imgproc.hpp>
+
+namespace fishdso {
+
+KeyFrameDatabase::KeyFrameDatabase(const Settings::KeyFrameDatabase &settings)
+    : settings(settings) {}
+
+std::vector<float> KeyFrameDatabase::thumbnail(const cv::Mat1b &image) const {
+  cv::Mat1b small;
+  cv::resize(image, small,
+             cv::Size(settings.thumbnailWidth, settings.thumbnailHeight), 0, 0,
+             cv::INTER_AREA);
+
+  std::vector<float> result(small.begin(), small.end());
+  float mean = std::accumulate(result.begin(), result.end(), 0.0f) /
+               std::max(int(result.size()), 1);
+  for (float &v : result)
+    v -= mean;
+  float norm = std::sqrt(
+      std::inner_product(result.begin(), result.end(), result.begin(), 0.0f));
+  // a flat image is not similar to anything
+  if (norm > 0)
+    for (float &v : result)
+      v /= norm;
+  return result;
+}
+
+std::shared_ptr<const KeyFrameDatabase::Entry>
+KeyFrameDatabase::add(int globalFrameNum, const SE3 &thisToWorld,
+                      const DepthedImagePyramid &trackingBase) {
+  std::shared_ptr<const Entry> entry(new Entry{
+      globalFrameNum, thisToWorld, thumbnail(trackingBase.images[0]),
+      trackingBase});
+
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.push_back(entry);
+  while (int(entries.size()) > std::max(settings.maxEntries, 0))
+    entries.pop_front();
+  return entry;
+}
+
+std::vector<std::shared_ptr<const KeyFrameDatabase::Entry>>
+KeyFrameDatabase::query(const cv::Mat1b &image, int maxGlobalFrameNum) const {
+  std::vector<float> queried = thumbnail(image);
+
+  std::vector<std::pair<float, std::shared_ptr<const Entry>>> scored;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    scored.reserve(entries.size());
+    for (const auto &entry : entries)
+      if (entry->globalFrameNum <= maxGlobalFrameNum)
+          scored.push_back({std::inner_product(queried.begin(), queried.end(),
+                                             entry->thumbnail.begin(), 0.0f),
+                          entry});
+  }
+
+  int resultNum = std::min(settings.candidateNum, int(scored.size()));
+  std::partial_sort(
+      scored.begin(), scored.begin() + resultNum, scored.end(),
+      [](const auto &a, const auto &b) { return a.first > b.first; });
+
+  std::vector<std::shared_ptr<const Entry>> result;
+  result.reserve(resultNum);
+  for (int i = 0; i < resultNum; ++i)
+    result.push_back(scored[i].second);
+  return result;
+}
+
+int KeyFrameDatabase::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return entries.size();
+}
+
+} // namespace fishdso
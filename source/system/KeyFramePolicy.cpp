@@ -0,0 +1,26 @@
+#include "system/KeyFramePolicy.h"
+#include <cmath>
+
+namespace fishdso {
+
+KeyFramePolicy::KeyFramePolicy(int imageWidth, int imageHeight,
+                               const Settings::KeyFramePolicy &settings)
+    : imageSize(imageWidth + imageHeight)
+    , settings(settings) {}
+
+double KeyFramePolicy::score(const KeyFrameCues &cues) const {
+  return cues.flow / (settings.maxFlow * imageSize) +
+         cues.translationFlow / (settings.maxTranslationFlow * imageSize) +
+         cues.lightChange / settings.maxLightChange;
+}
+
+bool KeyFramePolicy::needKeyFrame(const KeyFrameCues &cues) const {
+  if (cues.framesSinceKeyFrame < settings.minFramesBetweenKeyFrames)
+    return false;
+  if (cues.framesSinceKeyFrame >= settings.maxFramesBetweenKeyFrames)
+    return true;
+  return score(cues) > 1 || cues.visibleRatio < settings.minVisibleRatio ||
+         cues.rmseRatio > settings.maxRmseRatio;
+}
+
+} // namespace fishdso
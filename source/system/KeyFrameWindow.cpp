@@ -0,0 +1,63 @@
+#include "system/KeyFrameWindow.h"
+#include <glog/logging.h>
+
+namespace fishdso {
+
+KeyFrameWindow::KeyFrameWindow(int capacity)
+    : slots(capacity) {
+  CHECK_GT(capacity, 0);
+  order.reserve(capacity);
+}
+
+template <typename PointPtrT>
+void reuseStorage(std::vector<PointPtrT> &points,
+                  std::vector<PointPtrT> &spare) {
+  if (spare.capacity() <= points.capacity())
+    return;
+  spare.insert(spare.end(), std::make_move_iterator(points.begin()),
+               std::make_move_iterator(points.end()));
+  points.clear();
+  points.swap(spare);
+}
+
+KeyFrame &KeyFrameWindow::pushBack(KeyFrame &&keyFrame) {
+  CHECK_LT(size(), capacity()) << "the keyframe window is full";
+  int num = keyFrame.preKeyFrame->globalFrameNum;
+  if (!empty())
+    CHECK_GT(num, (*this)[size() - 1].first);
+
+  int free = 0;
+  while (slots[free])
+    free++;
+  std::optional<value_type> &slot = slots[free];
+  slot.emplace(num, std::move(keyFrame));
+  order.push_back(free);
+
+  KeyFrame &added = slot->second;
+  reuseStorage(added.immaturePoints, spareImmaturePoints);
+  reuseStorage(added.optimizedPoints, spareOptimizedPoints);
+  return added;
+}
+
+void KeyFrameWindow::erase(int i) {
+  CHECK(i >= 0 && i < size());
+  std::optional<value_type> &slot = slots[order[i]];
+  KeyFrame &erased = slot->second;
+  erased.immaturePoints.clear();
+  erased.optimizedPoints.clear();
+  if (erased.immaturePoints.capacity() > spareImmaturePoints.capacity())
+    spareImmaturePoints.swap(erased.immaturePoints);
+  if (erased.optimizedPoints.capacity() > spareOptimizedPoints.capacity())
+    spareOptimizedPoints.swap(erased.optimizedPoints);
+  slot.reset();
+  order.erase(order.begin() + i);
+}
+
+bool KeyFrameWindow::contains(const KeyFrame *keyFrame, int num) const {
+  for (const auto &[kfNum, kf] : *this)
+    if (&kf == keyFrame)
+      return kfNum == num;
+  return false;
+}
+
+} // namespace fishdso
@@ -0,0 +1,279 @@
+#include "system/LoopCloser.h"
+#include "system/FrameTracker.h"
+#include "system/PreKeyFrame.h"
+#include "util/Log.h"
+#include "util/Profiler.h"
+#include "util/defs.h"
+#include <ceres/autodiff_cost_function.h>
+#include <ceres/local_parameterization.h>
+#include <ceres/problem.h>
+#include <ceres/solver.h>
+#include <cmath>
+#include <glog/logging.h>
+
+namespace fishdso {
+
+namespace {
+
+// The residual of an edge: the rotation vector of measured^-1 * iToJ,
+// approximated by twice the vector part of the quaternion, then the
+// difference of the translations and of the log-scales.
+struct PoseGraphResidual {
+  PoseGraphResidual(const Sim3 &measured)
+      : rot(measured.rxso3().quaternion().normalized())
+      , trans(measured.translation())
+      , logScale(std::log(measured.scale())) {}
+
+  template <typename T>
+  bool operator()(const T *const rotIP, const T *const transIP,
+                  const T *const logScaleIP, const T *const rotJP,
+                  const T *const transJP, const T *const logScaleJP,
+                  T *res) const {
+    typedef Eigen::Matrix<T, 3, 1> Vec3t;
+    typedef Eigen::Quaternion<T> Quatt;
+    using std::exp;
+
+    Eigen::Map<const Quatt> rotI(rotIP), rotJ(rotJP);
+    Eigen::Map<const Vec3t> transI(transIP), transJ(transJP);
+
+    Quatt rotIToJ = rotJ * rotI.conjugate();
+    T scaleIToJ = exp(logScaleJP[0] - logScaleIP[0]);
+    Vec3t transIToJ = transJ - scaleIToJ * (rotIToJ * transI);
+
+    Quatt rotDiff = rot.cast<T>().conjugate() * rotIToJ;
+    // q and -q are the same rotation
+    T sign = rotDiff.w() < T(0) ? T(-1) : T(1);
+    for (int k = 0; k < 3; ++k) {
+      res[k] = T(2) * sign * rotDiff.vec()[k];
+      res[3 + k] = transIToJ[k] - T(trans[k]);
+    }
+    res[6] = logScaleJP[0] - logScaleIP[0] - T(logScale);
+
+    return true;
+  }
+
+  Quaternion rot;
+  Vec3 trans;
+  double logScale;
+};
+
+Sim3 toSim3(const SE3 &pose) {
+  return Sim3(Sophus::RxSO3d(1.0, pose.so3()), pose.translation());
+}
+
+} // namespace
+
+LoopCloser::LoopCloser(CameraModel *cam, const KeyFrameDatabase *database,
+                       Callback onLoopClosed, const Settings &settings)
+    : cam(cam)
+    , camPyr(cam->camPyr(settings.pyramid.levelNum))
+    , database(database)
+    , onLoopClosed(onLoopClosed)
+    , settings(settings) {
+  worker = std::thread(&LoopCloser::workerLoop, this);
+}
+
+LoopCloser::~LoopCloser() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    doStop = true;
+  }
+  cv.notify_all();
+  worker.join();
+}
+
+void LoopCloser::addKeyFrame(
+    std::shared_ptr<const KeyFrameDatabase::Entry> entry) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(std::move(entry));
+  }
+  cv.notify_all();
+}
+
+void LoopCloser::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [this]() { return queue.empty() && !isBusy; });
+}
+
+int LoopCloser::loopNum() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return loops;
+}
+
+void LoopCloser::workerLoop() {
+  while (true) {
+    std::shared_ptr<const KeyFrameDatabase::Entry> entry;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this]() { return doStop || !queue.empty(); });
+      // the queue is drained before stopping
+      if (queue.empty())
+        return;
+      entry = std::move(queue.front());
+      queue.pop_front();
+      isBusy = true;
+    }
+
+    process(*entry);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      isBusy = false;
+    }
+    cv.notify_all();
+  }
+}
+
+LoopCloser::Node LoopCloser::Node::fromPose(int globalFrameNum,
+                                            const Sim3 &worldToThis) {
+  return {globalFrameNum, worldToThis.rxso3().quaternion().normalized(),
+          worldToThis.translation(), std::log(worldToThis.scale())};
+}
+
+Sim3 LoopCloser::Node::pose() const {
+  return Sim3(Sophus::RxSO3d(std::exp(logScale), SO3(rot)), trans);
+}
+
+void LoopCloser::process(const KeyFrameDatabase::Entry &entry) {
+  PROFILE_SCOPE("loop.process");
+  Sim3 worldToThis = toSim3(entry.thisToWorld.inverse());
+  if (!nodes.empty()) {
+    // the odometry edge is the motion as it was estimated
+    Sim3 worldToPrev = nodes.back().pose() * correctedToLive.inverse();
+    edges.push_back({int(nodes.size()) - 1, int(nodes.size()),
+                     worldToThis * worldToPrev.inverse()});
+  }
+  nodes.push_back(
+      Node::fromPose(entry.globalFrameNum, worldToThis * correctedToLive));
+  nodeIndex[entry.globalFrameNum] = nodes.size() - 1;
+
+  int maxCandidateNum = entry.globalFrameNum - settings.loopClosure.minFrameGap;
+  bool isLoopFound = false;
+  for (const auto &candidate : database->query(entry.trackingBase.images[0],
+                                               maxCandidateNum)) {
+    auto nodeIt = nodeIndex.find(candidate->globalFrameNum);
+    if (nodeIt == nodeIndex.end())
+      continue;
+    std::optional<Sim3> candidateToThis = verify(*candidate, entry);
+    if (!candidateToThis)
+      continue;
+
+    DSO_LOG(LOOP, 0) << "loop between keyframes #" << candidate->globalFrameNum
+                     << " and #" << entry.globalFrameNum;
+    edges.push_back({nodeIt->second, int(nodes.size()) - 1, *candidateToThis});
+    isLoopFound = true;
+  }
+
+  if (!isLoopFound)
+    return;
+
+  optimize(nodes, edges, settings.loopClosure);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++loops;
+  }
+
+  correctedToLive = worldToThis.inverse() * nodes.back().pose();
+  StdMap<int, Sim3> corrected;
+  for (const Node &node : nodes)
+    corrected[node.globalFrameNum] = node.pose();
+  if (onLoopClosed)
+    onLoopClosed(corrected);
+}
+
+std::optional<Sim3>
+LoopCloser::verify(const KeyFrameDatabase::Entry &candidate,
+                   const KeyFrameDatabase::Entry &entry) const {
+  PROFILE_SCOPE("loop.verify");
+  FrameTrackerSettings trackerSettings = settings.getFrameTrackerSettings();
+
+  // tracks the image of "to" against the depths of "from", the translation
+  // comes in the scale of "from"
+  auto track = [&](const KeyFrameDatabase::Entry &from,
+                   const KeyFrameDatabase::Entry &to, double *rmse) {
+    SourceFrame frame;
+    frame.gray = to.trackingBase.images[0];
+    frame.globalFrameNum = to.globalFrameNum;
+    PreKeyFrame tracked(nullptr, cam, frame, settings.pyramid);
+    std::unique_ptr<DepthedImagePyramid> base(
+        new DepthedImagePyramid(from.trackingBase));
+    FrameTracker tracker(camPyr, std::move(base), {}, trackerSettings);
+    return tracker.trackFrameQuiet(tracked, SE3(), AffLight(), 0, rmse).first;
+  };
+
+  double rmseForth = INF, rmseBack = INF;
+  SE3 candidateToThis = track(candidate, entry, &rmseForth);
+  if (!(rmseForth <= settings.loopClosure.maxRmse))
+    return std::nullopt;
+  SE3 thisToCandidate = track(entry, candidate, &rmseBack);
+  if (!(rmseBack <= settings.loopClosure.maxRmse))
+    return std::nullopt;
+
+  return combineMotions(candidateToThis, thisToCandidate,
+                        settings.loopClosure);
+}
+
+std::optional<Sim3>
+LoopCloser::combineMotions(const SE3 &candidateToThis,
+                           const SE3 &thisToCandidate,
+                           const Settings::LoopClosure &settings) {
+  // Both motions are the same one in different scales, so the rotations
+  // should be inverse to each other. A ratio of the translations of two
+  // unrelated motions would give a scale all the same.
+  double rotationDisagreement =
+      (candidateToThis.so3() * thisToCandidate.so3()).log().norm();
+  if (rotationDisagreement > settings.maxRotationDisagreement) {
+    DSO_LOG(LOOP, 1) << "rotations of the loop disagree by "
+                     << rotationDisagreement;
+    return std::nullopt;
+  }
+
+  // The scale of the candidate is the one the loop is measured in, and
+  // thisToCandidate is in the scale of this keyframe.
+  double scale = 1;
+  double forth = candidateToThis.translation().norm();
+  double back = thisToCandidate.translation().norm();
+  if (forth > settings.minScaleBaseline && back > settings.minScaleBaseline)
+    scale = back / forth;
+
+  return Sim3(Sophus::RxSO3d(scale, candidateToThis.so3()),
+              scale * candidateToThis.translation());
+}
+
+void LoopCloser::optimize(StdVector<Node> &nodes, const StdVector<Edge> &edges,
+                          const Settings::LoopClosure &settings) {
+  PROFILE_SCOPE("loop.optimize");
+  ceres::Problem problem;
+  for (Node &node : nodes) {
+    problem.AddParameterBlock(node.rot.coeffs().data(), 4,
+                              new ceres::EigenQuaternionParameterization());
+    problem.AddParameterBlock(node.trans.data(), 3);
+    problem.AddParameterBlock(&node.logScale, 1);
+  }
+  // the gauge freedom of Sim3 is fixed with the first keyframe
+  problem.SetParameterBlockConstant(nodes[0].rot.coeffs().data());
+  problem.SetParameterBlockConstant(nodes[0].trans.data());
+  problem.SetParameterBlockConstant(&nodes[0].logScale);
+
+  for (const Edge &edge : edges) {
+    Node &nodeI = nodes[edge.i], &nodeJ = nodes[edge.j];
+    problem.AddResidualBlock(
+        new ceres::AutoDiffCostFunction<PoseGraphResidual, 7, 4, 3, 1, 4, 3,
+                                        1>(new PoseGraphResidual(edge.iToJ)),
+        new ceres::HuberLoss(settings.outlierResidual),
+        nodeI.rot.coeffs().data(), nodeI.trans.data(), &nodeI.logScale,
+        nodeJ.rot.coeffs().data(), nodeJ.trans.data(), &nodeJ.logScale);
+  }
+
+  ceres::Solver::Options options;
+  options.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
+  options.max_num_iterations = settings.maxIterations;
+  options.max_solver_time_in_seconds = settings.maxSeconds;
+  ceres::Solver::Summary summary;
+  ceres::Solve(options, &problem, &summary);
+  DSO_LOG(LOOP, 1) << "pose graph of " << nodes.size() << " keyframes: "
+                   << summary.BriefReport();
+}
+
+} // namespace fishdso
@@ -0,0 +1,200 @@
+#include "system/MapLocalizer.h"
+#include "util/Log.h"
+#include "util/Profiler.h"
+#include "util/Scheduler.h"
+#include <algorithm>
+#include <glog/logging.h>
+#include <limits>
+#include <tbb/parallel_for.h>
+#include <tuple>
+
+namespace fishdso {
+
+namespace {
+
+Settings::KeyFrameDatabase holdingAll(Settings::KeyFrameDatabase settings) {
+  settings.maxEntries = std::numeric_limits<int>::max();
+  return settings;
+}
+
+} // namespace
+
+MapLocalizer::MapLocalizer(const SnapshotLoader &snapshotLoader,
+                           const Settings &settings)
+    : cam(snapshotLoader.getCam())
+    , camPyr(cam->camPyr(settings.pyramid.levelNum))
+    , settings(settings)
+    , trackerSettings(std::make_shared<const FrameTrackerSettings>(
+          settings.getFrameTrackerSettings()))
+    , database(holdingAll(settings.keyFrameDatabase))
+    , meanNeighbourDistance(0)
+    , lastRmse(INF) {
+  StdMap<int, KeyFrame> loadedKeyFrames;
+  snapshotLoader.load(loadedKeyFrames);
+  CHECK(!loadedKeyFrames.empty()) << "the map is empty";
+
+  // only the images and the depths are kept, the keyframes themselves with
+  // their points go away
+  for (auto &[num, keyFrame] : loadedKeyFrames) {
+    std::vector<double> xs, ys, depths, weights;
+    for (const auto &op : keyFrame.optimizedPoints)
+      if (op->state == OptimizedPoint::ACTIVE) {
+        xs.push_back(op->p[0]);
+        ys.push_back(op->p[1]);
+        depths.push_back(op->depth());
+        weights.push_back(1.0 / op->stddev);
+      }
+    // the first keyframes of a map may have no optimized points yet
+    for (const auto &ip : keyFrame.immaturePoints)
+      if (ip->state == ImmaturePoint::ACTIVE && ip->stddev < INF) {
+        xs.push_back(ip->p[0]);
+        ys.push_back(ip->p[1]);
+        depths.push_back(ip->depth);
+        weights.push_back(1.0 / ip->stddev);
+      }
+    DepthedImagePyramid trackingBase(keyFrame.preKeyFrame->frame().clone(),
+                                     settings.pyramid.levelNum, xs, ys,
+                                     depths, weights);
+    keyFrames.push_back(
+        database.add(num, keyFrame.thisToWorld, trackingBase));
+  }
+
+  // the scale of a monocular map is arbitrary
+  for (int i = 0; i + 1 < keyFrames.size(); ++i)
+    meanNeighbourDistance += (keyFrames[i + 1]->thisToWorld.translation() -
+                              keyFrames[i]->thisToWorld.translation())
+                                 .norm();
+  if (keyFrames.size() > 1)
+    meanNeighbourDistance /= keyFrames.size() - 1;
+  if (meanNeighbourDistance == 0)
+    meanNeighbourDistance = 1;
+
+  DSO_LOG(SYSTEM, 0) << "loaded a map of " << keyFrames.size() << " keyframes";
+}
+
+int MapLocalizer::keyFrameNum() const { return keyFrames.size(); }
+
+int MapLocalizer::baseFrameNum() const {
+  return base ? base->globalFrameNum : -1;
+}
+
+double MapLocalizer::distance(const SE3 &worldToFrame,
+                              const KeyFrameDatabase::Entry &keyFrame) const {
+  SE3 keyFrameToFrame = worldToFrame * keyFrame.thisToWorld;
+  return keyFrameToFrame.translation().norm() / meanNeighbourDistance +
+         settings.localization.rotationWeight *
+             keyFrameToFrame.so3().log().norm();
+}
+
+int MapLocalizer::nearestKeyFrame(const SE3 &worldToFrame) const {
+  int nearest = 0;
+  double minDistance = INF;
+  for (int i = 0; i < keyFrames.size(); ++i) {
+    double d = distance(worldToFrame, *keyFrames[i]);
+    if (d < minDistance) {
+      minDistance = d;
+      nearest = i;
+    }
+  }
+  return nearest;
+}
+
+void MapLocalizer::setBase(
+    const std::shared_ptr<const KeyFrameDatabase::Entry> &keyFrame) {
+  if (base == keyFrame)
+    return;
+  std::unique_ptr<DepthedImagePyramid> trackingBase(
+      new DepthedImagePyramid(keyFrame->trackingBase));
+  tracker.reset(new FrameTracker(camPyr, std::move(trackingBase), {},
+                                 trackerSettings));
+  base = keyFrame;
+  // the light of the new base is not known relative to the old one
+  lightBaseToLast = AffineLightTransform<double>();
+  lastRmse = INF;
+}
+
+std::optional<SE3> MapLocalizer::relocalize(const PreKeyFrame &frame) {
+  PROFILE_SCOPE("localizer.relocalize");
+  std::vector<std::shared_ptr<const KeyFrameDatabase::Entry>> candidates =
+      database.query(frame.frame());
+  if (candidates.empty())
+    return std::nullopt;
+
+  StdVector<SE3> candidateToFrame(candidates.size());
+  std::vector<double> rmses(candidates.size(), INF);
+  int coarsestLevel = settings.pyramid.levelNum - 1;
+  ParallelExecutor(settings.threading, Scheduler::TRACKING).execute([&]() {
+    tbb::parallel_for(0, int(candidates.size()), [&](int i) {
+      std::unique_ptr<DepthedImagePyramid> recalled(
+          new DepthedImagePyramid(candidates[i]->trackingBase));
+      FrameTracker candidateTracker(camPyr, std::move(recalled), {},
+                                    trackerSettings);
+      std::tie(candidateToFrame[i], std::ignore) =
+          candidateTracker.trackFrameQuiet(frame, SE3(), AffLight(),
+                                           coarsestLevel, &rmses[i]);
+    });
+  });
+
+  int best = std::min_element(rmses.begin(), rmses.end()) - rmses.begin();
+  if (rmses[best] == INF)
+    return std::nullopt;
+
+  DSO_LOG(TRACKING, 0) << "relocalized against map keyframe #"
+                       << candidates[best]->globalFrameNum
+                       << ", coarse rmse = " << rmses[best];
+  setBase(candidates[best]);
+  SE3 baseToFrame;
+  std::tie(baseToFrame, lightBaseToLast) =
+      tracker->trackFrame(frame, candidateToFrame[best], AffLight());
+  lastRmse = tracker->lastRmse;
+  return baseToFrame * base->thisToWorld.inverse();
+}
+
+std::optional<SE3> MapLocalizer::localize(const SourceFrame &frame) {
+  PROFILE_SCOPE("localizer.localize");
+  PreKeyFrame preKeyFrame(nullptr, cam, frame, settings.pyramid);
+
+  std::optional<SE3> worldToFrame;
+  if (base && !lastWorldToFrame.empty()) {
+    SE3 predicted = lastWorldToFrame[0];
+    if (lastWorldToFrame.size() > 1)
+      predicted = lastWorldToFrame[0] * lastWorldToFrame[1].inverse() *
+                  lastWorldToFrame[0];
+    auto [baseToFrame, lightBaseToFrame] = tracker->trackFrame(
+        preKeyFrame, predicted * base->thisToWorld, lightBaseToLast);
+    if (tracker->lastRmse <=
+        lastRmse * settings.frameTracker.trackFailFactor) {
+      worldToFrame = baseToFrame * base->thisToWorld.inverse();
+      lightBaseToLast = lightBaseToFrame;
+      lastRmse = tracker->lastRmse;
+    } else
+      DSO_LOG(TRACKING, 0) << "lost track of frame #" << frame.globalFrameNum
+                           << ", rmse = " << tracker->lastRmse;
+  }
+  if (!worldToFrame)
+    worldToFrame = relocalize(preKeyFrame);
+
+  if (!worldToFrame) {
+    base.reset();
+    tracker.reset();
+    lastWorldToFrame.clear();
+    return std::nullopt;
+  }
+
+  lastWorldToFrame.insert(lastWorldToFrame.begin(), *worldToFrame);
+  lastWorldToFrame.resize(std::min(int(lastWorldToFrame.size()), 2));
+
+  const std::shared_ptr<const KeyFrameDatabase::Entry> &nearest =
+      keyFrames[nearestKeyFrame(*worldToFrame)];
+  if (nearest != base && distance(*worldToFrame, *nearest) <
+                             settings.localization.switchRatio *
+                                 distance(*worldToFrame, *base)) {
+    DSO_LOG(TRACKING, 1) << "switch to map keyframe #"
+                         << nearest->globalFrameNum;
+    PROFILE_COUNT("localizer.switches", 1);
+    setBase(nearest);
+  }
+  return worldToFrame;
+}
+
+} // namespace fishdso
@@ -0,0 +1,87 @@
+#include "system/MarginalizationPolicy.h"
+#include <algorithm>
+#include <cmath>
+#include <glog/logging.h>
+
+namespace fishdso {
+
+MarginalizationPolicy::MarginalizationPolicy(
+    const Settings::Marginalization &settings)
+    : settings(settings) {
+  CHECK_GE(settings.keptNewest, 2);
+}
+
+MatXX MarginalizationPolicy::distances(
+    const StdVector<SE3> &thisToWorld) const {
+  const int n = thisToWorld.size();
+  MatXX translations(n, n), angles(n, n);
+  double translationSum = 0;
+  for (int i = 0; i < n; ++i)
+    for (int j = 0; j < n; ++j) {
+      translations(i, j) =
+          (thisToWorld[i].translation() - thisToWorld[j].translation()).norm();
+      angles(i, j) =
+          (thisToWorld[i].so3().inverse() * thisToWorld[j].so3()).log().norm();
+      translationSum += translations(i, j);
+    }
+  // the scale of a monocular map is arbitrary
+  double meanTranslation = n > 1 ? translationSum / (n * (n - 1)) : 0;
+  if (meanTranslation > 0)
+    translations /= meanTranslation;
+  return translations + settings.rotationWeight * angles;
+}
+
+double MarginalizationPolicy::redundancy(const MatXX &distances,
+                                         const std::vector<bool> &isGone,
+                                         int i) const {
+  constexpr double eps = 1e-5;
+  const int newest = distances.rows() - 1;
+  double inverseSum = 0;
+  for (int j = 0; j < newest; ++j)
+    if (j != i && !isGone[j])
+      inverseSum += 1 / (eps + distances(i, j));
+  return std::sqrt(distances(i, newest)) * inverseSum;
+}
+
+std::vector<int>
+MarginalizationPolicy::choose(const StdVector<SE3> &thisToWorld,
+                              const std::vector<double> &visibleRatios,
+                              int maxKeyFrames) const {
+  CHECK_EQ(thisToWorld.size(), visibleRatios.size());
+  const int n = thisToWorld.size();
+  const int candidateNum = std::max(n - settings.keptNewest, 0);
+
+  std::vector<bool> isGone(n, false);
+  int remaining = n;
+  for (int i = 0; i < candidateNum; ++i)
+    if (visibleRatios[i] < settings.minVisibleRatio) {
+      isGone[i] = true;
+      remaining--;
+    }
+
+  MatXX dist = distances(thisToWorld);
+  for (; remaining > maxKeyFrames; --remaining) {
+    int mostRedundant = -1;
+    double maxRedundancy = -1;
+    for (int i = 0; i < candidateNum; ++i) {
+      if (isGone[i])
+        continue;
+      double r = redundancy(dist, isGone, i);
+      if (r > maxRedundancy) {
+        maxRedundancy = r;
+        mostRedundant = i;
+      }
+    }
+    if (mostRedundant < 0)
+      break;
+    isGone[mostRedundant] = true;
+  }
+
+  std::vector<int> chosen;
+  for (int i = 0; i < n; ++i)
+    if (isGone[i])
+      chosen.push_back(i);
+  return chosen;
+}
+
+} // namespace fishdso
@@ -0,0 +1,80 @@
+#include "system/PhotometricCalibration.h"
+#include <fstream>
+#include <glog/logging.h>
+#include <opencv2/imgcodecs.hpp>
+
+namespace fishdso {
+
+PhotometricCalibration::PhotometricCalibration(
+    const std::vector<double> &inverseResponse, const cv::Mat1f &vignette) {
+  if (inverseResponse.empty())
+    for (int v = 0; v < 256; ++v)
+      irradiance[v] = v;
+  else {
+    CHECK_EQ(inverseResponse.size(), 256u);
+    double lo = inverseResponse[0], hi = inverseResponse[255];
+    CHECK_GT(hi, lo) << "the inverse response should increase";
+    for (int v = 0; v < 256; ++v)
+      irradiance[v] = 255 * (inverseResponse[v] - lo) / (hi - lo);
+  }
+  for (int v = 0; v < 256; ++v)
+    responseLut[v] = cv::saturate_cast<uchar>(irradiance[v]);
+
+  if (!vignette.empty()) {
+    double maxVignette;
+    cv::minMaxLoc(vignette, nullptr, &maxVignette);
+    CHECK_GT(maxVignette, 0);
+    gain.create(vignette.rows, vignette.cols);
+    for (int y = 0; y < vignette.rows; ++y)
+      for (int x = 0; x < vignette.cols; ++x)
+        gain(y, x) = vignette(y, x) > 0 ? maxVignette / vignette(y, x) : 0;
+  }
+}
+
+std::shared_ptr<PhotometricCalibration>
+PhotometricCalibration::load(const std::string &inverseResponseFile,
+                             const std::string &vignetteFile) {
+  std::vector<double> inverseResponse;
+  if (!inverseResponseFile.empty()) {
+    std::ifstream ifs(inverseResponseFile);
+    CHECK(ifs.is_open()) << "could not open " << inverseResponseFile;
+    double value;
+    while (ifs >> value)
+      inverseResponse.push_back(value);
+    CHECK_EQ(inverseResponse.size(), 256u)
+        << "wrong inverse response in " << inverseResponseFile;
+  }
+
+  cv::Mat1f vignette;
+  if (!vignetteFile.empty()) {
+    cv::Mat image = cv::imread(vignetteFile, cv::IMREAD_ANYDEPTH);
+    CHECK(!image.empty()) << "could not read " << vignetteFile;
+    image.convertTo(vignette, CV_32F);
+  }
+
+  return std::shared_ptr<PhotometricCalibration>(
+      new PhotometricCalibration(inverseResponse, vignette));
+}
+
+void PhotometricCalibration::apply(const cv::Mat1b &src,
+                                   cv::Mat1b &dst) const {
+  if (hasVignette()) {
+    CHECK_EQ(src.cols, gain.cols);
+    CHECK_EQ(src.rows, gain.rows);
+  }
+  dst.create(src.rows, src.cols);
+  for (int y = 0; y < src.rows; ++y) {
+    const uchar *srcRow = src[y];
+    uchar *dstRow = dst[y];
+    if (hasVignette()) {
+      const float *gainRow = gain[y];
+      for (int x = 0; x < src.cols; ++x)
+        dstRow[x] =
+            cv::saturate_cast<uchar>(irradiance[srcRow[x]] * gainRow[x]);
+    } else
+      for (int x = 0; x < src.cols; ++x)
+        dstRow[x] = responseLut[srcRow[x]];
+  }
+}
+
+} // namespace fishdso
@@ -0,0 +1,91 @@
+#include "system/PointBudgetController.h"
+#include "util/Log.h"
+#include <algorithm>
+#include <cmath>
+#include <glog/logging.h>
+
+namespace fishdso {
+
+bool PointBudget::operator==(const PointBudget &other) const {
+  return pointsNum == other.pointsNum &&
+         optimizedPointsNum == other.optimizedPointsNum &&
+         baIterations == other.baIterations;
+}
+
+bool PointBudget::operator!=(const PointBudget &other) const {
+  return !(*this == other);
+}
+
+PointBudgetController::PointBudgetController(
+    const PointBudget &initial, const Settings::PointBudget &settings)
+    : frameTime(-1)
+    , keyFrameTime(-1)
+    , framesSinceChange(0)
+    , settings(settings) {
+  CHECK_GT(settings.targetFrameTime, 0);
+  CHECK_GT(settings.targetKeyFrameTime, 0);
+  CHECK_LE(settings.minPointsNum, settings.maxPointsNum);
+  CHECK_LE(settings.minOptimizedPoints, settings.maxOptimizedPoints);
+  CHECK_LE(settings.minBaIterations, settings.maxBaIterations);
+  curBudget = clamped(initial);
+}
+
+PointBudget PointBudgetController::clamped(const PointBudget &budget) const {
+  return {std::clamp(budget.pointsNum, settings.minPointsNum,
+                     settings.maxPointsNum),
+          std::clamp(budget.optimizedPointsNum, settings.minOptimizedPoints,
+                     settings.maxOptimizedPoints),
+          std::clamp(budget.baIterations, settings.minBaIterations,
+                     settings.maxBaIterations)};
+}
+
+bool PointBudgetController::update(const FrameTimings &timings) {
+  auto smooth = [this](double &smoothed, double sample) {
+    smoothed = smoothed < 0 ? sample
+                            : (1 - settings.smoothing) * smoothed +
+                                  settings.smoothing * sample;
+  };
+  smooth(frameTime, timings.seconds[FrameTimings::TRACKING] +
+                        timings.seconds[FrameTimings::TRACING]);
+  if (timings.isKeyFrame)
+    smooth(keyFrameTime, timings.seconds[FrameTimings::KEYFRAME_CREATION] +
+                             timings.seconds[FrameTimings::BUNDLE_ADJUSTMENT]);
+
+  if (++framesSinceChange < settings.minFramesBetweenChanges)
+    return false;
+
+  PointBudget newBudget = curBudget;
+
+  // the points are scaled by the inverse of the load, by maxStep at most
+  double frameLoad = frameTime / settings.targetFrameTime;
+  if (std::abs(frameLoad - 1) > settings.tolerance) {
+    double factor = std::clamp(1 / std::max(frameLoad, 1e-9),
+                               1 - settings.maxStep, 1 + settings.maxStep);
+    newBudget.pointsNum = std::lround(curBudget.pointsNum * factor);
+    newBudget.optimizedPointsNum =
+        std::lround(curBudget.optimizedPointsNum * factor);
+  }
+
+  // BA time goes mostly into the iterations, one is added or taken away
+  if (keyFrameTime >= 0) {
+    double keyFrameLoad = keyFrameTime / settings.targetKeyFrameTime;
+    if (keyFrameLoad > 1 + settings.tolerance)
+      newBudget.baIterations--;
+    else if (keyFrameLoad < 1 - settings.tolerance)
+      newBudget.baIterations++;
+  }
+
+  newBudget = clamped(newBudget);
+  if (newBudget == curBudget)
+    return false;
+
+  DSO_LOG(SYSTEM, 1) << "point budget: " << newBudget.pointsNum << " points, "
+                     << newBudget.optimizedPointsNum << " optimized, "
+                     << newBudget.baIterations << " BA iterations (frame "
+                     << frameTime << " s, keyframe " << keyFrameTime << " s)";
+  curBudget = newBudget;
+  framesSinceChange = 0;
+  return true;
+}
+
+} // namespace fishdso
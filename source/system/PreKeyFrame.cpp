@@ -1,26 +1,137 @@
 #include "system/PreKeyFrame.h"
 #include "PreKeyFrameInternals.h"
 #include "system/KeyFrame.h"
+#include "util/MemoryAccounting.h"
 #include "util/util.h"
+#include <algorithm>
 #include <ceres/cubic_interpolation.h>
+#include <glog/logging.h>
 #include <opencv2/opencv.hpp>
 
 namespace fishdso {
 
+struct FramePyramidsMemory {
+  static constexpr const char *name = "memory.framePyramids";
+};
+
 PreKeyFrame::PreKeyFrame(KeyFrame *baseKeyFrame, CameraModel *cam,
                          const cv::Mat &frameColored, int globalFrameNum,
-                         const Settings::Pyramid &_pyrSettings)
-    : frameColored(frameColored)
-    , framePyr(cvtBgrToGray(frameColored), _pyrSettings.levelNum)
-    , baseKeyFrame(baseKeyFrame)
+                         const Settings::Pyramid &_pyrSettings,
+                         std::shared_ptr<FrameBufferPool> bufferPool)
+    : baseKeyFrame(baseKeyFrame)
     , cam(cam)
     , globalFrameNum(globalFrameNum)
     , pyrSettings(_pyrSettings)
-    , internals(std::unique_ptr<PreKeyFrameInternals>(
-          new PreKeyFrameInternals(framePyr, pyrSettings))) {
-  grad(frame(), gradX, gradY, gradNorm);
+    , bufferPool(bufferPool)
+    , colorProvider([frameColored]() { return cv::Mat3b(frameColored); }) {
+  acquireBuffers();
+  cv::cvtColor(frameColored, framePyr.images[0], cv::COLOR_BGR2GRAY);
+  if (cam && cam->getPhotometricCalibration())
+    cam->getPhotometricCalibration()->apply(framePyr.images[0],
+                                            framePyr.images[0]);
+  buildPyramid();
+}
+
+PreKeyFrame::PreKeyFrame(KeyFrame *baseKeyFrame, CameraModel *cam,
+                         const SourceFrame &frame,
+                         const Settings::Pyramid &_pyrSettings,
+                         std::shared_ptr<FrameBufferPool> bufferPool)
+    : baseKeyFrame(baseKeyFrame)
+    , cam(cam)
+    , globalFrameNum(frame.globalFrameNum)
+    , arrivalTime(frame.arrivalTime)
+    , pyrSettings(_pyrSettings)
+    , bufferPool(bufferPool)
+    , colorProvider(frame.colorProvider) {
+  CHECK(!frame.gray.empty());
+  acquireBuffers();
+  // The calibration is applied on the way into our buffer, in place of the
+  // copy. Otherwise sharing an owned image saves the copy, and a foreign
+  // buffer can be reused by its owner as soon as we return.
+  if (cam && cam->getPhotometricCalibration())
+    cam->getPhotometricCalibration()->apply(frame.gray, framePyr.images[0]);
+  else if (frame.gray.u)
+    framePyr.images[0] = frame.gray;
+  else
+    frame.gray.copyTo(framePyr.images[0]);
+  buildPyramid();
+}
+
+void PreKeyFrame::acquireBuffers() {
+  if (bufferPool) {
+    FrameBuffers buffers = bufferPool->acquire();
+    framePyr = std::move(buffers.framePyr);
+    internals = std::move(buffers.internals);
+  }
+
+  framePyr.images.resize(pyrSettings.levelNum);
+  cv::Mat1b &base = framePyr.images[0];
+  if (base.u && base.u->refcount > 1)
+    base.release();
+}
+
+void PreKeyFrame::buildPyramid() {
+  if (cam && cam->hasInvalidPixels()) {
+    CHECK_EQ(frame().cols, cam->getWidth());
+    CHECK_EQ(frame().rows, cam->getHeight());
+  }
+  framePyr.rebuild(pyrSettings.levelNum);
+
+  if (internals && internals->levelNum() == pyrSettings.levelNum)
+    internals->reset(framePyr);
+  else
+    internals = std::unique_ptr<PreKeyFrameInternals>(
+        new PreKeyFrameInternals(framePyr, pyrSettings));
+
+  // shared with the pool while the frame is alive, so it is booked here
+  for (const cv::Mat1b &level : framePyr.images)
+    pyramidBytes += level.total() * level.elemSize();
+  bookAllocation<FramePyramidsMemory>(pyramidBytes);
+}
+
+PreKeyFrame::~PreKeyFrame() {
+  bookDeallocation<FramePyramidsMemory>(pyramidBytes);
+  if (!bufferPool)
+    return;
+  FrameBuffers buffers;
+  buffers.framePyr = std::move(framePyr);
+  buffers.internals = std::move(internals);
+  bufferPool->release(std::move(buffers));
+}
+
+Vec2f PreKeyFrame::gradient(const cv::Point &p) const {
+  const cv::Mat1b &img = frame();
+  if (cam && cam->hasInvalidPixels()) {
+    const Vec2i &span = cam->getValidSpans()[p.y];
+    if (p.x < span[0] || p.x >= span[1])
+      return Vec2f::Zero();
+  }
+  // replicated borders, as in gradAndPyrDown
+  int left = std::max(p.x - 1, 0), right = std::min(p.x + 1, img.cols - 1);
+  int up = std::max(p.y - 1, 0), down = std::min(p.y + 1, img.rows - 1);
+  return Vec2f(0.5f * (float(img(p.y, right)) - float(img(p.y, left))),
+               0.5f * (float(img(down, p.x)) - float(img(up, p.x))));
 }
 
-PreKeyFrame::~PreKeyFrame() {}
+float PreKeyFrame::gradNorm(const cv::Point &p) const {
+  Vec2f g = gradient(p);
+  return std::sqrt(g[0] * g[0] + g[1] * g[1]);
+}
+
+cv::Mat1f PreKeyFrame::gradNormImage() const {
+  const cv::Mat1b &img = frame();
+  cv::Mat1f gradX(img.size()), gradY(img.size()), gradNorm(img.size());
+  gradAndPyrDown(img, gradX[0], gradY[0], gradNorm[0], nullptr,
+                 cam && cam->hasInvalidPixels() ? cam->getValidSpans().data()
+                                                : nullptr);
+  return gradNorm;
+}
+
+const cv::Mat3b &PreKeyFrame::frameColored() const {
+  std::call_once(colorOnce, [this]() {
+    colored = colorProvider ? colorProvider() : cvtGrayToBgr(frame());
+  });
+  return colored;
+}
 
 }; // namespace fishdso
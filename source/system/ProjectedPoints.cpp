@@ -0,0 +1,73 @@
+#include "system/ProjectedPoints.h"
+#include <glog/logging.h>
+
+namespace fishdso {
+
+ProjectedPoints::ProjectedPoints(const CameraModel *cam)
+    : cam(cam)
+    , sourceNum(0) {}
+
+void ProjectedPoints::add(const SE3 *sourceToBase,
+                          const std::vector<double> &srcX,
+                          const std::vector<double> &srcY,
+                          const std::vector<double> &srcDepth) {
+  CHECK(srcX.size() == srcY.size() && srcY.size() == srcDepth.size());
+  const int n = srcX.size();
+  const int sourceInd = sourceNum++;
+  grid.reset();
+
+  if (!sourceToBase) {
+    x.insert(x.end(), srcX.begin(), srcX.end());
+    y.insert(y.end(), srcY.begin(), srcY.end());
+    depth.insert(depth.end(), srcDepth.begin(), srcDepth.end());
+    source.insert(source.end(), n, sourceInd);
+    for (int i = 0; i < n; ++i)
+      sourceIndex.push_back(i);
+    return;
+  }
+
+  // the motion is applied as one matrix to all of the points
+  const Mat33 R = sourceToBase->rotationMatrix();
+  const Vec3 t = sourceToBase->translation();
+  std::vector<double> rayX(n), rayY(n), rayZ(n);
+  for (int i = 0; i < n; ++i) {
+    Vec3 ray = cam->unmap(Vec2(srcX[i], srcY[i])).normalized();
+    rayX[i] = ray[0];
+    rayY[i] = ray[1];
+    rayZ[i] = ray[2];
+  }
+  for (int i = 0; i < n; ++i) {
+    double px = srcDepth[i] * rayX[i], py = srcDepth[i] * rayY[i],
+           pz = srcDepth[i] * rayZ[i];
+    rayX[i] = R(0, 0) * px + R(0, 1) * py + R(0, 2) * pz + t[0];
+    rayY[i] = R(1, 0) * px + R(1, 1) * py + R(1, 2) * pz + t[1];
+    rayZ[i] = R(2, 0) * px + R(2, 1) * py + R(2, 2) * pz + t[2];
+  }
+
+  std::vector<double> mappedX(n), mappedY(n);
+  cam->mapBatch(n, rayX.data(), rayY.data(), rayZ.data(), mappedX.data(),
+                mappedY.data());
+
+  for (int i = 0; i < n; ++i) {
+    if (!cam->isOnImage(Vec2(mappedX[i], mappedY[i]), 0))
+      continue;
+    x.push_back(mappedX[i]);
+    y.push_back(mappedY[i]);
+    depth.push_back(std::sqrt(rayX[i] * rayX[i] + rayY[i] * rayY[i] +
+                              rayZ[i] * rayZ[i]));
+    source.push_back(sourceInd);
+    sourceIndex.push_back(i);
+  }
+}
+
+void ProjectedPoints::buildGrid(int cellSize) {
+  grid.reset(
+      new PointGrid(cam->getWidth(), cam->getHeight(), cellSize, x, y));
+}
+
+const PointGrid &ProjectedPoints::getGrid() const {
+  CHECK(grid) << "buildGrid() was not called after the last add()";
+  return *grid;
+}
+
+} // namespace fishdso
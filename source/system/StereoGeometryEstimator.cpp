@@ -1,12 +1,18 @@
 #include "system/StereoGeometryEstimator.h"
 #include "system/SphericalPlus.h"
-#include "util/flags.h"
+#include "util/Log.h"
+#include "util/Profiler.h"
+#include "util/Random.h"
+#include "util/Scheduler.h"
 #include "util/geometry.h"
 #include <RelativePoseEstimator.h>
+#include <atomic>
 #include <ceres/ceres.h>
 #include <fstream>
 #include <glog/logging.h>
-#include <random>
+#include <numeric>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
 namespace fishdso {
 
@@ -59,36 +65,103 @@ StereoGeometryEstimator::depths() {
 
 int StereoGeometryEstimator::inliersNum() { return _inliersInds.size(); }
 
-double reprojectionError(CameraModel *cam, const Mat33 &E, const Mat33 &Et,
-                         const std::pair<Vec2, Vec2> &imgCorresp,
-                         std::pair<Vec3, Vec3> rayCorresp) {
-  Vec3 norm1 = Et * rayCorresp.second;
-  Vec3 norm2 = E * rayCorresp.first;
-  if (norm1.squaredNorm() > 1e-4)
-    rayCorresp.first -=
-        (rayCorresp.first.dot(norm1) / norm1.squaredNorm()) * norm1;
-  if (norm2.squaredNorm() > 1e-4)
-    rayCorresp.second -=
-        (rayCorresp.second.dot(norm2) / norm2.squaredNorm()) * norm2;
-
-  double err1 = (cam->map(rayCorresp.first.data()) - imgCorresp.first).norm();
-  double err2 = (cam->map(rayCorresp.second.data()) - imgCorresp.second).norm();
-
-  return std::min(err1, err2);
+namespace {
+
+// correspondences per chunk of scoreEssentials
+constexpr int scoringChunkSize = 64;
+
+// Moves the ray onto the plane with the given normal, unless the normal is
+// degenerate.
+EIGEN_STRONG_INLINE Vec3 ontoPlane(const Vec3 &ray, const Vec3 &normal) {
+  double sqNorm = normal.squaredNorm();
+  return sqNorm > 1e-4 ? Vec3(ray - (ray.dot(normal) / sqNorm) * normal) : ray;
 }
 
-int StereoGeometryEstimator::findInliersEssential(
-    const Mat33 &E, std::vector<int> &inliersInds) {
-  inliersInds.resize(0);
-  int result = 0;
-  Mat33 Et = E.transpose();
-  for (int i = 0; i < int(rays.size()); ++i) {
-    if (reprojectionError(cam, E, Et, imgCorresps[i], rays[i]) <
-        settings.outlierReprojError) {
-      ++result;
-      inliersInds.push_back(i);
+} // namespace
+
+// The reprojection error of a correspondence is the smaller of the
+// distances from each point to the projection of its ray corrected onto the
+// epipolar plane of the other one.
+void StereoGeometryEstimator::scoreEssentials(
+    const Mat33 *Es, int EsNum, const int *inds, int n, int atLeast,
+    const std::atomic<int> *sharedAtLeast, int *inliersNum,
+    std::vector<int> *inliersInds) const {
+  constexpr int B = scoringChunkSize;
+  const double sqThreshold =
+      settings.outlierReprojError * settings.outlierReprojError;
+
+  StdVector<Mat33> Ets(EsNum);
+  for (int e = 0; e < EsNum; ++e) {
+    Ets[e] = Es[e].transpose();
+    inliersNum[e] = 0;
+    if (inliersInds)
+      inliersInds[e].resize(0);
+  }
+
+  int chunkInds[B];
+  double x1[B], y1[B], z1[B], x2[B], y2[B], z2[B];
+  double u1[B], v1[B], u2[B], v2[B];
+  for (int from = 0; from < n; from += B) {
+    const int cnt = std::min(B, n - from);
+    for (int l = 0; l < cnt; ++l)
+      chunkInds[l] = inds ? inds[from + l] : from + l;
+    if (sharedAtLeast)
+      atLeast =
+          std::max(atLeast, sharedAtLeast->load(std::memory_order_relaxed));
+
+    bool anyScored = false;
+    for (int e = 0; e < EsNum; ++e) {
+      if (inliersNum[e] < 0)
+        continue;
+      if (inliersNum[e] + (n - from) < atLeast) {
+        inliersNum[e] = -1;
+        continue;
+      }
+      anyScored = true;
+
+      const Mat33 &E = Es[e], &Et = Ets[e];
+      for (int l = 0; l < cnt; ++l) {
+        const std::pair<Vec3, Vec3> &ray = rays[chunkInds[l]];
+        Vec3 first = ontoPlane(ray.first, Et * ray.second);
+        Vec3 second = ontoPlane(ray.second, E * ray.first);
+        x1[l] = first[0];
+        y1[l] = first[1];
+        z1[l] = first[2];
+        x2[l] = second[0];
+        y2[l] = second[1];
+        z2[l] = second[2];
+      }
+      cam->mapBatch(cnt, x1, y1, z1, u1, v1);
+      cam->mapBatch(cnt, x2, y2, z2, u2, v2);
+
+      for (int l = 0; l < cnt; ++l) {
+        const std::pair<Vec2, Vec2> &corresp = imgCorresps[chunkInds[l]];
+        double du1 = u1[l] - corresp.first[0], dv1 = v1[l] - corresp.first[1];
+        double du2 = u2[l] - corresp.second[0],
+               dv2 = v2[l] - corresp.second[1];
+        double sqErr = std::min(du1 * du1 + dv1 * dv1, du2 * du2 + dv2 * dv2);
+        if (sqErr < sqThreshold) {
+          ++inliersNum[e];
+          if (inliersInds)
+            inliersInds[e].push_back(chunkInds[l]);
+        }
+      }
     }
+    if (!anyScored)
+      return;
   }
+
+  for (int e = 0; e < EsNum; ++e)
+    if (inliersNum[e] < atLeast)
+      inliersNum[e] = -1;
+}
+
+int StereoGeometryEstimator::findInliersEssential(const Mat33 &E,
+                                                  std::vector<int> &inliersInds,
+                                                  int atLeast) const {
+  int result;
+  scoreEssentials(&E, 1, nullptr, rays.size(), atLeast, nullptr, &result,
+                  &inliersInds);
   return result;
 }
 
@@ -107,10 +180,10 @@ int StereoGeometryEstimator::findInliersMotion(const SE3 &motion,
   return inliersInds.size();
 }
 
-SE3 StereoGeometryEstimator::extractMotion(const Mat33 &E,
-                                           std::vector<int> &inliersInds,
-                                           int &newInliers,
-                                           bool doLogFrontPoints) {
+namespace {
+
+// the four motions that an essential matrix decomposes into
+void decompose(const Mat33 &E, SE3 solutions[4]) {
   Eigen::JacobiSVD<Mat33> svdE(E, Eigen::ComputeFullU | Eigen::ComputeFullV);
   Mat33 U = svdE.matrixU();
   Mat33 V = svdE.matrixV();
@@ -129,7 +202,43 @@ SE3 StereoGeometryEstimator::extractMotion(const Mat33 &E,
   Mat33 R1 = U * W * V.transpose();
   Mat33 R2 = U * W.transpose() * V.transpose();
 
-  SE3 solutions[4] = {SE3(R1, t), SE3(R1, -t), SE3(R2, t), SE3(R2, -t)};
+  solutions[0] = SE3(R1, t);
+  solutions[1] = SE3(R1, -t);
+  solutions[2] = SE3(R2, t);
+  solutions[3] = SE3(R2, -t);
+}
+
+} // namespace
+
+SE3 StereoGeometryEstimator::bestDecomposition(
+    const Mat33 &E, const std::vector<int> &inliersInds,
+    int &frontPointsNum) const {
+  SE3 solutions[4];
+  decompose(E, solutions);
+
+  frontPointsNum = 0;
+  SE3 bestSol;
+  for (const SE3 &sol : solutions) {
+    int curFrontPointsNum = 0;
+    for (int i : inliersInds) {
+      Vec2 depths = triangulate(sol, rays[i].first, rays[i].second);
+      if (depths[0] > 0 && depths[1] > 0)
+        ++curFrontPointsNum;
+    }
+    if (curFrontPointsNum > frontPointsNum) {
+      frontPointsNum = curFrontPointsNum;
+      bestSol = sol;
+    }
+  }
+  return bestSol;
+}
+
+SE3 StereoGeometryEstimator::extractMotion(const Mat33 &E,
+                                           std::vector<int> &inliersInds,
+                                           int &newInliers,
+                                           bool doLogFrontPoints) {
+  SE3 solutions[4];
+  decompose(E, solutions);
 
   //  Mat33 tCross;
   //  tCross << 0, -t[2], t[1], t[2], 0, -t[0], -t[1], t[0], 0;
@@ -142,15 +251,14 @@ SE3 StereoGeometryEstimator::extractMotion(const Mat33 &E,
   bestInliersInds.resize(0);
   curInliersInds.resize(0);
 
-  if (doLogFrontPoints)
-    VLOG(1) << "points in front: ";
-
+  const bool logFrontPoints = doLogFrontPoints && DSO_LOG_IS_ON(INIT, 3);
+  std::stringstream frontPointsLog;
   for (SE3 sol : solutions) {
     curInliersInds = inliersInds;
     int curFrontPointsNum = findInliersMotion(sol, curInliersInds);
 
-    if (doLogFrontPoints)
-      VLOG(1) << curFrontPointsNum << ' ';
+    if (logFrontPoints)
+      frontPointsLog << curFrontPointsNum << ' ';
 
     if (curFrontPointsNum > bestFrontPointsNum) {
       bestFrontPointsNum = curFrontPointsNum;
@@ -159,73 +267,222 @@ SE3 StereoGeometryEstimator::extractMotion(const Mat33 &E,
     }
   }
 
-  if (doLogFrontPoints)
-    VLOG(1) << std::endl;
+  if (logFrontPoints)
+    DSO_LOG(INIT, 3) << "points in front: " << frontPointsLog.str();
 
   std::swap(inliersInds, bestInliersInds);
   newInliers = bestFrontPointsNum;
   return bestSol;
 }
 
+namespace {
+
+// the 5-point solver gives at most this many essential matrices
+constexpr int maxSolutions = 10;
+// essential matrices scored together on a block of preemptive RANSAC
+constexpr int candidatesPerPass = 8;
+
+struct Hypothesis {
+  Mat33 solutions[maxSolutions];
+  int solutionNum = 0;
+};
+
+struct ScoredHypothesis {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  int frontPointsNum = -1;
+  Mat33 E;
+  SE3 motion;
+};
+
+void updateMax(std::atomic<int> &value, int candidate) {
+  int cur = value.load(std::memory_order_relaxed);
+  while (cur < candidate &&
+         !value.compare_exchange_weak(cur, candidate,
+                                      std::memory_order_relaxed))
+    ;
+}
+
+} // namespace
+
+// Hypotheses are processed in rounds, generated and scored in parallel.
+// Every hypothesis samples with its own generator seeded by its index, and
+// the ties go to the earlier ones, so the result does not depend on the
+// number of threads. All of the solutions of a hypothesis are scored in one
+// pass over the correspondences, and a solution stops being scored once it
+// cannot reach the best inlier count found so far by any thread.
 SE3 StereoGeometryEstimator::findCoarseMotion() {
   if (coarseFound || preciseFound)
     return motion;
+  PROFILE_SCOPE("stereo.ransac");
 
-  relative_pose::GeneralizedCentralRelativePoseEstimator<double> est;
   constexpr int N =
       Settings::StereoMatcher::StereoGeometryEstimator::minimalSolveN;
   const double p = settings.successProb;
-
-  SE3 bestMotion;
-
-  std::mt19937 mt(FLAGS_deterministic ? 42 : std::random_device()());
-  std::uniform_int_distribution<> inds(0, rays.size() - 1);
-
-  int hypotesisInd[N];
-  std::pair<Vec3 *, Vec3 *> hypotesis[N];
-  Mat33 results[10];
+  const int corrNum = rays.size();
+  CHECK_GE(corrNum, N) << "too few correspondences for RANSAC";
+
+  // a single seed for all of the streams of the estimation
+  const std::uint32_t seed = randomStream(settings.deterministic,
+                                          RandomStage::STEREO_RANSAC)();
+
+  // the order in which the correspondences are scored preemptively
+  std::vector<int> scoringOrder;
+  if (settings.preemptiveBlockSize > 0) {
+    scoringOrder.resize(corrNum);
+    std::iota(scoringOrder.begin(), scoringOrder.end(), 0);
+    RandomStream(seed, RandomStage::STEREO_SCORING_ORDER, 0, 0)
+        .shuffle(scoringOrder.begin(), scoringOrder.end());
+  }
 
   int bestInliers = -1;
-  std::vector<int> curInliersInds = inlierVectorsPool[ransacCurInliers],
-                   bestInliersInds = inlierVectorsPool[ransacBestInliers];
+  SE3 bestMotion;
+  Mat33 bestE = Mat33::Zero();
+  std::atomic<int> sharedBestInliers(0);
 
   long long iterNum = settings.maxRansacIter;
   double q = std::pow(1.0 - std::pow(1 - p, 1.0 / iterNum), 1.0 / N);
 
-  for (int it = 0; it < iterNum; ++it) {
-    for (int i = 0; i < N; ++i)
-      hypotesisInd[i] = inds(mt);
-    std::sort(hypotesisInd, hypotesisInd + N);
-    bool isRepeated = false;
-    for (int i = 0; i + 1 < N; ++i)
-      if (hypotesisInd[i] == hypotesisInd[i + 1])
-        isRepeated = true;
-    if (isRepeated)
-      continue;
-    for (int i = 0; i < N; ++i)
-      hypotesis[i] = std::make_pair<Vec3 *, Vec3 *>(
-          &rays[hypotesisInd[i]].second, &rays[hypotesisInd[i]].first);
-
-    int foundN = est.estimate(hypotesis, N, results);
-    int maxInliers = 0, maxInliersInd = 0;
-
-    for (int i = 0; i < foundN; ++i) {
-      int inliers = findInliersEssential(results[i], curInliersInds);
-      if (inliers > maxInliers) {
-        maxInliers = inliers;
-        maxInliersInd = i;
-        std::swap(bestInliersInds, curInliersInds);
+  const int roundSize = std::max(settings.hypothesesPerRound, 1);
+  ParallelExecutor executor(threadingSettings, Scheduler::TRACKING);
+
+  for (long long firstInd = 0; firstInd < iterNum; firstInd += roundSize) {
+    const int curRoundSize = std::min<long long>(roundSize, iterNum - firstInd);
+
+    std::vector<Hypothesis> hypotheses(curRoundSize);
+    executor.execute([&]() {
+      tbb::parallel_for(
+          tbb::blocked_range<int>(0, curRoundSize),
+          [&](const tbb::blocked_range<int> &range) {
+            relative_pose::GeneralizedCentralRelativePoseEstimator<double> est;
+            int hypotesisInd[N];
+            std::pair<Vec3 *, Vec3 *> hypotesis[N];
+            for (int h = range.begin(); h < range.end(); ++h) {
+              // the stream of the hypothesis, whichever thread solves it
+              RandomStream stream(seed, RandomStage::STEREO_RANSAC, 0,
+                                  std::uint32_t(firstInd + h));
+              for (int i = 0; i < N; ++i) {
+                do
+                  hypotesisInd[i] = stream.uniformInt(corrNum);
+                while (std::find(hypotesisInd, hypotesisInd + i,
+                                 hypotesisInd[i]) != hypotesisInd + i);
+              }
+              std::sort(hypotesisInd, hypotesisInd + N);
+              for (int i = 0; i < N; ++i)
+                hypotesis[i] = std::make_pair<Vec3 *, Vec3 *>(
+                    &rays[hypotesisInd[i]].second,
+                    &rays[hypotesisInd[i]].first);
+              hypotheses[h].solutionNum =
+                  est.estimate(hypotesis, N, hypotheses[h].solutions);
+            }
+          });
+    });
+
+    // (hypothesis, solution) pairs, ordered by the hypothesis
+    std::vector<std::pair<int, int>> candidates;
+    for (int h = 0; h < curRoundSize; ++h)
+      for (int s = 0; s < hypotheses[h].solutionNum; ++s)
+        candidates.push_back({h, s});
+
+    if (!scoringOrder.empty()) {
+      std::vector<int> partialInliers(candidates.size(), 0);
+      for (int from = 0; from < corrNum && candidates.size() > 1;
+           from += settings.preemptiveBlockSize) {
+        const int to = std::min(from + settings.preemptiveBlockSize, corrNum);
+        std::vector<int> blockInliers(candidates.size());
+        executor.execute([&]() {
+          tbb::parallel_for(
+              tbb::blocked_range<int>(0, candidates.size(),
+                                      candidatesPerPass),
+              [&](const tbb::blocked_range<int> &range) {
+                Mat33 Es[candidatesPerPass];
+                for (int c = range.begin(); c < range.end();
+                     c += candidatesPerPass) {
+                  const int cnt =
+                      std::min(candidatesPerPass, int(range.end()) - c);
+                  for (int k = 0; k < cnt; ++k)
+                    Es[k] = hypotheses[candidates[c + k].first]
+                                .solutions[candidates[c + k].second];
+                  scoreEssentials(Es, cnt, scoringOrder.data() + from,
+                                  to - from, 0, nullptr, &blockInliers[c]);
+                }
+              });
+        });
+        for (int c = 0; c < int(candidates.size()); ++c)
+          partialInliers[c] += blockInliers[c];
+
+        std::vector<int> kept(candidates.size());
+        std::iota(kept.begin(), kept.end(), 0);
+        std::stable_sort(kept.begin(), kept.end(), [&](int c1, int c2) {
+          return partialInliers[c1] > partialInliers[c2];
+        });
+        kept.resize(std::max<int>(1, kept.size() / 2));
+        std::sort(kept.begin(), kept.end());
+
+        std::vector<std::pair<int, int>> keptCandidates;
+        std::vector<int> keptInliers;
+        for (int c : kept) {
+          keptCandidates.push_back(candidates[c]);
+          keptInliers.push_back(partialInliers[c]);
+        }
+        candidates = std::move(keptCandidates);
+        partialInliers = std::move(keptInliers);
       }
     }
-    SE3 curMotion = extractMotion(results[maxInliersInd], bestInliersInds,
-                                  maxInliers, false);
-    if (bestInliers < maxInliers) {
-      bestInliers = maxInliers;
-      bestMotion = curMotion;
-      std::swap(_inliersInds, bestInliersInds);
-    }
 
-    double curQ = double(maxInliers) / rays.size();
+    // consecutive candidates from the same hypothesis
+    std::vector<int> groupStart;
+    for (int c = 0; c < int(candidates.size()); ++c)
+      if (c == 0 || candidates[c].first != candidates[c - 1].first)
+        groupStart.push_back(c);
+    const int groupNum = groupStart.size();
+    groupStart.push_back(candidates.size());
+
+    StdVector<ScoredHypothesis> scored(groupNum);
+    executor.execute([&]() {
+      tbb::parallel_for(
+          tbb::blocked_range<int>(0, groupNum),
+          [&](const tbb::blocked_range<int> &range) {
+            Mat33 Es[maxSolutions];
+            int inliersNum[maxSolutions];
+            std::vector<int> inliersInds[maxSolutions];
+            for (int g = range.begin(); g < range.end(); ++g) {
+              const int EsNum = groupStart[g + 1] - groupStart[g];
+              for (int k = 0; k < EsNum; ++k) {
+                const std::pair<int, int> &c = candidates[groupStart[g] + k];
+                Es[k] = hypotheses[c.first].solutions[c.second];
+              }
+              // all of the solutions of the hypothesis in one pass
+              scoreEssentials(Es, EsNum, nullptr, corrNum, 1,
+                              &sharedBestInliers, inliersNum, inliersInds);
+              int maxInliers = 0;
+              const Mat33 *maxInliersE = nullptr;
+              std::vector<int> *bestInliersInds = nullptr;
+              for (int k = 0; k < EsNum; ++k)
+                if (inliersNum[k] > maxInliers) {
+                  maxInliers = inliersNum[k];
+                  maxInliersE = &Es[k];
+                  bestInliersInds = &inliersInds[k];
+                }
+              if (!maxInliersE)
+                continue;
+
+              scored[g].E = *maxInliersE;
+              scored[g].motion = bestDecomposition(
+                  *maxInliersE, *bestInliersInds, scored[g].frontPointsNum);
+              updateMax(sharedBestInliers, scored[g].frontPointsNum);
+            }
+          });
+    });
+
+    for (const ScoredHypothesis &hyp : scored)
+      if (hyp.frontPointsNum > bestInliers) {
+        bestInliers = hyp.frontPointsNum;
+        bestMotion = hyp.motion;
+        bestE = hyp.E;
+      }
+
+    double curQ = double(bestInliers) / corrNum;
     if (curQ > q) {
       q = curQ;
       double newIterNum = std::log(1 - p) / std::log(1 - std::pow(curQ, N));
@@ -234,16 +491,19 @@ SE3 StereoGeometryEstimator::findCoarseMotion() {
     }
   }
 
-  LOG(INFO) << "iterNum = " << iterNum << std::endl;
-  LOG(INFO) << "total inliers on coarse = " << bestInliers << std::endl;
+  PROFILE_COUNT("stereo.ransacIterations", iterNum);
+  DSO_LOG(INIT, 1) << "iterNum = " << iterNum
+                   << ", total inliers on coarse = " << bestInliers;
   if (iterNum == settings.maxRansacIter)
     LOG(WARNING) << "max number of RANSAC iterations reached" << std::endl;
   coarseFound = true;
   motion = bestMotion;
 
+  findInliersEssential(bestE, _inliersInds);
   bestMotion =
       extractMotion(toEssential(bestMotion), _inliersInds, bestInliers, true);
-  VLOG(1) << "total inliers on coarse after front check = " << bestInliers;
+  DSO_LOG(INIT, 2) << "total inliers on coarse after front check = "
+                   << bestInliers;
 
   return bestMotion;
 }
@@ -312,6 +572,7 @@ SE3 StereoGeometryEstimator::findPreciseMotion() {
     return motion;
   if (!coarseFound)
     findCoarseMotion();
+  PROFILE_SCOPE("stereo.refine");
 
   SE3 coarseMotion = motion;
 
@@ -338,24 +599,27 @@ SE3 StereoGeometryEstimator::findPreciseMotion() {
   ceres::Solver::Options options;
   options.linear_solver_type = ceres::DENSE_QR;
   // options.minimizer_progress_to_stdout = true;
-  options.num_threads = threadingSettings.numThreads;
+  options.num_threads = threadNum(threadingSettings);
   options.max_num_iterations = 10;
   ceres::Solver::Summary summary;
 
   ceres::Solve(options, &problem, &summary);
 
-  LOG(INFO) << "post-RANSAC averaging:\n" << summary.FullReport() << std::endl;
+  DSO_LOG(INIT, 1) << "post-RANSAC averaging: " << summary.BriefReport();
+  DSO_LOG(INIT, 3) << "post-RANSAC averaging:\n" << summary.FullReport();
 
   findInliersEssential(toEssential(motion), _inliersInds);
   findInliersMotion(motion, _inliersInds);
 
-  LOG(INFO) << "translation diff angle = "
-            << 180. / M_PI *
-                   (coarseMotion.translation() - motion.translation()).norm()
-            << "\nrotation diff = "
-            << 180. / M_PI *
-                   (coarseMotion.so3() * motion.so3().inverse()).log().norm()
-            << std::endl;
+  DSO_LOG(INIT, 1) << "translation diff angle = "
+                   << 180. / M_PI *
+                          (coarseMotion.translation() - motion.translation())
+                              .norm()
+                   << ", rotation diff = "
+                   << 180. / M_PI *
+                          (coarseMotion.so3() * motion.so3().inverse())
+                              .log()
+                              .norm();
 
   preciseFound = true;
   return motion;
@@ -1,24 +1,179 @@
 #include "system/StereoMatcher.h"
+#include "util/Log.h"
+#include "util/PointGrid.h"
+#include "util/Profiler.h"
+#include "util/Scheduler.h"
 #include "util/defs.h"
 #include "util/settings.h"
 #include <RelativePoseEstimator.h>
 #include <glog/logging.h>
+#include <limits>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
-DEFINE_bool(draw_inlier_matches, false, "Debug output stereo inlier matches.");
 
 namespace fishdso {
 
+namespace {
+
+std::unique_ptr<cv::DescriptorMatcher>
+createMatcher(const Settings::StereoMatcher &settings) {
+  switch (settings.matcherType) {
+  case Settings::StereoMatcher::LSH:
+    return std::unique_ptr<cv::DescriptorMatcher>(new cv::FlannBasedMatcher(
+        cv::makePtr<cv::flann::LshIndexParams>(settings.lshTableNum,
+                                               settings.lshKeySize,
+                                               settings.lshMultiProbeLevel)));
+  case Settings::StereoMatcher::GRID:
+    return nullptr;
+  default:
+    return std::unique_ptr<cv::DescriptorMatcher>(
+        new cv::BFMatcher(cv::NORM_HAMMING, true));
+  }
+}
+
+// keeps the matches that are also the best ones the other way round
+std::vector<cv::DMatch>
+crossChecked(const std::vector<cv::DMatch> &matches,
+             const std::vector<cv::DMatch> &reverseMatches, int trainNum) {
+  std::vector<int> reverseBest(trainNum, -1);
+  for (const cv::DMatch &m : reverseMatches)
+    if (m.queryIdx >= 0 && m.queryIdx < trainNum)
+      reverseBest[m.queryIdx] = m.trainIdx;
+
+  std::vector<cv::DMatch> result;
+  result.reserve(matches.size());
+  for (const cv::DMatch &m : matches)
+    if (m.trainIdx >= 0 && m.trainIdx < trainNum &&
+        reverseBest[m.trainIdx] == m.queryIdx)
+      result.push_back(m);
+  return result;
+}
+
+} // namespace
+
 StereoMatcher::StereoMatcher(CameraModel *cam,
                              const Settings::StereoMatcher &_settings,
                              const Settings::Threading &threadingSettings)
     : cam(cam)
-    , descriptorsMask(cam->getHeight(), cam->getWidth(), CV_8U, CV_WHITE_BYTE)
-    , orb(cv::ORB::create(_settings.keyPointNum))
-    , descriptorMatcher(std::unique_ptr<cv::DescriptorMatcher>(
-          new cv::BFMatcher(cv::NORM_HAMMING, true)))
+    , descriptorsMask(cam->validMask())
+    , orb{cv::ORB::create(_settings.keyPointNum),
+          cv::ORB::create(_settings.keyPointNum)}
+    , descriptorMatcher(createMatcher(_settings))
     , settings(_settings)
     , threadingSettings(threadingSettings) {}
 
+void StereoMatcher::detectFeatures(cv::Mat frames[2], const int frameIds[2],
+                                   std::vector<cv::KeyPoint> keyPoints[2],
+                                   cv::Mat descriptors[2]) {
+  PROFILE_SCOPE("stereo.detect");
+  bool isCached[2];
+  for (int i = 0; i < 2; ++i) {
+    auto it = cachedFeatures.find(frameIds[i]);
+    isCached[i] = frameIds[i] != NO_FRAME_ID && it != cachedFeatures.end();
+    if (isCached[i]) {
+      keyPoints[i] = it->second.keyPoints;
+      descriptors[i] = it->second.descriptors;
+    }
+  }
+
+  ParallelExecutor(threadingSettings, Scheduler::TRACKING).execute([&]() {
+    tbb::parallel_for(tbb::blocked_range<int>(0, 2),
+                      [&](const tbb::blocked_range<int> &range) {
+                        for (int i = range.begin(); i < range.end(); ++i)
+                          if (!isCached[i])
+                            orb[i]->detectAndCompute(frames[i], descriptorsMask,
+                                                     keyPoints[i],
+                                                     descriptors[i]);
+                      });
+  });
+
+  for (int i = 0; i < 2; ++i)
+    if (keyPoints[i].empty())
+      throw std::runtime_error(
+          "StereoMatcher error: no keypoints found on frame " +
+          std::to_string(i));
+
+  // only the latest frames are worth keeping
+  std::map<int, FrameFeatures> newCache;
+  for (int i = 0; i < 2; ++i)
+    if (frameIds[i] != NO_FRAME_ID)
+      newCache[frameIds[i]] = {keyPoints[i], descriptors[i]};
+  cachedFeatures = std::move(newCache);
+}
+
+std::vector<cv::DMatch>
+StereoMatcher::matchFeatures(const std::vector<cv::KeyPoint> keyPoints[2],
+                             const cv::Mat descriptors[2],
+                             const SO3 &predictedRotation) const {
+  std::vector<cv::DMatch> matches;
+  switch (settings.matcherType) {
+  case Settings::StereoMatcher::GRID:
+    return matchOnGrid(keyPoints, descriptors, predictedRotation);
+  case Settings::StereoMatcher::LSH: {
+    std::vector<cv::DMatch> reverseMatches;
+    descriptorMatcher->match(descriptors[1], descriptors[0], matches);
+    descriptorMatcher->match(descriptors[0], descriptors[1], reverseMatches);
+    return crossChecked(matches, reverseMatches, descriptors[0].rows);
+  }
+  default:
+    descriptorMatcher->match(descriptors[1], descriptors[0], matches);
+    return matches;
+  }
+}
+
+std::vector<cv::DMatch>
+StereoMatcher::matchOnGrid(const std::vector<cv::KeyPoint> keyPoints[2],
+                           const cv::Mat descriptors[2],
+                           const SO3 &predictedRotation) const {
+  const std::vector<cv::KeyPoint> &queryKp = keyPoints[1],
+                                  &trainKp = keyPoints[0];
+  const int queryNum = queryKp.size(), trainNum = trainKp.size();
+
+  std::vector<double> x(trainNum), y(trainNum);
+  for (int t = 0; t < trainNum; ++t) {
+    x[t] = trainKp[t].pt.x;
+    y[t] = trainKp[t].pt.y;
+  }
+  PointGrid grid(cam->getWidth(), cam->getHeight(),
+                 settings.gridMatchCellSize, x, y);
+
+  // the best distance and the other index for every keypoint on both sides,
+  // ties going to the lower index
+  constexpr int noMatch = std::numeric_limits<int>::max();
+  std::vector<std::pair<int, int>> bestForQuery(queryNum, {noMatch, -1}),
+      bestForTrain(trainNum, {noMatch, -1});
+
+  const SO3 secondToFirst = predictedRotation.inverse();
+  const double radius = settings.gridMatchRadius;
+  for (int q = 0; q < queryNum; ++q) {
+    Vec2 predicted =
+        cam->map(secondToFirst * cam->unmap(toVec2(queryKp[q].pt)));
+    cv::Mat queryDescriptor = descriptors[1].row(q);
+    grid.forEachInBox(
+        predicted[0] - radius, predicted[1] - radius, predicted[0] + radius,
+        predicted[1] + radius, [&](int t) {
+          if ((toVec2(trainKp[t].pt) - predicted).squaredNorm() >
+              radius * radius)
+            return;
+          int dist = int(cv::norm(queryDescriptor, descriptors[0].row(t),
+                                  cv::NORM_HAMMING));
+          if (std::make_pair(dist, t) < bestForQuery[q])
+            bestForQuery[q] = {dist, t};
+          if (std::make_pair(dist, q) < bestForTrain[t])
+            bestForTrain[t] = {dist, q};
+        });
+  }
+
+  std::vector<cv::DMatch> matches;
+  for (int q = 0; q < queryNum; ++q) {
+    auto [dist, t] = bestForQuery[q];
+    if (t >= 0 && bestForTrain[t].second == q)
+      matches.push_back(cv::DMatch(q, t, float(dist)));
+  }
+  return matches;
+}
+
 void StereoMatcher::filterOutStillMatches(
     std::vector<cv::DMatch> &matches, std::vector<cv::DMatch> &stillMatches,
     const std::vector<cv::KeyPoint> kp[2]) const {
@@ -35,25 +190,29 @@ void StereoMatcher::filterOutStillMatches(
   std::copy_n(stillIt, matches.end() - stillIt, stillMatches.begin());
   matches.erase(stillIt, matches.end());
 
-  LOG(INFO) << "still matches removed = " << stillMatches.size() << std::endl;
+  DSO_LOG(INIT, 2) << "still matches removed = " << stillMatches.size();
 }
 
 SE3 StereoMatcher::match(cv::Mat frames[2], StdVector<Vec2> resPoints[2],
-                         std::vector<double> resDepths[2]) const {
+                         std::vector<double> resDepths[2]) {
+  const int frameIds[2] = {NO_FRAME_ID, NO_FRAME_ID};
+  return match(frames, frameIds, resPoints, resDepths);
+}
+
+SE3 StereoMatcher::match(cv::Mat frames[2], const int frameIds[2],
+                         StdVector<Vec2> resPoints[2],
+                         std::vector<double> resDepths[2],
+                         const SO3 &predictedRotation) {
   std::vector<cv::KeyPoint> keyPoints[2];
   cv::Mat descriptors[2];
-  for (int i = 0; i < 2; ++i) {
-    orb->detectAndCompute(frames[i], cv::noArray(), keyPoints[i],
-                          descriptors[i]);
-    if (keyPoints[i].empty())
-      throw std::runtime_error(
-          "StereoMatcher error: no keypoints found on frame " +
-          std::to_string(i));
-  }
+  detectFeatures(frames, frameIds, keyPoints, descriptors);
 
   std::vector<cv::DMatch> matches;
-  descriptorMatcher->match(descriptors[1], descriptors[0], matches);
-  LOG(INFO) << "total matches = " << matches.size() << std::endl;
+  {
+    PROFILE_SCOPE("stereo.match");
+    matches = matchFeatures(keyPoints, descriptors, predictedRotation);
+  }
+  DSO_LOG(INIT, 1) << "total matches = " << matches.size();
   if (matches.empty())
     throw std::runtime_error("StereoMatcher error: no matches found");
 
@@ -75,10 +234,9 @@ SE3 StereoMatcher::match(cv::Mat frames[2], StdVector<Vec2> resPoints[2],
   else
     motion = geometryEstimator.findCoarseMotion();
 
-  LOG(INFO) << "inlier matches = " << geometryEstimator.inliersNum()
-            << std::endl;
+  DSO_LOG(INIT, 1) << "inlier matches = " << geometryEstimator.inliersNum();
 
-  if (FLAGS_draw_inlier_matches) {
+  if (settings.drawInlierMatches) {
     std::vector<cv::DMatch> inlierMatches;
     inlierMatches.reserve(matches.size());
     for (int i : geometryEstimator.inliersInds())
@@ -0,0 +1,448 @@
+#include "system/WindowedOptimizer.h"
+#include "util/Log.h"
+#include "util/util.h"
+#include <Eigen/Cholesky>
+#include <algorithm>
+#include <glog/logging.h>
+
+namespace fishdso {
+
+typedef Eigen::Matrix<double, 1, WindowedOptimizer::frameParams> FrameJacobian;
+typedef Eigen::Matrix<double, 3, 6> Mat36;
+
+WindowedOptimizer::WindowedOptimizer(CameraModel *cam,
+                                     const BundleAdjusterSettings &_settings)
+    : cam(cam)
+    , settings(_settings) {}
+
+EIGEN_STRONG_INLINE double huberEnergy(double r, double threshold) {
+  double absR = std::abs(r);
+  return absR <= threshold ? 0.5 * r * r : threshold * (absR - 0.5 * threshold);
+}
+
+WindowedOptimizer::Problem
+WindowedOptimizer::buildProblem(const std::vector<KeyFrame *> &window,
+                                const std::vector<KeyFrame *> &hosts) {
+  Problem problem;
+  problem.frames = window;
+
+  const double c = settings.gradWeighting.c;
+  for (int h = 0; h < window.size(); ++h) {
+    KeyFrame *host = window[h];
+    if (std::find(hosts.begin(), hosts.end(), host) == hosts.end())
+      continue;
+    const BicubicTiles &hostFrame = *host->imageTiles;
+
+    for (const auto &op : host->optimizedPoints) {
+      if (op->state != OptimizedPoint::ACTIVE ||
+          !std::isfinite(op->logInvDepth))
+        continue;
+
+      int pointInd = problem.points.size();
+      bool isObserved = false;
+      Vec3 inHost = cam->unmap(op->p).normalized() * op->depth();
+      for (int t = 0; t < window.size(); ++t) {
+        if (t == h)
+          continue;
+        Vec2 reproj = cam->map(window[t]->thisToWorld.inverse() *
+                               host->thisToWorld * inHost);
+        if (!cam->isOnImage(reproj, settings.residualPattern.height))
+          continue;
+
+        isObserved = true;
+        for (const Vec2 &offset : settings.residualPattern.pattern()) {
+          Vec2 pos = op->p + offset;
+          Residual res;
+          res.point = pointInd;
+          res.host = h;
+          res.target = t;
+          res.baseDirection = cam->unmap(pos).normalized();
+          hostFrame.evaluate(pos[1], pos[0], &res.baseIntencity);
+          double gradNorm = host->preKeyFrame->gradNorm(toCvPoint(pos));
+          res.weight = c / std::hypot(c, gradNorm);
+          problem.residuals.push_back(res);
+        }
+      }
+
+      if (isObserved)
+        problem.points.push_back(op.get());
+    }
+  }
+
+  return problem;
+}
+
+double WindowedOptimizer::residualValue(const Problem &problem,
+                                        const Residual &res,
+                                        const SE3 &hostToTarget) {
+  const AffLight &hostLight = problem.frames[res.host]->lightWorldToThis;
+  const AffLight &targetLight = problem.frames[res.target]->lightWorldToThis;
+
+  double depth = std::exp(-problem.points[res.point]->logInvDepth);
+  Vec2 onTarget = cam->map(hostToTarget * (res.baseDirection * depth));
+  double trackedIntencity;
+  problem.frames[res.target]->imageTiles->evaluate(onTarget[1], onTarget[0],
+                                                   &trackedIntencity);
+
+  // same as DirectResidual with the target multiplier normalized out
+  double mult = std::exp(hostLight.data[0] - targetLight.data[0]);
+  return trackedIntencity + targetLight.data[1] -
+         mult * (res.baseIntencity + hostLight.data[1]);
+}
+
+double WindowedOptimizer::linearize(const Problem &problem,
+                                    Linearization *lin) {
+  constexpr int fp = frameParams;
+  const int n = problem.frames.size();
+  const double outlierDiff = settings.intencity.outlierDiff;
+
+  StdVector<SE3> hostToTarget(n * n);
+  for (int h = 0; h < n; ++h)
+    for (int t = 0; t < n; ++t)
+      hostToTarget[h * n + t] = problem.frames[t]->thisToWorld.inverse() *
+                                problem.frames[h]->thisToWorld;
+
+  if (lin) {
+    lin->Hff.setZero(fp * n, fp * n);
+    lin->bf.setZero(fp * n);
+    lin->Hpp.assign(problem.points.size(), 0);
+    lin->bp.assign(problem.points.size(), 0);
+    lin->Hpf.setZero(problem.points.size(), fp * n);
+  }
+
+  double energy = 0;
+  for (const Residual &res : problem.residuals) {
+    if (!lin) {
+      energy +=
+          res.weight *
+          huberEnergy(residualValue(problem, res,
+                                    hostToTarget[res.host * n + res.target]),
+                      outlierDiff);
+      continue;
+    }
+
+    const KeyFrame *host = problem.frames[res.host];
+    const KeyFrame *target = problem.frames[res.target];
+    const SE3 &toTarget = hostToTarget[res.host * n + res.target];
+
+    double depth = std::exp(-problem.points[res.point]->logInvDepth);
+    Vec3 inHost = res.baseDirection * depth;
+    Vec3 inTarget = toTarget * inHost;
+    std::pair<Vec2, Mat23> mapped = cam->diffMap(inTarget);
+    double trackedIntencity, dIdy, dIdx;
+    target->imageTiles->evaluate(mapped.first[1], mapped.first[0],
+                                 &trackedIntencity, &dIdy, &dIdx);
+
+    const AffLight &hostLight = host->lightWorldToThis;
+    const AffLight &targetLight = target->lightWorldToThis;
+    double mult = std::exp(hostLight.data[0] - targetLight.data[0]);
+    double hostTransformed = mult * (res.baseIntencity + hostLight.data[1]);
+    double r = trackedIntencity + targetLight.data[1] - hostTransformed;
+
+    double absR = std::abs(r);
+    energy += res.weight * huberEnergy(r, outlierDiff);
+    double w = res.weight * (absR <= outlierDiff ? 1.0 : outlierDiff / absR);
+
+    Eigen::RowVector3d dRdPos =
+        Eigen::RowVector2d(dIdx, dIdy) * mapped.second;
+    Mat33 rot = toTarget.so3().matrix();
+    Mat36 dPosdHost, dPosdTarget;
+    dPosdHost << rot, -rot * SO3::hat(inHost);
+    dPosdTarget << -Mat33::Identity(), SO3::hat(inTarget);
+
+    FrameJacobian jHost, jTarget;
+    jHost.head<6>() = dRdPos * dPosdHost;
+    jHost[6] = -hostTransformed;
+    jHost[7] = -mult;
+    jTarget.head<6>() = dRdPos * dPosdTarget;
+    jTarget[6] = hostTransformed;
+    jTarget[7] = 1;
+    if (!settings.affineLight.optimizeAffineLight) {
+      jHost.tail<2>().setZero();
+      jTarget.tail<2>().setZero();
+    }
+    double jPoint = -dRdPos.dot(rot * inHost);
+
+    int ho = fp * res.host, to = fp * res.target;
+    lin->Hff.block<fp, fp>(ho, ho) += w * jHost.transpose() * jHost;
+    lin->Hff.block<fp, fp>(ho, to) += w * jHost.transpose() * jTarget;
+    lin->Hff.block<fp, fp>(to, ho) += w * jTarget.transpose() * jHost;
+    lin->Hff.block<fp, fp>(to, to) += w * jTarget.transpose() * jTarget;
+    lin->bf.segment<fp>(ho) += w * r * jHost.transpose();
+    lin->bf.segment<fp>(to) += w * r * jTarget.transpose();
+
+    lin->Hpp[res.point] += w * jPoint * jPoint;
+    lin->bp[res.point] += w * jPoint * r;
+    lin->Hpf.block<1, fp>(res.point, ho) += w * jPoint * jHost;
+    lin->Hpf.block<1, fp>(res.point, to) += w * jPoint * jTarget;
+  }
+
+  return energy;
+}
+
+double WindowedOptimizer::priorAt(const Problem &problem, MatXX *H, VecX *b) {
+  constexpr int fp = frameParams;
+  const int n = problem.frames.size();
+  H->setZero(fp * n, fp * n);
+  b->setZero(fp * n);
+  if (priorFrames.empty())
+    return 0;
+
+  std::vector<int> ind(priorFrames.size());
+  for (int i = 0; i < priorFrames.size(); ++i) {
+    auto it = std::find(problem.frames.begin(), problem.frames.end(),
+                        priorFrames[i]);
+    if (it == problem.frames.end()) {
+      LOG(WARNING) << "prior keyframe is not in the window, prior ignored";
+      return 0;
+    }
+    ind[i] = it - problem.frames.begin();
+  }
+
+  VecX dx(fp * priorFrames.size());
+  for (int i = 0; i < priorFrames.size(); ++i) {
+    dx.segment<6>(fp * i) =
+        (priorLinThisToWorld[i].inverse() * priorFrames[i]->thisToWorld).log();
+    dx[fp * i + 6] =
+        priorFrames[i]->lightWorldToThis.data[0] - priorLinLight[i].data[0];
+    dx[fp * i + 7] =
+        priorFrames[i]->lightWorldToThis.data[1] - priorLinLight[i].data[1];
+  }
+
+  VecX grad = priorB + priorH * dx;
+  for (int i = 0; i < priorFrames.size(); ++i) {
+    b->segment<fp>(fp * ind[i]) = grad.segment<fp>(fp * i);
+    for (int j = 0; j < priorFrames.size(); ++j)
+      H->block<fp, fp>(fp * ind[i], fp * ind[j]) =
+          priorH.block<fp, fp>(fp * i, fp * j);
+  }
+
+  return priorB.dot(dx) + 0.5 * dx.dot(priorH * dx);
+}
+
+void WindowedOptimizer::schurPoints(const Linearization &lin, double lambda,
+                                    MatXX &H, VecX &b) {
+  for (int p = 0; p < lin.Hpp.size(); ++p) {
+    double hpp = lin.Hpp[p] * (1 + lambda);
+    if (hpp <= 0)
+      continue;
+    H.noalias() -= lin.Hpf.row(p).transpose() * lin.Hpf.row(p) / hpp;
+    b.noalias() -= lin.Hpf.row(p).transpose() * (lin.bp[p] / hpp);
+  }
+}
+
+void WindowedOptimizer::adjust(const std::vector<KeyFrame *> &window,
+                               int maxIterations) {
+  constexpr int fp = frameParams;
+  CHECK_GE(window.size(), 2);
+
+  Problem problem = buildProblem(window, window);
+  const int n = window.size();
+
+  std::vector<bool> isFixed(fp * n, false);
+  if (!hasPrior()) {
+    std::fill(isFixed.begin(), isFixed.begin() + fp, true);
+    if (settings.bundleAdjuster.fixedMotionOnFirstAdjustent && n == 2)
+      std::fill(isFixed.begin() + fp, isFixed.end(), true);
+    if (settings.bundleAdjuster.fixedRotationOnSecondKF)
+      std::fill(isFixed.begin() + fp + 3, isFixed.begin() + fp + 6, true);
+  }
+  if (!settings.affineLight.optimizeAffineLight)
+    for (int f = 0; f < n; ++f)
+      isFixed[fp * f + 6] = isFixed[fp * f + 7] = true;
+
+  Linearization lin;
+  MatXX priorHess;
+  VecX priorGrad;
+  double energy =
+      linearize(problem, &lin) + priorAt(problem, &priorHess, &priorGrad);
+  double initialEnergy = energy;
+  double lambda = settings.bundleAdjuster.initialLmLambda;
+
+  StdVector<SE3> backupThisToWorld(n);
+  std::vector<AffLight> backupLight(n);
+  std::vector<double> backupLogInvDepth(problem.points.size());
+
+  const double minLogInvDepth = -std::log(settings.depth.max);
+  const double maxLogInvDepth = -std::log(settings.depth.min);
+
+  int it = 0;
+  for (; it < maxIterations; ++it) {
+    MatXX H = lin.Hff + priorHess;
+    VecX b = lin.bf + priorGrad;
+    H.diagonal() = H.diagonal() * (1 + lambda) +
+                   VecX::Constant(H.rows(), 1e-9 * (1 + lambda));
+    schurPoints(lin, lambda, H, b);
+    for (int i = 0; i < fp * n; ++i)
+      if (isFixed[i]) {
+        H.row(i).setZero();
+        H.col(i).setZero();
+        H(i, i) = 1;
+        b[i] = 0;
+      }
+    VecX dx = H.ldlt().solve(-b);
+
+    for (int f = 0; f < n; ++f) {
+      KeyFrame *kf = problem.frames[f];
+      backupThisToWorld[f] = kf->thisToWorld;
+      backupLight[f] = kf->lightWorldToThis;
+      kf->thisToWorld = kf->thisToWorld * SE3::exp(dx.segment<6>(fp * f));
+      kf->lightWorldToThis.data[0] = std::clamp(
+          kf->lightWorldToThis.data[0] + dx[fp * f + 6],
+          settings.affineLight.minAffineLightA,
+          settings.affineLight.maxAffineLightA);
+      kf->lightWorldToThis.data[1] = std::clamp(
+          kf->lightWorldToThis.data[1] + dx[fp * f + 7],
+          settings.affineLight.minAffineLightB,
+          settings.affineLight.maxAffineLightB);
+    }
+    for (int p = 0; p < problem.points.size(); ++p) {
+      double &logInvDepth = problem.points[p]->logInvDepth;
+      backupLogInvDepth[p] = logInvDepth;
+      double hpp = lin.Hpp[p] * (1 + lambda);
+      if (hpp <= 0)
+        continue;
+      double step = -(lin.bp[p] + lin.Hpf.row(p).dot(dx)) / hpp;
+      logInvDepth =
+          std::clamp(logInvDepth + step, minLogInvDepth, maxLogInvDepth);
+    }
+
+    Linearization newLin;
+    MatXX newPriorHess;
+    VecX newPriorGrad;
+    double newEnergy = linearize(problem, &newLin) +
+                       priorAt(problem, &newPriorHess, &newPriorGrad);
+    if (newEnergy < energy) {
+      double relDecrease = (energy - newEnergy) / energy;
+      energy = newEnergy;
+      lin = std::move(newLin);
+      priorHess = std::move(newPriorHess);
+      priorGrad = std::move(newPriorGrad);
+      lambda *= 0.5;
+      if (relDecrease < 1e-6)
+        break;
+    } else {
+      for (int f = 0; f < n; ++f) {
+        problem.frames[f]->thisToWorld = backupThisToWorld[f];
+        problem.frames[f]->lightWorldToThis = backupLight[f];
+      }
+      for (int p = 0; p < problem.points.size(); ++p)
+        problem.points[p]->logInvDepth = backupLogInvDepth[p];
+      lambda *= 4;
+    }
+  }
+
+  DSO_LOG(BA, 1) << "windowed BA: " << n << " keyframes, "
+                 << problem.points.size() << " points, "
+                 << problem.residuals.size() << " residuals, " << it
+                 << " iterations, energy " << initialEnergy << " -> " << energy
+                 << (hasPrior() ? " (with prior)" : "");
+
+  classifyOutliers(problem);
+}
+
+void WindowedOptimizer::classifyOutliers(const Problem &problem) {
+  const int n = problem.frames.size();
+  StdVector<SE3> hostToTarget(n * n);
+  for (int h = 0; h < n; ++h)
+    for (int t = 0; t < n; ++t)
+      hostToTarget[h * n + t] = problem.frames[t]->thisToWorld.inverse() *
+                                problem.frames[h]->thisToWorld;
+
+  std::vector<std::vector<double>> values(problem.points.size());
+  for (const Residual &res : problem.residuals)
+    values[res.point].push_back(std::abs(residualValue(
+        problem, res, hostToTarget[res.host * n + res.target])));
+
+  int pointsOutliers = 0;
+  for (int p = 0; p < problem.points.size(); ++p) {
+    std::vector<double> &v = values[p];
+    std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+    if (v[v.size() / 2] > settings.intencity.outlierDiff) {
+      problem.points[p]->state = OptimizedPoint::OUTLIER;
+      pointsOutliers++;
+    }
+  }
+
+  DSO_LOG(BA, 1) << "outlier points = " << pointsOutliers;
+}
+
+void WindowedOptimizer::marginalizeFrame(const Linearization &lin, int k,
+                                         MatXX &resH, VecX &resB) {
+  constexpr int fp = frameParams;
+  const int n = lin.bf.size() / fp;
+  MatXX H = lin.Hff;
+  VecX b = lin.bf;
+  schurPoints(lin, 0, H, b);
+
+  std::vector<int> keep;
+  keep.reserve(fp * (n - 1));
+  for (int f = 0; f < n; ++f)
+    if (f != k)
+      for (int j = 0; j < fp; ++j)
+        keep.push_back(fp * f + j);
+
+  const int m = keep.size();
+  MatXX Hrr(m, m), Hrk(m, fp);
+  VecX br(m);
+  for (int i = 0; i < m; ++i) {
+    br[i] = b[keep[i]];
+    for (int j = 0; j < m; ++j)
+      Hrr(i, j) = H(keep[i], keep[j]);
+    for (int j = 0; j < fp; ++j)
+      Hrk(i, j) = H(keep[i], fp * k + j);
+  }
+  Mat88 Hkk = H.block<fp, fp>(fp * k, fp * k);
+  Vec8 bk = b.segment<fp>(fp * k);
+  // affine light parameters might be unconstrained
+  Hkk.diagonal().array() += 1e-9 * (1 + Hkk.diagonal().maxCoeff());
+  Eigen::LDLT<Mat88> HkkLdlt(Hkk);
+
+  resH = Hrr - Hrk * HkkLdlt.solve(Hrk.transpose());
+  resH = 0.5 * (resH + resH.transpose()).eval();
+  resB = br - Hrk * HkkLdlt.solve(bk);
+}
+
+void WindowedOptimizer::marginalize(KeyFrame *keyFrame,
+                                    const std::vector<KeyFrame *> &window) {
+  auto kfIt = std::find(window.begin(), window.end(), keyFrame);
+  CHECK(kfIt != window.end());
+  const int k = kfIt - window.begin();
+  const int n = window.size();
+
+  // Only the residuals hosted by keyFrame are folded in, and their points
+  // leave with it. The ones hosted by the other keyframes and observed in
+  // keyFrame are dropped, as in DSO: their points stay in the window, so
+  // folding them in would need marginalizing those depths too, which would
+  // either throw the points away or tie every other residual of theirs to a
+  // dense prior. What is lost is only the keyFrame side of those
+  // observations, and the points keep constraining the hosts through the
+  // remaining targets.
+  Problem problem = buildProblem(window, {keyFrame});
+  Linearization lin;
+  linearize(problem, &lin);
+
+  MatXX oldPriorH;
+  VecX oldPriorB;
+  priorAt(problem, &oldPriorH, &oldPriorB);
+  lin.Hff += oldPriorH;
+  lin.bf += oldPriorB;
+
+  marginalizeFrame(lin, k, priorH, priorB);
+
+  priorFrames.clear();
+  priorLinThisToWorld.clear();
+  priorLinLight.clear();
+  for (int f = 0; f < n; ++f)
+    if (f != k) {
+      priorFrames.push_back(window[f]);
+      priorLinThisToWorld.push_back(window[f]->thisToWorld);
+      priorLinLight.push_back(window[f]->lightWorldToThis);
+    }
+
+  DSO_LOG(BA, 1) << "marginalized keyframe #"
+                 << keyFrame->preKeyFrame->globalFrameNum << " with "
+                 << problem.points.size() << " points into the prior";
+}
+
+} // namespace fishdso
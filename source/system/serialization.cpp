@@ -1,6 +1,14 @@
 #include "system/serialization.h"
 #include "system/KeyFrame.h"
+#include <algorithm>
 #include <boost/math/special_functions/nonfinite_num_facets.hpp>
+#include <fcntl.h>
+#include <opencv2/imgcodecs.hpp>
+#include <set>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace fishdso {
 
@@ -11,36 +19,265 @@ std::locale correctLocale() {
   return std::locale(tmpLocale, new boost::math::nonfinite_num_get<char>());
 }
 
-DataSerializer<STORE>::DataSerializer(const fs::path &fname)
-    : stream(fname) {
-  stream.precision(std::numeric_limits<double>::max_digits10 + 1);
-  stream.imbue(correctLocale());
+// header of binary files, padded to keep the data 8-byte aligned
+constexpr char binaryMagic[8] = {'F', 'I', 'S', 'H', 'D', 'S', 'O', 'B'};
+constexpr int32_t binaryVersion = 1;
+constexpr int binaryHeaderSize = sizeof(binaryMagic) + 2 * sizeof(int32_t);
+
+namespace {
+
+constexpr char manifestName[] = "manifest.txt";
+
+// One line of the manifest of DeltaSnapshotSaver:
+// <delta> full <n> <frame numbers> state <n> <frame numbers>
+// window <n> <frame numbers> end
+struct ManifestEntry {
+  int delta;
+  std::vector<int> full;
+  std::vector<int> state;
+  std::vector<int> window;
+};
+
+bool parseManifestLine(const std::string &line, ManifestEntry &entry) {
+  std::stringstream lineStream(line);
+  std::string tag;
+  auto readList = [&](const char *expectedTag, std::vector<int> &nums) {
+    int size;
+    if (!(lineStream >> tag >> size) || tag != expectedTag || size < 0)
+      return false;
+    nums.resize(size);
+    for (int &num : nums)
+      if (!(lineStream >> num))
+        return false;
+    return true;
+  };
+  return (lineStream >> entry.delta) && readList("full", entry.full) &&
+         readList("state", entry.state) && readList("window", entry.window) &&
+         (lineStream >> tag) && tag == "end";
+}
+
+// The complete lines only, a line that was being appended when the writer
+// stopped is not. completeSize is how many bytes they take.
+std::vector<ManifestEntry> readManifest(const fs::path &fname,
+                                        size_t *completeSize = nullptr) {
+  std::vector<ManifestEntry> entries;
+  std::ifstream ifs(fname);
+  std::string line;
+  size_t size = 0;
+  // without the newline it is the last and unfinished one
+  while (std::getline(ifs, line) && !ifs.eof()) {
+    ManifestEntry entry;
+    if (!parseManifestLine(line, entry))
+      break;
+    entries.push_back(entry);
+    size += line.size() + 1;
+  }
+  if (completeSize)
+    *completeSize = size;
+  return entries;
+}
+
+// "<prefix><number><suffix>"
+bool parseNumberedName(const std::string &name, const std::string &prefix,
+                       const std::string &suffix, int &num) {
+  if (name.size() <= prefix.size() + suffix.size() ||
+      name.compare(0, prefix.size(), prefix) != 0 ||
+      name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+    return false;
+  std::string digits =
+      name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+  if (!std::all_of(digits.begin(), digits.end(),
+                   [](char c) { return c >= '0' && c <= '9'; }))
+    return false;
+  num = std::stoi(digits);
+  return true;
+}
+
+// the level 0 of its pyramid, see FrameEmbedding
+cv::Mat1b loadFrame(const fs::path &frameFname) {
+  DataSerializer<LOAD> frameData(frameFname);
+  int embedding, rows, cols;
+  frameData.process(embedding);
+  frameData.process(rows);
+  frameData.process(cols);
+  std::vector<uchar> bytes;
+  frameData.process(bytes);
+
+  cv::Mat1b frame;
+  if (embedding == PNG_FRAMES)
+    frame = cv::imdecode(bytes, cv::IMREAD_GRAYSCALE);
+  else {
+    CHECK_EQ(embedding, RAW_FRAMES) << "unknown frame embedding";
+    CHECK_EQ(bytes.size(), size_t(rows) * cols);
+    frame = cv::Mat1b(rows, cols);
+    std::memcpy(frame.data, bytes.data(), bytes.size());
+  }
+  CHECK(!frame.empty() && frame.rows == rows && frame.cols == cols)
+      << "could not decode " << frameFname;
+  return frame;
+}
+
+fs::path trackedFrameFname(const fs::path &snapshotDir, int frameNum) {
+  return snapshotDir / ("pkf" + std::to_string(frameNum) + ".txt");
+}
+
+fs::path deltaStateFname(const fs::path &deltaDir, int frameNum) {
+  return deltaDir / ("state" + std::to_string(frameNum) + ".txt");
+}
+
+void syncPath(const fs::path &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0) << "could not open " << path;
+  CHECK_EQ(fsync(fd), 0) << "could not sync " << path;
+  close(fd);
+}
+
+// FNV-1a over the bytes of the values
+class Fingerprint {
+public:
+  template <typename T> void add(const T &val) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&val);
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ull;
+    }
+  }
+  void add(const Vec2 &vec) {
+    add(vec[0]);
+    add(vec[1]);
+  }
+  void add(const SE3 &motion) {
+    for (int i = 0; i < SE3::num_parameters; ++i)
+      add(motion.data()[i]);
+  }
+  void add(const AffLight &affLight) {
+    add(affLight.data[0]);
+    add(affLight.data[1]);
+  }
+
+  uint64_t hash = 14695981039346656037ull;
+};
+
+uint64_t structureHash(const KeyFrame &keyFrame) {
+  Fingerprint fingerprint;
+  fingerprint.add(int(keyFrame.immaturePoints.size()));
+  for (const auto &ip : keyFrame.immaturePoints)
+    fingerprint.add(ip->p);
+  fingerprint.add(int(keyFrame.optimizedPoints.size()));
+  for (const auto &op : keyFrame.optimizedPoints)
+    fingerprint.add(op->p);
+  return fingerprint.hash;
+}
+
+uint64_t stateHash(const KeyFrame &keyFrame) {
+  Fingerprint fingerprint;
+  fingerprint.add(keyFrame.thisToWorld);
+  fingerprint.add(keyFrame.lightWorldToThis);
+  for (const auto &ip : keyFrame.immaturePoints) {
+    fingerprint.add(ip->minDepth);
+    fingerprint.add(ip->maxDepth);
+    fingerprint.add(ip->depth);
+    fingerprint.add(ip->bestQuality);
+    fingerprint.add(ip->lastEnergy);
+    fingerprint.add(ip->stddev);
+    fingerprint.add(int(ip->state));
+  }
+  for (const auto &op : keyFrame.optimizedPoints) {
+    fingerprint.add(op->logInvDepth);
+    fingerprint.add(op->stddev);
+    fingerprint.add(int(op->state));
+  }
+  fingerprint.add(int(keyFrame.trackedFrames.size()));
+  return fingerprint.hash;
+}
+
+} // namespace
+
+DataSerializer<STORE>::DataSerializer(const fs::path &fname,
+                                      SerializerFormat format)
+    : format(format)
+    , stream(fname, format == BINARY
+                        ? std::ios_base::out | std::ios_base::binary
+                        : std::ios_base::out) {
+  if (format == BINARY) {
+    int32_t reserved = 0;
+    stream.write(binaryMagic, sizeof(binaryMagic));
+    stream.write(reinterpret_cast<const char *>(&binaryVersion),
+                 sizeof(binaryVersion));
+    stream.write(reinterpret_cast<const char *>(&reserved), sizeof(reserved));
+  } else {
+    stream.precision(std::numeric_limits<double>::max_digits10 + 1);
+    stream.imbue(correctLocale());
+  }
 }
 
 DataSerializer<LOAD>::DataSerializer(const fs::path &fname)
-    : stream(fname) {
-  stream.imbue(correctLocale());
+    : mapped(nullptr)
+    , mappedSize(0)
+    , cur(nullptr)
+    , mappedEnd(nullptr) {
+  int fd = open(fname.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0) << "could not open " << fname;
+  struct stat fileStat;
+  CHECK_EQ(fstat(fd, &fileStat), 0);
+  size_t fileSize = fileStat.st_size;
+
+  char magic[sizeof(binaryMagic)];
+  bool isBinary =
+      fileSize >= binaryHeaderSize &&
+      pread(fd, magic, sizeof(magic), 0) == ssize_t(sizeof(magic)) &&
+      std::memcmp(magic, binaryMagic, sizeof(magic)) == 0;
+  if (isBinary) {
+    void *addr = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    CHECK(addr != MAP_FAILED) << "could not map " << fname;
+    mapped = static_cast<char *>(addr);
+    mappedSize = fileSize;
+    int32_t version;
+    std::memcpy(&version, mapped + sizeof(binaryMagic), sizeof(version));
+    CHECK_EQ(version, binaryVersion) << "unsupported snapshot version";
+    cur = mapped + binaryHeaderSize;
+    mappedEnd = mapped + mappedSize;
+  }
+  close(fd);
+
+  if (!isBinary) {
+    stream.open(fname);
+    stream.imbue(correctLocale());
+  }
 }
 
-template <SerializerMode mode>
-PointSerializer<mode>::PointSerializer(const fs::path &pointsFname,
-                                       int patternSize)
+DataSerializer<LOAD>::~DataSerializer() {
+  if (mapped)
+    munmap(mapped, mappedSize);
+}
+
+template <>
+PointSerializer<STORE>::PointSerializer(const fs::path &pointsFname,
+                                        int patternSize,
+                                        SerializerFormat format)
+    : dataSerializer(pointsFname, format)
+    , PS(patternSize) {}
+
+template <>
+PointSerializer<LOAD>::PointSerializer(const fs::path &pointsFname,
+                                       int patternSize, SerializerFormat)
     : dataSerializer(pointsFname)
     , PS(patternSize) {}
 
 template <SerializerMode mode>
 void PointSerializer<mode>::process(RefT<mode, ImmaturePoint> p) {
   dataSerializer.process(p.p);
+  ImmaturePointBlockBase::PatternRef pattern = p.pattern();
   for (int i = 0; i < PS; ++i)
-    dataSerializer.process(p.baseDirections[i]);
+    dataSerializer.process(pattern.directions[i]);
   dataSerializer.process(
-      p.baseDirections[0]); // for compatibility with multicamera version
+      pattern.directions[0]); // for compatibility with multicamera version
   for (int i = 0; i < PS; ++i)
-    dataSerializer.process(p.baseIntencities[i]);
+    dataSerializer.process(pattern.intencities[i]);
   for (int i = 0; i < PS; ++i)
-    dataSerializer.process(p.baseGrad[i]);
+    dataSerializer.process(pattern.grads[i]);
   for (int i = 0; i < PS; ++i)
-    dataSerializer.process(p.baseGradNorm[i]);
+    dataSerializer.process(pattern.gradNorms[i]);
   dataSerializer.process(p.minDepth);
   dataSerializer.process(p.maxDepth);
   dataSerializer.process(p.depth);
@@ -77,14 +314,37 @@ void PointSerializer<mode>::process(RefT<mode, OptimizedPoint> p) {
 PreKeyFrameLoader::PreKeyFrameLoader(const MultiFovReader *datasetReader,
                                      CameraModel *cam, KeyFrame *baseFrame,
                                      const fs::path &preKeyFrameFname,
-                                     const Settings::Pyramid &pyramidSettings)
+                                     const Settings::Pyramid &pyramidSettings,
+                                     const fs::path &frameFname)
     : datasetReader(datasetReader)
     , cam(cam)
     , baseFrame(baseFrame)
     , preKeyFrameFname(preKeyFrameFname)
-    , pyramidSettings(pyramidSettings) {}
+    , pyramidSettings(pyramidSettings)
+    , frameFname(frameFname) {}
 
 std::shared_ptr<PreKeyFrame> PreKeyFrameLoader::load() const {
+  TrackedFrameRecord record = loadRecord();
+
+  std::shared_ptr<PreKeyFrame> preKeyFrame;
+  if (!frameFname.empty()) {
+    // the colour image is made out of the gray one
+    SourceFrame frame = {loadFrame(frameFname), {}, record.globalFrameNum};
+    preKeyFrame.reset(new PreKeyFrame(baseFrame, cam, frame, pyramidSettings));
+  } else {
+    CHECK(datasetReader) << "the frame #" << record.globalFrameNum
+                         << " is not embedded into the snapshot, the "
+                            "dataset is needed to load it";
+    cv::Mat frame = datasetReader->getFrame(record.globalFrameNum);
+    preKeyFrame.reset(new PreKeyFrame(baseFrame, cam, frame,
+                                      record.globalFrameNum, pyramidSettings));
+  }
+  preKeyFrame->baseToThis = record.baseToThis;
+  preKeyFrame->lightBaseToThis = record.lightBaseToThis;
+  return preKeyFrame;
+}
+
+TrackedFrameRecord PreKeyFrameLoader::loadRecord() const {
   DataSerializer<LOAD> dataSerializer(preKeyFrameFname);
 
   SE3 baseToTracked;
@@ -93,22 +353,35 @@ std::shared_ptr<PreKeyFrame> PreKeyFrameLoader::load() const {
   dataSerializer.process(baseToTracked);
   dataSerializer.process(globalFrameNum);
   dataSerializer.process(lightBaseToTracked);
-
-  cv::Mat frame = datasetReader->getFrame(globalFrameNum);
-
-  std::shared_ptr<PreKeyFrame> preKeyFrame(
-      new PreKeyFrame(baseFrame, cam, frame, globalFrameNum, pyramidSettings));
-  preKeyFrame->baseToThis = baseToTracked;
-  preKeyFrame->lightBaseToThis = lightBaseToTracked;
-  return preKeyFrame;
+  return TrackedFrameRecord(baseToTracked, lightBaseToTracked, globalFrameNum);
 }
 
 void PreKeyFrameSaver::store(const fs::path &preKeyFrameFname,
-                             const PreKeyFrame &preKeyFrame) {
-  DataSerializer<STORE> dataSerializer(preKeyFrameFname);
-  dataSerializer.process(preKeyFrame.baseToThis);
-  dataSerializer.process(preKeyFrame.globalFrameNum);
-  dataSerializer.process(preKeyFrame.lightBaseToThis);
+                             const TrackedFrameRecord &record,
+                             SerializerFormat format) {
+  DataSerializer<STORE> dataSerializer(preKeyFrameFname, format);
+  dataSerializer.process(record.baseToThis);
+  dataSerializer.process(record.globalFrameNum);
+  dataSerializer.process(record.lightBaseToThis);
+}
+
+void PreKeyFrameSaver::storeFrame(const fs::path &frameFname,
+                                  const cv::Mat1b &frame,
+                                  FrameEmbedding embedding,
+                                  SerializerFormat format) {
+  CHECK_NE(embedding, NO_FRAMES);
+  std::vector<uchar> bytes;
+  if (embedding == PNG_FRAMES)
+    CHECK(cv::imencode(".png", frame, bytes)) << "could not encode a frame";
+  else
+    for (int y = 0; y < frame.rows; ++y)
+      bytes.insert(bytes.end(), frame.ptr(y), frame.ptr(y) + frame.cols);
+
+  DataSerializer<STORE> frameData(frameFname, format);
+  frameData.process(int(embedding));
+  frameData.process(frame.rows);
+  frameData.process(frame.cols);
+  frameData.process(bytes);
 }
 
 KeyFrameLoader::KeyFrameLoader(const MultiFovReader *datasetReader,
@@ -119,15 +392,18 @@ KeyFrameLoader::KeyFrameLoader(const MultiFovReader *datasetReader,
     , snapshotDir(snapshotDir)
     , cam(cam)
     , kfSettings(kfSettings)
-    , tracerSettings(tracerSettings) {}
+    , tracerSettings(
+          std::make_shared<const PointTracerSettings>(tracerSettings)) {}
 
 void KeyFrameLoader::load(const fs::path &keyFrameDir,
                           StdMap<int, KeyFrame> &keyFrames) const {
-  int patternSize = tracerSettings.residualPattern.pattern().size();
+  int patternSize = tracerSettings->residualPattern.pattern().size();
 
+  fs::path frameFname = keyFrameDir / "frame.txt";
   std::shared_ptr<PreKeyFrame> preKeyFrame =
       PreKeyFrameLoader(datasetReader, cam, nullptr, keyFrameDir / "pkf.txt",
-                        tracerSettings.pyramid)
+                        tracerSettings->pyramid,
+                        fs::exists(frameFname) ? frameFname : fs::path())
           .load();
   int frameNum = preKeyFrame->globalFrameNum;
   auto [keyFrameIt, insertionOk] = keyFrames.insert(
@@ -154,6 +430,42 @@ void KeyFrameLoader::load(const fs::path &keyFrameDir,
   loadTrackedVector(ownData, keyFrame);
 }
 
+void KeyFrameLoader::loadState(const fs::path &stateFname,
+                               KeyFrame &keyFrame) const {
+  DataSerializer<LOAD> stateData(stateFname);
+
+  int globalFrameNum;
+  stateData.process(globalFrameNum);
+  CHECK_EQ(globalFrameNum, keyFrame.preKeyFrame->globalFrameNum);
+  stateData.process(keyFrame.thisToWorld);
+  stateData.process(keyFrame.lightWorldToThis);
+
+  int size;
+  stateData.process(size);
+  CHECK_EQ(size, int(keyFrame.immaturePoints.size()));
+  for (const auto &ip : keyFrame.immaturePoints) {
+    stateData.process(ip->minDepth);
+    stateData.process(ip->maxDepth);
+    stateData.process(ip->depth);
+    stateData.process(ip->bestQuality);
+    stateData.process(ip->lastEnergy);
+    stateData.process(ip->stddev);
+    stateData.process(ip->state);
+  }
+  stateData.process(size);
+  CHECK_EQ(size, int(keyFrame.optimizedPoints.size()));
+  for (const auto &op : keyFrame.optimizedPoints) {
+    stateData.process(op->logInvDepth);
+    stateData.process(op->stddev);
+    int state;
+    stateData.process(state);
+    op->state = OptimizedPoint::State(state);
+  }
+
+  keyFrame.trackedFrames.clear();
+  loadTrackedVector(stateData, keyFrame);
+}
+
 template <typename PointT>
 void KeyFrameLoader::loadPointVector(
     DataSerializer<LOAD> &ownData, KeyFrame &baseFrame,
@@ -178,29 +490,40 @@ void KeyFrameLoader::loadTrackedVector(DataSerializer<LOAD> &ownData,
     PreKeyFrameLoader preKeyFrameLoader(
         datasetReader, cam, &keyFrame,
         snapshotDir / ("pkf" + std::to_string(preKeyFrameNum) + ".txt"),
-        tracerSettings.pyramid);
-    keyFrame.trackedFrames.push_back(preKeyFrameLoader.load());
+        tracerSettings->pyramid);
+    keyFrame.trackedFrames.push_back(preKeyFrameLoader.loadRecord());
   }
 }
 
-KeyFrameSaver::KeyFrameSaver(const fs::path &snapshotDir, int patternSize)
+KeyFrameSaver::KeyFrameSaver(const fs::path &snapshotDir, int patternSize,
+                             SerializerFormat format,
+                             FrameEmbedding frameEmbedding,
+                             bool storeTrackedFrames)
     : snapshotDir(snapshotDir)
-    , patternSize(patternSize) {}
+    , patternSize(patternSize)
+    , format(format)
+    , frameEmbedding(frameEmbedding)
+    , storeTrackedFrames(storeTrackedFrames) {}
 
 void KeyFrameSaver::store(const KeyFrame &keyFrame) const {
   int frameNum = keyFrame.preKeyFrame->globalFrameNum;
   fs::path keyFrameDir(snapshotDir / ("kf" + std::to_string(frameNum)));
   fs::create_directories(keyFrameDir);
 
-  DataSerializer<STORE> ownData(keyFrameDir / "kf.txt");
+  DataSerializer<STORE> ownData(keyFrameDir / "kf.txt", format);
 
-  PreKeyFrameSaver::store(keyFrameDir / "pkf.txt", *keyFrame.preKeyFrame);
+  PreKeyFrameSaver::store(keyFrameDir / "pkf.txt", *keyFrame.preKeyFrame,
+                          format);
+  if (frameEmbedding != NO_FRAMES)
+    PreKeyFrameSaver::storeFrame(keyFrameDir / "frame.txt",
+                                 keyFrame.preKeyFrame->frame(), frameEmbedding,
+                                 format);
 
   PointSerializer<STORE> immaturePointSerializer(
-      keyFrameDir / "immaturePoints.txt", patternSize);
+      keyFrameDir / "immaturePoints.txt", patternSize, format);
   storePointVector(ownData, keyFrame.immaturePoints, immaturePointSerializer);
   PointSerializer<STORE> optimizedPointSerializer(
-      keyFrameDir / "optimizedPoints.txt", patternSize);
+      keyFrameDir / "optimizedPoints.txt", patternSize, format);
   storePointVector(ownData, keyFrame.optimizedPoints, optimizedPointSerializer);
 
   ownData.process(frameNum);
@@ -209,6 +532,34 @@ void KeyFrameSaver::store(const KeyFrame &keyFrame) const {
   storeTrackedVector(ownData, keyFrame);
 }
 
+void KeyFrameSaver::storeState(const fs::path &stateFname,
+                               const KeyFrame &keyFrame) const {
+  DataSerializer<STORE> stateData(stateFname, format);
+
+  stateData.process(keyFrame.preKeyFrame->globalFrameNum);
+  stateData.process(keyFrame.thisToWorld);
+  stateData.process(keyFrame.lightWorldToThis);
+
+  stateData.process(int(keyFrame.immaturePoints.size()));
+  for (const auto &ip : keyFrame.immaturePoints) {
+    stateData.process(ip->minDepth);
+    stateData.process(ip->maxDepth);
+    stateData.process(ip->depth);
+    stateData.process(ip->bestQuality);
+    stateData.process(ip->lastEnergy);
+    stateData.process(ip->stddev);
+    stateData.process(ip->state);
+  }
+  stateData.process(int(keyFrame.optimizedPoints.size()));
+  for (const auto &op : keyFrame.optimizedPoints) {
+    stateData.process(op->logInvDepth);
+    stateData.process(op->stddev);
+    stateData.process(int(op->state));
+  }
+
+  storeTrackedVector(stateData, keyFrame);
+}
+
 template <typename PointT>
 void KeyFrameSaver::storePointVector(
     DataSerializer<STORE> &ownData,
@@ -223,11 +574,11 @@ void KeyFrameSaver::storeTrackedVector(DataSerializer<STORE> &ownData,
                                        const KeyFrame &keyFrame) const {
   ownData.process(int(keyFrame.trackedFrames.size()));
   for (int j = 0; j < keyFrame.trackedFrames.size(); ++j) {
-    int preKeyFrameNum = keyFrame.trackedFrames[j]->globalFrameNum;
+    int preKeyFrameNum = keyFrame.trackedFrames[j].globalFrameNum;
     ownData.process(preKeyFrameNum);
-    PreKeyFrameSaver().store(
-        snapshotDir / ("pkf" + std::to_string(preKeyFrameNum) + ".txt"),
-        *keyFrame.trackedFrames[j]);
+    if (storeTrackedFrames)
+      PreKeyFrameSaver().store(trackedFrameFname(snapshotDir, preKeyFrameNum),
+                               keyFrame.trackedFrames[j], format);
   }
 }
 
@@ -239,45 +590,228 @@ SnapshotLoader::SnapshotLoader(const MultiFovReader *datasetReader,
     , snapshotDir(snapshotDir)
     , settings(settings) {}
 
-void SnapshotLoader::loadDepthColBounds() const {
-  fs::path depthCols = snapshotDir / "depth_col.txt";
-  std::ifstream ifs(depthCols);
-  ifs >> minDepthCol >> maxDepthCol;
-}
-
 void SnapshotLoader::load(StdMap<int, KeyFrame> &keyFrames) const {
   CHECK(fs::is_directory(snapshotDir));
 
   KeyFrameLoader keyFrameLoader(datasetReader, snapshotDir, cam,
                                 settings.keyFrame,
                                 settings.getPointTracerSettings());
+
+  if (fs::exists(snapshotDir / manifestName)) {
+    std::vector<ManifestEntry> entries =
+        readManifest(snapshotDir / manifestName);
+    CHECK(!entries.empty()) << "no complete deltas in " << snapshotDir;
+    // frame number -> the deltas that have it in full and its state
+    std::map<int, std::pair<int, int>> latest;
+    for (const ManifestEntry &entry : entries) {
+      for (int num : entry.full)
+        latest[num] = {entry.delta, -1};
+      for (int num : entry.state) {
+        auto it = latest.find(num);
+        CHECK(it != latest.end())
+            << "delta " << entry.delta << " has the state of keyframe #"
+            << num << " that was never stored in full";
+        it->second.second = entry.delta;
+      }
+      std::set<int> window(entry.window.begin(), entry.window.end());
+      for (auto it = latest.begin(); it != latest.end();)
+        it = window.count(it->first) ? std::next(it) : latest.erase(it);
+    }
+
+    auto deltaDir = [this](int delta) {
+      return snapshotDir / ("delta" + std::to_string(delta));
+    };
+    for (const auto &[num, deltas] : latest) {
+      keyFrameLoader.load(deltaDir(deltas.first) / ("kf" + std::to_string(num)),
+                          keyFrames);
+      if (deltas.second >= 0)
+        keyFrameLoader.loadState(deltaStateFname(deltaDir(deltas.second), num),
+                                 keyFrames.at(num));
+    }
+    return;
+  }
+
   for (fs::path fname : fs::directory_iterator(snapshotDir)) {
     if (fs::is_directory(fname) && fname.string().size() >= 2 &&
         fname.stem().string().substr(0, 2) == "kf")
       keyFrameLoader.load(fname, keyFrames);
   }
-
-  loadDepthColBounds();
 }
 
-SnapshotSaver::SnapshotSaver(const fs::path &snapshotDir, int patternSize)
+SnapshotSaver::SnapshotSaver(const fs::path &snapshotDir, int patternSize,
+                             SerializerFormat format,
+                             FrameEmbedding frameEmbedding)
     : snapshotDir(snapshotDir)
-    , patternSize(patternSize) {}
-
-void SnapshotSaver::saveDepthColBounds() const {
-  fs::path depthCols = snapshotDir / "depth_col.txt";
-  std::ofstream ofs(depthCols);
-  ofs << minDepthCol << ' ' << maxDepthCol;
-}
+    , patternSize(patternSize)
+    , format(format)
+    , frameEmbedding(frameEmbedding) {}
 
 void SnapshotSaver::save(const KeyFrame *_keyFrames[], int numKeyFrames) const {
   fs::create_directories(snapshotDir);
-  KeyFrameSaver keyFrameSaver(snapshotDir, patternSize);
+  KeyFrameSaver keyFrameSaver(snapshotDir, patternSize, format,
+                              frameEmbedding);
   CHECK(fs::is_directory(snapshotDir));
   for (int j = 0; j < numKeyFrames; ++j)
     keyFrameSaver.store(*_keyFrames[j]);
+}
+
+DeltaSnapshotSaver::DeltaSnapshotSaver(const fs::path &snapshotDir,
+                                       int patternSize,
+                                       SerializerFormat format, int syncEvery,
+                                       FrameEmbedding frameEmbedding)
+    : snapshotDir(snapshotDir)
+    , patternSize(patternSize)
+    , format(format)
+    , syncEvery(syncEvery)
+    , frameEmbedding(frameEmbedding)
+    , nextDelta(0) {
+  CHECK_GE(syncEvery, 1);
+  fs::create_directories(snapshotDir);
+
+  // An unfinished last line of the manifest is cut off, and the deltas that
+  // were not listed are written anew.
+  fs::path manifestFname = snapshotDir / manifestName;
+  if (fs::exists(manifestFname)) {
+    size_t completeSize;
+    std::vector<ManifestEntry> entries =
+        readManifest(manifestFname, &completeSize);
+    fs::resize_file(manifestFname, completeSize);
+    if (!entries.empty())
+      nextDelta = entries.back().delta + 1;
+  }
+  std::vector<fs::path> unlisted;
+  for (const fs::path &path : fs::directory_iterator(snapshotDir)) {
+    int delta;
+    if (parseNumberedName(path.filename().string(), "delta", "", delta) &&
+        delta >= nextDelta)
+      unlisted.push_back(path);
+  }
+  for (const fs::path &path : unlisted)
+    fs::remove_all(path);
+}
+
+DeltaSnapshotSaver::~DeltaSnapshotSaver() { sync(); }
 
-  saveDepthColBounds();
+fs::path DeltaSnapshotSaver::deltaDir(int delta) const {
+  return snapshotDir / ("delta" + std::to_string(delta));
+}
+
+void DeltaSnapshotSaver::save(const KeyFrame *keyFrames[], int numKeyFrames) {
+  int delta = nextDelta++;
+  fs::path dir = deltaDir(delta);
+  fs::create_directories(dir);
+  KeyFrameSaver keyFrameSaver(dir, patternSize, format, frameEmbedding,
+                              false);
+
+  std::vector<int> full, state, window;
+  std::map<int, StoredKeyFrame> newStored;
+  for (int i = 0; i < numKeyFrames; ++i) {
+    const KeyFrame &keyFrame = *keyFrames[i];
+    int num = keyFrame.preKeyFrame->globalFrameNum;
+    window.push_back(num);
+
+    auto storedIt = stored.find(num);
+    bool isNew = storedIt == stored.end();
+    StoredKeyFrame entry = isNew ? StoredKeyFrame{0, 0, -1, -1, {}}
+                                 : std::move(storedIt->second);
+
+    // tracked frames are only appended to a keyframe
+    for (int j = entry.trackedNums.size(); j < keyFrame.trackedFrames.size();
+         ++j) {
+      const TrackedFrameRecord &tracked = keyFrame.trackedFrames[j];
+      fs::path fname = trackedFrameFname(snapshotDir, tracked.globalFrameNum);
+      PreKeyFrameSaver::store(fname, tracked, format);
+      pendingTracked.push_back(fname);
+      entry.trackedNums.push_back(tracked.globalFrameNum);
+    }
+
+    uint64_t newStructureHash = structureHash(keyFrame);
+    uint64_t newStateHash = stateHash(keyFrame);
+    if (isNew || newStructureHash != entry.structureHash) {
+      keyFrameSaver.store(keyFrame);
+      entry.fullDelta = delta;
+      entry.stateDelta = -1;
+      full.push_back(num);
+    } else if (newStateHash != entry.stateHash) {
+      keyFrameSaver.storeState(deltaStateFname(dir, num), keyFrame);
+      entry.stateDelta = delta;
+      state.push_back(num);
+    }
+    entry.structureHash = newStructureHash;
+    entry.stateHash = newStateHash;
+    newStored[num] = std::move(entry);
+  }
+  stored = std::move(newStored);
+
+  std::stringstream line;
+  line << delta;
+  auto writeList = [&line](const char *tag, const std::vector<int> &nums) {
+    line << ' ' << tag << ' ' << nums.size();
+    for (int num : nums)
+      line << ' ' << num;
+  };
+  writeList("full", full);
+  writeList("state", state);
+  writeList("window", window);
+  line << " end";
+  pending.push_back({delta, line.str()});
+
+  if (pending.size() >= syncEvery)
+    sync();
+}
+
+void DeltaSnapshotSaver::sync() {
+  if (pending.empty())
+    return;
+
+  for (const PendingDelta &delta : pending) {
+    fs::path dir = deltaDir(delta.num);
+    for (const auto &entry : fs::recursive_directory_iterator(dir))
+      syncPath(entry.path());
+    syncPath(dir);
+  }
+  for (const fs::path &fname : pendingTracked)
+    syncPath(fname);
+  syncPath(snapshotDir);
+
+  fs::path manifestFname = snapshotDir / manifestName;
+  bool isNewManifest = !fs::exists(manifestFname);
+  {
+    std::ofstream manifest(manifestFname, std::ios_base::app);
+    for (const PendingDelta &delta : pending)
+      manifest << delta.manifestLine << '\n';
+    CHECK(manifest) << "could not append to " << manifestFname;
+  }
+  syncPath(manifestFname);
+  if (isNewManifest)
+    syncPath(snapshotDir);
+
+  pending.clear();
+  pendingTracked.clear();
+  removeUnneeded();
+}
+
+void DeltaSnapshotSaver::removeUnneeded() const {
+  std::set<int> neededDeltas, neededTracked;
+  for (const auto &[num, entry] : stored) {
+    neededDeltas.insert(entry.fullDelta);
+    if (entry.stateDelta >= 0)
+      neededDeltas.insert(entry.stateDelta);
+    neededTracked.insert(entry.trackedNums.begin(), entry.trackedNums.end());
+  }
+
+  std::vector<fs::path> unneeded;
+  for (const fs::path &path : fs::directory_iterator(snapshotDir)) {
+    std::string name = path.filename().string();
+    int num;
+    if ((parseNumberedName(name, "delta", "", num) &&
+         !neededDeltas.count(num)) ||
+        (parseNumberedName(name, "pkf", ".txt", num) &&
+         !neededTracked.count(num)))
+      unneeded.push_back(path);
+  }
+  for (const fs::path &path : unneeded)
+    fs::remove_all(path);
 }
 
 template class PointSerializer<LOAD>;
@@ -0,0 +1,75 @@
+#include "util/BicubicTiles.h"
+#include <glog/logging.h>
+
+namespace fishdso {
+
+namespace {
+
+// rows give the coefficients of 1, t, t^2 and t^3 of the Catmull-Rom spline
+// through p0, p1, p2 and p3 on [p1, p2]
+constexpr float catmullRom[4][4] = {{0.0f, 1.0f, 0.0f, 0.0f},
+                                    {-0.5f, 0.0f, 0.5f, 0.0f},
+                                    {1.0f, -2.5f, 2.0f, -0.5f},
+                                    {-0.5f, 1.5f, -1.5f, 0.5f}};
+
+} // namespace
+
+BicubicTiles::BicubicTiles(const cv::Mat1b &img)
+    : image(img)
+    // cells -1 to size - 1 on each axis
+    , tilesX((img.cols + tileSize) / tileSize)
+    , tilesY((img.rows + tileSize) / tileSize)
+    , tiles(tilesX * tilesY)
+    , tileOnce(new std::once_flag[tilesX * tilesY]) {
+  CHECK(!img.empty());
+}
+
+void BicubicTiles::release() {
+  for (auto &tile : tiles)
+    tile.reset();
+  tileOnce.reset(new std::once_flag[tiles.size()]);
+}
+
+int BicubicTiles::materializedTiles() const {
+  return std::count_if(tiles.begin(), tiles.end(),
+                       [](const auto &tile) { return bool(tile); });
+}
+
+void BicubicTiles::materialize(int tile) const {
+  std::unique_ptr<float[]> data(new float[tileSize * tileSize * cellFloats]);
+  const int y0 = (tile / tilesX) * tileSize - 1;
+  const int x0 = (tile % tilesX) * tileSize - 1;
+  for (int ty = 0; ty < tileSize; ++ty)
+    for (int tx = 0; tx < tileSize; ++tx) {
+      float *a = data.get() + (ty * tileSize + tx) * cellFloats;
+      int cy = y0 + ty, cx = x0 + tx;
+      if (cy >= image.rows || cx >= image.cols) {
+        std::fill(a, a + cellFloats, 0.0f);
+        continue;
+      }
+
+      float p[4][4];
+      for (int r = 0; r < 4; ++r)
+        for (int c = 0; c < 4; ++c)
+          p[r][c] = image(std::clamp(cy - 1 + r, 0, image.rows - 1),
+                          std::clamp(cx - 1 + c, 0, image.cols - 1));
+      // M P along the rows, then (M P) M^T along the columns
+      float mp[4][4];
+      for (int i = 0; i < 4; ++i)
+        for (int c = 0; c < 4; ++c) {
+          mp[i][c] = 0;
+          for (int r = 0; r < 4; ++r)
+            mp[i][c] += catmullRom[i][r] * p[r][c];
+        }
+      for (int i = 0; i < 4; ++i)
+        for (int j = 0; j < 4; ++j) {
+          float sum = 0;
+          for (int c = 0; c < 4; ++c)
+            sum += mp[i][c] * catmullRom[j][c];
+          a[4 * i + j] = sum;
+        }
+    }
+  tiles[tile] = std::move(data);
+}
+
+} // namespace fishdso
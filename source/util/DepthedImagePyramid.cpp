@@ -1,35 +1,192 @@
 #include "util/DepthedImagePyramid.h"
 #include "util/util.h"
+#include <algorithm>
 #include <glog/logging.h>
 
 namespace fishdso {
 
+namespace {
+
+std::vector<double> coordinates(const StdVector<Vec2> &points, int coord) {
+  std::vector<double> result(points.size());
+  for (int i = 0; i < points.size(); ++i)
+    result[i] = points[i][coord];
+  return result;
+}
+
+int pixelIndex(double x, double y, int w, int h) {
+  cv::Point p = toCvPoint(Vec2(x, y));
+  return p.x >= 0 && p.y >= 0 && p.x < w && p.y < h ? p.y * w + p.x : -1;
+}
+
+// Groups the items with equal keys into blocks, in the order of the keys.
+// Returns the keys of the blocks and sets the block of every item.
+std::vector<int> groupByKey(std::vector<std::pair<int, int>> &keyed,
+                            std::vector<int> &itemBlock) {
+  std::sort(keyed.begin(), keyed.end());
+  std::vector<int> keys;
+  for (const auto &[key, item] : keyed) {
+    if (keys.empty() || keys.back() != key)
+      keys.push_back(key);
+    itemBlock[item] = keys.size() - 1;
+  }
+  return keys;
+}
+
+} // namespace
+
 DepthedImagePyramid::DepthedImagePyramid(const cv::Mat1b &baseImage,
                                          int levelNum,
                                          const StdVector<Vec2> &points,
                                          const std::vector<double> &depthsVec,
                                          const std::vector<double> &weightsVec)
-    : ImagePyramid(baseImage, levelNum)
-    , depths(levelNum) {
-  CHECK(points.size() == depthsVec.size() &&
+    : DepthedImagePyramid(baseImage, levelNum, coordinates(points, 0),
+                          coordinates(points, 1), depthsVec, weightsVec) {}
+
+DepthedImagePyramid::DepthedImagePyramid(const cv::Mat1b &baseImage,
+                                         int levelNum,
+                                         const std::vector<double> &pointsX,
+                                         const std::vector<double> &pointsY,
+                                         const std::vector<double> &depthsVec,
+                                         const std::vector<double> &weightsVec)
+    : ImagePyramid(baseImage, levelNum) {
+  splat(pointsX, pointsY, depthsVec, weightsVec);
+}
+
+DepthedImagePyramid::DepthedImagePyramid(const ImagePyramid &images,
+                                         int levelNum,
+                                         const std::vector<double> &pointsX,
+                                         const std::vector<double> &pointsY,
+                                         const std::vector<double> &depthsVec,
+                                         const std::vector<double> &weightsVec) {
+  if (images.images.size() >= levelNum)
+    this->images.assign(images.images.begin(),
+                        images.images.begin() + levelNum);
+  else {
+    this->images = {images[0]};
+    rebuild(levelNum);
+  }
+  splat(pointsX, pointsY, depthsVec, weightsVec);
+}
+
+void DepthedImagePyramid::splat(const std::vector<double> &pointsX,
+                                const std::vector<double> &pointsY,
+                                const std::vector<double> &depthsVec,
+                                const std::vector<double> &weightsVec) {
+  CHECK(pointsX.size() == pointsY.size() &&
+        pointsY.size() == depthsVec.size() &&
         depthsVec.size() == weightsVec.size());
+  const int levelNum = images.size();
+  const int w = images[0].cols, h = images[0].rows;
+
+  // Only the points are sorted into the blocks of level 0. Every coarser
+  // level is made of the blocks of the previous one, of which there are
+  // already few.
+  pointPixel.resize(pointsX.size());
+  pointBlock.assign(pointsX.size(), -1);
+  std::vector<std::pair<int, int>> keyed;
+  keyed.reserve(pointsX.size());
+  for (int i = 0; i < pointsX.size(); ++i) {
+    pointPixel[i] = pixelIndex(pointsX[i], pointsY[i], w, h);
+    if (pointPixel[i] >= 0)
+      keyed.push_back({pointPixel[i], i});
+  }
+  std::vector<std::vector<int>> keys(levelNum);
+  keys[0] = groupByKey(keyed, pointBlock);
+
+  blocks.assign(levelNum, Blocks());
+  for (int il = 0; il < levelNum; ++il) {
+    blocks[il].parent.assign(keys[il].size(), -1);
+    if (il + 1 == levelNum)
+      break;
+    int lw = w >> il, pw = w >> (il + 1), ph = h >> (il + 1);
+    keyed.clear();
+    for (int b = 0; b < keys[il].size(); ++b) {
+      int px = (keys[il][b] % lw) >> 1, py = (keys[il][b] / lw) >> 1;
+      if (px < pw && py < ph)
+        keyed.push_back({py * pw + px, b});
+    }
+    keys[il + 1] = groupByKey(keyed, blocks[il].parent);
+  }
+
+  std::vector<std::vector<double>> depthSums, weightSums;
+  sumBlocks(depthsVec, weightsVec, depthSums, weightSums);
+  points.assign(levelNum, DepthedPoints());
+  for (int il = 0; il < levelNum; ++il) {
+    int lw = w >> il;
+    DepthedPoints &level = points[il];
+    blocks[il].depthed.assign(keys[il].size(), -1);
+    for (int b = 0; b < keys[il].size(); ++b) {
+      if (std::abs(weightSums[il][b]) <= 1e-8)
+        continue;
+      blocks[il].depthed[b] = level.size();
+      level.x.push_back(keys[il][b] % lw);
+      level.y.push_back(keys[il][b] / lw);
+      level.depth.push_back(depthSums[il][b] / weightSums[il][b]);
+      level.weight.push_back(weightSums[il][b]);
+    }
+  }
+}
 
-  depths[0] = cv::Mat1d(baseImage.rows, baseImage.cols, -1.0);
-  cv::Mat1d weights = cv::Mat1d(baseImage.rows, baseImage.cols, 0.0);
-  for (int i = 0; i < points.size(); ++i) {
-    cv::Point cvp = toCvPoint(points[i]);
-    depths[0](cvp) = depthsVec[i];
-    weights(cvp) = weightsVec[i];
+void DepthedImagePyramid::sumBlocks(
+    const std::vector<double> &depthsVec,
+    const std::vector<double> &weightsVec,
+    std::vector<std::vector<double>> &depthSums,
+    std::vector<std::vector<double>> &weightSums) const {
+  depthSums.resize(blocks.size());
+  weightSums.resize(blocks.size());
+  for (int il = 0; il < blocks.size(); ++il) {
+    depthSums[il].assign(blocks[il].parent.size(), 0);
+    weightSums[il].assign(blocks[il].parent.size(), 0);
   }
+  for (int i = 0; i < pointBlock.size(); ++i)
+    if (pointBlock[i] >= 0) {
+      depthSums[0][pointBlock[i]] += weightsVec[i] * depthsVec[i];
+      weightSums[0][pointBlock[i]] += weightsVec[i];
+    }
+  for (int il = 0; il + 1 < blocks.size(); ++il)
+    for (int b = 0; b < blocks[il].parent.size(); ++b) {
+      int parent = blocks[il].parent[b];
+      if (parent >= 0) {
+        depthSums[il + 1][parent] += depthSums[il][b];
+        weightSums[il + 1][parent] += weightSums[il][b];
+      }
+    }
+}
+
+bool DepthedImagePyramid::updateDepths(const std::vector<double> &pointsX,
+                                       const std::vector<double> &pointsY,
+                                       const std::vector<double> &depthsVec,
+                                       const std::vector<double> &weightsVec) {
+  CHECK(pointsX.size() == pointsY.size() &&
+        pointsY.size() == depthsVec.size() &&
+        depthsVec.size() == weightsVec.size());
+  if (pointsX.size() != pointPixel.size())
+    return false;
+  const int w = images[0].cols, h = images[0].rows;
+  for (int i = 0; i < pointsX.size(); ++i)
+    if (pixelIndex(pointsX[i], pointsY[i], w, h) != pointPixel[i])
+      return false;
 
-  cv::Mat1d weightedDepths = depths[0].mul(weights, 1);
-  cv::Mat1d integralWeightedDepths;
-  cv::Mat1d integralWeights;
-  cv::integral(weights, integralWeights, CV_64F);
-  cv::integral(weightedDepths, integralWeightedDepths, CV_64F);
+  std::vector<std::vector<double>> depthSums, weightSums;
+  sumBlocks(depthsVec, weightsVec, depthSums, weightSums);
+  for (int il = 0; il < blocks.size(); ++il)
+    for (int b = 0; b < weightSums[il].size(); ++b)
+      if ((std::abs(weightSums[il][b]) > 1e-8) !=
+          (blocks[il].depthed[b] >= 0))
+        return false;
 
-  for (int il = 1; il < levelNum; ++il)
-    depths[il] = pyrNUpDepth(integralWeightedDepths, integralWeights, il);
+  for (int il = 0; il < blocks.size(); ++il) {
+    DepthedPoints &level = points[il];
+    for (int b = 0; b < weightSums[il].size(); ++b) {
+      int j = blocks[il].depthed[b];
+      if (j < 0)
+        continue;
+      level.depth[j] = depthSums[il][b] / weightSums[il][b];
+      level.weight[j] = weightSums[il][b];
+    }
+  }
+  return true;
 }
 
 } // namespace fishdso
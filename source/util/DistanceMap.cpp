@@ -1,91 +1,158 @@
 #include "util/DistanceMap.h"
 #include "util/defs.h"
 #include "util/settings.h"
-#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <queue>
 
 namespace fishdso {
 
-// lowest power of 2 greater than x
-unsigned clp2(unsigned x) {
-  x--;
-  x |= (x >> 1);
-  x |= (x >> 2);
-  x |= (x >> 4);
-  x |= (x >> 8);
-  x |= (x >> 16);
-  return x + 1;
-}
+namespace {
 
-DistanceMap::DistanceMap(int givenW, int givenH, const StdVector<Vec2> &points,
-                         const Settings::DistanceMap &settings)
-    : settings(settings) {
-  const int wdiv = 1 + (givenW - 1) / settings.maxWidth;
-  const int hdiv = 1 + (givenH - 1) / settings.maxHeight;
-  pyrDown = std::min(clp2(wdiv), clp2(hdiv));
-  const int w = givenW / pyrDown, h = givenH / pyrDown;
+// larger than any squared distance on an image, yet far from overflowing
+constexpr double farAway = 1e20;
 
-  LOG(INFO) << "DistanceMap: w, h = " << w << ' ' << h
-            << " pyrDown = " << pyrDown << std::endl;
+// Lower envelope of the parabolas (q - p)^2 + f[p], sampled at q = 0..n-1.
+// v and z are scratch buffers of sizes n and n + 1.
+void distanceTransform1d(const double *f, int n, double *d, int *v,
+                         double *z) {
+  int k = 0;
+  v[0] = 0;
+  z[0] = -std::numeric_limits<double>::infinity();
+  z[1] = std::numeric_limits<double>::infinity();
+  auto intersection = [f](int q, int p) {
+    return ((f[q] + double(q) * q) - (f[p] + double(p) * p)) / (2.0 * (q - p));
+  };
+  for (int q = 1; q < n; ++q) {
+    // z[0] is -infinity, so this stops at k = 0 the latest
+    double s = intersection(q, v[k]);
+    while (s <= z[k]) {
+      --k;
+      s = intersection(q, v[k]);
+    }
+    ++k;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = std::numeric_limits<double>::infinity();
+  }
+
+  k = 0;
+  for (int q = 0; q < n; ++q) {
+    while (z[k + 1] < q)
+      ++k;
+    double shift = q - v[k];
+    d[q] = shift * shift + f[v[k]];
+  }
+}
 
-  dist = MatXXi::Constant(h, w, std::numeric_limits<int>::max());
+bool isOnImage(const Vec2 &p, int w, int h) {
+  return p[0] >= 0 && p[0] < w && p[1] >= 0 && p[1] < h;
+}
 
-  StdQueue<Vec2i> q;
+} // namespace
 
+DistanceMap::DistanceMap(int w, int h, const StdVector<Vec2> &points,
+                         const Settings::DistanceMap &settings)
+    : sqDist(h, w)
+    , settings(settings) {
+  // column-major, as Eigen stores it, so that the first pass goes along
+  // contiguous columns
+  MatXX cur = MatXX::Constant(h, w, farAway);
   for (const Vec2 &p : points) {
-    if (!(p[0] >= 0 && p[0] < givenW && p[1] >= 0 && p[1] < givenH)) {
-      continue;
-    }
-    Vec2i pi = p.cast<int>() / pyrDown;
-    dist(pi[1], pi[0]) = 0;
-    q.push(pi);
+    if (isOnImage(p, w, h))
+      cur(int(p[1]), int(p[0])) = 0;
   }
 
-  while (!q.empty()) {
-    Vec2i cur = q.front();
-    int curd = dist(cur[1], cur[0]);
-    q.pop();
-
-    for (int dx : {-1, 1}) {
-      const int newx = cur[0] + dx;
-      if (newx >= 0 && newx < w && dist(cur[1], newx) > curd + 1) {
-        dist(cur[1], newx) = curd + 1;
-        q.push(Vec2i(newx, cur[1]));
-      }
-    }
-    for (int dy : {-1, 1}) {
-      const int newy = cur[1] + dy;
-      if (newy >= 0 && newy < h && dist(newy, cur[0]) > curd + 1) {
-        dist(newy, cur[0]) = curd + 1;
-        q.push(Vec2i(cur[0], newy));
-      }
-    }
+  const int maxSize = std::max(w, h);
+  std::vector<double> f(maxSize), d(maxSize), z(maxSize + 1);
+  std::vector<int> v(maxSize);
+
+  for (int x = 0; x < w; ++x) {
+    distanceTransform1d(cur.col(x).data(), h, d.data(), v.data(), z.data());
+    std::copy(d.begin(), d.begin() + h, cur.col(x).data());
+  }
+
+  const double maxSqDist = double(w) * w + double(h) * h;
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x)
+      f[x] = cur(y, x);
+    distanceTransform1d(f.data(), w, d.data(), v.data(), z.data());
+    for (int x = 0; x < w; ++x)
+      sqDist(y, x) = d[x] > maxSqDist ? std::numeric_limits<int>::max()
+                                      : int(d[x]);
   }
 }
 
 std::vector<int> DistanceMap::choose(const StdVector<Vec2> &otherPoints,
-                                     int pointsNeeded) {
-  std::vector<int> chosen;
-  std::vector<std::pair<int, int>> otherDist(otherPoints.size());
-  for (int i = 0; i < otherPoints.size(); ++i) {
-    const Vec2 &p = otherPoints[i];
-    Vec2i pi = p.cast<int>() / pyrDown;
-
-    otherDist[i].first = i;
-    if (!Eigen::AlignedBox2i(Vec2i::Zero(), Vec2i(dist.cols(), dist.rows()))
-             .contains(pi))
-      otherDist[i].second = -1;
-    else
-      otherDist[i].second = dist(pi[1], pi[0]);
+                                     int pointsNeeded) const {
+  const int w = sqDist.cols(), h = sqDist.rows();
+  std::vector<double> x, y;
+  std::vector<int> candInd;
+  for (int i = 0; i < otherPoints.size(); ++i)
+    if (isOnImage(otherPoints[i], w, h)) {
+      x.push_back(otherPoints[i][0]);
+      y.push_back(otherPoints[i][1]);
+      candInd.push_back(i);
+    }
+
+  PointGrid grid(w, h, settings.cellSize, x, y);
+  std::vector<int> chosen = choose(x, y, grid, pointsNeeded);
+  for (int &c : chosen)
+    c = candInd[c];
+  return chosen;
+}
+
+std::vector<int> DistanceMap::choose(const std::vector<double> &x,
+                                     const std::vector<double> &y,
+                                     const PointGrid &grid,
+                                     int pointsNeeded) const {
+  const int candNum = x.size();
+  const int w = sqDist.cols(), h = sqDist.rows();
+
+  // current squared distances of the candidates to the map's points and the
+  // ones chosen so far
+  std::vector<Vec2i> pos(candNum);
+  std::vector<int> candSqDist(candNum);
+  for (int c = 0; c < candNum; ++c) {
+    pos[c] = Vec2i(std::clamp(int(x[c]), 0, w - 1),
+                   std::clamp(int(y[c]), 0, h - 1));
+    candSqDist[c] = sqDist(pos[c][1], pos[c][0]);
   }
 
-  int total = std::min(pointsNeeded, int(otherPoints.size()));
-  std::nth_element(
-      otherDist.begin(), otherDist.begin() + total, otherDist.end(),
-      [](const auto &a, const auto &b) { return a.second > b.second; });
-  for (int i = 0; i < total; ++i)
-    if (otherDist[i].second != -1)
-      chosen.push_back(otherDist[i].first);
+  // Max-heap with lazy deletion: distances only decrease, and an outdated
+  // entry is recognized by its distance. Ties go to the lower index.
+  std::priority_queue<std::pair<int, int>> heap;
+  for (int c = 0; c < candNum; ++c)
+    heap.push({candSqDist[c], -c});
+
+  std::vector<bool> isChosen(candNum, false);
+  std::vector<int> chosen;
+  chosen.reserve(std::max(0, std::min(pointsNeeded, candNum)));
+  while (int(chosen.size()) < pointsNeeded && !heap.empty()) {
+    auto [curSqDist, negC] = heap.top();
+    heap.pop();
+    int c = -negC;
+    if (isChosen[c] || curSqDist != candSqDist[c])
+      continue;
+    isChosen[c] = true;
+    chosen.push_back(c);
+
+    // No candidate is farther than the chosen one from the rest, so only
+    // those within that distance can get closer to the chosen one.
+    double radius = std::sqrt(double(curSqDist));
+    const Vec2i p = pos[c];
+    grid.forEachInBox(p[0] - radius, p[1] - radius, p[0] + radius,
+                      p[1] + radius, [&](int o) {
+                        if (isChosen[o])
+                          return;
+                        int newSqDist = (pos[o] - p).squaredNorm();
+                        if (newSqDist < candSqDist[o]) {
+                          candSqDist[o] = newSqDist;
+                          heap.push({newSqDist, -o});
+                        }
+                      });
+  }
 
   return chosen;
 }
@@ -6,8 +6,63 @@ namespace fishdso {
 ImagePyramid::ImagePyramid(const cv::Mat1b &baseImage, int levelNum)
     : images(levelNum) {
   images[0] = baseImage;
+  rebuild(levelNum);
+}
+
+ImagePyramid::ImagePyramid(const cv::Mat1b &baseImage, int levelNum,
+                           PyramidGradients &gradients)
+    : images(levelNum) {
+  images[0] = baseImage;
+  rebuild(levelNum, gradients);
+}
+
+void ImagePyramid::rebuild(int levelNum) {
+  images.resize(levelNum);
+  for (int lvl = 1; lvl < levelNum; ++lvl) {
+    if (images[lvl].u && images[lvl].u->refcount > 1)
+      images[lvl].release();
+    gradAndPyrDown(images[lvl - 1], nullptr, nullptr, nullptr, &images[lvl]);
+  }
+}
+
+void ImagePyramid::rebuild(
+    int levelNum, PyramidGradients &gradients,
+    const std::vector<std::vector<Vec2i>> *validSpans) {
+  const int baseW = images[0].cols, baseH = images[0].rows;
+  images.resize(levelNum);
   for (int lvl = 1; lvl < levelNum; ++lvl)
-    images[lvl] = boxFilterPyrDown<unsigned char>(images[lvl - 1]);
+    if (images[lvl].u && images[lvl].u->refcount > 1)
+      images[lvl].release();
+
+  // planes are padded to a multiple of 8 floats to keep them aligned
+  constexpr int planeAlign = 8;
+  std::vector<size_t> offsets(levelNum);
+  size_t total = 0;
+  for (int lvl = 0; lvl < levelNum; ++lvl) {
+    size_t planeSize = size_t(baseW >> lvl) * (baseH >> lvl);
+    planeSize = (planeSize + planeAlign - 1) / planeAlign * planeAlign;
+    offsets[lvl] = total;
+    total += 3 * planeSize;
+  }
+  gradients.arena.resize(total);
+  gradients.gradX.resize(levelNum);
+  gradients.gradY.resize(levelNum);
+  gradients.gradNorm.resize(levelNum);
+
+  for (int lvl = 0; lvl < levelNum; ++lvl) {
+    int w = baseW >> lvl, h = baseH >> lvl;
+    size_t planeSize =
+        (size_t(w) * h + planeAlign - 1) / planeAlign * planeAlign;
+    float *gradX = gradients.arena.data() + offsets[lvl];
+    float *gradY = gradX + planeSize;
+    float *gradNorm = gradY + planeSize;
+    gradients.gradX[lvl] = cv::Mat1f(h, w, gradX);
+    gradients.gradY[lvl] = cv::Mat1f(h, w, gradY);
+    gradients.gradNorm[lvl] = cv::Mat1f(h, w, gradNorm);
+    gradAndPyrDown(images[lvl], gradX, gradY, gradNorm,
+                   lvl + 1 < levelNum ? &images[lvl + 1] : nullptr,
+                   validSpans ? (*validSpans)[lvl].data() : nullptr);
+  }
 }
 
 } // namespace fishdso
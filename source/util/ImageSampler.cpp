@@ -0,0 +1,200 @@
+#include "util/ImageSampler.h"
+#include <glog/logging.h>
+#include <opencv2/imgproc.hpp>
+
+namespace fishdso {
+
+ImageSampler::ImageSampler(const cv::Mat1b &img, Layout layout,
+                           bool hugePages)
+    : layout(layout)
+    , data(HugePageAllocator<float>(hugePages))
+    , rowMajor(HugePageAllocator<float>(hugePages)) {
+  reset(img);
+}
+
+void ImageSampler::reset(const cv::Mat1b &img) {
+  width = img.cols;
+  height = img.rows;
+  minCoord = -pad + 1;
+  maxX = img.cols + pad - 3;
+  maxY = img.rows + pad - 3;
+  const int paddedWidth = img.cols + 2 * pad;
+  const int paddedHeight = img.rows + 2 * pad;
+  auto &target = layout == TILED ? rowMajor : data;
+  target.resize(paddedWidth * paddedHeight);
+
+  // converted straight into the padded buffer, then the border is replicated
+  cv::Mat1f padded(paddedHeight, paddedWidth, target.data());
+  cv::Mat1f inner = padded(cv::Rect(pad, pad, width, height));
+  img.convertTo(inner, CV_32F);
+  CHECK(inner.data == padded(cv::Rect(pad, pad, width, height)).data);
+  for (int y = pad; y < pad + height; ++y) {
+    float *row = padded[y];
+    std::fill(row, row + pad, row[pad]);
+    std::fill(row + pad + width, row + paddedWidth, row[pad + width - 1]);
+  }
+  for (int y = 0; y < pad; ++y) {
+    std::copy(padded[pad], padded[pad] + paddedWidth, padded[y]);
+    std::copy(padded[pad + height - 1], padded[pad + height - 1] + paddedWidth,
+              padded[pad + height + y]);
+  }
+
+  if (layout == ROW_MAJOR) {
+    stride = paddedWidth;
+    return;
+  }
+  // the tiles past the padding are left as they are, no tap reaches them
+  const int tilesX = (paddedWidth + tileSide - 1) / tileSide;
+  const int tilesY = (paddedHeight + tileSide - 1) / tileSide;
+  stride = tilesX * tileSide * tileSide;
+  data.resize(stride * tilesY);
+  for (int y = 0; y < paddedHeight; ++y) {
+    float *rowStart =
+        data.data() + (y / tileSide) * stride + (y % tileSide) * tileSide;
+    for (int x = 0; x < paddedWidth; ++x)
+      rowStart[(x / tileSide) * tileSide * tileSide + x % tileSide] =
+          padded(y, x);
+  }
+}
+
+template <typename T>
+void ImageSampler::evaluateBicubic(int n, const T *ys, const T *xs, T *f,
+                                   T *dfdy, T *dfdx) const {
+  constexpr int B = batchSize;
+  alignas(32) float wy[4][B], wx[4][B], dwy[4][B], dwx[4][B];
+  alignas(32) float taps[4][4][B];
+
+  for (int start = 0; start < n; start += B) {
+    int cnt = std::min(B, n - start);
+
+    for (int l = 0; l < B; ++l) {
+      int i = start + std::min(l, cnt - 1);
+      float fy = std::clamp(float(ys[i]), minCoord, maxY);
+      float fx = std::clamp(float(xs[i]), minCoord, maxX);
+      float iy = std::floor(fy), ix = std::floor(fx);
+      float w[4], dw[4];
+      splineWeights(fy - iy, w, dw);
+      for (int k = 0; k < 4; ++k) {
+        wy[k][l] = w[k];
+        dwy[k][l] = dw[k];
+      }
+      splineWeights(fx - ix, w, dw);
+      for (int k = 0; k < 4; ++k) {
+        wx[k][l] = w[k];
+        dwx[k][l] = dw[k];
+      }
+
+      int rows[4], cols[4];
+      tapOffsets(int(iy), int(ix), rows, cols);
+      for (int r = 0; r < 4; ++r)
+        for (int c = 0; c < 4; ++c)
+          taps[r][c][l] = data[rows[r] + cols[c]];
+    }
+
+    alignas(32) float val[B] = {}, valDy[B] = {}, valDx[B] = {};
+    for (int r = 0; r < 4; ++r) {
+      alignas(32) float rowVal[B] = {}, rowDx[B] = {};
+      for (int c = 0; c < 4; ++c)
+        for (int l = 0; l < B; ++l) {
+          rowVal[l] += wx[c][l] * taps[r][c][l];
+          rowDx[l] += dwx[c][l] * taps[r][c][l];
+        }
+      for (int l = 0; l < B; ++l) {
+        val[l] += wy[r][l] * rowVal[l];
+        valDy[l] += dwy[r][l] * rowVal[l];
+        valDx[l] += wy[r][l] * rowDx[l];
+      }
+    }
+
+    for (int l = 0; l < cnt; ++l) {
+      f[start + l] = val[l];
+      if (dfdy)
+        dfdy[start + l] = valDy[l];
+      if (dfdx)
+        dfdx[start + l] = valDx[l];
+    }
+  }
+}
+
+// The taps of the cheaper kernels are taken from the same 4x4
+// neighbourhood as the bicubic ones, so that the clamping and the padding
+// hold for them as well.
+template <typename T>
+void ImageSampler::evaluateBilinear(int n, const T *ys, const T *xs, T *f,
+                                    T *dfdy, T *dfdx) const {
+  for (int i = 0; i < n; ++i) {
+    float fy = std::clamp(float(ys[i]), minCoord, maxY);
+    float fx = std::clamp(float(xs[i]), minCoord, maxX);
+    float iy = std::floor(fy), ix = std::floor(fx);
+    float ty = fy - iy, tx = fx - ix;
+
+    int rows[4], cols[4];
+    tapOffsets(int(iy), int(ix), rows, cols);
+    const float *top = data.data() + rows[1], *bottom = data.data() + rows[2];
+    float topDx = top[cols[2]] - top[cols[1]];
+    float bottomDx = bottom[cols[2]] - bottom[cols[1]];
+    float topVal = top[cols[1]] + tx * topDx;
+    float bottomVal = bottom[cols[1]] + tx * bottomDx;
+
+    f[i] = topVal + ty * (bottomVal - topVal);
+    if (dfdy)
+      dfdy[i] = bottomVal - topVal;
+    if (dfdx)
+      dfdx[i] = topDx + ty * (bottomDx - topDx);
+  }
+}
+
+template <typename T>
+void ImageSampler::evaluateNearest(int n, const T *ys, const T *xs, T *f,
+                                   T *dfdy, T *dfdx) const {
+  for (int i = 0; i < n; ++i) {
+    float fy = std::clamp(float(ys[i]), minCoord, maxY);
+    float fx = std::clamp(float(xs[i]), minCoord, maxX);
+
+    int rows[4], cols[4];
+    tapOffsets(int(std::floor(fy + 0.5f)), int(std::floor(fx + 0.5f)), rows,
+               cols);
+    const float *center = data.data() + rows[1];
+    f[i] = center[cols[1]];
+    if (dfdy)
+      dfdy[i] = 0.5f * (data[rows[2] + cols[1]] - data[rows[0] + cols[1]]);
+    if (dfdx)
+      dfdx[i] = 0.5f * (center[cols[2]] - center[cols[0]]);
+  }
+}
+
+template <ImageSampler::Interpolation I, typename T>
+void ImageSampler::evaluateBatch(int n, const T *ys, const T *xs, T *f,
+                                 T *dfdy, T *dfdx) const {
+  if constexpr (I == NEAREST)
+    evaluateNearest(n, ys, xs, f, dfdy, dfdx);
+  else if constexpr (I == BILINEAR)
+    evaluateBilinear(n, ys, xs, f, dfdy, dfdx);
+  else
+    evaluateBicubic(n, ys, xs, f, dfdy, dfdx);
+}
+
+template void ImageSampler::evaluateBatch<ImageSampler::NEAREST, float>(
+    int, const float *, const float *, float *, float *, float *) const;
+template void ImageSampler::evaluateBatch<ImageSampler::BILINEAR, float>(
+    int, const float *, const float *, float *, float *, float *) const;
+template void ImageSampler::evaluateBatch<ImageSampler::BICUBIC, float>(
+    int, const float *, const float *, float *, float *, float *) const;
+template void ImageSampler::evaluateBatch<ImageSampler::NEAREST, double>(
+    int, const double *, const double *, double *, double *, double *) const;
+template void ImageSampler::evaluateBatch<ImageSampler::BILINEAR, double>(
+    int, const double *, const double *, double *, double *, double *) const;
+template void ImageSampler::evaluateBatch<ImageSampler::BICUBIC, double>(
+    int, const double *, const double *, double *, double *, double *) const;
+
+void ImageSampler::evaluateBatch(int n, const double *ys, const double *xs,
+                                 double *f, double *dfdy, double *dfdx) const {
+  evaluateBicubic(n, ys, xs, f, dfdy, dfdx);
+}
+
+void ImageSampler::evaluateBatch(int n, const float *ys, const float *xs,
+                                 float *f, float *dfdy, float *dfdx) const {
+  evaluateBicubic(n, ys, xs, f, dfdy, dfdx);
+}
+
+} // namespace fishdso
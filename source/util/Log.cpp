@@ -0,0 +1,180 @@
+#include "util/Log.h"
+#include "util/Profiler.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <glog/logging.h>
+#include <mutex>
+#include <thread>
+
+namespace fishdso {
+
+namespace {
+
+const char *categoryNames[logCategoryNum] = {
+    "system", "init", "tracking", "tracing", "mapping",
+    "ba",     "loop", "camera",   "selection"};
+
+void writeToGlog(const LogRecord &record) {
+  google::LogMessage(record.file, record.line, google::GLOG_INFO).stream()
+      << '[' << Log::categoryName(record.category) << "] " << record.message;
+}
+
+struct Sink {
+  Sink()
+      : worker([this]() { run(); }) {}
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      hasRecords.wait(lock, [this]() { return !records.empty(); });
+      std::deque<LogRecord> batch;
+      batch.swap(records);
+      long long dropped = droppedUnreported;
+      droppedUnreported = 0;
+      auto write = sink ? sink : writeToGlog;
+      isWriting = true;
+      lock.unlock();
+
+      if (dropped > 0)
+        write({LogCategory::SYSTEM, 0, __FILE__, __LINE__,
+               std::to_string(dropped) + " log messages dropped"});
+      for (const LogRecord &record : batch)
+        write(record);
+
+      lock.lock();
+      isWriting = false;
+      drained.notify_all();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable hasRecords;
+  std::condition_variable drained;
+  std::deque<LogRecord> records;
+  bool isWriting = false;
+  long long droppedTotal = 0;
+  long long droppedUnreported = 0;
+  std::function<void(const LogRecord &)> sink;
+  std::thread worker;
+};
+
+std::atomic<bool> sinkStarted{false};
+
+// Never destroyed, as worker threads may still log during the exit.
+Sink &sink() {
+  static Sink *sink = new Sink();
+  sinkStarted.store(true, std::memory_order_relaxed);
+  return *sink;
+}
+
+struct FlushAtExit {
+  ~FlushAtExit() {
+    if (sinkStarted.load(std::memory_order_relaxed))
+      Log::flush();
+  }
+} flushAtExit;
+
+} // namespace
+
+std::array<std::atomic<int>, logCategoryNum> Log::verbosities;
+
+void Log::setVerbosity(LogCategory category, int level) {
+  verbosities[int(category)].store(level, std::memory_order_relaxed);
+}
+
+void Log::setVerbosities(const std::string &spec) {
+  std::stringstream stream(spec);
+  std::string entry;
+  while (std::getline(stream, entry, ',')) {
+    auto eq = entry.find('=');
+    CHECK(eq != std::string::npos) << "no level in \"" << entry << "\"";
+    std::string name = entry.substr(0, eq);
+    int level = std::stoi(entry.substr(eq + 1));
+    bool found = false;
+    for (int c = 0; c < logCategoryNum; ++c)
+      if (name == "all" || name == categoryNames[c]) {
+        setVerbosity(LogCategory(c), level);
+        found = true;
+      }
+    CHECK(found) << "unknown log category \"" << name << "\"";
+  }
+}
+
+const char *Log::categoryName(LogCategory category) {
+  return categoryNames[int(category)];
+}
+
+void Log::push(LogRecord &&record) {
+  Sink &s = sink();
+  {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.records.size() >= queueSize) {
+      s.droppedTotal++;
+      s.droppedUnreported++;
+      PROFILE_COUNT("log.dropped", 1);
+      return;
+    }
+    s.records.push_back(std::move(record));
+  }
+  s.hasRecords.notify_one();
+}
+
+void Log::flush() {
+  Sink &s = sink();
+  std::unique_lock<std::mutex> lock(s.mutex);
+  s.drained.wait(lock,
+                 [&s]() { return s.records.empty() && !s.isWriting; });
+}
+
+void Log::setSink(std::function<void(const LogRecord &)> newSink) {
+  flush();
+  Sink &s = sink();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  s.sink = std::move(newSink);
+}
+
+long long Log::droppedNum() {
+  Sink &s = sink();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  return s.droppedTotal;
+}
+
+LogRateLimiter::LogRateLimiter(double periodSeconds)
+    : periodNs(periodSeconds * 1e9) {}
+
+bool LogRateLimiter::allow() {
+  long long now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count();
+  long long next = nextNs.load(std::memory_order_relaxed);
+  // only one of the threads that see the period over lets its message through
+  if (now >= next && nextNs.compare_exchange_strong(
+                         next, now + periodNs, std::memory_order_relaxed))
+    return true;
+  suppressed.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+int LogRateLimiter::takeSuppressed() {
+  return suppressed.exchange(0, std::memory_order_relaxed);
+}
+
+LogMessage::LogMessage(LogCategory category, int level, const char *file,
+                       int line, LogRateLimiter *limiter)
+    : category(category)
+    , level(level)
+    , file(file)
+    , line(line)
+    , limiter(limiter) {}
+
+LogMessage::~LogMessage() {
+  if (limiter) {
+    int suppressed = limiter->takeSuppressed();
+    if (suppressed > 0)
+      message << " (" << suppressed << " more suppressed)";
+  }
+  Log::push({category, level, file, line, message.str()});
+}
+
+} // namespace fishdso
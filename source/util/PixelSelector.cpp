@@ -1,59 +1,153 @@
 #include "util/PixelSelector.h"
+#include "util/Log.h"
+#include "util/Profiler.h"
+#include "util/Random.h"
+#include "util/Scheduler.h"
 #include "util/defs.h"
-#include "util/flags.h"
 #include <glog/logging.h>
-#include <random>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
 namespace fishdso {
 
-#define LI (settings.gradThresholds.size())
+#define LI (settings.pixelSelector.gradThresholds.size())
 
-PixelSelector::PixelSelector(const Settings::PixelSelector &_settings)
-    : lastBlockSize(_settings.initialAdaptiveBlockSize)
-    , lastPointsFound(_settings.initialPointsFound)
+PixelSelector::PixelSelector(const PixelSelectorSettings &_settings)
+    : lastBlockSize(_settings.pixelSelector.initialAdaptiveBlockSize)
+    , lastPointsFound(_settings.pixelSelector.initialPointsFound)
     , settings(_settings) {}
 
-std::vector<cv::Point> PixelSelector::select(const cv::Mat &frame,
-                                             const cv::Mat1d &gradNorm,
-                                             int pointsNeeded,
-                                             cv::Mat *debugOut) {
-  int newBlockSize =
-      lastBlockSize * std::sqrt(static_cast<double>(lastPointsFound) /
-                                (pointsNeeded * settings.adaptToFactor));
-  return selectInternal(frame, gradNorm, pointsNeeded, newBlockSize, debugOut);
+std::vector<cv::Point>
+PixelSelector::select(const cv::Mat &frame, const cv::Mat1f &gradNorm,
+                      int pointsNeeded, cv::Mat *debugOut,
+                      const std::vector<Vec2i> *validSpans,
+                      const cv::Mat1b *mask) {
+  PROFILE_SCOPE("selector.select");
+  double adaptToFactor = settings.pixelSelector.adaptToFactor;
+  // nothing found last time would otherwise turn into empty blocks
+  int newBlockSize = std::max(
+      1, int(lastBlockSize *
+             std::sqrt(static_cast<double>(lastPointsFound) /
+                       (pointsNeeded * adaptToFactor))));
+  return selectInternal(frame, gradNorm, pointsNeeded, newBlockSize, debugOut,
+                        validSpans, mask);
 }
 
-void selectLayer(const cv::Mat &gradNorm, int selBlockSize, double threshold,
-                 std::vector<cv::Point> &res) {
-  for (int i = 0; i + selBlockSize < gradNorm.rows; i += selBlockSize)
-    for (int j = 0; j + selBlockSize < gradNorm.cols; j += selBlockSize) {
-      cv::Mat block = gradNorm(cv::Range(i, i + selBlockSize),
-                               cv::Range(j, j + selBlockSize));
-      double avg = cv::sum(block)[0] / (selBlockSize * selBlockSize);
-      double mx = 0;
-      cv::Point maxLoc = cv::Point(0, 0);
-      cv::minMaxLoc(block, NULL, &mx, NULL, &maxLoc);
-      if (mx > avg + threshold)
-        res.push_back(cv::Point(j, i) + maxLoc);
+// Blocks of one row of blocks, left to right, whose maximum exceeds their
+// average by more than threshold. The sums come from the integral image and
+// the maxima from a running maximum over the rows of each column. Among equal
+// maxima the first one in row-major order wins, as with cv::minMaxLoc. With
+// valid spans, only the blocks that touch them are processed, and a block
+// whose maximum is out of them or masked gives no point.
+void selectInBlockRow(const cv::Mat1f &gradNorm, const cv::Mat1d &integral,
+                      int top, int selBlockSize, double threshold,
+                      const std::vector<Vec2i> *validSpans,
+                      const cv::Mat1b *mask,
+                      std::vector<float> &colMax, std::vector<int> &colMaxRow,
+                      std::vector<cv::Point> &res) {
+  const int blockCols = (gradNorm.cols - 1) / selBlockSize;
+  const int bottom = top + selBlockSize;
+  int begin = 0, end = blockCols * selBlockSize;
+  if (validSpans) {
+    int validBegin = gradNorm.cols, validEnd = 0;
+    for (int r = top; r < bottom; ++r)
+      if ((*validSpans)[r][0] < (*validSpans)[r][1]) {
+        validBegin = std::min(validBegin, (*validSpans)[r][0]);
+        validEnd = std::max(validEnd, (*validSpans)[r][1]);
+      }
+    begin = validBegin / selBlockSize * selBlockSize;
+    end = std::min(end, (validEnd + selBlockSize - 1) / selBlockSize *
+                            selBlockSize);
+  }
+  if (begin >= end)
+    return;
+
+  const float *firstRow = gradNorm[top];
+  std::copy(firstRow + begin, firstRow + end, colMax.begin() + begin);
+  std::fill(colMaxRow.begin() + begin, colMaxRow.begin() + end, top);
+  for (int r = top + 1; r < bottom; ++r) {
+    const float *row = gradNorm[r];
+    for (int j = begin; j < end; ++j)
+      if (row[j] > colMax[j]) {
+        colMax[j] = row[j];
+        colMaxRow[j] = r;
+      }
+  }
+
+  const double *integralTop = integral[top];
+  const double *integralBottom = integral[bottom];
+  const double area = selBlockSize * selBlockSize;
+  for (int left = begin; left < end; left += selBlockSize) {
+    const int right = left + selBlockSize;
+    double avg = (integralBottom[right] - integralTop[right] -
+                  integralBottom[left] + integralTop[left]) /
+                 area;
+
+    int maxCol = left;
+    for (int j = left + 1; j < right; ++j)
+      if (colMax[j] > colMax[maxCol] ||
+          (colMax[j] == colMax[maxCol] && colMaxRow[j] < colMaxRow[maxCol]))
+        maxCol = j;
+
+    if (colMax[maxCol] <= avg + threshold)
+      continue;
+    if (validSpans) {
+      const Vec2i &span = (*validSpans)[colMaxRow[maxCol]];
+      if (maxCol < span[0] || maxCol >= span[1])
+        continue;
     }
+    if (mask && !(*mask)(colMaxRow[maxCol], maxCol))
+      continue;
+    res.push_back(cv::Point(maxCol, colMaxRow[maxCol]));
+  }
 }
 
-std::vector<cv::Point> PixelSelector::selectInternal(const cv::Mat &frame,
-                                                     const cv::Mat1d &gradNorm,
-                                                     int pointsNeeded,
-                                                     int blockSize,
-                                                     cv::Mat *debugOut) {
+// All blocks, in row-major order. Rows of blocks are processed in parallel,
+// the order of the result does not depend on the way they are split.
+void selectLayer(const cv::Mat1f &gradNorm, const cv::Mat1d &integral,
+                 int selBlockSize, double threshold,
+                 const std::vector<Vec2i> *validSpans, const cv::Mat1b *mask,
+                 std::vector<cv::Point> &res) {
+  const int blockRows = (gradNorm.rows - 1) / selBlockSize;
+  std::vector<std::vector<cv::Point>> rowPoints(blockRows);
+  tbb::parallel_for(tbb::blocked_range<int>(0, blockRows),
+                    [&](const tbb::blocked_range<int> &range) {
+                      std::vector<float> colMax(gradNorm.cols);
+                      std::vector<int> colMaxRow(gradNorm.cols);
+                      for (int bi = range.begin(); bi < range.end(); ++bi)
+                        selectInBlockRow(gradNorm, integral, bi * selBlockSize,
+                                         selBlockSize, threshold, validSpans,
+                                         mask, colMax, colMaxRow,
+                                         rowPoints[bi]);
+                    });
+
+  for (const auto &points : rowPoints)
+    res.insert(res.end(), points.begin(), points.end());
+}
+
+std::vector<cv::Point> PixelSelector::selectInternal(
+    const cv::Mat &frame, const cv::Mat1f &gradNorm, int pointsNeeded,
+    int blockSize, cv::Mat *debugOut, const std::vector<Vec2i> *validSpans,
+    const cv::Mat1b *mask) {
   std::vector<std::vector<cv::Point>> pointsOverThres(LI);
   std::vector<cv::Point> pointsAll;
 
   for (int i = 0; i < LI; ++i)
     pointsOverThres[i].reserve(2 * pointsNeeded);
 
+  cv::Mat1d integral;
+  cv::integral(gradNorm, integral, CV_64F);
+  ParallelExecutor(settings.threading, Scheduler::MAPPING).execute([&]() {
+    for (int i = 0; i < LI; ++i)
+      selectLayer(gradNorm, integral, (1 << i) * blockSize,
+                  settings.pixelSelector.gradThresholds[i], validSpans, mask,
+                  pointsOverThres[i]);
+  });
+
   for (int i = 0; i < LI; ++i) {
-    selectLayer(gradNorm, (1 << i) * blockSize, settings.gradThresholds[i],
-                pointsOverThres[i]);
-    std::mt19937 mt(FLAGS_deterministic ? 42 : std::random_device()());
-    std::shuffle(pointsOverThres[i].begin(), pointsOverThres[i].end(), mt);
+    RandomStream stream = randomStream(settings.pixelSelector.deterministic,
+                                       RandomStage::PIXEL_SELECTOR, 0, i);
+    stream.shuffle(pointsOverThres[i].begin(), pointsOverThres[i].end());
     // std::cout << "over thres " << i << " are " << pointsOverThres[i].size()
     // << std::endl;
   }
@@ -64,12 +158,15 @@ std::vector<cv::Point> PixelSelector::selectInternal(const cv::Mat &frame,
                         return accumulated + b.size();
                       });
 
-  std::stringstream levLog;
-  for (int i = 0; i < LI - 1; ++i)
-    levLog << pointsOverThres[i].size() << " + ";
-  levLog << pointsOverThres[LI - 1].size();
-  LOG(INFO) << "selector: found " << foundTotal << " (= " << levLog.str() << ")"
-            << std::endl;
+  if (DSO_LOG_IS_ON(SELECTION, 2)) {
+    std::stringstream levLog;
+    for (int i = 0; i < LI - 1; ++i)
+      levLog << pointsOverThres[i].size() << " + ";
+    levLog << pointsOverThres[LI - 1].size();
+    DSO_LOG(SELECTION, 2) << "selector: found " << foundTotal << " (= "
+                          << levLog.str() << ")";
+  }
+  PROFILE_COUNT("selector.found", foundTotal);
 
   if (foundTotal > pointsNeeded) {
     int sz = 0;
@@ -85,7 +182,7 @@ std::vector<cv::Point> PixelSelector::selectInternal(const cv::Mat &frame,
     const int rad = int(5e-3 * debugOut->cols);
     for (int i = 0; i < std::min(int(LI), 3); ++i)
       for (const cv::Point &p : pointsOverThres[i])
-        cv::circle(*debugOut, p, rad, settings.pointColors[i], 2);
+        cv::circle(*debugOut, p, rad, settings.pixelSelector.pointColors[i], 2);
   }
 
   for (int curL = 0; curL < LI; ++curL)
@@ -94,6 +191,7 @@ std::vector<cv::Point> PixelSelector::selectInternal(const cv::Mat &frame,
 
   lastBlockSize = blockSize;
   lastPointsFound = foundTotal;
+  PROFILE_COUNT("selector.selected", pointsAll.size());
 
   return pointsAll;
 }
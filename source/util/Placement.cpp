@@ -0,0 +1,104 @@
+#include "util/Placement.h"
+#include <Eigen/Core>
+#include <cstdlib>
+#include <glog/logging.h>
+#include <new>
+#include <sstream>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+namespace fishdso {
+
+namespace {
+
+constexpr size_t hugePageSize = size_t(2) << 20;
+
+bool isHuge(size_t bytes, bool hugePages) {
+  return hugePages && bytes >= hugePageSize;
+}
+
+size_t roundToHugePages(size_t bytes) {
+  return (bytes + hugePageSize - 1) / hugePageSize * hugePageSize;
+}
+
+} // namespace
+
+std::vector<int> parseCoreList(const std::string &list) {
+  std::vector<int> cores;
+  std::stringstream stream(list);
+  std::string range;
+  while (std::getline(stream, range, ',')) {
+    if (range.empty())
+      continue;
+    size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first
+                                         : std::stoi(range.substr(dash + 1));
+    CHECK(first >= 0 && first <= last) << "wrong core range " << range;
+    for (int core = first; core <= last; ++core)
+      cores.push_back(core);
+  }
+  return cores;
+}
+
+#ifdef __linux__
+
+bool pinThread(const std::vector<int> &cores) {
+  if (cores.empty())
+    return true;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int core : cores)
+    if (core < CPU_SETSIZE)
+      CPU_SET(core, &set);
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  LOG_IF(WARNING, error) << "could not pin a thread, error " << error;
+  return !error;
+}
+
+ScopedAffinity::ScopedAffinity(const std::vector<int> &cores) {
+  if (cores.empty())
+    return;
+  cpu_set_t set;
+  if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    return;
+  for (int core = 0; core < CPU_SETSIZE; ++core)
+    if (CPU_ISSET(core, &set))
+      previousCores.push_back(core);
+  pinThread(cores);
+}
+
+#else
+
+bool pinThread(const std::vector<int> &cores) { return cores.empty(); }
+
+ScopedAffinity::ScopedAffinity(const std::vector<int> &cores) {}
+
+#endif
+
+ScopedAffinity::~ScopedAffinity() { pinThread(previousCores); }
+
+void *allocateBuffer(size_t bytes, bool hugePages) {
+  if (!isHuge(bytes, hugePages))
+    return Eigen::internal::aligned_malloc(bytes);
+  size_t size = roundToHugePages(bytes);
+  void *data = nullptr;
+  if (posix_memalign(&data, hugePageSize, size) != 0)
+    throw std::bad_alloc();
+#ifdef __linux__
+  madvise(data, size, MADV_HUGEPAGE);
+#endif
+  return data;
+}
+
+void freeBuffer(void *data, size_t bytes, bool hugePages) {
+  if (isHuge(bytes, hugePages))
+    std::free(data);
+  else
+    Eigen::internal::aligned_free(data);
+}
+
+} // namespace fishdso
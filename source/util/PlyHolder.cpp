@@ -1,24 +1,51 @@
 #include "util/PlyHolder.h"
+#include <cstring>
 #include <glog/logging.h>
-#include <fstream>
 
 namespace fishdso {
 
 const int countSpace = 19;
 
-PlyHolder::PlyHolder(const std::string &fname)
+// x, y, z as floats and red, green, blue as uchars, packed
+constexpr int binaryVertexSize = 3 * sizeof(float) + 3;
+
+PlyHolder::PlyHolder(const std::string &fname, Format format,
+                     int pointsPerChunk)
     : fname(fname)
+    , format(format)
+    , pointsPerChunk(pointsPerChunk)
+    , buffer(bufferSize)
+    , chunkNum(0)
     , pointCount(0) {
-  std::ofstream fs(fname);
+  openChunk();
+}
+
+PlyHolder::~PlyHolder() { updatePointCount(); }
+
+std::string PlyHolder::chunkName(int chunk) const {
+  if (pointsPerChunk <= 0)
+    return fname;
+  std::string::size_type dot = fname.rfind('.');
+  std::string::size_type slash = fname.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    dot = fname.size();
+  return fname.substr(0, dot) + "_" + std::to_string(chunk) + fname.substr(dot);
+}
+
+void PlyHolder::openChunk() {
+  std::string name = chunkName(chunkNum);
+  // the buffer has to be set before the file is opened
+  fs.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+  fs.open(name, std::ios_base::out | std::ios_base::binary);
 
   if (!fs.good())
-    throw std::runtime_error("File \"" + fname + "\" could not be created.");
+    throw std::runtime_error("File \"" + name + "\" could not be created.");
 
-  fs << R"__(ply
-format ascii 1.0
-element vertex 0)__" +
-            std::string(countSpace - 1, ' ') +
-            R"__(
+  fs << "ply\nformat "
+     << (format == BINARY ? "binary_little_endian" : "ascii")
+     << " 1.0\nelement vertex ";
+  countPos = fs.tellp();
+  fs << '0' << std::string(countSpace - 1, ' ') << R"__(
 property float x
 property float y
 property float z
@@ -27,8 +54,35 @@ property uchar green
 property uchar blue
 end_header
 )__";
+  pointCount = 0;
+}
 
-  fs.close();
+void PlyHolder::write(const Vec3 *points, const cv::Vec3b *colors,
+                      int count) {
+  if (format == BINARY) {
+    // PLY binary_little_endian is the byte order of the platforms we run on,
+    // so the vertices are packed as they are in memory
+    std::vector<char> packed(size_t(count) * binaryVertexSize);
+    char *out = packed.data();
+    for (int i = 0; i < count; ++i) {
+      float coords[3] = {float(points[i][0]), float(points[i][1]),
+                         float(points[i][2])};
+      unsigned char rgb[3] = {colors[i][2], colors[i][1], colors[i][0]};
+      std::memcpy(out, coords, sizeof(coords));
+      std::memcpy(out + sizeof(coords), rgb, sizeof(rgb));
+      out += binaryVertexSize;
+    }
+    fs.write(packed.data(), packed.size());
+  } else {
+    for (int i = 0; i < count; ++i) {
+      const Vec3 &p = points[i];
+      const cv::Vec3b &color = colors[i];
+      fs << p[0] << ' ' << p[1] << ' ' << p[2] << ' ';
+      fs << int(color[2]) << ' ' << int(color[1]) << ' ' << int(color[0])
+         << '\n';
+    }
+  }
+  pointCount += count;
 }
 
 void PlyHolder::putPoints(const std::vector<Vec3> &points,
@@ -38,27 +92,29 @@ void PlyHolder::putPoints(const std::vector<Vec3> &points,
          "PlyHolder::putPoints."
       << std::endl;
 
-  std::ofstream fs(fname, std::ios_base::app);
   int cnt = std::min(points.size(), colors.size());
-  for (int i = 0; i < cnt; ++i) {
-    const Vec3 &p = points[i];
-    const cv::Vec3b &color = colors[i];
-    fs << p[0] << ' ' << p[1] << ' ' << p[2] << ' ';
-    fs << int(color[2]) << ' ' << int(color[1]) << ' ' << int(color[0]) << '\n';
+  for (int written = 0; written < cnt;) {
+    if (pointsPerChunk > 0 && pointCount >= pointsPerChunk) {
+      updatePointCount();
+      fs.close();
+      ++chunkNum;
+      openChunk();
+    }
+    int toWrite = pointsPerChunk > 0
+                      ? std::min(cnt - written, pointsPerChunk - pointCount)
+                      : cnt - written;
+    write(points.data() + written, colors.data() + written, toWrite);
+    written += toWrite;
   }
-
-  pointCount += cnt;
-
-  fs.close();
 }
 
 void PlyHolder::updatePointCount() {
-  const int countPos = 36;
-  std::fstream fs(fname);
+  std::streampos end = fs.tellp();
   std::string emplacedValue = std::to_string(pointCount);
   emplacedValue += std::string(countSpace - emplacedValue.length(), ' ');
   fs.seekp(countPos) << emplacedValue;
-  fs.close();
+  fs.seekp(end);
+  fs.flush();
 }
 
 } // namespace fishdso
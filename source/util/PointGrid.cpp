@@ -0,0 +1,29 @@
+#include "util/PointGrid.h"
+#include <glog/logging.h>
+
+namespace fishdso {
+
+PointGrid::PointGrid(int w, int h, int cellSize, const std::vector<double> &x,
+                     const std::vector<double> &y)
+    : cellSize(cellSize)
+    , cellsW(std::max(1, (w + cellSize - 1) / cellSize))
+    , cellsH(std::max(1, (h + cellSize - 1) / cellSize))
+    , cellStart(cellsW * cellsH + 1, 0)
+    , cellItems(x.size()) {
+  CHECK_EQ(x.size(), y.size());
+  CHECK_GT(cellSize, 0);
+
+  std::vector<int> cells(x.size());
+  for (int i = 0; i < x.size(); ++i) {
+    cells[i] = cellY(y[i]) * cellsW + cellX(x[i]);
+    cellStart[cells[i] + 1]++;
+  }
+  for (int c = 0; c < cellsW * cellsH; ++c)
+    cellStart[c + 1] += cellStart[c];
+
+  std::vector<int> cellFill(cellStart.begin(), cellStart.end() - 1);
+  for (int i = 0; i < x.size(); ++i)
+    cellItems[cellFill[cells[i]]++] = i;
+}
+
+} // namespace fishdso
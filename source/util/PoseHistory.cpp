@@ -0,0 +1,77 @@
+#include "util/PoseHistory.h"
+#include <algorithm>
+#include <glog/logging.h>
+
+namespace fishdso {
+
+PoseHistory::PoseHistory(int chunkSize)
+    : chunkSize(chunkSize)
+    , totalSize(0)
+    , flushedSize(0) {
+  CHECK_GT(chunkSize, 0);
+}
+
+FramePose &PoseHistory::append(int frameNum) {
+  CHECK(empty() || frameNum > lastFrameNum());
+  if (chunks.empty() || chunks.back().size() == chunkSize) {
+    chunks.emplace_back();
+    chunks.back().reserve(chunkSize);
+  }
+  FramePose &pose = chunks.back().emplace_back();
+  pose.frameNum = frameNum;
+  ++totalSize;
+  return pose;
+}
+
+FramePose &PoseHistory::operator[](int frameNum) {
+  return const_cast<FramePose &>(
+      static_cast<const PoseHistory &>(*this)[frameNum]);
+}
+
+const FramePose &PoseHistory::operator[](int frameNum) const {
+  // the first chunk that starts after frameNum, the frame is in the one
+  // before it
+  auto chunkIt = std::upper_bound(
+      chunks.begin(), chunks.end(), frameNum,
+      [](int num, const Chunk &chunk) { return num < chunk[0].frameNum; });
+  CHECK(chunkIt != chunks.begin())
+      << "frame #" << frameNum << " was flushed or never added";
+  const Chunk &chunk = *(--chunkIt);
+  auto it = std::lower_bound(
+      chunk.begin(), chunk.end(), frameNum,
+      [](const FramePose &pose, int num) { return pose.frameNum < num; });
+  CHECK(it != chunk.end() && it->frameNum == frameNum)
+      << "frame #" << frameNum << " was never added";
+  return *it;
+}
+
+int PoseHistory::lastFrameNum(int ind) const {
+  CHECK_LT(ind, totalSize - flushedSize);
+  for (auto chunkIt = chunks.rbegin(); chunkIt != chunks.rend(); ++chunkIt) {
+    if (ind < chunkIt->size())
+      return (*chunkIt)[chunkIt->size() - 1 - ind].frameNum;
+    ind -= chunkIt->size();
+  }
+  LOG(FATAL) << "unreachable";
+  return -1;
+}
+
+std::vector<PoseHistory::Chunk> PoseHistory::flushBefore(int frameNum) {
+  std::vector<Chunk> flushed;
+  while (chunks.size() > 1 && chunks.front().back().frameNum < frameNum) {
+    flushedSize += chunks.front().size();
+    flushed.push_back(std::move(chunks.front()));
+    chunks.pop_front();
+  }
+  return flushed;
+}
+
+std::vector<PoseHistory::Chunk> PoseHistory::flushAll() {
+  std::vector<Chunk> flushed(std::make_move_iterator(chunks.begin()),
+                             std::make_move_iterator(chunks.end()));
+  chunks.clear();
+  flushedSize = totalSize;
+  return flushed;
+}
+
+} // namespace fishdso
@@ -0,0 +1,318 @@
+#include "util/Profiler.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <glog/logging.h>
+#include <iomanip>
+#include <mutex>
+
+namespace fishdso {
+
+namespace {
+
+enum MetricKind { TIMER, COUNTER, HISTOGRAM, MEMORY };
+
+// A timer takes two slots (calls and nanoseconds), a counter one, a
+// histogram one per bucket, including the two outer ones, and a memory
+// metric two (the change of the live bytes and the allocations).
+struct Metric {
+  std::string name;
+  MetricKind kind;
+  int firstSlot;
+  double min, max;
+  int bucketNum;
+};
+
+struct TraceEvent {
+  const char *name;
+  // since the start of the trace
+  long long startNs;
+  long long durationNs;
+};
+
+// The ring of a thread is (re)allocated by its first event in a new trace.
+struct ThreadTrace {
+  // only contended while the trace is written out
+  std::mutex mutex;
+  int generation = 0;
+  std::vector<TraceEvent> ring;
+  long long eventNum = 0;
+};
+
+struct ThreadSlots {
+  ThreadSlots(int threadId)
+      : threadId(threadId) {
+    for (auto &slot : slots)
+      slot.store(0, std::memory_order_relaxed);
+  }
+
+  std::array<std::atomic<long long>, Profiler::maxSlots> slots;
+  int threadId;
+  ThreadTrace trace;
+};
+
+struct Registry {
+  std::mutex mutex;
+  // Fixed capacity, so that recording can read the metric behind an id it
+  // was given without taking the lock while others register.
+  std::array<Metric, Profiler::maxSlots> metrics;
+  int metricNum = 0;
+  int slotsUsed = 0;
+  std::vector<ThreadSlots *> threads;
+  // what the threads that have already exited recorded
+  std::array<long long, Profiler::maxSlots> retired = {};
+  // of the memory metrics, by the first slot
+  std::array<long long, Profiler::maxSlots> liveBytes = {};
+  int threadNum = 0;
+
+  // Zero while no trace was started. The capacity and the start are set
+  // before the generation is published.
+  std::atomic<int> traceGeneration{0};
+  int traceCapacity = 0;
+  std::chrono::steady_clock::time_point traceStart;
+  // the events of the exited threads with their ids
+  std::vector<std::pair<int, TraceEvent>> retiredEvents;
+};
+
+// the events of the current trace in the order of recording
+void appendEvents(ThreadTrace &trace, int generation, int threadId,
+                  std::vector<std::pair<int, TraceEvent>> &events) {
+  if (trace.generation != generation)
+    return;
+  long long capacity = trace.ring.size();
+  for (long long e = std::max(0LL, trace.eventNum - capacity);
+       e < trace.eventNum; ++e)
+    events.push_back({threadId, trace.ring[e % capacity]});
+}
+
+// Never destroyed, as worker threads may still record during the exit.
+Registry &registry() {
+  static Registry *registry = new Registry();
+  return *registry;
+}
+
+struct ThreadSlotsHolder {
+  ThreadSlotsHolder() {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    slots = new ThreadSlots(reg.threadNum++);
+    reg.threads.push_back(slots);
+  }
+
+  ~ThreadSlotsHolder() {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    for (int s = 0; s < reg.slotsUsed; ++s)
+      reg.retired[s] += slots->slots[s].load(std::memory_order_relaxed);
+    appendEvents(slots->trace, reg.traceGeneration.load(), slots->threadId,
+                 reg.retiredEvents);
+    reg.threads.erase(
+        std::find(reg.threads.begin(), reg.threads.end(), slots));
+    delete slots;
+  }
+
+  ThreadSlots *slots;
+};
+
+ThreadSlots *threadSlots() {
+  thread_local ThreadSlotsHolder holder;
+  return holder.slots;
+}
+
+std::atomic<long long> &threadSlot(int slot) {
+  return threadSlots()->slots[slot];
+}
+
+int registerMetric(const char *name, MetricKind kind, double min, double max,
+                   int bucketNum) {
+  Registry &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  for (int i = 0; i < reg.metricNum; ++i) {
+    const Metric &metric = reg.metrics[i];
+    if (metric.name != name)
+      continue;
+    CHECK(metric.kind == kind && metric.min == min && metric.max == max &&
+          metric.bucketNum == bucketNum)
+        << "metric \"" << name << "\" registered differently twice";
+    return i;
+  }
+
+  int slotNum = kind == HISTOGRAM ? bucketNum + 2 : kind == COUNTER ? 1 : 2;
+  CHECK_LE(reg.slotsUsed + slotNum, Profiler::maxSlots)
+      << "too many profiled metrics";
+  reg.metrics[reg.metricNum] = {name, kind, reg.slotsUsed, min, max, bucketNum};
+  reg.slotsUsed += slotNum;
+  return reg.metricNum++;
+}
+
+void add(int slot, long long value) {
+  threadSlot(slot).fetch_add(value, std::memory_order_relaxed);
+}
+
+} // namespace
+
+std::atomic<bool> Profiler::tracing{false};
+
+int Profiler::registerTimer(const char *name) {
+  return registerMetric(name, TIMER, 0, 0, 0);
+}
+
+int Profiler::registerCounter(const char *name) {
+  return registerMetric(name, COUNTER, 0, 0, 0);
+}
+
+int Profiler::registerHistogram(const char *name, double min, double max,
+                                int bucketNum) {
+  CHECK_LT(min, max);
+  CHECK_GT(bucketNum, 0);
+  return registerMetric(name, HISTOGRAM, min, max, bucketNum);
+}
+
+int Profiler::registerMemory(const char *name) {
+  return registerMetric(name, MEMORY, 0, 0, 0);
+}
+
+void Profiler::addTime(int id, std::chrono::steady_clock::duration duration) {
+  int slot = registry().metrics[id].firstSlot;
+  add(slot, 1);
+  add(slot + 1,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+void Profiler::addCount(int id, long long value) {
+  add(registry().metrics[id].firstSlot, value);
+}
+
+void Profiler::addToHistogram(int id, double value) {
+  const Metric &metric = registry().metrics[id];
+  int bucket;
+  if (!(value >= metric.min)) // NaN goes here as well
+    bucket = 0;
+  else if (value >= metric.max)
+    bucket = metric.bucketNum + 1;
+  else
+    bucket = 1 + std::min(int(metric.bucketNum * (value - metric.min) /
+                              (metric.max - metric.min)),
+                          metric.bucketNum - 1);
+  add(metric.firstSlot + bucket, 1);
+}
+
+void Profiler::addAllocation(int id, long long bytes) {
+  int slot = registry().metrics[id].firstSlot;
+  add(slot, bytes);
+  add(slot + 1, 1);
+}
+
+void Profiler::addDeallocation(int id, long long bytes) {
+  add(registry().metrics[id].firstSlot, -bytes);
+}
+
+FrameProfile Profiler::collect() {
+  Registry &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+
+  std::array<long long, maxSlots> sums = reg.retired;
+  reg.retired.fill(0);
+  for (ThreadSlots *thread : reg.threads)
+    for (int s = 0; s < reg.slotsUsed; ++s)
+      sums[s] += thread->slots[s].exchange(0, std::memory_order_relaxed);
+
+  FrameProfile profile;
+  for (int i = 0; i < reg.metricNum; ++i) {
+    const Metric &metric = reg.metrics[i];
+    const long long *slot = sums.data() + metric.firstSlot;
+    switch (metric.kind) {
+    case TIMER:
+      profile.timers.push_back({metric.name, slot[0], slot[1] * 1e-9});
+      break;
+    case COUNTER:
+      profile.counters.push_back({metric.name, slot[0]});
+      break;
+    case HISTOGRAM:
+      profile.histograms.push_back(
+          {metric.name, metric.min, metric.max,
+           std::vector<long long>(slot, slot + metric.bucketNum + 2)});
+      break;
+    case MEMORY:
+      reg.liveBytes[metric.firstSlot] += slot[0];
+      profile.memory.push_back(
+          {metric.name, reg.liveBytes[metric.firstSlot], slot[1]});
+      break;
+    }
+  }
+  return profile;
+}
+
+void Profiler::startTrace(int eventsPerThread) {
+  CHECK_GT(eventsPerThread, 0);
+  Registry &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  reg.traceCapacity = eventsPerThread;
+  reg.traceStart = std::chrono::steady_clock::now();
+  reg.retiredEvents.clear();
+  reg.traceGeneration.fetch_add(1, std::memory_order_release);
+  tracing.store(true, std::memory_order_relaxed);
+}
+
+void Profiler::stopTrace() { tracing.store(false, std::memory_order_relaxed); }
+
+void Profiler::addTraceEvent(const char *name,
+                             std::chrono::steady_clock::time_point start,
+                             std::chrono::steady_clock::time_point end) {
+  if (!isTracing())
+    return;
+  Registry &reg = registry();
+  int generation = reg.traceGeneration.load(std::memory_order_acquire);
+  ThreadTrace &trace = threadSlots()->trace;
+  std::lock_guard<std::mutex> lock(trace.mutex);
+  if (trace.generation != generation) {
+    trace.generation = generation;
+    trace.ring.resize(reg.traceCapacity);
+    trace.eventNum = 0;
+  }
+  auto toNs = [](std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+        .count();
+  };
+  trace.ring[trace.eventNum % trace.ring.size()] = {
+      name, toNs(start - reg.traceStart), toNs(end - start)};
+  trace.eventNum++;
+}
+
+const char *Profiler::metricName(int id) {
+  return registry().metrics[id].name.c_str();
+}
+
+void Profiler::writeTrace(const std::string &fname) {
+  Registry &reg = registry();
+  std::vector<std::pair<int, TraceEvent>> events;
+  {
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    int generation = reg.traceGeneration.load();
+    events = reg.retiredEvents;
+    for (ThreadSlots *thread : reg.threads) {
+      std::lock_guard<std::mutex> traceLock(thread->trace.mutex);
+      appendEvents(thread->trace, generation, thread->threadId, events);
+    }
+  }
+
+  std::ofstream ofs(fname);
+  CHECK(ofs) << "could not open " << fname;
+  ofs << std::fixed << std::setprecision(3);
+  ofs << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  for (int i = 0; i < events.size(); ++i) {
+    const auto &[threadId, event] = events[i];
+    std::string name = event.name;
+    std::string category = name.substr(0, name.find('.'));
+    ofs << (i > 0 ? ",\n" : "\n") << "{\"name\": \"" << name
+        << "\", \"cat\": \"" << category
+        << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << threadId
+        << ", \"ts\": " << event.startNs * 1e-3
+        << ", \"dur\": " << event.durationNs * 1e-3 << '}';
+  }
+  ofs << "\n]}\n";
+}
+
+} // namespace fishdso
@@ -0,0 +1,63 @@
+#include "util/Random.h"
+#include <glog/logging.h>
+#include <random>
+
+namespace fishdso {
+
+namespace {
+
+constexpr std::uint32_t philoxM0 = 0xD2511F53, philoxM1 = 0xCD9E8D57;
+constexpr std::uint32_t philoxW0 = 0x9E3779B9, philoxW1 = 0xBB67AE85;
+constexpr int philoxRounds = 10;
+constexpr std::uint32_t deterministicSeed = 42;
+
+} // namespace
+
+RandomStream::RandomStream(std::uint32_t seed, RandomStage stage,
+                           std::uint32_t key, std::uint32_t task)
+    : key{seed, key}
+    , task(task)
+    , stage(stage) {}
+
+std::array<std::uint32_t, 4>
+RandomStream::philox(std::uint64_t blockCounter) const {
+  std::array<std::uint32_t, 4> c = {
+      std::uint32_t(blockCounter), std::uint32_t(blockCounter >> 32), task,
+      std::uint32_t(stage)};
+  std::uint32_t k0 = key[0], k1 = key[1];
+  for (int round = 0; round < philoxRounds; ++round) {
+    std::uint64_t p0 = std::uint64_t(philoxM0) * c[0];
+    std::uint64_t p1 = std::uint64_t(philoxM1) * c[2];
+    c = {std::uint32_t(p1 >> 32) ^ c[1] ^ k0, std::uint32_t(p1),
+         std::uint32_t(p0 >> 32) ^ c[3] ^ k1, std::uint32_t(p0)};
+    k0 += philoxW0;
+    k1 += philoxW1;
+  }
+  return c;
+}
+
+int RandomStream::uniformInt(int n) {
+  CHECK_GT(n, 0);
+  // the largest multiple of n that fits, the numbers above it are redrawn
+  const std::uint64_t range = std::uint64_t(max()) + 1;
+  const std::uint64_t limit = range - range % n;
+  std::uint64_t x;
+  do
+    x = (*this)();
+  while (x >= limit);
+  return int(x % n);
+}
+
+double RandomStream::uniformReal() {
+  std::uint64_t high = (*this)() >> 5, low = (*this)() >> 6;
+  return (high * 67108864.0 + low) / 9007199254740992.0;
+}
+
+RandomStream randomStream(bool deterministic, RandomStage stage,
+                          std::uint32_t key, std::uint32_t task) {
+  std::uint32_t seed =
+      deterministic ? deterministicSeed : std::random_device()();
+  return RandomStream(seed, stage, key, task);
+}
+
+} // namespace fishdso
@@ -0,0 +1,136 @@
+#include "util/RecordStream.h"
+#include <cstring>
+#include <glog/logging.h>
+
+namespace fishdso {
+
+namespace {
+
+constexpr char recordMagic[8] = {'F', 'I', 'S', 'H', 'D', 'S', 'O', 'R'};
+constexpr int32_t recordVersion = 1;
+
+// x, y, z as floats and blue, green, red as uchars
+constexpr int packedPointSize = 3 * sizeof(float) + 3;
+
+} // namespace
+
+RecordStream::RecordStream(const std::string &fname, Precision posePrecision)
+    : posePrecision(posePrecision)
+    , buffer(bufferSize) {
+  // the buffer has to be set before the file is opened
+  stream.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+  stream.open(fname, std::ios_base::out | std::ios_base::binary);
+  if (!stream.good())
+    throw std::runtime_error("File \"" + fname + "\" could not be created.");
+  stream.write(recordMagic, sizeof(recordMagic));
+  put(recordVersion);
+  put(int32_t(posePrecision));
+}
+
+RecordStream::~RecordStream() { flush(); }
+
+void RecordStream::putPose(int frameNum, double timestamp,
+                           const SE3 &worldToFrame) {
+  Eigen::Matrix<double, 7, 1> motion;
+  motion << worldToFrame.unit_quaternion().coeffs(),
+      worldToFrame.translation();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  put(int32_t(POSE));
+  put(int32_t(frameNum));
+  put(timestamp);
+  for (int i = 0; i < 7; ++i) {
+    if (posePrecision == FLOAT)
+      put(float(motion[i]));
+    else
+      put(motion[i]);
+  }
+}
+
+void RecordStream::putPoints(int keyFrameNum, const std::vector<Vec3> &points,
+                             const std::vector<cv::Vec3b> &colors) {
+  CHECK_EQ(points.size(), colors.size());
+  std::vector<char> packed(points.size() * packedPointSize);
+  char *out = packed.data();
+  for (int i = 0; i < points.size(); ++i) {
+    float coords[3] = {float(points[i][0]), float(points[i][1]),
+                       float(points[i][2])};
+    std::memcpy(out, coords, sizeof(coords));
+    std::memcpy(out + sizeof(coords), colors[i].val, 3);
+    out += packedPointSize;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  put(int32_t(POINTS));
+  put(int32_t(keyFrameNum));
+  put(int32_t(points.size()));
+  stream.write(packed.data(), packed.size());
+}
+
+void RecordStream::flush() {
+  std::lock_guard<std::mutex> lock(mutex);
+  stream.flush();
+}
+
+RecordReader::RecordReader(const std::string &fname)
+    : stream(fname, std::ios_base::in | std::ios_base::binary) {
+  CHECK(stream.good()) << "could not open " << fname;
+  char magic[sizeof(recordMagic)];
+  int32_t version, precision;
+  CHECK(stream.read(magic, sizeof(magic)) &&
+        std::memcmp(magic, recordMagic, sizeof(magic)) == 0)
+      << fname << " is not a record stream";
+  CHECK(get(version) && version == recordVersion)
+      << "unsupported record stream version";
+  CHECK(get(precision));
+  posePrecision = RecordStream::Precision(precision);
+}
+
+bool RecordReader::next(Record &record) {
+  int32_t type;
+  if (!get(type))
+    return false;
+  record.type = RecordStream::RecordType(type);
+
+  if (record.type == RecordStream::POSE) {
+    int32_t frameNum;
+    Eigen::Matrix<double, 7, 1> motion;
+    if (!get(frameNum) || !get(record.timestamp))
+      return false;
+    for (int i = 0; i < 7; ++i) {
+      if (posePrecision == RecordStream::FLOAT) {
+        float val;
+        if (!get(val))
+          return false;
+        motion[i] = val;
+      } else if (!get(motion[i]))
+        return false;
+    }
+    record.frameNum = frameNum;
+    Quaternion rotation(motion.head<4>());
+    record.worldToFrame = SE3(rotation.normalized(), motion.tail<3>());
+    return true;
+  }
+
+  CHECK_EQ(record.type, RecordStream::POINTS) << "unknown record type";
+  int32_t keyFrameNum, count;
+  if (!get(keyFrameNum) || !get(count))
+    return false;
+  std::vector<char> packed(size_t(count) * packedPointSize);
+  if (!stream.read(packed.data(), packed.size()))
+    return false;
+  record.keyFrameNum = keyFrameNum;
+  record.points.resize(count);
+  record.colors.resize(count);
+  const char *in = packed.data();
+  for (int i = 0; i < count; ++i) {
+    float coords[3];
+    std::memcpy(coords, in, sizeof(coords));
+    std::memcpy(record.colors[i].val, in + sizeof(coords), 3);
+    record.points[i] = Vec3(coords[0], coords[1], coords[2]);
+    in += packedPointSize;
+  }
+  return true;
+}
+
+} // namespace fishdso
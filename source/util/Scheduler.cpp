@@ -0,0 +1,104 @@
+#include "util/Scheduler.h"
+#include "util/Placement.h"
+#include <glog/logging.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_scheduler_observer.h>
+
+namespace fishdso {
+
+namespace {
+
+// Pins the workers entering an arena. The threads that call execute only
+// visit it and are left as they are.
+class PinningObserver : public tbb::task_scheduler_observer {
+public:
+  PinningObserver(tbb::task_arena &arena, const std::vector<int> &cores)
+      : tbb::task_scheduler_observer(arena)
+      , cores(cores) {
+    observe(true);
+  }
+  ~PinningObserver() { observe(false); }
+
+  void on_scheduler_entry(bool isWorker) override {
+    if (isWorker)
+      pinThread(cores);
+  }
+
+private:
+  std::vector<int> cores;
+};
+
+} // namespace
+
+struct Scheduler::Arenas {
+  tbb::task_arena arenas[priorityNum];
+  std::vector<std::unique_ptr<PinningObserver>> observers;
+};
+
+Scheduler::Scheduler(int numThreads, const std::vector<int> &cores)
+    : mNumThreads(numThreads)
+    , arenas(new Arenas) {
+  CHECK_GT(numThreads, 0);
+#if TBB_INTERFACE_VERSION >= 12000
+  const tbb::task_arena::priority priorities[priorityNum] = {
+      tbb::task_arena::priority::high, tbb::task_arena::priority::normal,
+      tbb::task_arena::priority::low};
+  for (int p = 0; p < priorityNum; ++p)
+    arenas->arenas[p].initialize(numThreads, 1, priorities[p]);
+#else
+  for (int p = 0; p < priorityNum; ++p)
+    arenas->arenas[p].initialize(numThreads);
+#endif
+  if (!cores.empty())
+    for (int p = 0; p < priorityNum; ++p)
+      arenas->observers.emplace_back(
+          new PinningObserver(arenas->arenas[p], cores));
+}
+
+Scheduler::~Scheduler() = default;
+
+int Scheduler::numThreads() const { return mNumThreads; }
+
+void Scheduler::execute(Priority priority, const std::function<void()> &f) {
+  arenas->arenas[priority].execute(f);
+}
+
+void Scheduler::enqueue(Priority priority, std::function<void()> f) {
+  arenas->arenas[priority].enqueue(std::move(f));
+}
+
+struct ParallelExecutor::OwnArena {
+  OwnArena(int numThreads, const std::vector<int> &cores)
+      : arena(numThreads) {
+    if (!cores.empty()) {
+      arena.initialize();
+      observer.reset(new PinningObserver(arena, cores));
+    }
+  }
+
+  tbb::task_arena arena;
+  std::unique_ptr<PinningObserver> observer;
+};
+
+ParallelExecutor::ParallelExecutor(const Settings::Threading &settings,
+                                   Scheduler::Priority priority)
+    : scheduler(settings.scheduler.get())
+    , priority(priority)
+    , ownArena(scheduler ? nullptr
+                         : new OwnArena(settings.numThreads, settings.cores)) {}
+
+ParallelExecutor::~ParallelExecutor() = default;
+
+void ParallelExecutor::execute(const std::function<void()> &f) {
+  if (scheduler)
+    scheduler->execute(priority, f);
+  else
+    ownArena->arena.execute(f);
+}
+
+int threadNum(const Settings::Threading &settings) {
+  return settings.scheduler ? settings.scheduler->numThreads()
+                            : settings.numThreads;
+}
+
+} // namespace fishdso
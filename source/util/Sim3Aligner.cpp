@@ -31,4 +31,17 @@ Vec3 Sim3Aligner::alignScale(const Vec3 &pointInFrameGT) const {
   return scaleGTToDso * pointInFrameGT;
 }
 
+void Sim3Aligner::alignToWorld(const SE3 &frameToWorld,
+                               std::vector<Vec3> &pointsInFrameGT) const {
+  static_assert(sizeof(Vec3) == 3 * sizeof(double),
+                "points should be packed into a 3xN matrix");
+  if (pointsInFrameGT.empty())
+    return;
+  Eigen::Map<Eigen::Matrix<double, 3, Eigen::Dynamic>> block(
+      pointsInFrameGT.data()->data(), 3, pointsInFrameGT.size());
+  Mat33 scaledRotation = scaleGTToDso * frameToWorld.rotationMatrix();
+  block = scaledRotation * block;
+  block.colwise() += frameToWorld.translation();
+}
+
 } // namespace fishdso
@@ -1,8 +1,27 @@
 #include "util/SphericalTerrain.h"
 #include "util/defs.h"
+#include "util/util.h"
 
 namespace fishdso {
 
+namespace {
+
+// points sampled on every side of a sector to find its bounding box
+constexpr int sideSamples = 16;
+// accounts for the sides curving between the samples
+constexpr int boxPadding = 2;
+
+struct SectorFill {
+  // pointing inside the sector
+  Vec3 sideNormals[3];
+  // the plane through the depthed rays is planeNormal * p = planeOffset
+  Vec3 planeNormal;
+  double planeOffset;
+  int minX, maxX;
+};
+
+} // namespace
+
 SphericalTerrain::SphericalTerrain(
     const std::vector<Vec3> &depthedRays,
     const Settings::Triangulation &triangulationSettings)
@@ -15,17 +34,71 @@ bool SphericalTerrain::operator()(Vec3 direction, double &resDepth) {
   if (sec == nullptr)
     return false;
 
-  Mat43 A;
-  for (int i = 0; i < 3; ++i)
-    A.block<3, 1>(0, i) = *sec->rays[i];
-  A.block<1, 3>(3, 0) = Vec3::Ones().transpose();
-  Mat44 Q = A.householderQr().householderQ();
-  Vec4 plane = Q.col(3);
-  double alpha = -plane[3] / plane.head<3>().dot(direction);
-  resDepth = alpha * direction.norm();
+  // the plane through the depthed rays is planeNormal * p = planeOffset
+  const Vec3 *r[3] = {sec->rays[0], sec->rays[1], sec->rays[2]};
+  Vec3 planeNormal = (*r[1] - *r[0]).cross(*r[2] - *r[0]);
+  double along = planeNormal.dot(direction);
+  if (along == 0)
+    return false;
+  resDepth = planeNormal.dot(*r[0]) / along * direction.norm();
   return true;
 }
 
+cv::Mat1d SphericalTerrain::denseDepths(
+    CameraModel *cam, const Settings::Threading &threading) const {
+  const int w = cam->getWidth(), h = cam->getHeight();
+  cv::Mat1d result(h, w, 0.0);
+
+  std::vector<SectorFill> fills;
+  std::vector<int> minRow, maxRow;
+  for (const SphericalTriangulation::TrihedralSector &sec : triang.sectors()) {
+    SectorFill fill;
+    const Vec3 *r[3] = {sec.rays[0], sec.rays[1], sec.rays[2]};
+    for (int i = 0; i < 3; ++i)
+      fill.sideNormals[i] = sec.sideNormals[i];
+    fill.planeNormal = (*r[1] - *r[0]).cross(*r[2] - *r[0]);
+    fill.planeOffset = fill.planeNormal.dot(*r[0]);
+
+    Vec2 boxMin(INF, INF), boxMax(-INF, -INF);
+    for (int i = 0; i < 3; ++i)
+      for (int k = 0; k < sideSamples; ++k) {
+        double t = double(k) / sideSamples;
+        Vec3 ray = (1 - t) * r[i]->normalized() +
+                   t * r[(i + 1) % 3]->normalized();
+        Vec2 p = cam->map(ray);
+        boxMin = boxMin.cwiseMin(p);
+        boxMax = boxMax.cwiseMax(p);
+      }
+    fill.minX = int(std::floor(boxMin[0])) - boxPadding;
+    fill.maxX = int(std::ceil(boxMax[0])) + boxPadding;
+    fills.push_back(fill);
+    minRow.push_back(int(std::floor(boxMin[1])) - boxPadding);
+    maxRow.push_back(int(std::ceil(boxMax[1])) + boxPadding);
+  }
+
+  forEachInRowBands(
+      h, minRow, maxRow, threading,
+      [&](int i, int rowFrom, int rowTo) {
+        const SectorFill &fill = fills[i];
+        int xFrom = std::max(fill.minX, 0), xTo = std::min(fill.maxX, w - 1);
+        for (int y = rowFrom; y <= rowTo; ++y)
+          for (int x = xFrom; x <= xTo; ++x) {
+            Vec3 ray = cam->unmap(Vec2(double(x), double(y)));
+            if (fill.sideNormals[0].dot(ray) < 0 ||
+                fill.sideNormals[1].dot(ray) < 0 ||
+                fill.sideNormals[2].dot(ray) < 0)
+              continue;
+            double along = fill.planeNormal.dot(ray);
+            if (along == 0)
+              continue;
+            double depth = fill.planeOffset / along * ray.norm();
+            if (depth > 0)
+              result(y, x) = depth;
+          }
+      });
+  return result;
+}
+
 void SphericalTerrain::checkAllSectors(Vec3 ray, CameraModel *cam,
                                        cv::Mat &img) {
   triang.checkAllSectors(ray, cam, img);
@@ -1,6 +1,9 @@
 #include "util/SphericalTriangulation.h"
+#include "util/Log.h"
 #include "util/defs.h"
 #include "util/geometry.h"
+#include <algorithm>
+#include <cmath>
 #include <glog/logging.h>
 
 namespace fishdso {
@@ -29,42 +32,185 @@ StdVector<Vec2> projectAll(const std::vector<Vec3> &rays) {
   return result;
 }
 
+namespace {
+
+// The cube map has cubeMapSide x cubeMapSide cells on each face. Face
+// 2 * axis + (1 if the direction is negative along the axis) has the other
+// two axes in cyclic order as its coordinates.
+constexpr int cubeMapSide = 16;
+constexpr int cubeMapCellNum = 6 * cubeMapSide * cubeMapSide;
+// angle between the center of a face and its corners
+const double faceRadius = std::acos(1 / std::sqrt(3.0));
+
+Vec3 onFace(int face, double u, double v) {
+  int axis = face / 2;
+  Vec3 result;
+  result[axis] = face % 2 == 0 ? 1 : -1;
+  result[(axis + 1) % 3] = u;
+  result[(axis + 2) % 3] = v;
+  return result.normalized();
+}
+
+// the smallest cap containing a spherical polygon, up to its center
+void boundingCap(const Vec3 *corners, int cornerNum, Vec3 &center,
+                 double &radius) {
+  center = Vec3::Zero();
+  for (int i = 0; i < cornerNum; ++i)
+    center += corners[i].normalized();
+  radius = M_PI;
+  if (center.norm() < 1e-9)
+    return;
+  center.normalize();
+  double maxAngle = 0;
+  for (int i = 0; i < cornerNum; ++i)
+    maxAngle = std::max(maxAngle, angle(center, corners[i]));
+  // a cap of at least a hemisphere may not hold the polygon
+  if (maxAngle < M_PI_2)
+    radius = maxAngle;
+}
+
+} // namespace
+
 SphericalTriangulation::SphericalTriangulation(
     const std::vector<Vec3> &rays, const Settings::Triangulation &settings)
     : tangentTriang(projectAll(rays), settings)
-    , _rays(rays) {
-  for (auto tri : tangentTriang.triangles()) {
+    , _rays(rays)
+    , sectorOfTriangle(tangentTriang.triangleNum(), -1) {
+  for (int tri = 0; tri < tangentTriang.triangleNum(); ++tri) {
+    if (tangentTriang.isIncidentToBoundary(tri))
+      continue;
+    TrihedralSector sec;
     for (int i = 0; i < 3; ++i)
-      _sectors[tri].rays[i] = &_rays[tri->vert[i]->index];
+      sec.rays[i] = &_rays[tangentTriang.corner(tri, i)];
+    for (int i = 0; i < 3; ++i) {
+      sec.sideNormals[i] = sec.rays[i]->cross(*sec.rays[(i + 1) % 3]);
+      if (sec.sideNormals[i].dot(*sec.rays[(i + 2) % 3]) < 0)
+        sec.sideNormals[i] *= -1;
+    }
+    sec.triangle = tri;
+    sectorOfTriangle[tri] = _sectors.size();
+    _sectors.push_back(sec);
   }
+  buildCubeMap();
+}
+
+void SphericalTriangulation::buildCubeMap() {
+  StdVector<Vec3> cellCenters(cubeMapCellNum);
+  std::vector<double> cellRadii(cubeMapCellNum);
+  for (int face = 0; face < 6; ++face)
+    for (int iv = 0; iv < cubeMapSide; ++iv)
+      for (int iu = 0; iu < cubeMapSide; ++iu) {
+        auto coord = [](double i) { return -1 + 2 * i / cubeMapSide; };
+        Vec3 corners[4] = {onFace(face, coord(iu), coord(iv)),
+                           onFace(face, coord(iu + 1), coord(iv)),
+                           onFace(face, coord(iu), coord(iv + 1)),
+                           onFace(face, coord(iu + 1), coord(iv + 1))};
+        int cell = (face * cubeMapSide + iv) * cubeMapSide + iu;
+        cellCenters[cell] = onFace(face, coord(iu + 0.5), coord(iv + 0.5));
+        cellRadii[cell] = 0;
+        for (const Vec3 &corner : corners)
+          cellRadii[cell] =
+              std::max(cellRadii[cell], angle(cellCenters[cell], corner));
+      }
+
+  // pairs (cell, triangle), a cell for every cap that reaches it
+  std::vector<std::pair<int, int>> overlaps;
+  for (const TrihedralSector &sec : _sectors) {
+    Vec3 corners[3] = {*sec.rays[0], *sec.rays[1], *sec.rays[2]};
+    Vec3 center;
+    double radius;
+    boundingCap(corners, 3, center, radius);
+    for (int face = 0; face < 6; ++face) {
+      if (radius + faceRadius < M_PI &&
+          center.dot(onFace(face, 0, 0)) < std::cos(radius + faceRadius))
+        continue;
+      int faceBegin = face * cubeMapSide * cubeMapSide;
+      for (int cell = faceBegin; cell < faceBegin + cubeMapSide * cubeMapSide;
+           ++cell) {
+        double reach = radius + cellRadii[cell] + 1e-9;
+        if (reach >= M_PI || center.dot(cellCenters[cell]) >= std::cos(reach))
+          overlaps.push_back({cell, sec.triangle});
+      }
+    }
+  }
+  std::sort(overlaps.begin(), overlaps.end());
+
+  cellBegin.assign(cubeMapCellNum + 1, 0);
+  cellTriangles.resize(overlaps.size());
+  for (int i = 0; i < overlaps.size(); ++i) {
+    cellBegin[overlaps[i].first + 1]++;
+    cellTriangles[i] = overlaps[i].second;
+  }
+  for (int cell = 0; cell < cubeMapCellNum; ++cell)
+    cellBegin[cell + 1] += cellBegin[cell];
+}
+
+int SphericalTriangulation::cubeMapCell(const Vec3 &ray) {
+  int axis = 0;
+  for (int i = 1; i < 3; ++i)
+    if (std::abs(ray[i]) > std::abs(ray[axis]))
+      axis = i;
+  double scale = std::abs(ray[axis]);
+  if (scale == 0)
+    return 0;
+  int face = 2 * axis + (ray[axis] < 0 ? 1 : 0);
+  auto index = [scale](double coord) {
+    int i = (coord / scale + 1) / 2 * cubeMapSide;
+    return std::clamp(i, 0, cubeMapSide - 1);
+  };
+  int iu = index(ray[(axis + 1) % 3]), iv = index(ray[(axis + 2) % 3]);
+  return (face * cubeMapSide + iv) * cubeMapSide + iu;
+}
+
+void SphericalTriangulation::removeSector(int sector) {
+  sectorOfTriangle[_sectors[sector].triangle] = -1;
+  if (sector + 1 < _sectors.size()) {
+    _sectors[sector] = _sectors.back();
+    sectorOfTriangle[_sectors[sector].triangle] = sector;
+  }
+  _sectors.pop_back();
 }
 
 SphericalTriangulation::TrihedralSector *
 SphericalTriangulation::enclosingSector(Vec3 ray) {
-  std::vector<
-      std::map<const Triangulation::Triangle *, TrihedralSector>::iterator>
-      secIters;
-  for (auto it = _sectors.begin(); it != _sectors.end(); ++it)
-    if (isInSector(ray, it->second.rays))
-      secIters.push_back(it);
-  if (secIters.size() == 1) {
-    return &secIters[0]->second;
-  } else if (secIters.size() > 1) {
-    // std::cout << "removing some sectors!" << std::endl;
-
-    auto bestSecIter = *std::min_element(
-        secIters.begin(), secIters.end(), [](auto si1, auto si2) {
-          return sectorBadness(&si1->second) < sectorBadness(&si2->second);
-        });
-    for (auto si : secIters) {
-      if (si != bestSecIter)
-        _sectors.erase(si);
+  int cell = cubeMapCell(ray);
+  int found = -1;
+  bool overlap = false;
+  for (int k = cellBegin[cell]; k < cellBegin[cell + 1]; ++k) {
+    int sec = sectorOfTriangle[cellTriangles[k]];
+    if (sec >= 0 && _sectors[sec].contains(ray)) {
+      if (found >= 0) {
+        overlap = true;
+        break;
+      }
+      found = sec;
     }
+  }
+  if (found < 0)
+    return nullptr;
+  if (!overlap)
+    return &_sectors[found];
 
-    return &bestSecIter->second;
+  std::vector<int> containing;
+  for (int k = cellBegin[cell]; k < cellBegin[cell + 1]; ++k) {
+    int sec = sectorOfTriangle[cellTriangles[k]];
+    if (sec >= 0 && _sectors[sec].contains(ray))
+      containing.push_back(cellTriangles[k]);
   }
+  int bestTri = *std::min_element(
+      containing.begin(), containing.end(), [this](int tri1, int tri2) {
+        return sectorBadness(&_sectors[sectorOfTriangle[tri1]]) <
+               sectorBadness(&_sectors[sectorOfTriangle[tri2]]);
+      });
+  for (int tri : containing)
+    if (tri != bestTri)
+      removeSector(sectorOfTriangle[tri]);
+  return &_sectors[sectorOfTriangle[bestTri]];
+}
 
-  return nullptr;
+const StdVector<SphericalTriangulation::TrihedralSector> &
+SphericalTriangulation::sectors() const {
+  return _sectors;
 }
 
 void drawCurvedInternal(CameraModel *cam, Vec3 rayFrom, Vec3 rayTo,
@@ -99,22 +245,22 @@ void SphericalTriangulation::checkAllSectors(Vec3 ray, CameraModel *cam,
                                              cv::Mat &img) {
   static bool secDrawn = false;
   std::vector<TrihedralSector *> sec;
-  for (auto &triSec : _sectors)
-    if (isInSector(ray, triSec.second.rays))
-      sec.push_back(&triSec.second);
+  for (TrihedralSector &triSec : _sectors)
+    if (isInSector(ray, triSec.rays))
+      sec.push_back(&triSec);
   if (sec.size() > 1) {
-    LOG(INFO) << sec.size() << " sectors pnt!" << std::endl;
-    LOG(INFO) << "p = " << cam->map(ray.data()).transpose() << std::endl;
+    DSO_LOG(MAPPING, 3) << sec.size() << " sectors pnt!";
+    DSO_LOG(MAPPING, 3) << "p = " << cam->map(ray.data()).transpose();
     putDot(img, toCvPoint(cam->map(ray.data())), CV_BLACK);
 
     int i = 0;
     for (auto s : sec) {
-      LOG(INFO) << "sec " << i++ << " mapped" << std::endl;
+      DSO_LOG(MAPPING, 3) << "sec " << i++ << " mapped";
       for (auto r : s->rays)
-        LOG(INFO) << cam->map(r->data()).transpose() << std::endl;
-      LOG(INFO) << "unmapped:" << std::endl;
+        DSO_LOG(MAPPING, 3) << cam->map(r->data()).transpose();
+      DSO_LOG(MAPPING, 3) << "unmapped:";
       for (auto r : s->rays)
-        LOG(INFO) << r->transpose() << std::endl;
+        DSO_LOG(MAPPING, 3) << r->transpose();
 
       if (!secDrawn) {
         for (int i = 0; i < 3; ++i) {
@@ -133,12 +279,13 @@ void SphericalTriangulation::fillUncovered(cv::Mat &img, CameraModel *cam,
   const int step = 10;
   double pnt[2];
   int it = 0;
-  LOG(INFO) << "start finding uncovered pixels" << std::endl;
+  DSO_LOG(MAPPING, 2) << "start finding uncovered pixels";
   for (int y = 0; y < img.rows; y += step)
     for (int x = 0; x < img.cols; x += step) {
-      LOG(INFO) << x << ' ' << y << ' '
-                << 100 * (double((it++) * step * step) / (img.rows * img.cols))
-                << "%" << std::endl;
+      const int cell = it++;
+      DSO_LOG_EVERY_SEC(MAPPING, 2, 1.0)
+          << x << ' ' << y << ' '
+          << 100 * (double(cell * step * step) / (img.rows * img.cols)) << "%";
       pnt[0] = x;
       pnt[1] = y;
       if (isInConvexDummy(cam->unmap(pnt)))
@@ -175,10 +322,10 @@ void SphericalTriangulation::draw(cv::Mat &img, CameraModel *cam,
   //  drawCurvedInternal(cam, rayFrom, rayTo, img, CV_BLACK);
 
   std::set<std::pair<Vec3 *, Vec3 *>> edgesDrawn;
-  for (auto triSec : _sectors) {
+  for (const TrihedralSector &triSec : _sectors) {
     for (int i = 0; i < 3; ++i) {
-      Vec3 *rayFromPtr = triSec.second.rays[i];
-      Vec3 *rayToPtr = triSec.second.rays[(i + 1) % 3];
+      Vec3 *rayFromPtr = triSec.rays[i];
+      Vec3 *rayToPtr = triSec.rays[(i + 1) % 3];
       if (rayFromPtr > rayToPtr)
         std::swap(rayFromPtr, rayToPtr);
       if (edgesDrawn.find({rayFromPtr, rayToPtr}) != edgesDrawn.end())
@@ -1,11 +1,60 @@
 #include "util/Terrain.h"
+#include "util/defs.h"
+#include "util/geometry.h"
+#include "util/util.h"
 
 namespace fishdso {
 
+namespace {
+
+// Writes the depths linearly interpolated over the triangle into the rows
+// [rowFrom, rowTo] of the pixels inside it.
+void fillTriangle(const Vec2 corners[3], const Vec3 &cornerDepths,
+                  int rowFrom, int rowTo, cv::Mat1d &depths) {
+  const Vec2 &a = corners[0], &b = corners[1], &c = corners[2];
+  double det = cross2(b - a, c - a);
+  if (det == 0)
+    return;
+  double db = cornerDepths[1] - cornerDepths[0];
+  double dc = cornerDepths[2] - cornerDepths[0];
+  Vec2 depthGrad(((c[1] - a[1]) * db - (b[1] - a[1]) * dc) / det,
+                 ((b[0] - a[0]) * dc - (c[0] - a[0]) * db) / det);
+
+  for (int y = rowFrom; y <= rowTo; ++y) {
+    double xMin = INF, xMax = -INF;
+    for (int i = 0; i < 3; ++i) {
+      const Vec2 &p = corners[i], &q = corners[(i + 1) % 3];
+      if (y < std::min(p[1], q[1]) || y > std::max(p[1], q[1]))
+        continue;
+      if (p[1] == q[1]) {
+        xMin = std::min({xMin, p[0], q[0]});
+        xMax = std::max({xMax, p[0], q[0]});
+        continue;
+      }
+      double x = p[0] + (y - p[1]) * (q[0] - p[0]) / (q[1] - p[1]);
+      xMin = std::min(xMin, x);
+      xMax = std::max(xMax, x);
+    }
+    if (xMin > xMax)
+      continue;
+    int xFrom = std::max(int(std::ceil(xMin)), 0);
+    int xTo = std::min(int(std::floor(xMax)), depths.cols - 1);
+    double *row = depths[y];
+    double depth = cornerDepths[0] + depthGrad.dot(Vec2(xFrom, y) - a);
+    for (int x = xFrom; x <= xTo; ++x) {
+      row[x] = depth;
+      depth += depthGrad[0];
+    }
+  }
+}
+
+} // namespace
+
 Terrain::Terrain(CameraModel *cam, const StdVector<Vec2> &points,
                  const std::vector<double> &depths,
                  const Settings::Triangulation &triangulationSettings)
-    : depths(depths)
+    : cam(cam)
+    , depths(depths)
     , triang(points, triangulationSettings) {
   if (points.size() != depths.size())
     throw std::runtime_error("bad Terrain initialization!");
@@ -20,30 +69,93 @@ Terrain::Terrain(CameraModel *cam, const StdVector<Vec2> &points,
   debugOut = false;
 }
 
+Terrain::Terrain(CameraModel *cam,
+                 const Settings::Triangulation &triangulationSettings)
+    : cam(cam)
+    , triang(Vec2(0, 0), Vec2(cam->getWidth(), cam->getHeight()),
+             triangulationSettings) {
+  debugOut = false;
+}
+
+void Terrain::addPoint(const Vec2 &p, double depth) {
+  triang.addPoint(p);
+  depths.push_back(depth);
+  refRays.push_back(cam->unmap(p.data()).normalized() * depth);
+}
+
 bool Terrain::hasInterpolatedDepth(Vec2 p) {
-  return !triang.isIncidentToBoundary(triang.enclosingTriangle(p));
+  int tri = triang.enclosingTriangle(p);
+  return tri != Triangulation::NO_TRIANGLE && !triang.isIncidentToBoundary(tri);
 }
 
 bool Terrain::operator()(Vec2 p, double &resDepth) {
-  auto tri = triang.enclosingTriangle(p);
-  if (tri == nullptr || triang.isIncidentToBoundary(tri))
+  int tri = triang.enclosingTriangle(p);
+  if (tri == Triangulation::NO_TRIANGLE || triang.isIncidentToBoundary(tri))
     return false;
 
   Vec3 depths;
   for (int i = 0; i < 3; ++i) {
-    int curInd = tri->vert[i]->index;
+    int curInd = triang.corner(tri, i);
     depths[i] = refRays[curInd].norm();
   }
 
   Mat33 A;
   for (int i = 0; i < 3; ++i)
-    A.block<1, 2>(i, 0) = tri->vert[i]->pos.transpose();
+    A.block<1, 2>(i, 0) = triang.point(triang.corner(tri, i)).transpose();
   A.block<3, 1>(0, 2) = Vec3::Ones();
   Vec3 coeffs = A.fullPivHouseholderQr().solve(depths);
   resDepth = coeffs[0] * p[0] + coeffs[1] * p[1] + coeffs[2];
   return true;
 }
 
+cv::Mat1d Terrain::denseDepths(int width, int height,
+                               const Settings::Threading &threading) const {
+  return rasterize(width, height, threading,
+                   [&](int vert) { return refRays[vert].norm(); });
+}
+
+cv::Mat1d Terrain::denseValues(const std::vector<double> &values, int width,
+                               int height,
+                               const Settings::Threading &threading) const {
+  CHECK_EQ(values.size(), refRays.size());
+  return rasterize(width, height, threading,
+                   [&](int vert) { return values[vert]; });
+}
+
+cv::Mat1d
+Terrain::rasterize(int width, int height, const Settings::Threading &threading,
+                   const std::function<double(int)> &vertexValue) const {
+  cv::Mat1d result(height, width, 0.0);
+
+  std::vector<int> triangles, minRow, maxRow;
+  for (int t = 0; t < triang.triangleNum(); ++t) {
+    if (triang.isIncidentToBoundary(t))
+      continue;
+    double minY = INF, maxY = -INF;
+    for (int i = 0; i < 3; ++i) {
+      minY = std::min(minY, triang.point(triang.corner(t, i))[1]);
+      maxY = std::max(maxY, triang.point(triang.corner(t, i))[1]);
+    }
+    triangles.push_back(t);
+    minRow.push_back(int(std::ceil(minY)));
+    maxRow.push_back(int(std::floor(maxY)));
+  }
+
+  forEachInRowBands(
+      height, minRow, maxRow, threading,
+      [&](int i, int rowFrom, int rowTo) {
+        Vec2 corners[3];
+        Vec3 cornerDepths;
+        for (int j = 0; j < 3; ++j) {
+          int vert = triang.corner(triangles[i], j);
+          corners[j] = triang.point(vert);
+          cornerDepths[j] = vertexValue(vert);
+        }
+        fillTriangle(corners, cornerDepths, rowFrom, rowTo, result);
+      });
+  return result;
+}
+
 void Terrain::draw(cv::Mat &img, cv::Scalar edgeCol) {
   triang.draw(img, edgeCol);
 }
@@ -54,13 +166,12 @@ void Terrain::drawDensePlainDepths(cv::Mat &img, double minDepth,
     std::cerr << "wrong img type in drawDensePlainDepths" << std::endl;
     throw std::runtime_error("wrong img type in drawDensePlainDepths");
   }
+  cv::Mat1d depths = denseDepths(img.cols, img.rows);
   for (int y = 0; y < img.rows; ++y)
-    for (int x = 0; x < img.cols; ++x) {
-      double depth;
-      if (operator()(Vec2(double(x), double(y)), depth))
+    for (int x = 0; x < img.cols; ++x)
+      if (depths(y, x) > 0)
         img.at<cv::Vec3b>(y, x) =
-            toCvVec3bDummy(depthCol(depth, minDepth, maxDepth));
-    }
+            toCvVec3bDummy(depthCol(depths(y, x), minDepth, maxDepth));
 }
 
 void Terrain::drawCurved(CameraModel *cam, cv::Mat &img, cv::Scalar edgeCol) {
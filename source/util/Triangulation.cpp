@@ -3,591 +3,361 @@
 #include "util/geometry.h"
 #include "util/types.h"
 #include "util/util.h"
+#include <algorithm>
+#include <cstdint>
 #include <glog/logging.h>
+#include <numeric>
 #include <opencv2/opencv.hpp>
-#include <queue>
-#include "util/flags.h"
-#include <random>
 
 namespace fishdso {
 
-Triangulation::Triangulation(const StdVector<Vec2> &newPoints,
-                             const Settings::Triangulation &settings)
-    : indicesInv(newPoints.size())
-    , mt(FLAGS_deterministic ? 42 : std::random_device()())
-    , settings(settings) {
-  //_vertices.reserve(newPoints.size() + 3);
-
-  double minx = std::numeric_limits<double>::infinity(),
-         miny = std::numeric_limits<double>::infinity(),
-         maxx = -std::numeric_limits<double>::infinity(),
-         maxy = -std::numeric_limits<double>::infinity();
-
-  for (Vec2 p : newPoints) {
-    if (p[0] < minx)
-      minx = p[0];
-    if (p[1] < miny)
-      miny = p[1];
-    if (p[0] > maxx)
-      maxx = p[0];
-    if (p[1] > maxy)
-      maxy = p[1];
-  }
-
-  maxDim = std::max(maxx - minx, maxy - miny);
-  upperLeft = Vec2(minx, miny);
-  bottomRight = Vec2(maxx, maxy);
-
-  makeBoundingVertex(Vec2(minx - maxDim, miny - maxDim));
-  makeBoundingVertex(Vec2(minx + 4 * maxDim, miny - maxDim));
-  makeBoundingVertex(Vec2(minx - maxDim, miny + 4 * maxDim));
-
-  Triangle *tri = makeTriangle();
-  Edge *edges[] = {makeEdge(), makeEdge(), makeEdge()};
-  for (int edgesInd = 0; edgesInd < 3; ++edgesInd) {
-    const auto &curEdge = edges[edgesInd];
-    curEdge->vert[0] = _vertices[edgesInd].get();
-    _vertices[edgesInd]->edges.insert(curEdge);
-    curEdge->vert[1] = _vertices[(edgesInd + 1) % 3].get();
-    _vertices[(edgesInd + 1) % 3]->edges.insert(curEdge);
-    curEdge->triang[0] = tri;
-    curEdge->triang[1] = nullptr;
-
-    tri->edges[edgesInd] = curEdge;
-  }
-
-  for (int pointsInd = 0; pointsInd < 3; ++pointsInd) {
-    _vertices[pointsInd]->triangles.insert(tri);
-    tri->vert[pointsInd] = _vertices[pointsInd].get();
-  }
-
-  std::vector<int> indices(newPoints.size());
-  for (int i = 0; i < int(indices.size()); ++i)
-    indices[i] = i;
-  std::shuffle(indices.begin(), indices.end(), mt);
-
-  for (int i = 0; i < int(indices.size()); ++i) {
-    Vertex *vert = makeVertex(newPoints[indices[i]], indices[i]);
-    Vertex *vertCreated = addPoint(vert);
-    if (vertCreated != vert) {
-      // std::cout << "smth repeated!" << std::endl;
-      indicesInv[indices[i]] = indicesInv[vertCreated->index];
-      _vertices.pop_back();
-    } else
-      indicesInv[indices[i]] = i + 3;
+namespace {
+
+Vec2 minCorner(const StdVector<Vec2> &points) {
+  if (points.empty())
+    return Vec2::Zero();
+  Vec2 result = points[0];
+  for (const Vec2 &p : points)
+    result = result.cwiseMin(p);
+  return result;
+}
+
+Vec2 maxCorner(const StdVector<Vec2> &points) {
+  if (points.empty())
+    return Vec2::Zero();
+  Vec2 result = points[0];
+  for (const Vec2 &p : points)
+    result = result.cwiseMax(p);
+  return result;
+}
+
+// position along the Hilbert curve filling the 2^16 x 2^16 grid
+std::uint32_t hilbertIndex(std::uint32_t x, std::uint32_t y) {
+  constexpr std::uint32_t n = 1u << 16;
+  std::uint32_t d = 0;
+  for (std::uint32_t s = n / 2; s > 0; s /= 2) {
+    std::uint32_t rx = (x & s) > 0;
+    std::uint32_t ry = (y & s) > 0;
+    d += s * s * ((3 * rx) ^ ry);
+    if (ry == 0) {
+      if (rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
   }
-
-  tidy();
-  fillPtrVectors();
+  return d;
 }
 
-Triangulation::VertexIterator Triangulation::begin() const {
-  return vertexPtrs.begin();
-}
-
-Triangulation::VertexIterator Triangulation::end() const {
-  return vertexPtrs.end();
-}
+// rounds this small are not split further
+constexpr int minBrioRound = 64;
 
-Triangulation::Vertex *Triangulation::operator[](int index) const {
-  if (index < 0 || index >= int(_vertices.size()) - 3)
-    throw std::runtime_error("Triangulation: index out of bounds");
-  return _vertices[indicesInv[index]].get();
-}
+} // namespace
 
-const std::vector<const Triangulation::Edge *> &Triangulation::edges() const {
-  return edgePtrs;
-}
-
-const std::vector<const Triangulation::Triangle *> &
-Triangulation::triangles() const {
-  return trianglePtrs;
-}
-
-Triangulation::Vertex *Triangulation::makeBoundingVertex(const Vec2 &newPos) {
-  _vertices.push_back(std::unique_ptr<Vertex>(new Vertex()));
-  _vertices.back()->pos = newPos;
-  _vertices.back()->index = -1;
-
-  return _vertices.back().get();
-}
-
-Triangulation::Vertex *Triangulation::makeVertex(const Vec2 &newPos,
-                                                 int newIndex) {
-  _vertices.push_back(std::unique_ptr<Vertex>(new Vertex()));
-  _vertices.back()->pos = newPos;
-  _vertices.back()->index = newIndex;
-
-  return _vertices.back().get();
-}
-
-Triangulation::Edge *Triangulation::makeEdge() {
-  _edges.push_back(std::unique_ptr<Edge>(new Edge()));
-  return _edges.back().get();
-}
-
-Triangulation::Triangle *Triangulation::makeTriangle() {
-  _triangles.push_back(std::unique_ptr<Triangle>(new Triangle()));
-  return _triangles.back().get();
+Triangulation::Triangulation(const StdVector<Vec2> &newPoints,
+                             const Settings::Triangulation &settings)
+    : Triangulation(minCorner(newPoints), maxCorner(newPoints), settings) {
+  addPoints(newPoints);
 }
 
-void Triangulation::performFlip(Edge *oldEdge) {
-  // inc comes from "incident"
-  Vertex *incVert[] = {oldEdge->vert[0], oldEdge->vert[1]};
-  Triangle *oldTri[] = {oldEdge->triang[0], oldEdge->triang[1]};
-  Vertex *apartVert[] = {findThirdVert(oldTri[0], oldEdge),
-                         findThirdVert(oldTri[1], oldEdge)};
-
-  Edge *newEdge = makeEdge();
-  Triangle *incTri[] = {makeTriangle(), makeTriangle()};
-
-  for (int apartVertInd = 0; apartVertInd < 2; ++apartVertInd)
-    newEdge->vert[apartVertInd] = apartVert[apartVertInd];
-  for (int triIncInd = 0; triIncInd < 2; ++triIncInd)
-    newEdge->triang[triIncInd] = incTri[triIncInd];
-
-  for (int oldTriInd = 0; oldTriInd < 2; ++oldTriInd) {
-    const auto &curOldTri = oldTri[oldTriInd];
-    for (const auto &curEdge : curOldTri->edges) {
-      if (curEdge == oldEdge)
-        continue;
-      int edgeToTriInd = curEdge->triang[0] == curOldTri ? 0 : 1;
-      int incVertInd = isIncident(incVert[0], curEdge) ? 0 : 1;
-      curEdge->triang[edgeToTriInd] = incTri[incVertInd];
-      incTri[incVertInd]->edges[oldTriInd] = curEdge;
-    }
-  }
-
-  for (const auto &curIncTri : incTri)
-    curIncTri->edges[2] = newEdge;
-
-  for (const auto &curIncTri : incTri)
-    for (int apartVertInd = 0; apartVertInd < 2; ++apartVertInd)
-      curIncTri->vert[apartVertInd] = apartVert[apartVertInd];
-  for (int incVertInd = 0; incVertInd < 2; ++incVertInd)
-    incTri[incVertInd]->vert[2] = incVert[incVertInd];
-
-  for (const auto &curIncVert : incVert) {
-    curIncVert->edges.erase(oldEdge);
-    for (const auto &curOldTri : oldTri)
-      curIncVert->triangles.erase(curOldTri);
+Triangulation::Triangulation(const Vec2 &boxMin, const Vec2 &boxMax,
+                             const Settings::Triangulation &settings)
+    : maxDim((boxMax - boxMin).maxCoeff())
+    , upperLeft(boxMin)
+    , bottomRight(boxMax)
+    , halfEdgeStart{-1, -2, -3}
+    , twin{-1, -1, -1}
+    , lastFound(0)
+    , randomOrder(
+          randomStream(settings.deterministic, RandomStage::TRIANGULATION))
+    , settings(settings) {
+  if (!(maxDim > 0))
+    maxDim = 1;
+  bound[0] = Vec2(boxMin[0] - maxDim, boxMin[1] - maxDim);
+  bound[1] = Vec2(boxMin[0] + 4 * maxDim, boxMin[1] - maxDim);
+  bound[2] = Vec2(boxMin[0] - maxDim, boxMin[1] + 4 * maxDim);
+}
+
+int Triangulation::addPoint(const Vec2 &newPoint) {
+  int vertex = points.size();
+  points.push_back(newPoint);
+  pointVertex.push_back(vertex);
+  upperLeft = upperLeft.cwiseMin(newPoint);
+  bottomRight = bottomRight.cwiseMax(newPoint);
+  insert(vertex);
+  return vertex;
+}
+
+void Triangulation::addPoints(const StdVector<Vec2> &newPoints) {
+  if (newPoints.empty())
+    return;
+
+  int firstIndex = points.size();
+  Vec2 boxMin = minCorner(newPoints), boxMax = maxCorner(newPoints);
+  points.insert(points.end(), newPoints.begin(), newPoints.end());
+  for (int i = 0; i < newPoints.size(); ++i)
+    pointVertex.push_back(firstIndex + i);
+  upperLeft = upperLeft.cwiseMin(boxMin);
+  bottomRight = bottomRight.cwiseMax(boxMax);
+
+  double extent = (boxMax - boxMin).maxCoeff();
+  double scale = extent > 0 ? ((1 << 16) - 1) / extent : 0;
+  std::vector<std::uint32_t> keys(newPoints.size());
+  for (int i = 0; i < newPoints.size(); ++i) {
+    Vec2 scaled = (newPoints[i] - boxMin) * scale;
+    keys[i] = hilbertIndex(std::uint32_t(scaled[0]), std::uint32_t(scaled[1]));
   }
 
-  for (int apartVertInd = 0; apartVertInd < 2; ++apartVertInd)
-    apartVert[apartVertInd]->triangles.erase(oldTri[apartVertInd]);
-
-  for (int incVertInd = 0; incVertInd < 2; ++incVertInd) {
-    const auto &curIncVert = incVert[incVertInd];
-    curIncVert->edges.erase(oldEdge);
-    for (const auto &curOldTri : oldTri)
-      curIncVert->triangles.erase(curOldTri);
-    curIncVert->triangles.insert(incTri[incVertInd]);
+  // The last round is a random half of the points, the one before it---a
+  // random quarter, and so on. Every round goes along the Hilbert curve.
+  std::vector<int> order(newPoints.size());
+  std::iota(order.begin(), order.end(), 0);
+  randomOrder.shuffle(order.begin(), order.end());
+  for (int end = order.size(); end > 0;) {
+    int begin = end <= minBrioRound ? 0 : end / 2;
+    std::sort(order.begin() + begin, order.begin() + end,
+              [&keys](int i, int j) { return keys[i] < keys[j]; });
+    end = begin;
   }
 
-  for (const auto &curApartVert : apartVert) {
-    curApartVert->edges.insert(newEdge);
-    for (const auto &curIncTri : incTri)
-      curApartVert->triangles.insert(curIncTri);
-  }
+  for (int i : order)
+    insert(firstIndex + i);
 }
 
-EIGEN_STRONG_INLINE Triangulation::Vertex *
-Triangulation::findThirdVert(Triangle *tri, Edge *edge) {
-  bool edgeFound = false;
-  for (int i = 0; i < 3; ++i) {
-    if (tri->edges[i] == edge) {
-      edgeFound = true;
-      break;
-    }
-  }
-  if (!edgeFound)
-    throw std::runtime_error("triangulation inner problem: bad findThirdVert");
-
-  for (int i = 0; i < 3; ++i)
-    if (tri->vert[i] != edge->vert[0] && tri->vert[i] != edge->vert[1])
-      return tri->vert[i];
+int Triangulation::pointNum() const { return points.size(); }
 
-  CHECK(false);
-  return nullptr;
-}
+const Vec2 &Triangulation::point(int index) const { return points[index]; }
 
-EIGEN_STRONG_INLINE Triangulation::Edge *
-Triangulation::findOppositeEdge(Triangulation::Triangle *tri,
-                                Triangulation::Vertex *vert) {
-  bool vertFound = false;
-  for (const auto &triVert : tri->vert) {
-    if (triVert == vert) {
-      vertFound = true;
-      break;
-    }
-  }
-  if (!vertFound)
-    throw std::runtime_error(
-        "triangulation inner problem: bad findOppositeEdge");
+int Triangulation::vertexOf(int index) const { return pointVertex[index]; }
 
-  for (const auto &triSide : tri->edges)
-    if (triSide->vert[0] != vert && triSide->vert[1] != vert)
-      return triSide;
+int Triangulation::triangleNum() const { return halfEdgeStart.size() / 3; }
 
-  CHECK(false);
-  return nullptr;
+int Triangulation::corner(int triangle, int i) const {
+  return halfEdgeStart[3 * triangle + i];
 }
 
-EIGEN_STRONG_INLINE bool Triangulation::isIncident(Vertex *vert, Edge *edge) {
-  return edge->vert[0] == vert || edge->vert[1] == vert;
+int Triangulation::neighbour(int triangle, int i) const {
+  int opposite = twin[3 * triangle + (i + 1) % 3];
+  return opposite < 0 ? NO_TRIANGLE : opposite / 3;
 }
 
-EIGEN_STRONG_INLINE bool Triangulation::isIncident(Vertex *vert,
-                                                   Triangle *tri) {
-  return tri->vert[0] == vert || tri->vert[1] == vert || tri->vert[2] == vert;
+bool Triangulation::isIncidentToBoundary(int triangle) const {
+  return corner(triangle, 0) < 0 || corner(triangle, 1) < 0 ||
+         corner(triangle, 2) < 0;
 }
 
-EIGEN_STRONG_INLINE bool
-Triangulation::doesContain(Triangulation::Triangle *tri,
-                           const Vec2 &point) const {
-  return doesContain(tri->edges[0], point) ||
-         doesContain(tri->edges[1], point) ||
-         doesContain(tri->edges[2], point) ||
-         isInsideTriangle(tri->vert[0]->pos, tri->vert[1]->pos,
-                          tri->vert[2]->pos, point);
-}
+std::vector<std::pair<int, int>> Triangulation::edges() const {
+  std::vector<std::pair<int, int>> result;
+  for (int h = 0; h < int(twin.size()); ++h) {
+    int from = halfEdgeStart[h], to = halfEdgeStart[next(h)];
+    if (twin[h] > h && from >= 0 && to >= 0)
+      result.push_back({from, to});
+  }
+  return result;
+}
+
+int Triangulation::enclosingTriangle(const Vec2 &point) {
+  int found = enclosingTriangle(point, lastFound);
+  if (found != NO_TRIANGLE)
+    lastFound = found;
+  return found;
+}
+
+int Triangulation::enclosingTriangle(const Vec2 &point,
+                                     int startTriangle) const {
+  if (!isInsideTriangle(bound[0], bound[1], bound[2], point))
+    return NO_TRIANGLE;
+
+  // Remembering stochastic walk: the side the walk came through is not
+  // tested again, and the first side to test is random, so that the walk
+  // does not cycle even where the triangulation is not strictly Delaunay.
+  std::uint32_t random = 2463534242u;
+  int tri = startTriangle >= 0 && startTriangle < triangleNum() ? startTriangle
+                                                                : 0;
+  int entered = -1;
+  for (int step = 0; step <= 4 * triangleNum(); ++step) {
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    int first = random % 3;
+
+    int crossed = -1;
+    for (int i = 0; i < 3; ++i) {
+      int h = 3 * tri + (first + i) % 3;
+      if (h == entered)
+        continue;
+      const Vec2 &a = position(halfEdgeStart[h]);
+      const Vec2 &b = position(halfEdgeStart[next(h)]);
+      if (cross2(b - a, point - a) < 0) {
+        crossed = h;
+        break;
+      }
+    }
+    if (crossed < 0)
+      return tri;
+    entered = twin[crossed];
+    if (entered < 0)
+      return NO_TRIANGLE;
+    tri = entered / 3;
+  }
 
-EIGEN_STRONG_INLINE bool Triangulation::isInsideBound(const Vec2 &point) const {
-  return isInsideTriangle(_vertices[0]->pos, _vertices[1]->pos,
-                          _vertices[2]->pos, point);
+  LOG(WARNING) << "Triangulation: the walk did not converge, "
+                  "falling back to the exhaustive search";
+  for (int t = 0; t < triangleNum(); ++t)
+    if (isInsideTriangle(position(corner(t, 0)), position(corner(t, 1)),
+                         position(corner(t, 2)), point))
+      return t;
+  return NO_TRIANGLE;
 }
 
-EIGEN_STRONG_INLINE bool Triangulation::doesContain(Triangulation::Edge *edge,
-                                                    const Vec2 &point) const {
-  return doesABcontain(edge->vert[0]->pos, edge->vert[1]->pos, point,
-                       settings.epsPointIsOnSegment * maxDim);
+void Triangulation::setTriangle(int triangle, int a, int b, int c) {
+  halfEdgeStart[3 * triangle] = a;
+  halfEdgeStart[3 * triangle + 1] = b;
+  halfEdgeStart[3 * triangle + 2] = c;
 }
 
-EIGEN_STRONG_INLINE bool Triangulation::isFromBoundingTri(Vertex *vert) const {
-  return vert == _vertices[0].get() || vert == _vertices[1].get() ||
-         vert == _vertices[2].get();
+void Triangulation::link(int halfEdge, int twinHalfEdge) {
+  twin[halfEdge] = twinHalfEdge;
+  if (twinHalfEdge >= 0)
+    twin[twinHalfEdge] = halfEdge;
 }
 
-EIGEN_STRONG_INLINE bool Triangulation::isEdgeLegal(Edge *edge) const {
-  bool isInc1Bound = isFromBoundingTri(edge->vert[0]);
-  bool isInc2Bound = isFromBoundingTri(edge->vert[1]);
-  if (isInc1Bound && isInc2Bound)
+// Edges of the bounding triangle are fixed. The points are treated as if
+// the bounding vertices were infinitely far away: an edge opposite to one
+// of them stays, and an edge that ends at one is flipped whenever possible.
+bool Triangulation::isLegal(int halfEdge) const {
+  int twinHalfEdge = twin[halfEdge];
+  if (twinHalfEdge < 0)
     return true;
 
-  bool isAp1Bound = isFromBoundingTri(findThirdVert(edge->triang[0], edge));
-  bool isAp2Bound = isFromBoundingTri(findThirdVert(edge->triang[1], edge));
-  if ((isAp1Bound || isAp2Bound) && !isInc1Bound && !isInc2Bound)
+  int u = halfEdgeStart[halfEdge], w = halfEdgeStart[next(halfEdge)];
+  int apex1 = halfEdgeStart[prev(halfEdge)];
+  int apex2 = halfEdgeStart[prev(twinHalfEdge)];
+  bool isUBound = u < 0, isWBound = w < 0;
+  if (isUBound && isWBound)
+    return true;
+  if ((apex1 < 0 || apex2 < 0) && !isUBound && !isWBound)
     return true;
 
-  const Vec2 &a = edge->vert[0]->pos;
-  const Vec2 &b = edge->vert[1]->pos;
-  const Vec2 &c = findThirdVert(edge->triang[0], edge)->pos;
-  const Vec2 &d = findThirdVert(edge->triang[1], edge)->pos;
+  const Vec2 &a = position(u);
+  const Vec2 &b = position(w);
+  const Vec2 &c = position(apex1);
+  const Vec2 &d = position(apex2);
 
-  if (isInc1Bound || isInc2Bound)
+  if (isUBound || isWBound)
     return !isABCDConvex(a, c, b, d);
 
   return !isABCDConvex(a, c, b, d) || isABDelaunay(a, b, c, d);
 }
 
-Triangulation::Triangle *Triangulation::enclosingTriangle(const Vec2 &point) {
-  if (!isInsideBound(point))
-    return nullptr;
-
-  // "visibility walk"
-
-  //  std::cout << "look for " << point.transpose() << std::endl;
-
-  Edge *curEdge = *_vertices[0]->edges.begin();
-  if (curEdge->triang[0] != nullptr && doesContain(curEdge->triang[0], point))
-    return curEdge->triang[0];
-  if (curEdge->triang[1] != nullptr && doesContain(curEdge->triang[1], point))
-    return curEdge->triang[1];
-
-  Triangle *curTri = nullptr;
-
-  do {
-    //    std::cout << "edge from " << curEdge->vert[0]->pos.transpose() << " to
-    //    "
-    //              << curEdge->vert[1]->pos.transpose() << std::endl;
-    int adjTriInd;
-    if (curEdge->triang[0] == nullptr)
-      adjTriInd = 1;
-    else if (curEdge->triang[1] == nullptr)
-      adjTriInd = 0;
-    else if (isSameSide(curEdge->vert[0]->pos, curEdge->vert[1]->pos,
-                        findThirdVert(curEdge->triang[0], curEdge)->pos, point))
-      adjTriInd = 0;
-    else
-      adjTriInd = 1;
-
-    curTri = curEdge->triang[adjTriInd];
-
-    //    std::cout << "point = " << point.transpose() << std::endl;
-    //    std::cout << "in on edge? " << doesContain(curEdge, point) <<
-    //    std::endl; std::cout << "in on tri? " << doesContain(curTri, point) <<
-    //    std::endl;
-
-    Edge *otherEdges[2];
-    int otherEdgesInsertInd = 0;
-    for (const auto &triSide : curTri->edges) {
-      if (curEdge == triSide)
-        continue;
-      otherEdges[otherEdgesInsertInd++] = triSide;
-    }
-
-    bool isPossibleWay[] = {
-        !isSameSide(otherEdges[0]->vert[0]->pos, otherEdges[0]->vert[1]->pos,
-                    findThirdVert(curTri, otherEdges[0])->pos, point),
-        !isSameSide(otherEdges[1]->vert[0]->pos, otherEdges[1]->vert[1]->pos,
-                    findThirdVert(curTri, otherEdges[1])->pos, point)};
-
-    //    std::cout << "ways = " << isPossibleWay[0] << " " << isPossibleWay[1]
-    //              << std::endl;
-
-    int randomChoice;
-    if (isPossibleWay[0] && isPossibleWay[1])
-      randomChoice = mt() & 1;
-    else
-      randomChoice = 1;
-
-    for (int otherEdgesInd = 0; otherEdgesInd < 2; ++otherEdgesInd) {
-      if (!isPossibleWay[otherEdgesInd])
-        continue;
-      if (randomChoice) {
-        curEdge = otherEdges[otherEdgesInd];
-        break;
-      } else
-        randomChoice = !randomChoice;
-    }
-  } while (!doesContain(curTri, point));
-  return curTri;
-}
-
-bool Triangulation::isIncidentToBoundary(Triangle *tri) const {
-  return isFromBoundingTri(tri->vert[0]) || isFromBoundingTri(tri->vert[1]) ||
-         isFromBoundingTri(tri->vert[2]);
-}
-
-void Triangulation::divideTriangle(Triangle *tri, Vertex *vert) {
-  if (!doesContain(tri, vert->pos))
-    throw std::runtime_error("triangulation inner problem: tried to insert "
-                             "point outside a triangle!");
-
-  Edge *newEdges[] = {makeEdge(), makeEdge(), makeEdge()};
-  Triangle *newTri[] = {makeTriangle(), makeTriangle(), makeTriangle()};
-
-  for (int newEdgesInd = 0; newEdgesInd < 3; ++newEdgesInd) {
-    const auto &curNewEdge = newEdges[newEdgesInd];
-    curNewEdge->vert[0] = vert;
-    curNewEdge->vert[1] = tri->vert[newEdgesInd];
-
-    curNewEdge->triang[0] = newTri[(newEdgesInd + 1) % 3];
-    curNewEdge->triang[1] = newTri[(newEdgesInd + 2) % 3];
-    newTri[(newEdgesInd + 1) % 3]->edges[0] = curNewEdge;
-    newTri[(newEdgesInd + 2) % 3]->edges[1] = curNewEdge;
-  }
-
-  for (int newTriInd = 0; newTriInd < 3; ++newTriInd) {
-    const auto &curNewTri = newTri[newTriInd];
-    const auto &externEdge = findOppositeEdge(tri, tri->vert[newTriInd]);
-    int edgeCurTriInd = externEdge->triang[0] == tri ? 0 : 1;
-
-    curNewTri->edges[2] = externEdge;
-    externEdge->triang[edgeCurTriInd] = curNewTri;
-
-    curNewTri->vert[0] = tri->vert[(newTriInd + 1) % 3];
-    curNewTri->vert[1] = tri->vert[(newTriInd + 2) % 3];
-    curNewTri->vert[2] = vert;
-  }
-
-  for (int triVertInd = 0; triVertInd < 3; ++triVertInd) {
-    const auto &curVert = tri->vert[triVertInd];
-    curVert->edges.insert(newEdges[triVertInd]);
-
-    curVert->triangles.insert(newTri[(triVertInd + 1) % 3]);
-    curVert->triangles.insert(newTri[(triVertInd + 2) % 3]);
-
-    curVert->triangles.erase(tri);
-  }
+// Every half-edge given is opposite to the vertex just inserted in its
+// triangle. Flips keep the vertex as the last corner of both triangles.
+void Triangulation::legalize(std::vector<int> &halfEdges) {
+  while (!halfEdges.empty()) {
+    int h = halfEdges.back();
+    halfEdges.pop_back();
+    if (isLegal(h))
+      continue;
 
-  for (int i = 0; i < 3; ++i) {
-    vert->edges.insert(newEdges[i]);
-    vert->triangles.insert(newTri[i]);
+    int g = twin[h];
+    int t = h / 3, s = g / 3;
+    int u = halfEdgeStart[h], w = halfEdgeStart[next(h)];
+    int p = halfEdgeStart[prev(h)], y = halfEdgeStart[prev(g)];
+    int outerPU = twin[prev(h)], outerWP = twin[next(h)];
+    int outerUY = twin[next(g)], outerYW = twin[prev(g)];
+
+    setTriangle(t, u, y, p);
+    setTriangle(s, y, w, p);
+    link(3 * t, outerUY);
+    link(3 * t + 2, outerPU);
+    link(3 * s, outerYW);
+    link(3 * s + 1, outerWP);
+    link(3 * t + 1, 3 * s + 2);
+
+    halfEdges.push_back(3 * t);
+    halfEdges.push_back(3 * s);
   }
 }
 
-void Triangulation::divideEdge(Edge *edge, Vertex *vert) {
-  // indexed as oldTri[apartVertInd][incVertInd]
-  Triangle *oldTri[] = {edge->triang[0], edge->triang[1]};
-  Vertex *incVert[] = {edge->vert[0], edge->vert[1]};
-  Vertex *apartVert[] = {findThirdVert(edge->triang[0], edge),
-                         findThirdVert(edge->triang[1], edge)};
-
-  Triangle *newTri[][2] = {{makeTriangle(), makeTriangle()},
-                           {makeTriangle(), makeTriangle()}};
-
-  Edge *newIncEdges[] = {makeEdge(), makeEdge()};
-  Edge *newApEdges[] = {makeEdge(), makeEdge()};
-
-  for (int apartVertInd = 0; apartVertInd < 2; ++apartVertInd)
-    for (int incVertInd = 0; incVertInd < 2; ++incVertInd) {
-      const auto &curNewTri = newTri[apartVertInd][incVertInd];
-      curNewTri->edges[0] = newApEdges[apartVertInd];
-      newApEdges[apartVertInd]->triang[incVertInd] = curNewTri;
-
-      curNewTri->edges[1] = newIncEdges[incVertInd];
-      newIncEdges[incVertInd]->triang[apartVertInd] = curNewTri;
-
-      Edge *externEdge = nullptr;
-      for (const auto &oldTriSide : oldTri[apartVertInd]->edges) {
-        if (oldTriSide == edge)
-          continue;
-        if (isIncident(incVert[incVertInd], oldTriSide)) {
-          externEdge = oldTriSide;
-          break;
-        }
-      }
-      curNewTri->edges[2] = externEdge;
-      int oldTriEdgeInd = externEdge->triang[0] == oldTri[apartVertInd] ? 0 : 1;
-      externEdge->triang[oldTriEdgeInd] = curNewTri;
-    }
-
-  for (int apartVertInd = 0; apartVertInd < 2; ++apartVertInd)
-    for (int incVertInd = 0; incVertInd < 2; ++incVertInd) {
-      const auto &curNewTri = newTri[apartVertInd][incVertInd];
-      curNewTri->vert[0] = incVert[incVertInd];
-      incVert[incVertInd]->triangles.insert(curNewTri);
-
-      curNewTri->vert[1] = vert;
-      vert->triangles.insert(curNewTri);
+void Triangulation::insert(int vertex) {
+  const Vec2 &newPoint = points[vertex];
+  int tri = enclosingTriangle(newPoint);
+  CHECK_NE(tri, NO_TRIANGLE) << "Triangulation: point "
+                             << newPoint.transpose()
+                             << " is outside the bounding triangle";
 
-      curNewTri->vert[2] = apartVert[apartVertInd];
-      apartVert[apartVertInd]->triangles.insert(curNewTri);
+  for (int i = 0; i < 3; ++i) {
+    int c = corner(tri, i);
+    if (c >= 0 &&
+        areEqual(points[c], newPoint, settings.epsSamePoints * maxDim)) {
+      pointVertex[vertex] = c;
+      return;
     }
-
-  for (int apartVertInd = 0; apartVertInd < 2; ++apartVertInd) {
-    apartVert[apartVertInd]->triangles.erase(oldTri[apartVertInd]);
-    for (int incVertInd = 0; incVertInd < 2; ++incVertInd)
-      incVert[incVertInd]->triangles.erase(oldTri[apartVertInd]);
   }
 
-  for (int incEdgeInd = 0; incEdgeInd < 2; ++incEdgeInd) {
-    const auto &curIncEdge = newIncEdges[incEdgeInd];
-    curIncEdge->vert[0] = vert;
-    vert->edges.insert(curIncEdge);
-
-    curIncEdge->vert[1] = incVert[incEdgeInd];
-    incVert[incEdgeInd]->edges.insert(newIncEdges[incEdgeInd]);
-
-    incVert[incEdgeInd]->edges.erase(edge);
+  for (int i = 0; i < 3; ++i) {
+    int h = 3 * tri + i;
+    if (twin[h] >= 0 &&
+        doesABcontain(position(halfEdgeStart[h]),
+                      position(halfEdgeStart[next(h)]), newPoint,
+                      settings.epsPointIsOnSegment * maxDim)) {
+      splitEdge(h, vertex);
+      return;
+    }
   }
 
-  for (int apartEdgeInd = 0; apartEdgeInd < 2; ++apartEdgeInd) {
-    const auto &curApartEdge = newApEdges[apartEdgeInd];
-    curApartEdge->vert[0] = vert;
-    vert->edges.insert(curApartEdge);
-
-    curApartEdge->vert[1] = apartVert[apartEdgeInd];
-    apartVert[apartEdgeInd]->edges.insert(curApartEdge);
-  }
+  splitTriangle(tri, vertex);
 }
 
-Triangulation::Vertex *Triangulation::addPoint(Triangulation::Vertex *newVert) {
-  Triangle *tri = enclosingTriangle(newVert->pos);
-  std::queue<Edge *> maybeIllegal;
-
-  // std::cout << "add vert " << newVert->pos.transpose() << std::endl;
-
-  for (const auto &vert : tri->vert)
-    if (areEqual(vert->pos, newVert->pos, settings.epsSamePoints * maxDim))
-      return vert;
-
-  Edge *enclosingSide = nullptr;
-  for (const auto &side : tri->edges)
-    if (doesContain(side, newVert->pos))
-      enclosingSide = side;
+void Triangulation::splitTriangle(int triangle, int vertex) {
+  int a = corner(triangle, 0), b = corner(triangle, 1), c = corner(triangle, 2);
+  int outer[3] = {twin[3 * triangle], twin[3 * triangle + 1],
+                  twin[3 * triangle + 2]};
 
-  if (enclosingSide) {
-    for (const auto &nearTri : enclosingSide->triang)
-      for (const auto &nearSide : nearTri->edges) {
-        if (nearSide == enclosingSide)
-          continue;
-        maybeIllegal.push(nearSide);
-      }
-    divideEdge(enclosingSide, newVert);
-  } else {
-    for (const auto &side : tri->edges)
-      maybeIllegal.push(side);
-    divideTriangle(tri, newVert);
-  }
+  int t[3] = {triangle, triangleNum(), triangleNum() + 1};
+  halfEdgeStart.resize(halfEdgeStart.size() + 6);
+  twin.resize(twin.size() + 6);
 
-  while (!maybeIllegal.empty()) {
-    Edge *curEdge = maybeIllegal.front();
-    maybeIllegal.pop();
-
-    if (isEdgeLegal(curEdge))
-      continue;
-
-    int oppositeTriInd = isIncident(newVert, curEdge->triang[0]) ? 1 : 0;
-    Triangle *oppositeTri = curEdge->triang[oppositeTriInd];
-    for (const auto &opTriSide : oppositeTri->edges) {
-      if (opTriSide == curEdge)
-        continue;
-      maybeIllegal.push(opTriSide);
-    }
-
-    performFlip(curEdge);
+  setTriangle(t[0], a, b, vertex);
+  setTriangle(t[1], b, c, vertex);
+  setTriangle(t[2], c, a, vertex);
+  for (int i = 0; i < 3; ++i) {
+    link(3 * t[i], outer[i]);
+    link(3 * t[i] + 1, 3 * t[(i + 1) % 3] + 2);
   }
 
-  return newVert;
+  std::vector<int> maybeIllegal = {3 * t[0], 3 * t[1], 3 * t[2]};
+  legalize(maybeIllegal);
 }
 
-void Triangulation::tidy() {
-  std::unordered_set<Edge *> edgesUsed;
-  std::unordered_set<Triangle *> trianglesUsed;
-
-  for (int i = 0; i < int(_vertices.size()); ++i) {
-    Vertex *vert = _vertices[i].get();
-    for (Edge *edge : vert->edges)
-      edgesUsed.insert(edge);
-    for (Triangle *tri : vert->triangles)
-      trianglesUsed.insert(tri);
-  }
+// The new vertex is on the side halfEdge, u->w, between the triangles
+// u->w->x and w->u->y.
+void Triangulation::splitEdge(int halfEdge, int vertex) {
+  int twinHalfEdge = twin[halfEdge];
+  int u = halfEdgeStart[halfEdge], w = halfEdgeStart[next(halfEdge)];
+  int x = halfEdgeStart[prev(halfEdge)], y = halfEdgeStart[prev(twinHalfEdge)];
+  int outerWX = twin[next(halfEdge)], outerXU = twin[prev(halfEdge)];
+  int outerUY = twin[next(twinHalfEdge)], outerYW = twin[prev(twinHalfEdge)];
 
-  std::vector<std::unique_ptr<Edge>> newEdges;
-  newEdges.reserve(_edges.size());
-  std::vector<std::unique_ptr<Triangle>> newTriangles;
-  newTriangles.reserve(_triangles.size());
-  for (auto &e : _edges) {
-    if (edgesUsed.find(e.get()) != edgesUsed.end()) {
-      newEdges.push_back(std::unique_ptr<Edge>(nullptr));
-      std::swap(newEdges.back(), e);
-    }
-  }
-  for (auto &tri : _triangles) {
-    if (trianglesUsed.find(tri.get()) != trianglesUsed.end()) {
-      newTriangles.push_back(std::unique_ptr<Triangle>(nullptr));
-      std::swap(newTriangles.back(), tri);
-    }
-  }
+  // triangles in the order around the new vertex
+  int t[4] = {halfEdge / 3, triangleNum(), twinHalfEdge / 3, triangleNum() + 1};
+  halfEdgeStart.resize(halfEdgeStart.size() + 6);
+  twin.resize(twin.size() + 6);
 
-  std::swap(_edges, newEdges);
-  std::swap(_triangles, newTriangles);
-}
+  setTriangle(t[0], x, u, vertex);
+  setTriangle(t[1], w, x, vertex);
+  setTriangle(t[2], y, w, vertex);
+  setTriangle(t[3], u, y, vertex);
+  link(3 * t[0], outerXU);
+  link(3 * t[1], outerWX);
+  link(3 * t[2], outerYW);
+  link(3 * t[3], outerUY);
+  for (int i = 0; i < 4; ++i)
+    link(3 * t[i] + 2, 3 * t[(i + 1) % 4] + 1);
 
-void Triangulation::fillPtrVectors() {
-  vertexPtrs.reserve(_vertices.size() - 3);
-  for (int i = 0; i < int(_vertices.size()) - 3; ++i)
-    vertexPtrs.push_back(operator[](i));
-  edgePtrs.reserve(_edges.size());
-  for (const auto &e : _edges)
-    if (!isFromBoundingTri(e->vert[0]) && !isFromBoundingTri(e->vert[1]))
-      edgePtrs.push_back(e.get());
-  trianglePtrs.reserve(_triangles.size());
-  for (const auto &t : _triangles)
-    if (!isIncidentToBoundary(t.get()))
-      trianglePtrs.push_back(t.get());
+  std::vector<int> maybeIllegal = {3 * t[0], 3 * t[1], 3 * t[2], 3 * t[3]};
+  legalize(maybeIllegal);
 }
 
 cv::Mat Triangulation::draw(int imgWidth, int imgHeight, cv::Scalar bgCol,
@@ -613,22 +383,12 @@ void Triangulation::draw(cv::Mat &img, cv::Scalar edgeCol) const {
 void Triangulation::drawScaled(cv::Mat &img, double scaleX, double scaleY,
                                cv::Point upperLeftPoint,
                                cv::Scalar edgeCol) const {
-  std::set<Edge *> edgesDrawn;
-  std::set<Triangle *> trianglesDrawn;
-
-  for (const auto &p : _vertices)
-    for (auto e : p->edges) {
-      if (isFromBoundingTri(e->vert[0]) || isFromBoundingTri(e->vert[1]))
-        continue;
-      if (edgesDrawn.find(e) != edgesDrawn.end())
-        continue;
-      edgesDrawn.insert(e);
-      cv::Point v[] = {toCvPoint(e->vert[0]->pos - upperLeft, scaleX, scaleY,
-                                 upperLeftPoint),
-                       toCvPoint(e->vert[1]->pos - upperLeft, scaleX, scaleY,
-                                 upperLeftPoint)};
-      cv::line(img, v[0], v[1], edgeCol, 2);
-    }
+  for (auto [from, to] : edges()) {
+    cv::Point v[] = {
+        toCvPoint(points[from] - upperLeft, scaleX, scaleY, upperLeftPoint),
+        toCvPoint(points[to] - upperLeft, scaleX, scaleY, upperLeftPoint)};
+    cv::line(img, v[0], v[1], edgeCol, 2);
+  }
 }
 
 void drawCurvedInternal(CameraModel *cam, Vec2 ptFrom, Vec2 ptTo, cv::Mat &img,
@@ -653,22 +413,10 @@ void drawCurvedInternal(CameraModel *cam, Vec2 ptFrom, Vec2 ptTo, cv::Mat &img,
     cv::line(img, pnts[it], pnts[it + 1], edgeCol, 1);
 }
 
-void drawEdgeCurved(CameraModel *cam, Triangulation::Edge *edge, cv::Mat &img,
-                    cv::Scalar edgeCol) {
-  drawCurvedInternal(cam, edge->vert[0]->pos, edge->vert[1]->pos, img, edgeCol);
-}
-
 void Triangulation::drawCurved(CameraModel *cam, cv::Mat &img,
                                cv::Scalar edgeCol) const {
-  std::set<Edge *> edgesDrawn;
-  for (const auto &p : _vertices)
-    for (auto e : p->edges) {
-      if (isFromBoundingTri(e->vert[0]) || isFromBoundingTri(e->vert[1]))
-        continue;
-      if (edgesDrawn.find(e) != edgesDrawn.end())
-        continue;
-      drawEdgeCurved(cam, e, img, edgeCol);
-    }
+  for (auto [from, to] : edges())
+    drawCurvedInternal(cam, points[from], points[to], img, edgeCol);
 }
 
 } // namespace fishdso
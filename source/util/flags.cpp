@@ -1,24 +1,80 @@
 #include "util/flags.h"
+#include "util/Log.h"
+#include "util/Placement.h"
+#include <glog/logging.h>
+#include <iostream>
+#include <sstream>
 
 using namespace fishdso;
 
 DEFINE_int32(num_threads, Settings::Threading::default_numThreads,
              "Number of threads for Ceres Solver to use.");
+DEFINE_bool(async_mapping, Settings::Threading::default_asyncMapping,
+            "Run point tracing, keyframe creation and bundle adjustment on a "
+            "separate mapping thread?");
+DEFINE_string(cores, "",
+              "Cores to run the threads of the odometry on, like 0-7,16-23. "
+              "Empty means any core.");
+DEFINE_bool(huge_pages, Settings::Pyramid::default_hugePages,
+            "Back the samplers of the frame pyramids with transparent huge "
+            "pages?");
 
 DEFINE_int32(points_per_frame, 2000, "Number of points to trace per keyframe.");
 
+DEFINE_double(valid_angle, 180.0,
+              "Largest angle between a ray and the optical axis, in degrees, "
+              "for its pixel to be processed. Set it to the half of the "
+              "field of view of a fisheye lens to skip the black border "
+              "around its image circle.");
+DEFINE_bool(cache_camera_fit,
+            Settings::CameraModel::default_cacheMapPolyFit,
+            "Store the fitted inverse camera polynomial next to the "
+            "calibration file and load it on later starts.");
+DEFINE_string(static_mask, "",
+              "Grayscale image of the size of the frames, zero where the "
+              "vehicle or the rig occludes the view. Such pixels are not "
+              "selected or tracked. Empty means no mask.");
+DEFINE_string(inverse_response, "",
+              "Text file with the 256 values of the inverse response curve of "
+              "the camera, as in the TUM monoVO dataset. Empty means a linear "
+              "response.");
+DEFINE_string(vignette, "",
+              "8 or 16-bit image of the size of the frames with the "
+              "vignetting of the lens, brightest where it attenuates least. "
+              "Empty means no vignetting.");
+
 DEFINE_int32(first_frames_skip,
              Settings::DelaunayDsoInitializer::default_firstFramesSkip,
              "Number of frames to skip between two frames when initializing "
              "from keypoints.");
+DEFINE_int32(init_candidates_per_batch,
+             Settings::DelaunayDsoInitializer::default_candidatesPerBatch,
+             "Number of candidate second frames the initializer matches at "
+             "once.");
+DEFINE_int32(init_min_inliers,
+             Settings::DelaunayDsoInitializer::default_minInliers,
+             "Number of inlier matches that makes a frame pair good enough to "
+             "initialize from without waiting for later frames.");
 DEFINE_bool(
     run_max_RANSAC_iterations,
     Settings::StereoMatcher::StereoGeometryEstimator::default_runMaxRansacIter,
     "Always run maximum RANSAC iterations. This will be extremely long!");
+DEFINE_int32(RANSAC_preemptive_block,
+             Settings::StereoMatcher::StereoGeometryEstimator::
+                 default_preemptiveBlockSize,
+             "If positive, score RANSAC hypotheses preemptively on blocks of "
+             "this many correspondences, dropping the worse half after each.");
 DEFINE_bool(
     average_ORB_motion,
     Settings::StereoMatcher::StereoGeometryEstimator::default_runAveraging,
     "Use NNLS motion averaging after RANSAC?");
+DEFINE_string(ORB_matcher, "bf",
+              "How to match ORB descriptors on initialization: \"bf\" for "
+              "brute force, \"lsh\" for FLANN LSH or \"grid\" for brute force "
+              "around the positions predicted by the rotation.");
+DEFINE_double(ORB_grid_match_radius,
+              Settings::StereoMatcher::default_gridMatchRadius,
+              "Radius in pixels the grid ORB matcher searches within.");
 
 DEFINE_bool(optimize_affine_light,
             Settings::AffineLight::default_optimizeAffineLight,
@@ -27,6 +83,20 @@ DEFINE_bool(optimize_affine_light,
 DEFINE_bool(perform_full_tracing,
             Settings::PointTracer::default_performFullTracing,
             "Do we need to search through full epipolar curve?");
+DEFINE_bool(depth_filter_tracing, Settings::PointTracer::default_useDepthFilter,
+            "Fuse the traced depths in a per-point inverse depth filter and "
+            "search only around its estimate?");
+DEFINE_string(tracing_search_interpolation, "",
+              "Comma-separated interpolations of the epipolar search on the "
+              "pyramid levels, from the finest: \"nearest\", \"bilinear\" "
+              "or \"bicubic\". The levels past the list are bicubic.");
+DEFINE_int32(tracing_coarse_levels,
+             Settings::PointTracer::default_coarseSearchLevels,
+             "If positive, the epipolar search first runs this many pyramid "
+             "levels coarser and then refines only its best minima.");
+DEFINE_int32(tracing_search_candidates,
+             Settings::PointTracer::default_searchCandidates,
+             "Number of minima of the coarse epipolar search refined.");
 DEFINE_bool(use_alt_H_weighting,
             Settings::PointTracer::default_useAltHWeighting,
             "Do we need to use alternative formula for H robust weighting when "
@@ -54,6 +124,82 @@ DEFINE_double(track_fail_factor,
               Settings::FrameTracker::default_trackFailFactor,
               "If RMSE after tracking another frame grew by this factor, "
               "tracking is considered failed.");
+DEFINE_bool(analytic_tracking,
+            Settings::FrameTracker::default_useAnalyticJacobian,
+            "Track frames with the analytic-Jacobian Gauss-Newton solver "
+            "instead of the per-pixel Ceres problem?");
+DEFINE_bool(single_precision_tracking,
+            Settings::FrameTracker::default_useSinglePrecision,
+            "Evaluate the per-pixel terms of the analytic tracking solver in "
+            "single precision?");
+DEFINE_bool(cuda_tracking, Settings::FrameTracker::default_useCuda,
+            "Build the normal equations of the analytic tracking solver on "
+            "the GPU? Needs the CUDA_TRACKING build option.");
+DEFINE_bool(inverse_compositional_tracking,
+            Settings::FrameTracker::default_useInverseCompositional,
+            "Make the analytic tracking solver inverse compositional, with "
+            "the pose Jacobians precomputed on the base keyframe?");
+DEFINE_bool(tiled_sampling, Settings::Pyramid::default_tiledSamplers,
+            "Store the frames sampled by tracking and tracing in tiles of 4x4 "
+            "pixels instead of rows?");
+DEFINE_int32(tracking_max_points,
+             Settings::FrameTracker::default_maxPointsPerLevel,
+             "If positive, max number of base frame points tracked on each "
+             "pyramid level, chosen by how much they tell of the motion.");
+DEFINE_string(tracking_interpolation, "",
+              "Comma-separated interpolations of the tracked frame on the "
+              "pyramid levels with the analytic solver, as in "
+              "tracing_search_interpolation.");
+DEFINE_int32(tracking_max_iter, Settings::FrameTracker::default_maxIterations,
+             "Max number of LM iterations per pyramid level when tracking "
+             "with the analytic solver.");
+DEFINE_bool(recover_track, Settings::FrameTracker::default_recoverTrack,
+            "Retry failed tracks from several perturbed initial motions?");
+DEFINE_bool(skip_finest_tracking,
+            Settings::FrameTracker::default_skipFinestLevel,
+            "Skip tracking on the finest pyramid level if the pose update on "
+            "the previous level was small enough?");
+DEFINE_bool(relocalize, Settings::KeyFrameDatabase::default_enabled,
+            "Keep marginalized keyframes and relocalize against them when "
+            "tracking fails?");
+DEFINE_bool(close_loops, Settings::LoopClosure::default_enabled,
+            "Close loops over the marginalized keyframes? Needs relocalize.");
+DEFINE_bool(real_time, Settings::LoadShedding::default_enabled,
+            "Skip late frames, trace fewer of them and defer bundle adjustment "
+            "when the system falls behind?");
+DEFINE_double(max_frame_age, Settings::LoadShedding::default_maxFrameAge,
+              "Frames that waited for longer than this, in seconds, are "
+              "skipped in the real-time mode.");
+DEFINE_int32(speculative_batch_size,
+             Settings::SpeculativeTracking::default_batchSize,
+             "Max number of frames that DsoSystem::addFrames tracks at once "
+             "against the same base frame.");
+DEFINE_double(speculative_max_rotation_diff,
+              Settings::SpeculativeTracking::default_maxRotationDiff,
+              "Frames tracked at once are tracked again if their rotation "
+              "differs from the prediction by more than this, in radians.");
+DEFINE_double(speculative_max_translation_diff,
+              Settings::SpeculativeTracking::default_maxTranslationDiff,
+              "Frames tracked at once are tracked again if their translation "
+              "differs from the prediction by more than this fraction of the "
+              "distance from the base frame.");
+DEFINE_bool(global_ba, Settings::GlobalBundleAdjuster::default_enabled,
+            "Keep all of the keyframes and bundle adjust them together at the "
+            "end of the session?");
+DEFINE_int32(global_ba_submap_size,
+             Settings::GlobalBundleAdjuster::default_submapSize,
+             "Number of keyframes in a submap of the global bundle "
+             "adjustment.");
+DEFINE_bool(adapt_point_budget, Settings::PointBudget::default_enabled,
+            "Adjust the numbers of points and BA iterations to hold the "
+            "target frame times?");
+DEFINE_double(target_frame_time, Settings::PointBudget::default_targetFrameTime,
+              "Time of tracking and tracing per frame, in seconds, that the "
+              "adaptive point budget aims for.");
+DEFINE_double(rotation_prior_weight,
+              Settings::FrameTracker::default_rotationPriorWeight,
+              "Weight of the IMU rotation prior in tracking. With zero the IMU "
+              "rotation only initializes tracking.");
 
 DEFINE_bool(run_ba, Settings::BundleAdjuster::default_runBA,
             "Do we need to run bundle adjustment?");
@@ -63,42 +209,191 @@ DEFINE_bool(fixed_motion_on_first_ba,
             "Optimize only depths when running bundle adjustment on first two "
             "keyframes? We could assume that a good motion estimation is "
             "already availible due to RANSAC initialization and averaging.");
+DEFINE_bool(windowed_ba, Settings::BundleAdjuster::default_useWindowedOptimizer,
+            "Run bundle adjustment with the sliding-window optimizer that "
+            "marginalizes old keyframes instead of dropping them?");
+DEFINE_string(ba_linear_solver, "dense",
+              "Linear solver of bundle adjustment: \"dense\" or \"sparse\" "
+              "Schur, or \"iterative\" Schur with the Schur-Jacobi "
+              "preconditioner.");
+DEFINE_double(ba_max_time, Settings::BundleAdjuster::default_maxSolverTime,
+              "Wall time budget of one bundle adjustment in seconds, none if "
+              "not positive.");
+DEFINE_bool(ba_prune_outliers, Settings::BundleAdjuster::default_pruneOutliers,
+            "Stop optimizing the points that become outliers between the "
+            "iterations of bundle adjustment?");
+DEFINE_bool(ba_prewarp, Settings::BundleAdjuster::default_prewarpKeyFrames,
+            "Sample the keyframes in bundle adjustment from their images "
+            "resampled onto cube maps instead of through the camera model?");
+DEFINE_int32(max_keyframes, Settings::default_maxKeyFrames,
+             "Number of keyframes in the optimization window.");
 
 DEFINE_double(optimized_stddev, Settings::PointTracer::default_optimizedStddev,
               "Max disparity error for a point to become optimized.");
 
 DEFINE_int32(shift_between_keyframes, Settings::default_shiftBetweenKeyFrames,
              "Difference in frame numbers between chosen keyFrames.");
+DEFINE_bool(adaptive_keyframes, Settings::KeyFramePolicy::default_enabled,
+            "Choose keyframes by the optical flow, the visible points, the "
+            "light change and the tracking error instead of every "
+            "shift_between_keyframes frames?");
+DEFINE_bool(adaptive_marginalization,
+            Settings::Marginalization::default_enabled,
+            "Marginalize the keyframes with few points visible on the newest "
+            "one and then the most redundant ones instead of the oldest?");
 DEFINE_bool(deterministic, true,
             "Do we need deterministic random number generation?");
+DEFINE_string(log_verbosity, "",
+              "Verbosities of the logged subsystems, as a comma-separated list "
+              "of category=level with the categories system, init, tracking, "
+              "tracing, mapping, ba, loop, camera, selection or all. The "
+              "levels go from 0 (rare events, always on) to 3 (single points, "
+              "compiled out unless built with a higher LOG_MAX_LEVEL).");
+DEFINE_bool(draw_inlier_matches,
+            Settings::StereoMatcher::default_drawInlierMatches,
+            "Debug output stereo inlier matches.");
+
+bool validateDepthsPart(const char *flagname, double value) {
+  if (value >= 0 && value <= 1)
+    return true;
+  std::cerr << "Invalid value for --" << std::string(flagname) << ": " << value
+            << "\nit should be in [0, 1]" << std::endl;
+  return false;
+}
+
+DEFINE_double(red_depths_part, Settings::DepthColors::default_redDepthsPart,
+              "Part of contrast points that will be drawn red (i.e. they are "
+              "too close to be distinguished)");
+DEFINE_validator(red_depths_part, validateDepthsPart);
+
+DEFINE_double(blue_depths_part, Settings::DepthColors::default_blueDepthsPart,
+              "Part of contrast points that will NOT be drawn completely blue "
+              "(i.e. they are not too far to be distinguished)");
+DEFINE_validator(blue_depths_part, validateDepthsPart);
 
 namespace fishdso {
 
+namespace {
+
+std::vector<ImageSampler::Interpolation>
+parseInterpolations(const std::string &list) {
+  std::vector<ImageSampler::Interpolation> result;
+  std::stringstream stream(list);
+  std::string name;
+  while (std::getline(stream, name, ',')) {
+    if (name == "nearest")
+      result.push_back(ImageSampler::NEAREST);
+    else if (name == "bilinear")
+      result.push_back(ImageSampler::BILINEAR);
+    else {
+      CHECK_EQ(name, "bicubic") << "unknown interpolation";
+      result.push_back(ImageSampler::BICUBIC);
+    }
+  }
+  return result;
+}
+
+} // namespace
+
 Settings getFlaggedSettings() {
   Settings settings;
 
   settings.threading.numThreads = FLAGS_num_threads;
+  settings.threading.asyncMapping = FLAGS_async_mapping;
+  settings.threading.cores = parseCoreList(FLAGS_cores);
   settings.keyFrame.pointsNum = FLAGS_points_per_frame;
+  settings.cameraModel.validAngle = FLAGS_valid_angle * M_PI / 180;
+  settings.cameraModel.cacheMapPolyFit = FLAGS_cache_camera_fit;
   settings.delaunayDsoInitializer.firstFramesSkip = FLAGS_first_frames_skip;
+  settings.delaunayDsoInitializer.candidatesPerBatch =
+      FLAGS_init_candidates_per_batch;
+  settings.delaunayDsoInitializer.minInliers = FLAGS_init_min_inliers;
   settings.stereoMatcher.stereoGeometryEstimator.runMaxRansacIter =
       FLAGS_run_max_RANSAC_iterations;
+  settings.stereoMatcher.stereoGeometryEstimator.preemptiveBlockSize =
+      FLAGS_RANSAC_preemptive_block;
   settings.stereoMatcher.stereoGeometryEstimator.runAveraging =
       FLAGS_average_ORB_motion;
+  if (FLAGS_ORB_matcher == "lsh")
+    settings.stereoMatcher.matcherType = Settings::StereoMatcher::LSH;
+  else if (FLAGS_ORB_matcher == "grid")
+    settings.stereoMatcher.matcherType = Settings::StereoMatcher::GRID;
+  else
+    CHECK_EQ(FLAGS_ORB_matcher, "bf") << "unknown ORB matcher";
+  settings.stereoMatcher.gridMatchRadius = FLAGS_ORB_grid_match_radius;
   settings.bundleAdjuster.runBA = FLAGS_run_ba;
   settings.affineLight.optimizeAffineLight = FLAGS_optimize_affine_light;
   settings.pointTracer.performFullTracing = FLAGS_perform_full_tracing;
+  settings.pointTracer.useDepthFilter = FLAGS_depth_filter_tracing;
   settings.pointTracer.useAltHWeighting = FLAGS_use_alt_H_weighting;
   settings.pointTracer.gnIter = FLAGS_tracing_GN_iter;
   settings.pointTracer.positionVariance = FLAGS_pos_variance;
+  settings.pointTracer.levelSearchInterpolation =
+      parseInterpolations(FLAGS_tracing_search_interpolation);
+  settings.pointTracer.coarseSearchLevels = FLAGS_tracing_coarse_levels;
+  settings.pointTracer.searchCandidates = FLAGS_tracing_search_candidates;
   settings.trackFromLastKf = FLAGS_track_from_last_kf;
   settings.predictUsingScrew = FLAGS_predict_using_screw;
   settings.frameTracker.useGradWeighting = FLAGS_use_grad_weights_on_tracking;
   settings.frameTracker.trackFailFactor = FLAGS_track_fail_factor;
+  settings.frameTracker.useAnalyticJacobian = FLAGS_analytic_tracking;
+  settings.frameTracker.useSinglePrecision = FLAGS_single_precision_tracking;
+  settings.frameTracker.useCuda = FLAGS_cuda_tracking;
+  settings.frameTracker.useInverseCompositional =
+      FLAGS_inverse_compositional_tracking;
+  settings.frameTracker.maxPointsPerLevel = FLAGS_tracking_max_points;
+  settings.pyramid.tiledSamplers = FLAGS_tiled_sampling;
+  settings.pyramid.hugePages = FLAGS_huge_pages;
+  settings.frameTracker.maxIterations = FLAGS_tracking_max_iter;
+  settings.frameTracker.levelInterpolation =
+      parseInterpolations(FLAGS_tracking_interpolation);
+  settings.frameTracker.skipFinestLevel = FLAGS_skip_finest_tracking;
+  settings.frameTracker.recoverTrack = FLAGS_recover_track;
+  settings.frameTracker.rotationPriorWeight = FLAGS_rotation_prior_weight;
+  settings.keyFrameDatabase.enabled = FLAGS_relocalize;
+  settings.loopClosure.enabled = FLAGS_close_loops;
+  settings.loadShedding.enabled = FLAGS_real_time;
+  settings.loadShedding.maxFrameAge = FLAGS_max_frame_age;
+  settings.speculativeTracking.batchSize = FLAGS_speculative_batch_size;
+  settings.speculativeTracking.maxRotationDiff =
+      FLAGS_speculative_max_rotation_diff;
+  settings.speculativeTracking.maxTranslationDiff =
+      FLAGS_speculative_max_translation_diff;
+  settings.globalBundleAdjuster.enabled = FLAGS_global_ba;
+  settings.globalBundleAdjuster.submapSize = FLAGS_global_ba_submap_size;
+  settings.pointBudget.enabled = FLAGS_adapt_point_budget;
+  settings.pointBudget.targetFrameTime = FLAGS_target_frame_time;
   settings.bundleAdjuster.runBA = FLAGS_run_ba;
   settings.bundleAdjuster.fixedMotionOnFirstAdjustent =
       FLAGS_fixed_motion_on_first_ba;
+  settings.bundleAdjuster.useWindowedOptimizer = FLAGS_windowed_ba;
+  if (FLAGS_ba_linear_solver == "sparse")
+    settings.bundleAdjuster.linearSolver =
+        Settings::BundleAdjuster::SPARSE_SCHUR;
+  else if (FLAGS_ba_linear_solver == "iterative")
+    settings.bundleAdjuster.linearSolver =
+        Settings::BundleAdjuster::ITERATIVE_SCHUR;
+  else
+    CHECK_EQ(FLAGS_ba_linear_solver, "dense") << "unknown BA linear solver";
+  settings.bundleAdjuster.maxSolverTime = FLAGS_ba_max_time;
+  settings.bundleAdjuster.pruneOutliers = FLAGS_ba_prune_outliers;
+  settings.bundleAdjuster.prewarpKeyFrames = FLAGS_ba_prewarp;
+  settings.maxKeyFrames = FLAGS_max_keyframes;
   settings.pointTracer.optimizedStddev = FLAGS_optimized_stddev;
   settings.shiftBetweenKeyFrames = FLAGS_shift_between_keyframes;
+  settings.keyFramePolicy.enabled = FLAGS_adaptive_keyframes;
+  settings.marginalization.enabled = FLAGS_adaptive_marginalization;
+  settings.cameraModel.deterministic = FLAGS_deterministic;
+  settings.pixelSelector.deterministic = FLAGS_deterministic;
+  settings.triangulation.deterministic = FLAGS_deterministic;
+  settings.stereoMatcher.stereoGeometryEstimator.deterministic =
+      FLAGS_deterministic;
+  settings.stereoMatcher.drawInlierMatches = FLAGS_draw_inlier_matches;
+  settings.depthColors.redDepthsPart = FLAGS_red_depths_part;
+  settings.depthColors.blueDepthsPart = FLAGS_blue_depths_part;
+
+  // the verbosities are process-wide, not a part of the settings
+  Log::setVerbosities(FLAGS_log_verbosity);
 
   return settings;
 }
@@ -1,5 +1,7 @@
 #include "util/geometry.h"
+#include "util/defs.h"
 #include "util/settings.h"
+#include <algorithm>
 #include <cmath>
 #include <glog/logging.h>
 
@@ -153,4 +155,47 @@ bool intersectOnSphere(double sectorAngle, Vec3 &dir1, Vec3 &dir2) {
   return true;
 }
 
+RayCone::RayCone()
+    : axis(0, 0, 1)
+    , halfAngle(-1)
+    , minDepth(INF) {}
+
+RayCone::RayCone(const StdVector<Vec3> &rays,
+                 const std::vector<double> &minDepths)
+    : RayCone() {
+  CHECK_EQ(rays.size(), minDepths.size());
+  if (rays.empty())
+    return;
+
+  Vec3 sum = Vec3::Zero();
+  for (const Vec3 &ray : rays)
+    sum += ray;
+  // not the smallest cone, but a tight enough one for the rays of a camera
+  axis = sum.norm() > 1e-9 ? sum.normalized() : Vec3(0, 0, 1);
+  halfAngle = 0;
+  for (int i = 0; i < rays.size(); ++i) {
+    halfAngle = std::max(halfAngle, angle(axis, rays[i]));
+    minDepth = std::min(minDepth, minDepths[i]);
+  }
+}
+
+bool RayCone::maybeSeenFrom(const SE3 &baseToOther, double fovAngle) const {
+  if (halfAngle < 0)
+    return false;
+
+  // A point p0 + s * u with |u| = 1 and s >= minDepth deviates from u as
+  // seen from the other camera by at most asin(b / (minDepth - b)), b being
+  // |p0|, the baseline, if minDepth >= 2b. Closer points can be anywhere.
+  double baseline = baseToOther.translation().norm();
+  double deviation = 0;
+  if (baseline > 0) {
+    if (!(minDepth >= 2 * baseline))
+      return true;
+    deviation = std::asin(baseline / (minDepth - baseline));
+  }
+
+  double axisAngle = angle(baseToOther.so3() * axis, Vec3(0, 0, 1));
+  return axisAngle - halfAngle - deviation <= fovAngle;
+}
+
 } // namespace fishdso
@@ -19,11 +19,11 @@ InitializerSettings Settings::getInitializerSettings() const {
           threading,
           triangulation,
           keyFrame,
-          {pointTracer, intencity, residualPattern, pyramid}};
+          {pointTracer, intencity, residualPattern, pyramid, depth}};
 }
 
 PointTracerSettings Settings::getPointTracerSettings() const {
-  return {pointTracer, intencity, residualPattern, pyramid};
+  return {pointTracer, intencity, residualPattern, pyramid, depth, threading};
 }
 
 FrameTrackerSettings Settings::getFrameTrackerSettings() const {
@@ -36,4 +36,8 @@ BundleAdjusterSettings Settings::getBundleAdjusterSettings() const {
           affineLight,    threading,       depth};
 }
 
+PixelSelectorSettings Settings::getPixelSelectorSettings() const {
+  return {pixelSelector, threading};
+}
+
 } // namespace fishdso
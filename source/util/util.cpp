@@ -1,35 +1,18 @@
 #include "util/util.h"
+#include "util/Scheduler.h"
 #include "util/defs.h"
 #include "util/settings.h"
 #include <algorithm>
+#include <cmath>
 #include <glog/logging.h>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/opencv.hpp>
 #include <sophus/se3.hpp>
-
-bool validateDepthsPart(const char *flagname, double value) {
-  if (value >= 0 && value <= 1)
-    return true;
-  std::cerr << "Invalid value for --" << std::string(flagname) << ": " << value
-            << "\nit should be in [0, 1]" << std::endl;
-  return false;
-}
-
-DEFINE_double(red_depths_part, 0,
-              "Part of contrast points that will be drawn red (i.e. they are "
-              "too close to be distinguished)");
-DEFINE_validator(red_depths_part, validateDepthsPart);
-
-DEFINE_double(blue_depths_part, 0.7,
-              "Part of contrast points that will NOT be drawn completely blue "
-              "(i.e. they are not too far to be distinguished)");
-DEFINE_validator(blue_depths_part, validateDepthsPart);
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
 namespace fishdso {
 
-cv::Mat dbg;
-double minDepthCol = 0, maxDepthCol = 1;
-
 void printInPly(std::ostream &out, const std::vector<Vec3> &points,
                 const std::vector<cv::Vec3b> &colors) {
   std::vector<Vec3> pf;
@@ -72,25 +55,25 @@ end_header
   }
 }
 
-void setDepthColBounds(const std::vector<double> &depths) {
+DepthColBounds depthColBounds(const std::vector<double> &depths,
+                              const Settings::DepthColors &settings) {
   if (depths.empty())
-    return;
+    return {};
   std::vector<double> sorted = depths;
   std::sort(sorted.begin(), sorted.end());
-  int redInd = FLAGS_red_depths_part * int(sorted.size());
+  int redInd = settings.redDepthsPart * int(sorted.size());
   if (redInd < 0)
     redInd = 0;
   if (redInd >= sorted.size())
     redInd = sorted.size() - 1;
 
-  int blueInd = FLAGS_blue_depths_part * sorted.size();
+  int blueInd = settings.blueDepthsPart * sorted.size();
   if (blueInd < 0)
     blueInd = 0;
   if (blueInd >= sorted.size())
     blueInd = sorted.size() - 1;
 
-  minDepthCol = sorted[redInd];
-  maxDepthCol = sorted[blueInd];
+  return {sorted[redInd], sorted[blueInd]};
 }
 
 cv::Mat drawLeveled(cv::Mat3b *images, int num, int w, int h, int resultW) {
@@ -148,19 +131,70 @@ void putSquare(cv::Mat &img, const cv::Point &pos, int size,
                 col, thickness);
 }
 
-void grad(const cv::Mat &img, cv::Mat1d &gradX, cv::Mat1d &gradY,
-          cv::Mat1d &gradNorm) {
-  static double filter[] = {-0.5, 0.0, 0.5};
-  static cv::Mat1d gradXKer(1, 3, filter);
-  static cv::Mat1d gradYKer(3, 1, filter);
+void grad(const cv::Mat &img, cv::Mat1f &gradX, cv::Mat1f &gradY,
+          cv::Mat1f &gradNorm) {
+  static float filter[] = {-0.5, 0.0, 0.5};
+  static cv::Mat1f gradXKer(1, 3, filter);
+  static cv::Mat1f gradYKer(3, 1, filter);
 
-  cv::filter2D(img, gradX, CV_64F, gradXKer, cv::Point(-1, -1), 0,
+  cv::filter2D(img, gradX, CV_32F, gradXKer, cv::Point(-1, -1), 0,
                cv::BORDER_REPLICATE);
-  cv::filter2D(img, gradY, CV_64F, gradYKer, cv::Point(-1, -1), 0,
+  cv::filter2D(img, gradY, CV_32F, gradYKer, cv::Point(-1, -1), 0,
                cv::BORDER_REPLICATE);
   cv::magnitude(gradX, gradY, gradNorm);
 }
 
+void gradAndPyrDown(const cv::Mat1b &img, float *gradX, float *gradY,
+                    float *gradNorm, cv::Mat1b *down,
+                    const Vec2i *validSpans) {
+  const int w = img.cols, h = img.rows;
+  if (down)
+    down->create(h / 2, w / 2);
+
+  // the inner loops are branch-free over plain pointers so that the compiler
+  // can vectorize them
+  for (int y = 0; y < h; ++y) {
+    const uchar *row = img.ptr<uchar>(y);
+    if (gradX) {
+      const uchar *prev = img.ptr<uchar>(std::max(y - 1, 0));
+      const uchar *next = img.ptr<uchar>(std::min(y + 1, h - 1));
+      float *gx = gradX + size_t(y) * w;
+      float *gy = gradY + size_t(y) * w;
+      float *gn = gradNorm + size_t(y) * w;
+      const int begin = validSpans ? validSpans[y][0] : 0;
+      const int end = validSpans ? validSpans[y][1] : w;
+      if (validSpans) {
+        for (float *plane : {gx, gy, gn}) {
+          std::fill(plane, plane + begin, 0.0f);
+          std::fill(plane + std::max(begin, end), plane + w, 0.0f);
+        }
+      }
+      for (int x = begin; x < end; ++x)
+        gy[x] = 0.5f * (float(next[x]) - float(prev[x]));
+      if (w > 1) {
+        if (begin == 0 && end > 0)
+          gx[0] = 0.5f * (float(row[1]) - float(row[0]));
+        for (int x = std::max(begin, 1); x < std::min(end, w - 1); ++x)
+          gx[x] = 0.5f * (float(row[x + 1]) - float(row[x - 1]));
+        if (end == w && begin < w)
+          gx[w - 1] = 0.5f * (float(row[w - 1]) - float(row[w - 2]));
+      } else if (w == 1 && begin < end)
+        gx[0] = 0;
+      for (int x = begin; x < end; ++x)
+        gn[x] = std::sqrt(gx[x] * gx[x] + gy[x] * gy[x]);
+    }
+
+    if (down && (y & 1) && y / 2 < down->rows) {
+      const uchar *prev = img.ptr<uchar>(y - 1);
+      uchar *dst = down->ptr<uchar>(y / 2);
+      for (int x = 0; x < down->cols; ++x)
+        dst[x] = (int(prev[2 * x]) + int(prev[2 * x + 1]) + int(row[2 * x]) +
+                  int(row[2 * x + 1])) /
+                 4;
+    }
+  }
+}
+
 double gradNormAt(const cv::Mat1b &img, const cv::Point &p) {
   double dx = (img(p.y, p.x + 1) - img(p.y, p.x - 1)) / 2.0;
   double dy = (img(p.y + 1, p.x) - img(p.y - 1, p.x)) / 2.0;
@@ -260,6 +294,50 @@ cv::Mat1d pyrNUpDepth(const cv::Mat1d &integralWeightedDepths,
   return res;
 }
 
+void forEachInRowBands(int height, const std::vector<int> &minRow,
+                       const std::vector<int> &maxRow,
+                       const Settings::Threading &threading,
+                       const std::function<void(int, int, int)> &f) {
+  constexpr int bandHeight = 16;
+  const int bandNum = (height + bandHeight - 1) / bandHeight;
+  const int itemNum = minRow.size();
+
+  // items of every band, as one array of consecutive buckets
+  std::vector<int> bandStart(bandNum + 1, 0);
+  auto forEachBand = [&](int item, auto g) {
+    int from = std::max(minRow[item], 0);
+    int to = std::min(maxRow[item], height - 1);
+    if (from > to)
+      return;
+    for (int b = from / bandHeight; b <= to / bandHeight; ++b)
+      g(b);
+  };
+  for (int i = 0; i < itemNum; ++i)
+    forEachBand(i, [&](int b) { bandStart[b + 1]++; });
+  for (int b = 0; b < bandNum; ++b)
+    bandStart[b + 1] += bandStart[b];
+  std::vector<int> bandItems(bandStart[bandNum]);
+  std::vector<int> filled(bandStart.begin(), bandStart.end() - 1);
+  for (int i = 0; i < itemNum; ++i)
+    forEachBand(i, [&](int b) { bandItems[filled[b]++] = i; });
+
+  ParallelExecutor(threading, Scheduler::MAPPING).execute([&]() {
+    tbb::parallel_for(tbb::blocked_range<int>(0, bandNum),
+                      [&](const tbb::blocked_range<int> &range) {
+                        for (int b = range.begin(); b < range.end(); ++b) {
+                          int bandFrom = b * bandHeight;
+                          int bandTo = std::min(bandFrom + bandHeight, height);
+                          for (int j = bandStart[b]; j < bandStart[b + 1];
+                               ++j) {
+                            int i = bandItems[j];
+                            f(i, std::max(minRow[i], bandFrom),
+                              std::min(maxRow[i], bandTo - 1));
+                          }
+                        }
+                      });
+  });
+}
+
 cv::Mat3b drawDepthedFrame(const cv::Mat1b &frame, const cv::Mat1d &depths,
                            double minDepth, double maxDepth) {
   int w = frame.cols, h = frame.rows;
@@ -288,4 +366,11 @@ std::string curTimeBrief() {
   return std::string(curTime);
 }
 
+double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  int rank = std::ceil(p / 100 * sorted.size());
+  return sorted[std::clamp(rank - 1, 0, int(sorted.size()) - 1)];
+}
+
 } // namespace fishdso
@@ -1,8 +1,14 @@
 #include "system/CameraModel.h"
+#include "system/CubeMapImage.h"
 #include "system/DsoSystem.h"
+#include "util/geometry.h"
 #include "util/types.h"
 #include <Eigen/Core>
+#include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <opencv2/imgproc.hpp>
+#include <random>
 
 using namespace fishdso;
 
@@ -93,6 +99,312 @@ TEST(CameraModelTest, CamerasPyramid) {
     }
 }
 
+TEST(CameraModelTest, LookupTables) {
+  double scale = 604.0;
+  Vec2 center(1.58447, 1.07353);
+  int unmapPolyDeg = 7;
+  int pyrLevels = 3;
+  VecX unmapPolyCoeffs(unmapPolyDeg, 1);
+  unmapPolyCoeffs << 1.14544, -0.146714, -0.967996, 2.13329, -2.42001, 1.33018,
+      -0.292722;
+  int width = 1920, height = 1208;
+  Settings::CameraModel lutSettings;
+  lutSettings.useLookupTables = true;
+  CameraModel cam(width, height, scale, center, unmapPolyCoeffs);
+  CameraModel camLut(width, height, scale, center, unmapPolyCoeffs,
+                     lutSettings);
+  StdVector<CameraModel> camPyr = cam.camPyr(pyrLevels);
+  StdVector<CameraModel> camPyrLut = camLut.camPyr(pyrLevels);
+
+  std::mt19937 mt;
+  const int testCount = 1000;
+  for (int lvl = 0; lvl < pyrLevels; ++lvl) {
+    std::uniform_int_distribution<> xs(0, camPyr[lvl].getWidth() - 1);
+    std::uniform_int_distribution<> ys(0, camPyr[lvl].getHeight() - 1);
+    for (int it = 0; it < testCount; ++it) {
+      Vec2 pnt(xs(mt), ys(mt));
+      Vec3 ray = camPyr[lvl].unmap(pnt);
+      Vec3 rayLut = camPyrLut[lvl].unmap(pnt);
+      EXPECT_LT((ray - rayLut).norm(), 1e-12);
+
+      Vec3 pos = 3.0 * ray.normalized();
+      EXPECT_LT((camPyr[lvl].map(pos) - camPyrLut[lvl].map(pos)).norm(), 1e-3);
+    }
+  }
+}
+
+TEST(CameraModelTest, MapBatch) {
+  double scale = 604.0;
+  Vec2 center(1.58447, 1.07353);
+  int unmapPolyDeg = 7;
+  VecX unmapPolyCoeffs(unmapPolyDeg, 1);
+  unmapPolyCoeffs << 1.14544, -0.146714, -0.967996, 2.13329, -2.42001, 1.33018,
+      -0.292722;
+  int width = 1920, height = 1208;
+  Settings::CameraModel lutSettings;
+  lutSettings.useLookupTables = true;
+  CameraModel cam(width, height, scale, center, unmapPolyCoeffs);
+  CameraModel camLut(width, height, scale, center, unmapPolyCoeffs,
+                     lutSettings);
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<> xs(0, width), ys(0, height);
+  const int n = 1000;
+  std::vector<double> rayX(n), rayY(n), rayZ(n);
+  for (int i = 0; i < n; ++i) {
+    Vec3 ray = 2.5 * cam.unmap(Vec2(xs(mt), ys(mt))).normalized();
+    rayX[i] = ray[0];
+    rayY[i] = ray[1];
+    rayZ[i] = ray[2];
+  }
+  // a ray right along the optical axis
+  rayX[0] = rayY[0] = 0;
+
+  for (const CameraModel *c : {&cam, &camLut}) {
+    std::vector<double> x(n), y(n);
+    c->mapBatch(n, rayX.data(), rayY.data(), rayZ.data(), x.data(), y.data());
+    for (int i = 0; i < n; ++i) {
+      Vec2 expected = c->map(Vec3(rayX[i], rayY[i], rayZ[i]));
+      EXPECT_LT((Vec2(x[i], y[i]) - expected).norm(), 1e-9);
+    }
+  }
+}
+
+TEST(CameraModelTest, DiffMap) {
+  double scale = 604.0;
+  Vec2 center(1.58447, 1.07353);
+  int unmapPolyDeg = 7;
+  int pyrLevels = 3;
+  VecX unmapPolyCoeffs(unmapPolyDeg, 1);
+  unmapPolyCoeffs << 1.14544, -0.146714, -0.967996, 2.13329, -2.42001, 1.33018,
+      -0.292722;
+  int width = 1920, height = 1208;
+  CameraModel cam(width, height, scale, center, unmapPolyCoeffs);
+  StdVector<CameraModel> camPyr = cam.camPyr(pyrLevels);
+
+  std::mt19937 mt;
+  const int testCount = 200;
+  const double eps = 1e-6;
+  for (int lvl = 0; lvl < pyrLevels; ++lvl) {
+    std::uniform_real_distribution<> xs(0, camPyr[lvl].getWidth());
+    std::uniform_real_distribution<> ys(0, camPyr[lvl].getHeight());
+    for (int it = 0; it < testCount; ++it) {
+      Vec3 ray = 2.0 * camPyr[lvl].unmap(Vec2(xs(mt), ys(mt))).normalized();
+      auto [point, jacobian] = camPyr[lvl].diffMap(ray);
+      EXPECT_LT((point - camPyr[lvl].map(ray.data())).norm(), 1e-12);
+      for (int i = 0; i < 3; ++i) {
+        Vec3 d = Vec3::Zero();
+        d[i] = eps;
+        Vec3 plus = ray + d, minus = ray - d;
+        Vec2 numDiff =
+            (camPyr[lvl].map(plus.data()) - camPyr[lvl].map(minus.data())) /
+            (2 * eps);
+        EXPECT_LT((jacobian.col(i) - numDiff).norm(), 1e-3);
+      }
+    }
+  }
+}
+
+TEST(CameraModelTest, CubeMapImage) {
+  double scale = 604.0;
+  Vec2 center(1.58447, 1.07353);
+  int unmapPolyDeg = 7;
+  VecX unmapPolyCoeffs(unmapPolyDeg, 1);
+  unmapPolyCoeffs << 1.14544, -0.146714, -0.967996, 2.13329, -2.42001, 1.33018,
+      -0.292722;
+  int width = 1920, height = 1208;
+  CameraModel cam(width, height, scale, center, unmapPolyCoeffs);
+  cv::Mat1b img(height, width);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      img(y, x) = 128 + 100 * std::sin(x / 40.0) * std::cos(y / 50.0);
+  BicubicTiles tiles(img);
+  CubeMapImage cubeMap(cam, img);
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<> xs(width / 4, 3 * width / 4);
+  std::uniform_real_distribution<> ys(height / 4, 3 * height / 4);
+  const double eps = 1e-3;
+  for (int it = 0; it < 200; ++it) {
+    Vec3 ray = cam.unmap(Vec2(xs(mt), ys(mt))).normalized();
+    // the derivatives are compared inside the front face
+    if (ray[2] < std::cos(0.6))
+      continue;
+    Vec2 p = cam.map(ray);
+    double expected, actual;
+    tiles.evaluate(p[1], p[0], &expected);
+    Eigen::Matrix<double, 1, 3> dfdRay;
+    cubeMap.evaluate(ray, &actual, &dfdRay);
+    // resampled once bilinearly into bytes
+    EXPECT_NEAR(actual, expected, 4);
+    for (int i = 0; i < 3; ++i) {
+      Vec3 d = Vec3::Zero();
+      d[i] = eps;
+      double plus, minus;
+      cubeMap.evaluate(ray + d, &plus);
+      cubeMap.evaluate(ray - d, &minus);
+      double numDiff = (plus - minus) / (2 * eps);
+      EXPECT_NEAR(dfdRay[i], numDiff, 2 + 0.05 * std::abs(numDiff));
+    }
+  }
+}
+
+TEST(CameraModelTest, ValidSpans) {
+  double scale = 604.0;
+  Vec2 center(1.58447, 1.07353);
+  int unmapPolyDeg = 7;
+  int pyrLevels = 3;
+  VecX unmapPolyCoeffs(unmapPolyDeg, 1);
+  unmapPolyCoeffs << 1.14544, -0.146714, -0.967996, 2.13329, -2.42001, 1.33018,
+      -0.292722;
+  int width = 1920, height = 1208;
+  Settings::CameraModel camSettings;
+  camSettings.validAngle = M_PI * 85 / 180;
+  CameraModel cam(width, height, scale, center, unmapPolyCoeffs, camSettings);
+  ASSERT_TRUE(cam.hasInvalidPixels());
+  StdVector<CameraModel> camPyr = cam.camPyr(pyrLevels);
+
+  int invalidCount = 0;
+  for (int lvl = 0; lvl < pyrLevels; ++lvl) {
+    const std::vector<Vec2i> &spans = cam.getValidSpans(lvl);
+    ASSERT_EQ(spans, camPyr[lvl].getValidSpans());
+    ASSERT_EQ(int(spans.size()), camPyr[lvl].getHeight());
+    for (int y = 0; y < spans.size(); y += 7)
+      for (int x = 0; x < camPyr[lvl].getWidth(); x += 7) {
+        bool isValid = x >= spans[y][0] && x < spans[y][1];
+        Vec2 p(x, y);
+        double rayAngle = angle(camPyr[lvl].unmap(p), Vec3(0, 0, 1));
+        // the map polynomial is an approximation of the inverse
+        if (std::abs(rayAngle - camSettings.validAngle) > 1e-3)
+          EXPECT_EQ(isValid, rayAngle < camSettings.validAngle)
+              << "lvl=" << lvl << " x=" << x << " y=" << y;
+        EXPECT_EQ(isValid, camPyr[lvl].isOnImage(p, 0));
+        if (!isValid)
+          invalidCount++;
+      }
+  }
+  EXPECT_GT(invalidCount, 0);
+
+  CameraModel fullCam(width, height, scale, center, unmapPolyCoeffs);
+  EXPECT_FALSE(fullCam.hasInvalidPixels());
+  EXPECT_EQ(cv::countNonZero(fullCam.validMask()), width * height);
+}
+
+TEST(CameraModelTest, StaticMask) {
+  double scale = 604.0;
+  Vec2 center(1.58447, 1.07353);
+  int unmapPolyDeg = 7;
+  int pyrLevels = 3;
+  VecX unmapPolyCoeffs(unmapPolyDeg, 1);
+  unmapPolyCoeffs << 1.14544, -0.146714, -0.967996, 2.13329, -2.42001, 1.33018,
+      -0.292722;
+  int width = 1920, height = 1208;
+  CameraModel cam(width, height, scale, center, unmapPolyCoeffs);
+  ASSERT_FALSE(cam.hasStaticMask());
+
+  // the vehicle's hood at the bottom of the frame
+  const int hoodTop = 1001;
+  cv::Mat1b mask(height, width, CV_WHITE_BYTE);
+  mask.rowRange(hoodTop, height).setTo(0);
+  cam.setStaticMask(mask);
+  ASSERT_TRUE(cam.hasStaticMask());
+  StdVector<CameraModel> camPyr = cam.camPyr(pyrLevels);
+
+  for (int lvl = 0; lvl < pyrLevels; ++lvl) {
+    const cv::Mat1b &lvlMask = camPyr[lvl].getStaticMask();
+    ASSERT_EQ(lvlMask.rows, camPyr[lvl].getHeight());
+    ASSERT_EQ(lvlMask.cols, camPyr[lvl].getWidth());
+    EXPECT_EQ(cv::countNonZero(lvlMask != cam.getStaticMask(lvl)), 0);
+    for (int y = 0; y < lvlMask.rows; ++y) {
+      // a coarse pixel is kept only if all of its fine pixels are
+      bool isKept = ((y + 1) << lvl) <= hoodTop;
+      for (int x = 0; x < lvlMask.cols; x += 13) {
+        ASSERT_EQ(bool(lvlMask(y, x)), isKept)
+            << "lvl=" << lvl << " x=" << x << " y=" << y;
+        EXPECT_EQ(camPyr[lvl].isOnImage(Vec2(x, y), 0), isKept);
+      }
+    }
+  }
+  EXPECT_EQ(cv::countNonZero(cam.validMask()), hoodTop * width);
+}
+
+TEST(CameraModelTest, MapPolyCache) {
+  namespace fs = std::filesystem;
+  double scale = 604.0;
+  Vec2 center(1.58447, 1.07353);
+  VecX unmapPolyCoeffs(7, 1);
+  unmapPolyCoeffs << 1.14544, -0.146714, -0.967996, 2.13329, -2.42001, 1.33018,
+      -0.292722;
+  int width = 1920, height = 1208;
+  fs::path dir = fs::temp_directory_path() / "fishdso_test_mappoly";
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  std::string calibFileName = (dir / "calib.txt").string();
+  Settings::CameraModel camSettings;
+  camSettings.cacheMapPolyFit = true;
+
+  CameraModel fitted(width, height, scale, center, unmapPolyCoeffs,
+                     camSettings, calibFileName);
+  std::string cacheFileName = fitted.mapPolyCacheFileName(calibFileName);
+  ASSERT_TRUE(fs::exists(cacheFileName));
+
+  CameraModel loaded(width, height, scale, center, unmapPolyCoeffs,
+                     camSettings, calibFileName);
+  std::mt19937 mt(42);
+  std::uniform_real_distribution<double> coord(-1, 1);
+  for (int i = 0; i < 100; ++i) {
+    Vec3 ray(coord(mt), coord(mt), coord(mt));
+    EXPECT_EQ(fitted.map(ray), loaded.map(ray));
+  }
+
+  // other fitting settings get a cache of their own
+  Settings::CameraModel otherSettings = camSettings;
+  otherSettings.mapPolyDegree = 8;
+  CameraModel other(width, height, scale, center, unmapPolyCoeffs,
+                    otherSettings, calibFileName);
+  EXPECT_NE(other.mapPolyCacheFileName(calibFileName), cacheFileName);
+
+  // a broken cache is ignored and replaced
+  std::ofstream(cacheFileName) << "garbage";
+  CameraModel refitted(width, height, scale, center, unmapPolyCoeffs,
+                       camSettings, calibFileName);
+  Vec3 ray(0.3, -0.2, 1);
+  EXPECT_LT((refitted.map(ray) - fitted.map(ray)).norm(), 1e-3);
+  CameraModel reloaded(width, height, scale, center, unmapPolyCoeffs,
+                       camSettings, calibFileName);
+  EXPECT_EQ(reloaded.map(ray), refitted.map(ray));
+
+  fs::remove_all(dir);
+}
+
+TEST(CameraModelTest, UndistortMaps) {
+  double scale = 604.0;
+  Vec2 center(1.58447, 1.07353);
+  VecX unmapPolyCoeffs(7, 1);
+  unmapPolyCoeffs << 1.14544, -0.146714, -0.967996, 2.13329, -2.42001, 1.33018,
+      -0.292722;
+  CameraModel cam(1920, 1208, scale, center, unmapPolyCoeffs);
+
+  cv::Size size(640, 480);
+  Mat33 K;
+  K << 300, 0, 320, 0, 300, 240, 0, 0, 1;
+  auto [mapX, mapY] = cam.makeUndistortMaps(K, size);
+  ASSERT_EQ(mapX.size(), size);
+  ASSERT_EQ(mapY.size(), size);
+  for (int y = 0; y < size.height; y += 11)
+    for (int x = 0; x < size.width; x += 11) {
+      Vec2 expected = cam.map(Vec3(K.inverse() * Vec3(x, y, 1)));
+      EXPECT_NEAR(mapX(y, x), expected[0], 1e-2) << "x=" << x << " y=" << y;
+      EXPECT_NEAR(mapY(y, x), expected[1], 1e-2) << "x=" << x << " y=" << y;
+    }
+
+  // a constant image stays constant where the maps land on it
+  cv::Mat1b img(cam.getHeight(), cam.getWidth(), static_cast<uchar>(100));
+  cv::Mat1b undistorted;
+  cv::remap(img, undistorted, mapX, mapY, cv::INTER_LINEAR);
+  EXPECT_EQ(undistorted(size.height / 2, size.width / 2), 100);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
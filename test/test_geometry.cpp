@@ -1,9 +1,11 @@
 #include "system/CameraModel.h"
 #include "system/DsoSystem.h"
+#include "system/ImuPreintegrator.h"
 #include "util/geometry.h"
 #include "util/types.h"
 #include <Eigen/Core>
 #include <gtest/gtest.h>
+#include <random>
 #include <tuple>
 
 using namespace fishdso;
@@ -151,6 +153,89 @@ TEST(GeometryTest, IsABCDConvexTest) {
         << "test #" << i << " failed: returned true" << std::endl;
 }
 
+TEST(GeometryTest, RayConeIsConservative) {
+  const int pointNum = 50, motionNum = 500;
+  const double fovAngle = M_PI * 0.75;
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> coord(-1, 1);
+  std::uniform_real_distribution<double> depthDist(2, 20);
+  auto randomDir = [&]() {
+    Vec3 v;
+    do
+      v = Vec3(coord(mt), coord(mt), coord(mt));
+    while (v.norm() < 1e-3 || v.norm() > 1);
+    return Vec3(v.normalized());
+  };
+
+  int culled = 0;
+  for (int m = 0; m < motionNum; ++m) {
+    // points around a random direction, in a cone of some 30 degrees
+    Vec3 center = randomDir();
+    StdVector<Vec3> rays, points;
+    std::vector<double> minDepths;
+    for (int i = 0; i < pointNum; ++i) {
+      Vec3 ray = (center + 0.25 * randomDir()).normalized();
+      double depth = depthDist(mt);
+      rays.push_back(ray);
+      minDepths.push_back(depth * 0.8);
+      points.push_back(depth * ray);
+    }
+    RayCone cone(rays, minDepths);
+
+    SE3 baseToOther(SO3::exp(M_PI * Vec3(coord(mt), coord(mt), coord(mt))),
+                    0.5 * Vec3(coord(mt), coord(mt), coord(mt)));
+    bool anySeen = false;
+    for (const Vec3 &p : points)
+      if (angle(baseToOther * p, Vec3(0, 0, 1)) <= fovAngle)
+        anySeen = true;
+
+    bool maybeSeen = cone.maybeSeenFrom(baseToOther, fovAngle);
+    if (anySeen)
+      ASSERT_TRUE(maybeSeen) << "motion #" << m;
+    if (!maybeSeen)
+      culled++;
+  }
+  EXPECT_GT(culled, 0);
+
+  EXPECT_FALSE(RayCone().maybeSeenFrom(SE3(), fovAngle));
+}
+
+TEST(GeometryTest, ImuPreintegration) {
+  const Vec3 gyro(0.3, -0.2, 0.5);
+  const Vec3 accel(0.1, 0.2, 9.8);
+  const SE3 imuToCam(SO3::exp(Vec3(0.1, 0.7, -0.3)), Vec3(0.05, 0, 0.02));
+  ImuPreintegrator imu(imuToCam);
+  for (int i = 0; i <= 10; ++i)
+    imu.addMeasurement({0.1 * i, gyro, accel});
+
+  EXPECT_FALSE(imu.integrate(-0.05, 0.5).has_value());
+  EXPECT_FALSE(imu.integrate(0.5, 1.05).has_value());
+
+  std::optional<ImuDelta> delta = imu.integrate(0.05, 0.95);
+  ASSERT_TRUE(delta.has_value());
+  EXPECT_NEAR(delta->dt, 0.9, 1e-12);
+  EXPECT_LT((delta->deltaRot.log() - 0.9 * gyro).norm(), 1e-9);
+
+  // the camera turns the opposite way, in its own frame
+  SO3 expected = imuToCam.so3() * SO3::exp(-0.9 * gyro) *
+                 imuToCam.so3().inverse();
+  EXPECT_LT((imu.camRotation(*delta) * expected.inverse()).log().norm(), 1e-9);
+
+  ImuPreintegrator still;
+  for (int i = 0; i <= 10; ++i)
+    still.addMeasurement({0.1 * i, Vec3::Zero(), accel});
+  std::optional<ImuDelta> stillDelta = still.integrate(0, 1);
+  ASSERT_TRUE(stillDelta.has_value());
+  EXPECT_LT((stillDelta->deltaVel - accel).norm(), 1e-9);
+  EXPECT_LT((stillDelta->deltaPos - 0.5 * accel).norm(), 1e-9);
+
+  still.discardBefore(0.55);
+  EXPECT_EQ(still.measurementNum(), 6);
+  EXPECT_TRUE(still.integrate(0.55, 1).has_value());
+  EXPECT_FALSE(still.integrate(0.45, 1).has_value());
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
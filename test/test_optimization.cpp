@@ -0,0 +1,473 @@
+#include "system/BundleAdjuster.h"
+#include "system/FrameTracker.h"
+#include "system/ImmaturePoint.h"
+#include "system/KeyFrame.h"
+#include "system/LoopCloser.h"
+#include "system/PreKeyFrame.h"
+#include "system/WindowedOptimizer.h"
+#include "util/Profiler.h"
+#include "util/types.h"
+#include <Eigen/Dense>
+#include <gtest/gtest.h>
+#include <opencv2/core.hpp>
+#include <random>
+
+using namespace fishdso;
+
+namespace {
+
+// The walls z = 4 and x = 4 of a room in the world, covered with waves of
+// several lengths, so that every pyramid level has gradients to track.
+// Returns the distance along the unit direction to the nearest wall, and its
+// intensity there.
+std::pair<double, double> castRay(const Vec3 &center, const Vec3 &dir) {
+  constexpr double wall = 4;
+  double tz = dir[2] > 0 ? (wall - center[2]) / dir[2] : INF;
+  double tx = dir[0] > 0 ? (wall - center[0]) / dir[0] : INF;
+  double t = std::min(tz, tx);
+  if (t == INF)
+    return {INF, 0};
+  Vec3 p = center + t * dir;
+  double u = tz < tx ? p[0] : p[2], v = p[1];
+  double intensity = 128 + 50 * std::sin(2.1 * u + 0.3) * std::cos(1.7 * v) +
+                     30 * std::sin(0.9 * u - 1.3 * v) +
+                     20 * std::sin(7 * u) * std::sin(6 * v);
+  return {t, intensity};
+}
+
+cv::Mat1b renderRoom(const CameraModel &cam, const SE3 &worldToCam) {
+  SE3 camToWorld = worldToCam.inverse();
+  cv::Mat1b img(cam.getHeight(), cam.getWidth());
+  for (int y = 0; y < img.rows; ++y)
+    for (int x = 0; x < img.cols; ++x) {
+      Vec3 dir = camToWorld.so3() * cam.unmap(Vec2(x, y)).normalized();
+      double intensity = castRay(camToWorld.translation(), dir).second;
+      img(y, x) = cv::saturate_cast<uchar>(intensity);
+    }
+  return img;
+}
+
+} // namespace
+
+TEST(OptimizationTest, WindowedMarginalizationMatchesDense) {
+  constexpr int fp = WindowedOptimizer::frameParams;
+  const int frameNum = 3, pointNum = 6, resPerPoint = 10;
+  const int frameDim = fp * frameNum, dim = frameDim + pointNum;
+
+  std::mt19937 mt(42);
+  std::normal_distribution<double> gauss(0, 1);
+
+  // every residual depends on all the frames and on a single point, like the
+  // photometric ones do on their host, target and inverse depth
+  MatXX J = MatXX::Zero(pointNum * resPerPoint, dim);
+  VecX r(pointNum * resPerPoint);
+  for (int p = 0; p < pointNum; ++p)
+    for (int i = 0; i < resPerPoint; ++i) {
+      int row = p * resPerPoint + i;
+      for (int c = 0; c < frameDim; ++c)
+        J(row, c) = gauss(mt);
+      J(row, frameDim + p) = gauss(mt);
+      r[row] = gauss(mt);
+    }
+  // an old prior on the frames
+  MatXX priorJ = MatXX::NullaryExpr(frameDim, frameDim, [&]() {
+    return gauss(mt);
+  });
+  MatXX H = J.transpose() * J;
+  H.topLeftCorner(frameDim, frameDim) += priorJ.transpose() * priorJ;
+  VecX b = J.transpose() * r;
+
+  WindowedOptimizer::Linearization lin;
+  lin.Hff = H.topLeftCorner(frameDim, frameDim);
+  lin.bf = b.head(frameDim);
+  lin.Hpf = H.bottomLeftCorner(pointNum, frameDim);
+  for (int p = 0; p < pointNum; ++p) {
+    lin.Hpp.push_back(H(frameDim + p, frameDim + p));
+    lin.bp.push_back(b[frameDim + p]);
+  }
+
+  for (int k = 0; k < frameNum; ++k) {
+    MatXX priorH;
+    VecX priorB;
+    WindowedOptimizer::marginalizeFrame(lin, k, priorH, priorB);
+
+    // dense Schur complement of the points and of the frame k
+    std::vector<int> keep, drop;
+    for (int i = 0; i < dim; ++i)
+      (i < frameDim && i / fp != k ? keep : drop).push_back(i);
+    MatXX Hkk(drop.size(), drop.size()), Hrk(keep.size(), drop.size()),
+        Hrr(keep.size(), keep.size());
+    VecX bk(drop.size()), br(keep.size());
+    for (int i = 0; i < keep.size(); ++i) {
+      br[i] = b[keep[i]];
+      for (int j = 0; j < keep.size(); ++j)
+        Hrr(i, j) = H(keep[i], keep[j]);
+      for (int j = 0; j < drop.size(); ++j)
+        Hrk(i, j) = H(keep[i], drop[j]);
+    }
+    for (int i = 0; i < drop.size(); ++i) {
+      bk[i] = b[drop[i]];
+      for (int j = 0; j < drop.size(); ++j)
+        Hkk(i, j) = H(drop[i], drop[j]);
+    }
+    Eigen::LDLT<MatXX> HkkLdlt(Hkk);
+    MatXX expectedH = Hrr - Hrk * HkkLdlt.solve(Hrk.transpose());
+    VecX expectedB = br - Hrk * HkkLdlt.solve(bk);
+
+    ASSERT_EQ(priorH.rows(), fp * (frameNum - 1));
+    EXPECT_LT((priorH - expectedH).norm(), 1e-6 * expectedH.norm())
+        << "frame " << k;
+    EXPECT_LT((priorB - expectedB).norm(), 1e-6 * expectedB.norm())
+        << "frame " << k;
+  }
+}
+
+// Two cameras looking at different walls, the second one turned to the side
+// and shifted, track a known motion of the body together.
+TEST(OptimizationTest, RigTrackingRecoversBodyMotion) {
+  FrameTrackerSettings settings;
+  settings.pyramid.levelNum = 4;
+  CameraModel cam(320, 240, 200.0, 160.0, 120.0);
+  StdVector<CameraModel> camPyr = cam.camPyr(settings.pyramid.levelNum);
+
+  // the second camera looks along the x axis of the body
+  SE3 camToBody1(SO3::exp(Vec3(0, M_PI / 2, 0)), Vec3(0.2, -0.05, 0.1));
+  StdVector<FrameTracker::RigCamera> rig = {{&camPyr, SE3()},
+                                            {&camPyr, camToBody1.inverse()}};
+  SE3 baseToTracked(SO3::exp(Vec3(0.01, -0.02, 0.015)),
+                    Vec3(0.05, -0.03, 0.08));
+
+  // the world is the body of the base frame set
+  std::vector<std::unique_ptr<DepthedImagePyramid>> baseFrames;
+  std::vector<std::unique_ptr<PreKeyFrame>> tracked;
+  for (const FrameTracker::RigCamera &camera : rig) {
+    cv::Mat1b baseImg = renderRoom(cam, camera.bodyToCam);
+    SE3 camToWorld = camera.bodyToCam.inverse();
+    StdVector<Vec2> points;
+    std::vector<double> depths;
+    for (int y = 4; y < cam.getHeight() - 4; y += 3)
+      for (int x = 4; x < cam.getWidth() - 4; x += 3) {
+        Vec3 dir = camToWorld.so3() * cam.unmap(Vec2(x, y)).normalized();
+        points.push_back(Vec2(x, y));
+        depths.push_back(castRay(camToWorld.translation(), dir).first);
+      }
+    std::vector<double> weights(points.size(), 1.0);
+    baseFrames.emplace_back(new DepthedImagePyramid(
+        baseImg, settings.pyramid.levelNum, points, depths, weights));
+
+    SourceFrame frame;
+    frame.gray = renderRoom(cam, camera.bodyToCam * baseToTracked);
+    frame.globalFrameNum = 1;
+    tracked.emplace_back(
+        new PreKeyFrame(nullptr, &cam, frame, settings.pyramid));
+  }
+
+  FrameTracker tracker(rig, std::move(baseFrames), {}, settings);
+  std::vector<const PreKeyFrame *> frames = {tracked[0].get(),
+                                             tracked[1].get()};
+  auto [result, affLights] =
+      tracker.trackRig(frames, SE3(), std::vector<AffLight>(2));
+
+  SE3 error = result * baseToTracked.inverse();
+  EXPECT_LT(error.translation().norm(), 5e-3)
+      << "tracked:\n"
+      << result.matrix() << "\nexpected:\n"
+      << baseToTracked.matrix();
+  EXPECT_LT(error.so3().log().norm(), 1e-3);
+  ASSERT_EQ(affLights.size(), 2);
+  for (const AffLight &affLight : affLights) {
+    EXPECT_LT(std::abs(affLight.data[0]), 0.05);
+    EXPECT_LT(std::abs(affLight.data[1]), 5.0);
+  }
+}
+
+// The inverse compositional solver tracks a known motion of the camera in
+// the room as closely as the forward one. With a prior off the true
+// rotation both of them settle on the same compromise, which they would
+// not if the increment of one of them had the wrong sign.
+TEST(OptimizationTest, InverseCompositionalTrackingMatchesForward) {
+  FrameTrackerSettings settings;
+  settings.pyramid.levelNum = 4;
+  settings.frameTracker.useAnalyticJacobian = true;
+  CameraModel cam(320, 240, 200.0, 160.0, 120.0);
+  StdVector<CameraModel> camPyr = cam.camPyr(settings.pyramid.levelNum);
+  SE3 baseToTracked(SO3::exp(Vec3(0.01, -0.02, 0.015)),
+                    Vec3(0.05, -0.03, 0.08));
+
+  // the world is the base camera
+  cv::Mat1b baseImg = renderRoom(cam, SE3());
+  StdVector<Vec2> points;
+  std::vector<double> depths;
+  for (int y = 4; y < cam.getHeight() - 4; y += 3)
+    for (int x = 4; x < cam.getWidth() - 4; x += 3) {
+      points.push_back(Vec2(x, y));
+      depths.push_back(
+          castRay(Vec3::Zero(), cam.unmap(Vec2(x, y)).normalized()).first);
+    }
+  std::vector<double> weights(points.size(), 1.0);
+
+  SourceFrame frame;
+  frame.gray = renderRoom(cam, baseToTracked);
+  frame.globalFrameNum = 1;
+  PreKeyFrame tracked(nullptr, &cam, frame, settings.pyramid);
+
+  auto track = [&](bool isInverse, const std::optional<SO3> &rotationPrior,
+                   double priorWeight) {
+    FrameTrackerSettings curSettings = settings;
+    curSettings.frameTracker.useInverseCompositional = isInverse;
+    curSettings.frameTracker.rotationPriorWeight = priorWeight;
+    FrameTracker tracker(
+        camPyr,
+        std::make_unique<DepthedImagePyramid>(
+            baseImg, settings.pyramid.levelNum, points, depths, weights),
+        {}, curSettings);
+    return tracker.trackFrame(tracked, SE3(), AffLight(), rotationPrior).first;
+  };
+  auto translationError = [](const SE3 &a, const SE3 &b) {
+    return (a * b.inverse()).translation().norm();
+  };
+  auto rotationError = [](const SE3 &a, const SE3 &b) {
+    return (a.so3() * b.so3().inverse()).log().norm();
+  };
+
+  SE3 forward = track(false, std::nullopt, 0);
+  SE3 inverse = track(true, std::nullopt, 0);
+  EXPECT_LT(translationError(forward, baseToTracked), 5e-3);
+  EXPECT_LT(rotationError(forward, baseToTracked), 1e-3);
+  EXPECT_LT(translationError(inverse, baseToTracked),
+            translationError(forward, baseToTracked) + 2e-3)
+      << "tracked:\n"
+      << inverse.matrix() << "\nexpected:\n"
+      << baseToTracked.matrix();
+  EXPECT_LT(rotationError(inverse, baseToTracked),
+            rotationError(forward, baseToTracked) + 5e-4);
+
+  // the prior is weighted to be on par with the photometric energy
+  const double priorWeight = 1e10;
+  SO3 prior = baseToTracked.so3() * SO3::exp(Vec3(0, 0.004, 0));
+  SE3 forwardPrior = track(false, prior, priorWeight);
+  SE3 inversePrior = track(true, prior, priorWeight);
+  EXPECT_LT(rotationError(forwardPrior, baseToTracked), 0.0045);
+  EXPECT_LT(rotationError(inversePrior, forwardPrior), 5e-4);
+  EXPECT_LT(translationError(inversePrior, forwardPrior), 5e-3);
+
+  // and an exact prior keeps it at the true motion
+  SE3 inverseExact = track(true, baseToTracked.so3(), priorWeight);
+  EXPECT_LT(translationError(inverseExact, baseToTracked), 5e-3);
+  EXPECT_LT(rotationError(inverseExact, baseToTracked), 1e-3);
+}
+
+TEST(OptimizationTest, CoarseTracingMatchesExhaustive) {
+  CameraModel cam(320, 240, 200.0, 160.0, 120.0);
+  Settings::KeyFrame kfSettings;
+  kfSettings.pointsNum = 0;
+  const SE3 baseToRef(SO3(), Vec3(-0.2, 0, 0));
+  cv::Mat1b baseImg = renderRoom(cam, SE3());
+  cv::Mat1b refImg = renderRoom(cam, baseToRef);
+
+  // traces the same pixels with the given settings, the keyframe is the world
+  auto trace = [&](const PointTracerSettings &tracingSettings,
+                   std::vector<ImmaturePoint::TracingStatus> &statuses,
+                   std::vector<double> &depths) {
+    KeyFrame kf(std::make_shared<PreKeyFrame>(nullptr, &cam,
+                                              SourceFrame{baseImg, {}, 0}),
+                kfSettings,
+                std::make_shared<const PointTracerSettings>(tracingSettings));
+    kf.thisToWorld = SE3();
+    PreKeyFrame ref(&kf, &cam, SourceFrame{refImg, {}, 1});
+    ref.baseToThis = baseToRef;
+    for (int y = 40; y <= 200; y += 20)
+      for (int x = 40; x <= 280; x += 20) {
+        ImmaturePoint point(&kf, Vec2(x, y), kf.immaturePointBlock->add());
+        statuses.push_back(point.traceOn(kf, ref, ImmaturePoint::NO_DEBUG));
+        depths.push_back(point.depth);
+      }
+  };
+
+  PointTracerSettings exhaustiveSettings;
+  exhaustiveSettings.pointTracer.coarseSearchLevels = 0;
+  std::vector<ImmaturePoint::TracingStatus> exhaustiveStatuses;
+  std::vector<double> exhaustiveDepths;
+  trace(exhaustiveSettings, exhaustiveStatuses, exhaustiveDepths);
+
+  // with a single candidate, the second best has to come from around the
+  // lone coarse minimum
+  for (int candidates : {1, 3}) {
+    PointTracerSettings coarseSettings;
+    coarseSettings.pointTracer.coarseSearchLevels = 2;
+    coarseSettings.pointTracer.searchCandidates = candidates;
+    std::vector<ImmaturePoint::TracingStatus> coarseStatuses;
+    std::vector<double> coarseDepths;
+    trace(coarseSettings, coarseStatuses, coarseDepths);
+
+    int okNum = 0, matchedNum = 0, infEnergyNum = 0;
+    for (int i = 0; i < exhaustiveStatuses.size(); ++i) {
+      if (coarseStatuses[i] == ImmaturePoint::INF_ENERGY &&
+          exhaustiveStatuses[i] != ImmaturePoint::INF_ENERGY)
+        infEnergyNum++;
+      if (exhaustiveStatuses[i] != ImmaturePoint::OK)
+        continue;
+      okNum++;
+      if (coarseStatuses[i] == ImmaturePoint::OK &&
+          std::abs(coarseDepths[i] - exhaustiveDepths[i]) <
+              1e-2 * exhaustiveDepths[i])
+        matchedNum++;
+    }
+    EXPECT_GE(okNum, int(exhaustiveStatuses.size()) / 2);
+    EXPECT_EQ(infEnergyNum, 0) << "with " << candidates << " candidates";
+    EXPECT_GE(matchedNum, 0.9 * okNum) << "with " << candidates
+                                       << " candidates";
+  }
+
+  // and the depths found are the true ones
+  int i = 0;
+  for (int y = 40; y <= 200; y += 20)
+    for (int x = 40; x <= 280; x += 20, ++i)
+      if (exhaustiveStatuses[i] == ImmaturePoint::OK) {
+        double trueDepth =
+            castRay(Vec3::Zero(), cam.unmap(Vec2(x, y)).normalized()).first;
+        EXPECT_NEAR(exhaustiveDepths[i], trueDepth, 0.05 * trueDepth)
+            << "at " << x << " " << y;
+      }
+}
+
+TEST(OptimizationTest, PoseGraphPullsLoopBack) {
+  // keyframes on a circle, looking along it, with every measured motion
+  // between consecutive ones drifting in scale, rotation and translation
+  constexpr int n = 12;
+  constexpr double radius = 5;
+  StdVector<Sim3> worldToTrue;
+  for (int i = 0; i < n; ++i) {
+    double angle = 2 * M_PI * i / n;
+    SE3 worldToThis = SE3(SO3::exp(Vec3(0, angle, 0)),
+                          radius * Vec3(std::sin(angle), 0, std::cos(angle)))
+                          .inverse();
+    worldToTrue.push_back(
+        Sim3(Sophus::RxSO3d(1, worldToThis.so3()), worldToThis.translation()));
+  }
+  Sim3 drift(Sophus::RxSO3d(std::exp(0.01), SO3::exp(Vec3(0.01, -0.02, 0.01))),
+             Vec3(0.03, -0.02, 0.01));
+
+  StdVector<LoopCloser::Node> nodes;
+  StdVector<LoopCloser::Edge> edges;
+  Sim3 worldToMeasured = worldToTrue[0];
+  nodes.push_back(LoopCloser::Node::fromPose(0, worldToMeasured));
+  for (int i = 1; i < n; ++i) {
+    Sim3 prevToThis = worldToTrue[i] * worldToTrue[i - 1].inverse() * drift;
+    edges.push_back({i - 1, i, prevToThis});
+    worldToMeasured = prevToThis * worldToMeasured;
+    nodes.push_back(LoopCloser::Node::fromPose(i, worldToMeasured));
+  }
+  edges.push_back({0, n - 1, worldToTrue[n - 1] * worldToTrue[0].inverse()});
+
+  auto error = [&](int i) {
+    return (worldToTrue[i].inverse() * nodes[i].pose()).log().norm();
+  };
+  double initialError = error(n - 1);
+  ASSERT_GT(initialError, 0.1);
+
+  Settings::LoopClosure settings;
+  settings.maxIterations = 100;
+  LoopCloser::optimize(nodes, edges, settings);
+
+  EXPECT_LT(error(n - 1), 0.2 * initialError);
+  EXPECT_LT(error(0), 1e-9);
+}
+
+TEST(OptimizationTest, LoopVerificationRejectsDisagreeingRotations) {
+  // the same motion tracked back against depths twice as large
+  SE3 candidateToThis(SO3::exp(Vec3(0.1, -0.2, 0.05)), Vec3(0.3, 0.1, -0.2));
+  SE3 thisToCandidate = candidateToThis.inverse();
+  thisToCandidate.translation() *= 2;
+
+  Settings::LoopClosure settings;
+  std::optional<Sim3> loop =
+      LoopCloser::combineMotions(candidateToThis, thisToCandidate, settings);
+  ASSERT_TRUE(loop);
+  EXPECT_NEAR(loop->scale(), 2, 1e-9);
+  EXPECT_LT((loop->rxso3().so3() * candidateToThis.so3().inverse())
+                .log()
+                .norm(),
+            1e-9);
+  EXPECT_LT((loop->translation() - 2 * candidateToThis.translation()).norm(),
+            1e-9);
+
+  SE3 turnedBack(SO3::exp(Vec3(0, 0, 0.2)) * thisToCandidate.so3(),
+                 thisToCandidate.translation());
+  EXPECT_FALSE(
+      LoopCloser::combineMotions(candidateToThis, turnedBack, settings));
+}
+
+// A dark square painted onto the second of two keyframes of the room makes
+// the point in it an outlier from the start. It is frozen after the first
+// successful step and removed after the solve, the rest are kept.
+TEST(OptimizationTest, BundleAdjusterPrunesPlantedOutlier) {
+  CameraModel cam(320, 240, 200.0, 160.0, 120.0);
+  BundleAdjusterSettings settings;
+  settings.bundleAdjuster.pruneOutliers = true;
+  Settings::KeyFrame kfSettings;
+  kfSettings.pointsNum = 0;
+  auto tracingSettings = std::make_shared<const PointTracerSettings>();
+
+  SE3 camToWorld[2] = {SE3(), SE3(SO3(), Vec3(0.15, 0, 0))};
+  cv::Mat1b images[2];
+  for (int i = 0; i < 2; ++i)
+    images[i] = renderRoom(cam, camToWorld[i].inverse());
+  const Vec2 outlierPos(100, 120);
+  images[1](cv::Rect(outlierPos[0] - 7, outlierPos[1] - 7, 15, 15)) = 0;
+
+  std::vector<std::unique_ptr<KeyFrame>> keyFrames;
+  for (int i = 0; i < 2; ++i) {
+    keyFrames.emplace_back(new KeyFrame(
+        std::make_shared<PreKeyFrame>(nullptr, &cam,
+                                      SourceFrame{images[i], {}, i}),
+        kfSettings, tracingSettings));
+    keyFrames.back()->thisToWorld = camToWorld[i];
+  }
+
+  // the depths of the inliers are a bit off, so that the solve makes steps
+  KeyFrame &second = *keyFrames[1];
+  auto addPoint = [&](const Vec2 &p, double depthFactor) {
+    Vec3 dir = cam.unmap(p).normalized();
+    double depth = castRay(camToWorld[1].translation(), dir).first;
+    second.optimizedPoints.emplace_back(new OptimizedPoint(p));
+    second.optimizedPoints.back()->activate(depthFactor * depth);
+    return second.optimizedPoints.back().get();
+  };
+  OptimizedPoint *outlier = addPoint(outlierPos, 1);
+  std::vector<OptimizedPoint *> inliers;
+  for (int y = 50; y <= 190; y += 10)
+    for (int x = 60; x <= 260; x += 10)
+      if ((Vec2(x, y) - outlierPos).lpNorm<Eigen::Infinity>() > 14) {
+        double depthFactor = inliers.size() % 2 ? 1.03 : 0.97;
+        inliers.push_back(addPoint(Vec2(x, y), depthFactor));
+      }
+
+  BundleAdjuster bundleAdjuster(&cam, settings);
+  for (const auto &kf : keyFrames)
+    bundleAdjuster.addKeyFrame(kf.get());
+  Profiler::collect();
+  bundleAdjuster.adjust(20);
+
+  EXPECT_EQ(outlier->state, OptimizedPoint::OUTLIER);
+  for (OptimizedPoint *op : inliers)
+    EXPECT_EQ(op->state, OptimizedPoint::ACTIVE) << "at " << op->p.transpose();
+#ifdef FISHDSO_PROFILING
+  for (const auto &c : Profiler::collect().counters)
+    if (c.name == "ba.prunedPoints")
+      EXPECT_EQ(c.value, 1);
+#endif
+
+  // out of the problem, the depth of the outlier is not touched again
+  outlier->logInvDepth = 0;
+  bundleAdjuster.adjust(20);
+  EXPECT_EQ(outlier->logInvDepth, 0.0);
+  EXPECT_EQ(outlier->state, OptimizedPoint::OUTLIER);
+  for (OptimizedPoint *op : inliers)
+    EXPECT_EQ(op->state, OptimizedPoint::ACTIVE) << "at " << op->p.transpose();
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
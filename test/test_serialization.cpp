@@ -1,9 +1,11 @@
 #include "../samples/mfov/reader/MultiFovReader.h"
 #include "output/TrajectoryWriter.h"
 #include "system/DsoSystem.h"
+#include "system/MapLocalizer.h"
 #include "system/serialization.h"
 #include "util/flags.h"
 #include <gtest/gtest.h>
+#include <opencv2/imgproc.hpp>
 
 using namespace fishdso;
 
@@ -114,6 +116,85 @@ TEST_F(SerializationTest, canBeInterrupted) {
   EXPECT_LT(rotErr, maxRotErr);
 }
 
+TEST_F(SerializationTest, checkpointsMatchSnapshot) {
+  fs::path checkpointDir = outDir / "checkpoint";
+  dsoOriginal->enableCheckpoints(checkpointDir, BINARY, 2);
+  for (int frameInd = FLAGS_start;
+       frameInd < FLAGS_start + FLAGS_count_before_interruption; ++frameInd)
+    dsoOriginal->addFrame(datasetReader->getFrame(frameInd), frameInd);
+  fs::path snapshotDir = outDir / "snapshot";
+  dsoOriginal->saveSnapshot(snapshotDir);
+  // syncs the last checkpoint
+  dsoOriginal.reset();
+
+  StdMap<int, KeyFrame> fromSnapshot, fromCheckpoint;
+  SnapshotLoader(datasetReader.get(), &cam, snapshotDir, settings)
+      .load(fromSnapshot);
+  SnapshotLoader(datasetReader.get(), &cam, checkpointDir, settings)
+      .load(fromCheckpoint);
+
+  // the window moves only with a new keyframe, and so do the optimized points
+  ASSERT_EQ(fromSnapshot.size(), fromCheckpoint.size());
+  for (const auto &[num, kf] : fromSnapshot) {
+    ASSERT_TRUE(fromCheckpoint.count(num));
+    const KeyFrame &restored = fromCheckpoint.at(num);
+    EXPECT_LT((kf.thisToWorld.inverse() * restored.thisToWorld).log().norm(),
+              1e-9);
+    ASSERT_EQ(kf.optimizedPoints.size(), restored.optimizedPoints.size());
+    for (int i = 0; i < kf.optimizedPoints.size(); ++i)
+      EXPECT_NEAR(kf.optimizedPoints[i]->logInvDepth,
+                  restored.optimizedPoints[i]->logInvDepth, 1e-9);
+  }
+}
+
+TEST_F(SerializationTest, loadsEmbeddedFramesWithoutDataset) {
+  for (int frameInd = FLAGS_start;
+       frameInd < FLAGS_start + FLAGS_count_before_interruption; ++frameInd)
+    dsoOriginal->addFrame(datasetReader->getFrame(frameInd), frameInd);
+  fs::path snapshotDir = outDir / "snapshot";
+  dsoOriginal->saveSnapshot(snapshotDir, BINARY, PNG_FRAMES);
+
+  StdMap<int, KeyFrame> embedded;
+  SnapshotLoader(nullptr, &cam, snapshotDir, settings).load(embedded);
+
+  ASSERT_GE(embedded.size(), 2);
+  for (const auto &[num, kf] : embedded) {
+    cv::Mat1b expected;
+    cv::cvtColor(datasetReader->getFrame(num), expected, cv::COLOR_BGR2GRAY);
+    const cv::Mat1b &restored = kf.preKeyFrame->frame();
+    ASSERT_EQ(expected.size(), restored.size());
+    EXPECT_EQ(cv::countNonZero(expected != restored), 0);
+  }
+}
+
+TEST_F(SerializationTest, localizesKeyFramesInTheirMap) {
+  for (int frameInd = FLAGS_start;
+       frameInd < FLAGS_start + FLAGS_count_before_interruption; ++frameInd)
+    dsoOriginal->addFrame(datasetReader->getFrame(frameInd), frameInd);
+  fs::path snapshotDir = outDir / "snapshot";
+  dsoOriginal->saveSnapshot(snapshotDir);
+
+  StdMap<int, KeyFrame> keyFrames;
+  SnapshotLoader snapshotLoader(datasetReader.get(), &cam, snapshotDir,
+                                settings);
+  snapshotLoader.load(keyFrames);
+  MapLocalizer localizer(snapshotLoader, settings);
+  ASSERT_EQ(localizer.keyFrameNum(), keyFrames.size());
+
+  double mapLength = (keyFrames.begin()->second.thisToWorld.translation() -
+                      keyFrames.rbegin()->second.thisToWorld.translation())
+                         .norm();
+  // the images of the keyframes themselves are found at their poses
+  for (const auto &[num, kf] : keyFrames) {
+    std::optional<SE3> worldToFrame =
+        localizer.localize({datasetReader->getFrameGray(num), {}, num});
+    ASSERT_TRUE(worldToFrame);
+    SE3 diff = *worldToFrame * kf.thisToWorld;
+    EXPECT_LT(diff.translation().norm(), maxTransErr * mapLength);
+    EXPECT_LT((180 / M_PI) * diff.so3().log().norm(), maxRotErr);
+  }
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   gflags::ParseCommandLineFlags(&argc, &argv, true);
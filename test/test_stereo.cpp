@@ -1,5 +1,6 @@
 #include "system/CameraModel.h"
 #include "system/StereoGeometryEstimator.h"
+#include "util/flags.h"
 #include <gtest/gtest.h>
 #include <memory>
 #include <random>
@@ -222,6 +223,50 @@ TEST_F(StereoPositioningTest, RandomPointsPrecise) {
   }
 }
 
+TEST_F(StereoPositioningTest, CoarseIndependentOfThreads) {
+  const int npoints = 200, noutliers = 100;
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> xydistr(-10, 10);
+  std::uniform_real_distribution<double> zdistr(20, 30);
+  std::uniform_int_distribution<> camx(0, cam->getWidth() - 1);
+  std::uniform_int_distribution<> camy(0, cam->getHeight() - 1);
+
+  SE3 mot(SO3::rotY(0.1), Vec3(3, 0, 10));
+  StdVector<std::pair<Vec2, Vec2>> imgCorresps;
+  for (int i = 0; i < npoints; ++i) {
+    Vec3 p(xydistr(mt), xydistr(mt), zdistr(mt));
+    Vec3 mp = mot * p;
+    imgCorresps.push_back({cam->map(p.data()), cam->map(mp.data())});
+  }
+  for (int i = 0; i < noutliers; ++i)
+    imgCorresps.push_back({Vec2(double(camx(mt)), double(camy(mt))),
+                           Vec2(double(camx(mt)), double(camy(mt)))});
+  std::shuffle(imgCorresps.begin(), imgCorresps.end(), mt);
+
+  Settings::StereoMatcher::StereoGeometryEstimator settings;
+  settings.deterministic = true;
+  Settings::Threading oneThread, fourThreads;
+  oneThread.numThreads = 1;
+  fourThreads.numThreads = 4;
+
+  StereoGeometryEstimator single(cam.get(), imgCorresps, settings, oneThread);
+  StereoGeometryEstimator multi(cam.get(), imgCorresps, settings, fourThreads);
+  SE3 singleMotion = single.findCoarseMotion();
+  SE3 multiMotion = multi.findCoarseMotion();
+  EXPECT_EQ(singleMotion.matrix(), multiMotion.matrix());
+  EXPECT_EQ(single.inliersInds(), multi.inliersInds());
+
+  settings.preemptiveBlockSize = 20;
+  StereoGeometryEstimator preemptive(cam.get(), imgCorresps, settings,
+                                     fourThreads);
+  SE3 result = preemptive.findCoarseMotion();
+  double transErrAngle = std::acos(
+      mot.translation().normalized().dot(result.translation().normalized()));
+  double relRotAngle = (mot.so3().inverse() * result.so3()).log().norm();
+  EXPECT_LT(transErrAngle, 5 * (M_PI / 180.0));
+  EXPECT_LT(relRotAngle, 5 * (M_PI / 180.0));
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   //::testing::GTEST_FLAG(filter) = "StereoPositioningTest.RandomPointsPrecise";
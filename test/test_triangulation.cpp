@@ -1,7 +1,11 @@
+#include "output/DepthMapWriter.h"
+#include "util/SphericalTerrain.h"
+#include "util/Terrain.h"
 #include "util/Triangulation.h"
 #include "util/defs.h"
 #include "util/geometry.h"
 #include <gtest/gtest.h>
+#include <random>
 #include <set>
 
 using namespace fishdso;
@@ -12,38 +16,52 @@ class TriangulationTest
 TEST_P(TriangulationTest, IsConsistent) {
   const Triangulation &tester = *GetParam();
 
-  std::set<Triangulation::Edge *> edges;
-  std::set<Triangulation::Triangle *> triangles;
-
-  for (auto p : tester) {
-    for (auto e : p->edges)
-      edges.insert(e);
-    for (auto t : p->triangles)
-      triangles.insert(t);
-  }
+  for (int t = 0; t < tester.triangleNum(); ++t)
+    for (int i = 0; i < 3; ++i) {
+      int from = tester.corner(t, (i + 1) % 3);
+      int to = tester.corner(t, (i + 2) % 3);
+      int n = tester.neighbour(t, i);
+      if (n == Triangulation::NO_TRIANGLE) {
+        // only the outer sides of the bounding triangle have no neighbours
+        EXPECT_TRUE(from < 0 && to < 0);
+        continue;
+      }
 
-  for (auto e : edges)
-    for (auto p : e->vert)
-      EXPECT_NE(p->edges.find(e), p->edges.end());
+      int j = 0;
+      while (j < 3 && tester.neighbour(n, j) != t)
+        ++j;
+      ASSERT_LT(j, 3);
+      EXPECT_EQ(tester.corner(n, (j + 1) % 3), to);
+      EXPECT_EQ(tester.corner(n, (j + 2) % 3), from);
+    }
+}
 
-  for (auto t : triangles)
-    for (auto p : t->vert)
-      EXPECT_NE(p->triangles.find(t), p->triangles.end());
+TEST_P(TriangulationTest, LocatesPoints) {
+  Triangulation tester = *GetParam();
 
-  for (auto t : triangles)
-    for (auto e : t->edges)
-      EXPECT_NE(std::find(e->triang, e->triang + 2, t), (e->triang + 2));
+  for (int i = 0; i + 1 < tester.pointNum(); ++i) {
+    Vec2 p = 0.5 * (tester.point(i) + tester.point(i + 1));
+    int t = tester.enclosingTriangle(p);
+    ASSERT_NE(t, Triangulation::NO_TRIANGLE);
+    if (tester.isIncidentToBoundary(t))
+      continue;
+    EXPECT_TRUE(isInsideTriangle(tester.point(tester.corner(t, 0)),
+                                 tester.point(tester.corner(t, 1)),
+                                 tester.point(tester.corner(t, 2)), p));
+  }
 }
 
 TEST_P(TriangulationTest, IsPlanar) {
   const Triangulation &tester = *GetParam();
 
-  for (auto e1 : tester.edges())
-    for (auto e2 : tester.edges()) {
+  auto edges = tester.edges();
+  for (auto e1 : edges)
+    for (auto e2 : edges) {
       if (e1 == e2)
         continue;
-      bool test = doesABIntersectCD(e1->vert[0]->pos, e1->vert[1]->pos,
-                                    e2->vert[0]->pos, e2->vert[1]->pos, 1e-6);
+      const Vec2 &a1 = tester.point(e1.first), &b1 = tester.point(e1.second);
+      const Vec2 &a2 = tester.point(e2.first), &b2 = tester.point(e2.second);
+      bool test = doesABIntersectCD(a1, b1, a2, b2, 1e-6);
       if (test) {
         cv::Mat img = tester.draw(800, 800, CV_WHITE, CV_BLACK);
         cv::imshow("failed tri", img);
@@ -51,11 +69,11 @@ TEST_P(TriangulationTest, IsPlanar) {
       }
 
       ASSERT_FALSE(test) << "these do intersect:\n"
-                         << "a = " << e1->vert[0]->pos.transpose()
-                         << " b = " << e1->vert[1]->pos.transpose() << "\n"
+                         << "a = " << a1.transpose()
+                         << " b = " << b1.transpose() << "\n"
                          << "and\n"
-                         << "a = " << e2->vert[0]->pos.transpose()
-                         << " b = " << e2->vert[1]->pos.transpose() << "\n";
+                         << "a = " << a2.transpose()
+                         << " b = " << b2.transpose() << "\n";
     }
 }
 
@@ -113,9 +131,24 @@ std::shared_ptr<Triangulation> getNonGeneralTriang() {
   return std::shared_ptr<Triangulation>(new Triangulation(pnt));
 }
 
+std::shared_ptr<Triangulation> getIncrementalTriang() {
+  const int pntCount = 1000;
+  std::shared_ptr<Triangulation> triang(
+      new Triangulation(Vec2(0, 0), Vec2(10, 10)));
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> d(0, 10);
+
+  for (int i = 0; i < pntCount; ++i)
+    triang->addPoint(Vec2(d(mt), d(mt)));
+
+  return triang;
+}
+
 INSTANTIATE_TEST_CASE_P(Instantiation, TriangulationTest,
                         ::testing::Values(getSimpleTriang(), getRandomTriang(),
-                                          getNonGeneralTriang()));
+                                          getNonGeneralTriang(),
+                                          getIncrementalTriang()));
 
 TEST(TriangulationTest, IndicesConsistent) {
   const int pntCount = 200;
@@ -128,10 +161,175 @@ TEST(TriangulationTest, IndicesConsistent) {
 
   Triangulation tester(points);
 
-  for (int i = 0; i < int(points.size()); ++i) {
-    auto p = tester[i];
-    EXPECT_TRUE(points[i].isApprox(p->pos));
+  for (int i = 0; i < int(points.size()); ++i)
+    EXPECT_TRUE(points[i].isApprox(tester.point(tester.vertexOf(i))));
+}
+
+CameraModel fisheyeCamera() {
+  VecX unmapPolyCoeffs(5, 1);
+  unmapPolyCoeffs << 1.14169, -0.203229, -0.362134, 0.351011, -0.147191;
+  return CameraModel(1920, 1208, 604.0, Vec2(1.58492, 1.07424),
+                     unmapPolyCoeffs);
+}
+
+// Depths of a plane are interpolated exactly, so the dense fill can be
+// compared with the plane itself, and its coverage with the queries.
+TEST(TerrainTest, DenseDepthsMatchQueries) {
+  CameraModel cam = fisheyeCamera();
+  auto planeDepth = [](const Vec2 &p) { return 3 + 0.002 * p[0] + p[1] / 300; };
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> x(0, cam.getWidth());
+  std::uniform_real_distribution<double> y(0, cam.getHeight());
+  StdVector<Vec2> points;
+  std::vector<double> depths;
+  for (int i = 0; i < 300; ++i) {
+    points.push_back(Vec2(x(mt), y(mt)));
+    depths.push_back(planeDepth(points.back()));
+  }
+
+  Terrain terrain(&cam, points, depths);
+  cv::Mat1d dense = terrain.denseDepths(cam.getWidth(), cam.getHeight());
+  int queried = 0, missed = 0;
+  for (int py = 0; py < cam.getHeight(); py += 7)
+    for (int px = 0; px < cam.getWidth(); px += 7) {
+      Vec2 p(px, py);
+      double depth;
+      if (terrain(p, depth)) {
+        ++queried;
+        if (dense(py, px) == 0)
+          ++missed;
+      }
+      if (dense(py, px) > 0)
+        EXPECT_NEAR(dense(py, px), planeDepth(p), 1e-6);
+    }
+  EXPECT_GT(queried, 0);
+  EXPECT_LT(missed, 0.01 * queried);
+}
+
+// A plane of depths with a plane of uncertainties over it is written and
+// read back, in both precisions, with tiles cut by the image borders.
+TEST(TerrainTest, DepthMapWriterRoundTrip) {
+  CameraModel cam = fisheyeCamera();
+  auto planeDepth = [](const Vec2 &p) { return 3 + 0.002 * p[0] + p[1] / 300; };
+  auto planeStddev = [](const Vec2 &p) { return 0.5 + p[0] / 1000; };
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> x(0, cam.getWidth());
+  std::uniform_real_distribution<double> y(0, cam.getHeight());
+  StdVector<Vec2> points;
+  std::vector<double> depths, stddevs;
+  for (int i = 0; i < 300; ++i) {
+    points.push_back(Vec2(x(mt), y(mt)));
+    depths.push_back(planeDepth(points.back()));
+    stddevs.push_back(planeStddev(points.back()));
+  }
+  Terrain terrain(&cam, points, depths);
+  const int width = cam.getWidth(), height = cam.getHeight();
+  cv::Mat1d expectedDepth = terrain.denseDepths(width, height);
+  cv::Mat1d expectedStddev = terrain.denseValues(stddevs, width, height);
+  std::vector<double> confidences;
+  for (double stddev : stddevs)
+    confidences.push_back(1 / (1 + stddev));
+  cv::Mat1d expectedConfidence =
+      terrain.denseValues(confidences, width, height);
+  for (int py = 0; py < height; py += 7)
+    for (int px = 0; px < width; px += 7)
+      if (expectedDepth(py, px) > 0)
+        EXPECT_NEAR(expectedStddev(py, px), planeStddev(Vec2(px, py)), 1e-6);
+
+  SE3 frameToWorld(SO3::exp(Vec3(0.1, -0.2, 0.3)), Vec3(1, 2, 3));
+  for (auto precision : {DepthMapWriter::FLOAT32, DepthMapWriter::FLOAT16}) {
+    std::string fname;
+    {
+      DepthMapWriter writer(&cam, "tst_depth", precision, 100);
+      writer.addDepthMap(7, frameToWorld, points, depths, stddevs);
+      fname = writer.fileName(7);
+    }
+    DepthMapWriter::DepthMap depthMap = DepthMapWriter::read(fname);
+    EXPECT_EQ(depthMap.frameNum, 7);
+    EXPECT_LT((depthMap.frameToWorld.matrix() - frameToWorld.matrix())
+                  .cwiseAbs()
+                  .maxCoeff(),
+              1e-12);
+    ASSERT_EQ(depthMap.depth.rows, height);
+    ASSERT_EQ(depthMap.depth.cols, width);
+    // float16 keeps 11 significant bits
+    double tolerance = precision == DepthMapWriter::FLOAT32 ? 1e-5 : 1e-3;
+    for (int py = 0; py < height; ++py)
+      for (int px = 0; px < width; ++px) {
+        double depth = expectedDepth(py, px);
+        ASSERT_NEAR(depthMap.depth(py, px), depth, tolerance * depth);
+        ASSERT_NEAR(depthMap.confidence(py, px), expectedConfidence(py, px),
+                    tolerance);
+      }
+  }
+}
+
+TEST(TerrainTest, SphericalDenseDepthsMatchQueries) {
+  CameraModel cam = fisheyeCamera();
+  // the plane z = 5 in front of the camera
+  auto planeDepth = [](const Vec3 &ray) { return 5 * ray.norm() / ray[2]; };
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> x(0, cam.getWidth());
+  std::uniform_real_distribution<double> y(0, cam.getHeight());
+  std::vector<Vec3> depthedRays;
+  while (depthedRays.size() < 300) {
+    Vec2 p(x(mt), y(mt));
+    Vec3 ray = cam.unmap(p.data());
+    if (ray[2] > 0.3 * ray.norm())
+      depthedRays.push_back(ray * 5 / ray[2]);
+  }
+
+  SphericalTerrain terrain(depthedRays);
+  cv::Mat1d dense = terrain.denseDepths(&cam);
+  int queried = 0, missed = 0;
+  for (int py = 0; py < cam.getHeight(); py += 13)
+    for (int px = 0; px < cam.getWidth(); px += 13) {
+      Vec3 ray = cam.unmap(Vec2(px, py).data());
+      double depth;
+      if (terrain(ray, depth)) {
+        ++queried;
+        if (dense(py, px) == 0)
+          ++missed;
+      }
+      if (dense(py, px) > 0)
+        EXPECT_NEAR(dense(py, px), planeDepth(ray), 1e-6);
+    }
+  EXPECT_GT(queried, 0);
+  EXPECT_LT(missed, 0.01 * queried);
+}
+
+// The cube map only narrows the search, so every ray has to end up in the
+// same sector as when all of them are checked.
+TEST(TerrainTest, SectorLookupMatchesExhaustive) {
+  CameraModel cam = fisheyeCamera();
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> x(0, cam.getWidth());
+  std::uniform_real_distribution<double> y(0, cam.getHeight());
+  std::vector<Vec3> rays;
+  for (int i = 0; i < 500; ++i)
+    rays.push_back(cam.unmap(Vec2(x(mt), y(mt)).data()));
+
+  SphericalTriangulation triang(rays);
+  int found = 0;
+  for (int i = 0; i < 2000; ++i) {
+    Vec3 ray = cam.unmap(Vec2(x(mt), y(mt)).data());
+    SphericalTriangulation::TrihedralSector *sec = triang.enclosingSector(ray);
+    std::vector<const SphericalTriangulation::TrihedralSector *> containing;
+    for (const auto &candidate : triang.sectors())
+      if (isInSector(ray, const_cast<Vec3 **>(candidate.rays)))
+        containing.push_back(&candidate);
+    if (sec == nullptr) {
+      EXPECT_TRUE(containing.empty());
+      continue;
+    }
+    ++found;
+    ASSERT_EQ(int(containing.size()), 1);
+    EXPECT_EQ(containing[0], sec);
   }
+  EXPECT_GT(found, 1000);
 }
 
 int main(int argc, char **argv) {
@@ -1,11 +1,49 @@
+#include "CudaTracking.h"
+#include "PreKeyFrameInternals.h"
+#include "output/MapTileWriter.h"
+#include "output/TrajectoryEvaluator.h"
+#include "system/FrameBufferPool.h"
+#include "system/FrameQueue.h"
+#include "system/GlobalBundleAdjuster.h"
+#include "system/ImmaturePoint.h"
+#include "system/ImmaturePointBlock.h"
+#include "system/KeyFrameDatabase.h"
+#include "system/KeyFramePolicy.h"
+#include "system/KeyFrameWindow.h"
+#include "system/MarginalizationPolicy.h"
+#include "system/PhotometricCalibration.h"
+#include "system/PointBudgetController.h"
+#include "system/PreKeyFrame.h"
+#include "util/BicubicTiles.h"
 #include "util/DepthedImagePyramid.h"
+#include "util/DistanceMap.h"
+#include "util/ImagePyramid.h"
+#include "util/ImageSampler.h"
+#include "util/Log.h"
+#include "util/MemoryAccounting.h"
+#include "util/PixelSelector.h"
+#include "util/Placement.h"
 #include "util/PlyHolder.h"
+#include "util/PoseHistory.h"
+#include "util/Profiler.h"
+#include "util/Random.h"
+#include "util/RecordStream.h"
+#include "util/Scheduler.h"
 #include "util/defs.h"
+#include "util/flags.h"
 #include "util/settings.h"
 #include "util/util.h"
+#include <atomic>
+#include <ceres/cubic_interpolation.h>
 #include <cstdio>
+#include <cstring>
 #include <gtest/gtest.h>
+#include <numeric>
 #include <opencv2/opencv.hpp>
+#include <random>
+#include <set>
+#include <tbb/parallel_for.h>
+#include <thread>
 
 using namespace fishdso;
 
@@ -34,17 +72,68 @@ TEST(UtilTest, DepthedImagePyramid) {
   DepthedImagePyramid tst(base, Settings::Pyramid::default_levelNum, pnts, dps,
                           ws);
 
-  for (int i = 0; i < pnts.size(); ++i) {
-    for (int pl = 0; pl < Settings::Pyramid::default_levelNum; ++pl) {
+  for (int pl = 0; pl < Settings::Pyramid::default_levelNum; ++pl) {
+    const DepthedImagePyramid::DepthedPoints &level = tst.points[pl];
+    std::set<std::pair<int, int>> depthed;
+    for (int j = 0; j < level.size(); ++j)
+      if (level.depth[j] > 0)
+        depthed.insert({int(level.x[j]), int(level.y[j])});
+
+    for (int i = 0; i < pnts.size(); ++i) {
       cv::Point p = toCvPoint(pnts[i]);
-      ASSERT_GT(tst.depths[pl](p / (1 << pl)), 0)
-          << "pl=" << pl << " p=" << p << " psh=" << p / (1 << pl) << " i=" << i
+      cv::Point psh(p.x >> pl, p.y >> pl);
+      ASSERT_TRUE(depthed.count({psh.x, psh.y}))
+          << "pl=" << pl << " p=" << p << " psh=" << psh << " i=" << i
           << " d=" << dps[i] << " w=" << ws[i] << " porig=" << pnts[i]
           << std::endl;
     }
   }
 }
 
+TEST(UtilTest, DepthedImagePyramidUpdate) {
+  const int w = 640, h = 480, cnt = 1000;
+  const int levelNum = Settings::Pyramid::default_levelNum;
+
+  std::mt19937 mt;
+  std::uniform_real_distribution<double> x(0, w - 1), y(0, h - 1);
+  std::uniform_real_distribution<double> ddis(10.0, 20.0);
+  std::uniform_real_distribution<double> wdis(1.0, 2.0);
+  std::vector<double> xs, ys, dps, ws;
+  for (int i = 0; i < cnt; ++i) {
+    xs.push_back(x(mt));
+    ys.push_back(y(mt));
+    dps.push_back(ddis(mt));
+    ws.push_back(wdis(mt));
+  }
+
+  cv::Mat1b base(h, w, CV_BLACK_BYTE);
+  ImagePyramid images(base, levelNum);
+  DepthedImagePyramid updated(images, levelNum, xs, ys, dps, ws);
+  EXPECT_EQ(updated[levelNum - 1].data, images[levelNum - 1].data);
+
+  for (int i = 0; i < cnt; ++i) {
+    dps[i] *= 1.1;
+    ws[i] = wdis(mt);
+  }
+  ASSERT_TRUE(updated.updateDepths(xs, ys, dps, ws));
+  DepthedImagePyramid rebuilt(base, levelNum, xs, ys, dps, ws);
+  for (int pl = 0; pl < levelNum; ++pl) {
+    ASSERT_EQ(updated.points[pl].size(), rebuilt.points[pl].size());
+    for (int j = 0; j < rebuilt.points[pl].size(); ++j) {
+      EXPECT_EQ(updated.points[pl].x[j], rebuilt.points[pl].x[j]);
+      EXPECT_EQ(updated.points[pl].y[j], rebuilt.points[pl].y[j]);
+      EXPECT_NEAR(updated.points[pl].depth[j], rebuilt.points[pl].depth[j],
+                  1e-4);
+      EXPECT_NEAR(updated.points[pl].weight[j], rebuilt.points[pl].weight[j],
+                  1e-4);
+    }
+  }
+
+  // a point moved to another pixel needs a new pyramid
+  xs[0] = xs[0] < w / 2 ? xs[0] + 3 : xs[0] - 3;
+  EXPECT_FALSE(updated.updateDepths(xs, ys, dps, ws));
+}
+
 TEST(UtilTest, PlyHolderTriv) {
   const int pntCount = 5;
   const std::string fname = "tst.ply";
@@ -128,6 +217,1318 @@ end_header
   remove("tst.ply");
 }
 
+TEST(UtilTest, PlyHolderBinaryChunked) {
+  const int pntCount = 7, chunkSize = 3;
+  const std::string header = R"__(ply
+format binary_little_endian 1.0
+element vertex )__";
+  const std::string headerEnd = R"__(
+property float x
+property float y
+property float z
+property uchar red
+property uchar green
+property uchar blue
+end_header
+)__";
+
+  std::vector<Vec3> points;
+  std::vector<cv::Vec3b> colors;
+  for (int i = 0; i < pntCount; ++i) {
+    points.push_back(Vec3(i, i + 0.5, -i));
+    colors.push_back(cv::Vec3b(i, 2 * i, 3 * i));
+  }
+
+  {
+    PlyHolder tester("tst.ply", PlyHolder::BINARY, chunkSize);
+    tester.putPoints(points, colors);
+  }
+
+  for (int chunk = 0; chunk * chunkSize < pntCount; ++chunk) {
+    const std::string fname = "tst_" + std::to_string(chunk) + ".ply";
+    int cnt = std::min(chunkSize, pntCount - chunk * chunkSize);
+    std::string countStr = std::to_string(cnt);
+    countStr += std::string(19 - countStr.size(), ' ');
+
+    std::ifstream resFs(fname, std::ios_base::binary);
+    std::stringstream ss;
+    ss << resFs.rdbuf();
+    std::string res = ss.str();
+    std::string expectedHeader = header + countStr + headerEnd;
+    ASSERT_EQ(res.size(), expectedHeader.size() + cnt * 15) << fname;
+    EXPECT_EQ(res.substr(0, expectedHeader.size()), expectedHeader);
+
+    const char *data = res.data() + expectedHeader.size();
+    for (int j = 0; j < cnt; ++j) {
+      int i = chunk * chunkSize + j;
+      float coords[3];
+      std::memcpy(coords, data + 15 * j, sizeof(coords));
+      const unsigned char *rgb =
+          reinterpret_cast<const unsigned char *>(data + 15 * j + 12);
+      for (int k = 0; k < 3; ++k)
+        EXPECT_EQ(coords[k], float(points[i][k])) << "i=" << i;
+      EXPECT_EQ(rgb[0], colors[i][2]);
+      EXPECT_EQ(rgb[1], colors[i][1]);
+      EXPECT_EQ(rgb[2], colors[i][0]);
+    }
+    remove(fname.c_str());
+  }
+}
+
+TEST(UtilTest, RecordStreamRoundTrip) {
+  const std::string fname = "tst_records.bin";
+  SE3 motion(SO3::exp(Vec3(0.1, -0.2, 0.3)), Vec3(1, 2, 3));
+  std::vector<Vec3> points = {Vec3(1, 2, 3), Vec3(-4, 5.5, 6)};
+  std::vector<cv::Vec3b> colors = {cv::Vec3b(1, 2, 3), cv::Vec3b(4, 5, 6)};
+  for (auto precision : {RecordStream::FLOAT, RecordStream::DOUBLE}) {
+    {
+      RecordStream records(fname, precision);
+      records.putPose(7, 0.25, motion);
+      records.putPoints(5, points, colors);
+      records.putPose(8, 0.5, motion.inverse());
+    }
+    // the last record is cut off
+    std::ifstream ifs(fname, std::ios_base::binary);
+    std::string contents((std::istreambuf_iterator<char>(ifs)),
+                         std::istreambuf_iterator<char>());
+    ifs.close();
+    std::ofstream(fname, std::ios_base::binary)
+        .write(contents.data(), contents.size() - 1);
+
+    const double eps = precision == RecordStream::FLOAT ? 1e-6 : 1e-12;
+    RecordReader reader(fname);
+    RecordReader::Record record;
+    ASSERT_TRUE(reader.next(record));
+    EXPECT_EQ(record.type, RecordStream::POSE);
+    EXPECT_EQ(record.frameNum, 7);
+    EXPECT_EQ(record.timestamp, 0.25);
+    EXPECT_LT((record.worldToFrame.log() - motion.log()).norm(), eps);
+    ASSERT_TRUE(reader.next(record));
+    EXPECT_EQ(record.type, RecordStream::POINTS);
+    EXPECT_EQ(record.keyFrameNum, 5);
+    ASSERT_EQ(record.points.size(), points.size());
+    for (int i = 0; i < points.size(); ++i) {
+      EXPECT_EQ(record.points[i], points[i]);
+      EXPECT_EQ(record.colors[i], colors[i]);
+    }
+    EXPECT_FALSE(reader.next(record));
+  }
+  remove(fname.c_str());
+}
+
+TEST(UtilTest, MapTileWriter) {
+  const std::string dir = "tst_map";
+  {
+    // unit voxels, tiles of 4 voxels along a side, 3 levels, 4 voxels held
+    MapTileWriter writer(nullptr, dir, 1, 4, 3, 4, 1, PlyHolder::ASCII);
+    writer.addPoints({Vec3(0.2, 0.2, 0.2), Vec3(0.6, 0.4, 0.8),
+                      Vec3(1.5, 0.5, 0.5), Vec3(-0.5, 0.5, 0.5)},
+                     {cv::Vec3b(10, 20, 30), cv::Vec3b(20, 40, 50),
+                      cv::Vec3b(0, 0, 0), cv::Vec3b(0, 0, 0)});
+    EXPECT_EQ(writer.heldVoxelCount(), 3);
+    // six voxels evict the first tiles down to three
+    writer.addPoints({Vec3(4.5, 0.5, 0.5), Vec3(6.5, 0.5, 0.5),
+                      Vec3(7.5, 0.5, 0.5)},
+                     std::vector<cv::Vec3b>(3, cv::Vec3b(0, 0, 0)));
+    EXPECT_EQ(writer.heldVoxelCount(), 3);
+    // the evicted tile is restored and averaged further
+    writer.addPoints({Vec3(0.1, 0.1, 0.1)}, {cv::Vec3b(15, 30, 40)});
+    writer.flush();
+  }
+
+  std::ifstream indexFs(dir + "/tiles.txt");
+  std::stringstream index;
+  index << indexFs.rdbuf();
+  EXPECT_EQ(index.str(), "1 4 3\n"
+                         "-1 0 0 1 1 1\n"
+                         "0 0 0 2 1 1\n"
+                         "1 0 0 3 2 1\n");
+
+  std::ifstream tileFs(dir + "/0/0_0_0.ply");
+  std::string line;
+  while (std::getline(tileFs, line) && line != "end_header")
+    ;
+  bool foundAverage = false;
+  Vec3 p;
+  int r, g, b;
+  while (tileFs >> p[0] >> p[1] >> p[2] >> r >> g >> b) {
+    if (p[0] >= 1)
+      continue;
+    foundAverage = true;
+    EXPECT_LT((p - Vec3(0.3, 0.7 / 3, 1.1 / 3)).norm(), 1e-5);
+    EXPECT_EQ(b, 15);
+    EXPECT_EQ(g, 30);
+    EXPECT_EQ(r, 40);
+  }
+  EXPECT_TRUE(foundAverage);
+  fs::remove_all(dir);
+}
+
+TEST(UtilTest, ImageSamplerMatchesCeres) {
+  const int w = 37, h = 23, cnt = 10000;
+  const double eps = 1e-2;
+
+  std::mt19937 mt;
+  cv::Mat1b img(h, w);
+  std::uniform_int_distribution<int> intensity(0, 255);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      img(y, x) = intensity(mt);
+
+  ceres::Grid2D<unsigned char> grid(img.data, 0, h, 0, w);
+  ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char>> interpolator(grid);
+
+  std::uniform_real_distribution<double> ydis(-5.0, h + 5.0),
+      xdis(-5.0, w + 5.0);
+  std::vector<double> ys(cnt), xs(cnt), f(cnt), dfdy(cnt), dfdx(cnt);
+  for (int i = 0; i < cnt; ++i) {
+    ys[i] = ydis(mt);
+    xs[i] = xdis(mt);
+  }
+
+  for (auto layout : {ImageSampler::ROW_MAJOR, ImageSampler::TILED}) {
+    ImageSampler sampler(img, layout);
+    sampler.evaluateBatch(cnt, ys.data(), xs.data(), f.data(), dfdy.data(),
+                          dfdx.data());
+
+    for (int i = 0; i < cnt; ++i) {
+      double expF, expDfdy, expDfdx;
+      interpolator.Evaluate(ys[i], xs[i], &expF, &expDfdy, &expDfdx);
+      double sf, sdfdy, sdfdx;
+      sampler.evaluate(ys[i], xs[i], &sf, &sdfdy, &sdfdx);
+
+      ASSERT_NEAR(f[i], expF, eps) << "y=" << ys[i] << " x=" << xs[i];
+      ASSERT_NEAR(dfdy[i], expDfdy, eps) << "y=" << ys[i] << " x=" << xs[i];
+      ASSERT_NEAR(dfdx[i], expDfdx, eps) << "y=" << ys[i] << " x=" << xs[i];
+      ASSERT_NEAR(sf, expF, eps) << "y=" << ys[i] << " x=" << xs[i];
+      ASSERT_NEAR(sdfdy, expDfdy, eps) << "y=" << ys[i] << " x=" << xs[i];
+      ASSERT_NEAR(sdfdx, expDfdx, eps) << "y=" << ys[i] << " x=" << xs[i];
+    }
+  }
+}
+
+TEST(UtilTest, BicubicTilesMatchCeres) {
+  const int w = 37, h = 23, cnt = 10000;
+  const double eps = 1e-2;
+
+  std::mt19937 mt;
+  cv::Mat1b img(h, w);
+  std::uniform_int_distribution<int> intensity(0, 255);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      img(y, x) = intensity(mt);
+
+  ceres::Grid2D<unsigned char> grid(img.data, 0, h, 0, w);
+  ceres::BiCubicInterpolator<ceres::Grid2D<unsigned char>> interpolator(grid);
+  BicubicTiles tiles(img);
+  EXPECT_EQ(tiles.materializedTiles(), 0);
+
+  std::uniform_real_distribution<double> ydis(-5.0, h + 5.0),
+      xdis(-5.0, w + 5.0);
+  for (int i = 0; i < cnt; ++i) {
+    double y = ydis(mt), x = xdis(mt);
+    double expF, expDfdy, expDfdx;
+    interpolator.Evaluate(y, x, &expF, &expDfdy, &expDfdx);
+    double f, dfdy, dfdx;
+    tiles.evaluate(y, x, &f, &dfdy, &dfdx);
+
+    ASSERT_NEAR(f, expF, eps) << "y=" << y << " x=" << x;
+    ASSERT_NEAR(dfdy, expDfdy, eps) << "y=" << y << " x=" << x;
+    ASSERT_NEAR(dfdx, expDfdx, eps) << "y=" << y << " x=" << x;
+  }
+
+  // cells -1 to 37 by -1 to 23, in tiles of 16
+  EXPECT_EQ(tiles.materializedTiles(), 3 * 2);
+  tiles.release();
+  EXPECT_EQ(tiles.materializedTiles(), 0);
+  double f;
+  tiles.evaluate(h / 2, w / 2, &f);
+  EXPECT_EQ(tiles.materializedTiles(), 1);
+}
+
+TEST(UtilTest, ImageSamplerFloatBatch) {
+  const int w = 37, h = 23, cnt = 1000;
+
+  std::mt19937 mt;
+  cv::Mat1b img(h, w);
+  std::uniform_int_distribution<int> intensity(0, 255);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      img(y, x) = intensity(mt);
+  ImageSampler sampler(img);
+
+  std::uniform_real_distribution<float> ydis(-5.0, h + 5.0),
+      xdis(-5.0, w + 5.0);
+  std::vector<float> ys(cnt), xs(cnt), f(cnt), dfdy(cnt), dfdx(cnt);
+  std::vector<double> ysd(cnt), xsd(cnt), fd(cnt), dfdyd(cnt), dfdxd(cnt);
+  for (int i = 0; i < cnt; ++i) {
+    ysd[i] = ys[i] = ydis(mt);
+    xsd[i] = xs[i] = xdis(mt);
+  }
+  sampler.evaluateBatch(cnt, ys.data(), xs.data(), f.data(), dfdy.data(),
+                        dfdx.data());
+  sampler.evaluateBatch(cnt, ysd.data(), xsd.data(), fd.data(), dfdyd.data(),
+                        dfdxd.data());
+
+  // the sampling is done in floats either way, so the results are the same
+  for (int i = 0; i < cnt; ++i) {
+    ASSERT_EQ(double(f[i]), fd[i]) << "y=" << ys[i] << " x=" << xs[i];
+    ASSERT_EQ(double(dfdy[i]), dfdyd[i]) << "y=" << ys[i] << " x=" << xs[i];
+    ASSERT_EQ(double(dfdx[i]), dfdxd[i]) << "y=" << ys[i] << " x=" << xs[i];
+  }
+}
+
+TEST(UtilTest, ImageSamplerCheapInterpolations) {
+  const int w = 37, h = 23, cnt = 1000;
+  const double eps = 1e-2;
+
+  std::mt19937 mt;
+  cv::Mat1b img(h, w);
+  std::uniform_int_distribution<int> intensity(0, 255);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      img(y, x) = intensity(mt);
+  auto pixel = [&](int y, int x) {
+    return double(img(std::clamp(y, 0, h - 1), std::clamp(x, 0, w - 1)));
+  };
+
+  // inside of the image, as the coordinates are clamped differently
+  std::uniform_real_distribution<double> ydis(0, h - 1), xdis(0, w - 1);
+  std::vector<double> ys(cnt), xs(cnt), f(cnt), dfdy(cnt), dfdx(cnt);
+  for (int i = 0; i < cnt; ++i) {
+    ys[i] = ydis(mt);
+    xs[i] = xdis(mt);
+  }
+
+  for (auto layout : {ImageSampler::ROW_MAJOR, ImageSampler::TILED}) {
+    ImageSampler sampler(img, layout);
+
+    sampler.evaluateBatch<ImageSampler::BILINEAR>(
+        cnt, ys.data(), xs.data(), f.data(), dfdy.data(), dfdx.data());
+    for (int i = 0; i < cnt; ++i) {
+      int iy = std::floor(ys[i]), ix = std::floor(xs[i]);
+      double ty = ys[i] - iy, tx = xs[i] - ix;
+      double top = (1 - tx) * pixel(iy, ix) + tx * pixel(iy, ix + 1);
+      double bottom =
+          (1 - tx) * pixel(iy + 1, ix) + tx * pixel(iy + 1, ix + 1);
+      double dx = (1 - ty) * (pixel(iy, ix + 1) - pixel(iy, ix)) +
+                  ty * (pixel(iy + 1, ix + 1) - pixel(iy + 1, ix));
+      ASSERT_NEAR(f[i], (1 - ty) * top + ty * bottom, eps)
+          << "y=" << ys[i] << " x=" << xs[i];
+      ASSERT_NEAR(dfdy[i], bottom - top, eps)
+          << "y=" << ys[i] << " x=" << xs[i];
+      ASSERT_NEAR(dfdx[i], dx, eps) << "y=" << ys[i] << " x=" << xs[i];
+    }
+
+    sampler.evaluateBatch<ImageSampler::NEAREST>(
+        cnt, ys.data(), xs.data(), f.data(), dfdy.data(), dfdx.data());
+    for (int i = 0; i < cnt; ++i) {
+      int iy = std::floor(ys[i] + 0.5), ix = std::floor(xs[i] + 0.5);
+      ASSERT_EQ(f[i], pixel(iy, ix)) << "y=" << ys[i] << " x=" << xs[i];
+      ASSERT_EQ(dfdy[i], 0.5 * (pixel(iy + 1, ix) - pixel(iy - 1, ix)))
+          << "y=" << ys[i] << " x=" << xs[i];
+      ASSERT_EQ(dfdx[i], 0.5 * (pixel(iy, ix + 1) - pixel(iy, ix - 1)))
+          << "y=" << ys[i] << " x=" << xs[i];
+    }
+  }
+}
+
+TEST(UtilTest, FusedPyramidGradients) {
+  const int w = 75, h = 43, levelNum = 4;
+  const float eps = 1e-4;
+
+  std::mt19937 mt;
+  cv::Mat1b img(h, w);
+  std::uniform_int_distribution<int> intensity(0, 255);
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+      img(y, x) = intensity(mt);
+
+  PyramidGradients gradients;
+  ImagePyramid pyr(img, levelNum, gradients);
+  ImagePyramid plainPyr(img, levelNum);
+
+  cv::Mat1b expImg = img;
+  for (int lvl = 0; lvl < levelNum; ++lvl) {
+    if (lvl > 0)
+      expImg = boxFilterPyrDown<unsigned char>(expImg);
+    ASSERT_EQ(cv::countNonZero(pyr[lvl] != expImg), 0) << "lvl=" << lvl;
+    ASSERT_EQ(cv::countNonZero(plainPyr[lvl] != expImg), 0) << "lvl=" << lvl;
+
+    cv::Mat1f expGradX, expGradY, expGradNorm;
+    grad(expImg, expGradX, expGradY, expGradNorm);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(gradients.gradX[lvl].data) % 16, 0);
+    EXPECT_LE(cv::norm(gradients.gradX[lvl], expGradX, cv::NORM_INF), eps);
+    EXPECT_LE(cv::norm(gradients.gradY[lvl], expGradY, cv::NORM_INF), eps);
+    EXPECT_LE(cv::norm(gradients.gradNorm[lvl], expGradNorm, cv::NORM_INF),
+              eps);
+  }
+}
+
+TEST(UtilTest, PoseHistory) {
+  const int chunkSize = 4, cnt = 10;
+  PoseHistory history(chunkSize);
+  for (int i = 0; i < cnt; ++i) {
+    FramePose &pose = history.append(2 * i + 1);
+    pose.worldToFrame = SE3(SO3(), Vec3(i, 0, 0));
+  }
+  ASSERT_EQ(history.size(), cnt);
+  for (int i = 0; i < cnt; ++i)
+    EXPECT_EQ(history[2 * i + 1].worldToFrame.translation()[0], i);
+  EXPECT_EQ(history.lastFrameNum(), 2 * cnt - 1);
+  EXPECT_EQ(history.lastFrameNum(5), 2 * (cnt - 6) + 1);
+
+  // only the first chunk is entirely before frame #10
+  auto flushed = history.flushBefore(10);
+  ASSERT_EQ(flushed.size(), 1);
+  ASSERT_EQ(flushed[0].size(), chunkSize);
+  EXPECT_EQ(flushed[0][0].frameNum, 1);
+  EXPECT_EQ(history[9].frameNum, 9);
+
+  // the last chunk is kept even if it is old enough
+  flushed = history.flushBefore(1000);
+  ASSERT_EQ(flushed.size(), 1);
+  EXPECT_EQ(history.lastFrameNum(1), 2 * cnt - 3);
+
+  flushed = history.flushAll();
+  ASSERT_EQ(flushed.size(), 1);
+  EXPECT_EQ(flushed[0].size(), cnt - 2 * chunkSize);
+  EXPECT_EQ(history.size(), cnt);
+}
+
+// The selection over blocks, done with cv::sum and cv::minMaxLoc.
+TEST(UtilTest, PreKeyFrameGradientsOnDemand) {
+  const int w = 131, h = 77, levelNum = 3;
+  cv::Mat1b img(h, w);
+  cv::randu(img, 0, 256);
+  PyramidGradients gradients;
+  ImagePyramid pyr(img, levelNum, gradients);
+
+  Settings::Pyramid pyrSettings;
+  pyrSettings.levelNum = levelNum;
+  PreKeyFrame preKeyFrame(nullptr, nullptr, SourceFrame{img, {}, 0},
+                          pyrSettings);
+  for (int lvl = 1; lvl < levelNum; ++lvl)
+    EXPECT_EQ(cv::norm(preKeyFrame.framePyr[lvl], pyr[lvl], cv::NORM_INF), 0);
+  cv::Mat1f gradNorm = preKeyFrame.gradNormImage();
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x) {
+      cv::Point p(x, y);
+      Vec2f grad = preKeyFrame.gradient(p);
+      ASSERT_EQ(grad[0], gradients.gradX[0](p)) << "x=" << x << " y=" << y;
+      ASSERT_EQ(grad[1], gradients.gradY[0](p)) << "x=" << x << " y=" << y;
+      ASSERT_EQ(preKeyFrame.gradNorm(p), gradients.gradNorm[0](p));
+      ASSERT_EQ(gradNorm(p), gradients.gradNorm[0](p));
+    }
+}
+
+TEST(UtilTest, PixelSelectorMatchesBlockwise) {
+  const int w = 317, h = 203, pointsNeeded = 100000;
+  // small integer values give exact sums and lots of equal maxima
+  cv::Mat1b quantized(h, w);
+  cv::randu(quantized, 0, 8);
+  cv::Mat1f gradNorm;
+  quantized.convertTo(gradNorm, CV_32F, 4.0);
+
+  PixelSelectorSettings settings;
+  settings.pixelSelector.deterministic = true;
+  settings.pixelSelector.initialAdaptiveBlockSize = 5;
+  settings.pixelSelector.initialPointsFound = pointsNeeded;
+  settings.pixelSelector.adaptToFactor = 1;
+  const std::vector<double> &thresholds = settings.pixelSelector.gradThresholds;
+
+  std::vector<cv::Point> expected;
+  for (int l = 0; l < thresholds.size(); ++l) {
+    const int bs = settings.pixelSelector.initialAdaptiveBlockSize << l;
+    std::vector<cv::Point> level;
+    for (int i = 0; i + bs < h; i += bs)
+      for (int j = 0; j + bs < w; j += bs) {
+        cv::Mat block = gradNorm(cv::Range(i, i + bs), cv::Range(j, j + bs));
+        double avg = cv::sum(block)[0] / (bs * bs);
+        double mx = 0;
+        cv::Point maxLoc;
+        cv::minMaxLoc(block, nullptr, &mx, nullptr, &maxLoc);
+        if (mx > avg + thresholds[l])
+          level.push_back(cv::Point(j, i) + maxLoc);
+      }
+    std::mt19937 mt(42);
+    std::shuffle(level.begin(), level.end(), mt);
+    expected.insert(expected.end(), level.begin(), level.end());
+  }
+  ASSERT_FALSE(expected.empty());
+
+  for (int numThreads : {1, 3, 8}) {
+    settings.threading.numThreads = numThreads;
+    PixelSelector selector(settings);
+    EXPECT_EQ(selector.select(cv::Mat(), gradNorm, pointsNeeded, nullptr),
+              expected)
+        << "with " << numThreads << " threads";
+  }
+
+  settings.threading.scheduler = std::make_shared<Scheduler>(3);
+  PixelSelector scheduled(settings);
+  EXPECT_EQ(scheduled.select(cv::Mat(), gradNorm, pointsNeeded, nullptr),
+            expected)
+      << "on a shared scheduler";
+}
+
+TEST(UtilTest, Scheduler) {
+  Settings::Threading threading;
+  threading.scheduler = std::make_shared<Scheduler>(4);
+  EXPECT_EQ(threadNum(threading), 4);
+
+  const int itemNum = 1000;
+  std::vector<int> minRow(itemNum), maxRow(itemNum);
+  std::mt19937 mt(42);
+  std::uniform_int_distribution<int> row(0, 99);
+  for (int i = 0; i < itemNum; ++i) {
+    minRow[i] = row(mt);
+    maxRow[i] = std::min(99, minRow[i] + 20);
+  }
+  // work of different priorities, submitted from different threads at once
+  std::vector<int> rowsCovered[Scheduler::priorityNum];
+  std::vector<std::thread> submitters;
+  for (int p = 0; p < Scheduler::priorityNum; ++p) {
+    rowsCovered[p].assign(itemNum, 0);
+    submitters.emplace_back([&, p]() {
+      ParallelExecutor(threading, Scheduler::Priority(p)).execute([&]() {
+        forEachInRowBands(100, minRow, maxRow, threading,
+                          [&](int i, int rowFrom, int rowTo) {
+                            rowsCovered[p][i] += rowTo - rowFrom + 1;
+                          });
+      });
+    });
+  }
+  for (std::thread &t : submitters)
+    t.join();
+  for (int p = 0; p < Scheduler::priorityNum; ++p)
+    for (int i = 0; i < itemNum; ++i)
+      ASSERT_EQ(rowsCovered[p][i], maxRow[i] - minRow[i] + 1);
+
+  std::atomic<int> enqueuedDone(0);
+  for (int i = 0; i < 100; ++i)
+    threading.scheduler->enqueue(Scheduler::OUTPUT, [&]() { ++enqueuedDone; });
+  while (enqueuedDone < 100)
+    std::this_thread::yield();
+}
+
+TEST(UtilTest, ValidSpansSkipDeadPixels) {
+  const int w = 317, h = 203, levelNum = 3, pointsNeeded = 100000;
+  // a disk in the middle of every level
+  std::vector<std::vector<Vec2i>> spans(levelNum);
+  for (int lvl = 0; lvl < levelNum; ++lvl)
+    for (int y = 0; y < (h >> lvl); ++y) {
+      int half = std::max(0, (h >> (lvl + 1)) - std::abs(y - (h >> (lvl + 1))));
+      int c = w >> (lvl + 1);
+      spans[lvl].push_back(Vec2i(c - half, c + half));
+    }
+
+  cv::Mat1b img(h, w);
+  cv::randu(img, 0, 256);
+  PyramidGradients gradients, fullGradients;
+  ImagePyramid pyr(img, levelNum, fullGradients);
+  pyr.rebuild(levelNum, gradients, &spans);
+  for (int lvl = 0; lvl < levelNum; ++lvl)
+    for (int y = 0; y < (h >> lvl); ++y)
+      for (int x = 0; x < (w >> lvl); ++x) {
+        bool isValid = x >= spans[lvl][y][0] && x < spans[lvl][y][1];
+        for (auto plane : {&PyramidGradients::gradX, &PyramidGradients::gradY,
+                           &PyramidGradients::gradNorm})
+          ASSERT_EQ((gradients.*plane)[lvl](y, x),
+                    isValid ? (fullGradients.*plane)[lvl](y, x) : 0.0f)
+              << "lvl=" << lvl << " x=" << x << " y=" << y;
+      }
+
+  // the selected points are the ones selected without the spans that fall
+  // into them
+  PixelSelectorSettings settings;
+  settings.pixelSelector.deterministic = true;
+  settings.pixelSelector.initialAdaptiveBlockSize = 5;
+  settings.pixelSelector.initialPointsFound = pointsNeeded;
+  settings.pixelSelector.adaptToFactor = 1;
+  const cv::Mat1f &gradNorm = fullGradients.gradNorm[0];
+  std::vector<cv::Point> all = PixelSelector(settings).select(
+      cv::Mat(), gradNorm, pointsNeeded, nullptr);
+  std::vector<cv::Point> valid = PixelSelector(settings).select(
+      cv::Mat(), gradNorm, pointsNeeded, nullptr, &spans[0]);
+  std::vector<cv::Point> expected;
+  for (const cv::Point &p : all)
+    if (p.x >= spans[0][p.y][0] && p.x < spans[0][p.y][1])
+      expected.push_back(p);
+  ASSERT_FALSE(expected.empty());
+  ASSERT_LT(expected.size(), all.size());
+  std::sort(expected.begin(), expected.end(), cmp);
+  std::sort(valid.begin(), valid.end(), cmp);
+  EXPECT_EQ(valid, expected);
+}
+
+TEST(UtilTest, DistanceMap) {
+  const int w = 97, h = 61;
+  std::mt19937 mt(42);
+  std::uniform_real_distribution<double> x(-5, w + 5), y(-5, h + 5);
+  StdVector<Vec2> points(12), candidates(300);
+  for (Vec2 &p : points)
+    p = Vec2(x(mt), y(mt));
+  for (Vec2 &p : candidates)
+    p = Vec2(x(mt), y(mt));
+
+  auto isOnImage = [&](const Vec2 &p) {
+    return p[0] >= 0 && p[0] < w && p[1] >= 0 && p[1] < h;
+  };
+  auto sqDistTo = [&](const StdVector<Vec2> &pts, const Vec2i &q) {
+    int best = std::numeric_limits<int>::max();
+    for (const Vec2 &p : pts)
+      if (isOnImage(p))
+        best = std::min(best, (p.cast<int>() - q).squaredNorm());
+    return best;
+  };
+
+  DistanceMap distMap(w, h, points);
+  for (int py = 0; py < h; ++py)
+    for (int px = 0; px < w; ++px)
+      ASSERT_EQ(distMap.sqDistAt(px, py), sqDistTo(points, Vec2i(px, py)))
+          << "at " << px << ' ' << py;
+
+  // every chosen point is the farthest from the points and the ones chosen
+  // before it
+  std::vector<int> chosen = distMap.choose(candidates, 40);
+  ASSERT_EQ(chosen.size(), 40);
+  StdVector<Vec2> taken = points;
+  for (int i : chosen) {
+    ASSERT_TRUE(isOnImage(candidates[i]));
+    int chosenSqDist = sqDistTo(taken, candidates[i].cast<int>());
+    for (const Vec2 &c : candidates)
+      if (isOnImage(c))
+        EXPECT_LE(sqDistTo(taken, c.cast<int>()), chosenSqDist);
+    taken.push_back(candidates[i]);
+  }
+}
+
+TEST(UtilTest, KeyFrameDatabase) {
+  const int w = 160, h = 120;
+  std::mt19937 mt(42);
+  std::uniform_int_distribution<int> intensity(0, 255), noise(-10, 10);
+  auto randomImage = [&]() {
+    cv::Mat1b img(h, w);
+    // blocks, so that the thumbnails keep the structure
+    for (int y = 0; y < h; y += 20)
+      for (int x = 0; x < w; x += 20)
+        img(cv::Rect(x, y, 20, 20)).setTo(intensity(mt));
+    return img;
+  };
+
+  Settings::KeyFrameDatabase settings;
+  settings.maxEntries = 4;
+  settings.candidateNum = 2;
+  KeyFrameDatabase database(settings);
+  std::vector<cv::Mat1b> images;
+  for (int i = 0; i < 6; ++i) {
+    images.push_back(randomImage());
+    database.add(i, SE3(), DepthedImagePyramid(images.back(), 3, {}, {}, {}));
+  }
+  EXPECT_EQ(database.size(), 4);
+
+  for (int i = 2; i < 6; ++i) {
+    cv::Mat1b noisy = images[i].clone();
+    for (uchar &v : noisy)
+      v = cv::saturate_cast<uchar>(v + noise(mt));
+    auto found = database.query(noisy);
+    ASSERT_EQ(found.size(), 2);
+    EXPECT_EQ(found[0]->globalFrameNum, i);
+    EXPECT_NE(found[1]->globalFrameNum, i);
+  }
+}
+
+TEST(UtilTest, Profiler) {
+  int timer = Profiler::registerTimer("test.timer");
+  int counter = Profiler::registerCounter("test.counter");
+  int hist = Profiler::registerHistogram("test.hist", 0, 10, 5);
+  EXPECT_EQ(Profiler::registerCounter("test.counter"), counter);
+  Profiler::collect();
+
+  Profiler::addCount(counter, 3);
+  Profiler::addTime(timer, std::chrono::milliseconds(2));
+  // the values recorded by a thread are kept after it exits
+  std::thread worker([&]() {
+    Profiler::addCount(counter, 4);
+    for (double v : {-1.0, 0.0, 1.9, 2.0, 9.9, 10.0})
+      Profiler::addToHistogram(hist, v);
+  });
+  worker.join();
+
+  FrameProfile profile = Profiler::collect();
+  for (const auto &t : profile.timers)
+    if (t.name == "test.timer") {
+      EXPECT_EQ(t.calls, 1);
+      EXPECT_NEAR(t.seconds, 2e-3, 1e-9);
+    }
+  for (const auto &c : profile.counters)
+    if (c.name == "test.counter")
+      EXPECT_EQ(c.value, 7);
+  for (const auto &h : profile.histograms)
+    if (h.name == "test.hist")
+      EXPECT_EQ(h.buckets, std::vector<long long>({1, 2, 1, 0, 0, 1, 1}));
+
+  profile = Profiler::collect();
+  for (const auto &c : profile.counters)
+    if (c.name == "test.counter")
+      EXPECT_EQ(c.value, 0);
+}
+
+#ifdef FISHDSO_PROFILING
+struct TestMemory {
+  static constexpr const char *name = "test.memory";
+};
+
+struct TestCounted : CountedObject<TestMemory, TestCounted> {
+  double data[4];
+};
+
+TEST(UtilTest, MemoryAccounting) {
+  auto testMemory = [](const FrameProfile &profile) {
+    for (const auto &memory : profile.memory)
+      if (memory.name == "test.memory")
+        return memory;
+    return FrameProfile::Memory{"", -1, -1};
+  };
+  Profiler::collect();
+
+  CountedVector<double, TestMemory> values;
+  values.reserve(8);
+  std::unique_ptr<TestCounted> counted(new TestCounted());
+  FrameProfile::Memory memory = testMemory(Profiler::collect());
+  EXPECT_EQ(memory.liveBytes, 8 * sizeof(double) + sizeof(TestCounted));
+  EXPECT_EQ(memory.allocations, 2);
+
+  // the live bytes are kept between the collections, the allocations are not
+  std::thread worker([&]() { counted.reset(); });
+  worker.join();
+  memory = testMemory(Profiler::collect());
+  EXPECT_EQ(memory.liveBytes, 8 * sizeof(double));
+  EXPECT_EQ(memory.allocations, 0);
+
+  values = CountedVector<double, TestMemory>();
+  EXPECT_EQ(testMemory(Profiler::collect()).liveBytes, 0);
+}
+#endif
+
+TEST(UtilTest, ProfilerTrace) {
+  Profiler::startTrace(2);
+  auto start = std::chrono::steady_clock::now();
+  for (const char *name : {"test.first", "test.second", "test.third"})
+    Profiler::addTraceEvent(name, start, start + std::chrono::microseconds(5));
+  // the events of an exited thread stay on the timeline
+  std::thread worker([&]() {
+    Profiler::addTraceEvent("test.worker", start,
+                            start + std::chrono::microseconds(5));
+  });
+  worker.join();
+  Profiler::stopTrace();
+  Profiler::addTraceEvent("test.stopped", start, start);
+
+  const std::string fname = "tst_trace.json";
+  Profiler::writeTrace(fname);
+  std::ifstream ifs(fname);
+  std::string trace((std::istreambuf_iterator<char>(ifs)),
+                    std::istreambuf_iterator<char>());
+  remove(fname.c_str());
+
+  // the ring of two dropped the oldest event
+  EXPECT_EQ(trace.find("test.first"), std::string::npos);
+  EXPECT_NE(trace.find("\"name\": \"test.second\", \"cat\": \"test\""),
+            std::string::npos);
+  EXPECT_NE(trace.find("test.third"), std::string::npos);
+  EXPECT_NE(trace.find("test.worker"), std::string::npos);
+  EXPECT_NE(trace.find("\"dur\": 5.000"), std::string::npos);
+  EXPECT_EQ(trace.find("test.stopped"), std::string::npos);
+}
+
+TEST(UtilTest, FrameQueue) {
+  FrameQueue queue(2);
+  std::thread producer([&]() {
+    for (int i = 0; i < 5; ++i) {
+      SourceFrame frame;
+      frame.gray = cv::Mat1b(4, 4, uchar(i));
+      frame.globalFrameNum = i;
+      queue.push(frame);
+    }
+    queue.close();
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  SourceFrame frame;
+  int expected = 0;
+  while (queue.next(frame)) {
+    EXPECT_EQ(frame.globalFrameNum, expected++);
+    EXPECT_LE(frame.arrivalTime, std::chrono::steady_clock::now());
+    EXPECT_GE(frame.arrivalTime, start);
+    EXPECT_LE(queue.size(), 2);
+  }
+  EXPECT_EQ(expected, 5);
+  producer.join();
+}
+
+TEST(UtilTest, FrameQueueTryPush) {
+  FrameQueue queue(2);
+  for (int i = 0; i < 3; ++i) {
+    SourceFrame frame;
+    frame.globalFrameNum = i;
+    EXPECT_EQ(queue.tryPush(frame), i < 2);
+  }
+  EXPECT_EQ(queue.size(), 2);
+  queue.close();
+
+  SourceFrame frame;
+  int expected = 0;
+  while (queue.next(frame))
+    EXPECT_EQ(frame.globalFrameNum, expected++);
+  EXPECT_EQ(expected, 2);
+}
+
+TEST(UtilTest, FrameBufferPool) {
+  const int w = 64, h = 48, levelNum = 3;
+  auto randomImage = [&]() {
+    cv::Mat1b img(h, w);
+    cv::randu(img, 0, 256);
+    return img;
+  };
+
+  FrameBufferPool pool(1);
+  FrameBuffers buffers = pool.acquire();
+  EXPECT_TRUE(buffers.framePyr.images.empty());
+  buffers.framePyr.images = {randomImage()};
+  buffers.framePyr.rebuild(levelNum);
+  std::vector<const uchar *> data;
+  for (int lvl = 1; lvl < levelNum; ++lvl)
+    data.push_back(buffers.framePyr[lvl].data);
+
+  pool.release(std::move(buffers));
+  pool.release(FrameBuffers());
+  EXPECT_EQ(pool.freeCount(), 1);
+
+  // a released pyramid is rebuilt in place
+  FrameBuffers reused = pool.acquire();
+  EXPECT_EQ(pool.freeCount(), 0);
+  ASSERT_EQ(reused.framePyr.images.size(), levelNum);
+  reused.framePyr[0] = randomImage();
+  reused.framePyr.rebuild(levelNum);
+  for (int lvl = 1; lvl < levelNum; ++lvl)
+    EXPECT_EQ(reused.framePyr[lvl].data, data[lvl - 1]) << "level " << lvl;
+
+  // a level still referenced elsewhere is reallocated, not overwritten
+  cv::Mat1b held = reused.framePyr[1];
+  cv::Mat1b heldCopy = held.clone();
+  reused.framePyr[0] = randomImage();
+  reused.framePyr.rebuild(levelNum);
+  EXPECT_NE(reused.framePyr[1].data, held.data);
+  EXPECT_EQ(cv::countNonZero(held != heldCopy), 0);
+  EXPECT_EQ(reused.framePyr[2].data, data[1]);
+}
+
+TEST(UtilTest, PreKeyFrameInternalsMaterialize) {
+  Settings::Pyramid pyrSettings;
+  pyrSettings.levelNum = 4;
+  cv::Mat1b img(96, 128);
+  cv::randu(img, 0, 256);
+  ImagePyramid pyr(img, pyrSettings.levelNum);
+
+  PreKeyFrameInternals internals(pyr, pyrSettings);
+  for (int lvl = 0; lvl < pyrSettings.levelNum; ++lvl)
+    EXPECT_FALSE(internals.isMaterialized(lvl)) << "level " << lvl;
+
+  // sampling a level materializes just that one
+  for (int lvl = pyrSettings.levelNum - 1; lvl >= 0; --lvl) {
+    internals.reset(pyr);
+    const ImageSampler &sampler = internals.sampler(lvl);
+    EXPECT_EQ(sampler.getWidth(), pyr[lvl].cols);
+    EXPECT_EQ(sampler.getHeight(), pyr[lvl].rows);
+    for (int other = 0; other < pyrSettings.levelNum; ++other)
+      EXPECT_EQ(internals.isMaterialized(other), other == lvl)
+          << "sampled level " << lvl << ", level " << other;
+  }
+
+  for (int lvl = 0; lvl < pyrSettings.levelNum; ++lvl)
+    internals.sampler(lvl);
+  cv::Mat1b otherImg(96, 128);
+  cv::randu(otherImg, 0, 256);
+  ImagePyramid otherPyr(otherImg, pyrSettings.levelNum);
+  internals.reset(otherPyr);
+  for (int lvl = 0; lvl < pyrSettings.levelNum; ++lvl)
+    EXPECT_FALSE(internals.isMaterialized(lvl)) << "level " << lvl;
+}
+
+TEST(UtilTest, ImmaturePointBlock) {
+  for (int patternSize : {8, 9, 5}) {
+    std::unique_ptr<ImmaturePointBlockBase> block =
+        ImmaturePointBlockBase::create(patternSize);
+    block->resize(2);
+    int slot = block->add();
+    EXPECT_EQ(slot, 2);
+    EXPECT_EQ(block->size(), 3);
+    block->pattern(slot).intencities[patternSize - 1] = 7;
+
+    // the tracing reads the block of the same size directly
+    dispatchPatternSize(patternSize, [&](auto n) {
+      constexpr int N = decltype(n)::value;
+      auto *typed = dynamic_cast<ImmaturePointBlock<N> *>(block.get());
+      ASSERT_NE(typed, nullptr) << "pattern size " << patternSize;
+      EXPECT_GE(typed->capacity, patternSize);
+      EXPECT_EQ(typed->intencities[slot][patternSize - 1], 7);
+    });
+  }
+}
+
+TEST(UtilTest, PhotometricCalibration) {
+  std::vector<double> inverseResponse(256);
+  for (int v = 0; v < 256; ++v)
+    inverseResponse[v] = 2 * v * v + 1;
+  cv::Mat1b src(2, 2, uchar(100));
+
+  PhotometricCalibration response(inverseResponse, cv::Mat1f());
+  EXPECT_FALSE(response.hasVignette());
+  cv::Mat1b dst;
+  response.apply(src, dst);
+  EXPECT_EQ(cv::countNonZero(dst != 39), 0);
+
+  cv::Mat1f vignette = (cv::Mat1f(2, 2) << 0.8, 0.4, 0.2, 0);
+  PhotometricCalibration calib(inverseResponse, vignette);
+  EXPECT_TRUE(calib.hasVignette());
+  cv::Mat1b inPlace = src.clone();
+  calib.apply(inPlace, inPlace);
+  EXPECT_EQ(inPlace(0, 0), 39);
+  EXPECT_EQ(inPlace(0, 1), 78);
+  EXPECT_EQ(inPlace(1, 0), 157);
+  EXPECT_EQ(inPlace(1, 1), 0);
+  src(0, 0) = 255;
+  calib.apply(src, dst);
+  EXPECT_EQ(dst(0, 0), 255);
+}
+
+TEST(UtilTest, Placement) {
+  EXPECT_EQ(parseCoreList("0-3,8,10-11"),
+            std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_TRUE(parseCoreList("").empty());
+  EXPECT_TRUE(pinThread({}));
+
+  for (bool hugePages : {false, true}) {
+    std::vector<float, HugePageAllocator<float>> small(
+        100, 1.0f, HugePageAllocator<float>(hugePages));
+    std::vector<float, HugePageAllocator<float>> large(
+        1 << 20, 2.0f, HugePageAllocator<float>(hugePages));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(small.data()) % 16, 0);
+    if (hugePages)
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(large.data()) % (2 << 20), 0);
+    small = large;
+    EXPECT_EQ(small.size(), large.size());
+    EXPECT_EQ(small.back(), 2.0f);
+  }
+}
+
+TEST(UtilTest, PointBudgetController) {
+  Settings::PointBudget settings;
+  settings.targetFrameTime = 0.03;
+  settings.targetKeyFrameTime = 0.2;
+  settings.minFramesBetweenChanges = 5;
+  PointBudgetController controller({2000, 2000, 10}, settings);
+
+  auto frame = [](double trackingTime, bool isKeyFrame, double baTime) {
+    FrameTimings timings;
+    timings.isKeyFrame = isKeyFrame;
+    timings.seconds[FrameTimings::TRACKING] = trackingTime;
+    timings.seconds[FrameTimings::BUNDLE_ADJUSTMENT] = baTime;
+    return timings;
+  };
+
+  // within the tolerance nothing changes
+  for (int i = 0; i < 20; ++i)
+    EXPECT_FALSE(controller.update(frame(0.031, i % 5 == 0, 0.21)));
+  EXPECT_EQ(controller.budget(), PointBudget({2000, 2000, 10}));
+
+  // too slow, the points shrink by maxStep at most, and then nothing
+  // changes for minFramesBetweenChanges frames
+  EXPECT_TRUE(controller.update(frame(0.06, true, 0.4)));
+  EXPECT_LT(controller.budget().pointsNum, 2000);
+  EXPECT_GE(controller.budget().pointsNum, 1600);
+  EXPECT_EQ(controller.budget().baIterations, 9);
+  for (int i = 0; i < 4; ++i)
+    EXPECT_FALSE(controller.update(frame(0.06, false, 0)));
+
+  // they never leave the bounds
+  for (int i = 0; i < 500; ++i)
+    controller.update(frame(0.06, i % 5 == 0, 0.4));
+  EXPECT_EQ(controller.budget(),
+            PointBudget({settings.minPointsNum, settings.minOptimizedPoints,
+                         settings.minBaIterations}));
+
+  for (int i = 0; i < 500; ++i)
+    controller.update(frame(0.001, i % 5 == 0, 0.01));
+  EXPECT_EQ(controller.budget(),
+            PointBudget({settings.maxPointsNum, settings.maxOptimizedPoints,
+                         settings.maxBaIterations}));
+}
+
+TEST(UtilTest, KeyFramePolicy) {
+  Settings::KeyFramePolicy settings;
+  KeyFramePolicy policy(600, 400, settings);
+  // standing still, with the points in view and tracking well
+  KeyFrameCues still = {0.5, 0.1, 0.95, 0.01, 1.1, 10};
+  EXPECT_LT(policy.score(still), 0.1);
+  EXPECT_FALSE(policy.needKeyFrame(still));
+  still.framesSinceKeyFrame = settings.maxFramesBetweenKeyFrames;
+  EXPECT_TRUE(policy.needKeyFrame(still));
+
+  // the translation flow alone is enough
+  KeyFrameCues moving = still;
+  moving.framesSinceKeyFrame = settings.minFramesBetweenKeyFrames;
+  moving.translationFlow = settings.maxTranslationFlow * 1000 * 1.1;
+  EXPECT_GT(policy.score(moving), 1);
+  EXPECT_TRUE(policy.needKeyFrame(moving));
+  // but not before the rate limit
+  moving.framesSinceKeyFrame = settings.minFramesBetweenKeyFrames - 1;
+  EXPECT_FALSE(policy.needKeyFrame(moving));
+
+  KeyFrameCues cue = still;
+  cue.framesSinceKeyFrame = 5;
+  EXPECT_FALSE(policy.needKeyFrame(cue));
+  cue.visibleRatio = settings.minVisibleRatio / 2;
+  EXPECT_TRUE(policy.needKeyFrame(cue));
+  cue = still;
+  cue.framesSinceKeyFrame = 5;
+  cue.rmseRatio = settings.maxRmseRatio * 1.5;
+  EXPECT_TRUE(policy.needKeyFrame(cue));
+  cue = still;
+  cue.framesSinceKeyFrame = 5;
+  cue.lightChange = settings.maxLightChange * 1.5;
+  EXPECT_TRUE(policy.needKeyFrame(cue));
+}
+
+TEST(UtilTest, MarginalizationPolicy) {
+  Settings::Marginalization settings;
+  MarginalizationPolicy policy(settings);
+  // keyframes along a line, the third one right next to the second one
+  StdVector<SE3> thisToWorld;
+  for (double x : {0.0, 1.0, 1.05, 2.0, 3.0, 4.0})
+    thisToWorld.push_back(SE3(SO3(), Vec3(x, 0, 0)));
+  std::vector<double> visibleRatios(thisToWorld.size(), 0.5);
+
+  EXPECT_TRUE(policy.choose(thisToWorld, visibleRatios, 6).empty());
+  EXPECT_EQ(policy.choose(thisToWorld, visibleRatios, 5),
+            std::vector<int>({1}));
+  EXPECT_EQ(policy.choose(thisToWorld, visibleRatios, 4),
+            std::vector<int>({1, 2}));
+
+  // not seen from the newest one, even with room in the window
+  visibleRatios[3] = settings.minVisibleRatio / 2;
+  EXPECT_EQ(policy.choose(thisToWorld, visibleRatios, 6),
+            std::vector<int>({3}));
+  // but the newest ones stay anyway
+  visibleRatios[4] = settings.minVisibleRatio / 2;
+  EXPECT_EQ(policy.choose(thisToWorld, visibleRatios, 6),
+            std::vector<int>({3}));
+  EXPECT_EQ(policy.choose(thisToWorld, visibleRatios, 2).size(), 4u);
+}
+
+TEST(UtilTest, GlobalBundleAdjusterSubmaps) {
+  EXPECT_TRUE(GlobalBundleAdjuster::submapRanges(1, 10, 3).empty());
+  EXPECT_EQ(GlobalBundleAdjuster::submapRanges(8, 10, 3),
+            (std::vector<std::pair<int, int>>{{0, 8}}));
+
+  for (int kfNum = 2; kfNum < 60; ++kfNum)
+    for (int overlap = 1; overlap < 5; ++overlap) {
+      auto ranges = GlobalBundleAdjuster::submapRanges(kfNum, 10, overlap);
+      ASSERT_FALSE(ranges.empty());
+      EXPECT_EQ(ranges.front().first, 0);
+      EXPECT_EQ(ranges.back().second, kfNum);
+      for (int s = 0; s < ranges.size(); ++s) {
+        auto [begin, end] = ranges[s];
+        EXPECT_GE(end - begin, 2);
+        EXPECT_LE(end - begin, 10);
+        // consecutive submaps share overlap keyframes
+        if (s > 0)
+          EXPECT_EQ(ranges[s - 1].second - begin, overlap);
+      }
+    }
+}
+
+TEST(UtilTest, TrajectoryEvaluator) {
+  // the estimated world is the ground truth one moved by a similarity
+  const double scale = 0.5;
+  const SE3 gtToOur(SO3::exp(Vec3(0.1, -0.3, 0.2)), Vec3(1, 2, 3));
+  StdVector<SE3> worldToFrameGT;
+  PoseHistory::Chunk chunk;
+  for (int i = 0; i < 60; ++i) {
+    SE3 frameToWorldGT(SO3::exp(Vec3(0, 0.05 * i, 0.01 * i)),
+                       Vec3(std::cos(0.1 * i), 0.02 * i, std::sin(0.1 * i)));
+    worldToFrameGT.push_back(frameToWorldGT.inverse());
+    SE3 frameToWorld = gtToOur * frameToWorldGT;
+    frameToWorld.translation() = scale * gtToOur.so3() *
+                                     frameToWorldGT.translation() +
+                                 gtToOur.translation();
+    FramePose pose;
+    pose.frameNum = i;
+    pose.isEstimated = i > 0;
+    pose.worldToFrame = frameToWorld.inverse();
+    chunk.push_back(pose);
+  }
+
+  TrajectoryEvaluator evaluator(worldToFrameGT, 5);
+  EXPECT_EQ(evaluator.summary().frameCount, 0);
+  evaluator.posesFlushed(chunk);
+  TrajectoryEvaluator::Summary summary = evaluator.summary();
+  EXPECT_EQ(summary.frameCount, 59);
+  EXPECT_EQ(summary.rpePairNum, 54);
+  EXPECT_NEAR(summary.scale, 1 / scale, 1e-6);
+  EXPECT_NEAR(summary.ateRmse, 0, 1e-6);
+  EXPECT_NEAR(summary.rpeTransRmse, 0, 1e-6);
+  EXPECT_NEAR(summary.rpeRotRmse, 0, 1e-6);
+  Vec3 center = chunk[10].worldToFrame.inverse().translation();
+  EXPECT_LT((evaluator.alignment() * center -
+             worldToFrameGT[10].inverse().translation())
+                .norm(),
+            1e-6);
+
+  // a displaced frame raises the ATE by its displacement over sqrt(n)
+  TrajectoryEvaluator displaced(worldToFrameGT, 5);
+  SE3 frameToWorld = chunk[30].worldToFrame.inverse();
+  frameToWorld.translation() += Vec3(0, scale * 0.59, 0);
+  chunk[30].worldToFrame = frameToWorld.inverse();
+  displaced.posesFlushed(chunk);
+  EXPECT_GT(displaced.summary().ateRmse, 0.05);
+  EXPECT_LT(displaced.summary().ateRmse, 0.59 / std::sqrt(59.0));
+  EXPECT_GT(displaced.summary().rpeTransRmse, 0);
+}
+
+TEST(UtilTest, RandomStream) {
+  // the known answers of Philox4x32-10 from its reference implementation
+  RandomStream zero(0, RandomStage(0), 0, 0);
+  std::array<std::uint32_t, 4> expected = {0x6627e8d5, 0xe169c58d, 0xbc57ac4c,
+                                           0x9b00dbd8};
+  EXPECT_EQ(zero.philox(0), expected);
+  RandomStream pi(0xa4093822, RandomStage(0x03707344), 0x299f31d0,
+                  0x13198a2e);
+  expected = {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1};
+  EXPECT_EQ(pi.philox(0x85a308d3243f6a88), expected);
+
+  RandomStream a(7, RandomStage::STEREO_RANSAC, 3, 5),
+      b(7, RandomStage::STEREO_RANSAC, 3, 5),
+      otherTask(7, RandomStage::STEREO_RANSAC, 3, 6);
+  int differ = 0;
+  for (int i = 0; i < 100; ++i) {
+    auto x = a();
+    EXPECT_EQ(x, b());
+    differ += x != otherTask();
+  }
+  EXPECT_GT(differ, 90);
+
+  for (int i = 0; i < 1000; ++i) {
+    int x = a.uniformInt(13);
+    EXPECT_GE(x, 0);
+    EXPECT_LT(x, 13);
+    double r = a.uniformReal();
+    EXPECT_GE(r, 0);
+    EXPECT_LT(r, 1);
+  }
+
+  std::vector<int> perm(100);
+  std::iota(perm.begin(), perm.end(), 0);
+  a.shuffle(perm.begin(), perm.end());
+  std::vector<int> sorted = perm;
+  std::sort(sorted.begin(), sorted.end());
+  for (int i = 0; i < 100; ++i)
+    EXPECT_EQ(sorted[i], i);
+
+  // the draws of the tasks do not depend on the threads they run on
+  constexpr int taskNum = 256;
+  std::vector<int> serial(taskNum), parallel(taskNum);
+  for (int task = 0; task < taskNum; ++task)
+    serial[task] =
+        RandomStream(42, RandomStage::PIXEL_SELECTOR, 1, task).uniformInt(1000);
+  tbb::parallel_for(0, taskNum, [&](int task) {
+    parallel[task] =
+        RandomStream(42, RandomStage::PIXEL_SELECTOR, 1, task).uniformInt(1000);
+  });
+  EXPECT_EQ(serial, parallel);
+}
+
+TEST(UtilTest, Log) {
+  std::vector<LogRecord> written;
+  Log::setSink([&](const LogRecord &record) { written.push_back(record); });
+  Log::setVerbosities("all=0,ba=1");
+  int evaluated = 0;
+  auto evaluate = [&]() { return ++evaluated; };
+
+  // the arguments of the messages that are not written are not evaluated
+  DSO_LOG(TRACKING, 1) << evaluate();
+  DSO_LOG(BA, 1) << "ba " << evaluate();
+  for (int i = 0; i < 10; ++i)
+    DSO_LOG_EVERY_SEC(BA, 0, 1e6) << "limited " << i;
+  Log::setVerbosities("all=100");
+  DSO_LOG(TRACKING, FISHDSO_MAX_LOG_LEVEL + 1) << evaluate();
+  Log::flush();
+  EXPECT_EQ(evaluated, 1);
+  ASSERT_EQ(written.size(), 2);
+  EXPECT_EQ(written[0].category, LogCategory::BA);
+  EXPECT_EQ(written[0].level, 1);
+  EXPECT_EQ(written[0].message, "ba 1");
+  EXPECT_EQ(written[1].message, "limited 0");
+
+  LogRateLimiter limiter(1e6);
+  EXPECT_TRUE(limiter.allow());
+  EXPECT_FALSE(limiter.allow());
+  EXPECT_FALSE(limiter.allow());
+  EXPECT_EQ(limiter.takeSuppressed(), 2);
+  EXPECT_EQ(limiter.takeSuppressed(), 0);
+  LogRateLimiter everyTime(0);
+  EXPECT_TRUE(everyTime.allow());
+  EXPECT_TRUE(everyTime.allow());
+
+  Log::setSink(nullptr);
+  Log::setVerbosities("all=0");
+}
+
+TEST(UtilTest, KeyFrameWindow) {
+  cv::Mat1b img(48, 64);
+  cv::randu(img, 0, 256);
+  Settings::KeyFrame kfSettings;
+  kfSettings.pointsNum = 10;
+  auto tracingSettings = std::make_shared<const PointTracerSettings>();
+  auto keyFrame = [&](int num) {
+    return KeyFrame(std::make_shared<PreKeyFrame>(
+                        nullptr, nullptr, SourceFrame{img, {}, num}),
+                    kfSettings, tracingSettings);
+  };
+  auto nums = [](const KeyFrameWindow &window) {
+    std::vector<int> result;
+    for (const auto &[num, kf] : window)
+      result.push_back(num);
+    return result;
+  };
+
+  KeyFrameWindow window(3);
+  KeyFrame *kf0 = &window.pushBack(keyFrame(0));
+  KeyFrame *kf1 = &window.pushBack(keyFrame(1));
+  KeyFrame *kf2 = &window.pushBack(keyFrame(2));
+  EXPECT_EQ(window.size(), 3);
+  EXPECT_EQ(nums(window), std::vector<int>({0, 1, 2}));
+
+  // a big point vector to be handed over
+  kf0->immaturePoints.reserve(1000);
+  const auto *immatureData = kf0->immaturePoints.data();
+
+  window.popFront();
+  EXPECT_FALSE(window.contains(kf0, 0));
+  EXPECT_TRUE(window.contains(kf1, 1));
+  EXPECT_EQ(window.frontNum(), 1);
+
+  // the slot of the marginalized keyframe is taken by the new one, the
+  // others stay where they were
+  KeyFrame *kf3 = &window.pushBack(keyFrame(3));
+  EXPECT_EQ(kf3, kf0);
+  EXPECT_FALSE(window.contains(kf0, 0));
+  EXPECT_TRUE(window.contains(kf3, 3));
+  EXPECT_EQ(&window[0].second, kf1);
+  EXPECT_EQ(&window[1].second, kf2);
+  EXPECT_EQ(&window.back(), kf3);
+  EXPECT_EQ(nums(window), std::vector<int>({1, 2, 3}));
+  EXPECT_EQ(kf3->immaturePoints.data(), immatureData);
+  EXPECT_GE(kf3->immaturePoints.capacity(), 1000);
+  EXPECT_TRUE(kf3->immaturePoints.empty());
+
+  // marginalized from the middle, the order is still by frame numbers
+  window.erase(1);
+  EXPECT_FALSE(window.contains(kf2, 2));
+  KeyFrame *kf4 = &window.pushBack(keyFrame(4));
+  EXPECT_EQ(kf4, kf2);
+  EXPECT_EQ(nums(window), std::vector<int>({1, 3, 4}));
+  EXPECT_EQ(window.frontNum(), 1);
+  EXPECT_TRUE(window.contains(kf4, 4));
+  EXPECT_FALSE(window.contains(kf4, 2));
+}
+
+TEST(UtilTest, DepthFilter) {
+  CameraModel cam(64, 48, 50.0, 32.0, 24.0);
+  cv::Mat1b img(48, 64);
+  cv::randu(img, 0, 256);
+  Settings::KeyFrame kfSettings;
+  kfSettings.pointsNum = 0;
+  KeyFrame keyFrame(std::make_shared<PreKeyFrame>(nullptr, &cam,
+                                                  SourceFrame{img, {}, 0}),
+                    kfSettings, std::make_shared<const PointTracerSettings>());
+  auto newPoint = [&]() {
+    return ImmaturePoint(&keyFrame, Vec2(32, 24),
+                         keyFrame.immaturePointBlock->add());
+  };
+  std::mt19937 mt(1);
+
+  // measurements around the same inverse depth make the filter converge
+  ImmaturePoint consistent = newPoint();
+  std::normal_distribution<double> noise(0, 0.01);
+  for (int i = 0; i < 200; ++i)
+    EXPECT_TRUE(consistent.updateDepthFilter(0.25 + noise(mt), 1e-4));
+  EXPECT_EQ(consistent.state, ImmaturePoint::ACTIVE);
+  EXPECT_TRUE(consistent.isFilterConverged());
+  EXPECT_NEAR(consistent.filterMean, 0.25, 3e-3);
+  EXPECT_GT(consistent.filterA / (consistent.filterA + consistent.filterB),
+            0.9);
+
+  // measurements that agree with none of the others drive the inlier ratio
+  // down until the point is an outlier
+  ImmaturePoint inconsistent = newPoint();
+  std::uniform_real_distribution<double> anywhere(0.05, 5);
+  bool isInlier = true;
+  for (int i = 0; i < 200 && isInlier; ++i)
+    isInlier = inconsistent.updateDepthFilter(anywhere(mt), 1e-6);
+  EXPECT_FALSE(isInlier);
+  EXPECT_EQ(inconsistent.state, ImmaturePoint::OUTLIER);
+}
+
+// The per-block sums of the tracking kernel, reduced on the host, match the
+// normal equations of all of the residuals at once. Needs no device.
+TEST(UtilTest, CudaBlockReduction) {
+  // the last block is only partly filled
+  const int pointNum = 3 * cuda::blockSize + 17;
+  const double outlierDiff = 12;
+  std::mt19937 mt(7);
+  std::normal_distribution<double> gauss(0, 1);
+  std::uniform_real_distribution<double> resDist(-30, 30);
+
+  std::vector<double> partials(
+      cuda::partialNum(pointNum) * cuda::linearizationSize, 0.0);
+  Mat88 expectedH = Mat88::Zero();
+  Vec8 expectedB = Vec8::Zero();
+  double expectedEnergy = 0;
+  for (int i = 0; i < pointNum; ++i) {
+    Vec8 jac = Vec8::NullaryExpr([&]() { return gauss(mt); });
+    double res = resDist(mt), weight = 0.5 + std::abs(gauss(mt));
+    cuda::accumulateResidual(
+        res, weight, jac.data(), outlierDiff,
+        &partials[i / cuda::blockSize * cuda::linearizationSize]);
+
+    double absRes = std::abs(res);
+    bool isInlier = absRes <= outlierDiff;
+    double w = weight * (isInlier ? 1 : outlierDiff / absRes);
+    expectedH += w * jac * jac.transpose();
+    expectedB += w * res * jac;
+    expectedEnergy += weight * (isInlier ? res * res
+                                         : outlierDiff *
+                                               (2 * absRes - outlierDiff));
+  }
+
+  Mat88 H;
+  Vec8 b;
+  double energy = cuda::reducePartials(partials, &H, &b);
+  EXPECT_LT((H - expectedH).norm(), 1e-9 * expectedH.norm());
+  EXPECT_LT((b - expectedB).norm(), 1e-9 * expectedB.norm());
+  EXPECT_NEAR(energy, expectedEnergy, 1e-9 * expectedEnergy);
+
+  // the blocks are added up in order, so the result is exactly the same
+  Mat88 againH;
+  Vec8 againB;
+  EXPECT_EQ(cuda::reducePartials(partials, &againH, &againB), energy);
+  EXPECT_EQ(againH, H);
+  EXPECT_EQ(againB, b);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   // ::testing::GTEST_FLAG(filter) = "UtilTest.PlyHolderTriv";